@@ -45,6 +45,24 @@ typedef struct {
     LIST_ENTRY list_entry;
 } metadata_reloc_ref;
 
+typedef struct {
+    LIST_ENTRY list;
+    metadata_reloc** index; // sorted by address
+    ULONG num_index;
+    ULONG max_index;
+} metadata_reloc_list;
+
+typedef struct {
+    metadata_reloc* mr;
+    metadata_reloc_ref* ref;
+} metadata_reloc_lookup;
+
+typedef struct {
+    metadata_reloc* parent;
+    uint64_t old_address;
+    uint64_t new_address;
+} metadata_reloc_update;
+
 typedef struct {
     uint64_t address;
     uint64_t size;
@@ -68,9 +86,104 @@ typedef struct {
     LIST_ENTRY list_entry;
 } data_reloc_ref;
 
+typedef struct {
+    uint8_t* data;
+    write_data_context wtc;
+    bool in_flight;
+} balance_write;
+
 #define BALANCE_UNIT 0x100000 // only read 1 MB at a time
+#define BALANCE_PIPELINE_DEPTH 4 // number of BALANCE_UNIT writes allowed in flight while relocating data
+
+#define BALANCE_DATA_BATCH_SIZE 0x2000000 // 32 MB
+#define BALANCE_DATA_BATCH_ITEMS 1024
+
+typedef struct {
+    balance_write writes[BALANCE_PIPELINE_DEPTH];
+    unsigned int next;
+} balance_pipeline;
+
+static void init_metadata_reloc_list(metadata_reloc_list* items) {
+    InitializeListHead(&items->list);
+    items->index = NULL;
+    items->num_index = 0;
+    items->max_index = 0;
+}
+
+static void free_metadata_reloc_list(metadata_reloc_list* items) {
+    while (!IsListEmpty(&items->list)) {
+        metadata_reloc* mr = CONTAINING_RECORD(RemoveHeadList(&items->list), metadata_reloc, list_entry);
+
+        while (!IsListEmpty(&mr->refs)) {
+            metadata_reloc_ref* ref = CONTAINING_RECORD(RemoveHeadList(&mr->refs), metadata_reloc_ref, list_entry);
+
+            ExFreePool(ref);
+        }
+
+        if (mr->data)
+            ExFreePool(mr->data);
+
+        ExFreePool(mr);
+    }
+
+    if (items->index)
+        ExFreePool(items->index);
+
+    items->index = NULL;
+    items->num_index = items->max_index = 0;
+}
+
+// returns the position of address in the index, or where it ought to be inserted
+static ULONG find_metadata_reloc_index(metadata_reloc_list* items, uint64_t address) {
+    ULONG lo = 0, hi = items->num_index;
 
-static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items, traverse_ptr* tp,
+    while (lo < hi) {
+        ULONG mid = lo + ((hi - lo) / 2);
+
+        if (items->index[mid]->address == address)
+            return mid;
+        else if (items->index[mid]->address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static NTSTATUS add_metadata_reloc_index(metadata_reloc_list* items, metadata_reloc* mr) {
+    ULONG pos;
+
+    if (items->num_index == items->max_index) {
+        ULONG new_max = items->max_index == 0 ? 256 : items->max_index * 2;
+        metadata_reloc** new_index = ExAllocatePoolWithTag(PagedPool, sizeof(metadata_reloc*) * new_max, ALLOC_TAG);
+
+        if (!new_index) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (items->index) {
+            RtlCopyMemory(new_index, items->index, sizeof(metadata_reloc*) * items->num_index);
+            ExFreePool(items->index);
+        }
+
+        items->index = new_index;
+        items->max_index = new_max;
+    }
+
+    pos = find_metadata_reloc_index(items, mr->address);
+
+    if (pos < items->num_index)
+        RtlMoveMemory(&items->index[pos + 1], &items->index[pos], sizeof(metadata_reloc*) * (items->num_index - pos));
+
+    items->index[pos] = mr;
+    items->num_index++;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, metadata_reloc_list* items, traverse_ptr* tp,
                                    bool skinny, metadata_reloc** mr2, chunk* c, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     metadata_reloc* mr;
@@ -88,6 +201,7 @@ static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_l
     mr->address = tp->item->key.obj_id;
     mr->data = NULL;
     mr->ei = (EXTENT_ITEM*)tp->item->data;
+    mr->new_address = 0;
     mr->system = false;
     InitializeListHead(&mr->refs);
 
@@ -215,7 +329,19 @@ static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_l
         }
     }
 
-    InsertTailList(items, &mr->list_entry);
+    Status = add_metadata_reloc_index(items, mr);
+    if (!NT_SUCCESS(Status)) {
+        while (!IsListEmpty(&mr->refs)) {
+            metadata_reloc_ref* ref = CONTAINING_RECORD(RemoveHeadList(&mr->refs), metadata_reloc_ref, list_entry);
+
+            ExFreePool(ref);
+        }
+
+        ExFreePool(mr);
+        return Status;
+    }
+
+    InsertTailList(&items->list, &mr->list_entry);
 
     if (mr2)
         *mr2 = mr;
@@ -223,24 +349,19 @@ static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_l
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS add_metadata_reloc_parent(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items,
+static NTSTATUS add_metadata_reloc_parent(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, metadata_reloc_list* items,
                                           uint64_t address, metadata_reloc** mr2, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le;
     KEY searchkey;
     traverse_ptr tp;
     bool skinny = false;
     NTSTATUS Status;
+    ULONG pos;
 
-    le = items->Flink;
-    while (le != items) {
-        metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
-
-        if (mr->address == address) {
-            *mr2 = mr;
-            return STATUS_SUCCESS;
-        }
+    pos = find_metadata_reloc_index(items, address);
 
-        le = le->Flink;
+    if (pos < items->num_index && items->index[pos]->address == address) {
+        *mr2 = items->index[pos];
+        return STATUS_SUCCESS;
     }
 
     searchkey.obj_id = address;
@@ -563,111 +684,290 @@ static NTSTATUS add_metadata_reloc_extent_item(_Requires_exclusive_lock_held_(_C
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items,
-                                     LIST_ENTRY* data_items, chunk* c, LIST_ENTRY* rollback) {
-    LIST_ENTRY tree_writes, *le;
+static int compare_metadata_reloc_lookups(metadata_reloc_lookup* a, metadata_reloc_lookup* b) {
+    KEY key1 = *(KEY*)&a->mr->data[1];
+    KEY key2 = *(KEY*)&b->mr->data[1];
+
+    if (a->ref->tbr.offset != b->ref->tbr.offset)
+        return a->ref->tbr.offset < b->ref->tbr.offset ? -1 : 1;
+
+    if (a->mr->data->level != b->mr->data->level)
+        return a->mr->data->level < b->mr->data->level ? -1 : 1;
+
+    return keycmp(key1, key2);
+}
+
+static void sort_metadata_reloc_lookups(metadata_reloc_lookup* lookups, metadata_reloc_lookup* scratch, ULONG num) {
+    ULONG half, i, j, k;
+
+    // merge sort - there can be tens of thousands of these on a volume with a lot of snapshots
+
+    if (num < 2)
+        return;
+
+    half = num / 2;
+
+    sort_metadata_reloc_lookups(lookups, scratch, half);
+    sort_metadata_reloc_lookups(&lookups[half], scratch, num - half);
+
+    RtlCopyMemory(scratch, lookups, sizeof(metadata_reloc_lookup) * half);
+
+    i = 0;
+    j = half;
+    k = 0;
+
+    while (i < half && j < num) {
+        if (compare_metadata_reloc_lookups(&lookups[j], &scratch[i]) < 0) {
+            lookups[k] = lookups[j];
+            j++;
+        } else {
+            lookups[k] = scratch[i];
+            i++;
+        }
+
+        k++;
+    }
+
+    while (i < half) {
+        lookups[k] = scratch[i];
+        i++;
+        k++;
+    }
+}
+
+static bool tree_covers_key(tree* t, KEY* key) {
+    tree_data* first = NULL;
+    tree_data* last = NULL;
+    LIST_ENTRY* le;
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+
+        if (!td->ignore) {
+            first = td;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    le = t->itemlist.Blink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+
+        if (!td->ignore) {
+            last = td;
+            break;
+        }
+
+        le = le->Blink;
+    }
+
+    if (!first || !last)
+        return false;
+
+    // if the key lies between our first and last items, a search for it would have to go through us
+    return keycmp((*key), first->key) >= 0 && keycmp((*key), last->key) <= 0;
+}
+
+static NTSTATUS resolve_tree_block_refs(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, metadata_reloc_list* items,
+                                        metadata_reloc_lookup* lookups, ULONG num_lookups, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    traverse_ptr tp;
-    uint8_t level, max_level = 0;
-    chunk* newchunk = NULL;
+    metadata_reloc_lookup* scratch;
+    root* r = NULL;
+    tree* last_tree = NULL;
+    ULONG i;
 
-    InitializeListHead(&tree_writes);
+    scratch = ExAllocatePoolWithTag(PagedPool, sizeof(metadata_reloc_lookup) * ((num_lookups / 2) + 1), ALLOC_TAG);
+    if (!scratch) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    le = items->Flink;
-    while (le != items) {
-        metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
-        LIST_ENTRY* le2;
-        chunk* pc;
+    // Sort by tree, level, and key, so that we walk each tree in order and neighbouring
+    // blocks can reuse the parent we've just found rather than doing a full search.
 
-        mr->data = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-        if (!mr->data) {
-            ERR("out of memory\n");
-            return STATUS_INSUFFICIENT_RESOURCES;
+    sort_metadata_reloc_lookups(lookups, scratch, num_lookups);
+
+    ExFreePool(scratch);
+
+    for (i = 0; i < num_lookups; i++) {
+        metadata_reloc* mr = lookups[i].mr;
+        metadata_reloc_ref* ref = lookups[i].ref;
+        KEY* firstitem = (KEY*)&mr->data[1];
+        uint8_t level = mr->data->level + 1;
+        tree* t;
+
+        if (!r || r->id != ref->tbr.offset) {
+            last_tree = NULL;
+
+            Status = find_root(Vcb, ref->tbr.offset, &r, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("could not find subvol with id %I64x\n", ref->tbr.offset);
+                return STATUS_INTERNAL_ERROR;
+            }
         }
 
-        Status = read_data(Vcb, mr->address, Vcb->superblock.node_size, NULL, true, (uint8_t*)mr->data,
-                           c && mr->address >= c->offset && mr->address < c->offset + c->chunk_item->size ? c : NULL, &pc, NULL, 0, false, NormalPagePriority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("read_data returned %08lx\n", Status);
-            return Status;
+        if (last_tree && last_tree->header.level == level && tree_covers_key(last_tree, firstitem))
+            t = last_tree;
+        else {
+            traverse_ptr tp;
+
+            Status = find_item_to_level(Vcb, r, &tp, firstitem, false, level, NULL);
+            if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
+                ERR("find_item_to_level returned %08lx\n", Status);
+                return Status;
+            }
+
+            t = tp.tree;
+            while (t && t->header.level < level) {
+                t = t->parent;
+            }
+
+            last_tree = t;
         }
 
-        if (pc->chunk_item->type & BLOCK_FLAG_SYSTEM)
-            mr->system = true;
+        if (!t)
+            ref->top = true;
+        else {
+            metadata_reloc* mr2;
+
+            Status = add_metadata_reloc_parent(Vcb, items, t->header.address, &mr2, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_metadata_reloc_parent returned %08lx\n", Status);
+                return Status;
+            }
+
+            ref->parent = mr2;
+        }
+    }
 
-        if (data_items && mr->data->level == 0) {
-            le2 = data_items->Flink;
-            while (le2 != data_items) {
-                data_reloc* dr = CONTAINING_RECORD(le2, data_reloc, list_entry);
-                leaf_node* ln = (leaf_node*)&mr->data[1];
-                uint16_t i;
+    return STATUS_SUCCESS;
+}
 
-                for (i = 0; i < mr->data->num_items; i++) {
-                    if (ln[i].key.obj_type == TYPE_EXTENT_DATA && ln[i].size >= sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
-                        EXTENT_DATA* ed = (EXTENT_DATA*)((uint8_t*)mr->data + sizeof(tree_header) + ln[i].offset);
+static void update_metadata_reloc_children(metadata_reloc_list* items, metadata_reloc* mr) {
+    uint16_t i;
+    internal_node* in = (internal_node*)&mr->data[1];
 
-                        if (ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) {
-                            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+    // All the blocks on the level below have been given their new addresses by now, so we can
+    // fix up all of our pointers in one pass, rather than searching for each child in turn.
 
-                            if (ed2->address == dr->address)
-                                ed2->address = dr->new_address;
-                        }
-                    }
-                }
+    for (i = 0; i < mr->data->num_items; i++) {
+        ULONG pos = find_metadata_reloc_index(items, in[i].address);
 
-                le2 = le2->Flink;
+        if (pos < items->num_index && items->index[pos]->address == in[i].address && items->index[pos]->new_address != 0)
+            in[i].address = items->index[pos]->new_address;
+    }
+
+    if (mr->t) {
+        LIST_ENTRY* le;
+
+        le = mr->t->itemlist.Flink;
+        while (le != &mr->t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+
+            if (!td->inserted) {
+                ULONG pos = find_metadata_reloc_index(items, td->treeholder.address);
+
+                if (pos < items->num_index && items->index[pos]->address == td->treeholder.address && items->index[pos]->new_address != 0)
+                    td->treeholder.address = items->index[pos]->new_address;
             }
+
+            le = le->Flink;
         }
+    }
+}
 
-        if (mr->data->level > max_level)
-            max_level = mr->data->level;
+static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, metadata_reloc_list* items,
+                                     LIST_ENTRY* data_items, chunk* c, LIST_ENTRY* rollback) {
+    LIST_ENTRY tree_writes, *le, *start;
+    NTSTATUS Status;
+    traverse_ptr tp;
+    uint8_t level, max_level = 0;
+    chunk* newchunk = NULL;
+#ifdef DEBUG_BALANCE_TIMES
+    LARGE_INTEGER freq, time1, time2;
+    uint64_t resolve_time, alloc_time, write_time, extent_time;
+#endif
+
+    InitializeListHead(&tree_writes);
 
-        le2 = mr->refs.Flink;
-        while (le2 != &mr->refs) {
-            metadata_reloc_ref* ref = CONTAINING_RECORD(le2, metadata_reloc_ref, list_entry);
+#ifdef DEBUG_BALANCE_TIMES
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
 
-            if (ref->type == TYPE_TREE_BLOCK_REF) {
-                KEY* firstitem;
-                root* r = NULL;
-                LIST_ENTRY* le3;
-                tree* t;
+    // Resolve the backrefs a batch at a time - resolving them can add more parents onto the end of
+    // the list, which then become the next batch.
 
-                firstitem = (KEY*)&mr->data[1];
+    start = items->list.Flink;
+    while (start != &items->list) {
+        LIST_ENTRY* last = items->list.Blink;
+        metadata_reloc_lookup* lookups;
+        ULONG num_lookups = 0;
+        bool done = false;
 
-                le3 = Vcb->roots.Flink;
-                while (le3 != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le3, root, list_entry);
+        le = start;
+        while (!done) {
+            metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
+            LIST_ENTRY* le2;
+            chunk* pc;
 
-                    if (r2->id == ref->tbr.offset) {
-                        r = r2;
-                        break;
-                    }
+            done = le == last;
 
-                    le3 = le3->Flink;
-                }
+            mr->data = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+            if (!mr->data) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
 
-                if (!r) {
-                    ERR("could not find subvol with id %I64x\n", ref->tbr.offset);
-                    return STATUS_INTERNAL_ERROR;
-                }
+            Status = read_data(Vcb, mr->address, Vcb->superblock.node_size, NULL, true, (uint8_t*)mr->data,
+                               c && mr->address >= c->offset && mr->address < c->offset + c->chunk_item->size ? c : NULL, &pc, NULL, 0, false, NormalPagePriority);
+            if (!NT_SUCCESS(Status)) {
+                ERR("read_data returned %08lx\n", Status);
+                return Status;
+            }
 
-                Status = find_item_to_level(Vcb, r, &tp, firstitem, false, mr->data->level + 1, NULL);
-                if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
-                    ERR("find_item_to_level returned %08lx\n", Status);
-                    return Status;
-                }
+            if (pc->chunk_item->type & BLOCK_FLAG_SYSTEM)
+                mr->system = true;
+
+            if (data_items && mr->data->level == 0) {
+                le2 = data_items->Flink;
+                while (le2 != data_items) {
+                    data_reloc* dr = CONTAINING_RECORD(le2, data_reloc, list_entry);
+                    leaf_node* ln = (leaf_node*)&mr->data[1];
+                    uint16_t i;
 
-                t = tp.tree;
-                while (t && t->header.level < mr->data->level + 1) {
-                    t = t->parent;
+                    for (i = 0; i < mr->data->num_items; i++) {
+                        if (ln[i].key.obj_type == TYPE_EXTENT_DATA && ln[i].size >= sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
+                            EXTENT_DATA* ed = (EXTENT_DATA*)((uint8_t*)mr->data + sizeof(tree_header) + ln[i].offset);
+
+                            if (ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) {
+                                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+                                if (ed2->address == dr->address)
+                                    ed2->address = dr->new_address;
+                            }
+                        }
+                    }
+
+                    le2 = le2->Flink;
                 }
+            }
 
-                if (!t)
-                    ref->top = true;
-                else {
+            if (mr->data->level > max_level)
+                max_level = mr->data->level;
+
+            le2 = mr->refs.Flink;
+            while (le2 != &mr->refs) {
+                metadata_reloc_ref* ref = CONTAINING_RECORD(le2, metadata_reloc_ref, list_entry);
+
+                if (ref->type == TYPE_TREE_BLOCK_REF)
+                    num_lookups++;
+                else if (ref->type == TYPE_SHARED_BLOCK_REF) {
                     metadata_reloc* mr2;
 
-                    Status = add_metadata_reloc_parent(Vcb, items, t->header.address, &mr2, rollback);
+                    Status = add_metadata_reloc_parent(Vcb, items, ref->sbr.offset, &mr2, rollback);
                     if (!NT_SUCCESS(Status)) {
                         ERR("add_metadata_reloc_parent returned %08lx\n", Status);
                         return Status;
@@ -675,26 +975,67 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
 
                     ref->parent = mr2;
                 }
-            } else if (ref->type == TYPE_SHARED_BLOCK_REF) {
-                metadata_reloc* mr2;
 
-                Status = add_metadata_reloc_parent(Vcb, items, ref->sbr.offset, &mr2, rollback);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("add_metadata_reloc_parent returned %08lx\n", Status);
-                    return Status;
+                le2 = le2->Flink;
+            }
+
+            le = le->Flink;
+        }
+
+        if (num_lookups > 0) {
+            ULONG n = 0;
+
+            lookups = ExAllocatePoolWithTag(PagedPool, sizeof(metadata_reloc_lookup) * num_lookups, ALLOC_TAG);
+            if (!lookups) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            le = start;
+            done = false;
+            while (!done) {
+                metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
+                LIST_ENTRY* le2;
+
+                done = le == last;
+
+                le2 = mr->refs.Flink;
+                while (le2 != &mr->refs) {
+                    metadata_reloc_ref* ref = CONTAINING_RECORD(le2, metadata_reloc_ref, list_entry);
+
+                    if (ref->type == TYPE_TREE_BLOCK_REF) {
+                        lookups[n].mr = mr;
+                        lookups[n].ref = ref;
+                        n++;
+                    }
+
+                    le2 = le2->Flink;
                 }
 
-                ref->parent = mr2;
+                le = le->Flink;
             }
 
-            le2 = le2->Flink;
+            Status = resolve_tree_block_refs(Vcb, items, lookups, num_lookups, rollback);
+
+            ExFreePool(lookups);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("resolve_tree_block_refs returned %08lx\n", Status);
+                return Status;
+            }
         }
 
-        le = le->Flink;
+        start = last->Flink;
     }
 
-    le = items->Flink;
-    while (le != items) {
+#ifdef DEBUG_BALANCE_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+    resolve_time = time2.QuadPart - time1.QuadPart;
+    time1 = time2;
+#endif
+
+    le = items->list.Flink;
+    while (le != &items->list) {
         metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
         LIST_ENTRY* le2;
         uint32_t hash;
@@ -723,8 +1064,8 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
     }
 
     for (level = 0; level <= max_level; level++) {
-        le = items->Flink;
-        while (le != items) {
+        le = items->list.Flink;
+        while (le != &items->list) {
             metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
 
             if (mr->data->level == level) {
@@ -734,6 +1075,9 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
                 uint64_t flags;
                 tree* t3;
 
+                if (level > 0)
+                    update_metadata_reloc_children(items, mr);
+
                 if (mr->system)
                     flags = Vcb->system_flags;
                 else if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS)
@@ -811,54 +1155,17 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
                     ExReleaseResourceLite(&Vcb->chunk_lock);
                 }
 
-                // update parents
+                // parents get updated when we get to them, in update_metadata_reloc_children
                 le2 = mr->refs.Flink;
                 while (le2 != &mr->refs) {
                     metadata_reloc_ref* ref = CONTAINING_RECORD(le2, metadata_reloc_ref, list_entry);
 
-                    if (ref->parent) {
-                        uint16_t i;
-                        internal_node* in = (internal_node*)&ref->parent->data[1];
-
-                        for (i = 0; i < ref->parent->data->num_items; i++) {
-                            if (in[i].address == mr->address) {
-                                in[i].address = mr->new_address;
-                                break;
-                            }
-                        }
-
-                        if (ref->parent->t) {
-                            LIST_ENTRY* le3;
-
-                            le3 = ref->parent->t->itemlist.Flink;
-                            while (le3 != &ref->parent->t->itemlist) {
-                                tree_data* td = CONTAINING_RECORD(le3, tree_data, list_entry);
-
-                                if (!td->inserted && td->treeholder.address == mr->address)
-                                    td->treeholder.address = mr->new_address;
-
-                                le3 = le3->Flink;
-                            }
-                        }
-                    } else if (ref->top && ref->type == TYPE_TREE_BLOCK_REF) {
-                        LIST_ENTRY* le3;
-                        root* r = NULL;
+                    if (!ref->parent && ref->top && ref->type == TYPE_TREE_BLOCK_REF) {
+                        root* r;
 
                         // alter ROOT_ITEM
 
-                        le3 = Vcb->roots.Flink;
-                        while (le3 != &Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le3, root, list_entry);
-
-                            if (r2->id == ref->tbr.offset) {
-                                r = r2;
-                                break;
-                            }
-
-                            le3 = le3->Flink;
-                        }
-
-                        if (r) {
+                        if (NT_SUCCESS(find_root(Vcb, ref->tbr.offset, &r, NULL))) {
                             r->treeholder.address = mr->new_address;
 
                             if (r == Vcb->root_root)
@@ -1041,21 +1348,22 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
                 else {
                     bool inserted = false;
 
-                    le2 = tree_writes.Flink;
+                    // search backwards, as new addresses are usually handed out in ascending order
+                    le2 = tree_writes.Blink;
                     while (le2 != &tree_writes) {
                         tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
 
-                        if (tw2->address > tw->address) {
-                            InsertHeadList(le2->Blink, &tw->list_entry);
+                        if (tw2->address < tw->address) {
+                            InsertHeadList(le2, &tw->list_entry);
                             inserted = true;
                             break;
                         }
 
-                        le2 = le2->Flink;
+                        le2 = le2->Blink;
                     }
 
                     if (!inserted)
-                        InsertTailList(&tree_writes, &tw->list_entry);
+                        InsertHeadList(&tree_writes, &tw->list_entry);
                 }
             }
 
@@ -1063,14 +1371,26 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
         }
     }
 
+#ifdef DEBUG_BALANCE_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+    alloc_time = time2.QuadPart - time1.QuadPart;
+    time1 = time2;
+#endif
+
     Status = do_tree_writes(Vcb, &tree_writes, true);
     if (!NT_SUCCESS(Status)) {
         ERR("do_tree_writes returned %08lx\n", Status);
         goto end;
     }
 
-    le = items->Flink;
-    while (le != items) {
+#ifdef DEBUG_BALANCE_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+    write_time = time2.QuadPart - time1.QuadPart;
+    time1 = time2;
+#endif
+
+    le = items->list.Flink;
+    while (le != &items->list) {
         metadata_reloc* mr = CONTAINING_RECORD(le, metadata_reloc, list_entry);
 
         Status = add_metadata_reloc_extent_item(Vcb, mr);
@@ -1082,6 +1402,14 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
         le = le->Flink;
     }
 
+#ifdef DEBUG_BALANCE_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+    extent_time = time2.QuadPart - time1.QuadPart;
+
+    ERR("relocated %lu tree blocks: resolve %I64u, alloc %I64u, write %I64u, extents %I64u (freq = %I64u)\n", items->num_index,
+        resolve_time, alloc_time, write_time, extent_time, freq.QuadPart);
+#endif
+
     Status = STATUS_SUCCESS;
 
 end:
@@ -1102,16 +1430,24 @@ static NTSTATUS balance_metadata_chunk(device_extension* Vcb, chunk* c, bool* ch
     traverse_ptr tp;
     NTSTATUS Status;
     bool b;
-    LIST_ENTRY items, rollback;
+    LIST_ENTRY rollback;
+    metadata_reloc_list items;
     uint32_t loaded = 0;
+#ifdef DEBUG_BALANCE_TIMES
+    LARGE_INTEGER freq, time1, time2;
+#endif
 
     TRACE("chunk %I64x\n", c->offset);
 
     InitializeListHead(&rollback);
-    InitializeListHead(&items);
+    init_metadata_reloc_list(&items);
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
 
+#ifdef DEBUG_BALANCE_TIMES
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
+
     searchkey.obj_id = c->offset;
     searchkey.obj_type = TYPE_METADATA_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1163,13 +1499,19 @@ static NTSTATUS balance_metadata_chunk(device_extension* Vcb, chunk* c, bool* ch
             tp = next_tp;
     } while (b);
 
-    if (IsListEmpty(&items)) {
+    if (IsListEmpty(&items.list)) {
         *changed = false;
         Status = STATUS_SUCCESS;
         goto end;
     } else
         *changed = true;
 
+#ifdef DEBUG_BALANCE_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+
+    ERR("found %lu tree blocks in chunk %I64x in %I64u (freq = %I64u)\n", loaded, c->offset, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
+
     Status = write_metadata_items(Vcb, &items, NULL, c, &rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("write_metadata_items returned %08lx\n", Status);
@@ -1182,9 +1524,19 @@ static NTSTATUS balance_metadata_chunk(device_extension* Vcb, chunk* c, bool* ch
 
 end:
     if (NT_SUCCESS(Status)) {
+#ifdef DEBUG_BALANCE_TIMES
+        time1 = KeQueryPerformanceCounter(&freq);
+#endif
+
         Status = do_write(Vcb, NULL);
         if (!NT_SUCCESS(Status))
             ERR("do_write returned %08lx\n", Status);
+
+#ifdef DEBUG_BALANCE_TIMES
+        time2 = KeQueryPerformanceCounter(NULL);
+
+        ERR("committed chunk %I64x in %I64u (freq = %I64u)\n", c->offset, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
     }
 
     if (NT_SUCCESS(Status))
@@ -1196,48 +1548,23 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
-    while (!IsListEmpty(&items)) {
-        metadata_reloc* mr = CONTAINING_RECORD(RemoveHeadList(&items), metadata_reloc, list_entry);
-
-        while (!IsListEmpty(&mr->refs)) {
-            metadata_reloc_ref* ref = CONTAINING_RECORD(RemoveHeadList(&mr->refs), metadata_reloc_ref, list_entry);
-
-            ExFreePool(ref);
-        }
-
-        if (mr->data)
-            ExFreePool(mr->data);
-
-        ExFreePool(mr);
-    }
+    free_metadata_reloc_list(&items);
 
     return Status;
 }
 
-static NTSTATUS data_reloc_add_tree_edr(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* metadata_items,
+static NTSTATUS data_reloc_add_tree_edr(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, metadata_reloc_list* metadata_items,
                                         data_reloc* dr, EXTENT_DATA_REF* edr, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    LIST_ENTRY* le;
     KEY searchkey;
     traverse_ptr tp;
-    root* r = NULL;
+    root* r;
     metadata_reloc* mr;
     uint64_t last_tree = 0;
     data_reloc_ref* ref;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == edr->root) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
-
-    if (!r) {
+    Status = find_root(Vcb, edr->root, &r, NULL);
+    if (!NT_SUCCESS(Status)) {
         ERR("could not find subvol %I64x\n", edr->root);
         return STATUS_INTERNAL_ERROR;
     }
@@ -1313,7 +1640,7 @@ static NTSTATUS data_reloc_add_tree_edr(_Requires_lock_held_(_Curr_->tree_lock)
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS add_data_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items, LIST_ENTRY* metadata_items,
+static NTSTATUS add_data_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items, metadata_reloc_list* metadata_items,
                                traverse_ptr* tp, chunk* c, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     data_reloc* dr;
@@ -1352,6 +1679,8 @@ static NTSTATUS add_data_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock)
         release_chunk_lock(c, Vcb);
     }
 
+    extent_cache_invalidate(&Vcb->extent_cache, tp->item->key.obj_id);
+
     ei = (EXTENT_ITEM*)tp->item->data;
     inline_rc = 0;
 
@@ -1668,357 +1997,548 @@ static NTSTATUS add_data_reloc_extent_item(_Requires_exclusive_lock_held_(_Curr_
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, bool* changed) {
-    KEY searchkey;
-    traverse_ptr tp;
+static NTSTATUS data_reloc_alloc(device_extension* Vcb, data_reloc* dr, chunk** pnewchunk, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    bool b;
-    LIST_ENTRY items, metadata_items, rollback, *le;
-    uint64_t loaded = 0, num_loaded = 0;
-    chunk* newchunk = NULL;
-    uint8_t* data = NULL;
+    chunk* newchunk = *pnewchunk;
+    LIST_ENTRY* le;
 
-    TRACE("chunk %I64x\n", c->offset);
+    if (newchunk) {
+        bool done = false;
 
-    InitializeListHead(&rollback);
-    InitializeListHead(&items);
-    InitializeListHead(&metadata_items);
+        acquire_chunk_lock(newchunk, Vcb);
 
-    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+        if (find_data_address_in_chunk(Vcb, newchunk, dr->size, &dr->new_address)) {
+            newchunk->used += dr->size;
+            space_list_subtract(newchunk, dr->new_address, dr->size, rollback);
+            done = true;
+        }
 
-    searchkey.obj_id = c->offset;
-    searchkey.obj_type = TYPE_EXTENT_ITEM;
-    searchkey.offset = 0xffffffffffffffff;
+        release_chunk_lock(newchunk, Vcb);
+
+        if (done) {
+            dr->newchunk = newchunk;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (!c2->readonly && !c2->reloc && c2 != newchunk && c2->chunk_item->type == Vcb->data_flags) {
+            acquire_chunk_lock(c2, Vcb);
+
+            if ((c2->chunk_item->size - c2->used) >= dr->size) {
+                if (find_data_address_in_chunk(Vcb, c2, dr->size, &dr->new_address)) {
+                    c2->used += dr->size;
+                    space_list_subtract(c2, dr->new_address, dr->size, rollback);
+                    release_chunk_lock(c2, Vcb);
+                    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                    dr->newchunk = *pnewchunk = c2;
+
+                    return STATUS_SUCCESS;
+                }
+            }
+
+            release_chunk_lock(c2, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    // allocate new chunk if necessary
+
+    Status = alloc_chunk(Vcb, Vcb->data_flags, &newchunk, false);
 
-    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, false, NULL);
     if (!NT_SUCCESS(Status)) {
-        ERR("find_item returned %08lx\n", Status);
-        goto end;
+        ERR("alloc_chunk returned %08lx\n", Status);
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        return Status;
     }
 
-    do {
-        traverse_ptr next_tp;
+    acquire_chunk_lock(newchunk, Vcb);
 
-        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+    newchunk->balance_num = Vcb->balance.balance_num;
+
+    if (!find_data_address_in_chunk(Vcb, newchunk, dr->size, &dr->new_address)) {
+        release_chunk_lock(newchunk, Vcb);
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        ERR("could not find address in new chunk\n");
+        return STATUS_DISK_FULL;
+    }
+
+    newchunk->used += dr->size;
+    space_list_subtract(newchunk, dr->new_address, dr->size, rollback);
+
+    release_chunk_lock(newchunk, Vcb);
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    dr->newchunk = *pnewchunk = newchunk;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS balance_write_wait(device_extension* Vcb, balance_write* bw) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+
+    if (!bw->in_flight)
+        return STATUS_SUCCESS;
+
+    if (bw->wtc.need_wait)
+        KeWaitForSingleObject(&bw->wtc.Event, Executive, KernelMode, false, NULL);
+
+    le = bw->wtc.stripes.Flink;
+    while (le != &bw->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            Status = stripe->iosb.Status;
+            log_device_error(Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
             break;
+        }
 
-        if (tp.item->key.obj_id >= c->offset && tp.item->key.obj_type == TYPE_EXTENT_ITEM) {
-            bool tree = false;
+        le = le->Flink;
+    }
 
-            if (tp.item->key.obj_type == TYPE_EXTENT_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
-                EXTENT_ITEM* ei = (EXTENT_ITEM*)tp.item->data;
+    free_write_data_stripes(&bw->wtc);
 
-                if (ei->flags & EXTENT_ITEM_TREE_BLOCK)
-                    tree = true;
-            }
+    bw->in_flight = false;
 
-            if (!tree) {
-                Status = add_data_reloc(Vcb, &items, &metadata_items, &tp, c, &rollback);
+    return Status;
+}
 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("add_data_reloc returned %08lx\n", Status);
-                    goto end;
-                }
+static NTSTATUS balance_pipeline_flush(device_extension* Vcb, balance_pipeline* bp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    unsigned int i;
 
-                loaded += tp.item->key.offset;
-                num_loaded++;
+    for (i = 0; i < BALANCE_PIPELINE_DEPTH; i++) {
+        NTSTATUS Status2 = balance_write_wait(Vcb, &bp->writes[i]);
 
-                if (loaded >= 0x1000000 || num_loaded >= 100) // only do so much at a time, so we don't block too obnoxiously
-                    break;
-            }
+        if (!NT_SUCCESS(Status2)) {
+            ERR("balance_write_wait returned %08lx\n", Status2);
+
+            if (NT_SUCCESS(Status))
+                Status = Status2;
         }
+    }
 
-        b = find_next_item(Vcb, &tp, &next_tp, false, NULL);
+    return Status;
+}
 
-        if (b)
-            tp = next_tp;
-    } while (b);
+static void free_balance_pipeline(device_extension* Vcb, balance_pipeline* bp) {
+    unsigned int i;
 
-    if (IsListEmpty(&items)) {
-        *changed = false;
-        Status = STATUS_SUCCESS;
-        goto end;
-    } else
-        *changed = true;
+    // make sure nothing is still writing from our buffers
+    balance_pipeline_flush(Vcb, bp);
 
-    data = ExAllocatePoolWithTag(PagedPool, BALANCE_UNIT, ALLOC_TAG);
-    if (!data) {
+    for (i = 0; i < BALANCE_PIPELINE_DEPTH; i++) {
+        if (bp->writes[i].data)
+            ExFreePool(bp->writes[i].data);
+    }
+
+    ExFreePool(bp);
+}
+
+static NTSTATUS init_balance_pipeline(balance_pipeline** pbp) {
+    balance_pipeline* bp;
+    unsigned int i;
+
+    // needs to be non-paged, as it contains the events we wait on
+    bp = ExAllocatePoolWithTag(NonPagedPool, sizeof(balance_pipeline), ALLOC_TAG);
+    if (!bp) {
         ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto end;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    le = items.Flink;
-    while (le != &items) {
-        data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
-        bool done = false;
-        LIST_ENTRY* le2;
-        void* csum;
-        RTL_BITMAP bmp;
-        ULONG* bmparr;
-        ULONG bmplen, runlength, index, lastoff;
+    RtlZeroMemory(bp, sizeof(balance_pipeline));
 
-        if (newchunk) {
-            acquire_chunk_lock(newchunk, Vcb);
+    for (i = 0; i < BALANCE_PIPELINE_DEPTH; i++) {
+        bp->writes[i].data = ExAllocatePoolWithTag(PagedPool, BALANCE_UNIT, ALLOC_TAG);
+        if (!bp->writes[i].data) {
+            ERR("out of memory\n");
 
-            if (find_data_address_in_chunk(Vcb, newchunk, dr->size, &dr->new_address)) {
-                newchunk->used += dr->size;
-                space_list_subtract(newchunk, dr->new_address, dr->size, &rollback);
-                done = true;
+            while (i > 0) {
+                i--;
+                ExFreePool(bp->writes[i].data);
             }
 
-            release_chunk_lock(newchunk, Vcb);
+            ExFreePool(bp);
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
+    }
 
-        if (!done) {
-            ExAcquireResourceExclusiveLite(&Vcb->chunk_lock, true);
+    *pbp = bp;
 
-            le2 = Vcb->chunks.Flink;
-            while (le2 != &Vcb->chunks) {
-                chunk* c2 = CONTAINING_RECORD(le2, chunk, list_entry);
+    return STATUS_SUCCESS;
+}
 
-                if (!c2->readonly && !c2->reloc && c2 != newchunk && c2->chunk_item->type == Vcb->data_flags) {
-                    acquire_chunk_lock(c2, Vcb);
+// Copies length sectors from src to dst. Each BALANCE_UNIT is read synchronously into the
+// next free buffer, and its write is launched without waiting for it to complete, so that
+// reads overlap with the writes of the previous BALANCE_PIPELINE_DEPTH - 1 units.
+static NTSTATUS balance_pipeline_copy(device_extension* Vcb, balance_pipeline* bp, chunk* c, uint64_t src, chunk* newchunk,
+                                      uint64_t dst, ULONG length, void* csum) {
+    NTSTATUS Status;
+    bool parity = newchunk->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6);
 
-                    if ((c2->chunk_item->size - c2->used) >= dr->size) {
-                        if (find_data_address_in_chunk(Vcb, c2, dr->size, &dr->new_address)) {
-                            c2->used += dr->size;
-                            space_list_subtract(c2, dr->new_address, dr->size, &rollback);
-                            release_chunk_lock(c2, Vcb);
-                            newchunk = c2;
-                            done = true;
-                            break;
-                        }
-                    }
+    while (length > 0) {
+        balance_write* bw = &bp->writes[bp->next];
+        ULONG rl;
+        LIST_ENTRY* le;
 
-                    release_chunk_lock(c2, Vcb);
-                }
+        if (length << Vcb->sector_shift > BALANCE_UNIT)
+            rl = BALANCE_UNIT >> Vcb->sector_shift;
+        else
+            rl = length;
 
-                le2 = le2->Flink;
-            }
+        Status = balance_write_wait(Vcb, bw);
+        if (!NT_SUCCESS(Status)) {
+            ERR("balance_write_wait returned %08lx\n", Status);
+            return Status;
+        }
+
+        Status = read_data(Vcb, src, rl << Vcb->sector_shift, csum, false, bw->data, c, NULL, NULL, 0, false, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_data returned %08lx\n", Status);
+            return Status;
+        }
 
-            // allocate new chunk if necessary
-            if (!done) {
-                Status = alloc_chunk(Vcb, Vcb->data_flags, &newchunk, false);
+        if (parity) {
+            // Parity writes need the stripe range lock and can't overlap each other, so do these synchronously.
 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("alloc_chunk returned %08lx\n", Status);
-                    ExReleaseResourceLite(&Vcb->chunk_lock);
-                    goto end;
-                }
+            Status = balance_pipeline_flush(Vcb, bp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("balance_pipeline_flush returned %08lx\n", Status);
+                return Status;
+            }
+
+            Status = write_data_complete(Vcb, dst, bw->data, rl << Vcb->sector_shift, NULL, newchunk, false, 0, NormalPagePriority);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_data_complete returned %08lx\n", Status);
+                return Status;
+            }
+        } else {
+            KeInitializeEvent(&bw->wtc.Event, NotificationEvent, false);
+            InitializeListHead(&bw->wtc.stripes);
+            bw->wtc.need_wait = false;
+            bw->wtc.stripes_left = 0;
+            bw->wtc.parity1 = bw->wtc.parity2 = bw->wtc.scratch = NULL;
+            bw->wtc.mdl = bw->wtc.parity1_mdl = bw->wtc.parity2_mdl = NULL;
+
+            Status = write_data(Vcb, dst, bw->data, rl << Vcb->sector_shift, &bw->wtc, NULL, newchunk, false, 0, NormalPagePriority);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_data returned %08lx\n", Status);
+                free_write_data_stripes(&bw->wtc);
+                return Status;
+            }
 
-                acquire_chunk_lock(newchunk, Vcb);
+            // launch writes, but don't wait for them
 
-                newchunk->balance_num = Vcb->balance.balance_num;
+            le = bw->wtc.stripes.Flink;
+            while (le != &bw->wtc.stripes) {
+                write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
 
-                if (!find_data_address_in_chunk(Vcb, newchunk, dr->size, &dr->new_address)) {
-                    release_chunk_lock(newchunk, Vcb);
-                    ExReleaseResourceLite(&Vcb->chunk_lock);
-                    ERR("could not find address in new chunk\n");
-                    Status = STATUS_DISK_FULL;
-                    goto end;
-                } else {
-                    newchunk->used += dr->size;
-                    space_list_subtract(newchunk, dr->new_address, dr->size, &rollback);
+                if (stripe->status != WriteDataStatus_Ignore) {
+                    bw->wtc.need_wait = true;
+                    IoCallDriver(stripe->device->devobj, stripe->Irp);
                 }
 
-                release_chunk_lock(newchunk, Vcb);
+                le = le->Flink;
             }
 
-            ExReleaseResourceLite(&Vcb->chunk_lock);
+            bw->in_flight = true;
+            bp->next = (bp->next + 1) % BALANCE_PIPELINE_DEPTH;
         }
 
-        dr->newchunk = newchunk;
+        if (csum)
+            csum = (uint8_t*)csum + (rl * Vcb->csum_size);
 
-        bmplen = (ULONG)(dr->size >> Vcb->sector_shift);
+        src += rl << Vcb->sector_shift;
+        dst += rl << Vcb->sector_shift;
+        length -= rl;
+    }
 
-        bmparr = ExAllocatePoolWithTag(PagedPool, (ULONG)sector_align(bmplen + 1, sizeof(ULONG)), ALLOC_TAG);
-        if (!bmparr) {
-            ERR("out of memory\n");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS copy_data_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, balance_pipeline* bp, data_reloc* dr, chunk* c) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    void* csum;
+    RTL_BITMAP bmp;
+    ULONG* bmparr;
+    ULONG bmplen, runlength, index, lastoff;
+
+    bmplen = (ULONG)(dr->size >> Vcb->sector_shift);
+
+    bmparr = ExAllocatePoolWithTag(PagedPool, (ULONG)sector_align(bmplen + 1, sizeof(ULONG)), ALLOC_TAG);
+    if (!bmparr) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((dr->size * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
+    if (!csum) {
+        ERR("out of memory\n");
+        ExFreePool(bmparr);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitializeBitMap(&bmp, bmparr, bmplen);
+    RtlSetAllBits(&bmp); // 1 = no csum, 0 = csum
+
+    searchkey.obj_id = EXTENT_CSUM_ID;
+    searchkey.obj_type = TYPE_EXTENT_CSUM;
+    searchkey.offset = dr->address;
+
+    Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, false, NULL);
+    if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
+        ERR("find_item returned %08lx\n", Status);
+        goto end;
+    }
+
+    if (Status != STATUS_NOT_FOUND) {
+        do {
+            traverse_ptr next_tp;
+
+            if (tp.item->key.obj_type == TYPE_EXTENT_CSUM) {
+                if (tp.item->key.offset >= dr->address + dr->size)
+                    break;
+                else if (tp.item->size >= Vcb->csum_size && tp.item->key.offset + (((unsigned int)tp.item->size << Vcb->sector_shift) / Vcb->csum_size) >= dr->address) {
+                    uint64_t cs = max(dr->address, tp.item->key.offset);
+                    uint64_t ce = min(dr->address + dr->size, tp.item->key.offset + (((unsigned int)tp.item->size << Vcb->sector_shift) / Vcb->csum_size));
+
+                    RtlCopyMemory((uint8_t*)csum + (((cs - dr->address) * Vcb->csum_size) >> Vcb->sector_shift),
+                                  tp.item->data + (((cs - tp.item->key.offset) * Vcb->csum_size) >> Vcb->sector_shift),
+                                  (ULONG)(((ce - cs) * Vcb->csum_size) >> Vcb->sector_shift));
+
+                    RtlClearBits(&bmp, (ULONG)((cs - dr->address) >> Vcb->sector_shift), (ULONG)((ce - cs) >> Vcb->sector_shift));
+
+                    if (ce == dr->address + dr->size)
+                        break;
+                }
+            }
+
+            if (find_next_item(Vcb, &tp, &next_tp, false, NULL))
+                tp = next_tp;
+            else
+                break;
+        } while (true);
+    }
+
+    lastoff = 0;
+    runlength = RtlFindFirstRunClear(&bmp, &index);
+
+    while (runlength != 0) {
+        if (index >= bmplen)
+            break;
+
+        if (index + runlength >= bmplen) {
+            runlength = bmplen - index;
+
+            if (runlength == 0)
+                break;
         }
 
-        csum = ExAllocatePoolWithTag(PagedPool, (ULONG)((dr->size * Vcb->csum_size) >> Vcb->sector_shift), ALLOC_TAG);
-        if (!csum) {
-            ERR("out of memory\n");
-            ExFreePool(bmparr);
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+        // handle no csum run
+        if (index > lastoff) {
+            Status = balance_pipeline_copy(Vcb, bp, c, dr->address + (lastoff << Vcb->sector_shift), dr->newchunk,
+                                           dr->new_address + (lastoff << Vcb->sector_shift), index - lastoff, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("balance_pipeline_copy returned %08lx\n", Status);
+                goto end;
+            }
         }
 
-        RtlInitializeBitMap(&bmp, bmparr, bmplen);
-        RtlSetAllBits(&bmp); // 1 = no csum, 0 = csum
+        add_checksum_entry(Vcb, dr->new_address + (index << Vcb->sector_shift), runlength, (uint8_t*)csum + (index * Vcb->csum_size), NULL);
+        add_checksum_entry(Vcb, dr->address + (index << Vcb->sector_shift), runlength, NULL, NULL);
 
-        searchkey.obj_id = EXTENT_CSUM_ID;
-        searchkey.obj_type = TYPE_EXTENT_CSUM;
-        searchkey.offset = dr->address;
+        // handle csum run
+        Status = balance_pipeline_copy(Vcb, bp, c, dr->address + (index << Vcb->sector_shift), dr->newchunk,
+                                       dr->new_address + (index << Vcb->sector_shift), runlength, (uint8_t*)csum + (index * Vcb->csum_size));
+        if (!NT_SUCCESS(Status)) {
+            ERR("balance_pipeline_copy returned %08lx\n", Status);
+            goto end;
+        }
+
+        index += runlength;
+        lastoff = index;
+        runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
+    }
 
-        Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, false, NULL);
-        if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
-            ERR("find_item returned %08lx\n", Status);
-            ExFreePool(csum);
-            ExFreePool(bmparr);
+    // handle final nocsum run
+    if (lastoff < bmplen) {
+        Status = balance_pipeline_copy(Vcb, bp, c, dr->address + (lastoff << Vcb->sector_shift), dr->newchunk,
+                                       dr->new_address + (lastoff << Vcb->sector_shift), bmplen - lastoff, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("balance_pipeline_copy returned %08lx\n", Status);
             goto end;
         }
+    }
 
-        if (Status != STATUS_NOT_FOUND) {
-            do {
-                traverse_ptr next_tp;
+    Status = STATUS_SUCCESS;
 
-                if (tp.item->key.obj_type == TYPE_EXTENT_CSUM) {
-                    if (tp.item->key.offset >= dr->address + dr->size)
-                        break;
-                    else if (tp.item->size >= Vcb->csum_size && tp.item->key.offset + (((unsigned int)tp.item->size << Vcb->sector_shift) / Vcb->csum_size) >= dr->address) {
-                        uint64_t cs = max(dr->address, tp.item->key.offset);
-                        uint64_t ce = min(dr->address + dr->size, tp.item->key.offset + (((unsigned int)tp.item->size << Vcb->sector_shift) / Vcb->csum_size));
+end:
+    ExFreePool(csum);
+    ExFreePool(bmparr);
 
-                        RtlCopyMemory((uint8_t*)csum + (((cs - dr->address) * Vcb->csum_size) >> Vcb->sector_shift),
-                                      tp.item->data + (((cs - tp.item->key.offset) * Vcb->csum_size) >> Vcb->sector_shift),
-                                      (ULONG)(((ce - cs) * Vcb->csum_size) >> Vcb->sector_shift));
+    return Status;
+}
 
-                        RtlClearBits(&bmp, (ULONG)((cs - dr->address) >> Vcb->sector_shift), (ULONG)((ce - cs) >> Vcb->sector_shift));
+static data_reloc* find_data_reloc(data_reloc** relocs, ULONG num_relocs, uint64_t address) {
+    ULONG lo = 0, hi = num_relocs;
 
-                        if (ce == dr->address + dr->size)
-                            break;
-                    }
-                }
+    // relocs is sorted by address, as we found the extents by walking the extent tree
 
-                if (find_next_item(Vcb, &tp, &next_tp, false, NULL))
-                    tp = next_tp;
-                else
-                    break;
-            } while (true);
-        }
+    while (lo < hi) {
+        ULONG mid = lo + ((hi - lo) / 2);
 
-        lastoff = 0;
-        runlength = RtlFindFirstRunClear(&bmp, &index);
+        if (relocs[mid]->address == address)
+            return relocs[mid];
+        else if (relocs[mid]->address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-        while (runlength != 0) {
-            if (index >= bmplen)
-                break;
+    return NULL;
+}
 
-            if (index + runlength >= bmplen) {
-                runlength = bmplen - index;
+static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, bool* changed) {
+    KEY searchkey;
+    traverse_ptr tp;
+    NTSTATUS Status;
+    bool b;
+    LIST_ENTRY items, rollback, *le;
+    metadata_reloc_list metadata_items;
+    uint64_t loaded = 0;
+    ULONG num_loaded = 0;
+    chunk* newchunk = NULL;
+    balance_pipeline* bp = NULL;
+    data_reloc** relocs = NULL;
 
-                if (runlength == 0)
-                    break;
-            }
+    TRACE("chunk %I64x\n", c->offset);
 
-            if (index > lastoff) {
-                ULONG off = lastoff;
-                ULONG size = index - lastoff;
+    InitializeListHead(&rollback);
+    InitializeListHead(&items);
+    init_metadata_reloc_list(&metadata_items);
 
-                // handle no csum run
-                do {
-                    ULONG rl;
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
 
-                    if (size << Vcb->sector_shift > BALANCE_UNIT)
-                        rl = BALANCE_UNIT >> Vcb->sector_shift;
-                    else
-                        rl = size;
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_EXTENT_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
 
-                    Status = read_data(Vcb, dr->address + (off << Vcb->sector_shift), rl << Vcb->sector_shift, NULL, false, data,
-                                       c, NULL, NULL, 0, false, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("read_data returned %08lx\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
+    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, false, NULL);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        goto end;
+    }
 
-                    Status = write_data_complete(Vcb, dr->new_address + (off << Vcb->sector_shift), data, rl << Vcb->sector_shift,
-                                                 NULL, newchunk, false, 0, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("write_data_complete returned %08lx\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
+    do {
+        traverse_ptr next_tp;
 
-                    size -= rl;
-                    off += rl;
-                } while (size > 0);
-            }
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
 
-            add_checksum_entry(Vcb, dr->new_address + (index << Vcb->sector_shift), runlength, (uint8_t*)csum + (index * Vcb->csum_size), NULL);
-            add_checksum_entry(Vcb, dr->address + (index << Vcb->sector_shift), runlength, NULL, NULL);
+        if (tp.item->key.obj_id >= c->offset && tp.item->key.obj_type == TYPE_EXTENT_ITEM) {
+            bool tree = false;
 
-            // handle csum run
-            do {
-                ULONG rl;
+            if (tp.item->key.obj_type == TYPE_EXTENT_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
+                EXTENT_ITEM* ei = (EXTENT_ITEM*)tp.item->data;
 
-                if (runlength << Vcb->sector_shift > BALANCE_UNIT)
-                    rl = BALANCE_UNIT >> Vcb->sector_shift;
-                else
-                    rl = runlength;
+                if (ei->flags & EXTENT_ITEM_TREE_BLOCK)
+                    tree = true;
+            }
 
-                Status = read_data(Vcb, dr->address + (index << Vcb->sector_shift), rl << Vcb->sector_shift,
-                                   (uint8_t*)csum + (index * Vcb->csum_size), false, data, c, NULL, NULL, 0, false, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08lx\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(bmparr);
-                    goto end;
-                }
+            if (!tree) {
+                Status = add_data_reloc(Vcb, &items, &metadata_items, &tp, c, &rollback);
 
-                Status = write_data_complete(Vcb, dr->new_address + (index << Vcb->sector_shift), data, rl << Vcb->sector_shift,
-                                             NULL, newchunk, false, 0, NormalPagePriority);
                 if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08lx\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(bmparr);
+                    ERR("add_data_reloc returned %08lx\n", Status);
                     goto end;
                 }
 
-                runlength -= rl;
-                index += rl;
-            } while (runlength > 0);
+                loaded += tp.item->key.offset;
+                num_loaded++;
 
-            lastoff = index;
-            runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
+                if (loaded >= BALANCE_DATA_BATCH_SIZE || num_loaded >= BALANCE_DATA_BATCH_ITEMS) // only do so much at a time, so we don't block too obnoxiously
+                    break;
+            }
         }
 
-        ExFreePool(csum);
-        ExFreePool(bmparr);
+        b = find_next_item(Vcb, &tp, &next_tp, false, NULL);
 
-        // handle final nocsum run
-        if (lastoff < dr->size >> Vcb->sector_shift) {
-            ULONG off = lastoff;
-            ULONG size = (ULONG)((dr->size >> Vcb->sector_shift) - lastoff);
+        if (b)
+            tp = next_tp;
+    } while (b);
 
-            do {
-                ULONG rl;
+    if (IsListEmpty(&items)) {
+        *changed = false;
+        Status = STATUS_SUCCESS;
+        goto end;
+    } else
+        *changed = true;
 
-                if (size << Vcb->sector_shift > BALANCE_UNIT)
-                    rl = BALANCE_UNIT >> Vcb->sector_shift;
-                else
-                    rl = size;
+    relocs = ExAllocatePoolWithTag(PagedPool, sizeof(data_reloc*) * num_loaded, ALLOC_TAG);
+    if (!relocs) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
 
-                Status = read_data(Vcb, dr->address + (off << Vcb->sector_shift), rl << Vcb->sector_shift, NULL, false, data,
-                                   c, NULL, NULL, 0, false, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08lx\n", Status);
-                    goto end;
-                }
+    // allocate all the new addresses up front, so the copying below isn't interrupted by chunk allocation
 
-                Status = write_data_complete(Vcb, dr->new_address + (off << Vcb->sector_shift), data, rl << Vcb->sector_shift,
-                                             NULL, newchunk, false, 0, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08lx\n", Status);
-                    goto end;
-                }
+    num_loaded = 0;
+
+    le = items.Flink;
+    while (le != &items) {
+        data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
 
-                size -= rl;
-                off += rl;
-            } while (size > 0);
+        Status = data_reloc_alloc(Vcb, dr, &newchunk, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("data_reloc_alloc returned %08lx\n", Status);
+            goto end;
+        }
+
+        relocs[num_loaded] = dr;
+        num_loaded++;
+
+        le = le->Flink;
+    }
+
+    Status = init_balance_pipeline(&bp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_balance_pipeline returned %08lx\n", Status);
+        goto end;
+    }
+
+    le = items.Flink;
+    while (le != &items) {
+        data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
+
+        Status = copy_data_reloc(Vcb, bp, dr, c);
+        if (!NT_SUCCESS(Status)) {
+            ERR("copy_data_reloc returned %08lx\n", Status);
+            goto end;
         }
 
         le = le->Flink;
     }
 
-    ExFreePool(data);
-    data = NULL;
+    Status = balance_pipeline_flush(Vcb, bp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("balance_pipeline_flush returned %08lx\n", Status);
+        goto end;
+    }
+
+    free_balance_pipeline(Vcb, bp);
+    bp = NULL;
 
     Status = write_metadata_items(Vcb, &metadata_items, &items, NULL, &rollback);
     if (!NT_SUCCESS(Status)) {
@@ -2041,23 +2561,19 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, bool* change
 
     le = c->changed_extents.Flink;
     while (le != &c->changed_extents) {
-        LIST_ENTRY *le2, *le3;
+        LIST_ENTRY* le3;
         changed_extent* ce = CONTAINING_RECORD(le, changed_extent, list_entry);
 
-        le3 = le->Flink;
+        data_reloc* dr;
 
-        le2 = items.Flink;
-        while (le2 != &items) {
-            data_reloc* dr = CONTAINING_RECORD(le2, data_reloc, list_entry);
+        le3 = le->Flink;
 
-            if (ce->address == dr->address) {
-                ce->address = dr->new_address;
-                RemoveEntryList(&ce->list_entry);
-                InsertTailList(&dr->newchunk->changed_extents, &ce->list_entry);
-                break;
-            }
+        dr = find_data_reloc(relocs, num_loaded, ce->address);
 
-            le2 = le2->Flink;
+        if (dr) {
+            ce->address = dr->new_address;
+            RemoveEntryList(&ce->list_entry);
+            InsertTailList(&dr->newchunk->changed_extents, &ce->list_entry);
         }
 
         le = le3;
@@ -2068,6 +2584,10 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, bool* change
     Vcb->need_write = true;
 
 end:
+    // wait for any writes still in flight before we roll back or free anything
+    if (bp)
+        free_balance_pipeline(Vcb, bp);
+
     if (NT_SUCCESS(Status)) {
         // update extents in cache inodes before we flush
         le = Vcb->chunks.Flink;
@@ -2088,17 +2608,10 @@ end:
                             EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
 
                             if (ed2->size > 0 && ed2->address >= c->offset && ed2->address < c->offset + c->chunk_item->size) {
-                                LIST_ENTRY* le3 = items.Flink;
-                                while (le3 != &items) {
-                                    data_reloc* dr = CONTAINING_RECORD(le3, data_reloc, list_entry);
-
-                                    if (ed2->address == dr->address) {
-                                        ed2->address = dr->new_address;
-                                        break;
-                                    }
+                                data_reloc* dr = find_data_reloc(relocs, num_loaded, ed2->address);
 
-                                    le3 = le3->Flink;
-                                }
+                                if (dr)
+                                    ed2->address = dr->new_address;
                             }
                         }
                     }
@@ -2121,7 +2634,6 @@ end:
         clear_rollback(&rollback);
 
         // update open FCBs
-        // FIXME - speed this up(?)
 
         le = Vcb->all_fcbs.Flink;
         while (le != &Vcb->all_fcbs) {
@@ -2139,17 +2651,10 @@ end:
                         EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
 
                         if (ed2->size > 0 && ed2->address >= c->offset && ed2->address < c->offset + c->chunk_item->size) {
-                            LIST_ENTRY* le3 = items.Flink;
-                            while (le3 != &items) {
-                                data_reloc* dr = CONTAINING_RECORD(le3, data_reloc, list_entry);
-
-                                if (ed2->address == dr->address) {
-                                    ed2->address = dr->new_address;
-                                    break;
-                                }
+                            data_reloc* dr = find_data_reloc(relocs, num_loaded, ed2->address);
 
-                                le3 = le3->Flink;
-                            }
+                            if (dr)
+                                ed2->address = dr->new_address;
                         }
                     }
                 }
@@ -2168,8 +2673,8 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
-    if (data)
-        ExFreePool(data);
+    if (relocs)
+        ExFreePool(relocs);
 
     while (!IsListEmpty(&items)) {
         data_reloc* dr = CONTAINING_RECORD(RemoveHeadList(&items), data_reloc, list_entry);
@@ -2183,20 +2688,7 @@ end:
         ExFreePool(dr);
     }
 
-    while (!IsListEmpty(&metadata_items)) {
-        metadata_reloc* mr = CONTAINING_RECORD(RemoveHeadList(&metadata_items), metadata_reloc, list_entry);
-
-        while (!IsListEmpty(&mr->refs)) {
-            metadata_reloc_ref* ref = CONTAINING_RECORD(RemoveHeadList(&mr->refs), metadata_reloc_ref, list_entry);
-
-            ExFreePool(ref);
-        }
-
-        if (mr->data)
-            ExFreePool(mr->data);
-
-        ExFreePool(mr);
-    }
+    free_metadata_reloc_list(&metadata_items);
 
     return Status;
 }
@@ -2222,11 +2714,25 @@ static __inline uint64_t get_chunk_dup_type(chunk* c) {
         return BLOCK_FLAG_SINGLE;
 }
 
-static bool should_balance_chunk(device_extension* Vcb, uint8_t sort, chunk* c) {
-    btrfs_balance_opts* opts;
+static uint16_t get_chunk_factor(chunk* c) {
+    if (c->chunk_item->type & BLOCK_FLAG_RAID0)
+        return c->chunk_item->num_stripes;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
+        return c->chunk_item->num_stripes / c->chunk_item->sub_stripes;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID5)
+        return c->chunk_item->num_stripes - 1;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID6)
+        return c->chunk_item->num_stripes - 2;
+    else // SINGLE, DUPLICATE, RAID1, RAID1C3, RAID1C4
+        return 1;
+}
 
-    opts = &Vcb->balance.opts[sort];
+// space taken up on the devices by a chunk, i.e. what we get back when it goes
+static __inline uint64_t get_chunk_phys_size(chunk* c) {
+    return (c->chunk_item->size / get_chunk_factor(c)) * c->chunk_item->num_stripes;
+}
 
+static bool should_balance_chunk(btrfs_balance_opts* opts, chunk* c) {
     if (!(opts->flags & BTRFS_BALANCE_OPTS_ENABLED))
         return false;
 
@@ -2254,23 +2760,12 @@ static bool should_balance_chunk(device_extension* Vcb, uint8_t sort, chunk* c)
     }
 
     if (opts->flags & BTRFS_BALANCE_OPTS_DRANGE) {
-        uint16_t i, factor;
+        uint16_t i;
         uint64_t physsize;
         CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
         bool b = false;
 
-        if (c->chunk_item->type & BLOCK_FLAG_RAID0)
-            factor = c->chunk_item->num_stripes;
-        else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
-            factor = c->chunk_item->num_stripes / c->chunk_item->sub_stripes;
-        else if (c->chunk_item->type & BLOCK_FLAG_RAID5)
-            factor = c->chunk_item->num_stripes - 1;
-        else if (c->chunk_item->type & BLOCK_FLAG_RAID6)
-            factor = c->chunk_item->num_stripes - 2;
-        else // SINGLE, DUPLICATE, RAID1, RAID1C3, RAID1C4
-            factor = 1;
-
-        physsize = c->chunk_item->size / factor;
+        physsize = c->chunk_item->size / get_chunk_factor(c);
 
         for (i = 0; i < c->chunk_item->num_stripes; i++) {
             if (cis[i].offset < opts->drange_end && cis[i].offset + physsize >= opts->drange_start &&
@@ -2315,6 +2810,111 @@ static bool should_balance_chunk(device_extension* Vcb, uint8_t sort, chunk* c)
     return true;
 }
 
+static uint64_t get_unallocated_space(device_extension* Vcb) {
+    uint64_t unallocated = 0;
+    LIST_ENTRY* le;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+        if (dev->devobj && !dev->readonly && dev->devitem.num_bytes > dev->devitem.bytes_used)
+            unallocated += dev->devitem.num_bytes - dev->devitem.bytes_used;
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return unallocated;
+}
+
+// chunks we've finished relocating which haven't been dropped by a flush yet
+static uint64_t get_pending_reloc_space(device_extension* Vcb) {
+    uint64_t space = 0;
+    LIST_ENTRY* le;
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (c->reloc && !c->list_entry_balance.Flink && c->used == 0)
+            space += get_chunk_phys_size(c);
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    return space;
+}
+
+static void sort_balance_chunks(LIST_ENTRY* chunks) {
+    LIST_ENTRY sorted;
+
+    // insertion sort by amount of space used, so that we do the emptiest chunks first
+
+    InitializeListHead(&sorted);
+
+    while (!IsListEmpty(chunks)) {
+        chunk* c = CONTAINING_RECORD(RemoveHeadList(chunks), chunk, list_entry_balance);
+        LIST_ENTRY* le = sorted.Flink;
+        bool inserted = false;
+
+        while (le != &sorted) {
+            chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry_balance);
+
+            if (c2->used > c->used) {
+                InsertHeadList(le->Blink, &c->list_entry_balance);
+                inserted = true;
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (!inserted)
+            InsertTailList(&sorted, &c->list_entry_balance);
+    }
+
+    if (!IsListEmpty(&sorted)) {
+        chunks->Flink = sorted.Flink;
+        chunks->Blink = sorted.Blink;
+        chunks->Flink->Blink = chunks;
+        chunks->Blink->Flink = chunks;
+    }
+}
+
+static __inline uint8_t get_balance_sort(chunk* c) {
+    if (c->chunk_item->type & BLOCK_FLAG_DATA)
+        return BALANCE_OPTS_DATA;
+    else if (c->chunk_item->type & BLOCK_FLAG_METADATA)
+        return BALANCE_OPTS_METADATA;
+    else
+        return BALANCE_OPTS_SYSTEM;
+}
+
+static bool balance_target_reached(device_extension* Vcb, uint8_t sort) {
+    if (!(Vcb->balance.opts[sort].flags & BTRFS_BALANCE_OPTS_TARGET))
+        return false;
+
+    return get_unallocated_space(Vcb) + get_pending_reloc_space(Vcb) >= Vcb->balance.target[sort];
+}
+
+static void skip_balance_chunk(device_extension* Vcb, chunk* c) {
+    TRACE("target reached, skipping chunk %I64x\n", c->offset);
+
+    RemoveEntryList(&c->list_entry_balance);
+    c->list_entry_balance.Flink = NULL;
+    c->reloc = false;
+
+    Vcb->balance.chunks_left--;
+}
+
 static void copy_balance_args(btrfs_balance_opts* opts, BALANCE_ARGS* args) {
     if (opts->flags & BTRFS_BALANCE_OPTS_PROFILES) {
         args->profiles = opts->profiles;
@@ -3076,10 +3676,13 @@ void __stdcall balance_thread(void* context) {
     }
 
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS) {
-        if (Vcb->balance.opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ENABLED)
+        if (Vcb->balance.opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ENABLED) {
             RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_METADATA], &Vcb->balance.opts[BALANCE_OPTS_DATA], sizeof(btrfs_balance_opts));
-        else if (Vcb->balance.opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ENABLED)
+            Vcb->balance.target[BALANCE_OPTS_METADATA] = Vcb->balance.target[BALANCE_OPTS_DATA];
+        } else if (Vcb->balance.opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ENABLED) {
             RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_DATA], &Vcb->balance.opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
+            Vcb->balance.target[BALANCE_OPTS_DATA] = Vcb->balance.target[BALANCE_OPTS_METADATA];
+        }
     }
 
     num_chunks[0] = num_chunks[1] = num_chunks[2] = 0;
@@ -3139,7 +3742,7 @@ void __stdcall balance_thread(void* context) {
         }
 
         if ((!(Vcb->balance.opts[sort].flags & BTRFS_BALANCE_OPTS_LIMIT) || num_chunks[sort] < Vcb->balance.opts[sort].limit_end) &&
-            should_balance_chunk(Vcb, sort, c)) {
+            should_balance_chunk(&Vcb->balance.opts[sort], c)) {
             InsertTailList(&chunks, &c->list_entry_balance);
 
             num_chunks[sort]++;
@@ -3171,6 +3774,11 @@ void __stdcall balance_thread(void* context) {
 
     ExReleaseResourceLite(&Vcb->chunk_lock);
 
+    if (Vcb->balance.opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE ||
+        Vcb->balance.opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE ||
+        Vcb->balance.opts[BALANCE_OPTS_SYSTEM].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE)
+        sort_balance_chunks(&chunks);
+
     // If we're doing a full balance, try and allocate a new chunk now, before we mess things up
     if (okay_metadata_chunks == 0 || okay_data_chunks == 0 || okay_system_chunks == 0) {
         bool consolidated = false;
@@ -3289,6 +3897,12 @@ void __stdcall balance_thread(void* context) {
         chunk* c = CONTAINING_RECORD(le, chunk, list_entry_balance);
         LIST_ENTRY* le2 = le->Flink;
 
+        if (c->chunk_item->type & BLOCK_FLAG_DATA && balance_target_reached(Vcb, BALANCE_OPTS_DATA)) {
+            skip_balance_chunk(Vcb, c);
+            le = le2;
+            continue;
+        }
+
         if (c->chunk_item->type & BLOCK_FLAG_DATA) {
             bool changed;
 
@@ -3334,8 +3948,15 @@ void __stdcall balance_thread(void* context) {
         chunk* c;
         bool changed;
 
+        c = CONTAINING_RECORD(chunks.Flink, chunk, list_entry_balance);
+
+        // mixed chunks have already been started on above, so finish them off
+        if (!(c->chunk_item->type & BLOCK_FLAG_DATA) && balance_target_reached(Vcb, get_balance_sort(c))) {
+            skip_balance_chunk(Vcb, c);
+            continue;
+        }
+
         le = RemoveHeadList(&chunks);
-        c = CONTAINING_RECORD(le, chunk, list_entry_balance);
 
         if (c->chunk_item->type & BLOCK_FLAG_METADATA || c->chunk_item->type & BLOCK_FLAG_SYSTEM) {
             do {
@@ -3508,13 +4129,94 @@ end:
     KeSetEvent(&Vcb->balance.finished, 0, false);
 }
 
+static NTSTATUS check_balance_opts(btrfs_balance_opts* opts) {
+    if (opts->flags & BTRFS_BALANCE_OPTS_PROFILES) {
+        opts->profiles &= BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID1 | BLOCK_FLAG_DUPLICATE | BLOCK_FLAG_RAID10 |
+                          BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6 | BLOCK_FLAG_SINGLE | BLOCK_FLAG_RAID1C3 |
+                          BLOCK_FLAG_RAID1C4;
+
+        if (opts->profiles == 0)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_DEVID) {
+        if (opts->devid == 0)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_DRANGE) {
+        if (opts->drange_start > opts->drange_end)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_VRANGE) {
+        if (opts->vrange_start > opts->vrange_end)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_LIMIT) {
+        opts->limit_start = max(1, opts->limit_start);
+        opts->limit_end = max(1, opts->limit_end);
+
+        if (opts->limit_start > opts->limit_end)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_STRIPES) {
+        opts->stripes_start = max(1, opts->stripes_start);
+        opts->stripes_end = max(1, opts->stripes_end);
+
+        if (opts->stripes_start > opts->stripes_end)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_USAGE) {
+        opts->usage_start = min(100, opts->stripes_start);
+        opts->usage_end = min(100, opts->stripes_end);
+
+        if (opts->stripes_start > opts->stripes_end)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (opts->flags & BTRFS_BALANCE_OPTS_CONVERT) {
+        if (opts->convert != BLOCK_FLAG_RAID0 && opts->convert != BLOCK_FLAG_RAID1 &&
+            opts->convert != BLOCK_FLAG_DUPLICATE && opts->convert != BLOCK_FLAG_RAID10 &&
+            opts->convert != BLOCK_FLAG_RAID5 && opts->convert != BLOCK_FLAG_RAID6 &&
+            opts->convert != BLOCK_FLAG_SINGLE && opts->convert != BLOCK_FLAG_RAID1C3 &&
+            opts->convert != BLOCK_FLAG_RAID1C4)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Older tools send btrfs_start_balance without the targets on the end.
+static NTSTATUS get_balance_targets(btrfs_start_balance* bsb, ULONG length, uint64_t* target) {
+    uint8_t i;
+
+    for (i = 0; i < 3; i++) {
+        if (!(bsb->opts[i].flags & BTRFS_BALANCE_OPTS_ENABLED) || !(bsb->opts[i].flags & BTRFS_BALANCE_OPTS_TARGET)) {
+            target[i] = 0;
+            continue;
+        }
+
+        if (length < sizeof(btrfs_start_balance) || bsb->target[i] == 0)
+            return STATUS_INVALID_PARAMETER;
+
+        target[i] = bsb->target[i];
+    }
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
     NTSTATUS Status;
     btrfs_start_balance* bsb = (btrfs_start_balance*)data;
     OBJECT_ATTRIBUTES oa;
+    uint64_t target[3];
     uint8_t i;
 
-    if (length < sizeof(btrfs_start_balance) || !data)
+    if (length < offsetof(btrfs_start_balance, target) || !data)
         return STATUS_INVALID_PARAMETER;
 
     if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
@@ -3545,68 +4247,20 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
 
     for (i = 0; i < 3; i++) {
         if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_ENABLED) {
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_PROFILES) {
-                bsb->opts[i].profiles &= BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID1 | BLOCK_FLAG_DUPLICATE | BLOCK_FLAG_RAID10 |
-                                         BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6 | BLOCK_FLAG_SINGLE | BLOCK_FLAG_RAID1C3 |
-                                         BLOCK_FLAG_RAID1C4;
-
-                if (bsb->opts[i].profiles == 0)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_DEVID) {
-                if (bsb->opts[i].devid == 0)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_DRANGE) {
-                if (bsb->opts[i].drange_start > bsb->opts[i].drange_end)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_VRANGE) {
-                if (bsb->opts[i].vrange_start > bsb->opts[i].vrange_end)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_LIMIT) {
-                bsb->opts[i].limit_start = max(1, bsb->opts[i].limit_start);
-                bsb->opts[i].limit_end = max(1, bsb->opts[i].limit_end);
-
-                if (bsb->opts[i].limit_start > bsb->opts[i].limit_end)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_STRIPES) {
-                bsb->opts[i].stripes_start = max(1, bsb->opts[i].stripes_start);
-                bsb->opts[i].stripes_end = max(1, bsb->opts[i].stripes_end);
-
-                if (bsb->opts[i].stripes_start > bsb->opts[i].stripes_end)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_USAGE) {
-                bsb->opts[i].usage_start = min(100, bsb->opts[i].stripes_start);
-                bsb->opts[i].usage_end = min(100, bsb->opts[i].stripes_end);
-
-                if (bsb->opts[i].stripes_start > bsb->opts[i].stripes_end)
-                    return STATUS_INVALID_PARAMETER;
-            }
-
-            if (bsb->opts[i].flags & BTRFS_BALANCE_OPTS_CONVERT) {
-                if (bsb->opts[i].convert != BLOCK_FLAG_RAID0 && bsb->opts[i].convert != BLOCK_FLAG_RAID1 &&
-                    bsb->opts[i].convert != BLOCK_FLAG_DUPLICATE && bsb->opts[i].convert != BLOCK_FLAG_RAID10 &&
-                    bsb->opts[i].convert != BLOCK_FLAG_RAID5 && bsb->opts[i].convert != BLOCK_FLAG_RAID6 &&
-                    bsb->opts[i].convert != BLOCK_FLAG_SINGLE && bsb->opts[i].convert != BLOCK_FLAG_RAID1C3 &&
-                    bsb->opts[i].convert != BLOCK_FLAG_RAID1C4)
-                    return STATUS_INVALID_PARAMETER;
-            }
+            Status = check_balance_opts(&bsb->opts[i]);
+            if (!NT_SUCCESS(Status))
+                return Status;
         }
     }
 
+    Status = get_balance_targets(bsb, length, target);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_DATA], &bsb->opts[BALANCE_OPTS_DATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_METADATA], &bsb->opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&Vcb->balance.opts[BALANCE_OPTS_SYSTEM], &bsb->opts[BALANCE_OPTS_SYSTEM], sizeof(btrfs_balance_opts));
+    RtlCopyMemory(Vcb->balance.target, target, sizeof(target));
 
     Vcb->balance.paused = false;
     Vcb->balance.removing = false;
@@ -3625,6 +4279,153 @@ NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESS
     return STATUS_SUCCESS;
 }
 
+NTSTATUS estimate_balance(device_extension* Vcb, void* data, ULONG inlen, void* out, ULONG outlen, ULONG_PTR* retlen) {
+    NTSTATUS Status;
+    btrfs_start_balance* bsb = (btrfs_start_balance*)data;
+    btrfs_balance_estimate* bbe = (btrfs_balance_estimate*)out;
+    btrfs_balance_opts opts[3];
+    uint64_t target[3], num_chunks[3], spare[3], total_size[3], total_phys[3], total_count[3], unallocated, reclaimed = 0, allocated = 0, new_chunks = 0;
+    chunk** cands;
+    ULONG num_cands = 0, max_cands = 0, j;
+    bool order_usage;
+    LIST_ENTRY* le;
+    uint8_t i, pass;
+
+    if (inlen < offsetof(btrfs_start_balance, target) || !data)
+        return STATUS_INVALID_PARAMETER;
+
+    if (outlen < sizeof(btrfs_balance_estimate) || !out)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlCopyMemory(opts, bsb->opts, sizeof(opts));
+
+    for (i = 0; i < 3; i++) {
+        if (opts[i].flags & BTRFS_BALANCE_OPTS_ENABLED) {
+            Status = check_balance_opts(&opts[i]);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+
+        num_chunks[i] = spare[i] = total_size[i] = total_phys[i] = total_count[i] = 0;
+    }
+
+    Status = get_balance_targets(bsb, inlen, target);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS) {
+        if (opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ENABLED) {
+            RtlCopyMemory(&opts[BALANCE_OPTS_METADATA], &opts[BALANCE_OPTS_DATA], sizeof(btrfs_balance_opts));
+            target[BALANCE_OPTS_METADATA] = target[BALANCE_OPTS_DATA];
+        } else if (opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ENABLED) {
+            RtlCopyMemory(&opts[BALANCE_OPTS_DATA], &opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
+            target[BALANCE_OPTS_DATA] = target[BALANCE_OPTS_METADATA];
+        }
+    }
+
+    order_usage = opts[BALANCE_OPTS_DATA].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE ||
+                  opts[BALANCE_OPTS_METADATA].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE ||
+                  opts[BALANCE_OPTS_SYSTEM].flags & BTRFS_BALANCE_OPTS_ORDER_USAGE;
+
+    RtlZeroMemory(bbe, sizeof(btrfs_balance_estimate));
+
+    unallocated = get_unallocated_space(Vcb);
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        max_cands++;
+        le = le->Flink;
+    }
+
+    if (max_cands == 0) {
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        goto end;
+    }
+
+    cands = ExAllocatePoolWithTag(PagedPool, sizeof(chunk*) * max_cands, ALLOC_TAG);
+    if (!cands) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // same selection as balance_thread
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+        uint8_t sort = get_balance_sort(c);
+
+        total_size[sort] += c->chunk_item->size;
+        total_phys[sort] += get_chunk_phys_size(c);
+        total_count[sort]++;
+
+        if ((!(opts[sort].flags & BTRFS_BALANCE_OPTS_LIMIT) || num_chunks[sort] < opts[sort].limit_end) &&
+            should_balance_chunk(&opts[sort], c)) {
+            if (order_usage) {
+                j = num_cands;
+
+                while (j > 0 && cands[j - 1]->used > c->used) {
+                    cands[j] = cands[j - 1];
+                    j--;
+                }
+
+                cands[j] = c;
+            } else
+                cands[num_cands] = c;
+
+            num_cands++;
+            num_chunks[sort]++;
+        } else
+            spare[sort] += c->chunk_item->size - c->used;
+
+        le = le->Flink;
+    }
+
+    // Data chunks get done before metadata and system. When the space left in the chunks we're not
+    // touching runs out, assume we'll need a new chunk the same size as the average one of that type.
+
+    for (pass = 0; pass < 2; pass++) {
+        for (j = 0; j < num_cands; j++) {
+            chunk* c = cands[j];
+            uint8_t sort = get_balance_sort(c);
+
+            if ((pass == 0) != (sort == BALANCE_OPTS_DATA))
+                continue;
+
+            if (opts[sort].flags & BTRFS_BALANCE_OPTS_TARGET && unallocated + reclaimed >= target[sort] + allocated)
+                continue;
+
+            while (spare[sort] < c->used) {
+                spare[sort] += total_size[sort] / total_count[sort];
+                allocated += total_phys[sort] / total_count[sort];
+                new_chunks++;
+            }
+
+            spare[sort] -= c->used;
+
+            bbe->chunks++;
+            bbe->bytes_to_move += c->used;
+            reclaimed += get_chunk_phys_size(c);
+        }
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    ExFreePool(cands);
+
+end:
+    bbe->chunks_freed = bbe->chunks > new_chunks ? bbe->chunks - new_chunks : 0;
+    bbe->unallocated_before = unallocated;
+    bbe->unallocated_after = unallocated + reclaimed > allocated ? unallocated + reclaimed - allocated : 0;
+
+    *retlen = sizeof(btrfs_balance_estimate);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS look_for_balance_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb) {
     KEY searchkey;
     traverse_ptr tp;
@@ -3711,7 +4512,8 @@ NTSTATUS look_for_balance_item(_Requires_lock_held_(_Curr_->tree_lock) device_ex
 NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
     btrfs_query_balance* bqb = (btrfs_query_balance*)data;
 
-    if (length < sizeof(btrfs_query_balance) || !data)
+    // older tools don't leave room for the targets
+    if (length < offsetof(btrfs_query_balance, target) || !data)
         return STATUS_INVALID_PARAMETER;
 
     if (!Vcb->balance.thread) {
@@ -3743,6 +4545,9 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
     RtlCopyMemory(&bqb->metadata_opts, &Vcb->balance.opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bqb->system_opts, &Vcb->balance.opts[BALANCE_OPTS_SYSTEM], sizeof(btrfs_balance_opts));
 
+    if (length >= sizeof(btrfs_query_balance))
+        RtlCopyMemory(bqb->target, Vcb->balance.target, sizeof(bqb->target));
+
     return STATUS_SUCCESS;
 }
 
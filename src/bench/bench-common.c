@@ -0,0 +1,127 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "bench-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+double cpu_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+uint32_t rnd(uint32_t* seed) {
+    *seed = (*seed * 1103515245) + 12345;
+
+    return *seed >> 8;
+}
+
+void make_synthetic(uint8_t* buf, size_t len) {
+    static const char* words[] = {
+        "btrfs", "extent", "chunk", "the", "of", "and", "superblock", "tree", "node", "leaf", "inode",
+        "checksum", "device", "stripe", "a", "to", "in", "subvolume", "snapshot", "compression"
+    };
+    uint32_t seed = 0x12345678;
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char* w;
+        size_t wl;
+
+        seed = (seed * 1103515245) + 12345;
+        w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        wl = strlen(w);
+
+        if ((seed >> 8) % 7 == 0) { // sprinkle in some noise
+            buf[pos++] = (uint8_t)(seed >> 24);
+            continue;
+        }
+
+        while (wl > 0 && pos < len) {
+            buf[pos++] = (uint8_t)*w++;
+            wl--;
+        }
+
+        if (pos < len)
+            buf[pos++] = (seed >> 12) % 11 == 0 ? '\n' : ' ';
+    }
+}
+
+// The top bits, as the bottom bits of rnd repeat too soon for zstd not to notice.
+void make_random(uint8_t* buf, size_t len, uint32_t* seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(rnd(seed) >> 16);
+    }
+}
+
+bool read_input(const char* fn, uint8_t** buf, size_t* len) {
+    int fd;
+    struct stat st;
+    size_t pos = 0;
+
+    fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", fn, strerror(errno));
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", fn, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    *buf = realloc(*buf, *len + st.st_size);
+
+    while (pos < (size_t)st.st_size) {
+        ssize_t ret = read(fd, *buf + *len + pos, st.st_size - pos);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            fprintf(stderr, "Could not read %s: %s\n", fn, ret == 0 ? "unexpected end of file" : strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        pos += ret;
+    }
+
+    close(fd);
+
+    *len += pos;
+
+    return true;
+}
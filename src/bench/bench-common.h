@@ -0,0 +1,43 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Helpers shared by the benchmarks.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Wall-clock time in seconds.
+double now(void);
+
+// CPU time used by this thread in seconds, which a busy machine pre-empting
+// us doesn't inflate.
+double cpu_now(void);
+
+uint32_t rnd(uint32_t* seed);
+
+// Text-like data, which compresses to about a third.
+void make_synthetic(uint8_t* buf, size_t len);
+
+// Noise, which doesn't compress at all.
+void make_random(uint8_t* buf, size_t len, uint32_t* seed);
+
+// Appends the contents of fn to *buf, which can start off NULL, and adds its
+// length to *len. Prints a message and returns false if it can't.
+bool read_input(const char* fn, uint8_t** buf, size_t* len);
@@ -0,0 +1,380 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Benchmark for the decompressed extent cache in extent-cache.c, built in
+// user mode. The input is compressed into 128 KB extents, and then read back
+// in small random pieces the way read_file does, with the cache at various
+// sizes. Before that, it checks that what comes out of the cache is right, and
+// that invalidation and eviction work.
+
+#include "../compress-shim.h"
+#include "bench-common.h"
+#include "../btrfs.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#define EXTENT_SIZE 0x20000 // COMPRESSED_EXTENT_SIZE
+#define SYNTHETIC_SIZE 0x4000000
+#define BASE_ADDRESS 0x10000000
+
+typedef struct {
+    uint8_t* in;
+    uint32_t inlen;
+    uint8_t* comp;
+    uint32_t complen;
+    uint64_t address;
+    uint64_t generation;
+} extent;
+
+typedef struct {
+    const char* name;
+    unsigned int hot_percent; // proportion of reads going to...
+    unsigned int hot_extents_percent; // ...this proportion of the file
+} pattern;
+
+static const pattern patterns[] = {
+    { "uniform", 100, 100 },
+    { "90/10", 90, 10 },
+    { "99/1", 99, 1 },
+};
+
+static const uint64_t cache_sizes[] = { 0, 0x100000, 0x800000, 0x2000000 };
+
+static NTSTATUS decompress_extent(uint8_t type, extent* ext, uint8_t* out, uint32_t outlen) {
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            return zlib_decompress(ext->comp, ext->complen, out, outlen);
+
+        case BTRFS_COMPRESSION_LZO:
+            return lzo_decompress(ext->comp + sizeof(uint32_t), ext->complen - sizeof(uint32_t), out, outlen, sizeof(uint32_t));
+
+        case BTRFS_COMPRESSION_ZSTD:
+            return zstd_decompress(ext->comp, ext->complen, out, outlen, NULL);
+
+        default:
+            return STATUS_INTERNAL_ERROR;
+    }
+}
+
+// As read_file: look in the cache, and if it's not there decompress the whole
+// extent and add it. Without a cache, decompress only as far as we need to.
+static bool read_extent(extent_cache* ec, uint8_t type, extent* ext, uint32_t off, uint32_t len, uint8_t* data) {
+    uint8_t* decomp;
+    uint32_t outlen;
+
+    if (extent_cache_read(ec, ext->address, ext->generation, off, data, len))
+        return true;
+
+    outlen = ec->max_size > 0 ? ext->inlen : off + len;
+
+    decomp = malloc(outlen);
+
+    if (!NT_SUCCESS(decompress_extent(type, ext, decomp, outlen))) {
+        free(decomp);
+        return false;
+    }
+
+    memcpy(data, decomp + off, len);
+
+    if (ec->max_size > 0)
+        extent_cache_insert(ec, ext->address, ext->generation, decomp, outlen);
+    else
+        free(decomp);
+
+    return true;
+}
+
+static extent* pick_extent(const pattern* pat, extent* exts, unsigned int num_extents, uint32_t* seed) {
+    unsigned int hot = (unsigned int)(((uint64_t)num_extents * pat->hot_extents_percent) / 100);
+
+    if (hot == 0)
+        hot = 1;
+
+    if (hot >= num_extents || rnd(seed) % 100 < pat->hot_percent)
+        return &exts[rnd(seed) % hot];
+    else
+        return &exts[hot + (rnd(seed) % (num_extents - hot))];
+}
+
+static bool check(uint8_t type, extent* exts, unsigned int num_extents, uint32_t read_size) {
+    extent_cache ec;
+    uint8_t* buf = malloc(read_size);
+    uint32_t seed = 0xcafebabe;
+    bool ret = false;
+
+    extent_cache_init(&ec, 0x800000);
+
+    // what comes out must match what went in, whether it's from the cache or not
+    for (unsigned int i = 0; i < 10000; i++) {
+        extent* ext = &exts[rnd(&seed) % min(num_extents, 16)];
+        uint32_t off, len;
+
+        if (ext->inlen <= read_size) {
+            off = 0;
+            len = ext->inlen;
+        } else {
+            off = rnd(&seed) % (ext->inlen - read_size);
+            len = read_size;
+        }
+
+        if (!read_extent(&ec, type, ext, off, len, buf)) {
+            fprintf(stderr, "Decompression failed.\n");
+            goto end;
+        }
+
+        if (memcmp(buf, ext->in + off, len)) {
+            fprintf(stderr, "Read of %x bytes at %x in extent %" PRIx64 " returned the wrong data.\n", len, off, ext->address);
+            goto end;
+        }
+    }
+
+    if (ec.hits == 0) {
+        fprintf(stderr, "Nothing was found in the cache.\n");
+        goto end;
+    }
+
+    if (ec.size > ec.max_size) {
+        fprintf(stderr, "Cache holds %" PRIu64 " bytes, more than its maximum of %" PRIu64 ".\n", ec.size, ec.max_size);
+        goto end;
+    }
+
+    // a different generation at the same address isn't the same extent
+    if (extent_cache_read(&ec, exts[0].address, exts[0].generation + 1, 0, buf, min(read_size, exts[0].inlen))) {
+        fprintf(stderr, "Cache returned an extent with the wrong generation.\n");
+        goto end;
+    }
+
+    // once freed, it mustn't come back
+    read_extent(&ec, type, &exts[0], 0, min(read_size, exts[0].inlen), buf);
+    extent_cache_invalidate(&ec, exts[0].address);
+
+    if (extent_cache_read(&ec, exts[0].address, exts[0].generation, 0, buf, min(read_size, exts[0].inlen))) {
+        fprintf(stderr, "Cache returned an extent after it was invalidated.\n");
+        goto end;
+    }
+
+    if (ec.invalidations != 1) {
+        fprintf(stderr, "Expected 1 invalidation, got %" PRIu64 ".\n", ec.invalidations);
+        goto end;
+    }
+
+    // a cache big enough for one extent keeps only the last one
+    extent_cache_free(&ec);
+    extent_cache_init(&ec, EXTENT_SIZE);
+
+    for (unsigned int i = 0; i < min(num_extents, 4); i++) {
+        read_extent(&ec, type, &exts[i], 0, min(read_size, exts[i].inlen), buf);
+    }
+
+    if (num_extents > 1 && (ec.evictions != min(num_extents, 4) - 1 ||
+        extent_cache_read(&ec, exts[0].address, exts[0].generation, 0, buf, min(read_size, exts[0].inlen)))) {
+        fprintf(stderr, "Least recently used extent was not evicted.\n");
+        goto end;
+    }
+
+    ret = true;
+
+end:
+    extent_cache_free(&ec);
+    free(buf);
+
+    return ret;
+}
+
+static void bench(uint8_t type, const pattern* pat, uint64_t cache_size, extent* exts, unsigned int num_extents,
+                  uint32_t read_size, double min_time, double* base) {
+    extent_cache ec;
+    uint8_t* buf = malloc(read_size);
+    uint32_t seed = 0x12345678;
+    uint64_t reads = 0;
+    double start, elapsed, rate;
+
+    extent_cache_init(&ec, cache_size);
+
+    start = now();
+
+    do {
+        for (unsigned int i = 0; i < 1000; i++) {
+            extent* ext = pick_extent(pat, exts, num_extents, &seed);
+            uint32_t off = ext->inlen > read_size ? (rnd(&seed) % (ext->inlen - read_size)) & ~0xfff : 0;
+
+            if (!read_extent(&ec, type, ext, off, min(read_size, ext->inlen), buf)) {
+                fprintf(stderr, "Decompression failed.\n");
+                exit(1);
+            }
+
+            reads++;
+        }
+
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    rate = (double)reads / elapsed;
+
+    if (cache_size == 0)
+        *base = rate;
+
+    printf("%-8s %8" PRIu64 " %9.1f%% %12.0f %7.2fx %10" PRIu64 "\n", pat->name, cache_size / 1024,
+           ec.hits + ec.misses > 0 ? (double)ec.hits * 100.0 / (double)(ec.hits + ec.misses) : 0.0,
+           rate, *base > 0 ? rate / *base : 0.0, ec.evictions);
+
+    extent_cache_free(&ec);
+    free(buf);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: cachebench [-a algorithm] [-r readsize] [-t seconds] [file]\n\n");
+    fprintf(stderr, "Measures small random reads from the given file, or from 64 MB of synthetic text,\n");
+    fprintf(stderr, "compressed into 128 KB extents, with and without the decompressed extent cache.\n\n");
+    fprintf(stderr, "  -a <algorithm>   zlib, lzo or zstd, by default zstd\n");
+    fprintf(stderr, "  -r <readsize>    size of each read, by default 4096\n");
+    fprintf(stderr, "  -t <seconds>     minimum time for each measurement, by default 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    uint8_t type = BTRFS_COMPRESSION_ZSTD;
+    uint32_t read_size = 0x1000;
+    double min_time = 1.0;
+    uint8_t* data = NULL;
+    size_t len = 0;
+    extent* exts;
+    unsigned int num_extents, num_compressed = 0, i;
+    comp_ctx* ctx;
+
+    while ((opt = getopt(argc, argv, "a:r:t:")) != -1) {
+        switch (opt) {
+            case 'a':
+                if (!strcmp(optarg, "zlib"))
+                    type = BTRFS_COMPRESSION_ZLIB;
+                else if (!strcmp(optarg, "lzo"))
+                    type = BTRFS_COMPRESSION_LZO;
+                else if (!strcmp(optarg, "zstd"))
+                    type = BTRFS_COMPRESSION_ZSTD;
+                else {
+                    fprintf(stderr, "Unknown algorithm %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'r':
+                read_size = (uint32_t)strtoul(optarg, NULL, 0);
+
+                if (read_size == 0 || read_size > EXTENT_SIZE) {
+                    fprintf(stderr, "Invalid read size %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 't':
+                min_time = strtod(optarg, NULL);
+
+                if (min_time <= 0) {
+                    fprintf(stderr, "Invalid time %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind == argc) {
+        len = SYNTHETIC_SIZE;
+        data = malloc(len);
+        make_synthetic(data, len);
+    } else if (optind == argc - 1) {
+        if (!read_input(argv[optind], &data, &len)) {
+            free(data);
+            return 1;
+        }
+    } else {
+        usage();
+        return 1;
+    }
+
+    num_extents = (unsigned int)((len + EXTENT_SIZE - 1) / EXTENT_SIZE);
+    exts = malloc(num_extents * sizeof(extent));
+    ctx = comp_ctx_alloc();
+
+    // Only extents which compress end up compressed on disk, so only they
+    // go through the cache.
+    for (i = 0; i < num_extents; i++) {
+        extent* ext = &exts[num_compressed];
+        unsigned int space_left = 0;
+        NTSTATUS Status;
+
+        ext->in = data + ((size_t)i * EXTENT_SIZE);
+        ext->inlen = (uint32_t)min(EXTENT_SIZE, len - ((size_t)i * EXTENT_SIZE));
+        ext->comp = malloc(EXTENT_SIZE);
+        ext->address = BASE_ADDRESS + ((uint64_t)i * EXTENT_SIZE);
+        ext->generation = 1;
+
+        if (type == BTRFS_COMPRESSION_ZLIB)
+            Status = zlib_compress(ext->in, ext->inlen, ext->comp, ext->inlen, 3, &space_left, ctx);
+        else if (type == BTRFS_COMPRESSION_LZO)
+            Status = lzo_compress(ext->in, ext->inlen, ext->comp, ext->inlen, &space_left, ctx);
+        else
+            Status = zstd_compress(ext->in, ext->inlen, ext->comp, ext->inlen, 3, &space_left, ctx);
+
+        if (!NT_SUCCESS(Status)) {
+            fprintf(stderr, "Compression failed (error %08x).\n", (uint32_t)Status);
+            return 1;
+        }
+
+        if (space_left == 0) {
+            free(ext->comp);
+            continue;
+        }
+
+        ext->complen = ext->inlen - space_left;
+        num_compressed++;
+    }
+
+    comp_ctx_free(ctx);
+
+    if (num_compressed == 0) {
+        fprintf(stderr, "Nothing compressed.\n");
+        return 1;
+    }
+
+    if (!check(type, exts, num_compressed, read_size))
+        return 1;
+
+    printf("%u of %u extents compressed, %u-byte reads\n\n", num_compressed, num_extents, read_size);
+    printf("pattern  cache KB  hit rate      reads/s   gain  evictions\n");
+
+    for (unsigned int p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        double base = 0;
+
+        for (unsigned int c = 0; c < sizeof(cache_sizes) / sizeof(cache_sizes[0]); c++) {
+            bench(type, &patterns[p], cache_sizes[c], exts, num_compressed, read_size, min_time, &base);
+        }
+    }
+
+    for (i = 0; i < num_compressed; i++) {
+        free(exts[i].comp);
+    }
+
+    free(exts);
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,420 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Benchmark for compress.c, built in user mode. The input is split into parts
+// the size of a compressed extent, as write_compressed does, and each part is
+// compressed and decompressed in turn, once setting up the compressor for
+// every part as the driver used to, and once reusing a calc thread's context.
+// It also checks compression_heuristic's verdict on each part against what
+// the compressors actually manage.
+
+#include "../compress-shim.h"
+#include "bench-common.h"
+#include "../btrfs.h"
+#include <stdio.h>
+#include <getopt.h>
+
+#define PART_SIZE 0x20000 // COMPRESSED_EXTENT_SIZE
+#define SYNTHETIC_SIZE 0x1000000
+#define SYNTHETIC_TEXT 0xc00000 // the rest is noise
+#define SECTOR_SIZE 0x1000
+#define ROUNDS 9
+
+typedef struct {
+    uint8_t type;
+    const char* name;
+    unsigned int def_level;
+    unsigned int max_level;
+    bool decompress_ctx; // whether decompression uses the context
+} algorithm;
+
+static const algorithm algorithms[] = {
+    { BTRFS_COMPRESSION_ZLIB, "zlib", 3, 9,  false },
+    { BTRFS_COMPRESSION_LZO,  "lzo",  0, 0,  false },
+    { BTRFS_COMPRESSION_ZSTD, "zstd", 3, 15, true },
+};
+
+typedef struct {
+    uint8_t* in;
+    uint32_t inlen;
+    uint8_t* comp;
+    uint32_t complen; // 0 if it didn't compress
+    bool heuristic; // what compression_heuristic thought
+} part;
+
+typedef struct {
+    unsigned int rejected; // parts the heuristic turned down...
+    unsigned int rejected_compressible; // ...which would have saved a sector
+    unsigned int accepted_incompressible; // parts it let through which didn't
+} heuristic_result;
+
+static NTSTATUS compress_part(uint8_t type, unsigned int level, part* p, uint8_t* out, comp_ctx* ctx) {
+    NTSTATUS Status;
+    unsigned int space_left = 0;
+
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            Status = zlib_compress(p->in, p->inlen, out, p->inlen, level, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            Status = lzo_compress(p->in, p->inlen, out, p->inlen, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            Status = zstd_compress(p->in, p->inlen, out, p->inlen, level, &space_left, ctx);
+        break;
+
+        default:
+            return STATUS_INTERNAL_ERROR;
+    }
+
+    if (NT_SUCCESS(Status))
+        p->complen = space_left > 0 ? p->inlen - space_left : 0;
+
+    return Status;
+}
+
+static NTSTATUS decompress_part(uint8_t type, part* p, uint8_t* out, comp_ctx* ctx) {
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            return zlib_decompress(p->comp, p->complen, out, p->inlen);
+
+        case BTRFS_COMPRESSION_LZO:
+            // as read.c does, skipping the overall length
+            return lzo_decompress(p->comp + sizeof(uint32_t), p->complen - sizeof(uint32_t), out, p->inlen, sizeof(uint32_t));
+
+        case BTRFS_COMPRESSION_ZSTD:
+            return zstd_decompress(p->comp, p->complen, out, p->inlen, ctx);
+
+        default:
+            return STATUS_INTERNAL_ERROR;
+    }
+}
+
+// Runs through all the parts until at least min_time has gone by, and
+// returns the throughput in MB/s of uncompressed data.
+static double run(const algorithm* alg, unsigned int level, part* parts, unsigned int num_parts, bool decompress,
+                  bool reuse, double min_time, uint8_t* out) {
+    comp_ctx* ctx = reuse ? comp_ctx_alloc() : NULL;
+    uint64_t bytes = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (unsigned int i = 0; i < num_parts; i++) {
+            NTSTATUS Status;
+
+            if (decompress) {
+                if (parts[i].complen == 0)
+                    continue;
+
+                Status = decompress_part(alg->type, &parts[i], out, ctx);
+            } else
+                Status = compress_part(alg->type, level, &parts[i], out, ctx);
+
+            if (!NT_SUCCESS(Status)) {
+                fprintf(stderr, "%s %s failed (error %08x).\n", alg->name, decompress ? "decompression" : "compression",
+                        (uint32_t)Status);
+                exit(1);
+            }
+
+            bytes += parts[i].inlen;
+        }
+
+        elapsed = now() - start;
+    } while (elapsed < min_time && bytes > 0);
+
+    if (ctx)
+        comp_ctx_free(ctx);
+
+    return elapsed > 0 ? (double)bytes / elapsed / 1048576.0 : 0;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// The fresh and reused runs take turns, swapping which goes first each round,
+// so that the CPU's clock speed and whatever else is running affect both the
+// same. Returns the median of each.
+static void compare(const algorithm* alg, unsigned int level, part* parts, unsigned int num_parts, bool decompress,
+                    double min_time, uint8_t* out, double* fresh, double* reused) {
+    double f[ROUNDS], r[ROUNDS];
+
+    for (unsigned int i = 0; i < ROUNDS; i++) {
+        if (i & 1) {
+            r[i] = run(alg, level, parts, num_parts, decompress, true, min_time / ROUNDS, out);
+            f[i] = run(alg, level, parts, num_parts, decompress, false, min_time / ROUNDS, out);
+        } else {
+            f[i] = run(alg, level, parts, num_parts, decompress, false, min_time / ROUNDS, out);
+            r[i] = run(alg, level, parts, num_parts, decompress, true, min_time / ROUNDS, out);
+        }
+    }
+
+    qsort(f, ROUNDS, sizeof(double), cmp_double);
+    qsort(r, ROUNDS, sizeof(double), cmp_double);
+
+    *fresh = f[ROUNDS / 2];
+    *reused = r[ROUNDS / 2];
+}
+
+static void bench(const algorithm* alg, unsigned int level, part* parts, unsigned int num_parts, double min_time, uint8_t* out,
+                  heuristic_result* hr) {
+    uint64_t total = 0, comp_total = 0;
+    double c_fresh, c_reuse, d_fresh, d_reuse;
+
+    memset(hr, 0, sizeof(heuristic_result));
+
+    // compress everything once, to get the ratio and something to decompress
+    for (unsigned int i = 0; i < num_parts; i++) {
+        if (!NT_SUCCESS(compress_part(alg->type, level, &parts[i], parts[i].comp, NULL))) {
+            fprintf(stderr, "%s compression failed.\n", alg->name);
+            exit(1);
+        }
+
+        total += parts[i].inlen;
+        comp_total += parts[i].complen != 0 ? parts[i].complen : parts[i].inlen;
+
+        // as write_compressed, which only keeps it if it saves a sector
+        if (!parts[i].heuristic) {
+            hr->rejected++;
+
+            if (parts[i].complen != 0 && parts[i].inlen - parts[i].complen >= SECTOR_SIZE)
+                hr->rejected_compressible++;
+        } else if (parts[i].complen == 0 || parts[i].inlen - parts[i].complen < SECTOR_SIZE)
+            hr->accepted_incompressible++;
+
+        if (parts[i].complen != 0) {
+            if (!NT_SUCCESS(decompress_part(alg->type, &parts[i], out, NULL)) || memcmp(out, parts[i].in, parts[i].inlen)) {
+                fprintf(stderr, "%s round trip failed on part %u.\n", alg->name, i);
+                exit(1);
+            }
+        }
+    }
+
+    compare(alg, level, parts, num_parts, false, min_time, out, &c_fresh, &c_reuse);
+
+    printf("%-4s %5u %6.3f %10.1f %10.1f %6.2fx", alg->name, level, total > 0 ? (double)comp_total / (double)total : 0.0,
+           c_fresh, c_reuse, c_fresh > 0 ? c_reuse / c_fresh : 0.0);
+
+    // there's nothing to compare if decompression doesn't use the context
+    if (alg->decompress_ctx) {
+        compare(alg, level, parts, num_parts, true, min_time, out, &d_fresh, &d_reuse);
+
+        printf(" %10.1f %10.1f %6.2fx\n", d_fresh, d_reuse, d_fresh > 0 ? d_reuse / d_fresh : 0.0);
+    } else {
+        d_fresh = run(alg, level, parts, num_parts, true, false, min_time, out);
+
+        printf(" %10.1f %10s %7s\n", d_fresh, "-", "-");
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: compbench [-a algorithms] [-l level] [-s partsize] [-t seconds] [file...]\n\n");
+    fprintf(stderr, "Measures the throughput of compress.c on 128 KB parts of the given files, or of\n");
+    fprintf(stderr, "16 MB of synthetic text and noise, setting up the compressor for each part and reusing it.\n");
+    fprintf(stderr, "With the synthetic data, it fails if the compressibility heuristic turns down any\n");
+    fprintf(stderr, "of the text or lets through any of the noise.\n\n");
+    fprintf(stderr, "  -a <algorithms>  comma-separated list of zlib, lzo and zstd; by default all\n");
+    fprintf(stderr, "  -l <level>       compression level, by default 3\n");
+    fprintf(stderr, "  -s <partsize>    size of each part, up to 131072, by default 131072\n");
+    fprintf(stderr, "  -t <seconds>     minimum time for each measurement, by default 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    bool selected[sizeof(algorithms) / sizeof(algorithms[0])];
+    bool have_algs = false;
+    unsigned int level = 0, num_parts, i;
+    uint32_t part_size = PART_SIZE;
+    double min_time = 1.0;
+    uint8_t* data = NULL;
+    size_t len = 0;
+    part* parts;
+    uint8_t* out;
+    heuristic_result hr[sizeof(algorithms) / sizeof(algorithms[0])];
+    double heuristic_time;
+    size_t text_len = 0;
+
+    memset(selected, 0, sizeof(selected));
+
+    while ((opt = getopt(argc, argv, "a:l:s:t:")) != -1) {
+        switch (opt) {
+            case 'a': {
+                char* s = strdup(optarg);
+                char* save;
+
+                for (char* tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                    for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+                        if (!strcmp(tok, algorithms[i].name))
+                            break;
+                    }
+
+                    if (i == sizeof(algorithms) / sizeof(algorithms[0])) {
+                        fprintf(stderr, "Unknown algorithm %s.\n", tok);
+                        free(s);
+                        return 1;
+                    }
+
+                    selected[i] = true;
+                }
+
+                free(s);
+                have_algs = true;
+            break;
+            }
+
+            case 'l':
+                level = (unsigned int)strtoul(optarg, NULL, 0);
+
+                if (level == 0) {
+                    fprintf(stderr, "Invalid level %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 's':
+                part_size = (uint32_t)strtoul(optarg, NULL, 0);
+
+                if (part_size < 0x1000 || part_size > PART_SIZE) {
+                    fprintf(stderr, "Invalid part size %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 't':
+                min_time = strtod(optarg, NULL);
+
+                if (min_time <= 0) {
+                    fprintf(stderr, "Invalid time %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind == argc) {
+        uint32_t seed = 0x12345678;
+
+        len = SYNTHETIC_SIZE;
+        text_len = SYNTHETIC_TEXT;
+        data = malloc(len);
+        make_synthetic(data, text_len);
+        make_random(data + text_len, len - text_len, &seed);
+    } else {
+        for (int j = optind; j < argc; j++) {
+            if (!read_input(argv[j], &data, &len)) {
+                free(data);
+                return 1;
+            }
+        }
+    }
+
+    if (len == 0) {
+        fprintf(stderr, "Nothing to compress.\n");
+        free(data);
+        return 1;
+    }
+
+    num_parts = (unsigned int)((len + part_size - 1) / part_size);
+    parts = malloc(num_parts * sizeof(part));
+    out = malloc(PART_SIZE);
+
+    for (i = 0; i < num_parts; i++) {
+        parts[i].in = data + ((size_t)i * part_size);
+        parts[i].inlen = (uint32_t)min(part_size, len - ((size_t)i * part_size));
+        parts[i].comp = malloc(PART_SIZE);
+        parts[i].complen = 0;
+    }
+
+    heuristic_time = now();
+
+    for (i = 0; i < num_parts; i++) {
+        parts[i].heuristic = compression_heuristic(parts[i].in, parts[i].inlen);
+    }
+
+    heuristic_time = now() - heuristic_time;
+
+    // With the synthetic data, we know what the heuristic ought to say.
+    if (text_len != 0) {
+        unsigned int bad_text = 0, bad_noise = 0;
+
+        for (i = 0; i < num_parts; i++) {
+            size_t off = (size_t)i * part_size;
+
+            if (off + parts[i].inlen <= text_len && !parts[i].heuristic)
+                bad_text++;
+            else if (off >= text_len && parts[i].heuristic)
+                bad_noise++;
+        }
+
+        if (bad_text != 0 || bad_noise != 0) {
+            fprintf(stderr, "Heuristic turned down %u parts of text and let through %u parts of noise.\n", bad_text, bad_noise);
+
+            for (i = 0; i < num_parts; i++) {
+                free(parts[i].comp);
+            }
+
+            free(parts);
+            free(out);
+            free(data);
+
+            return 1;
+        }
+    }
+
+    printf("%zu bytes in %u parts\n\n", len, num_parts);
+    printf("                   -------- compress MB/s --------  ------- decompress MB/s -------\n");
+    printf("alg  level  ratio      fresh     reused    gain      fresh     reused    gain\n");
+
+    for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        unsigned int l;
+
+        if (have_algs && !selected[i])
+            continue;
+
+        l = level != 0 ? min(level, algorithms[i].max_level) : algorithms[i].def_level;
+
+        bench(&algorithms[i], l, parts, num_parts, min_time, out, &hr[i]);
+    }
+
+    printf("\nheuristic: %.2f us per part\n", heuristic_time * 1000000.0 / num_parts);
+
+    for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        if (have_algs && !selected[i])
+            continue;
+
+        printf("%-4s rejected %u of %u parts, %u of which would have compressed; let through %u which didn't\n",
+               algorithms[i].name, hr[i].rejected, num_parts, hr[i].rejected_compressible, hr[i].accepted_incompressible);
+    }
+
+    for (i = 0; i < num_parts; i++) {
+        free(parts[i].comp);
+    }
+
+    free(parts);
+    free(out);
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,739 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Regression suite for compress.c, built in user mode. It runs each of the
+// driver's compressors, at a spread of levels, over a fixed corpus - text,
+// program code, a disk image and already-compressed media, generated the same
+// way every time, or the files in a directory - in 128 KB parts, as the calc
+// threads do. The results can be saved as a baseline, and a later run compared
+// against it, failing if anything compresses worse, or with -s if anything
+// has got slower by more than the threshold plus the runs' own spread.
+
+#include "../compress-shim.h"
+#include "bench-common.h"
+#include "../btrfs.h"
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define PART_SIZE 0x20000 // COMPRESSED_EXTENT_SIZE
+#define SECTOR_SIZE 0x1000
+#define CORPUS_SIZE 0x400000
+#define MAX_CORPORA 64
+#define RATIO_TOLERANCE 0.01 // compression is deterministic, so this is only for rounding
+#define SPREAD_CAP 0.1 // the most that each set of runs' spread can add to the threshold
+#define MIN_FACTOR 0.5 // and anything slower than this, relative to the baseline, always counts
+
+typedef struct {
+    uint8_t type;
+    const char* name;
+    unsigned int level;
+} config;
+
+static const config configs[] = {
+    { BTRFS_COMPRESSION_ZLIB, "zlib", 1 },
+    { BTRFS_COMPRESSION_ZLIB, "zlib", 3 },
+    { BTRFS_COMPRESSION_ZLIB, "zlib", 6 },
+    { BTRFS_COMPRESSION_ZLIB, "zlib", 9 },
+    { BTRFS_COMPRESSION_LZO,  "lzo",  0 },
+    { BTRFS_COMPRESSION_ZSTD, "zstd", 1 },
+    { BTRFS_COMPRESSION_ZSTD, "zstd", 3 },
+    { BTRFS_COMPRESSION_ZSTD, "zstd", 9 },
+    { BTRFS_COMPRESSION_ZSTD, "zstd", 15 },
+};
+
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+typedef struct {
+    char name[64];
+    uint8_t* data;
+    size_t len;
+} corpus;
+
+typedef struct {
+    uint8_t* in;
+    uint32_t inlen;
+    uint8_t* comp;
+    uint32_t complen; // 0 if it didn't compress
+} part;
+
+typedef struct {
+    char corpus[64];
+    char alg[8];
+    unsigned int level;
+    double ratio;
+    double comp_mbs; // medians
+    double decomp_mbs;
+    double comp_spread; // interquartile range, as a fraction of the median
+    double decomp_spread;
+} result;
+
+static size_t make_text(uint8_t* buf, size_t len, uint32_t* seed) {
+    static const char* words[] = {
+        "btrfs", "extent", "chunk", "the", "of", "and", "superblock", "tree", "node", "leaf", "inode",
+        "checksum", "device", "stripe", "a", "to", "in", "subvolume", "snapshot", "compression", "is", "that",
+        "which", "for", "with", "data", "metadata", "balance", "scrub", "was", "be", "it"
+    };
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char* w = words[rnd(seed) % (sizeof(words) / sizeof(words[0]))];
+        uint32_t r = rnd(seed);
+
+        while (*w && pos < len) {
+            buf[pos++] = (uint8_t)*w++;
+        }
+
+        if (pos < len)
+            buf[pos++] = r % 13 == 0 ? '.' : (r % 17 == 0 ? '\n' : ' ');
+    }
+
+    return len;
+}
+
+// Something like x86-64 code: functions made of common instructions with
+// small displacements and immediates, then tables of nearby pointers.
+static size_t make_code(uint8_t* buf, size_t len, uint32_t* seed) {
+    static const uint8_t prologue[] = { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xec };
+    static const uint8_t epilogue[] = { 0xc9, 0xc3, 0xcc, 0xcc };
+    static const uint8_t ops[][3] = {
+        { 0x48, 0x8b, 0x45 }, { 0x48, 0x89, 0x45 }, { 0x8b, 0x45, 0x00 }, { 0x89, 0x45, 0x00 },
+        { 0x48, 0x8d, 0x05 }, { 0xe8, 0x00, 0x00 }, { 0x0f, 0x84, 0x00 }, { 0x48, 0x85, 0xc0 },
+        { 0x74, 0x00, 0x00 }, { 0x75, 0x00, 0x00 }, { 0x31, 0xc0, 0x00 }, { 0x48, 0x83, 0xc4 },
+    };
+    size_t pos = 0;
+    uint64_t addr = 0x140001000;
+
+    while (pos < len) {
+        unsigned int instrs = 8 + (rnd(seed) % 120);
+
+        for (unsigned int i = 0; i < sizeof(prologue) && pos < len; i++) {
+            buf[pos++] = prologue[i];
+        }
+
+        if (pos < len)
+            buf[pos++] = (uint8_t)(8 * (1 + (rnd(seed) % 16)));
+
+        for (unsigned int i = 0; i < instrs && pos < len; i++) {
+            unsigned int op = rnd(seed) % (sizeof(ops) / sizeof(ops[0]));
+            int32_t disp = (int32_t)(rnd(seed) % 0x4000) - 0x2000;
+
+            for (unsigned int j = 0; j < 3 && pos < len; j++) {
+                if (j > 0 && ops[op][j] == 0)
+                    break;
+
+                buf[pos++] = ops[op][j];
+            }
+
+            if (op == 5 || op == 4 || op == 6) { // rel32
+                for (unsigned int j = 0; j < 4 && pos < len; j++) {
+                    buf[pos++] = (uint8_t)(disp >> (j * 8));
+                }
+            } else if (pos < len)
+                buf[pos++] = (uint8_t)(0xf8 - (8 * (rnd(seed) % 8)));
+        }
+
+        for (unsigned int i = 0; i < sizeof(epilogue) && pos < len; i++) {
+            buf[pos++] = epilogue[i];
+        }
+
+        if (rnd(seed) % 8 == 0) {
+            unsigned int ptrs = 4 + (rnd(seed) % 60);
+
+            for (unsigned int i = 0; i < ptrs; i++) {
+                addr += 0x10 + (rnd(seed) % 0x400);
+
+                for (unsigned int j = 0; j < 8 && pos < len; j++) {
+                    buf[pos++] = (uint8_t)(addr >> (j * 8));
+                }
+            }
+        }
+    }
+
+    return len;
+}
+
+// Already-compressed media: noise, with a small header every so often, as in a
+// video container.
+static size_t make_media(uint8_t* buf, size_t len, uint32_t* seed) {
+    static const uint8_t header[] = { 0x00, 0x00, 0x01, 0xb3, 0x14, 0x00, 0xf0, 0x13 };
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t chunk = 0x4000 + (rnd(seed) % 0x10000);
+
+        for (unsigned int i = 0; i < sizeof(header) && pos < len; i++) {
+            buf[pos++] = header[i];
+        }
+
+        chunk = min(chunk, len - pos);
+        make_random(buf + pos, chunk, seed);
+        pos += chunk;
+    }
+
+    return len;
+}
+
+// A disk image: lots of empty blocks, some blocks that are repeated, and the
+// rest a mixture of text, code and compressed files.
+static size_t make_vm(uint8_t* buf, size_t len, uint32_t* seed) {
+    for (size_t pos = 0; pos < len; pos += SECTOR_SIZE) {
+        size_t block = min(SECTOR_SIZE, len - pos);
+        uint32_t r = rnd(seed) % 100;
+
+        if (r < 50)
+            memset(buf + pos, 0, block);
+        else if (r < 60 && pos >= 0x10 * SECTOR_SIZE)
+            memcpy(buf + pos, buf + pos - ((1 + (rnd(seed) % 0x10)) * SECTOR_SIZE), block);
+        else if (r < 75)
+            make_text(buf + pos, block, seed);
+        else if (r < 90)
+            make_code(buf + pos, block, seed);
+        else
+            make_random(buf + pos, block, seed);
+    }
+
+    return len;
+}
+
+static void add_standard_corpora(corpus* corpora, unsigned int* num_corpora) {
+    static const struct {
+        const char* name;
+        size_t (*make)(uint8_t*, size_t, uint32_t*);
+    } standard[] = {
+        { "text", make_text },
+        { "code", make_code },
+        { "vm", make_vm },
+        { "media", make_media },
+    };
+
+    for (unsigned int i = 0; i < sizeof(standard) / sizeof(standard[0]); i++) {
+        corpus* c = &corpora[(*num_corpora)++];
+        uint32_t seed = 0x12345678 + i;
+
+        strcpy(c->name, standard[i].name);
+        c->len = CORPUS_SIZE;
+        c->data = malloc(c->len);
+        standard[i].make(c->data, c->len, &seed);
+    }
+}
+
+// Every regular file in dir is a corpus of its own, named after the file.
+static bool add_dir_corpora(const char* dir, corpus* corpora, unsigned int* num_corpora) {
+    DIR* d = opendir(dir);
+    struct dirent* de;
+
+    if (!d) {
+        fprintf(stderr, "Could not open %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    while ((de = readdir(d))) {
+        char fn[4096];
+        struct stat st;
+        corpus* c;
+
+        snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+
+        if (stat(fn, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+            continue;
+
+        if (*num_corpora == MAX_CORPORA) {
+            fprintf(stderr, "Too many files in %s.\n", dir);
+            closedir(d);
+            return false;
+        }
+
+        c = &corpora[*num_corpora];
+
+        snprintf(c->name, sizeof(c->name), "%.63s", de->d_name);
+
+        // spaces would confuse the baseline file
+        for (char* s = c->name; *s; s++) {
+            if (*s == ' ')
+                *s = '_';
+        }
+
+        c->data = NULL;
+        c->len = 0;
+
+        if (!read_input(fn, &c->data, &c->len)) {
+            closedir(d);
+            return false;
+        }
+
+        (*num_corpora)++;
+    }
+
+    closedir(d);
+
+    return true;
+}
+
+static NTSTATUS compress_part(const config* cfg, part* p, comp_ctx* ctx) {
+    NTSTATUS Status;
+    unsigned int space_left = 0;
+
+    switch (cfg->type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            Status = zlib_compress(p->in, p->inlen, p->comp, p->inlen, cfg->level, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            Status = lzo_compress(p->in, p->inlen, p->comp, p->inlen, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            Status = zstd_compress(p->in, p->inlen, p->comp, p->inlen, cfg->level, &space_left, ctx);
+        break;
+
+        default:
+            return STATUS_INTERNAL_ERROR;
+    }
+
+    if (NT_SUCCESS(Status))
+        p->complen = space_left > 0 ? p->inlen - space_left : 0;
+
+    return Status;
+}
+
+static NTSTATUS decompress_part(const config* cfg, part* p, uint8_t* out, comp_ctx* ctx) {
+    switch (cfg->type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            return zlib_decompress(p->comp, p->complen, out, p->inlen);
+
+        case BTRFS_COMPRESSION_LZO:
+            return lzo_decompress(p->comp + sizeof(uint32_t), p->complen - sizeof(uint32_t), out, p->inlen, sizeof(uint32_t));
+
+        case BTRFS_COMPRESSION_ZSTD:
+            return zstd_decompress(p->comp, p->complen, out, p->inlen, ctx);
+
+        default:
+            return STATUS_INTERNAL_ERROR;
+    }
+}
+
+// Goes round the parts until min_time has passed, and returns MB/s of
+// uncompressed data. Decompression only counts the parts that compressed, as
+// only they would be compressed on disk.
+static double run(const config* cfg, part* parts, unsigned int num_parts, bool decompress, double min_time, uint8_t* out) {
+    comp_ctx* ctx = comp_ctx_alloc();
+    uint64_t bytes = 0;
+    // CPU time rather than wall time, so that a busy CI machine pre-empting us
+    // doesn't look like a regression
+    double start = cpu_now(), elapsed;
+
+    do {
+        for (unsigned int i = 0; i < num_parts; i++) {
+            NTSTATUS Status;
+
+            if (decompress) {
+                if (parts[i].complen == 0)
+                    continue;
+
+                Status = decompress_part(cfg, &parts[i], out, ctx);
+            } else
+                Status = compress_part(cfg, &parts[i], ctx);
+
+            if (!NT_SUCCESS(Status)) {
+                fprintf(stderr, "%s %s failed (error %08x).\n", cfg->name, decompress ? "decompression" : "compression",
+                        (uint32_t)Status);
+                exit(1);
+            }
+
+            bytes += parts[i].inlen;
+
+            // the slow levels can take a while to get through the whole corpus
+            elapsed = cpu_now() - start;
+            if (elapsed >= min_time)
+                break;
+        }
+
+        elapsed = cpu_now() - start;
+    } while (elapsed < min_time && bytes > 0);
+
+    comp_ctx_free(ctx);
+
+    return elapsed > 0 ? (double)bytes / elapsed / 1048576.0 : 0;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Sorts the measurements, and returns the median and the interquartile range
+// relative to it.
+static double median(double* v, unsigned int n, double* spread) {
+    double med;
+
+    qsort(v, n, sizeof(double), cmp_double);
+
+    med = n % 2 ? v[n / 2] : (v[(n / 2) - 1] + v[n / 2]) / 2;
+
+    *spread = med > 0 ? (v[n - 1 - (n / 4)] - v[n / 4]) / med : 0;
+
+    return med;
+}
+
+// Returns false if a part didn't come back as it went in.
+static bool bench(const config* cfg, corpus* c, part* parts, unsigned int num_parts, double min_time, unsigned int reps,
+                  uint8_t* out, result* r) {
+    uint64_t total = 0, stored = 0;
+    double* comp_mbs;
+    double* decomp_mbs;
+
+    for (unsigned int i = 0; i < num_parts; i++) {
+        if (!NT_SUCCESS(compress_part(cfg, &parts[i], NULL))) {
+            fprintf(stderr, "%s compression failed on part %u of %s.\n", cfg->name, i, c->name);
+            return false;
+        }
+
+        total += parts[i].inlen;
+
+        // as write_compressed, which only keeps it if it saves a sector
+        if (parts[i].complen != 0 && parts[i].inlen - parts[i].complen >= SECTOR_SIZE)
+            stored += sector_align(parts[i].complen, SECTOR_SIZE);
+        else
+            stored += sector_align(parts[i].inlen, SECTOR_SIZE);
+
+        if (parts[i].complen != 0) {
+            if (!NT_SUCCESS(decompress_part(cfg, &parts[i], out, NULL)) || memcmp(out, parts[i].in, parts[i].inlen)) {
+                fprintf(stderr, "%s level %u round trip failed on part %u of %s.\n", cfg->name, cfg->level, i, c->name);
+                return false;
+            }
+        }
+    }
+
+    snprintf(r->corpus, sizeof(r->corpus), "%.63s", c->name);
+    snprintf(r->alg, sizeof(r->alg), "%.7s", cfg->name);
+    r->level = cfg->level;
+    r->ratio = (double)stored / (double)total;
+
+    // The median rather than the best, as one lucky run would make the
+    // baseline impossible to meet.
+    comp_mbs = malloc(reps * sizeof(double));
+    decomp_mbs = malloc(reps * sizeof(double));
+
+    if (!comp_mbs || !decomp_mbs) {
+        fprintf(stderr, "Out of memory.\n");
+        free(comp_mbs);
+        free(decomp_mbs);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < reps; i++) {
+        comp_mbs[i] = run(cfg, parts, num_parts, false, min_time, out);
+        decomp_mbs[i] = run(cfg, parts, num_parts, true, min_time, out);
+    }
+
+    r->comp_mbs = median(comp_mbs, reps, &r->comp_spread);
+    r->decomp_mbs = median(decomp_mbs, reps, &r->decomp_spread);
+
+    free(comp_mbs);
+    free(decomp_mbs);
+
+    return true;
+}
+
+static bool write_baseline(const char* fn, result* results, unsigned int num_results) {
+    FILE* f = fopen(fn, "w");
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", fn, strerror(errno));
+        return false;
+    }
+
+    fprintf(f, "# corpus alg level ratio compress-MB/s decompress-MB/s compress-spread decompress-spread\n");
+
+    for (unsigned int i = 0; i < num_results; i++) {
+        fprintf(f, "%s %s %u %.4f %.1f %.1f %.4f %.4f\n", results[i].corpus, results[i].alg, results[i].level, results[i].ratio,
+                results[i].comp_mbs, results[i].decomp_mbs, results[i].comp_spread, results[i].decomp_spread);
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+static result* read_baseline(const char* fn, unsigned int* num) {
+    FILE* f = fopen(fn, "r");
+    char line[256];
+    result* base = NULL;
+
+    *num = 0;
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", fn, strerror(errno));
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        result r;
+        int fields;
+
+        if (line[0] == '#')
+            continue;
+
+        // older baselines don't have the spreads
+        r.comp_spread = r.decomp_spread = 0;
+
+        fields = sscanf(line, "%63s %7s %u %lf %lf %lf %lf %lf", r.corpus, r.alg, &r.level, &r.ratio, &r.comp_mbs, &r.decomp_mbs,
+                        &r.comp_spread, &r.decomp_spread);
+
+        if (fields != 6 && fields != 8)
+            continue;
+
+        base = realloc(base, (*num + 1) * sizeof(result));
+        base[(*num)++] = r;
+    }
+
+    fclose(f);
+
+    return base;
+}
+
+// Whether mbs is more than the threshold slower than base_mbs, allowing for the
+// spread of both sets of measurements. The spreads are capped, and so is the
+// whole allowance, so that a noisy machine can't let everything through.
+static bool is_slower(double mbs, double spread, double base_mbs, double base_spread, double threshold) {
+    double factor = 1.0 - threshold - min(spread, SPREAD_CAP) - min(base_spread, SPREAD_CAP);
+
+    if (factor < min(MIN_FACTOR, 1.0 - threshold))
+        factor = min(MIN_FACTOR, 1.0 - threshold);
+
+    return mbs < base_mbs * factor;
+}
+
+// Compares a result with the baseline. Sets *worse if the ratio has got
+// worse, and returns a description of what's got slower, or NULL if nothing
+// has.
+static const char* compare(result* r, result* base, unsigned int num_base, double threshold, bool* worse) {
+    *worse = false;
+
+    for (unsigned int i = 0; i < num_base; i++) {
+        if (strcmp(r->corpus, base[i].corpus) || strcmp(r->alg, base[i].alg) || r->level != base[i].level)
+            continue;
+
+        if (r->ratio > base[i].ratio * (1.0 + RATIO_TOLERANCE))
+            *worse = true;
+
+        if (is_slower(r->comp_mbs, r->comp_spread, base[i].comp_mbs, base[i].comp_spread, threshold))
+            return "compress";
+
+        if (is_slower(r->decomp_mbs, r->decomp_spread, base[i].decomp_mbs, base[i].decomp_spread, threshold))
+            return "decompress";
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: compsuite [-a algorithms] [-d dir] [-t seconds] [-n reps] [-w file] [-b file] [-r percent] [-s]\n\n");
+    fprintf(stderr, "Runs compress.c at a range of levels over a standard corpus of text, code, a disk image\n");
+    fprintf(stderr, "and compressed media, in 128 KB parts, and compares the results with a baseline.\n\n");
+    fprintf(stderr, "  -a <algorithms>  comma-separated list of zlib, lzo and zstd; by default all\n");
+    fprintf(stderr, "  -d <dir>         use the files in dir as the corpus instead\n");
+    fprintf(stderr, "  -t <seconds>     minimum time for each measurement, by default 0.2\n");
+    fprintf(stderr, "  -n <reps>        measurements to take the median of, by default 3\n");
+    fprintf(stderr, "  -w <file>        write the results to file, as a baseline\n");
+    fprintf(stderr, "  -b <file>        compare the results with the baseline in file, and fail if anything\n");
+    fprintf(stderr, "                   compresses worse\n");
+    fprintf(stderr, "  -r <percent>     how much slower than the baseline, beyond the measurements' spread\n");
+    fprintf(stderr, "                   (each capped at 10%%), counts as a regression, by default 10\n");
+    fprintf(stderr, "  -s               fail on regressions in speed too, rather than only reporting them\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    const char* algs = NULL;
+    const char* dir = NULL;
+    const char* write_fn = NULL;
+    const char* base_fn = NULL;
+    double min_time = 0.2, threshold = 0.1;
+    unsigned int reps = 3, num_corpora = 0, num_results = 0, num_base = 0, regressions = 0, slower = 0;
+    corpus corpora[MAX_CORPORA];
+    result* results;
+    result* base = NULL;
+    uint8_t* out;
+    bool ok = true, strict = false;
+
+    while ((opt = getopt(argc, argv, "a:d:t:n:w:b:r:s")) != -1) {
+        switch (opt) {
+            case 'a':
+                algs = optarg;
+            break;
+
+            case 'd':
+                dir = optarg;
+            break;
+
+            case 't':
+                min_time = strtod(optarg, NULL);
+
+                if (min_time <= 0) {
+                    fprintf(stderr, "Invalid time %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'n':
+                reps = (unsigned int)strtoul(optarg, NULL, 0);
+
+                if (reps == 0) {
+                    fprintf(stderr, "Invalid number of repetitions %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'w':
+                write_fn = optarg;
+            break;
+
+            case 'b':
+                base_fn = optarg;
+            break;
+
+            case 'r':
+                threshold = strtod(optarg, NULL) / 100.0;
+
+                if (threshold <= 0 || threshold >= 1) {
+                    fprintf(stderr, "Invalid threshold %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 's':
+                strict = true;
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+        return 1;
+    }
+
+    if (base_fn) {
+        base = read_baseline(base_fn, &num_base);
+
+        if (!base) {
+            fprintf(stderr, "No results in %s.\n", base_fn);
+            return 1;
+        }
+    }
+
+    if (dir) {
+        if (!add_dir_corpora(dir, corpora, &num_corpora))
+            return 1;
+
+        if (num_corpora == 0) {
+            fprintf(stderr, "No files in %s.\n", dir);
+            return 1;
+        }
+    } else
+        add_standard_corpora(corpora, &num_corpora);
+
+    results = malloc(num_corpora * NUM_CONFIGS * sizeof(result));
+    out = malloc(PART_SIZE);
+
+    printf("corpus       alg  level  ratio  compress MB/s  decompress MB/s  us/part\n");
+
+    for (unsigned int i = 0; i < num_corpora && ok; i++) {
+        corpus* c = &corpora[i];
+        unsigned int num_parts = (unsigned int)((c->len + PART_SIZE - 1) / PART_SIZE);
+        part* parts = malloc(num_parts * sizeof(part));
+
+        for (unsigned int j = 0; j < num_parts; j++) {
+            parts[j].in = c->data + ((size_t)j * PART_SIZE);
+            parts[j].inlen = (uint32_t)min(PART_SIZE, c->len - ((size_t)j * PART_SIZE));
+            parts[j].comp = malloc(PART_SIZE);
+            parts[j].complen = 0;
+        }
+
+        for (unsigned int j = 0; j < NUM_CONFIGS; j++) {
+            result* r = &results[num_results];
+            const char* slowed = NULL;
+            bool worse = false;
+
+            if (algs && !strstr(algs, configs[j].name))
+                continue;
+
+            if (!bench(&configs[j], c, parts, num_parts, min_time, reps, out, r)) {
+                ok = false;
+                break;
+            }
+
+            num_results++;
+
+            if (base) {
+                slowed = compare(r, base, num_base, threshold, &worse);
+
+                if (worse)
+                    regressions++;
+
+                if (slowed)
+                    slower++;
+            }
+
+            printf("%-12s %-4s %5u %6.3f %14.1f %16.1f %8.1f%s%s%s\n", r->corpus, r->alg, r->level, r->ratio, r->comp_mbs,
+                   r->decomp_mbs, r->comp_mbs > 0 ? (double)PART_SIZE / 1048576.0 / r->comp_mbs * 1000000.0 : 0.0,
+                   worse ? "  REGRESSED: ratio" : "", slowed ? "  SLOWER: " : "", slowed ? slowed : "");
+        }
+
+        for (unsigned int j = 0; j < num_parts; j++) {
+            free(parts[j].comp);
+        }
+
+        free(parts);
+    }
+
+    if (ok && write_fn && !write_baseline(write_fn, results, num_results))
+        ok = false;
+
+    if (ok && base) {
+        if (regressions > 0)
+            printf("\n%u of %u results compress worse than %s\n", regressions, num_results, base_fn);
+
+        if (slower > 0) {
+            printf("%s%u of %u results slower than %s by more than %.0f%% plus noise%s\n", regressions > 0 ? "" : "\n", slower,
+                   num_results, base_fn, threshold * 100.0, strict ? "" : " (not failing, as -s wasn't given)");
+        }
+
+        if (regressions == 0 && slower == 0)
+            printf("\nno regressions against %s\n", base_fn);
+    }
+
+    for (unsigned int i = 0; i < num_corpora; i++) {
+        free(corpora[i].data);
+    }
+
+    free(results);
+    free(base);
+    free(out);
+
+    return ok && regressions == 0 && (!strict || slower == 0) ? 0 : 1;
+}
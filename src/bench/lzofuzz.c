@@ -0,0 +1,326 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Round-trip fuzzer for the LZO code in compress.c, built in user mode. It
+// compresses inputs of random lengths and kinds, checks that they decompress
+// to the same thing, both in full and cut short as read_file does, and then
+// feeds the decompressor corrupted and random streams, which it has to reject
+// or decode without going outside its buffers. Every buffer is allocated at
+// its exact size, so building with -fsanitize=address catches overruns.
+
+#include "../compress-shim.h"
+#include "bench-common.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#define MAX_LEN 0x20000 // COMPRESSED_EXTENT_SIZE
+
+enum {
+    KIND_RANDOM,
+    KIND_RUNS,
+    KIND_REPEATS,
+    KIND_TEXT,
+    KIND_ZEROES,
+    NUM_KINDS
+};
+
+static const char* kind_names[] = { "random", "runs", "repeats", "text", "zeroes" };
+
+static void make_input(uint8_t* data, uint32_t len, unsigned int kind, uint32_t* seed) {
+    static const char* words[] = { "the ", "btrfs ", "extent ", "compressed ", "of ", "and ", "data ", "\n", "    ", "{\n",
+                                   "}\n", "return ", "0x", "uint32_t ", "Status" };
+    uint32_t i = 0;
+
+    switch (kind) {
+        case KIND_RANDOM:
+            for (i = 0; i < len; i++) {
+                data[i] = (uint8_t)rnd(seed);
+            }
+        break;
+
+        case KIND_RUNS:
+            while (i < len) {
+                uint8_t c = (uint8_t)(rnd(seed) % 4);
+                uint32_t run = 1 + (rnd(seed) % 400);
+
+                while (run > 0 && i < len) {
+                    data[i++] = c;
+                    run--;
+                }
+            }
+        break;
+
+        case KIND_REPEATS: {
+            // a short pattern repeated with the odd flipped bit, so there's
+            // plenty of overlapping matches close by
+            uint32_t period = 1 + (rnd(seed) % 64);
+
+            for (i = 0; i < len; i++) {
+                if (i < period)
+                    data[i] = (uint8_t)rnd(seed);
+                else
+                    data[i] = data[i - period] ^ (rnd(seed) % 64 == 0 ? 1 : 0);
+            }
+            break;
+        }
+
+        case KIND_TEXT:
+            while (i < len) {
+                const char* w = words[rnd(seed) % (sizeof(words) / sizeof(words[0]))];
+
+                while (*w && i < len) {
+                    data[i++] = *w++;
+                }
+            }
+        break;
+
+        case KIND_ZEROES:
+            memset(data, 0, len);
+        break;
+    }
+}
+
+// Lengths around the page size are where things go wrong, so they come up
+// more often than they would by chance.
+static uint32_t random_length(uint32_t* seed) {
+    switch (rnd(seed) % 4) {
+        case 0:
+            return 1 + (rnd(seed) % 64);
+
+        case 1:
+            return ((1 + (rnd(seed) % 32)) * 0x1000) + (rnd(seed) % 32) - 16;
+
+        default:
+            return 1 + (rnd(seed) % MAX_LEN);
+    }
+}
+
+static bool round_trip(uint8_t* in, uint32_t len, unsigned int kind, comp_ctx* ctx, uint32_t* seed, uint8_t** pcomp, uint32_t* pcomplen) {
+    NTSTATUS Status;
+    uint8_t* comp;
+    uint8_t* out;
+    unsigned int space_left = 0;
+    uint32_t complen, partial, buflen;
+
+    *pcomp = NULL;
+
+    // we give it more space than it could possibly need, so that even random
+    // data comes out compressed
+    buflen = (len * 2) + 64;
+    comp = malloc(buflen);
+
+    Status = lzo_compress(in, len, comp, buflen, &space_left, ctx);
+    if (!NT_SUCCESS(Status)) {
+        fprintf(stderr, "lzo_compress failed on %u bytes of %s (error %08x).\n", len, kind_names[kind], (uint32_t)Status);
+        free(comp);
+        return false;
+    }
+
+    if (space_left == 0) {
+        fprintf(stderr, "lzo_compress ran out of space on %u bytes of %s.\n", len, kind_names[kind]);
+        free(comp);
+        return false;
+    }
+
+    complen = buflen - space_left;
+
+    if (*(uint32_t*)comp != complen) {
+        fprintf(stderr, "lzo_compress header says %x bytes, but wrote %x.\n", *(uint32_t*)comp, complen);
+        free(comp);
+        return false;
+    }
+
+    out = malloc(len);
+
+    Status = lzo_decompress(comp + sizeof(uint32_t), complen - sizeof(uint32_t), out, len, sizeof(uint32_t));
+    if (!NT_SUCCESS(Status) || memcmp(in, out, len)) {
+        fprintf(stderr, "Round trip of %u bytes of %s failed (error %08x).\n", len, kind_names[kind], (uint32_t)Status);
+        free(out);
+        free(comp);
+        return false;
+    }
+
+    free(out);
+
+    partial = 1 + (rnd(seed) % len);
+    out = malloc(partial);
+
+    Status = lzo_decompress(comp + sizeof(uint32_t), complen - sizeof(uint32_t), out, partial, sizeof(uint32_t));
+    if (!NT_SUCCESS(Status) || memcmp(in, out, partial)) {
+        fprintf(stderr, "Decompressing %u of %u bytes of %s failed (error %08x).\n", partial, len, kind_names[kind], (uint32_t)Status);
+        free(out);
+        free(comp);
+        return false;
+    }
+
+    free(out);
+
+    *pcomp = comp;
+    *pcomplen = complen;
+
+    return true;
+}
+
+// All we care about here is that it doesn't crash - the result doesn't matter.
+static void decompress_corrupt(uint8_t* comp, uint32_t complen, uint32_t outlen, uint32_t* seed, uint64_t* rejected) {
+    uint8_t* in;
+    uint8_t* out;
+    unsigned int changes = 1 + (rnd(seed) % 8);
+
+    // sometimes cut it short as well
+    if (rnd(seed) % 4 == 0)
+        complen = 1 + (rnd(seed) % complen);
+
+    in = malloc(complen);
+    out = malloc(outlen);
+
+    memcpy(in, comp, complen);
+
+    for (unsigned int i = 0; i < changes; i++) {
+        uint32_t off = rnd(seed) % complen;
+
+        // leave the page lengths alone most of the time, otherwise we never
+        // get as far as the LZO stream
+        if (off < sizeof(uint32_t) && rnd(seed) % 4 != 0)
+            continue;
+
+        switch (rnd(seed) % 3) {
+            case 0:
+                in[off] ^= (uint8_t)(1 << (rnd(seed) % 8));
+            break;
+
+            case 1:
+                in[off] = (uint8_t)rnd(seed);
+            break;
+
+            case 2:
+                in[off] = 0;
+            break;
+        }
+    }
+
+    if (!NT_SUCCESS(lzo_decompress(in, complen, out, outlen, sizeof(uint32_t))))
+        (*rejected)++;
+
+    free(out);
+    free(in);
+}
+
+static void decompress_random(uint32_t* seed, uint64_t* rejected) {
+    uint32_t len = 1 + (rnd(seed) % 256);
+    uint32_t outlen = 1 + (rnd(seed) % 0x2000);
+    uint8_t* in = malloc(len + sizeof(uint32_t));
+    uint8_t* out = malloc(outlen);
+
+    *(uint32_t*)in = len;
+
+    for (uint32_t i = 0; i < len; i++) {
+        in[sizeof(uint32_t) + i] = (uint8_t)rnd(seed);
+    }
+
+    if (!NT_SUCCESS(lzo_decompress(in, len + sizeof(uint32_t), out, outlen, sizeof(uint32_t))))
+        (*rejected)++;
+
+    free(out);
+    free(in);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: lzofuzz [-n iterations] [-s seed]\n\n");
+    fprintf(stderr, "Checks that the LZO code in compress.c decompresses what it compresses, and that\n");
+    fprintf(stderr, "corrupted streams don't make the decompressor go outside its buffers.\n\n");
+    fprintf(stderr, "  -n <iterations>  number of inputs to try, by default 10000\n");
+    fprintf(stderr, "  -s <seed>        random seed, by default 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    unsigned long iterations = 10000;
+    uint32_t seed = 1;
+    uint8_t* in;
+    comp_ctx* ctx;
+    uint64_t total_in = 0, total_comp = 0, corrupt = 0, corrupt_rejected = 0, random_rejected = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+
+                if (iterations == 0) {
+                    fprintf(stderr, "Invalid number of iterations %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 's':
+                seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+        return 1;
+    }
+
+    ctx = comp_ctx_alloc();
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        uint32_t len = random_length(&seed);
+        unsigned int kind = rnd(&seed) % NUM_KINDS;
+        uint8_t* comp;
+        uint32_t complen;
+
+        in = malloc(len);
+        make_input(in, len, kind, &seed);
+
+        // every other one without a context, so that we test both ways of
+        // getting the hash table
+        if (!round_trip(in, len, kind, i % 2 ? ctx : NULL, &seed, &comp, &complen)) {
+            fprintf(stderr, "Failed on iteration %lu with seed %u.\n", i, seed);
+            free(in);
+            comp_ctx_free(ctx);
+            return 1;
+        }
+
+        total_in += len;
+        total_comp += complen;
+
+        for (unsigned int j = 0; j < 4; j++) {
+            decompress_corrupt(comp + sizeof(uint32_t), complen - sizeof(uint32_t), len, &seed, &corrupt_rejected);
+            corrupt++;
+        }
+
+        decompress_random(&seed, &random_rejected);
+
+        free(comp);
+        free(in);
+    }
+
+    comp_ctx_free(ctx);
+
+    printf("%lu round trips of %" PRIu64 " bytes, compressed to %.3f\n", iterations, total_in, (double)total_comp / (double)total_in);
+    printf("%" PRIu64 " of %" PRIu64 " corrupted streams and %" PRIu64 " of %lu random streams rejected\n",
+           corrupt_rejected, corrupt, random_rejected, iterations);
+
+    return 0;
+}
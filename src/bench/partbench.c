@@ -0,0 +1,334 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Benchmark for the CompressPartSize and ReadAheadGranularity mount options,
+// built in user mode. For each part size, the input is compressed as
+// write_compressed would, and then read back as read_file would - in small
+// random reads, and sequentially in pieces the size of each read-ahead
+// granularity, as the cache manager asks for them - going through the
+// decompressed extent cache at its default size.
+
+#include "../compress-shim.h"
+#include "bench-common.h"
+#include "../btrfs.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#define SYNTHETIC_SIZE 0x2000000
+#define SECTOR_SIZE 0x1000
+#define RANDOM_READ_SIZE 0x1000
+#define BASE_ADDRESS 0x10000000
+#define DEFAULT_CACHE_SIZE 0x800000 // ExtentCacheSize
+
+static const uint32_t part_sizes[] = { 0x4000, 0x8000, 0x10000, 0x20000 };
+static const uint32_t granularities[] = { 0x10000, 0x20000, 0x40000, 0x100000 };
+
+#define NUM_GRANULARITIES (sizeof(granularities) / sizeof(granularities[0]))
+
+typedef struct {
+    uint8_t* in;
+    uint32_t inlen;
+    uint8_t* comp;
+    uint32_t complen; // 0 if it didn't compress
+} part;
+
+static NTSTATUS compress_part(uint8_t type, unsigned int level, part* p, comp_ctx* ctx) {
+    NTSTATUS Status;
+    unsigned int space_left = 0;
+
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            Status = zlib_compress(p->in, p->inlen, p->comp, p->inlen, level, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            Status = lzo_compress(p->in, p->inlen, p->comp, p->inlen, &space_left, ctx);
+        break;
+
+        default:
+            Status = zstd_compress(p->in, p->inlen, p->comp, p->inlen, level, &space_left, ctx);
+        break;
+    }
+
+    // as write_compressed, only worth it if it saves a sector
+    p->complen = NT_SUCCESS(Status) && space_left >= SECTOR_SIZE ? p->inlen - space_left : 0;
+
+    return Status;
+}
+
+static NTSTATUS decompress_part(uint8_t type, part* p, uint8_t* out, uint32_t outlen) {
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            return zlib_decompress(p->comp, p->complen, out, outlen);
+
+        case BTRFS_COMPRESSION_LZO:
+            return lzo_decompress(p->comp + sizeof(uint32_t), p->complen - sizeof(uint32_t), out, outlen, sizeof(uint32_t));
+
+        default:
+            return zstd_decompress(p->comp, p->complen, out, outlen, NULL);
+    }
+}
+
+// As read_file: each compressed part the range touches is looked for in the
+// cache, or else decompressed - all of it, and added to the cache, if we only
+// want some of it, otherwise only as far as we need.
+static bool read_range(extent_cache* ec, uint8_t type, part* parts, uint32_t part_size, uint64_t off, uint32_t len, uint8_t* data) {
+    while (len > 0) {
+        unsigned int n = (unsigned int)(off / part_size);
+        part* p = &parts[n];
+        uint32_t poff = (uint32_t)(off - ((uint64_t)n * part_size));
+        uint32_t read = min(len, p->inlen - poff);
+
+        if (p->complen == 0)
+            memcpy(data, p->in + poff, read);
+        else if (!extent_cache_read(ec, BASE_ADDRESS + ((uint64_t)n * part_size), 1, poff, data, read)) {
+            bool cache = ec->max_size > 0 && (poff != 0 || read < p->inlen);
+            uint32_t outlen = cache ? p->inlen : poff + read;
+            uint8_t* decomp = malloc(outlen);
+
+            if (!NT_SUCCESS(decompress_part(type, p, decomp, outlen))) {
+                free(decomp);
+                return false;
+            }
+
+            memcpy(data, decomp + poff, read);
+
+            if (cache)
+                extent_cache_insert(ec, BASE_ADDRESS + ((uint64_t)n * part_size), 1, decomp, outlen);
+            else
+                free(decomp);
+        }
+
+        off += read;
+        data += read;
+        len -= read;
+    }
+
+    return true;
+}
+
+static void bench(uint8_t type, unsigned int level, uint8_t* data, size_t len, uint32_t part_size, uint64_t cache_size,
+                  double min_time, comp_ctx* ctx) {
+    unsigned int num_parts = (unsigned int)((len + part_size - 1) / part_size);
+    part* parts = malloc(num_parts * sizeof(part));
+    uint8_t* buf = malloc(granularities[NUM_GRANULARITIES - 1]);
+    uint64_t disk = 0, bytes = 0, reads = 0;
+    uint32_t seed = 0x12345678;
+    extent_cache ec;
+    double start, elapsed, comp_mbs, reads_per_sec;
+
+    for (unsigned int i = 0; i < num_parts; i++) {
+        parts[i].in = data + ((size_t)i * part_size);
+        parts[i].inlen = (uint32_t)min(part_size, len - ((size_t)i * part_size));
+        parts[i].comp = malloc(parts[i].inlen);
+    }
+
+    start = now();
+
+    do {
+        for (unsigned int i = 0; i < num_parts; i++) {
+            NTSTATUS Status = compress_part(type, level, &parts[i], ctx);
+
+            if (!NT_SUCCESS(Status)) {
+                fprintf(stderr, "Compression failed (error %08x).\n", (uint32_t)Status);
+                exit(1);
+            }
+
+            bytes += parts[i].inlen;
+        }
+
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    comp_mbs = (double)bytes / elapsed / 1048576.0;
+
+    for (unsigned int i = 0; i < num_parts; i++) {
+        disk += parts[i].complen > 0 ? sector_align(parts[i].complen, SECTOR_SIZE) : sector_align(parts[i].inlen, SECTOR_SIZE);
+    }
+
+    extent_cache_init(&ec, cache_size);
+
+    start = now();
+
+    do {
+        for (unsigned int i = 0; i < 1000; i++) {
+            uint64_t off = len > RANDOM_READ_SIZE ? (((uint64_t)rnd(&seed) << 8) % (len - RANDOM_READ_SIZE)) & ~(uint64_t)0xfff : 0;
+
+            if (!read_range(&ec, type, parts, part_size, off, (uint32_t)min(RANDOM_READ_SIZE, len), buf)) {
+                fprintf(stderr, "Decompression failed.\n");
+                exit(1);
+            }
+
+            reads++;
+        }
+
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    reads_per_sec = (double)reads / elapsed;
+
+    extent_cache_free(&ec);
+
+    printf("%7u %6.3f %9.1f %10.0f", part_size / 1024, (double)disk / (double)len, comp_mbs, reads_per_sec);
+
+    for (unsigned int g = 0; g < NUM_GRANULARITIES; g++) {
+        extent_cache_init(&ec, cache_size);
+
+        bytes = 0;
+        start = now();
+
+        do {
+            for (uint64_t off = 0; off < len; off += granularities[g]) {
+                uint32_t read = (uint32_t)min(granularities[g], len - off);
+
+                if (!read_range(&ec, type, parts, part_size, off, read, buf)) {
+                    fprintf(stderr, "Decompression failed.\n");
+                    exit(1);
+                }
+
+                if (memcmp(buf, data + off, read)) {
+                    fprintf(stderr, "Data read back at %" PRIx64 " did not match.\n", off);
+                    exit(1);
+                }
+
+                bytes += read;
+            }
+
+            elapsed = now() - start;
+        } while (elapsed < min_time);
+
+        extent_cache_free(&ec);
+
+        printf(" %9.1f", (double)bytes / elapsed / 1048576.0);
+    }
+
+    printf("\n");
+
+    for (unsigned int i = 0; i < num_parts; i++) {
+        free(parts[i].comp);
+    }
+
+    free(parts);
+    free(buf);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: partbench [-a algorithm] [-l level] [-c cachesize] [-t seconds] [file]\n\n");
+    fprintf(stderr, "Compresses the given file, or 32 MB of synthetic text, in parts of 16 to 128 KB, and\n");
+    fprintf(stderr, "measures the ratio, compression speed, random 4 KB reads, and sequential reads with\n");
+    fprintf(stderr, "read-ahead granularities of 64 KB to 1 MB.\n\n");
+    fprintf(stderr, "  -a <algorithm>   zlib, lzo or zstd, by default zstd\n");
+    fprintf(stderr, "  -l <level>       compression level, by default 3\n");
+    fprintf(stderr, "  -c <cachesize>   size of the decompressed extent cache, by default 8388608\n");
+    fprintf(stderr, "  -t <seconds>     minimum time for each measurement, by default 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    uint8_t type = BTRFS_COMPRESSION_ZSTD;
+    unsigned int level = 3;
+    uint64_t cache_size = DEFAULT_CACHE_SIZE;
+    double min_time = 1.0;
+    uint8_t* data = NULL;
+    size_t len = 0;
+    comp_ctx* ctx;
+
+    while ((opt = getopt(argc, argv, "a:l:c:t:")) != -1) {
+        switch (opt) {
+            case 'a':
+                if (!strcmp(optarg, "zlib"))
+                    type = BTRFS_COMPRESSION_ZLIB;
+                else if (!strcmp(optarg, "lzo"))
+                    type = BTRFS_COMPRESSION_LZO;
+                else if (!strcmp(optarg, "zstd"))
+                    type = BTRFS_COMPRESSION_ZSTD;
+                else {
+                    fprintf(stderr, "Unknown algorithm %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'l':
+                level = (unsigned int)strtoul(optarg, NULL, 0);
+
+                if (level == 0) {
+                    fprintf(stderr, "Invalid level %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'c':
+                cache_size = strtoull(optarg, NULL, 0);
+            break;
+
+            case 't':
+                min_time = strtod(optarg, NULL);
+
+                if (min_time <= 0) {
+                    fprintf(stderr, "Invalid time %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind == argc) {
+        len = SYNTHETIC_SIZE;
+        data = malloc(len);
+        make_synthetic(data, len);
+    } else if (optind == argc - 1) {
+        if (!read_input(argv[optind], &data, &len)) {
+            free(data);
+            return 1;
+        }
+    } else {
+        usage();
+        return 1;
+    }
+
+    if (len == 0) {
+        fprintf(stderr, "Nothing to compress.\n");
+        free(data);
+        return 1;
+    }
+
+    ctx = comp_ctx_alloc();
+
+    printf("%zu bytes, cache %" PRIu64 " KB\n\n", len, cache_size / 1024);
+    printf("%7s %6s %9s %10s  sequential MB/s with read-ahead of\n", "part KB", "ratio", "comp MB/s", "4K reads/s");
+    printf("%35s", "");
+
+    for (unsigned int g = 0; g < NUM_GRANULARITIES; g++) {
+        printf(" %6u KB", granularities[g] / 1024);
+    }
+
+    printf("\n");
+
+    for (unsigned int i = 0; i < sizeof(part_sizes) / sizeof(part_sizes[0]); i++) {
+        bench(type, level, data, len, part_sizes[i], cache_size, min_time, ctx);
+    }
+
+    comp_ctx_free(ctx);
+    free(data);
+
+    return 0;
+}
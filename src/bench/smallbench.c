@@ -0,0 +1,302 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Small-file benchmark. Unlike the others, this one doesn't run any of the
+// driver's code itself - it creates, writes, reads and deletes lots of small
+// files in a directory, and times each step, so it has to be pointed at a
+// mounted volume. Files no bigger than MaxInline are stored inline, which is
+// what it's meant to exercise. Built under Cygwin or MSYS2 it works on a
+// WinBtrfs volume; on Linux it gives figures for the kernel driver to compare.
+
+#include "bench-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#define DEFAULT_FILES 10000
+#define DEFAULT_SIZE 1000 // comfortably under the default MaxInline of 2048
+#define PATH_LEN 4096
+
+typedef struct {
+    const char* name;
+    double time;
+    uint64_t bytes;
+} phase;
+
+static void fill(uint8_t* data, uint32_t len, unsigned long n) {
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = (uint8_t)((n * 31) + i);
+    }
+}
+
+static void file_name(char* buf, size_t buflen, const char* dir, unsigned long n) {
+    snprintf(buf, buflen, "%s/%08lx", dir, n);
+}
+
+static bool do_create(const char* dir, unsigned long files) {
+    char name[PATH_LEN + 32];
+
+    for (unsigned long n = 0; n < files; n++) {
+        int fd;
+
+        file_name(name, sizeof(name), dir, n);
+
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Could not create %s: %s\n", name, strerror(errno));
+            return false;
+        }
+
+        close(fd);
+    }
+
+    return true;
+}
+
+// Writes each file in pieces of writesize, each one an append, as a program
+// writing a config file line by line would.
+static bool do_write(const char* dir, unsigned long files, uint32_t size, uint32_t writesize, bool sync, uint8_t* data) {
+    char name[PATH_LEN + 32];
+
+    for (unsigned long n = 0; n < files; n++) {
+        int fd;
+
+        file_name(name, sizeof(name), dir, n);
+        fill(data, size, n);
+
+        fd = open(name, O_WRONLY | O_APPEND);
+        if (fd == -1) {
+            fprintf(stderr, "Could not open %s: %s\n", name, strerror(errno));
+            return false;
+        }
+
+        for (uint32_t off = 0; off < size; off += writesize) {
+            uint32_t len = size - off < writesize ? size - off : writesize;
+
+            if (write(fd, data + off, len) != (ssize_t)len) {
+                fprintf(stderr, "Could not write to %s: %s\n", name, strerror(errno));
+                close(fd);
+                return false;
+            }
+        }
+
+        if (sync && fsync(fd) == -1) {
+            fprintf(stderr, "Could not sync %s: %s\n", name, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        close(fd);
+    }
+
+    return true;
+}
+
+static bool do_read(const char* dir, unsigned long files, uint32_t size, uint8_t* data, uint8_t* expected) {
+    char name[PATH_LEN + 32];
+
+    for (unsigned long n = 0; n < files; n++) {
+        int fd;
+        ssize_t ret;
+
+        file_name(name, sizeof(name), dir, n);
+
+        fd = open(name, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Could not open %s: %s\n", name, strerror(errno));
+            return false;
+        }
+
+        // ask for one more byte than there is, so we know we got the end
+        ret = read(fd, data, size + 1);
+
+        close(fd);
+
+        if (ret != (ssize_t)size) {
+            fprintf(stderr, "Read %zd bytes from %s, expected %u.\n", ret, name, size);
+            return false;
+        }
+
+        fill(expected, size, n);
+
+        if (memcmp(data, expected, size)) {
+            fprintf(stderr, "%s did not read back what was written.\n", name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool do_delete(const char* dir, unsigned long files) {
+    char name[PATH_LEN + 32];
+
+    for (unsigned long n = 0; n < files; n++) {
+        file_name(name, sizeof(name), dir, n);
+
+        // if we failed partway through creating them, they won't all be there
+        if (unlink(name) == -1 && errno != ENOENT) {
+            fprintf(stderr, "Could not delete %s: %s\n", name, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: smallbench [-n files] [-s size] [-w writesize] [-f] [dir]\n\n");
+    fprintf(stderr, "Creates, writes, reads back and deletes lots of small files in a new directory\n");
+    fprintf(stderr, "within dir, or the current directory, and reports how many of each it can do a second.\n\n");
+    fprintf(stderr, "  -n <files>      number of files, by default %u\n", DEFAULT_FILES);
+    fprintf(stderr, "  -s <size>       size of each file in bytes, by default %u\n", DEFAULT_SIZE);
+    fprintf(stderr, "  -w <writesize>  write each file in appends of this many bytes, by default all at once\n");
+    fprintf(stderr, "  -f              fsync each file after writing it\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    unsigned long files = DEFAULT_FILES;
+    uint32_t size = DEFAULT_SIZE, writesize = 0;
+    bool sync = false, ok;
+    const char* parent = ".";
+    char dir[PATH_LEN];
+    uint8_t* data;
+    uint8_t* expected;
+    phase phases[4];
+    double start;
+
+    while ((opt = getopt(argc, argv, "n:s:w:f")) != -1) {
+        switch (opt) {
+            case 'n':
+                files = strtoul(optarg, NULL, 0);
+
+                if (files == 0) {
+                    fprintf(stderr, "Invalid number of files %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 's':
+                size = (uint32_t)strtoul(optarg, NULL, 0);
+
+                if (size == 0 || size > 0x100000) {
+                    fprintf(stderr, "Invalid size %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'w':
+                writesize = (uint32_t)strtoul(optarg, NULL, 0);
+
+                if (writesize == 0) {
+                    fprintf(stderr, "Invalid write size %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'f':
+                sync = true;
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind < argc - 1) {
+        usage();
+        return 1;
+    }
+
+    if (optind == argc - 1)
+        parent = argv[optind];
+
+    if (writesize == 0 || writesize > size)
+        writesize = size;
+
+    snprintf(dir, sizeof(dir), "%s/smallbench.%u", parent, (unsigned int)getpid());
+
+    if (mkdir(dir, 0755) == -1) {
+        fprintf(stderr, "Could not create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    data = malloc(size + 1);
+    expected = malloc(size);
+
+    printf("%lu files of %u bytes, written %u bytes at a time%s\n\n", files, size, writesize, sync ? ", with fsync" : "");
+
+    phases[0].name = "create";
+    phases[0].bytes = 0;
+    start = now();
+    ok = do_create(dir, files);
+    phases[0].time = now() - start;
+
+    if (ok) {
+        phases[1].name = "write";
+        phases[1].bytes = (uint64_t)files * size;
+        start = now();
+        ok = do_write(dir, files, size, writesize, sync, data);
+        phases[1].time = now() - start;
+    }
+
+    if (ok) {
+        phases[2].name = "read";
+        phases[2].bytes = (uint64_t)files * size;
+        start = now();
+        ok = do_read(dir, files, size, data, expected);
+        phases[2].time = now() - start;
+    }
+
+    // clean up whatever happens
+    phases[3].name = "delete";
+    phases[3].bytes = 0;
+    start = now();
+    if (!do_delete(dir, files))
+        ok = false;
+    phases[3].time = now() - start;
+
+    rmdir(dir);
+
+    free(expected);
+    free(data);
+
+    if (!ok)
+        return 1;
+
+    printf("%-8s %12s %10s\n", "", "files/s", "MB/s");
+
+    for (unsigned int i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        printf("%-8s %12.0f", phases[i].name, (double)files / phases[i].time);
+
+        if (phases[i].bytes != 0)
+            printf(" %10.2f", (double)phases[i].bytes / phases[i].time / 1048576.0);
+
+        printf("\n");
+    }
+
+    return 0;
+}
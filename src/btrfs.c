@@ -85,7 +85,14 @@ uint32_t mount_allow_degraded = 0;
 uint32_t mount_readonly = 0;
 uint32_t mount_no_root_dir = 0;
 uint32_t mount_nodatacow = 0;
+uint32_t mount_extent_cache_size = 0x800000;
+uint32_t mount_adaptive_level = 0;
+uint32_t mount_adaptive_level_min = 1;
+uint32_t mount_adaptive_level_max = 9;
+uint32_t mount_compress_part_size = COMPRESSED_EXTENT_SIZE;
+uint32_t mount_read_ahead_granularity = READ_AHEAD_GRANULARITY;
 uint32_t no_pnp = 0;
+uint32_t send_buffer_size = 4;
 bool log_started = false;
 UNICODE_STRING log_device, log_file, registry_path;
 tPsUpdateDiskCounters fPsUpdateDiskCounters;
@@ -2120,6 +2127,9 @@ void uninit(_In_ device_extension* Vcb) {
         ExFreePool(r);
     }
 
+    if (Vcb->root_index)
+        ExFreePool(Vcb->root_index);
+
     while (!IsListEmpty(&Vcb->chunks)) {
         chunk* c = CONTAINING_RECORD(RemoveHeadList(&Vcb->chunks), chunk, list_entry);
 
@@ -2183,6 +2193,8 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
     ExDeleteResourceLite(&Vcb->scrub.stats_lock);
     ExDeleteResourceLite(&Vcb->send_load_lock);
+    ExDeleteResourceLite(&Vcb->root_index_lock);
+    extent_cache_free(&Vcb->extent_cache);
 
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
     ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
@@ -2192,6 +2204,7 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeletePagedLookasideList(&Vcb->name_bit_lookaside);
     ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
     ExDeleteNPagedLookasideList(&Vcb->fcb_np_lookaside);
+    ExDeletePagedLookasideList(&Vcb->comp_buf_lookaside);
 
     ZwClose(Vcb->flush_thread_handle);
 
@@ -2336,12 +2349,14 @@ NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject
             } else {
                 LIST_ENTRY* le;
 
-                // FIXME - we need a lock here
+                ExAcquireResourceExclusiveLite(&fileref->fcb->Vcb->root_index_lock, true);
 
                 RemoveEntryList(&fileref->fcb->subvol->list_entry);
 
                 InsertTailList(&fileref->fcb->Vcb->drop_roots, &fileref->fcb->subvol->list_entry);
 
+                ExReleaseResourceLite(&fileref->fcb->Vcb->root_index_lock);
+
                 le = fileref->children.Flink;
                 while (le != &fileref->children) {
                     file_ref* fr2 = CONTAINING_RECORD(le, file_ref, list_entry);
@@ -2981,7 +2996,7 @@ NTSTATUS dev_ioctl(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG ControlCode, _In
 
 _Requires_exclusive_lock_held_(Vcb->tree_lock)
 static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ uint64_t addr,
-                         _In_ uint64_t generation, _In_opt_ traverse_ptr* tp) {
+                         _In_ uint64_t generation, _In_opt_ traverse_ptr* tp, _Out_opt_ root** pr) {
     root* r = ExAllocatePoolWithTag(PagedPool, sizeof(root), ALLOC_TAG);
     if (!r) {
         ERR("out of memory\n");
@@ -3070,9 +3085,170 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ uint64_t id, _In_ u
             break;
     }
 
+    if (pr)
+        *pr = r;
+
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS add_root_index(device_extension* Vcb, uint64_t id, uint64_t offset) {
+    root_index_entry* rie;
+
+    if (Vcb->root_index_len > 0 && Vcb->root_index[Vcb->root_index_len - 1].id == id) {
+        Vcb->root_index[Vcb->root_index_len - 1].offset = offset;
+        return STATUS_SUCCESS;
+    }
+
+    if (Vcb->root_index_len == Vcb->root_index_max) {
+        ULONG new_max = Vcb->root_index_max == 0 ? 64 : (Vcb->root_index_max * 2);
+        root_index_entry* ri2 = ExAllocatePoolWithTag(PagedPool, sizeof(root_index_entry) * new_max, ALLOC_TAG);
+
+        if (!ri2) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (Vcb->root_index) {
+            RtlCopyMemory(ri2, Vcb->root_index, sizeof(root_index_entry) * Vcb->root_index_len);
+            ExFreePool(Vcb->root_index);
+        }
+
+        Vcb->root_index = ri2;
+        Vcb->root_index_max = new_max;
+    }
+
+    rie = &Vcb->root_index[Vcb->root_index_len];
+    rie->id = id;
+    rie->offset = offset;
+    rie->parent = 0;
+    rie->loaded = false;
+
+    Vcb->root_index_len++;
+
+    return STATUS_SUCCESS;
+}
+
+static root_index_entry* find_root_index(device_extension* Vcb, uint64_t id) {
+    ULONG lo = 0, hi = Vcb->root_index_len;
+
+    // entries are added in root tree order, so the index is sorted by ID
+    while (lo < hi) {
+        ULONG mid = lo + ((hi - lo) / 2);
+
+        if (Vcb->root_index[mid].id == id)
+            return &Vcb->root_index[mid];
+        else if (Vcb->root_index[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static root* find_loaded_root(device_extension* Vcb, uint64_t id) {
+    LIST_ENTRY* le = Vcb->roots.Flink;
+
+    while (le != &Vcb->roots) {
+        root* r = CONTAINING_RECORD(le, root, list_entry);
+
+        if (r->id == id)
+            return r;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static NTSTATUS load_indexed_root(device_extension* Vcb, root_index_entry* rie, root** pr, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    ROOT_ITEM* ri;
+    root* r;
+
+    searchkey.obj_id = rie->id;
+    searchkey.obj_type = TYPE_ROOT_ITEM;
+    searchkey.offset = rie->offset;
+
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08lx\n", Status);
+        return Status;
+    }
+
+    if (keycmp(tp.item->key, searchkey)) {
+        ERR("could not find (%I64x,%x,%I64x) in root tree\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (tp.item->size < offsetof(ROOT_ITEM, byte_limit)) {
+        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, offsetof(ROOT_ITEM, byte_limit));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    ri = (ROOT_ITEM*)tp.item->data;
+
+    TRACE("loading root %I64x - address %I64x\n", rie->id, ri->block_number);
+
+    Status = add_root(Vcb, rie->id, ri->block_number, ri->generation, &tp, &r);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_root returned %08lx\n", Status);
+        return Status;
+    }
+
+    r->parent = rie->parent;
+    rie->loaded = true;
+
+    *pr = r;
+
+    return STATUS_SUCCESS;
+}
+
+// Subvolumes are only added to the root index at mount, and are loaded here when first
+// needed. Once loaded, the index entry is kept but marked, so that a subvol which has since
+// been deleted isn't brought back from its stale ROOT_ITEM.
+NTSTATUS find_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ uint64_t id, _Out_ root** pr, _In_opt_ PIRP Irp) {
+    NTSTATUS Status;
+    root_index_entry* rie;
+    root* r;
+
+    ExAcquireResourceSharedLite(&Vcb->root_index_lock, true);
+
+    r = find_loaded_root(Vcb, id);
+    rie = r ? NULL : find_root_index(Vcb, id);
+
+    ExReleaseResourceLite(&Vcb->root_index_lock);
+
+    if (r) {
+        *pr = r;
+        return STATUS_SUCCESS;
+    }
+
+    if (!rie || rie->loaded)
+        return STATUS_NOT_FOUND;
+
+    ExAcquireResourceExclusiveLite(&Vcb->root_index_lock, true);
+
+    // check again, in case another thread got here first
+    r = find_loaded_root(Vcb, id);
+
+    if (r)
+        Status = STATUS_SUCCESS;
+    else if (rie->loaded)
+        Status = STATUS_NOT_FOUND;
+    else
+        Status = load_indexed_root(Vcb, rie, &r, Irp);
+
+    ExReleaseResourceLite(&Vcb->root_index_lock);
+
+    if (NT_SUCCESS(Status))
+        *pr = r;
+
+    return Status;
+}
+
 static NTSTATUS look_for_roots(_Requires_exclusive_lock_held_(_Curr_->tree_lock) _In_ device_extension* Vcb, _In_opt_ PIRP Irp) {
     traverse_ptr tp, next_tp;
     KEY searchkey;
@@ -3100,17 +3276,29 @@ static NTSTATUS look_for_roots(_Requires_exclusive_lock_held_(_Curr_->tree_lock)
             } else {
                 TRACE("root %I64x - address %I64x\n", tp.item->key.obj_id, ri->block_number);
 
-                Status = add_root(Vcb, tp.item->key.obj_id, ri->block_number, ri->generation, &tp);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("add_root returned %08lx\n", Status);
-                    return Status;
+                if (tp.item->key.obj_id >= 0x100 && !(tp.item->key.obj_id & 0xf000000000000000)) { // subvol
+                    Status = add_root_index(Vcb, tp.item->key.obj_id, tp.item->key.offset);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_root_index returned %08lx\n", Status);
+                        return Status;
+                    }
+                } else {
+                    Status = add_root(Vcb, tp.item->key.obj_id, ri->block_number, ri->generation, &tp, NULL);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_root returned %08lx\n", Status);
+                        return Status;
+                    }
                 }
             }
-        } else if (tp.item->key.obj_type == TYPE_ROOT_BACKREF && !IsListEmpty(&Vcb->roots)) {
-            root* lastroot = CONTAINING_RECORD(Vcb->roots.Blink, root, list_entry);
-
-            if (lastroot->id == tp.item->key.obj_id)
-                lastroot->parent = tp.item->key.offset;
+        } else if (tp.item->key.obj_type == TYPE_ROOT_BACKREF) {
+            if (Vcb->root_index_len > 0 && Vcb->root_index[Vcb->root_index_len - 1].id == tp.item->key.obj_id)
+                Vcb->root_index[Vcb->root_index_len - 1].parent = tp.item->key.offset;
+            else if (!IsListEmpty(&Vcb->roots)) {
+                root* lastroot = CONTAINING_RECORD(Vcb->roots.Blink, root, list_entry);
+
+                if (lastroot->id == tp.item->key.obj_id)
+                    lastroot->parent = tp.item->key.offset;
+            }
         }
 
         b = find_next_item(Vcb, &tp, &next_tp, false, Irp);
@@ -3866,30 +4054,28 @@ void protect_superblocks(_Inout_ chunk* c) {
     }
 }
 
-NTSTATUS find_chunk_usage(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
-    LIST_ENTRY* le = Vcb->chunks.Flink;
+static root* get_block_group_root(device_extension* Vcb) {
+    if (Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_BLOCK_GROUP_TREE) {
+        if (!Vcb->block_group_root)
+            ERR("block_group_tree compat_ro flag set but no block group root found\n");
+
+        return Vcb->block_group_root;
+    } else
+        return Vcb->extent_root;
+}
+
+static NTSTATUS find_chunk_usage_range(device_extension* Vcb, root* r, LIST_ENTRY* first, LIST_ENTRY* last,
+                                       uint64_t* bytes_used, PIRP Irp) {
+    LIST_ENTRY* le = first;
     chunk* c;
     KEY searchkey;
     traverse_ptr tp;
     BLOCK_GROUP_ITEM* bgi;
     NTSTATUS Status;
-    root* r;
-
-    if (Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_BLOCK_GROUP_TREE) {
-        r = Vcb->block_group_root;
-
-        if (!r) {
-            ERR("block_group_tree compat_ro flag set but no block group root found\n");
-            return STATUS_INVALID_PARAMETER;
-        }
-    } else
-        r = Vcb->extent_root;
 
     searchkey.obj_type = TYPE_BLOCK_GROUP_ITEM;
 
-    Vcb->superblock.bytes_used = 0;
-
-    while (le != &Vcb->chunks) {
+    while (le != last) {
         c = CONTAINING_RECORD(le, chunk, list_entry);
 
         searchkey.obj_id = c->offset;
@@ -3909,7 +4095,7 @@ NTSTATUS find_chunk_usage(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
 
                 TRACE("chunk %I64x has %I64x bytes used\n", c->offset, c->used);
 
-                Vcb->superblock.bytes_used += bgi->used;
+                *bytes_used += bgi->used;
             } else {
                 ERR("(%I64x;%I64x,%x,%I64x) is %u bytes, expected %Iu\n",
                     r->id, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(BLOCK_GROUP_ITEM));
@@ -3919,6 +4105,23 @@ NTSTATUS find_chunk_usage(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
         le = le->Flink;
     }
 
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS find_chunk_usage(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
+    NTSTATUS Status;
+    root* r;
+    uint64_t bytes_used = 0;
+
+    r = get_block_group_root(Vcb);
+    if (!r)
+        return STATUS_INVALID_PARAMETER;
+
+    Status = find_chunk_usage_range(Vcb, r, Vcb->chunks.Flink, &Vcb->chunks, &bytes_used, Irp);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Vcb->superblock.bytes_used = bytes_used;
     Vcb->chunk_usage_found = true;
 
     return STATUS_SUCCESS;
@@ -3983,21 +4186,14 @@ static NTSTATUS load_sys_chunks(_In_ device_extension* Vcb) {
 
 _Ret_maybenull_
 root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
-    LIST_ENTRY* le;
+    root* r;
 
     static const char fn[] = "default";
     static uint32_t crc32 = 0x8dbfc2d2;
 
     if (Vcb->options.subvol_id != 0) {
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == Vcb->options.subvol_id)
-                return r;
-
-            le = le->Flink;
-        }
+        if (NT_SUCCESS(find_root(Vcb, Vcb->options.subvol_id, &r, Irp)))
+            return r;
     }
 
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL) {
@@ -4043,34 +4239,22 @@ root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
             goto end;
         }
 
-        le = Vcb->roots.Flink;
-        while (le != &Vcb->roots) {
-            root* r = CONTAINING_RECORD(le, root, list_entry);
-
-            if (r->id == di->key.obj_id)
-                return r;
-
-            le = le->Flink;
-        }
+        if (NT_SUCCESS(find_root(Vcb, di->key.obj_id, &r, Irp)))
+            return r;
 
         ERR("could not find root %I64x, using default instead\n", di->key.obj_id);
     }
 
 end:
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r->id == BTRFS_ROOT_FSTREE)
-            return r;
-
-        le = le->Flink;
-    }
+    if (NT_SUCCESS(find_root(Vcb, BTRFS_ROOT_FSTREE, &r, Irp)))
+        return r;
 
     return NULL;
 }
 
 void init_file_cache(_In_ PFILE_OBJECT FileObject, _In_ CC_FILE_SIZES* ccfs) {
+    fcb* fcb = FileObject->FsContext;
+
     TRACE("(%p, %p)\n", FileObject, ccfs);
 
     CcInitializeCacheMap(FileObject, ccfs, false, &cache_callbacks, FileObject);
@@ -4078,7 +4262,7 @@ void init_file_cache(_In_ PFILE_OBJECT FileObject, _In_ CC_FILE_SIZES* ccfs) {
     if (diskacc)
         fCcSetAdditionalCacheAttributesEx(FileObject, CC_ENABLE_DISK_IO_ACCOUNTING);
 
-    CcSetReadAheadGranularity(FileObject, READ_AHEAD_GRANULARITY);
+    CcSetReadAheadGranularity(FileObject, fcb->Vcb->options.read_ahead_granularity);
 }
 
 uint32_t get_num_of_processors() {
@@ -4112,6 +4296,8 @@ static NTSTATUS create_calc_threads(_In_ PDEVICE_OBJECT DeviceObject) {
     KeInitializeSpinLock(&Vcb->calcthreads.spinlock);
     KeInitializeEvent(&Vcb->calcthreads.event, NotificationEvent, false);
 
+    init_comp_levels(Vcb);
+
     RtlZeroMemory(Vcb->calcthreads.threads, sizeof(drv_calc_thread) * Vcb->calcthreads.num_threads);
 
     InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
@@ -4375,6 +4561,185 @@ static void calculate_sector_shift(device_extension* Vcb) {
     }
 }
 
+#define MOUNT_CHUNKS_PER_THREAD 256
+
+typedef struct {
+    device_extension* Vcb;
+    device* dev;
+    LIST_ENTRY* first;
+    LIST_ENTRY* last;
+    uint64_t bytes_used;
+    PIRP Irp;
+    NTSTATUS Status;
+    uint64_t time;
+    HANDLE thread;
+    KEVENT finished;
+} mount_job;
+
+static void do_mount_job(mount_job* job) {
+    LARGE_INTEGER time1, time2;
+
+    time1 = KeQueryPerformanceCounter(NULL);
+
+    if (job->dev)
+        job->Status = find_disk_holes(job->Vcb, job->dev, job->Irp);
+    else {
+        root* r = get_block_group_root(job->Vcb);
+
+        if (r)
+            job->Status = find_chunk_usage_range(job->Vcb, r, job->first, job->last, &job->bytes_used, job->Irp);
+        else
+            job->Status = STATUS_INVALID_PARAMETER;
+    }
+
+    time2 = KeQueryPerformanceCounter(NULL);
+
+    job->time = time2.QuadPart - time1.QuadPart;
+}
+
+_Function_class_(KSTART_ROUTINE)
+static void __stdcall mount_job_thread(void* context) {
+    mount_job* job = context;
+
+    do_mount_job(job);
+
+    KeSetEvent(&job->finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Block-group items and dev extents live in different trees, and each slice of
+// the chunk list touches different leaves, so these can be read concurrently.
+// The mount thread holds tree_lock exclusively while it waits.
+static NTSTATUS run_mount_jobs(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    mount_job* jobs;
+    ULONG num_jobs, num_usage_jobs = 0, num_chunks = 0, i;
+    OBJECT_ATTRIBUTES oa;
+    uint64_t bytes_used = 0;
+
+    if (!Vcb->readonly) {
+        le = Vcb->chunks.Flink;
+        while (le != &Vcb->chunks) {
+            num_chunks++;
+            le = le->Flink;
+        }
+
+        num_usage_jobs = min(get_num_of_processors(), (num_chunks + MOUNT_CHUNKS_PER_THREAD - 1) / MOUNT_CHUNKS_PER_THREAD);
+
+        if (num_usage_jobs == 0)
+            num_usage_jobs = 1;
+    }
+
+    num_jobs = num_usage_jobs;
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        num_jobs++;
+        le = le->Flink;
+    }
+
+    if (num_jobs == 0)
+        return STATUS_SUCCESS;
+
+    jobs = ExAllocatePoolWithTag(NonPagedPool, sizeof(mount_job) * num_jobs, ALLOC_TAG);
+    if (!jobs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(jobs, sizeof(mount_job) * num_jobs);
+
+    for (i = 0; i < num_jobs; i++) {
+        jobs[i].Vcb = Vcb;
+        KeInitializeEvent(&jobs[i].finished, NotificationEvent, false);
+    }
+
+    if (num_usage_jobs > 0) {
+        ULONG per_job = (num_chunks + num_usage_jobs - 1) / num_usage_jobs;
+
+        le = Vcb->chunks.Flink;
+
+        for (i = 0; i < num_usage_jobs; i++) {
+            ULONG j;
+
+            jobs[i].first = le;
+
+            for (j = 0; j < per_job && le != &Vcb->chunks; j++) {
+                le = le->Flink;
+            }
+
+            jobs[i].last = le;
+        }
+    }
+
+    i = num_usage_jobs;
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        jobs[i].dev = CONTAINING_RECORD(le, device, list_entry);
+        i++;
+        le = le->Flink;
+    }
+
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    // the first job runs on this thread
+    for (i = 1; i < num_jobs; i++) {
+        Status = PsCreateSystemThread(&jobs[i].thread, 0, &oa, NULL, NULL, mount_job_thread, &jobs[i]);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08lx\n", Status);
+            jobs[i].thread = NULL;
+        }
+    }
+
+    jobs[0].Irp = Irp;
+    do_mount_job(&jobs[0]);
+
+    Vcb->mount_times.threads = 1;
+
+    for (i = 1; i < num_jobs; i++) {
+        if (jobs[i].thread) {
+            KeWaitForSingleObject(&jobs[i].finished, Executive, KernelMode, false, NULL);
+            ZwClose(jobs[i].thread);
+            Vcb->mount_times.threads++;
+        } else {
+            jobs[i].Irp = Irp;
+            do_mount_job(&jobs[i]);
+        }
+    }
+
+    Status = STATUS_SUCCESS;
+
+    for (i = 0; i < num_jobs; i++) {
+        if (!NT_SUCCESS(jobs[i].Status)) {
+            if (jobs[i].dev)
+                ERR("find_disk_holes returned %08lx\n", jobs[i].Status);
+            else
+                ERR("find_chunk_usage_range returned %08lx\n", jobs[i].Status);
+
+            if (NT_SUCCESS(Status))
+                Status = jobs[i].Status;
+        }
+
+        if (jobs[i].dev)
+            Vcb->mount_times.disk_holes = max(Vcb->mount_times.disk_holes, jobs[i].time);
+        else {
+            bytes_used += jobs[i].bytes_used;
+            Vcb->mount_times.chunk_usage = max(Vcb->mount_times.chunk_usage, jobs[i].time);
+        }
+    }
+
+    if (NT_SUCCESS(Status) && num_usage_jobs > 0) {
+        Vcb->superblock.bytes_used = bytes_used;
+        Vcb->chunk_usage_found = true;
+    }
+
+    ExFreePool(jobs);
+
+    return Status;
+}
+
 static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     PIO_STACK_LOCATION IrpSp;
     PDEVICE_OBJECT NewDeviceObject = NULL;
@@ -4396,6 +4761,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     OBJECT_ATTRIBUTES oa;
     device_extension* real_devext;
     KIRQL irql;
+    LARGE_INTEGER freq, mount_start, time1, time2;
 
     TRACE("(%p, %p)\n", DeviceObject, Irp);
 
@@ -4545,6 +4911,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     Vcb = (PVOID)NewDeviceObject->DeviceExtension;
     RtlZeroMemory(Vcb, sizeof(device_extension));
+
+    mount_start = KeQueryPerformanceCounter(&freq);
+    Vcb->mount_times.frequency = freq.QuadPart;
     Vcb->type = VCB_TYPE_FS;
     Vcb->vde = vde;
 
@@ -4558,6 +4927,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeResourceLite(&Vcb->dirty_filerefs_lock);
     ExInitializeResourceLite(&Vcb->dirty_subvols_lock);
     ExInitializeResourceLite(&Vcb->scrub.stats_lock);
+    ExInitializeResourceLite(&Vcb->root_index_lock);
+    extent_cache_init(&Vcb->extent_cache, 0);
 
     ExInitializeResourceLite(&Vcb->load_lock);
     ExAcquireResourceExclusiveLite(&Vcb->load_lock, true);
@@ -4595,6 +4966,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    Vcb->extent_cache.max_size = Vcb->options.extent_cache_size;
+
     if (pdode) {
         if (RtlCompareMemory(&boot_uuid, &pdode->uuid, sizeof(BTRFS_UUID)) == sizeof(BTRFS_UUID) && boot_subvol != 0)
             Vcb->options.subvol_id = boot_subvol;
@@ -4721,6 +5094,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    time1 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.superblock = time1.QuadPart - mount_start.QuadPart;
+
     InitializeListHead(&Vcb->chunks);
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
@@ -4745,16 +5121,22 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializePagedLookasideList(&Vcb->name_bit_lookaside, NULL, NULL, 0, sizeof(name_bit), ALLOC_TAG, 0);
     ExInitializeNPagedLookasideList(&Vcb->range_lock_lookaside, NULL, NULL, 0, sizeof(range_lock), ALLOC_TAG, 0);
     ExInitializeNPagedLookasideList(&Vcb->fcb_np_lookaside, NULL, NULL, 0, sizeof(fcb_nonpaged), ALLOC_TAG, 0);
+    ExInitializePagedLookasideList(&Vcb->comp_buf_lookaside, NULL, NULL, 0, COMPRESSED_EXTENT_SIZE, ALLOC_TAG, 0);
     init_lookaside = true;
 
     Vcb->Vpb = IrpSp->Parameters.MountVolume.Vpb;
 
+    time1 = KeQueryPerformanceCounter(NULL);
+
     Status = load_chunk_root(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("load_chunk_root returned %08lx\n", Status);
         goto exit;
     }
 
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.chunk_root = time2.QuadPart - time1.QuadPart;
+
     if (Vcb->superblock.num_devices > 1) {
         if (Vcb->devices_loaded < Vcb->superblock.num_devices && (!Vcb->options.allow_degraded || !finished_probing)) {
             ERR("could not mount as %I64u device(s) missing\n", Vcb->superblock.num_devices - Vcb->devices_loaded);
@@ -4793,7 +5175,9 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         }
     }
 
-    add_root(Vcb, BTRFS_ROOT_ROOT, Vcb->superblock.root_tree_addr, Vcb->superblock.generation - 1, NULL);
+    time1 = KeQueryPerformanceCounter(NULL);
+
+    add_root(Vcb, BTRFS_ROOT_ROOT, Vcb->superblock.root_tree_addr, Vcb->superblock.generation - 1, NULL, NULL);
 
     if (!Vcb->root_root) {
         ERR("Could not load root of roots.\n");
@@ -4807,14 +5191,19 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
-    if (!Vcb->readonly) {
-        Status = find_chunk_usage(Vcb, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("find_chunk_usage returned %08lx\n", Status);
-            goto exit;
-        }
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.roots = time2.QuadPart - time1.QuadPart;
+
+    // chunk usage (if not readonly) and disk holes
+    Status = run_mount_jobs(Vcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("run_mount_jobs returned %08lx\n", Status);
+        goto exit;
     }
 
+    time1 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.parallel = time1.QuadPart - time2.QuadPart;
+
     InitializeListHead(&batchlist);
 
     // We've already increased the generation by one
@@ -4983,18 +5372,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
-    le = Vcb->devices.Flink;
-    while (le != &Vcb->devices) {
-        device* dev2 = CONTAINING_RECORD(le, device, list_entry);
-
-        Status = find_disk_holes(Vcb, dev2, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("find_disk_holes returned %08lx\n", Status);
-            goto exit;
-        }
-
-        le = le->Flink;
-    }
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.root_dir = time2.QuadPart - time1.QuadPart;
 
     IoAcquireVpbSpinLock(&irql);
 
@@ -5041,6 +5420,15 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     ExInitializeResourceLite(&Vcb->send_load_lock);
 
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->mount_times.total = time2.QuadPart - mount_start.QuadPart;
+
+#ifdef DEBUG_MOUNT_TIMES
+    ERR("mounted in %I64u (chunk root %I64u, roots %I64u, chunk usage %I64u, disk holes %I64u, threads %u, freq = %I64u)\n",
+        Vcb->mount_times.total, Vcb->mount_times.chunk_root, Vcb->mount_times.roots, Vcb->mount_times.chunk_usage,
+        Vcb->mount_times.disk_holes, Vcb->mount_times.threads, Vcb->mount_times.frequency);
+#endif
+
 exit:
     if (Vcb) {
         ExReleaseResourceLite(&Vcb->tree_lock);
@@ -5058,6 +5446,7 @@ exit:
                 ExDeletePagedLookasideList(&Vcb->name_bit_lookaside);
                 ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
                 ExDeleteNPagedLookasideList(&Vcb->fcb_np_lookaside);
+                ExDeletePagedLookasideList(&Vcb->comp_buf_lookaside);
             }
 
             if (Vcb->root_file)
@@ -5082,6 +5471,11 @@ exit:
             ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
+            ExDeleteResourceLite(&Vcb->root_index_lock);
+            extent_cache_free(&Vcb->extent_cache);
+
+            if (Vcb->root_index)
+                ExFreePool(Vcb->root_index);
 
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
@@ -567,6 +567,9 @@ typedef struct {
 #define BTRFS_SEND_CMD_UTIMES         20
 #define BTRFS_SEND_CMD_END            21
 #define BTRFS_SEND_CMD_UPDATE_EXTENT  22
+#define BTRFS_SEND_CMD_FALLOCATE      23
+#define BTRFS_SEND_CMD_FILEATTR       24
+#define BTRFS_SEND_CMD_ENCODED_WRITE  25
 
 #define BTRFS_SEND_TLV_UUID             1
 #define BTRFS_SEND_TLV_TRANSID          2
@@ -592,9 +595,27 @@ typedef struct {
 #define BTRFS_SEND_TLV_CLONE_PATH      22
 #define BTRFS_SEND_TLV_CLONE_OFFSET    23
 #define BTRFS_SEND_TLV_CLONE_LENGTH    24
+#define BTRFS_SEND_TLV_FALLOCATE_MODE  25
+#define BTRFS_SEND_TLV_FILEATTR        26
+#define BTRFS_SEND_TLV_UNENCODED_FILE_LEN 27
+#define BTRFS_SEND_TLV_UNENCODED_LEN   28
+#define BTRFS_SEND_TLV_UNENCODED_OFFSET 29
+#define BTRFS_SEND_TLV_COMPRESSION     30
+#define BTRFS_SEND_TLV_ENCRYPTION      31
+
+#define BTRFS_ENCODED_IO_COMPRESSION_NONE     0
+#define BTRFS_ENCODED_IO_COMPRESSION_ZLIB     1
+#define BTRFS_ENCODED_IO_COMPRESSION_ZSTD     2
+#define BTRFS_ENCODED_IO_COMPRESSION_LZO_4K   3
+#define BTRFS_ENCODED_IO_COMPRESSION_LZO_64K  7
+
+#define BTRFS_ENCODED_IO_ENCRYPTION_NONE      0
 
 #define BTRFS_SEND_MAGIC "btrfs-stream"
 
+#define BTRFS_SEND_STREAM_VERSION     1
+#define BTRFS_SEND_STREAM_VERSION_MAX 2
+
 typedef struct {
     uint8_t magic[13];
     uint32_t version;
@@ -55,11 +55,14 @@
 #include <stdbool.h>
 #include "btrfs.h"
 #include "btrfsioctl.h"
+#include "extent-cache.h"
 
 #ifdef _DEBUG
 // #define DEBUG_FCB_REFCOUNTS
 // #define DEBUG_LONG_MESSAGES
 // #define DEBUG_FLUSH_TIMES
+// #define DEBUG_BALANCE_TIMES
+// #define DEBUG_MOUNT_TIMES
 // #define DEBUG_CHUNK_LOCKS
 // #define DEBUG_TRIM_EMULATION
 #define DEBUG_PARANOID
@@ -95,9 +98,10 @@
 #define EA_PROP_COMPRESSION_HASH 0x20ccdf69
 
 #define MAX_EXTENT_SIZE 0x8000000 // 128 MB
-#define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
+#define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB - the most Linux will accept, and the default for CompressPartSize
 
-#define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
+#define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // default - really ought to be a multiple of CompressPartSize
+#define MAX_READ_AHEAD_GRANULARITY 0x1000000 // 16 MB
 
 #ifndef IO_REPARSE_TAG_LX_SYMLINK
 
@@ -279,6 +283,8 @@ typedef struct _fcb {
     struct _file_ref* fileref;
     bool inode_item_changed;
     enum prop_compression_type prop_compression;
+    unsigned int comp_failures; // consecutive compressed writes where nothing compressed
+    uint64_t comp_skip; // bytes still to be written before we try compressing again
     LIST_ENTRY xattrs;
     bool marked_as_orphan;
     bool case_sensitive;
@@ -365,6 +371,7 @@ typedef struct _ccb {
     bool lxss;
     send_info* send;
     NTSTATUS send_status;
+    btrfs_send_stats send_stats;
 } ccb;
 
 struct _device_extension;
@@ -441,6 +448,13 @@ typedef struct _root {
     LIST_ENTRY list_entry_dirty;
 } root;
 
+typedef struct {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t parent;
+    bool loaded;
+} root_index_entry;
+
 enum batch_operation {
     Batch_Delete,
     Batch_DeleteInode,
@@ -620,22 +634,43 @@ typedef struct {
     KEVENT event;
     enum calc_thread_type type;
     NTSTATUS Status;
+    bool skipped; // compression job turned down by compression_heuristic
+    uint32_t level; // for zlib and zstd compression jobs
 } calc_job;
 
+typedef struct _comp_ctx comp_ctx;
+
 typedef struct {
     PDEVICE_OBJECT DeviceObject;
     HANDLE handle;
     KEVENT finished;
     unsigned int number;
     bool quit;
+    comp_ctx* comp_ctx;
 } drv_calc_thread;
 
+// With AdaptiveLevel set, the zlib or zstd level new compression jobs get,
+// which follows how far the calc threads are behind.
+typedef struct {
+    uint32_t level;
+    uint32_t min_level;
+    uint32_t max_level;
+    uint64_t submitted; // bytes queued since last_adjust
+    LONG64 comp_bytes; // bytes compressed at this level since last_adjust...
+    LONG64 comp_time; // ...and how long it took, in performance counter ticks
+    LARGE_INTEGER last_adjust;
+} comp_level;
+
 typedef struct {
     ULONG num_threads;
     LIST_ENTRY job_list;
     KSPIN_LOCK spinlock;
     drv_calc_thread* threads;
     KEVENT event;
+    unsigned int comp_queued; // compression jobs not yet started
+    comp_level zlib_level;
+    comp_level zstd_level;
+    LARGE_INTEGER perf_freq;
 } drv_calc_threads;
 
 typedef struct {
@@ -646,6 +681,9 @@ typedef struct {
     bool readonly;
     uint32_t zlib_level;
     uint32_t zstd_level;
+    bool adaptive_level;
+    uint32_t adaptive_level_min;
+    uint32_t adaptive_level_max;
     uint32_t flush_interval;
     uint32_t max_inline;
     uint64_t subvol_id;
@@ -656,6 +694,9 @@ typedef struct {
     bool allow_degraded;
     bool no_root_dir;
     bool nodatacow;
+    uint32_t extent_cache_size;
+    uint32_t compress_part_size;
+    uint32_t read_ahead_granularity;
 } mount_options;
 
 #define VCB_TYPE_FS         1
@@ -673,6 +714,7 @@ typedef struct {
     uint64_t total_chunks;
     uint64_t chunks_left;
     btrfs_balance_opts opts[3];
+    uint64_t target[3];
     bool paused;
     bool stopping;
     bool removing;
@@ -768,6 +810,10 @@ typedef struct _device_extension {
     uint64_t system_flags;
     LIST_ENTRY roots;
     LIST_ENTRY drop_roots;
+    root_index_entry* root_index;
+    ULONG root_index_len;
+    ULONG root_index_max;
+    ERESOURCE root_index_lock;
     root* chunk_root;
     root* root_root;
     root* extent_root;
@@ -799,6 +845,9 @@ typedef struct _device_extension {
     drv_calc_threads calcthreads;
     balance_info balance;
     scrub_info scrub;
+    btrfs_mount_times mount_times;
+    btrfs_compression_stats comp_stats;
+    extent_cache extent_cache;
     ERESOURCE send_load_lock;
     LONG running_sends;
     LIST_ENTRY send_ops;
@@ -811,6 +860,7 @@ typedef struct _device_extension {
     PAGED_LOOKASIDE_LIST name_bit_lookaside;
     NPAGED_LOOKASIDE_LIST range_lock_lookaside;
     NPAGED_LOOKASIDE_LIST fcb_np_lookaside;
+    PAGED_LOOKASIDE_LIST comp_buf_lookaside; // output buffers for write_compressed
     LIST_ENTRY list_entry;
 } device_extension;
 
@@ -1141,6 +1191,7 @@ uint32_t get_num_of_processors();
 
 _Ret_maybenull_
 root* find_default_subvol(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_opt_ PIRP Irp);
+NTSTATUS find_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ uint64_t id, _Out_ root** pr, _In_opt_ PIRP Irp);
 
 void do_shutdown(PIRP Irp);
 bool check_superblock_checksum(superblock* sb);
@@ -1166,7 +1217,14 @@ extern uint32_t mount_allow_degraded;
 extern uint32_t mount_readonly;
 extern uint32_t mount_no_root_dir;
 extern uint32_t mount_nodatacow;
+extern uint32_t mount_extent_cache_size;
+extern uint32_t mount_adaptive_level;
+extern uint32_t mount_adaptive_level_min;
+extern uint32_t mount_adaptive_level_max;
+extern uint32_t mount_compress_part_size;
+extern uint32_t mount_read_ahead_granularity;
 extern uint32_t no_pnp;
+extern uint32_t send_buffer_size;
 
 #ifndef __GNUC__
 #define __attribute__(x)
@@ -1435,6 +1493,7 @@ void do_unlock_volume(device_extension* Vcb);
 void trim_whole_device(device* dev);
 void flush_subvol_fcbs(root* subvol);
 bool fcb_is_inline(fcb* fcb);
+extent* get_inline_extent(fcb* fcb);
 NTSTATUS dismount_volume(device_extension* Vcb, bool shutdown, PIRP Irp);
 
 // in flushthread.c
@@ -1532,11 +1591,19 @@ void watch_registry(HANDLE regh);
 // in compress.c
 NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
 NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t inpageoff);
-NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
+NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, comp_ctx* ctx);
 NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback);
-NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left);
-NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left);
-NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left);
+NTSTATUS write_encoded(fcb* fcb, uint64_t start_data, uint64_t num_bytes, uint64_t decoded_size, uint64_t decoded_offset,
+                       uint8_t compression, uint8_t* data, unsigned int datalen, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left,
+                       comp_ctx* ctx);
+NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left, comp_ctx* ctx);
+NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left,
+                       comp_ctx* ctx);
+comp_ctx* comp_ctx_alloc();
+void comp_ctx_free(comp_ctx* ctx);
+bool compression_heuristic(const uint8_t* data, uint32_t len);
+bool compression_skip(fcb* fcb, uint64_t length);
 
 // in galois.c
 void galois_double(uint8_t* data, uint32_t len);
@@ -1561,11 +1628,13 @@ NTSTATUS add_calc_job_decomp(device_extension* Vcb, uint8_t compression, void* i
                              void* out, unsigned int outlen, unsigned int off, calc_job** pcj);
 NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in, unsigned int inlen,
                            void* out, unsigned int outlen, calc_job** pcj);
-void calc_thread_main(device_extension* Vcb, calc_job* cj);
+void calc_thread_main(device_extension* Vcb, calc_job* cj, comp_ctx* ctx);
+void init_comp_levels(device_extension* Vcb);
 
 // in balance.c
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
 NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length);
+NTSTATUS estimate_balance(device_extension* Vcb, void* data, ULONG inlen, void* out, ULONG outlen, ULONG_PTR* retlen);
 NTSTATUS pause_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS resume_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS stop_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
@@ -1599,6 +1668,7 @@ NTSTATUS stop_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 // in send.c
 NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp);
 NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode);
+NTSTATUS get_send_stats(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen);
 
 // in fsrtl.c
 NTSTATUS __stdcall compat_FsRtlValidateReparsePointBuffer(IN ULONG BufferLength, IN PREPARSE_DATA_BUFFER ReparseBuffer);
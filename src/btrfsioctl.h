@@ -38,6 +38,11 @@
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_BTRFS_UNLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_CSUM_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FSCTL_BTRFS_ESTIMATE_BALANCE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_MOUNT_TIMES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_ENCODED_WRITE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84d, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_SEND_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84e, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_COMPRESSION_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84f, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef struct {
     uint64_t subvol;
@@ -137,6 +142,8 @@ typedef struct {
 #define BTRFS_BALANCE_OPTS_USAGE        0x080
 #define BTRFS_BALANCE_OPTS_CONVERT      0x100
 #define BTRFS_BALANCE_OPTS_SOFT         0x200
+#define BTRFS_BALANCE_OPTS_ORDER_USAGE  0x400
+#define BTRFS_BALANCE_OPTS_TARGET       0x800
 
 #define BLOCK_FLAG_SINGLE 0x1000000000000 // only used in balance
 
@@ -172,12 +179,62 @@ typedef struct {
     btrfs_balance_opts data_opts;
     btrfs_balance_opts metadata_opts;
     btrfs_balance_opts system_opts;
+    uint64_t target[3]; // for BTRFS_BALANCE_OPTS_TARGET - older drivers don't fill this in
 } btrfs_query_balance;
 
 typedef struct {
     btrfs_balance_opts opts[3];
+    uint64_t target[3]; // for BTRFS_BALANCE_OPTS_TARGET - older tools don't send this
 } btrfs_start_balance;
 
+typedef struct {
+    uint64_t chunks;
+    uint64_t bytes_to_move;
+    uint64_t chunks_freed;
+    uint64_t unallocated_before;
+    uint64_t unallocated_after;
+} btrfs_balance_estimate;
+
+// times are in performance counter ticks
+typedef struct {
+    uint64_t frequency;
+    uint64_t superblock;
+    uint64_t chunk_root;
+    uint64_t roots;
+    uint64_t chunk_usage;
+    uint64_t disk_holes;
+    uint64_t parallel;
+    uint64_t root_dir;
+    uint64_t total;
+    uint32_t threads;
+} btrfs_mount_times;
+
+typedef struct {
+    uint64_t bytes_written; // file data sent as WRITE or ENCODED_WRITE
+    uint64_t bytes_cloned; // file data sent as CLONE
+    uint64_t clone_lookups; // extents we looked for a clone source for
+    uint64_t clone_cache_hits;
+    uint64_t clone_candidates; // backrefs examined
+} btrfs_send_stats;
+
+// since mount, in bytes of uncompressed data
+typedef struct {
+    uint64_t compressed_in; // parts that were written compressed...
+    uint64_t compressed_out; // ...and what they came to on disk
+    uint64_t incompressible; // compressed, but not worth keeping
+    uint64_t skipped_heuristic; // not compressed, as the heuristic said it wouldn't be worth it
+    uint64_t skipped_inode; // not compressed, as the inode's recent writes didn't compress
+    uint64_t extent_cache_hits; // reads of compressed extents, by number, found in the extent cache...
+    uint64_t extent_cache_misses; // ...and not
+    uint64_t extent_cache_evictions;
+    uint64_t extent_cache_invalidations; // dropped because the extent was freed
+    uint64_t extent_cache_size; // bytes currently cached
+    uint64_t level_increases; // times AdaptiveLevel has raised the compression level...
+    uint64_t level_decreases; // ...and lowered it
+    uint32_t zlib_level; // the level new zlib and zstd parts are being compressed at
+    uint32_t zstd_level;
+} btrfs_compression_stats;
+
 typedef struct {
     uint8_t uuid[16];
     BOOL missing;
@@ -264,6 +321,9 @@ typedef struct {
     uint64_t ctransid;
 } btrfs_find_subvol;
 
+// Both of these can be followed by a ULONG after clones[num_clones], giving
+// the stream version to send. If it's missing or 0, the version is 1.
+
 typedef struct {
     HANDLE parent;
     ULONG num_clones;
@@ -276,6 +336,17 @@ typedef struct {
     void* POINTER_32 clones[1];
 } btrfs_send_subvol32;
 
+typedef struct {
+    uint64_t offset;
+    uint64_t unencoded_file_len;
+    uint64_t unencoded_len;
+    uint64_t unencoded_offset;
+    uint32_t compression;
+    uint32_t encryption;
+    uint32_t length;
+    uint8_t data[1];
+} btrfs_encoded_write;
+
 typedef struct {
     uint64_t device;
     uint64_t size;
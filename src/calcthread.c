@@ -18,14 +18,109 @@
 #include "btrfs_drv.h"
 #include "zstd/lib/common/xxhash.h"
 #include "crc32c.h"
+#include "zstd/lib/zstd.h"
 
-void calc_thread_main(device_extension* Vcb, calc_job* cj) {
+#define COMP_LEVEL_INTERVAL 10 // adjust the adaptive level at most every tenth of a second
+
+// Unless compress_force is set, parts the heuristic thinks won't compress are
+// written as they are without trying.
+static bool skip_comp_job(device_extension* Vcb, calc_job* cj, uint8_t* src) {
+    if (Vcb->options.compress_force || compression_heuristic(src, cj->inlen))
+        return false;
+
+    cj->space_left = 0;
+    cj->skipped = true;
+
+    return true;
+}
+
+static void init_comp_level(comp_level* cl, uint32_t level, uint32_t min_level, uint32_t max_level) {
+    cl->min_level = min_level;
+    cl->max_level = max(min_level, max_level);
+    cl->level = min(max(level, cl->min_level), cl->max_level);
+    cl->submitted = 0;
+    cl->comp_bytes = 0;
+    cl->comp_time = 0;
+    cl->last_adjust = KeQueryPerformanceCounter(NULL);
+}
+
+void init_comp_levels(device_extension* Vcb) {
+    uint32_t min_level = Vcb->options.adaptive_level_min, max_level = Vcb->options.adaptive_level_max;
+
+    KeQueryPerformanceCounter(&Vcb->calcthreads.perf_freq);
+
+    Vcb->calcthreads.comp_queued = 0;
+
+    init_comp_level(&Vcb->calcthreads.zlib_level, Vcb->options.zlib_level, min(min_level, 9), min(max_level, 9));
+    init_comp_level(&Vcb->calcthreads.zstd_level, Vcb->options.zstd_level, min(min_level, (uint32_t)ZSTD_maxCLevel()),
+                    min(max_level, (uint32_t)ZSTD_maxCLevel()));
+}
+
+// Called with the calc threads' spinlock held, as a compression job of inlen
+// bytes is queued. If the jobs already queued are more than the threads can get
+// through, or are coming in faster than they can compress at this level, we go
+// down a level; if the threads are keeping up easily, we go up one. Either way,
+// it's one step at a time, and not more often than every COMP_LEVEL_INTERVAL.
+static uint32_t get_comp_level(device_extension* Vcb, comp_level* cl, unsigned int inlen) {
+    LARGE_INTEGER time = KeQueryPerformanceCounter(NULL);
+    uint64_t freq = Vcb->calcthreads.perf_freq.QuadPart;
+    uint64_t elapsed, capacity = 0, ingest;
+    LONG64 comp_bytes, comp_time;
+
+    cl->submitted += inlen;
+
+    elapsed = time.QuadPart - cl->last_adjust.QuadPart;
+
+    if (elapsed < freq / COMP_LEVEL_INTERVAL)
+        return cl->level;
+
+    comp_bytes = InterlockedExchange64(&cl->comp_bytes, 0);
+    comp_time = InterlockedExchange64(&cl->comp_time, 0);
+
+    // bytes per second, of what the threads could do flat out, and what they've been given
+    if (comp_time > 0)
+        capacity = (uint64_t)comp_bytes * freq / (uint64_t)comp_time * Vcb->calcthreads.num_threads;
+
+    ingest = cl->submitted * freq / elapsed;
+
+    if (Vcb->calcthreads.comp_queued > 2 * Vcb->calcthreads.num_threads || (capacity != 0 && ingest > capacity)) {
+        if (cl->level > cl->min_level) {
+            cl->level--;
+            InterlockedIncrement64((LONG64*)&Vcb->comp_stats.level_decreases);
+        }
+    } else if (Vcb->calcthreads.comp_queued == 0 && capacity != 0 && ingest < capacity / 2) {
+        if (cl->level < cl->max_level) {
+            cl->level++;
+            InterlockedIncrement64((LONG64*)&Vcb->comp_stats.level_increases);
+        }
+    }
+
+    cl->submitted = 0;
+    cl->last_adjust = time;
+
+    return cl->level;
+}
+
+// Records how long a compression job took, for get_comp_level. Jobs which
+// were queued before the last change still count, which only matters for a
+// moment.
+static void add_comp_time(comp_level* cl, unsigned int inlen, LARGE_INTEGER start) {
+    LARGE_INTEGER end = KeQueryPerformanceCounter(NULL);
+
+    InterlockedExchangeAdd64(&cl->comp_bytes, inlen);
+    InterlockedExchangeAdd64(&cl->comp_time, end.QuadPart - start.QuadPart);
+}
+
+// ctx is the calling calc thread's compression context, or NULL for threads
+// helping with their own jobs, which set one up each time
+void calc_thread_main(device_extension* Vcb, calc_job* cj, comp_ctx* ctx) {
     while (true) {
         KIRQL irql;
         calc_job* cj2;
         uint8_t* src;
         void* dest;
         bool last_one = false;
+        LARGE_INTEGER start;
 
         KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
 
@@ -66,6 +161,9 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
         if (cj2->not_started == 0) {
             RemoveEntryList(&cj2->list_entry);
             last_one = true;
+
+            if (cj2->type == calc_thread_comp_zlib || cj2->type == calc_thread_comp_lzo || cj2->type == calc_thread_comp_zstd)
+                Vcb->calcthreads.comp_queued--;
         }
 
         KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
@@ -102,31 +200,48 @@ void calc_thread_main(device_extension* Vcb, calc_job* cj) {
             break;
 
             case calc_thread_decomp_zstd:
-                cj2->Status = zstd_decompress(src, cj2->inlen, dest, cj2->outlen);
+                cj2->Status = zstd_decompress(src, cj2->inlen, dest, cj2->outlen, ctx);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zstd_decompress returned %08lx\n", cj2->Status);
             break;
 
             case calc_thread_comp_zlib:
-                cj2->Status = zlib_compress(src, cj2->inlen, dest, cj2->outlen, Vcb->options.zlib_level, &cj2->space_left);
+                if (skip_comp_job(Vcb, cj2, src))
+                    break;
+
+                start = KeQueryPerformanceCounter(NULL);
+
+                cj2->Status = zlib_compress(src, cj2->inlen, dest, cj2->outlen, cj2->level, &cj2->space_left, ctx);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zlib_compress returned %08lx\n", cj2->Status);
+                else if (Vcb->options.adaptive_level)
+                    add_comp_time(&Vcb->calcthreads.zlib_level, cj2->inlen, start);
             break;
 
             case calc_thread_comp_lzo:
-                cj2->Status = lzo_compress(src, cj2->inlen, dest, cj2->outlen, &cj2->space_left);
+                if (skip_comp_job(Vcb, cj2, src))
+                    break;
+
+                cj2->Status = lzo_compress(src, cj2->inlen, dest, cj2->outlen, &cj2->space_left, ctx);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("lzo_compress returned %08lx\n", cj2->Status);
             break;
 
             case calc_thread_comp_zstd:
-                cj2->Status = zstd_compress(src, cj2->inlen, dest, cj2->outlen, Vcb->options.zstd_level, &cj2->space_left);
+                if (skip_comp_job(Vcb, cj2, src))
+                    break;
+
+                start = KeQueryPerformanceCounter(NULL);
+
+                cj2->Status = zstd_compress(src, cj2->inlen, dest, cj2->outlen, cj2->level, &cj2->space_left, ctx);
 
                 if (!NT_SUCCESS(cj2->Status))
                     ERR("zstd_compress returned %08lx\n", cj2->Status);
+                else if (Vcb->options.adaptive_level)
+                    add_comp_time(&Vcb->calcthreads.zstd_level, cj2->inlen, start);
             break;
         }
 
@@ -175,7 +290,7 @@ void do_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* c
 
     KeReleaseSpinLock(&Vcb->calcthreads.spinlock, irql);
 
-    calc_thread_main(Vcb, &cj);
+    calc_thread_main(Vcb, &cj, NULL);
 
     KeWaitForSingleObject(&cj.event, Executive, KernelMode, false, NULL);
 }
@@ -251,6 +366,8 @@ NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in,
     cj->outlen = outlen;
     cj->left = cj->not_started = 1;
     cj->Status = STATUS_SUCCESS;
+    cj->skipped = false;
+    cj->level = 0;
 
     switch (compression) {
         case BTRFS_COMPRESSION_ZLIB:
@@ -275,6 +392,13 @@ NTSTATUS add_calc_job_comp(device_extension* Vcb, uint8_t compression, void* in,
 
     KeAcquireSpinLock(&Vcb->calcthreads.spinlock, &irql);
 
+    if (cj->type == calc_thread_comp_zlib)
+        cj->level = Vcb->options.adaptive_level ? get_comp_level(Vcb, &Vcb->calcthreads.zlib_level, inlen) : Vcb->options.zlib_level;
+    else if (cj->type == calc_thread_comp_zstd)
+        cj->level = Vcb->options.adaptive_level ? get_comp_level(Vcb, &Vcb->calcthreads.zstd_level, inlen) : Vcb->options.zstd_level;
+
+    Vcb->calcthreads.comp_queued++;
+
     InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
 
     KeSetEvent(&Vcb->calcthreads.event, 0, false);
@@ -296,15 +420,23 @@ void __stdcall calc_thread(void* context) {
 
     KeSetSystemAffinityThread((KAFFINITY)1 << thread->number);
 
+    // if this fails, calc_thread_main makes a new context for each job instead
+    thread->comp_ctx = comp_ctx_alloc();
+
     while (true) {
         KeWaitForSingleObject(&Vcb->calcthreads.event, Executive, KernelMode, false, NULL);
 
-        calc_thread_main(Vcb, NULL);
+        calc_thread_main(Vcb, NULL, thread->comp_ctx);
 
         if (thread->quit)
             break;
     }
 
+    if (thread->comp_ctx) {
+        comp_ctx_free(thread->comp_ctx);
+        thread->comp_ctx = NULL;
+    }
+
     ObDereferenceObject(thread->DeviceObject);
 
     KeSetEvent(&thread->finished, 0, false);
@@ -0,0 +1,135 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+// Enough of btrfs_drv.h for the compression and decompression functions in
+// compress.c to be built in user mode, such as by mkbtrfs on Linux, and for
+// the decompressed extent cache in extent-cache.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef int32_t NTSTATUS;
+
+#define NT_SUCCESS(Status) ((NTSTATUS)(Status) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xc000009a)
+#define STATUS_INTERNAL_ERROR           ((NTSTATUS)0xc00000e5)
+
+#define RtlZeroMemory(dest, len) memset((dest), 0, (len))
+#define RtlFillMemory(dest, len, fill) memset((dest), (fill), (len))
+#define RtlCopyMemory(dest, src, len) memcpy((dest), (src), (len))
+
+static __inline size_t RtlCompareMemory(const void* src1, const void* src2, size_t len) {
+    const uint8_t* a = src1;
+    const uint8_t* b = src2;
+    size_t i = 0;
+
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define PagedPool 1
+#define ExAllocatePoolWithTag(type, size, tag) malloc(size)
+#define ExFreePool(p) free(p)
+
+#define ALLOC_TAG 0x7442484D //'MHBt'
+#define ALLOC_TAG_ZLIB 0x7A42484D //'MHBz'
+
+#define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
+
+#define UNUSED(x) (void)(x)
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) ((type*)((uint8_t*)(address) - offsetof(type, field)))
+
+static __inline void InitializeListHead(LIST_ENTRY* head) {
+    head->Flink = head->Blink = head;
+}
+
+static __inline bool IsListEmpty(const LIST_ENTRY* head) {
+    return head->Flink == head;
+}
+
+static __inline void RemoveEntryList(LIST_ENTRY* entry) {
+    entry->Blink->Flink = entry->Flink;
+    entry->Flink->Blink = entry->Blink;
+}
+
+static __inline void InsertHeadList(LIST_ENTRY* head, LIST_ENTRY* entry) {
+    entry->Flink = head->Flink;
+    entry->Blink = head;
+    head->Flink->Blink = entry;
+    head->Flink = entry;
+}
+
+static __inline void InsertTailList(LIST_ENTRY* head, LIST_ENTRY* entry) {
+    entry->Flink = head;
+    entry->Blink = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink = entry;
+}
+
+typedef pthread_mutex_t ERESOURCE;
+
+#define ExInitializeResourceLite(r) pthread_mutex_init((r), NULL)
+#define ExDeleteResourceLite(r) pthread_mutex_destroy(r)
+#define ExAcquireResourceExclusiveLite(r, wait) pthread_mutex_lock(r)
+#define ExReleaseResourceLite(r) pthread_mutex_unlock(r)
+
+typedef struct _comp_ctx comp_ctx;
+
+NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
+NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t inpageoff);
+NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, comp_ctx* ctx);
+NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left,
+                       comp_ctx* ctx);
+NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left, comp_ctx* ctx);
+NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left,
+                       comp_ctx* ctx);
+comp_ctx* comp_ctx_alloc();
+bool compression_heuristic(const uint8_t* data, uint32_t len);
+void comp_ctx_free(comp_ctx* ctx);
+
+// callers get the failure through the returned NTSTATUS
+#define ERR(s, ...) ((void)0)
+
+#include "extent-cache.h"
+
+static __inline uint64_t sector_align(uint64_t n, uint64_t a) {
+    if (n & (a - 1))
+        n = (n + a) & ~(a - 1);
+
+    return n;
+}
@@ -17,16 +17,18 @@
  * You should have received a copy of the GNU Lesser General Public Licence
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
-// Portions of the LZO decompression code here were cribbed from code in
+// The LZO decompression code here was originally cribbed from code in
 // libavcodec, also under the LGPL. Thank you, Reimar Doeffinger.
 
-// The LZO compression code comes from v0.22 of lzo, written way back in
-// 1996, and available here:
-// https://www.ibiblio.org/pub/historic-linux/ftp-archives/sunsite.unc.edu/Sep-29-1996/libs/lzo-0.22.tar.gz
-// Modern versions of lzo are licensed under the GPL, but the very oldest
-// versions are under the LGPL and hence okay to use here.
+// The LZO compression code originally came from v0.22 of lzo, written way
+// back in 1996. It's since been rewritten along the lines of LZ4, but still
+// produces the LZO1X format that Linux expects.
 
+#ifdef _KERNEL_MODE
 #include "btrfs_drv.h"
+#else
+#include "compress-shim.h"
+#endif
 #include "zlib/zlib.h"
 
 #define ZSTD_STATIC_LINKING_ONLY
@@ -38,44 +40,27 @@
 typedef struct {
     uint8_t* in;
     uint32_t inlen;
-    uint32_t inpos;
     uint8_t* out;
     uint32_t outlen;
     uint32_t outpos;
-    bool error;
-    void* wrkmem;
 } lzo_stream;
 
-#define LZO1X_MEM_COMPRESS ((uint32_t) (16384L * sizeof(uint8_t*)))
+// Each page is compressed separately, so the hash table only has to hold
+// offsets within a page, and every match we find is near enough to be coded
+// as M2 or M3.
+#define LZO_HASH_BITS 12
+#define LZO1X_MEM_COMPRESS ((uint32_t)(sizeof(uint16_t) << LZO_HASH_BITS))
+
+#define M2_MAX_LEN 8
+#define M3_MAX_LEN 33
 
-#define M1_MAX_OFFSET 0x0400
 #define M2_MAX_OFFSET 0x0800
 #define M3_MAX_OFFSET 0x4000
-#define M4_MAX_OFFSET 0xbfff
-
-#define MX_MAX_OFFSET (M1_MAX_OFFSET + M2_MAX_OFFSET)
 
-#define M1_MARKER 0
 #define M2_MARKER 64
 #define M3_MARKER 32
 #define M4_MARKER 16
 
-#define _DV2(p, shift1, shift2) (((( (uint32_t)(p[2]) << shift1) ^ p[1]) << shift2) ^ p[0])
-#define DVAL_NEXT(dv, p) dv ^= p[-1]; dv = (((dv) >> 5) ^ ((uint32_t)(p[2]) << (2*5)))
-#define _DV(p, shift) _DV2(p, shift, shift)
-#define DVAL_FIRST(dv, p) dv = _DV((p), 5)
-#define _DINDEX(dv, p) ((40799u * (dv)) >> 5)
-#define DINDEX(dv, p) (((_DINDEX(dv, p)) & 0x3fff) << 0)
-#define UPDATE_D(dict, cycle, dv, p) dict[DINDEX(dv, p)] = (p)
-#define UPDATE_I(dict, cycle, index, p) dict[index] = (p)
-
-#define LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, max_offset) \
-    ((void*) m_pos < (void*) in || \
-    (m_off = (uint8_t*) ip - (uint8_t*) m_pos) <= 0 || \
-    m_off > max_offset)
-
-#define LZO_BYTE(x) ((unsigned char) (x))
-
 #define ZSTD_ALLOC_TAG 0x6474737a // "zstd"
 
 // needs to be the same as Linux (fs/btrfs/zstd.c)
@@ -86,178 +71,260 @@ static void zstd_free(void* opaque, void* address);
 
 static const ZSTD_customMem zstd_mem = { .customAlloc = zstd_malloc, .customFree = zstd_free, .opaque = NULL };
 
-static uint8_t lzo_nextbyte(lzo_stream* stream) {
-    uint8_t c;
+// Setting up a compressor means allocating and clearing its tables, which on
+// small parts costs more than the compression itself, so each calc thread
+// keeps its own, and resets it between jobs. Everything here is created the
+// first time it's needed. zlib's inflate isn't here, as inflateInit is cheap
+// enough that reusing the stream gained nothing.
+struct _comp_ctx {
+    z_stream deflate;
+    bool deflate_init;
+    unsigned int deflate_level;
+    ZSTD_CStream* zstd_cstream;
+    ZSTD_DStream* zstd_dstream;
+    void* lzo_wrkmem;
+    uint8_t* lzo_buf;
+    unsigned int lzo_buflen;
+};
+
+static __inline uint32_t lzo_load32(const uint8_t* p) {
+    uint32_t v;
+
+    RtlCopyMemory(&v, p, sizeof(uint32_t));
+
+    return v;
+}
 
-    if (stream->inpos >= stream->inlen) {
-        stream->error = true;
-        return 0;
-    }
+static __inline unsigned int lzo_ctz(size_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
 
-    c = stream->in[stream->inpos];
-    stream->inpos++;
+#ifdef _WIN64
+    _BitScanForward64(&index, v);
+#else
+    _BitScanForward(&index, v);
+#endif
 
-    return c;
+    return index;
+#else
+    return (unsigned int)__builtin_ctzll((unsigned long long)v);
+#endif
 }
 
-static int lzo_len(lzo_stream* stream, int byte, int mask) {
-    int len = byte & mask;
+// Returns how many bytes p and m have in common, going no further than end.
+// This is a word at a time - we're always little-endian, so the first byte
+// that differs is where the lowest set bit of the XOR is.
+static __inline uint32_t lzo_match_len(const uint8_t* p, const uint8_t* m, const uint8_t* end) {
+    const uint8_t* start = p;
 
-    if (len == 0) {
-        while (!(byte = lzo_nextbyte(stream))) {
-            if (stream->error) return 0;
+    while ((size_t)(end - p) >= sizeof(size_t)) {
+        size_t a, b;
 
-            len += 255;
-        }
+        RtlCopyMemory(&a, p, sizeof(size_t));
+        RtlCopyMemory(&b, m, sizeof(size_t));
+
+        if (a != b)
+            return (uint32_t)(p - start) + (lzo_ctz(a ^ b) >> 3);
 
-        len += mask + byte;
+        p += sizeof(size_t);
+        m += sizeof(size_t);
     }
 
-    return len;
+    while (p < end && *p == *m) {
+        p++;
+        m++;
+    }
+
+    return (uint32_t)(p - start);
 }
 
-static void lzo_copy(lzo_stream* stream, int len) {
-    if (stream->inpos + len > stream->inlen) {
-        stream->error = true;
-        return;
-    }
+// Long lengths are a run of zero bytes, each worth 255, followed by the rest.
+// Returns 0 if the input runs out.
+static __inline uint32_t lzo_ext_len(const uint8_t** pip, const uint8_t* ip_end, uint32_t len) {
+    const uint8_t* ip = *pip;
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
+    while (ip < ip_end && *ip == 0) {
+        len += 255;
+        ip++;
     }
 
-    do {
-        stream->out[stream->outpos] = stream->in[stream->inpos];
-        stream->inpos++;
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    if (ip == ip_end)
+        return 0;
+
+    len += *ip;
+    *pip = ip + 1;
+
+    return len;
 }
 
-static void lzo_copyback(lzo_stream* stream, uint32_t back, int len) {
-    if (stream->outpos < back) {
-        stream->error = true;
+// Matches can overlap what they're producing, so we can only go a word at a
+// time if they're at least a word back.
+static __inline void lzo_copy_match(uint8_t* op, uint32_t back, uint32_t len) {
+    const uint8_t* m = op - back;
+
+    if (back == 1) {
+        RtlFillMemory(op, len, *m);
         return;
     }
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
+    if (back >= sizeof(uint64_t)) {
+        while (len >= sizeof(uint64_t)) {
+            uint64_t v;
+
+            RtlCopyMemory(&v, m, sizeof(uint64_t));
+            RtlCopyMemory(op, &v, sizeof(uint64_t));
+
+            op += sizeof(uint64_t);
+            m += sizeof(uint64_t);
+            len -= sizeof(uint64_t);
+        }
     }
 
-    do {
-        stream->out[stream->outpos] = stream->out[stream->outpos - back];
-        stream->outpos++;
+    while (len > 0) {
+        *op++ = *m++;
         len--;
-    } while (len > 0);
+    }
 }
 
+// Decodes one page. If the page would go beyond outlen, we stop there and
+// return success, which is what lets read_file decompress only as much of an
+// extent as it needs.
 static NTSTATUS do_lzo_decompress(lzo_stream* stream) {
-    uint8_t byte;
-    uint32_t len, back;
-    bool backcopy = false;
+    const uint8_t* ip = stream->in;
+    const uint8_t* ip_end = ip + stream->inlen;
+    uint8_t* op = stream->out;
+    uint8_t* op_end = op + stream->outlen;
+    uint32_t t, len, back, n;
+    uint32_t state; // literals after the last match, or 4 after a literal run
+
+    if (ip == ip_end)
+        return STATUS_INTERNAL_ERROR;
 
-    stream->error = false;
+    t = *ip++;
+
+    if (t > 17) { // starts with a short literal run
+        len = t - 17;
+        state = min(len, 4);
+        goto literals;
+    }
 
-    byte = lzo_nextbyte(stream);
-    if (stream->error) return STATUS_INTERNAL_ERROR;
+    state = 0;
 
-    if (byte > 17) {
-        lzo_copy(stream, min((uint8_t)(byte - 17), (uint32_t)(stream->outlen - stream->outpos)));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+    while (true) {
+        if (t < 16) {
+            if (state == 0) { // literal run
+                len = t;
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+                if (len == 0) {
+                    len = lzo_ext_len(&ip, ip_end, 15);
+                    if (len == 0)
+                        return STATUS_INTERNAL_ERROR;
+                }
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+                len += 3;
+                state = 4;
+                goto literals;
+            }
 
-        if (byte < 16) return STATUS_INTERNAL_ERROR;
-    }
+            // M1, short matches which only make sense after literals
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
 
-    while (1) {
-        if (byte >> 4) {
-            backcopy = true;
-            if (byte >> 6) {
-                len = (byte >> 5) - 1;
-                back = (lzo_nextbyte(stream) << 3) + ((byte >> 2) & 7) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-            } else if (byte >> 5) {
-                len = lzo_len(stream, byte, 31);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                back = (lzo_nextbyte(stream) << 6) + (byte >> 2) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (state == 4) {
+                back = (t >> 2) + (*ip++ << 2) + M2_MAX_OFFSET + 1;
+                len = 3;
             } else {
-                len = lzo_len(stream, byte, 7);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+                back = (t >> 2) + (*ip++ << 2) + 1;
+                len = 2;
+            }
+        } else if (t >= M2_MARKER) {
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
+
+            back = ((t >> 2) & 7) + (*ip++ << 3) + 1;
+            len = (t >> 5) + 1;
+        } else if (t >= M3_MARKER) {
+            len = t & 31;
 
-                back = (1 << 14) + ((byte & 8) << 11);
+            if (len == 0) {
+                len = lzo_ext_len(&ip, ip_end, 31);
+                if (len == 0)
+                    return STATUS_INTERNAL_ERROR;
+            }
 
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+            len += 2;
 
-                back += (lzo_nextbyte(stream) << 6) + (byte >> 2);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
 
-                if (back == (1 << 14)) {
-                    if (len != 1)
-                        return STATUS_INTERNAL_ERROR;
-                    break;
-                }
+            back = (ip[0] >> 2) + (ip[1] << 6) + 1;
+            ip += 2;
+        } else { // M4
+            len = t & 7;
+
+            if (len == 0) {
+                len = lzo_ext_len(&ip, ip_end, 7);
+                if (len == 0)
+                    return STATUS_INTERNAL_ERROR;
             }
-        } else if (backcopy) {
-            len = 0;
-            back = (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
-        } else {
-            len = lzo_len(stream, byte, 15);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
 
-            lzo_copy(stream, min(len + 3, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            len += 2;
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
 
-            byte = lzo_nextbyte(stream);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            back = ((t & 8) << 11) + (ip[0] >> 2) + (ip[1] << 6);
+            ip += 2;
 
-            if (byte >> 4)
-                continue;
+            if (back == 0) { // end of stream
+                if (len != 3)
+                    return STATUS_INTERNAL_ERROR;
 
-            len = 1;
-            back = (1 << 11) + (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+                break;
+            }
 
-            break;
+            back += M3_MAX_OFFSET;
         }
 
-        lzo_copyback(stream, back, min(len + 2, stream->outlen - stream->outpos));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        // the low two bits of the last byte but one are how many literals follow
+        state = ip[-2] & 3;
+
+        if (back > (uint32_t)(op - stream->out))
+            return STATUS_INTERNAL_ERROR;
+
+        n = min(len, (uint32_t)(op_end - op));
+
+        lzo_copy_match(op, back, n);
+        op += n;
+
+        if (op == op_end)
+            break;
+
+        len = state;
+
+literals:
+        if (len > 0) {
+            n = min(len, (uint32_t)(op_end - op));
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+            if (n > (uint32_t)(ip_end - ip))
+                return STATUS_INTERNAL_ERROR;
 
-        len = byte & 3;
+            RtlCopyMemory(op, ip, n);
+            op += n;
+            ip += n;
 
-        if (len) {
-            lzo_copy(stream, min(len, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (op == op_end)
+                break;
+        }
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
-        } else
-            backcopy = !backcopy;
+        if (ip == ip_end)
+            return STATUS_INTERNAL_ERROR;
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        t = *ip++;
     }
 
+    stream->outpos = (uint32_t)(op - stream->out);
+
     return STATUS_SUCCESS;
 }
 
@@ -270,18 +337,21 @@ NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_
     outoff = 0;
 
     do {
+        if (inlen - inoff < sizeof(uint32_t)) {
+            ERR("overflow: %x + %x > %x\n", (uint32_t)sizeof(uint32_t), inoff, inlen);
+            return STATUS_INTERNAL_ERROR;
+        }
+
         partlen = *(uint32_t*)&inbuf[inoff];
+        inoff += sizeof(uint32_t);
 
-        if (partlen + inoff > inlen) {
+        if (partlen > inlen - inoff) {
             ERR("overflow: %x + %x > %x\n", partlen, inoff, inlen);
             return STATUS_INTERNAL_ERROR;
         }
 
-        inoff += sizeof(uint32_t);
-
         stream.in = &inbuf[inoff];
         stream.inlen = partlen;
-        stream.inpos = 0;
         stream.out = &outbuf[outoff];
         stream.outlen = min(outlen, LZO_PAGE_SIZE);
         stream.outpos = 0;
@@ -319,43 +389,87 @@ static void zlib_free(void* opaque, void* ptr) {
     ExFreePool(ptr);
 }
 
-NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left) {
-    z_stream c_stream;
+static z_stream* get_deflate(comp_ctx* ctx, z_stream* local, unsigned int level) {
+    z_stream* c_stream;
     int ret;
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+    if (ctx && ctx->deflate_init) {
+        if (ctx->deflate_level == level) {
+            ret = deflateReset(&ctx->deflate);
+
+            if (ret == Z_OK)
+                return &ctx->deflate;
+
+            ERR("deflateReset returned %i\n", ret);
+        }
+
+        deflateEnd(&ctx->deflate);
+        ctx->deflate_init = false;
+    }
+
+    c_stream = ctx ? &ctx->deflate : local;
 
-    ret = deflateInit(&c_stream, level);
+    c_stream->zalloc = zlib_alloc;
+    c_stream->zfree = zlib_free;
+    c_stream->opaque = (voidpf)0;
+
+    ret = deflateInit(c_stream, level);
 
     if (ret != Z_OK) {
         ERR("deflateInit returned %i\n", ret);
-        return STATUS_INTERNAL_ERROR;
+        return NULL;
     }
 
-    c_stream.next_in = inbuf;
-    c_stream.avail_in = inlen;
+    if (ctx) {
+        ctx->deflate_init = true;
+        ctx->deflate_level = level;
+    }
 
-    c_stream.next_out = outbuf;
-    c_stream.avail_out = outlen;
+    return c_stream;
+}
+
+static void put_deflate(comp_ctx* ctx, z_stream* c_stream, bool error) {
+    if (ctx && !error)
+        return;
+
+    deflateEnd(c_stream);
+
+    if (ctx)
+        ctx->deflate_init = false;
+}
+
+NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left,
+                       comp_ctx* ctx) {
+    z_stream local;
+    z_stream* c_stream;
+    int ret;
+
+    c_stream = get_deflate(ctx, &local, level);
+    if (!c_stream)
+        return STATUS_INTERNAL_ERROR;
+
+    c_stream->next_in = inbuf;
+    c_stream->avail_in = inlen;
+
+    c_stream->next_out = outbuf;
+    c_stream->avail_out = outlen;
 
     do {
-        ret = deflate(&c_stream, Z_FINISH);
+        ret = deflate(c_stream, Z_FINISH);
 
         if (ret != Z_OK && ret != Z_STREAM_END) {
             ERR("deflate returned %i\n", ret);
-            deflateEnd(&c_stream);
+            put_deflate(ctx, c_stream, true);
             return STATUS_INTERNAL_ERROR;
         }
 
-        if (c_stream.avail_in == 0 || c_stream.avail_out == 0)
+        if (c_stream->avail_in == 0 || c_stream->avail_out == 0)
             break;
     } while (ret != Z_STREAM_END);
 
-    deflateEnd(&c_stream);
+    *space_left = c_stream->avail_in > 0 ? 0 : c_stream->avail_out;
 
-    *space_left = c_stream.avail_in > 0 ? 0 : c_stream.avail_out;
+    put_deflate(ctx, c_stream, false);
 
     return STATUS_SUCCESS;
 }
@@ -406,241 +520,111 @@ NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS lzo_do_compress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t* out_len, void* wrkmem) {
-    const uint8_t* ip;
-    uint32_t dv;
-    uint8_t* op;
-    const uint8_t* in_end = in + in_len;
-    const uint8_t* ip_end = in + in_len - 9 - 4;
-    const uint8_t* ii;
-    const uint8_t** dict = (const uint8_t**)wrkmem;
-
-    op = out;
-    ip = in;
-    ii = ip;
-
-    DVAL_FIRST(dv, ip); UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-
-    while (1) {
-        const uint8_t* m_pos;
-        uint32_t m_len;
-        ptrdiff_t m_off;
-        uint32_t lit, dindex;
-
-        dindex = DINDEX(dv, ip);
-        m_pos = dict[dindex];
-        UPDATE_I(dict, cycle, dindex, ip);
-
-        if (!LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, M4_MAX_OFFSET) && m_pos[0] == ip[0] && m_pos[1] == ip[1] && m_pos[2] == ip[2]) {
-            lit = (uint32_t)(ip - ii);
-            m_pos += 3;
-            if (m_off <= M2_MAX_OFFSET)
-                goto match;
-
-            if (lit == 3) { /* better compression, but slower */
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
-
-                op[-2] |= LZO_BYTE(3);
-                *op++ = *ii++; *op++ = *ii++; *op++ = *ii++;
-                goto code_match;
-            }
-
-            if (*m_pos == ip[3])
-                goto match;
-        }
+// Writes a length too long for the opcode: zero bytes, each worth 255, then
+// the rest, which has to be at least 1.
+static __inline uint8_t* lzo_put_len(uint8_t* op, uint32_t len) {
+    while (len > 255) {
+        *op++ = 0;
+        len -= 255;
+    }
 
-        /* a literal */
-        ++ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_NEXT(dv, ip);
-        continue;
+    *op++ = (uint8_t)len;
 
-        /* a match */
-match:
-        /* store current literal run */
-        if (lit > 0) {
-            uint32_t t = lit;
+    return op;
+}
 
-            if (t <= 3) {
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
+static __inline uint8_t* lzo_put_literals(uint8_t* op, uint8_t* out, const uint8_t* lit, uint32_t len) {
+    if (len == 0)
+        return op;
 
-                op[-2] |= LZO_BYTE(t);
-            } else if (t <= 18)
-                *op++ = LZO_BYTE(t - 3);
-            else {
-                uint32_t tt = t - 18;
+    if (op == out && len <= 238)
+        *op++ = (uint8_t)(17 + len);
+    else if (len <= 3) // goes in the bottom bits of the previous match
+        op[-2] |= (uint8_t)len;
+    else if (len <= 18)
+        *op++ = (uint8_t)(len - 3);
+    else {
+        *op++ = 0;
+        op = lzo_put_len(op, len - 18);
+    }
 
-                *op++ = 0;
-                while (tt > 255) {
-                    tt -= 255;
-                    *op++ = 0;
-                }
+    RtlCopyMemory(op, lit, len);
 
-                if (tt <= 0)
-                    return STATUS_INTERNAL_ERROR;
+    return op + len;
+}
 
-                *op++ = LZO_BYTE(tt);
-            }
+static __inline uint8_t* lzo_put_match(uint8_t* op, uint32_t back, uint32_t len) {
+    back--;
 
-            do {
-                *op++ = *ii++;
-            } while (--t > 0);
+    if (len <= M2_MAX_LEN && back < M2_MAX_OFFSET) {
+        *op++ = (uint8_t)(((len - 1) << 5) | ((back & 7) << 2));
+        *op++ = (uint8_t)(back >> 3);
+    } else {
+        if (len <= M3_MAX_LEN)
+            *op++ = (uint8_t)(M3_MARKER | (len - 2));
+        else {
+            *op++ = M3_MARKER;
+            op = lzo_put_len(op, len - M3_MAX_LEN);
         }
 
+        *op++ = (uint8_t)((back & 63) << 2);
+        *op++ = (uint8_t)(back >> 6);
+    }
 
-        /* code the match */
-code_match:
-        if (ii != ip)
-            return STATUS_INTERNAL_ERROR;
-
-        ip += 3;
-        if (*m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++ ||
-            *m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++) {
-            --ip;
-            m_len = (uint32_t)(ip - ii);
-
-            if (m_len < 3 || m_len > 8)
-                return STATUS_INTERNAL_ERROR;
-
-            if (m_off <= M2_MAX_OFFSET) {
-                m_off -= 1;
-                *op++ = LZO_BYTE(((m_len - 1) << 5) | ((m_off & 7) << 2));
-                *op++ = LZO_BYTE(m_off >> 3);
-            } else if (m_off <= M3_MAX_OFFSET) {
-                m_off -= 1;
-                *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
-                goto m3_m4_offset;
-            } else {
-                m_off -= 0x4000;
-
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
+    return op;
+}
 
-                *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
-                goto m3_m4_offset;
-            }
-        } else {
-            const uint8_t* end;
-            end = in_end;
-            while (ip < end && *m_pos == *ip)
-                m_pos++, ip++;
-            m_len = (uint32_t)(ip - ii);
+// Compresses one page, of no more than LZO_PAGE_SIZE, as an LZO1X stream.
+// Like LZ4, we look up each position's first four bytes in a hash table, and
+// move through the input faster the longer we go without finding a match.
+static void lzo1x_1_compress(lzo_stream* stream, uint16_t* table) {
+    const uint8_t* in = stream->in;
+    const uint8_t* in_end = in + stream->inlen;
+    const uint8_t* ip = in;
+    const uint8_t* anchor = in;
+    uint8_t* op = stream->out;
 
-            if (m_len < 3)
-                return STATUS_INTERNAL_ERROR;
+    if (stream->inlen > sizeof(uint32_t)) {
+        const uint8_t* ip_limit = in_end - sizeof(uint32_t);
 
-            if (m_off <= M3_MAX_OFFSET) {
-                m_off -= 1;
-                if (m_len <= 33)
-                    *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
-                else {
-                    m_len -= 33;
-                    *op++ = M3_MARKER | 0;
-                    goto m3_m4_len;
-                }
-            } else {
-                m_off -= 0x4000;
+        RtlZeroMemory(table, LZO1X_MEM_COMPRESS);
 
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
+        while (ip <= ip_limit) {
+            uint32_t v = lzo_load32(ip);
+            uint32_t h = (v * 2654435761u) >> (32 - LZO_HASH_BITS);
+            const uint8_t* m = in + table[h];
+            uint32_t len;
 
-                if (m_len <= 9)
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
-                else {
-                    m_len -= 9;
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11));
-m3_m4_len:
-                    while (m_len > 255) {
-                        m_len -= 255;
-                        *op++ = 0;
-                    }
-
-                    if (m_len <= 0)
-                        return STATUS_INTERNAL_ERROR;
+            table[h] = (uint16_t)(ip - in);
 
-                    *op++ = LZO_BYTE(m_len);
-                }
+            if (m >= ip || lzo_load32(m) != v) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
             }
 
-m3_m4_offset:
-            *op++ = LZO_BYTE((m_off & 63) << 2);
-            *op++ = LZO_BYTE(m_off >> 6);
-        }
-
-        ii = ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_FIRST(dv, ip);
-    }
-
-    /* store final literal run */
-    if (in_end - ii > 0) {
-        uint32_t t = (uint32_t)(in_end - ii);
-
-        if (op == out && t <= 238)
-            *op++ = LZO_BYTE(17 + t);
-        else if (t <= 3)
-            op[-2] |= LZO_BYTE(t);
-        else if (t <= 18)
-            *op++ = LZO_BYTE(t - 3);
-        else {
-            uint32_t tt = t - 18;
-
-            *op++ = 0;
-            while (tt > 255) {
-                tt -= 255;
-                *op++ = 0;
+            while (ip > anchor && m > in && ip[-1] == m[-1]) {
+                ip--;
+                m--;
             }
 
-            if (tt <= 0)
-                return STATUS_INTERNAL_ERROR;
+            len = sizeof(uint32_t) + lzo_match_len(ip + sizeof(uint32_t), m + sizeof(uint32_t), in_end);
 
-            *op++ = LZO_BYTE(tt);
-        }
+            op = lzo_put_literals(op, stream->out, anchor, (uint32_t)(ip - anchor));
+            op = lzo_put_match(op, (uint32_t)(ip - m), len);
 
-        do {
-            *op++ = *ii++;
-        } while (--t > 0);
+            ip += len;
+            anchor = ip;
+        }
     }
 
-    *out_len = (uint32_t)(op - out);
-
-    return STATUS_SUCCESS;
-}
-
-static NTSTATUS lzo1x_1_compress(lzo_stream* stream) {
-    uint8_t *op = stream->out;
-    NTSTATUS Status = STATUS_SUCCESS;
-
-    if (stream->inlen <= 0)
-        stream->outlen = 0;
-    else if (stream->inlen <= 9 + 4) {
-        *op++ = LZO_BYTE(17 + stream->inlen);
-
-        stream->inpos = 0;
-        do {
-            *op++ = stream->in[stream->inpos];
-            stream->inpos++;
-        } while (stream->inlen < stream->inpos);
-        stream->outlen = (uint32_t)(op - stream->out);
-    } else
-        Status = lzo_do_compress(stream->in, stream->inlen, stream->out, &stream->outlen, stream->wrkmem);
+    op = lzo_put_literals(op, stream->out, anchor, (uint32_t)(in_end - anchor));
 
-    if (Status == STATUS_SUCCESS) {
-        op = stream->out + stream->outlen;
-        *op++ = M4_MARKER | 1;
-        *op++ = 0;
-        *op++ = 0;
-        stream->outlen += 3;
-    }
+    // end of stream
+    *op++ = M4_MARKER | 1;
+    *op++ = 0;
+    *op++ = 0;
 
-    return Status;
+    stream->outlen = (uint32_t)(op - stream->out);
 }
 
 static __inline uint32_t lzo_max_outlen(uint32_t inlen) {
@@ -659,18 +643,25 @@ static void zstd_free(void* opaque, void* address) {
     ExFreePool(address);
 }
 
-NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen) {
+NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, comp_ctx* ctx) {
     NTSTATUS Status;
     ZSTD_DStream* stream;
     size_t init_res, read;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
 
-    stream = ZSTD_createDStream_advanced(zstd_mem);
+    if (ctx && ctx->zstd_dstream)
+        stream = ctx->zstd_dstream;
+    else {
+        stream = ZSTD_createDStream_advanced(zstd_mem);
 
-    if (!stream) {
-        ERR("ZSTD_createDStream failed.\n");
-        return STATUS_INTERNAL_ERROR;
+        if (!stream) {
+            ERR("ZSTD_createDStream failed.\n");
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ctx)
+            ctx->zstd_dstream = stream;
     }
 
     init_res = ZSTD_initDStream(stream);
@@ -705,17 +696,23 @@ NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32
     Status = STATUS_SUCCESS;
 
 end:
-    ZSTD_freeDStream(stream);
+    // ZSTD_initDStream resets it for next time, but don't keep it after an error
+    if (!ctx || !NT_SUCCESS(Status)) {
+        ZSTD_freeDStream(stream);
+
+        if (ctx)
+            ctx->zstd_dstream = NULL;
+    }
 
     return Status;
 }
 
-NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left) {
-    NTSTATUS Status;
+NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left, comp_ctx* ctx) {
     unsigned int num_pages;
     unsigned int comp_data_len;
     uint8_t* comp_data;
     lzo_stream stream;
+    uint16_t* table;
     uint32_t* out_size;
 
     num_pages = (unsigned int)sector_align(inlen, LZO_PAGE_SIZE) / LZO_PAGE_SIZE;
@@ -728,17 +725,39 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
 
     // FIXME - can we write this so comp_data isn't necessary?
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    if (ctx && ctx->lzo_buflen < comp_data_len) {
+        if (ctx->lzo_buf)
+            ExFreePool(ctx->lzo_buf);
+
+        ctx->lzo_buf = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
+        ctx->lzo_buflen = ctx->lzo_buf ? comp_data_len : 0;
     }
 
-    stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
-    if (!stream.wrkmem) {
-        ERR("out of memory\n");
-        ExFreePool(comp_data);
-        return STATUS_INSUFFICIENT_RESOURCES;
+    if (ctx && ctx->lzo_buf)
+        comp_data = ctx->lzo_buf;
+    else {
+        comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
+        if (!comp_data) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (ctx && !ctx->lzo_wrkmem)
+        ctx->lzo_wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
+
+    if (ctx && ctx->lzo_wrkmem)
+        table = ctx->lzo_wrkmem;
+    else {
+        table = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
+        if (!table) {
+            ERR("out of memory\n");
+
+            if (comp_data != (ctx ? ctx->lzo_buf : NULL))
+                ExFreePool(comp_data);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
     out_size = (uint32_t*)comp_data;
@@ -750,14 +769,9 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
     for (unsigned int i = 0; i < num_pages; i++) {
         uint32_t* pagelen = (uint32_t*)(stream.out - sizeof(uint32_t));
 
-        stream.inlen = (uint32_t)min(LZO_PAGE_SIZE, outlen - (i * LZO_PAGE_SIZE));
+        stream.inlen = (uint32_t)min(LZO_PAGE_SIZE, inlen - (i * LZO_PAGE_SIZE));
 
-        Status = lzo1x_1_compress(&stream);
-        if (!NT_SUCCESS(Status)) {
-            ERR("lzo1x_1_compress returned %08lx\n", Status);
-            ExFreePool(comp_data);
-            return Status;
-        }
+        lzo1x_1_compress(&stream, table);
 
         *pagelen = stream.outlen;
         *out_size += stream.outlen + sizeof(uint32_t);
@@ -771,9 +785,11 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
             stream.out += LZO_PAGE_SIZE - (*out_size % LZO_PAGE_SIZE);
             *out_size += LZO_PAGE_SIZE - (*out_size % LZO_PAGE_SIZE);
         }
-    }
 
-    ExFreePool(stream.wrkmem);
+        // no point carrying on if it's not going to fit
+        if (*out_size >= outlen)
+            break;
+    }
 
     if (*out_size >= outlen)
         *space_left = 0;
@@ -783,23 +799,47 @@ NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
         RtlCopyMemory(outbuf, comp_data, *out_size);
     }
 
-    ExFreePool(comp_data);
+    if (!ctx || table != ctx->lzo_wrkmem)
+        ExFreePool(table);
+
+    if (!ctx || comp_data != ctx->lzo_buf)
+        ExFreePool(comp_data);
 
     return STATUS_SUCCESS;
 }
 
-NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left) {
+static void put_zstd_cstream(comp_ctx* ctx, ZSTD_CStream* stream, bool error) {
+    if (ctx && !error)
+        return;
+
+    ZSTD_freeCStream(stream);
+
+    if (ctx)
+        ctx->zstd_cstream = NULL;
+}
+
+NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left,
+                       comp_ctx* ctx) {
     ZSTD_CStream* stream;
     size_t init_res, written;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
     ZSTD_parameters params;
 
-    stream = ZSTD_createCStream_advanced(zstd_mem);
+    // ZSTD_initCStream_advanced below resets a reused stream, and keeps its
+    // workspace if the new level fits in it
+    if (ctx && ctx->zstd_cstream)
+        stream = ctx->zstd_cstream;
+    else {
+        stream = ZSTD_createCStream_advanced(zstd_mem);
 
-    if (!stream) {
-        ERR("ZSTD_createCStream failed.\n");
-        return STATUS_INTERNAL_ERROR;
+        if (!stream) {
+            ERR("ZSTD_createCStream failed.\n");
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ctx)
+            ctx->zstd_cstream = stream;
     }
 
     params = ZSTD_getParams(level, inlen, 0);
@@ -811,7 +851,7 @@ NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
 
     if (ZSTD_isError(init_res)) {
         ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
-        ZSTD_freeCStream(stream);
+        put_zstd_cstream(ctx, stream, true);
         return STATUS_INTERNAL_ERROR;
     }
 
@@ -828,7 +868,7 @@ NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
 
         if (ZSTD_isError(written)) {
             ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
-            ZSTD_freeCStream(stream);
+            put_zstd_cstream(ctx, stream, true);
             return STATUS_INTERNAL_ERROR;
         }
     }
@@ -836,11 +876,11 @@ NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
     written = ZSTD_endStream(stream, &output);
     if (ZSTD_isError(written)) {
         ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
-        ZSTD_freeCStream(stream);
+        put_zstd_cstream(ctx, stream, true);
         return STATUS_INTERNAL_ERROR;
     }
 
-    ZSTD_freeCStream(stream);
+    put_zstd_cstream(ctx, stream, false);
 
     if (input.pos < input.size) // output would be larger than input
         *space_left = 0;
@@ -850,156 +890,212 @@ NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t
     return STATUS_SUCCESS;
 }
 
-typedef struct {
-    uint8_t buf[COMPRESSED_EXTENT_SIZE];
-    uint8_t compression_type;
-    unsigned int inlen;
-    unsigned int outlen;
-    calc_job* cj;
-} comp_part;
+// The heuristic from Linux (fs/btrfs/compression.c), which looks at a sample
+// of the data to decide whether it's worth running the compressor. The sample
+// is 16 bytes out of every 256, and it's compressible if:
+// - its second half repeats the first, or
+// - it uses fewer than 64 different byte values, or
+// - 90% of it is made up of 64 or fewer byte values, or
+// - that takes fewer than 200, and its entropy is below 80% of the maximum.
+// Linux lets everything below 80% through too, rather than trying any harder
+// with those between 65% and 80%.
+
+#define HEURISTIC_READ_SIZE         16
+#define HEURISTIC_INTERVAL          256
+#define HEURISTIC_MIN_SAMPLES       16
+#define HEURISTIC_BYTE_SET          64
+#define HEURISTIC_CORE_SET_LOW      64
+#define HEURISTIC_CORE_SET_HIGH     200
+#define HEURISTIC_ENTROPY_HIGH      80
+
+static __inline unsigned int ilog2_64(uint64_t v) {
+    unsigned int r = 0;
+
+    if (v >= (uint64_t)1 << 32) { v >>= 32; r += 32; }
+    if (v >= (uint64_t)1 << 16) { v >>= 16; r += 16; }
+    if (v >= (uint64_t)1 << 8) { v >>= 8; r += 8; }
+    if (v >= (uint64_t)1 << 4) { v >>= 4; r += 4; }
+    if (v >= (uint64_t)1 << 2) { v >>= 2; r += 2; }
+    if (v >= (uint64_t)1 << 1) r += 1;
+
+    return r;
+}
 
-NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    uint64_t i;
-    unsigned int num_parts = (unsigned int)sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
-    uint8_t type;
-    comp_part* parts;
-    unsigned int buflen = 0;
-    uint8_t* buf;
-    chunk* c = NULL;
-    LIST_ENTRY* le;
-    uint64_t address, extaddr;
-    void* csum = NULL;
+// log2 of n^4, which keeps enough precision for the entropy in integers
+static __inline unsigned int ilog2_w(uint64_t n) {
+    return ilog2_64(n * n * n * n);
+}
 
-    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
-    }
+bool compression_heuristic(const uint8_t* data, uint32_t len) {
+    uint16_t buckets[256];
+    unsigned int num_samples, sample_size, byte_set, core_set, coverage, sz_base;
+    uint64_t entropy;
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08lx\n", Status);
-        return Status;
-    }
+    if (len > COMPRESSED_EXTENT_SIZE)
+        len = COMPRESSED_EXTENT_SIZE;
 
-    parts = ExAllocatePoolWithTag(PagedPool, sizeof(comp_part) * num_parts, ALLOC_TAG);
-    if (!parts) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    num_samples = len < HEURISTIC_READ_SIZE ? 0 : ((len - HEURISTIC_READ_SIZE) / HEURISTIC_INTERVAL) + 1;
 
-    for (i = 0; i < num_parts; i++) {
-        if (i == num_parts - 1)
-            parts[i].inlen = ((unsigned int)(end_data - start_data) - ((num_parts - 1) * COMPRESSED_EXTENT_SIZE));
-        else
-            parts[i].inlen = COMPRESSED_EXTENT_SIZE;
+    // too little to go on, so leave it to the compressor
+    if (num_samples < HEURISTIC_MIN_SAMPLES)
+        return true;
 
-        Status = add_calc_job_comp(fcb->Vcb, type, (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE), parts[i].inlen,
-                                   parts[i].buf, parts[i].inlen, &parts[i].cj);
-        if (!NT_SUCCESS(Status)) {
-            ERR("add_calc_job_comp returned %08lx\n", Status);
+    sample_size = num_samples * HEURISTIC_READ_SIZE;
 
-            for (unsigned int j = 0; j < i; j++) {
-                KeWaitForSingleObject(&parts[j].cj->event, Executive, KernelMode, false, NULL);
-                ExFreePool(parts[j].cj);
-            }
+    {
+        unsigned int half = num_samples / 2, i;
 
-            ExFreePool(parts);
-            return Status;
+        for (i = 0; i < half; i++) {
+            if (RtlCompareMemory(data + (i * HEURISTIC_INTERVAL), data + ((half + i) * HEURISTIC_INTERVAL),
+                                 HEURISTIC_READ_SIZE) != HEURISTIC_READ_SIZE) {
+                break;
+            }
         }
-    }
 
-    Status = STATUS_SUCCESS;
+        if (i == half)
+            return true;
+    }
 
-    for (int i = num_parts - 1; i >= 0; i--) {
-        calc_thread_main(fcb->Vcb, parts[i].cj);
+    RtlZeroMemory(buckets, sizeof(buckets));
 
-        KeWaitForSingleObject(&parts[i].cj->event, Executive, KernelMode, false, NULL);
+    for (unsigned int i = 0; i < num_samples; i++) {
+        const uint8_t* s = data + (i * HEURISTIC_INTERVAL);
 
-        if (!NT_SUCCESS(parts[i].cj->Status))
-            Status = parts[i].cj->Status;
+        for (unsigned int j = 0; j < HEURISTIC_READ_SIZE; j++) {
+            buckets[s[j]]++;
+        }
     }
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("calc job returned %08lx\n", Status);
-
-        for (unsigned int i = 0; i < num_parts; i++) {
-            ExFreePool(parts[i].cj);
-        }
+    byte_set = 0;
 
-        ExFreePool(parts);
-        return Status;
+    for (unsigned int i = 0; i < 256; i++) {
+        if (buckets[i] != 0)
+            byte_set++;
     }
 
-    for (unsigned int i = 0; i < num_parts; i++) {
-        if (parts[i].cj->space_left >= fcb->Vcb->superblock.sector_size) {
-            parts[i].compression_type = type;
-            parts[i].outlen = parts[i].inlen - parts[i].cj->space_left;
+    if (byte_set < HEURISTIC_BYTE_SET)
+        return true;
 
-            if (type == BTRFS_COMPRESSION_LZO)
-                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-            else if (type == BTRFS_COMPRESSION_ZSTD)
-                fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    // Shell sort, most common first
+    {
+        static const unsigned int gaps[] = { 132, 57, 23, 10, 4, 1 };
 
-            if ((parts[i].outlen & (fcb->Vcb->superblock.sector_size - 1)) != 0) {
-                unsigned int newlen = (unsigned int)sector_align(parts[i].outlen, fcb->Vcb->superblock.sector_size);
+        for (unsigned int g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+            unsigned int gap = gaps[g];
 
-                RtlZeroMemory(parts[i].buf + parts[i].outlen, newlen - parts[i].outlen);
+            for (unsigned int i = gap; i < 256; i++) {
+                uint16_t v = buckets[i];
+                unsigned int j = i;
+
+                while (j >= gap && buckets[j - gap] < v) {
+                    buckets[j] = buckets[j - gap];
+                    j -= gap;
+                }
 
-                parts[i].outlen = newlen;
+                buckets[j] = v;
             }
-        } else {
-            parts[i].compression_type = BTRFS_COMPRESSION_NONE;
-            parts[i].outlen = (unsigned int)sector_align(parts[i].inlen, fcb->Vcb->superblock.sector_size);
         }
+    }
+
+    coverage = 0;
 
-        buflen += parts[i].outlen;
-        ExFreePool(parts[i].cj);
+    for (core_set = 0; core_set < 256 && coverage * 10 < sample_size * 9; core_set++) {
+        coverage += buckets[core_set];
     }
 
-    // check if first 128 KB of file is incompressible
+    if (core_set <= HEURISTIC_CORE_SET_LOW)
+        return true;
 
-    if (start_data == 0 && parts[0].compression_type == BTRFS_COMPRESSION_NONE && !fcb->Vcb->options.compress_force) {
-        TRACE("adding nocompress flag to subvol %I64x, inode %I64x\n", fcb->subvol->id, fcb->inode);
+    if (core_set >= HEURISTIC_CORE_SET_HIGH)
+        return false;
 
-        fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
-        fcb->inode_item_changed = true;
-        mark_fcb_dirty(fcb);
+    sz_base = ilog2_w(sample_size);
+    entropy = 0;
+
+    for (unsigned int i = 0; i < 256 && buckets[i] != 0; i++) {
+        entropy += (uint64_t)buckets[i] * (sz_base - ilog2_w(buckets[i]));
     }
 
-    // join together into continuous buffer
+    entropy /= sample_size;
 
-    buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
-    if (!buf) {
+    // the maximum is 8 bits a byte, times 4 for the fourth powers
+    return entropy * 100 / (8 * 4) < HEURISTIC_ENTROPY_HIGH;
+}
+
+comp_ctx* comp_ctx_alloc() {
+    comp_ctx* ctx = ExAllocatePoolWithTag(PagedPool, sizeof(comp_ctx), ALLOC_TAG);
+
+    if (!ctx) {
         ERR("out of memory\n");
-        ExFreePool(parts);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        return NULL;
     }
 
-    {
-        uint8_t* buf2 = buf;
+    RtlZeroMemory(ctx, sizeof(comp_ctx));
 
-        for (i = 0; i < num_parts; i++) {
-            if (parts[i].compression_type == BTRFS_COMPRESSION_NONE)
-                RtlCopyMemory(buf2, (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE), parts[i].outlen);
-            else
-                RtlCopyMemory(buf2, parts[i].buf, parts[i].outlen);
+    return ctx;
+}
 
-            buf2 += parts[i].outlen;
-        }
-    }
+void comp_ctx_free(comp_ctx* ctx) {
+    if (ctx->deflate_init)
+        deflateEnd(&ctx->deflate);
+
+    if (ctx->zstd_cstream)
+        ZSTD_freeCStream(ctx->zstd_cstream);
+
+    if (ctx->zstd_dstream)
+        ZSTD_freeDStream(ctx->zstd_dstream);
 
-    // find an address
+    if (ctx->lzo_wrkmem)
+        ExFreePool(ctx->lzo_wrkmem);
+
+    if (ctx->lzo_buf)
+        ExFreePool(ctx->lzo_buf);
+
+    ExFreePool(ctx);
+}
+
+#ifdef _KERNEL_MODE
+typedef struct {
+    uint8_t compression_type;
+    unsigned int inlen;
+    unsigned int outlen;
+    bool skipped;
+    chunk* c;
+    uint64_t address;
+    void* csum;
+} comp_part;
+
+#define COMP_WRITE_DEPTH 8 // parts of a write_compressed being compressed or written at once
+
+typedef struct {
+    uint8_t* buf; // from comp_buf_lookaside
+    calc_job* cj;
+    write_data_context wtc;
+    bool in_flight;
+} comp_slot;
+
+// After a write to an inode where nothing compressed, we don't try again for
+// a while: 1 MB the first time, doubling each time after that up to 32 MB, and
+// back to trying every write once something does compress.
+#define COMP_SKIP_BASE          0x100000
+#define COMP_SKIP_MAX_SHIFT     5
+
+bool compression_skip(fcb* fcb, uint64_t length) {
+    if (fcb->Vcb->options.compress_force || fcb->comp_skip == 0)
+        return false;
+
+    fcb->comp_skip -= min(fcb->comp_skip, length);
+
+    InterlockedExchangeAdd64((LONG64*)&fcb->Vcb->comp_stats.skipped_inode, length);
+
+    return true;
+}
+
+static NTSTATUS find_compressed_address(fcb* fcb, unsigned int buflen, chunk** pc, uint64_t* paddress, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    chunk* c = NULL;
+    LIST_ENTRY* le;
+    uint64_t address;
 
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, true);
 
@@ -1039,8 +1135,6 @@ NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void
 
         if (!NT_SUCCESS(Status)) {
             ERR("alloc_chunk returned %08lx\n", Status);
-            ExFreePool(buf);
-            ExFreePool(parts);
             return Status;
         }
 
@@ -1057,65 +1151,335 @@ NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void
 
     if (!c) {
         WARN("couldn't find any data chunks with %x bytes free\n", buflen);
-        ExFreePool(buf);
-        ExFreePool(parts);
         return STATUS_DISK_FULL;
     }
 
-    // write to disk
+    *pc = c;
+    *paddress = address;
 
-    TRACE("writing %x bytes to %I64x\n", buflen, address);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS comp_slot_wait(device_extension* Vcb, comp_slot* cs) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+
+    if (!cs->in_flight)
+        return STATUS_SUCCESS;
+
+    if (cs->wtc.need_wait)
+        KeWaitForSingleObject(&cs->wtc.Event, Executive, KernelMode, false, NULL);
+
+    le = cs->wtc.stripes.Flink;
+    while (le != &cs->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            Status = stripe->iosb.Status;
+            log_device_error(Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    free_write_data_stripes(&cs->wtc);
+
+    cs->in_flight = false;
+
+    return Status;
+}
+
+// Launches the write of a part without waiting for it, unless it's going to
+// RAID5 or RAID6, where the stripe range lock means doing it synchronously.
+static NTSTATUS comp_slot_write(fcb* fcb, comp_slot* cs, comp_part* part, void* data, PIRP Irp) {
+    NTSTATUS Status;
+    ULONG priority = fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority;
+    LIST_ENTRY* le;
 
-    Status = write_data_complete(fcb->Vcb, address, buf, buflen, Irp, NULL, false, 0,
-                                 fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+    if (part->c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)) {
+        Status = write_data_complete(fcb->Vcb, part->address, data, part->outlen, Irp, part->c, false, 0, priority);
+        if (!NT_SUCCESS(Status))
+            ERR("write_data_complete returned %08lx\n", Status);
+
+        return Status;
+    }
+
+    KeInitializeEvent(&cs->wtc.Event, NotificationEvent, false);
+    InitializeListHead(&cs->wtc.stripes);
+    cs->wtc.need_wait = false;
+    cs->wtc.stripes_left = 0;
+    cs->wtc.parity1 = cs->wtc.parity2 = cs->wtc.scratch = NULL;
+    cs->wtc.mdl = cs->wtc.parity1_mdl = cs->wtc.parity2_mdl = NULL;
+
+    Status = write_data(fcb->Vcb, part->address, data, part->outlen, &cs->wtc, Irp, part->c, false, 0, priority);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_data_complete returned %08lx\n", Status);
-        ExFreePool(buf);
-        ExFreePool(parts);
+        ERR("write_data returned %08lx\n", Status);
+        free_write_data_stripes(&cs->wtc);
         return Status;
     }
 
-    // FIXME - do rest of the function while we're waiting for I/O to finish?
+    le = cs->wtc.stripes.Flink;
+    while (le != &cs->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
 
-    // calculate csums if necessary
+        if (stripe->status != WriteDataStatus_Ignore) {
+            cs->wtc.need_wait = true;
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+        }
 
-    if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
-        unsigned int sl = buflen >> fcb->Vcb->sector_shift;
+        le = le->Flink;
+    }
 
-        csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
-        if (!csum) {
+    cs->in_flight = true;
+
+    return STATUS_SUCCESS;
+}
+
+// Each part is compressed by the calc threads into one of COMP_WRITE_DEPTH
+// pooled buffers, and as soon as it's done (in order), it gets its own
+// address and its write is launched, while the parts after it are still being
+// compressed. The buffer is reused once the write's finished, so however big
+// the write, we never have more than COMP_WRITE_DEPTH parts' worth in flight.
+NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status, Status2;
+    device_extension* Vcb = fcb->Vcb;
+    uint32_t part_size = Vcb->options.compress_part_size;
+    unsigned int num_parts = (unsigned int)sector_align(end_data - start_data, part_size) / part_size;
+    unsigned int depth = min(num_parts, COMP_WRITE_DEPTH), next_comp = 0, i;
+    uint8_t type;
+    comp_part* parts;
+    comp_slot* slots;
+    unsigned int num_compressed = 0;
+    uint64_t comp_in = 0, comp_out = 0, incompressible = 0, skipped = 0;
+
+    if (Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
+        type = Vcb->options.compress_type;
+    else {
+        if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
+            type = BTRFS_COMPRESSION_LZO;
+        else if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
+            type = BTRFS_COMPRESSION_LZO;
+        else
+            type = BTRFS_COMPRESSION_ZLIB;
+    }
+
+    Status = excise_extents(Vcb, fcb, start_data, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    parts = ExAllocatePoolWithTag(PagedPool, sizeof(comp_part) * num_parts, ALLOC_TAG);
+    if (!parts) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(parts, sizeof(comp_part) * num_parts);
+
+    // needs to be non-paged, as it contains the events we wait on
+    slots = ExAllocatePoolWithTag(NonPagedPool, sizeof(comp_slot) * depth, ALLOC_TAG);
+    if (!slots) {
+        ERR("out of memory\n");
+        ExFreePool(parts);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(slots, sizeof(comp_slot) * depth);
+
+    for (i = 0; i < depth; i++) {
+        slots[i].buf = ExAllocateFromPagedLookasideList(&Vcb->comp_buf_lookaside);
+        if (!slots[i].buf) {
             ERR("out of memory\n");
-            ExFreePool(buf);
-            ExFreePool(parts);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
+    }
 
-        do_calc_job(fcb->Vcb, buf, sl, csum);
+    for (i = 0; i < num_parts; i++) {
+        comp_slot* cs;
+        comp_part* part = &parts[i];
+        uint8_t* src;
+
+        // keep the calc threads busy with the parts after this one
+        while (next_comp < num_parts && next_comp < i + depth) {
+            cs = &slots[next_comp % depth];
+
+            Status = comp_slot_wait(Vcb, cs);
+            if (!NT_SUCCESS(Status)) {
+                ERR("comp_slot_wait returned %08lx\n", Status);
+                goto end;
+            }
+
+            if (next_comp == num_parts - 1)
+                parts[next_comp].inlen = (unsigned int)(end_data - start_data) - ((num_parts - 1) * part_size);
+            else
+                parts[next_comp].inlen = part_size;
+
+            Status = add_calc_job_comp(Vcb, type, (uint8_t*)data + (next_comp * part_size), parts[next_comp].inlen,
+                                       cs->buf, parts[next_comp].inlen, &cs->cj);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_calc_job_comp returned %08lx\n", Status);
+                goto end;
+            }
+
+            next_comp++;
+        }
+
+        cs = &slots[i % depth];
+
+        calc_thread_main(Vcb, cs->cj, NULL);
+
+        KeWaitForSingleObject(&cs->cj->event, Executive, KernelMode, false, NULL);
+
+        Status = cs->cj->Status;
+        part->skipped = cs->cj->skipped;
+
+        if (NT_SUCCESS(Status) && cs->cj->space_left >= Vcb->superblock.sector_size) {
+            part->compression_type = type;
+            part->outlen = part->inlen - cs->cj->space_left;
+
+            if (type == BTRFS_COMPRESSION_LZO)
+                Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+            else if (type == BTRFS_COMPRESSION_ZSTD)
+                Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+
+            if ((part->outlen & (Vcb->superblock.sector_size - 1)) != 0) {
+                unsigned int newlen = (unsigned int)sector_align(part->outlen, Vcb->superblock.sector_size);
+
+                RtlZeroMemory(cs->buf + part->outlen, newlen - part->outlen);
+
+                part->outlen = newlen;
+            }
+
+            src = cs->buf;
+
+            num_compressed++;
+            comp_in += part->inlen;
+            comp_out += part->outlen;
+        } else {
+            part->compression_type = BTRFS_COMPRESSION_NONE;
+            part->outlen = (unsigned int)sector_align(part->inlen, Vcb->superblock.sector_size);
+
+            // no need to copy it anywhere, we can write it straight from data
+            src = (uint8_t*)data + (i * part_size);
+
+            if (part->skipped)
+                skipped += part->inlen;
+            else
+                incompressible += part->inlen;
+        }
+
+        ExFreePool(cs->cj);
+        cs->cj = NULL;
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("calc job returned %08lx\n", Status);
+            goto end;
+        }
+
+        Status = find_compressed_address(fcb, part->outlen, &part->c, &part->address, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("find_compressed_address returned %08lx\n", Status);
+            goto end;
+        }
+
+        if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+            unsigned int sl = part->outlen >> Vcb->sector_shift;
+
+            part->csum = ExAllocatePoolWithTag(PagedPool, sl * Vcb->csum_size, ALLOC_TAG);
+            if (!part->csum) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            do_calc_job(Vcb, src, sl, part->csum);
+        }
+
+        TRACE("writing %x bytes to %I64x\n", part->outlen, part->address);
+
+        Status = comp_slot_write(fcb, cs, part, src, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("comp_slot_write returned %08lx\n", Status);
+            goto end;
+        }
     }
 
-    ExFreePool(buf);
+end:
+    // make sure the calc threads and the disks are done with our buffers
+    for (i = 0; i < depth; i++) {
+        if (slots[i].cj) {
+            KeWaitForSingleObject(&slots[i].cj->event, Executive, KernelMode, false, NULL);
+            ExFreePool(slots[i].cj);
+        }
 
-    // add extents to fcb
+        Status2 = comp_slot_wait(Vcb, &slots[i]);
+        if (!NT_SUCCESS(Status2)) {
+            ERR("comp_slot_wait returned %08lx\n", Status2);
+
+            if (NT_SUCCESS(Status))
+                Status = Status2;
+        }
+
+        if (slots[i].buf)
+            ExFreeToPagedLookasideList(&Vcb->comp_buf_lookaside, slots[i].buf);
+    }
+
+    ExFreePool(slots);
+
+    if (!NT_SUCCESS(Status)) {
+        for (i = 0; i < num_parts; i++) {
+            if (parts[i].csum)
+                ExFreePool(parts[i].csum);
+        }
+
+        ExFreePool(parts);
+        return Status;
+    }
 
-    extaddr = address;
+    InterlockedExchangeAdd64((LONG64*)&Vcb->comp_stats.compressed_in, comp_in);
+    InterlockedExchangeAdd64((LONG64*)&Vcb->comp_stats.compressed_out, comp_out);
+    InterlockedExchangeAdd64((LONG64*)&Vcb->comp_stats.incompressible, incompressible);
+    InterlockedExchangeAdd64((LONG64*)&Vcb->comp_stats.skipped_heuristic, skipped);
+
+    if (num_compressed == 0) {
+        if (fcb->comp_failures <= COMP_SKIP_MAX_SHIFT)
+            fcb->comp_failures++;
+
+        fcb->comp_skip = (uint64_t)COMP_SKIP_BASE << (fcb->comp_failures - 1);
+    } else
+        fcb->comp_failures = 0;
+
+    // check if first 128 KB of file is incompressible - only if we actually tried, as Linux does
+
+    if (start_data == 0 && parts[0].compression_type == BTRFS_COMPRESSION_NONE && !parts[0].skipped && !Vcb->options.compress_force) {
+        TRACE("adding nocompress flag to subvol %I64x, inode %I64x\n", fcb->subvol->id, fcb->inode);
+
+        fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
+        fcb->inode_item_changed = true;
+        mark_fcb_dirty(fcb);
+    }
+
+    // add extents to fcb
 
     for (i = 0; i < num_parts; i++) {
         EXTENT_DATA* ed;
         EXTENT_DATA2* ed2;
-        void* csum2;
 
         ed = ExAllocatePoolWithTag(PagedPool, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), ALLOC_TAG);
         if (!ed) {
             ERR("out of memory\n");
-            ExFreePool(parts);
-
-            if (csum)
-                ExFreePool(csum);
-
-            return STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
         }
 
-        ed->generation = fcb->Vcb->superblock.generation;
+        ed->generation = Vcb->superblock.generation;
         ed->decoded_size = parts[i].inlen;
         ed->compression = parts[i].compression_type;
         ed->encryption = BTRFS_ENCRYPTION_NONE;
@@ -1123,69 +1487,170 @@ NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void
         ed->type = EXTENT_TYPE_REGULAR;
 
         ed2 = (EXTENT_DATA2*)ed->data;
-        ed2->address = extaddr;
+        ed2->address = parts[i].address;
         ed2->size = parts[i].outlen;
         ed2->offset = 0;
         ed2->num_bytes = parts[i].inlen;
 
-        if (csum) {
-            csum2 = ExAllocatePoolWithTag(PagedPool, (parts[i].outlen * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift, ALLOC_TAG);
-            if (!csum2) {
-                ERR("out of memory\n");
-                ExFreePool(ed);
-                ExFreePool(parts);
-                ExFreePool(csum);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+        Status = add_extent_to_fcb(fcb, start_data + (i * part_size), ed, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2),
+                                   true, parts[i].csum, rollback);
 
-            RtlCopyMemory(csum2, (uint8_t*)csum + (((extaddr - address) * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift),
-                          (parts[i].outlen * fcb->Vcb->csum_size) >> fcb->Vcb->sector_shift);
-        } else
-            csum2 = NULL;
+        ExFreePool(ed);
 
-        Status = add_extent_to_fcb(fcb, start_data + (i * COMPRESSED_EXTENT_SIZE), ed, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2),
-                                   true, csum2, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("add_extent_to_fcb returned %08lx\n", Status);
-            ExFreePool(ed);
-            ExFreePool(parts);
+            break;
+        }
 
-            if (csum)
-                ExFreePool(csum);
+        parts[i].csum = NULL; // now belongs to the extent
 
-            return Status;
+        fcb->inode_item.st_blocks += parts[i].inlen;
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        for (i = 0; i < num_parts; i++) {
+            if (parts[i].csum)
+                ExFreePool(parts[i].csum);
         }
 
-        ExFreePool(ed);
+        ExFreePool(parts);
+        return Status;
+    }
 
-        fcb->inode_item.st_blocks += parts[i].inlen;
+    // update extent refcounts
+
+    for (i = 0; i < num_parts; i++) {
+        chunk* c = parts[i].c;
+
+        ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+
+        add_changed_extent_ref(c, parts[i].address, parts[i].outlen, fcb->subvol->id, fcb->inode,
+                               start_data + (i * part_size), 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
 
-        extaddr += parts[i].outlen;
+        ExReleaseResourceLite(&c->changed_extents_lock);
     }
 
-    if (csum)
-        ExFreePool(csum);
+    fcb->extents_changed = true;
+    fcb->inode_item_changed = true;
+    mark_fcb_dirty(fcb);
 
-    // update extent refcounts
+    ExFreePool(parts);
 
-    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+    return STATUS_SUCCESS;
+}
 
-    extaddr = address;
+// writes an already-compressed extent as-is, e.g. from a received send stream
+NTSTATUS write_encoded(fcb* fcb, uint64_t start_data, uint64_t num_bytes, uint64_t decoded_size, uint64_t decoded_offset,
+                       uint8_t compression, uint8_t* data, unsigned int datalen, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    unsigned int buflen = (unsigned int)sector_align(datalen, fcb->Vcb->superblock.sector_size);
+    uint8_t* buf;
+    chunk* c;
+    uint64_t address;
+    EXTENT_DATA* ed;
+    EXTENT_DATA2* ed2;
+    void* csum = NULL;
 
-    for (i = 0; i < num_parts; i++) {
-        add_changed_extent_ref(c, extaddr, parts[i].outlen, fcb->subvol->id, fcb->inode,
-                               start_data + (i * COMPRESSED_EXTENT_SIZE), 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
+    Status = excise_extents(fcb->Vcb, fcb, start_data, start_data + num_bytes, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08lx\n", Status);
+        return Status;
+    }
+
+    buf = ExAllocatePoolWithTag(PagedPool, buflen, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(buf, data, datalen);
+
+    if (buflen > datalen)
+        RtlZeroMemory(buf + datalen, buflen - datalen);
+
+    Status = find_compressed_address(fcb, buflen, &c, &address, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_compressed_address returned %08lx\n", Status);
+        ExFreePool(buf);
+        return Status;
+    }
+
+    TRACE("writing %x bytes to %I64x\n", buflen, address);
+
+    Status = write_data_complete(fcb->Vcb, address, buf, buflen, Irp, NULL, false, 0, NormalPagePriority);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_data_complete returned %08lx\n", Status);
+        ExFreePool(buf);
+        return Status;
+    }
+
+    if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+        unsigned int sl = buflen >> fcb->Vcb->sector_shift;
+
+        csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
+        if (!csum) {
+            ERR("out of memory\n");
+            ExFreePool(buf);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        do_calc_job(fcb->Vcb, buf, sl, csum);
+    }
+
+    ExFreePool(buf);
 
-        extaddr += parts[i].outlen;
+    ed = ExAllocatePoolWithTag(PagedPool, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), ALLOC_TAG);
+    if (!ed) {
+        ERR("out of memory\n");
+
+        if (csum)
+            ExFreePool(csum);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    ed->generation = fcb->Vcb->superblock.generation;
+    ed->decoded_size = decoded_size;
+    ed->compression = compression;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_REGULAR;
+
+    ed2 = (EXTENT_DATA2*)ed->data;
+    ed2->address = address;
+    ed2->size = buflen;
+    ed2->offset = decoded_offset;
+    ed2->num_bytes = num_bytes;
+
+    Status = add_extent_to_fcb(fcb, start_data, ed, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2), true, csum, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_extent_to_fcb returned %08lx\n", Status);
+        ExFreePool(ed);
+
+        if (csum)
+            ExFreePool(csum);
+
+        return Status;
+    }
+
+    ExFreePool(ed);
+
+    fcb->inode_item.st_blocks += num_bytes;
+
+    if (compression == BTRFS_COMPRESSION_LZO)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+    else if (compression == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+    add_changed_extent_ref(c, address, buflen, fcb->subvol->id, fcb->inode, start_data - decoded_offset, 1,
+                           fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
     ExReleaseResourceLite(&c->changed_extents_lock);
 
     fcb->extents_changed = true;
     fcb->inode_item_changed = true;
     mark_fcb_dirty(fcb);
 
-    ExFreePool(parts);
-
     return STATUS_SUCCESS;
 }
+#endif
@@ -18,7 +18,13 @@
 #include "crc32c.h"
 #include <stdint.h>
 #include <stdbool.h>
+
+#ifdef _WIN32
 #include <sal.h>
+#else
+#define _In_
+#define _In_reads_bytes_(x)
+#endif
 
 crc_func calc_crc32c = calc_crc32c_sw;
 
@@ -69,3 +75,32 @@ uint32_t __stdcall calc_crc32c_sw(_In_ uint32_t seed, _In_reads_bytes_(msglen) u
     return rem;
 }
 #endif
+
+#if !defined(_WIN32) && defined(__x86_64__)
+#include <nmmintrin.h>
+
+// Linux builds don't use the assembly files
+__attribute__((target("sse4.2")))
+uint32_t calc_crc32c_hw(uint32_t seed, uint8_t* msg, uint32_t msglen) {
+    uint64_t rem = seed;
+
+    while (msglen >= sizeof(uint64_t)) {
+        uint64_t v;
+
+        __builtin_memcpy(&v, msg, sizeof(uint64_t));
+        rem = _mm_crc32_u64(rem, v);
+
+        msg += sizeof(uint64_t);
+        msglen -= sizeof(uint64_t);
+    }
+
+    while (msglen > 0) {
+        rem = _mm_crc32_u8((uint32_t)rem, *msg);
+
+        msg++;
+        msglen--;
+    }
+
+    return (uint32_t)rem;
+}
+#endif
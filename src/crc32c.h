@@ -6,7 +6,11 @@
 extern "C" {
 #endif
 
-#if defined(_X86_) || defined(_AMD64_) || defined(_ARM64_)
+#ifndef _WIN32
+#define __stdcall
+#endif
+
+#if defined(_X86_) || defined(_AMD64_) || defined(_ARM64_) || (!defined(_WIN32) && defined(__x86_64__))
 uint32_t __stdcall calc_crc32c_hw(uint32_t seed, uint8_t* msg, uint32_t msglen);
 #endif
 
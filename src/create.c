@@ -221,21 +221,8 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uin
             if (dc->hash == hash) {
                 if (dc->name.Length == fnus.Length && RtlCompareMemory(dc->name.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
+                        if (!NT_SUCCESS(find_root(fcb->Vcb, dc->key.obj_id, subvol, NULL)))
+                            *subvol = NULL;
 
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
@@ -268,21 +255,8 @@ NTSTATUS find_file_in_dir(PUNICODE_STRING filename, fcb* fcb, root** subvol, uin
             if (dc->hash_uc == hash) {
                 if (dc->name_uc.Length == fnus.Length && RtlCompareMemory(dc->name_uc.Buffer, fnus.Buffer, fnus.Length) == fnus.Length) {
                     if (dc->key.obj_type == TYPE_ROOT_ITEM) {
-                        LIST_ENTRY* le2;
-
-                        *subvol = NULL;
-
-                        le2 = fcb->Vcb->roots.Flink;
-                        while (le2 != &fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le2, root, list_entry);
-
-                            if (r2->id == dc->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
+                        if (!NT_SUCCESS(find_root(fcb->Vcb, dc->key.obj_id, subvol, NULL)))
+                            *subvol = NULL;
 
                         *inode = SUBVOL_ROOT_INODE;
                     } else {
@@ -4336,8 +4310,7 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
 
         if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
             ROOT_REF* rr = (ROOT_REF*)tp.item->data;
-            LIST_ENTRY* le;
-            root* r = NULL;
+            root* r;
             ULONG stringlen;
 
             if (tp.item->size < sizeof(ROOT_REF)) {
@@ -4352,19 +4325,8 @@ NTSTATUS open_fileref_by_inode(_Requires_exclusive_lock_held_(_Curr_->fcb_lock)
                 return STATUS_INTERNAL_ERROR;
             }
 
-            le = Vcb->roots.Flink;
-            while (le != &Vcb->roots) {
-                root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                if (r2->id == tp.item->key.offset) {
-                    r = r2;
-                    break;
-                }
-
-                le = le->Flink;
-            }
-
-            if (!r) {
+            Status = find_root(Vcb, tp.item->key.offset, &r, Irp);
+            if (!NT_SUCCESS(Status)) {
                 ERR("couldn't find subvol %I64x\n", tp.item->key.offset);
                 free_fcb(fcb);
                 return STATUS_INTERNAL_ERROR;
@@ -4577,17 +4539,8 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             RtlCopyMemory(&subvol_id, (uint8_t*)fn.Buffer + sizeof(uint64_t), sizeof(uint64_t));
 
             if (subvol_id == BTRFS_ROOT_FSTREE || (subvol_id >= 0x100 && subvol_id < 0x8000000000000000)) {
-                LIST_ENTRY* le = Vcb->roots.Flink;
-                while (le != &Vcb->roots) {
-                    root* r = CONTAINING_RECORD(le, root, list_entry);
-
-                    if (r->id == subvol_id) {
-                        subvol = r;
-                        break;
-                    }
-
-                    le = le->Flink;
-                }
+                if (!NT_SUCCESS(find_root(Vcb, subvol_id, &subvol, Irp)))
+                    subvol = NULL;
             }
 
             if (!subvol) {
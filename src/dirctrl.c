@@ -189,21 +189,8 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
     if (de->key.obj_type == TYPE_ROOT_ITEM) { // subvol
-        LIST_ENTRY* le;
-
-        r = NULL;
-
-        le = fcb->Vcb->roots.Flink;
-        while (le != &fcb->Vcb->roots) {
-            root* subvol = CONTAINING_RECORD(le, root, list_entry);
-
-            if (subvol->id == de->key.obj_id) {
-                r = subvol;
-                break;
-            }
-
-            le = le->Flink;
-        }
+        if (!NT_SUCCESS(find_root(fcb->Vcb, de->key.obj_id, &r, Irp)))
+            r = NULL;
 
         if (r && r->parent != fcb->subvol->id && (!de->dc || !de->dc->root_dir))
             r = NULL;
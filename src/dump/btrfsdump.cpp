@@ -0,0 +1,2506 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Tree dumper for images, replacing btrfs-dump.pl. The main thread walks the
+// internal nodes, and hands the leaves to a pool of workers which read,
+// verify and format them; the output is written in tree order regardless of
+// which worker finishes first, so dumps of two images can be diffed.
+
+#include "../btrfs.h"
+#include "../crc32c.h"
+#include "../zstd/lib/common/xxhash.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+// sys/stat.h defines these as macros
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+extern "C" {
+void calc_sha256(uint8_t* hash, const void* input, size_t len);
+void blake2b(void* out, size_t outlen, const void* in, size_t inlen);
+}
+
+#define TREE_LOG_ID 0xfffffffffffffffa
+
+#define TYPE_VERITY_DESC_ITEM   0x24
+#define TYPE_VERITY_MERKLE_ITEM 0x25
+#define TYPE_LOG_INDEX          0x48
+#define TYPE_EXTENT_OWNER_REF   0xAC
+#define TYPE_QGROUP_STATUS      0xF0
+#define TYPE_QGROUP_INFO        0xF2
+#define TYPE_QGROUP_LIMIT       0xF4
+#define TYPE_QGROUP_RELATION    0xF6
+
+static runtime_error errno_error(const char* func, const string& path) {
+    return runtime_error(string(func) + " failed on " + path + ": " + strerror(errno));
+}
+
+static void get_raid0_offset(uint64_t off, uint64_t stripe_length, uint16_t num_stripes, uint64_t* stripeoff, uint16_t* stripe) {
+    uint64_t initoff, startoff;
+
+    startoff = off % (num_stripes * stripe_length);
+    initoff = (off / (num_stripes * stripe_length)) * stripe_length;
+
+    *stripe = (uint16_t)(startoff / stripe_length);
+    *stripeoff = initoff + startoff - (*stripe * stripe_length);
+}
+
+static bool operator<(const KEY& a, const KEY& b) {
+    if (a.obj_id != b.obj_id)
+        return a.obj_id < b.obj_id;
+
+    if (a.obj_type != b.obj_type)
+        return a.obj_type < b.obj_type;
+
+    return a.offset < b.offset;
+}
+
+// output
+
+class item_out {
+public:
+    virtual ~item_out() = default;
+    virtual void type(const char* name) = 0;
+    virtual void num(const char* name, uint64_t v) = 0;
+    virtual void dec(const char* name, uint64_t v) = 0;
+    virtual void oct(const char* name, uint64_t v) = 0;
+    virtual void str(const char* name, string_view v) = 0;
+    virtual void hex(const char* name, string_view v) = 0; // already formatted
+    virtual void key(const char* name, const KEY& k) = 0;
+    virtual void begin_obj(const char* name, const char* kind) = 0;
+    virtual void end_obj() = 0;
+    virtual void begin_list(const char* name) = 0;
+    virtual void end_list() = 0;
+
+    void uuid(const char* name, const BTRFS_UUID& u);
+    void time(const char* name, const BTRFS_TIME& t);
+
+    string s;
+};
+
+void item_out::uuid(const char* name, const BTRFS_UUID& u) {
+    char buf[33];
+
+    for (unsigned int i = 0; i < 16; i++) {
+        sprintf(buf + (i * 2), "%02x", u.uuid[15 - i]);
+    }
+
+    hex(name, buf);
+}
+
+void item_out::time(const char* name, const BTRFS_TIME& t) {
+    struct tm tm;
+    time_t secs = (time_t)t.seconds;
+    char buf[40];
+
+    gmtime_r(&secs, &tm);
+
+    snprintf(buf, sizeof(buf), "%04u-%02u-%02uT%02u:%02u:%02u", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    hex(name, buf);
+}
+
+// Same layout as btrfs-dump.pl: space-separated name=value pairs, with
+// numbers in hex.
+class text_out : public item_out {
+public:
+    void type(const char* name) override {
+        s += name;
+    }
+
+    void num(const char* name, uint64_t v) override {
+        char buf[20];
+
+        sprintf(buf, "%llx", (unsigned long long)v);
+        field(name, buf);
+    }
+
+    void dec(const char* name, uint64_t v) override {
+        field(name, to_string(v));
+    }
+
+    void oct(const char* name, uint64_t v) override {
+        char buf[24];
+
+        sprintf(buf, "%llo", (unsigned long long)v);
+        field(name, buf);
+    }
+
+    void str(const char* name, string_view v) override {
+        field(name, v);
+    }
+
+    void hex(const char* name, string_view v) override {
+        field(name, v);
+    }
+
+    void key(const char* name, const KEY& k) override {
+        char buf[60];
+
+        sprintf(buf, "%llx,%x,%llx", (unsigned long long)k.obj_id, k.obj_type, (unsigned long long)k.offset);
+        field(name, buf);
+    }
+
+    // Named objects without a kind are bracketed, as in "data=(...)".
+    void begin_obj(const char* name, const char* kind) override {
+        if (kind) {
+            s += ' ';
+            s += kind;
+        } else if (name) {
+            s += ' ';
+            s += name;
+            s += "=(";
+        }
+
+        brackets.push_back(!kind && name);
+    }
+
+    void end_obj() override {
+        if (brackets.back())
+            s += ')';
+
+        brackets.pop_back();
+    }
+
+    void begin_list(const char*) override {
+    }
+
+    void end_list() override {
+    }
+
+private:
+    void field(const char* name, string_view v) {
+        if (s.empty() || s.back() != '(')
+            s += ' ';
+
+        if (name) {
+            s += name;
+            s += '=';
+        }
+
+        s += v;
+    }
+
+    vector<bool> brackets;
+};
+
+// One JSON object per line. Unsigned 64-bit numbers are written as they
+// are, so beware of parsers which use doubles.
+class json_out : public item_out {
+public:
+    void type(const char* name) override {
+        hex("kind", name);
+    }
+
+    void num(const char* name, uint64_t v) override {
+        prefix(name);
+        s += to_string(v);
+    }
+
+    void dec(const char* name, uint64_t v) override {
+        num(name, v);
+    }
+
+    void oct(const char* name, uint64_t v) override {
+        num(name, v);
+    }
+
+    void str(const char* name, string_view v) override {
+        prefix(name);
+        quote(v);
+    }
+
+    void hex(const char* name, string_view v) override {
+        prefix(name);
+        s += '"';
+        s += v;
+        s += '"';
+    }
+
+    void key(const char* name, const KEY& k) override {
+        prefix(name);
+        s += '[' + to_string(k.obj_id) + ',' + to_string(k.obj_type) + ',' + to_string(k.offset) + ']';
+    }
+
+    void begin_obj(const char* name, const char* kind) override {
+        prefix(name);
+        s += '{';
+        first.push_back(true);
+
+        if (kind)
+            hex("kind", kind);
+    }
+
+    void end_obj() override {
+        s += '}';
+        first.pop_back();
+    }
+
+    void begin_list(const char* name) override {
+        prefix(name);
+        s += '[';
+        first.push_back(true);
+        in_list.push_back(first.size());
+    }
+
+    void end_list() override {
+        s += ']';
+        first.pop_back();
+        in_list.pop_back();
+    }
+
+    void quote(string_view v) {
+        s += '"';
+
+        for (auto c : v) {
+            if (c == '"' || c == '\\') {
+                s += '\\';
+                s += c;
+            } else if ((uint8_t)c < 0x20) {
+                char buf[8];
+
+                sprintf(buf, "\\u%04x", (uint8_t)c);
+                s += buf;
+            } else
+                s += c;
+        }
+
+        s += '"';
+    }
+
+    vector<bool> first{true};
+    vector<size_t> in_list;
+
+private:
+    void prefix(const char* name) {
+        if (!first.back())
+            s += ',';
+
+        first.back() = false;
+
+        if (name && (in_list.empty() || in_list.back() != first.size())) {
+            s += '"';
+            s += name;
+            s += "\":";
+        }
+    }
+};
+
+// item formatting
+
+static string flags_string(uint64_t f, const pair<uint64_t, const char*>* names, bool zero_if_none) {
+    string s;
+
+    for (auto n = names; n->second; n++) {
+        if (f & n->first) {
+            if (!s.empty())
+                s += ',';
+
+            s += n->second;
+            f &= ~n->first;
+        }
+    }
+
+    if (f != 0 || (s.empty() && !zero_if_none)) {
+        char buf[20];
+
+        if (!s.empty())
+            s += ',';
+
+        sprintf(buf, "%llx", (unsigned long long)f);
+        s += buf;
+    }
+
+    if (s.empty())
+        s = "0";
+
+    return s;
+}
+
+static const pair<uint64_t, const char*> incompat_flag_names[] = {
+    { BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF, "mixed_backref" },
+    { BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL, "default_subvol" },
+    { BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS, "mixed_groups" },
+    { BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO, "compress_lzo" },
+    { BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD, "compress_zstd" },
+    { BTRFS_INCOMPAT_FLAGS_BIG_METADATA, "big_metadata" },
+    { BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF, "extended_iref" },
+    { BTRFS_INCOMPAT_FLAGS_RAID56, "raid56" },
+    { BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA, "skinny_metadata" },
+    { BTRFS_INCOMPAT_FLAGS_NO_HOLES, "no_holes" },
+    { BTRFS_INCOMPAT_FLAGS_METADATA_UUID, "metadata_uuid" },
+    { BTRFS_INCOMPAT_FLAGS_RAID1C34, "raid1c34" },
+    { BTRFS_INCOMPAT_FLAGS_ZONED, "zoned" },
+    { BTRFS_INCOMPAT_FLAGS_EXTENT_TREE_V2, "extent_tree_v2" },
+    { BTRFS_INCOMPAT_FLAGS_RAID_STRIPE_TREE, "raid_stripe_tree" },
+    { BTRFS_INCOMPAT_FLAGS_SIMPLE_QUOTA, "squota" },
+    { 0, nullptr }
+};
+
+static const pair<uint64_t, const char*> compat_ro_flag_names[] = {
+    { BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE, "space_tree" },
+    { BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE_VALID, "space_tree_valid" },
+    { BTRFS_COMPAT_RO_FLAGS_VERITY, "verity" },
+    { BTRFS_COMPAT_RO_FLAGS_BLOCK_GROUP_TREE, "block_group_tree" },
+    { 0, nullptr }
+};
+
+static const pair<uint64_t, const char*> inode_flag_names[] = {
+    { BTRFS_INODE_NODATASUM, "nodatasum" },
+    { BTRFS_INODE_NODATACOW, "nodatacow" },
+    { BTRFS_INODE_READONLY, "readonly" },
+    { BTRFS_INODE_NOCOMPRESS, "nocompress" },
+    { BTRFS_INODE_PREALLOC, "prealloc" },
+    { BTRFS_INODE_SYNC, "sync" },
+    { BTRFS_INODE_IMMUTABLE, "immutable" },
+    { BTRFS_INODE_APPEND, "append" },
+    { BTRFS_INODE_NODUMP, "nodump" },
+    { BTRFS_INODE_NOATIME, "noatime" },
+    { BTRFS_INODE_DIRSYNC, "dirsync" },
+    { BTRFS_INODE_COMPRESS, "compress" },
+    { (uint64_t)BTRFS_INODE_RO_VERITY << 32, "ro_verity" },
+    { 0, nullptr }
+};
+
+static const pair<uint64_t, const char*> balance_arg_flag_names[] = {
+    { 1 << 0, "profiles" },
+    { 1 << 1, "usage" },
+    { 1 << 2, "devid" },
+    { 1 << 3, "drange" },
+    { 1 << 4, "vrange" },
+    { 1 << 5, "limit" },
+    { 1 << 6, "limitrange" },
+    { 1 << 7, "stripesrange" },
+    { 1 << 8, "convert" },
+    { 1 << 9, "soft" },
+    { 1 << 10, "usagerange" },
+    { 0, nullptr }
+};
+
+static const pair<uint64_t, const char*> balance_flag_names[] = {
+    { 1 << 0, "data" },
+    { 1 << 1, "system" },
+    { 1 << 2, "metadata" },
+    { 0, nullptr }
+};
+
+static const pair<uint64_t, const char*> qgroup_status_flag_names[] = {
+    { 1 << 0, "on" },
+    { 1 << 1, "rescan" },
+    { 1 << 2, "inconsistent" },
+    { 1 << 3, "simple" },
+    { 0, nullptr }
+};
+
+static unsigned int csum_size(uint16_t csum_type) {
+    switch (csum_type) {
+        case CSUM_TYPE_XXHASH:
+            return sizeof(uint64_t);
+
+        case CSUM_TYPE_SHA256:
+        case CSUM_TYPE_BLAKE2:
+            return 32;
+
+        default:
+            return sizeof(uint32_t);
+    }
+}
+
+static string format_csum(const uint8_t* csum, uint16_t csum_type) {
+    string s;
+    char buf[20];
+
+    // printed as btrfs-dump.pl does, as little-endian words
+    if (csum_type == CSUM_TYPE_CRC32C) {
+        sprintf(buf, "%08x", *(uint32_t*)csum);
+        return buf;
+    }
+
+    for (unsigned int i = 0; i < csum_size(csum_type); i += sizeof(uint64_t)) {
+        sprintf(buf, "%016llx", (unsigned long long)*(uint64_t*)(csum + i));
+        s += buf;
+    }
+
+    return s;
+}
+
+class item_data {
+public:
+    item_data(const uint8_t* data, size_t len) : p(data), len(len) {
+    }
+
+    template<typename T>
+    const T* get() {
+        if (len < sizeof(T))
+            return nullptr;
+
+        auto t = (const T*)p;
+
+        p += sizeof(T);
+        len -= sizeof(T);
+
+        return t;
+    }
+
+    bool get_str(size_t n, string_view& sv) {
+        if (len < n)
+            return false;
+
+        sv = string_view((const char*)p, n);
+        p += n;
+        len -= n;
+
+        return true;
+    }
+
+    const uint8_t* p;
+    size_t len;
+};
+
+static void dump_inode(item_out& o, const INODE_ITEM& ii) {
+    o.num("gen", ii.generation);
+    o.num("transid", ii.transid);
+    o.num("size", ii.st_size);
+    o.num("blocks", ii.st_blocks);
+    o.num("blockgroup", ii.block_group);
+    o.num("nlink", ii.st_nlink);
+    o.num("uid", ii.st_uid);
+    o.num("gid", ii.st_gid);
+    o.oct("mode", ii.st_mode);
+    o.num("rdev", ii.st_rdev);
+    o.hex("flags", flags_string(ii.flags | ((uint64_t)ii.flags_ro << 32), inode_flag_names, true));
+    o.num("seq", ii.sequence);
+    o.time("atime", ii.st_atime);
+    o.time("ctime", ii.st_ctime);
+    o.time("mtime", ii.st_mtime);
+    o.time("otime", ii.otime);
+}
+
+static void dump_root_item(item_out& o, item_data& d) {
+    ROOT_ITEM ri;
+    size_t len = min(d.len, sizeof(ROOT_ITEM));
+
+    // older root items are shorter, so treat anything missing as zero
+    memset(&ri, 0, sizeof(ri));
+    memcpy(&ri, d.p, len);
+    d.p += len;
+    d.len -= len;
+
+    o.type("root_item");
+    dump_inode(o, ri.inode);
+
+    if (len <= sizeof(INODE_ITEM))
+        return;
+
+    o.num("expgen", ri.generation);
+    o.num("objid", ri.objid);
+    o.num("blocknum", ri.block_number);
+    o.num("bytelimit", ri.byte_limit);
+    o.num("bytesused", ri.bytes_used);
+    o.num("snapshotgen", ri.last_snapshot_generation);
+    o.num("flags", ri.flags);
+    o.num("numrefs", ri.num_references);
+    o.key("dropprogress", ri.drop_progress);
+    o.num("droplevel", ri.drop_level);
+    o.num("rootlevel", ri.root_level);
+
+    if (len <= offsetof(ROOT_ITEM, generation2))
+        return;
+
+    o.num("gen2", ri.generation2);
+    o.uuid("uuid", ri.uuid);
+    o.uuid("par_uuid", ri.parent_uuid);
+    o.uuid("rec_uuid", ri.received_uuid);
+    o.num("ctransid", ri.ctransid);
+    o.num("otransid", ri.otransid);
+    o.num("stransid", ri.stransid);
+    o.num("rtransid", ri.rtransid);
+    o.time("ctime", ri.ctime);
+    o.time("otime", ri.otime);
+    o.time("stime", ri.stime);
+    o.time("rtime", ri.rtime);
+}
+
+static void dump_balance_args(item_out& o, const char* name, const BALANCE_ARGS& ba) {
+    o.begin_obj(name, nullptr);
+    o.num("profiles", ba.profiles);
+
+    if (ba.flags & (1 << 10)) {
+        o.num("usage_start", ba.usage_start);
+        o.num("usage_end", ba.usage_end);
+    } else if (ba.flags & (1 << 1))
+        o.num("usage", ba.usage);
+
+    o.num("devid", ba.devid);
+    o.num("pstart", ba.drange_start);
+    o.num("pend", ba.drange_end);
+    o.num("vstart", ba.vrange_start);
+    o.num("vend", ba.vrange_end);
+    o.num("target", ba.convert);
+    o.hex("flags", flags_string(ba.flags, balance_arg_flag_names, false));
+
+    if (ba.flags & (1 << 5))
+        o.num("limit", ba.limit);
+    else if (ba.flags & (1 << 6)) {
+        o.num("limit_start", ba.limit_start);
+        o.num("limit_end", ba.limit_end);
+    }
+
+    if (ba.flags & (1 << 7)) {
+        o.num("stripes_start", ba.stripes_start);
+        o.num("stripes_end", ba.stripes_end);
+    }
+
+    o.end_obj();
+}
+
+static void dump_dir_items(item_out& o, item_data& d) {
+    o.begin_list("entries");
+
+    while (d.len > 0) {
+        auto di = d.get<DIR_ITEM>();
+        string_view name, name2;
+
+        // DIR_ITEM includes the first character of the name
+        if (!di) {
+            break;
+        }
+
+        d.p--;
+        d.len++;
+
+        if (!d.get_str(di->n, name) || !d.get_str(di->m, name2)) {
+            d.p -= offsetof(DIR_ITEM, name[0]);
+            d.len += offsetof(DIR_ITEM, name[0]);
+            break;
+        }
+
+        o.begin_obj(nullptr, nullptr);
+        o.key("key", di->key);
+        o.num("transid", di->transid);
+        o.num("m", di->m);
+        o.num("n", di->n);
+        o.num("type", di->type);
+        o.str("name", name);
+
+        if (!name2.empty())
+            o.str("name2", name2);
+
+        o.end_obj();
+    }
+
+    o.end_list();
+}
+
+static void dump_chunk_item(item_out& o, item_data& d) {
+    auto ci = d.get<CHUNK_ITEM>();
+
+    o.type("chunk_item");
+
+    if (!ci)
+        return;
+
+    o.num("size", ci->size);
+    o.num("root", ci->root_id);
+    o.num("stripelength", ci->stripe_length);
+    o.num("type", ci->type);
+    o.num("ioalign", ci->opt_io_alignment);
+    o.num("iowidth", ci->opt_io_width);
+    o.num("sectorsize", ci->sector_size);
+    o.num("numstripes", ci->num_stripes);
+    o.num("substripes", ci->sub_stripes);
+
+    o.begin_list("stripes");
+
+    for (unsigned int i = 0; i < ci->num_stripes; i++) {
+        auto cis = d.get<CHUNK_ITEM_STRIPE>();
+        char buf[20];
+
+        if (!cis)
+            break;
+
+        sprintf(buf, "stripe(%u)", i);
+
+        o.begin_obj(nullptr, buf);
+        o.num("devid", cis->dev_id);
+        o.num("offset", cis->offset);
+        o.uuid("devuuid", cis->dev_uuid);
+        o.end_obj();
+    }
+
+    o.end_list();
+}
+
+static void dump_dev_item(item_out& o, const DEV_ITEM& di) {
+    o.num("id", di.dev_id);
+    o.num("numbytes", di.num_bytes);
+    o.num("bytesused", di.bytes_used);
+    o.num("ioalign", di.optimal_io_align);
+    o.num("iowidth", di.optimal_io_width);
+    o.num("sectorsize", di.minimal_io_size);
+    o.num("type", di.type);
+    o.num("gen", di.generation);
+    o.num("startoff", di.start_offset);
+    o.num("devgroup", di.dev_group);
+    o.num("seekspeed", di.seek_speed);
+    o.num("bandwidth", di.bandwidth);
+    o.uuid("devid", di.device_uuid);
+    o.uuid("fsid", di.fs_uuid);
+}
+
+static void dump_extent_item(item_out& o, item_data& d, uint8_t type) {
+    if (d.len == sizeof(EXTENT_ITEM_V0)) {
+        auto eiv0 = d.get<EXTENT_ITEM_V0>();
+
+        o.type("extent_item_v0");
+        o.num("refcount", eiv0->refcount);
+        return;
+    }
+
+    auto ei = d.get<EXTENT_ITEM>();
+
+    o.type(type == TYPE_METADATA_ITEM ? "metadata_item_key" : "extent_item_key");
+
+    if (!ei)
+        return;
+
+    o.num("refcount", ei->refcount);
+    o.num("gen", ei->generation);
+    o.num("flags", ei->flags);
+
+    if (ei->flags & EXTENT_ITEM_TREE_BLOCK && type != TYPE_METADATA_ITEM) {
+        auto eit = d.get<EXTENT_ITEM2>();
+
+        if (!eit)
+            return;
+
+        o.key("key", eit->firstitem);
+        o.dec("level", eit->level);
+    }
+
+    o.begin_list("refs");
+
+    while (d.len > 0) {
+        uint8_t irt = *d.p;
+        bool ok = true;
+
+        d.p++;
+        d.len--;
+
+        switch (irt) {
+            case TYPE_EXTENT_OWNER_REF:
+            case TYPE_TREE_BLOCK_REF: {
+                auto tbr = d.get<TREE_BLOCK_REF>();
+
+                if (!tbr) {
+                    ok = false;
+                    break;
+                }
+
+                o.begin_obj(nullptr, irt == TYPE_TREE_BLOCK_REF ? "tree_block_ref" : "extent_owner_ref");
+                o.num("root", tbr->offset);
+                o.end_obj();
+                break;
+            }
+
+            case TYPE_EXTENT_DATA_REF: {
+                auto edr = d.get<EXTENT_DATA_REF>();
+
+                if (!edr) {
+                    ok = false;
+                    break;
+                }
+
+                o.begin_obj(nullptr, "extent_data_ref");
+                o.num("root", edr->root);
+                o.num("objid", edr->objid);
+                o.num("offset", edr->offset);
+                o.num("count", edr->count);
+                o.end_obj();
+                break;
+            }
+
+            case TYPE_SHARED_BLOCK_REF: {
+                auto sbr = d.get<SHARED_BLOCK_REF>();
+
+                if (!sbr) {
+                    ok = false;
+                    break;
+                }
+
+                o.begin_obj(nullptr, "shared_block_ref");
+                o.num("offset", sbr->offset);
+                o.end_obj();
+                break;
+            }
+
+            case TYPE_SHARED_DATA_REF: {
+                auto sdr = d.get<SHARED_DATA_REF>();
+
+                if (!sdr) {
+                    ok = false;
+                    break;
+                }
+
+                o.begin_obj(nullptr, "shared_data_ref");
+                o.num("offset", sdr->offset);
+                o.num("count", sdr->count);
+                o.end_obj();
+                break;
+            }
+
+            default:
+                o.begin_obj(nullptr, "unknown");
+                o.num("type", irt);
+                o.end_obj();
+                ok = false;
+        }
+
+        if (!ok) {
+            d.p--;
+            d.len++;
+            break;
+        }
+    }
+
+    o.end_list();
+}
+
+static void dump_u64_list(item_out& o, item_data& d, const char* type) {
+    o.type(type);
+    o.begin_list("values");
+
+    while (auto v = d.get<uint64_t>()) {
+        o.num(nullptr, *v);
+    }
+
+    o.end_list();
+}
+
+// Formats an item's contents. Returns false if we don't know the type.
+static bool dump_item(item_out& o, const KEY& key, const uint8_t* data, size_t len, uint16_t csum_type) {
+    item_data d(data, len);
+
+    switch (key.obj_type) {
+        case TYPE_INODE_ITEM: {
+            INODE_ITEM ii;
+            size_t l = min(len, sizeof(INODE_ITEM));
+
+            memset(&ii, 0, sizeof(ii));
+            memcpy(&ii, data, l);
+            d.p += l;
+            d.len -= l;
+
+            o.type("inode_item");
+            dump_inode(o, ii);
+            break;
+        }
+
+        case TYPE_ROOT_ITEM:
+            dump_root_item(o, d);
+            break;
+
+        case TYPE_INODE_REF:
+            o.type("inode_ref");
+            o.begin_list("refs");
+
+            while (d.len > 0) {
+                auto ir = d.get<INODE_REF>();
+                string_view name;
+
+                if (!ir)
+                    break;
+
+                d.p--; // INODE_REF includes the first character of the name
+                d.len++;
+
+                if (!d.get_str(ir->n, name)) {
+                    d.p -= offsetof(INODE_REF, name[0]);
+                    d.len += offsetof(INODE_REF, name[0]);
+                    break;
+                }
+
+                o.begin_obj(nullptr, nullptr);
+                o.num("index", ir->index);
+                o.num("n", ir->n);
+                o.str("name", name);
+                o.end_obj();
+            }
+
+            o.end_list();
+            break;
+
+        case TYPE_INODE_EXTREF:
+            o.type("inode_extref");
+            o.begin_list("refs");
+
+            while (d.len > 0) {
+                auto ier = d.get<INODE_EXTREF>();
+                string_view name;
+
+                if (!ier)
+                    break;
+
+                d.p--;
+                d.len++;
+
+                if (!d.get_str(ier->n, name)) {
+                    d.p -= offsetof(INODE_EXTREF, name[0]);
+                    d.len += offsetof(INODE_EXTREF, name[0]);
+                    break;
+                }
+
+                o.begin_obj(nullptr, nullptr);
+                o.num("dir", ier->dir);
+                o.num("index", ier->index);
+                o.num("n", ier->n);
+                o.str("name", name);
+                o.end_obj();
+            }
+
+            o.end_list();
+            break;
+
+        case TYPE_XATTR_ITEM:
+        case TYPE_DIR_ITEM:
+        case TYPE_DIR_INDEX:
+            o.type(key.obj_type == TYPE_DIR_ITEM ? "dir_item" : (key.obj_type == TYPE_XATTR_ITEM ? "xattr_item" : "dir_index"));
+            dump_dir_items(o, d);
+            break;
+
+        case TYPE_VERITY_DESC_ITEM:
+            o.type("verity_desc_item");
+
+            if (key.offset == 0) {
+                auto size = d.get<uint64_t>();
+
+                if (!size || d.len < 17)
+                    break;
+
+                d.p += 16;
+                d.len -= 16;
+
+                o.num("size", *size);
+                o.num("enc", *d.get<uint8_t>());
+            } else {
+                o.begin_list("data");
+
+                while (auto c = d.get<uint8_t>()) {
+                    char buf[4];
+
+                    sprintf(buf, "%02x", *c);
+                    o.hex(nullptr, buf);
+                }
+
+                o.end_list();
+            }
+            break;
+
+        case TYPE_VERITY_MERKLE_ITEM:
+            o.type("verity_merkle_item");
+            o.begin_list("hashes");
+
+            while (d.len >= 32) {
+                string s;
+
+                for (unsigned int i = 0; i < 32; i++) {
+                    char buf[4];
+
+                    sprintf(buf, "%02x", d.p[i]);
+                    s += buf;
+                }
+
+                o.hex(nullptr, s);
+
+                d.p += 32;
+                d.len -= 32;
+            }
+
+            o.end_list();
+            break;
+
+        case TYPE_ORPHAN_INODE:
+            o.type("orphan_item");
+            break;
+
+        case TYPE_LOG_INDEX: {
+            auto end = d.get<uint64_t>();
+
+            o.type("log_index");
+
+            if (end)
+                o.num("end", *end);
+
+            break;
+        }
+
+        case TYPE_EXTENT_DATA: {
+            auto ed = d.get<EXTENT_DATA>();
+
+            o.type("extent_data");
+
+            if (!ed)
+                break;
+
+            // EXTENT_DATA includes the first byte of the data
+            d.p--;
+            d.len++;
+
+            o.num("gen", ed->generation);
+            o.num("size", ed->decoded_size);
+            o.dec("comp", ed->compression);
+            o.dec("enc", ed->encryption);
+            o.dec("otherenc", ed->encoding);
+            o.dec("type", ed->type);
+
+            if (ed->type != EXTENT_TYPE_INLINE) {
+                auto ed2 = d.get<EXTENT_DATA2>();
+
+                if (!ed2)
+                    break;
+
+                o.num("ea", ed2->address);
+                o.num("es", ed2->size);
+                o.num("o", ed2->offset);
+                o.num("s", ed2->num_bytes);
+            } else {
+                auto l = min((uint64_t)d.len, ed->decoded_size);
+
+                d.p += l;
+                d.len -= l;
+            }
+
+            break;
+        }
+
+        case TYPE_EXTENT_CSUM: {
+            auto cs = csum_size(csum_type);
+
+            o.type("extent_csum");
+            o.begin_list("csums");
+
+            while (d.len >= cs) {
+                o.hex(nullptr, format_csum(d.p, csum_type));
+                d.p += cs;
+                d.len -= cs;
+            }
+
+            o.end_list();
+            break;
+        }
+
+        case TYPE_ROOT_BACKREF:
+        case TYPE_ROOT_REF: {
+            auto rr = d.get<ROOT_REF>();
+            string_view name;
+
+            o.type(key.obj_type == TYPE_ROOT_BACKREF ? "root_backref" : "root_ref");
+
+            if (!rr)
+                break;
+
+            d.p--;
+            d.len++;
+
+            o.num("id", rr->dir);
+            o.num("seq", rr->index);
+            o.num("n", rr->n);
+
+            if (d.get_str(rr->n, name))
+                o.str("name", name);
+
+            break;
+        }
+
+        case TYPE_EXTENT_ITEM:
+        case TYPE_METADATA_ITEM:
+            dump_extent_item(o, d, key.obj_type);
+            break;
+
+        case TYPE_TREE_BLOCK_REF:
+            o.type("tree_block_ref");
+            break;
+
+        case TYPE_EXTENT_DATA_REF: {
+            auto edr = d.get<EXTENT_DATA_REF>();
+
+            o.type("extent_data_ref");
+
+            if (edr) {
+                o.num("root", edr->root);
+                o.num("objid", edr->objid);
+                o.num("offset", edr->offset);
+                o.num("count", edr->count);
+            }
+
+            break;
+        }
+
+        case TYPE_EXTENT_REF_V0: {
+            auto erv0 = d.get<EXTENT_REF_V0>();
+
+            o.type("extent_ref_v0");
+
+            if (erv0) {
+                o.num("root", erv0->root);
+                o.num("gen", erv0->gen);
+                o.num("objid", erv0->objid);
+                o.num("count", erv0->count);
+            }
+
+            break;
+        }
+
+        case TYPE_SHARED_BLOCK_REF:
+            o.type("shared_block_ref");
+            break;
+
+        case TYPE_SHARED_DATA_REF: {
+            auto count = d.get<uint32_t>();
+
+            o.type("shared_data_ref");
+
+            if (count)
+                o.num("count", *count);
+
+            break;
+        }
+
+        case TYPE_BLOCK_GROUP_ITEM: {
+            auto bgi = d.get<BLOCK_GROUP_ITEM>();
+
+            o.type("block_group_item");
+
+            if (bgi) {
+                o.num("size", bgi->used);
+                o.num("chunktreeid", bgi->chunk_tree);
+                o.num("flags", bgi->flags);
+            }
+
+            break;
+        }
+
+        case TYPE_FREE_SPACE_INFO: {
+            auto fsi = d.get<FREE_SPACE_INFO>();
+
+            o.type("free_space_info");
+
+            if (fsi) {
+                o.num("count", fsi->count);
+                o.num("flags", fsi->flags);
+            }
+
+            break;
+        }
+
+        case TYPE_FREE_SPACE_EXTENT:
+            o.type("free_space_extent");
+            break;
+
+        case TYPE_FREE_SPACE_BITMAP:
+            o.type("free_space_bitmap");
+            break;
+
+        case TYPE_DEV_EXTENT: {
+            auto de = d.get<DEV_EXTENT>();
+
+            o.type("dev_extent");
+
+            if (de) {
+                o.num("chunktree", de->chunktree);
+                o.num("chunkobjid", de->objid);
+                o.num("logaddr", de->address);
+                o.num("size", de->length);
+                o.uuid("chunktreeuuid", de->chunktree_uuid);
+            }
+
+            break;
+        }
+
+        case TYPE_DEV_ITEM: {
+            auto di = d.get<DEV_ITEM>();
+
+            o.type("dev_item");
+
+            if (di)
+                dump_dev_item(o, *di);
+
+            break;
+        }
+
+        case TYPE_CHUNK_ITEM:
+            dump_chunk_item(o, d);
+            break;
+
+        case TYPE_QGROUP_STATUS:
+        case TYPE_QGROUP_INFO:
+        case TYPE_QGROUP_LIMIT: {
+            static const char* names[3][5] = {
+                { "version", "generation", "flags", "rescan", "enable_gen" },
+                { "generation", "rfer", "rfer_cmpr", "excl", "excl_cmpr" },
+                { "flags", "max_rfer", "max_excl", "rsv_rfer", "rsv_excl" }
+            };
+            unsigned int n = (key.obj_type - TYPE_QGROUP_STATUS) / 2;
+
+            o.type(n == 0 ? "qgroup_status" : (n == 1 ? "qgroup_info" : "qgroup_limit"));
+
+            if (d.len < 5 * sizeof(uint64_t))
+                break;
+
+            for (unsigned int i = 0; i < 5; i++) {
+                auto v = d.get<uint64_t>();
+
+                if (n == 0 && i == 2)
+                    o.hex(names[n][i], flags_string(*v, qgroup_status_flag_names, true));
+                else
+                    o.num(names[n][i], *v);
+            }
+
+            break;
+        }
+
+        case TYPE_QGROUP_RELATION:
+            o.type("qgroup_relation");
+            break;
+
+        case TYPE_TEMP_ITEM: {
+            if (key.obj_id != BALANCE_ITEM_ID)
+                return false;
+
+            auto bi = d.get<BALANCE_ITEM>();
+
+            o.type("balance");
+
+            if (!bi)
+                break;
+
+            o.hex("flags", flags_string(bi->flags, balance_flag_names, false));
+            dump_balance_args(o, "data", bi->data);
+            dump_balance_args(o, "metadata", bi->metadata);
+            dump_balance_args(o, "sys", bi->system);
+            break;
+        }
+
+        case TYPE_DEV_STATS:
+            dump_u64_list(o, d, "dev_stats");
+            break;
+
+        case TYPE_SUBVOL_UUID:
+            dump_u64_list(o, d, "uuid_subvol");
+            break;
+
+        case TYPE_SUBVOL_REC_UUID:
+            dump_u64_list(o, d, "uuid_rec_subvol");
+            break;
+
+        case 0: {
+            if (key.obj_id != FREE_SPACE_CACHE_ID)
+                return false;
+
+            auto fsi = d.get<FREE_SPACE_ITEM>();
+
+            o.type("free_space");
+
+            if (fsi) {
+                o.key("key", fsi->key);
+                o.num("gen", fsi->generation);
+                o.num("num_entries", fsi->num_entries);
+                o.num("num_bitmaps", fsi->num_bitmaps);
+            }
+
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    if (d.len > 0)
+        o.num("left", d.len);
+
+    return true;
+}
+
+static void dump_unknown(item_out& o, size_t len) {
+    o.type("unknown");
+    o.num("size", len);
+}
+
+// image access
+
+struct device {
+    int fd = -1;
+    string fn;
+};
+
+struct chunk {
+    uint64_t offset;
+    CHUNK_ITEM ci;
+    vector<CHUNK_ITEM_STRIPE> stripes;
+};
+
+class btrfs_image {
+public:
+    btrfs_image(const vector<string>& files);
+    ~btrfs_image();
+    void add_chunk(uint64_t offset, const CHUNK_ITEM* ci, size_t len);
+    bool read_tree(uint64_t addr, uint64_t gen, uint8_t* buf, string& err);
+    void prefetch(uint64_t addr);
+
+    superblock sb;
+    bool sb_csum_ok;
+
+private:
+    const chunk* find_chunk(uint64_t addr);
+    unsigned int num_mirrors(const chunk& c);
+    bool read_mirror(const chunk& c, uint64_t addr, uint32_t len, unsigned int mirror, uint8_t* buf);
+    bool read_phys(uint64_t dev_id, uint64_t off, uint32_t len, uint8_t* buf);
+    bool check_tree_checksum(const tree_header* th);
+
+    map<uint64_t, device> devices;
+    map<uint64_t, chunk> chunks;
+};
+
+static bool check_superblock_checksum(const superblock& sb) {
+    auto data = (const uint8_t*)&sb.uuid;
+    size_t len = sizeof(superblock) - sizeof(sb.checksum);
+
+    switch (sb.csum_type) {
+        case CSUM_TYPE_CRC32C:
+            return ~calc_crc32c(0xffffffff, (uint8_t*)data, (uint32_t)len) == *(uint32_t*)sb.checksum;
+
+        case CSUM_TYPE_XXHASH:
+            return XXH64(data, len, 0) == *(uint64_t*)sb.checksum;
+
+        case CSUM_TYPE_SHA256: {
+            uint8_t hash[32];
+
+            calc_sha256(hash, data, len);
+            return !memcmp(hash, sb.checksum, sizeof(hash));
+        }
+
+        case CSUM_TYPE_BLAKE2: {
+            uint8_t hash[32];
+
+            blake2b(hash, sizeof(hash), data, len);
+            return !memcmp(hash, sb.checksum, sizeof(hash));
+        }
+
+        default:
+            return false;
+    }
+}
+
+btrfs_image::btrfs_image(const vector<string>& files) {
+    for (size_t i = 0; i < files.size(); i++) {
+        device dev;
+        superblock sb2;
+
+        dev.fn = files[i];
+        dev.fd = open(dev.fn.c_str(), O_RDONLY | O_CLOEXEC);
+        if (dev.fd == -1)
+            throw errno_error("open", dev.fn);
+
+        auto ret = pread(dev.fd, &sb2, sizeof(sb2), superblock_addrs[0]);
+
+        if (ret < 0) {
+            close(dev.fd);
+            throw errno_error("pread", dev.fn);
+        }
+
+        if ((size_t)ret < sizeof(sb2) || sb2.magic != BTRFS_MAGIC) {
+            close(dev.fd);
+            throw runtime_error(dev.fn + " is not a btrfs device.");
+        }
+
+        if (i == 0) {
+            sb = sb2;
+            sb_csum_ok = check_superblock_checksum(sb);
+
+            if (!sb_csum_ok)
+                fprintf(stderr, "%s: superblock checksum mismatch\n", dev.fn.c_str());
+        } else if (memcmp(&sb2.uuid, &sb.uuid, sizeof(BTRFS_UUID))) {
+            close(dev.fd);
+            throw runtime_error(dev.fn + " belongs to a different filesystem.");
+        }
+
+        if (devices.count(sb2.dev_item.dev_id) != 0) {
+            close(dev.fd);
+            throw runtime_error(dev.fn + " is a duplicate of device " + to_string(sb2.dev_item.dev_id) + ".");
+        }
+
+        devices.emplace(sb2.dev_item.dev_id, dev);
+    }
+
+    if (sb.node_size < sizeof(tree_header) || sb.node_size > 0x10000)
+        throw runtime_error("Invalid node size " + to_string(sb.node_size) + ".");
+
+    // bootstrap chunks from the superblock
+
+    item_data d(sb.sys_chunk_array, min(sb.n, (uint32_t)SYS_CHUNK_ARRAY_SIZE));
+
+    while (d.len > 0) {
+        auto key = d.get<KEY>();
+        auto ci = (const CHUNK_ITEM*)d.p;
+
+        if (!key || d.len < sizeof(CHUNK_ITEM) || d.len < sizeof(CHUNK_ITEM) + (ci->num_stripes * sizeof(CHUNK_ITEM_STRIPE)))
+            break;
+
+        add_chunk(key->offset, ci, d.len);
+
+        d.p += sizeof(CHUNK_ITEM) + (ci->num_stripes * sizeof(CHUNK_ITEM_STRIPE));
+        d.len -= sizeof(CHUNK_ITEM) + (ci->num_stripes * sizeof(CHUNK_ITEM_STRIPE));
+    }
+}
+
+btrfs_image::~btrfs_image() {
+    for (const auto& d : devices) {
+        close(d.second.fd);
+    }
+}
+
+void btrfs_image::add_chunk(uint64_t offset, const CHUNK_ITEM* ci, size_t len) {
+    chunk c;
+
+    if (len < sizeof(CHUNK_ITEM) + (ci->num_stripes * sizeof(CHUNK_ITEM_STRIPE)) || ci->num_stripes == 0)
+        return;
+
+    c.offset = offset;
+    c.ci = *ci;
+
+    auto cis = (const CHUNK_ITEM_STRIPE*)&ci[1];
+
+    c.stripes.assign(cis, cis + ci->num_stripes);
+
+    if (c.ci.stripe_length == 0)
+        c.ci.stripe_length = 0x10000;
+
+    if ((c.ci.type & BLOCK_FLAG_RAID10 && (c.ci.sub_stripes == 0 || c.ci.num_stripes < c.ci.sub_stripes)) ||
+        (c.ci.type & BLOCK_FLAG_RAID5 && c.ci.num_stripes < 2) || (c.ci.type & BLOCK_FLAG_RAID6 && c.ci.num_stripes < 3))
+        return;
+
+    chunks[offset] = c;
+}
+
+const chunk* btrfs_image::find_chunk(uint64_t addr) {
+    auto it = chunks.upper_bound(addr);
+
+    if (it == chunks.begin())
+        return nullptr;
+
+    it--;
+
+    if (addr >= it->second.offset + it->second.ci.size)
+        return nullptr;
+
+    return &it->second;
+}
+
+unsigned int btrfs_image::num_mirrors(const chunk& c) {
+    if (c.ci.type & (BLOCK_FLAG_DUPLICATE | BLOCK_FLAG_RAID1 | BLOCK_FLAG_RAID1C3 | BLOCK_FLAG_RAID1C4))
+        return c.ci.num_stripes;
+    else if (c.ci.type & BLOCK_FLAG_RAID10)
+        return c.ci.sub_stripes;
+    else if (c.ci.type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        return 2; // the data stripe, then a reconstruction from the P stripe
+    else
+        return 1;
+}
+
+bool btrfs_image::read_phys(uint64_t dev_id, uint64_t off, uint32_t len, uint8_t* buf) {
+    auto it = devices.find(dev_id);
+
+    if (it == devices.end())
+        return false;
+
+    while (len > 0) {
+        auto ret = pread(it->second.fd, buf, len, (off_t)off);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            return false;
+
+        buf += ret;
+        off += (uint64_t)ret;
+        len -= (uint32_t)ret;
+    }
+
+    return true;
+}
+
+bool btrfs_image::read_mirror(const chunk& c, uint64_t addr, uint32_t len, unsigned int mirror, uint8_t* buf) {
+    const auto& ci = c.ci;
+    uint64_t off = addr - c.offset;
+
+    while (len > 0) {
+        uint32_t seglen = (uint32_t)min((uint64_t)len, ci.stripe_length - (off % ci.stripe_length));
+        uint64_t stripeoff;
+        uint16_t stripe;
+
+        if (ci.type & BLOCK_FLAG_RAID0) {
+            get_raid0_offset(off, ci.stripe_length, ci.num_stripes, &stripeoff, &stripe);
+
+            if (!read_phys(c.stripes[stripe].dev_id, c.stripes[stripe].offset + stripeoff, seglen, buf))
+                return false;
+        } else if (ci.type & BLOCK_FLAG_RAID10) {
+            get_raid0_offset(off, ci.stripe_length, ci.num_stripes / ci.sub_stripes, &stripeoff, &stripe);
+
+            stripe = (uint16_t)((stripe * ci.sub_stripes) + mirror);
+
+            if (!read_phys(c.stripes[stripe].dev_id, c.stripes[stripe].offset + stripeoff, seglen, buf))
+                return false;
+        } else if (ci.type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)) {
+            uint16_t num_parity = ci.type & BLOCK_FLAG_RAID6 ? 2 : 1;
+            uint16_t data_stripes = ci.num_stripes - num_parity;
+            uint16_t parity, q = 0xffff;
+
+            get_raid0_offset(off, ci.stripe_length, data_stripes, &stripeoff, &stripe);
+
+            parity = (uint16_t)(((off / (data_stripes * ci.stripe_length)) + data_stripes) % ci.num_stripes);
+
+            if (num_parity == 2) {
+                q = (parity + 1) % ci.num_stripes;
+                stripe = (q + stripe + 1) % ci.num_stripes;
+            } else
+                stripe = (parity + stripe + 1) % ci.num_stripes;
+
+            if (mirror == 0) {
+                if (!read_phys(c.stripes[stripe].dev_id, c.stripes[stripe].offset + stripeoff, seglen, buf))
+                    return false;
+            } else {
+                // rebuild from the other data stripes and P, ignoring Q
+                vector<uint8_t> tmp(seglen);
+                bool first = true;
+
+                for (uint16_t j = 0; j < ci.num_stripes; j++) {
+                    if (j == stripe || j == q)
+                        continue;
+
+                    if (!read_phys(c.stripes[j].dev_id, c.stripes[j].offset + stripeoff, seglen, first ? buf : tmp.data()))
+                        return false;
+
+                    if (!first) {
+                        for (uint32_t k = 0; k < seglen; k++) {
+                            buf[k] ^= tmp[k];
+                        }
+                    }
+
+                    first = false;
+                }
+            }
+        } else {
+            // SINGLE, DUP, and RAID1 and its variants
+            if (!read_phys(c.stripes[mirror].dev_id, c.stripes[mirror].offset + off, seglen, buf))
+                return false;
+        }
+
+        buf += seglen;
+        off += seglen;
+        len -= seglen;
+    }
+
+    return true;
+}
+
+bool btrfs_image::check_tree_checksum(const tree_header* th) {
+    auto data = (const uint8_t*)&th->fs_uuid;
+    size_t len = sb.node_size - sizeof(th->csum);
+
+    switch (sb.csum_type) {
+        case CSUM_TYPE_CRC32C:
+            return ~calc_crc32c(0xffffffff, (uint8_t*)data, (uint32_t)len) == *(uint32_t*)th->csum;
+
+        case CSUM_TYPE_XXHASH:
+            return XXH64(data, len, 0) == *(uint64_t*)th->csum;
+
+        case CSUM_TYPE_SHA256: {
+            uint8_t hash[32];
+
+            calc_sha256(hash, data, len);
+            return !memcmp(hash, th->csum, sizeof(hash));
+        }
+
+        case CSUM_TYPE_BLAKE2: {
+            uint8_t hash[32];
+
+            blake2b(hash, sizeof(hash), data, len);
+            return !memcmp(hash, th->csum, sizeof(hash));
+        }
+
+        default:
+            return false;
+    }
+}
+
+bool btrfs_image::read_tree(uint64_t addr, uint64_t gen, uint8_t* buf, string& err) {
+    auto c = find_chunk(addr);
+    auto th = (const tree_header*)buf;
+    const auto& fsid = sb.incompat_flags & BTRFS_INCOMPAT_FLAGS_METADATA_UUID ? sb.metadata_uuid : sb.uuid;
+    char msg[100];
+
+    if (!c) {
+        snprintf(msg, sizeof(msg), "address %llx not in any chunk", (unsigned long long)addr);
+        err = msg;
+        return false;
+    }
+
+    auto mirrors = num_mirrors(*c);
+
+    for (unsigned int i = 0; i < mirrors; i++) {
+        if (!read_mirror(*c, addr, sb.node_size, i, buf))
+            snprintf(msg, sizeof(msg), "could not read mirror %u", i);
+        else if (!check_tree_checksum(th))
+            snprintf(msg, sizeof(msg), "checksum mismatch on mirror %u", i);
+        else if (th->address != addr)
+            snprintf(msg, sizeof(msg), "address was %llx on mirror %u", (unsigned long long)th->address, i);
+        else if (memcmp(&th->fs_uuid, &fsid, sizeof(BTRFS_UUID)))
+            snprintf(msg, sizeof(msg), "wrong fsid on mirror %u", i);
+        else if (gen != 0 && th->generation != gen)
+            snprintf(msg, sizeof(msg), "generation was %llx on mirror %u, expected %llx", (unsigned long long)th->generation, i, (unsigned long long)gen);
+        else {
+            if (i != 0)
+                fprintf(stderr, "%llx: %s, used mirror %u\n", (unsigned long long)addr, err.c_str(), i);
+
+            return true;
+        }
+
+        if (i == 0)
+            err = msg;
+    }
+
+    return false;
+}
+
+void btrfs_image::prefetch(uint64_t addr) {
+    auto c = find_chunk(addr);
+
+    if (!c || c->ci.type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10 | BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        return;
+
+    auto it = devices.find(c->stripes[0].dev_id);
+
+    if (it != devices.end())
+        posix_fadvise(it->second.fd, (off_t)(c->stripes[0].offset + addr - c->offset), sb.node_size, POSIX_FADV_WILLNEED);
+}
+
+// dumping
+
+struct dump_options {
+    bool json = false;
+    bool items_only = false;
+    set<uint64_t> trees; // empty for all
+    bool log = true;
+    KEY min_key{0, 0, 0};
+    KEY max_key{0xffffffffffffffff, 0xff, 0xffffffffffffffff};
+    unsigned int threads;
+};
+
+struct dump_job {
+    uint64_t addr = 0; // 0 if out is ready to go
+    uint64_t gen;
+    uint64_t tree;
+    bool log;
+    unsigned int depth;
+    bool done = false;
+    string out;
+};
+
+class dumper {
+public:
+    dumper(btrfs_image& img, const dump_options& opts);
+    ~dumper();
+    void run();
+
+    atomic<uint64_t> errors{0};
+
+private:
+    void worker();
+    void do_job(dump_job& j, vector<uint8_t>& buf);
+    void emit(string&& s);
+    void write_ready(size_t limit);
+    void walk(uint64_t addr, uint64_t gen, uint8_t level, uint64_t tree, bool log, unsigned int depth, const KEY* next_key);
+    void dump_tree(uint64_t addr, uint8_t level, uint64_t tree, bool log);
+    void scan_tree(uint64_t addr, uint8_t level, const function<void(const KEY&, const uint8_t*, uint32_t)>& func);
+    void dump_superblock();
+    unique_ptr<item_out> make_out();
+    void finish_line(item_out& o);
+    bool want_tree(uint64_t tree, bool log);
+
+    btrfs_image& img;
+    const dump_options& opts;
+    deque<unique_ptr<dump_job>> queue;
+    deque<dump_job*> todo;
+    mutex lock;
+    condition_variable todo_cv, done_cv;
+    bool stopping = false;
+    vector<thread> workers;
+    size_t window;
+};
+
+dumper::dumper(btrfs_image& img, const dump_options& opts) : img(img), opts(opts) {
+    window = opts.threads * 32;
+
+    for (unsigned int i = 1; i < opts.threads; i++) {
+        workers.emplace_back([this]() {
+            worker();
+        });
+    }
+}
+
+dumper::~dumper() {
+    {
+        lock_guard<mutex> lg(lock);
+        stopping = true;
+    }
+
+    todo_cv.notify_all();
+
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+unique_ptr<item_out> dumper::make_out() {
+    if (opts.json)
+        return make_unique<json_out>();
+    else
+        return make_unique<text_out>();
+}
+
+void dumper::finish_line(item_out& o) {
+    if (opts.json) {
+        auto& jo = static_cast<json_out&>(o);
+
+        jo.s = '{' + jo.s + "}\n";
+    } else
+        o.s += '\n';
+}
+
+void dumper::do_job(dump_job& j, vector<uint8_t>& buf) {
+    string err;
+    auto th = (const tree_header*)buf.data();
+    string pref(opts.items_only ? 0 : j.depth, ' ');
+
+    if (!img.read_tree(j.addr, j.gen, buf.data(), err)) {
+        char msg[40];
+
+        errors++;
+        snprintf(msg, sizeof(msg), "%llx: ", (unsigned long long)j.addr);
+        fprintf(stderr, "%s%s\n", msg, err.c_str());
+
+        auto o = make_out();
+
+        if (opts.json)
+            o->num("tree", j.tree);
+
+        o->num("error", j.addr);
+        o->str("message", err);
+        finish_line(*o);
+
+        j.out = pref + (opts.json ? o->s : o->s.substr(1));
+        return;
+    }
+
+    if (th->level != 0) {
+        errors++;
+        fprintf(stderr, "%llx: expected leaf, found level %u\n", (unsigned long long)j.addr, th->level);
+    }
+
+    if (!opts.items_only) {
+        auto o = make_out();
+
+        if (opts.json) {
+            o->num("tree", j.tree);
+
+            if (j.log)
+                o->hex("log", "true");
+
+            o->begin_obj("header", nullptr);
+        } else
+            o->type("header");
+
+        o->hex("csum", format_csum(th->csum, img.sb.csum_type));
+        o->uuid("fsid", th->fs_uuid);
+        o->num("addr", th->address);
+        o->num("flags", th->flags);
+        o->uuid("chunk", th->chunk_tree_uuid);
+        o->num("gen", th->generation);
+        o->num("tree", th->tree_id);
+        o->num("numitems", th->num_items);
+        o->num("level", th->level);
+
+        if (opts.json)
+            o->end_obj();
+
+        finish_line(*o);
+        j.out += pref + o->s;
+    }
+
+    if (th->level != 0)
+        return;
+
+    auto ln = (const leaf_node*)(th + 1);
+    uint32_t max_items = (uint32_t)((img.sb.node_size - sizeof(tree_header)) / sizeof(leaf_node));
+
+    for (uint32_t i = 0; i < min(th->num_items, max_items); i++) {
+        const auto& key = ln[i].key;
+        auto o = make_out();
+
+        if (key < opts.min_key || opts.max_key < key)
+            continue;
+
+        if (opts.json) {
+            o->num("tree", j.tree);
+
+            if (j.log)
+                o->hex("log", "true");
+
+            o->key("key", key);
+            o->begin_obj("item", nullptr);
+        } else {
+            char buf2[60];
+
+            sprintf(buf2, "%llx,%x,%llx", (unsigned long long)key.obj_id, key.obj_type, (unsigned long long)key.offset);
+            o->s = pref + buf2;
+
+            if (opts.items_only)
+                o->s += ' ';
+            else
+                o->s += '\n' + pref;
+        }
+
+        if ((uint64_t)sizeof(tree_header) + ln[i].offset + ln[i].size > img.sb.node_size) {
+            o->type("invalid");
+            o->num("offset", ln[i].offset);
+            o->num("size", ln[i].size);
+            errors++;
+        } else {
+            auto data = buf.data() + sizeof(tree_header) + ln[i].offset;
+            size_t mark = o->s.size();
+
+            if (!dump_item(*o, key, data, ln[i].size, img.sb.csum_type)) {
+                o->s.resize(mark);
+
+                if (opts.json)
+                    static_cast<json_out&>(*o).first.back() = true;
+
+                dump_unknown(*o, ln[i].size);
+            }
+        }
+
+        if (opts.json)
+            o->end_obj();
+
+        finish_line(*o);
+        j.out += o->s;
+    }
+}
+
+void dumper::worker() {
+    vector<uint8_t> buf(img.sb.node_size);
+
+    while (true) {
+        dump_job* j;
+
+        {
+            unique_lock<mutex> ul(lock);
+
+            todo_cv.wait(ul, [&]() { return stopping || !todo.empty(); });
+
+            if (todo.empty())
+                return;
+
+            j = todo.front();
+            todo.pop_front();
+        }
+
+        do_job(*j, buf);
+
+        {
+            lock_guard<mutex> lg(lock);
+            j->done = true;
+        }
+
+        done_cv.notify_all();
+    }
+}
+
+// Writes out finished jobs in order, waiting until no more than limit are
+// queued.
+void dumper::write_ready(size_t limit) {
+    while (!queue.empty()) {
+        auto& j = *queue.front();
+
+        if (workers.empty()) {
+            if (!j.done) {
+                if (queue.size() <= limit)
+                    return;
+
+                vector<uint8_t> buf(img.sb.node_size);
+
+                do_job(j, buf);
+                j.done = true;
+            }
+        } else {
+            unique_lock<mutex> ul(lock);
+
+            if (!j.done) {
+                if (queue.size() <= limit)
+                    return;
+
+                done_cv.wait(ul, [&]() { return j.done; });
+            }
+        }
+
+        fwrite(j.out.data(), 1, j.out.size(), stdout);
+        queue.pop_front();
+    }
+}
+
+void dumper::emit(string&& s) {
+    if (queue.empty()) {
+        fwrite(s.data(), 1, s.size(), stdout);
+        return;
+    }
+
+    auto j = make_unique<dump_job>();
+
+    j->out = move(s);
+    j->done = true;
+    queue.push_back(move(j));
+}
+
+void dumper::walk(uint64_t addr, uint64_t gen, uint8_t level, uint64_t tree, bool log, unsigned int depth, const KEY* next_key) {
+    if (level == 0) {
+        auto j = make_unique<dump_job>();
+
+        j->addr = addr;
+        j->gen = gen;
+        j->tree = tree;
+        j->log = log;
+        j->depth = depth;
+
+        if (!workers.empty()) {
+            {
+                lock_guard<mutex> lg(lock);
+                todo.push_back(j.get());
+            }
+
+            todo_cv.notify_one();
+        }
+
+        queue.push_back(move(j));
+
+        write_ready(window);
+
+        return;
+    }
+
+    vector<uint8_t> buf(img.sb.node_size);
+    auto th = (const tree_header*)buf.data();
+    string pref(opts.items_only ? 0 : depth, ' ');
+    string err;
+
+    if (!img.read_tree(addr, gen, buf.data(), err)) {
+        dump_job j;
+
+        j.addr = addr;
+        j.gen = gen;
+        j.tree = tree;
+        j.log = log;
+        j.depth = depth;
+
+        do_job(j, buf); // prints the error
+        emit(move(j.out));
+        return;
+    }
+
+    if (th->level != level) {
+        errors++;
+        fprintf(stderr, "%llx: level was %u, expected %u\n", (unsigned long long)addr, th->level, level);
+
+        if (th->level == 0) {
+            walk(addr, gen, 0, tree, log, depth, next_key);
+            return;
+        }
+    }
+
+    if (!opts.items_only) {
+        auto o = make_out();
+
+        if (opts.json) {
+            o->num("tree", tree);
+
+            if (log)
+                o->hex("log", "true");
+
+            o->begin_obj("header", nullptr);
+        } else
+            o->type("header");
+
+        o->hex("csum", format_csum(th->csum, img.sb.csum_type));
+        o->uuid("fsid", th->fs_uuid);
+        o->num("addr", th->address);
+        o->num("flags", th->flags);
+        o->uuid("chunk", th->chunk_tree_uuid);
+        o->num("gen", th->generation);
+        o->num("tree", th->tree_id);
+        o->num("numitems", th->num_items);
+        o->num("level", th->level);
+
+        if (opts.json)
+            o->end_obj();
+
+        finish_line(*o);
+        emit(pref + o->s);
+    }
+
+    auto in = (const internal_node*)(th + 1);
+    uint32_t num_items = min(th->num_items, (uint32_t)((img.sb.node_size - sizeof(tree_header)) / sizeof(internal_node)));
+    vector<uint32_t> children;
+
+    // skip the children which can't contain anything in our key range
+    for (uint32_t i = 0; i < num_items; i++) {
+        const KEY* end = i == num_items - 1 ? next_key : &in[i + 1].key;
+
+        if (opts.max_key < in[i].key)
+            break;
+
+        if (end && !(opts.min_key < *end))
+            continue;
+
+        children.push_back(i);
+    }
+
+    if (th->level > 1) {
+        for (auto i : children) {
+            img.prefetch(in[i].address);
+        }
+    }
+
+    for (auto i : children) {
+        const auto& c = in[i];
+
+        if (!opts.items_only) {
+            auto o = make_out();
+
+            if (opts.json) {
+                o->num("tree", tree);
+
+                if (log)
+                    o->hex("log", "true");
+
+                o->key("key", c.key);
+                o->num("block", c.address);
+                o->num("gen", c.generation);
+            } else {
+                char buf2[60];
+
+                sprintf(buf2, "%llx,%x,%llx", (unsigned long long)c.key.obj_id, c.key.obj_type, (unsigned long long)c.key.offset);
+                o->s = buf2;
+                o->num("block", c.address);
+                o->num("gen", c.generation);
+            }
+
+            finish_line(*o);
+            emit(pref + o->s);
+        }
+
+        walk(c.address, c.generation, th->level - 1, tree, log, depth + 1, i == num_items - 1 ? next_key : &in[i + 1].key);
+    }
+}
+
+bool dumper::want_tree(uint64_t tree, bool log) {
+    if (log)
+        return opts.log;
+
+    return opts.trees.empty() || opts.trees.count(tree) != 0;
+}
+
+void dumper::dump_tree(uint64_t addr, uint8_t level, uint64_t tree, bool log) {
+    if (!opts.json) {
+        char buf[60];
+
+        if (tree == BTRFS_ROOT_CHUNK && !log)
+            emit("CHUNK: \n");
+        else if (tree == BTRFS_ROOT_ROOT && !log)
+            emit("ROOT: \n");
+        else if (tree == TREE_LOG_ID && !log)
+            emit("LOG: \n");
+        else {
+            sprintf(buf, "Tree %llx%s:\n", (unsigned long long)tree, log ? " (log)" : "");
+            emit(buf);
+        }
+    }
+
+    walk(addr, 0, level, tree, log, 0, nullptr);
+
+    if (!opts.json)
+        emit("\n");
+}
+
+// reads a tree on the main thread, for finding the chunks and roots
+void dumper::scan_tree(uint64_t addr, uint8_t level, const function<void(const KEY&, const uint8_t*, uint32_t)>& func) {
+    vector<uint8_t> buf(img.sb.node_size);
+    auto th = (const tree_header*)buf.data();
+    string err;
+
+    if (!img.read_tree(addr, 0, buf.data(), err)) {
+        fprintf(stderr, "%llx: %s\n", (unsigned long long)addr, err.c_str());
+        return;
+    }
+
+    if (th->level != level)
+        fprintf(stderr, "%llx: level was %u, expected %u\n", (unsigned long long)addr, th->level, level);
+
+    if (th->level == 0) {
+        auto ln = (const leaf_node*)(th + 1);
+        uint32_t num_items = min(th->num_items, (uint32_t)((img.sb.node_size - sizeof(tree_header)) / sizeof(leaf_node)));
+
+        for (uint32_t i = 0; i < num_items; i++) {
+            if ((uint64_t)sizeof(tree_header) + ln[i].offset + ln[i].size > img.sb.node_size)
+                continue;
+
+            func(ln[i].key, buf.data() + sizeof(tree_header) + ln[i].offset, ln[i].size);
+        }
+    } else {
+        auto in = (const internal_node*)(th + 1);
+        uint32_t num_items = min(th->num_items, (uint32_t)((img.sb.node_size - sizeof(tree_header)) / sizeof(internal_node)));
+        vector<internal_node> children(in, in + num_items);
+
+        for (const auto& c : children) {
+            scan_tree(c.address, th->level - 1, func);
+        }
+    }
+}
+
+void dumper::dump_superblock() {
+    const auto& sb = img.sb;
+    char magic[9];
+
+    auto o = make_out();
+
+    if (opts.json)
+        o->begin_obj("superblock", nullptr);
+    else
+        o->type("superblock");
+
+    memcpy(magic, &sb.magic, sizeof(sb.magic));
+    magic[8] = 0;
+
+    o->hex("csum", format_csum(sb.checksum, sb.csum_type));
+    o->uuid("fsuuid", sb.uuid);
+    o->num("physaddr", sb.sb_phys_addr);
+    o->num("flags", sb.flags);
+    o->str("magic", magic);
+    o->num("gen", sb.generation);
+    o->num("roottree", sb.root_tree_addr);
+    o->num("chunktree", sb.chunk_tree_addr);
+    o->num("logtree", sb.log_tree_addr);
+    o->num("log_root_transid", sb.log_root_transid);
+    o->num("total_bytes", sb.total_bytes);
+    o->num("bytes_used", sb.bytes_used);
+    o->num("root_dir_objectid", sb.root_dir_objectid);
+    o->num("num_devices", sb.num_devices);
+    o->num("sectorsize", sb.sector_size);
+    o->num("nodesize", sb.node_size);
+    o->num("leafsize", sb.leaf_size);
+    o->num("stripesize", sb.stripe_size);
+    o->num("n", sb.n);
+    o->num("chunk_root_generation", sb.chunk_root_generation);
+    o->num("compat_flags", sb.compat_flags);
+    o->hex("compat_ro_flags", flags_string(sb.compat_ro_flags, compat_ro_flag_names, false));
+    o->hex("incompat_flags", flags_string(sb.incompat_flags, incompat_flag_names, false));
+    o->num("csum_type", sb.csum_type);
+    o->num("root_level", sb.root_level);
+    o->num("chunk_root_level", sb.chunk_root_level);
+    o->num("log_root_level", sb.log_root_level);
+    o->begin_obj("dev_item", nullptr);
+    dump_dev_item(*o, sb.dev_item);
+    o->end_obj();
+    o->str("label", string_view(sb.label, strnlen(sb.label, sizeof(sb.label))));
+    o->num("cache_gen", sb.cache_generation);
+    o->num("uuid_tree_gen", sb.uuid_tree_generation);
+    o->uuid("metadata_uuid", sb.metadata_uuid);
+
+    if (!img.sb_csum_ok)
+        o->hex("csum_ok", "false");
+
+    if (opts.json)
+        o->end_obj();
+
+    finish_line(*o);
+    emit(move(o->s));
+
+    item_data d(sb.sys_chunk_array, min(sb.n, (uint32_t)SYS_CHUNK_ARRAY_SIZE));
+
+    while (d.len > 0) {
+        auto key = d.get<KEY>();
+        auto ci = (const CHUNK_ITEM*)d.p;
+
+        if (!key || d.len < sizeof(CHUNK_ITEM))
+            break;
+
+        auto len = min(d.len, sizeof(CHUNK_ITEM) + (ci->num_stripes * sizeof(CHUNK_ITEM_STRIPE)));
+        item_data d2(d.p, len);
+
+        o = make_out();
+
+        if (opts.json) {
+            o->key("bootstrap", *key);
+            o->begin_obj("item", nullptr);
+            dump_chunk_item(*o, d2);
+            o->end_obj();
+        } else {
+            char buf[80];
+
+            sprintf(buf, "bootstrap %llx,%x,%llx\n", (unsigned long long)key->obj_id, key->obj_type, (unsigned long long)key->offset);
+            o->s = buf;
+            dump_chunk_item(*o, d2);
+        }
+
+        finish_line(*o);
+        emit(move(o->s));
+
+        d.p += len;
+        d.len -= len;
+    }
+
+    for (unsigned int i = 0; i < BTRFS_NUM_BACKUP_ROOTS; i++) {
+        const auto& b = sb.backup[i];
+
+        o = make_out();
+
+        if (opts.json)
+            o->begin_obj("backup", nullptr);
+        else
+            o->type("backup");
+
+        o->num("tree_root", b.root_tree_addr);
+        o->num("tree_root_gen", b.root_tree_generation);
+        o->num("chunk_root", b.chunk_tree_addr);
+        o->num("chunk_root_gen", b.chunk_tree_generation);
+        o->num("extent_root", b.extent_tree_addr);
+        o->num("extent_root_gen", b.extent_tree_generation);
+        o->num("fs_root", b.fs_tree_addr);
+        o->num("fs_root_gen", b.fs_tree_generation);
+        o->num("dev_root", b.dev_root_addr);
+        o->num("dev_root_gen", b.dev_root_generation);
+        o->num("csum_root", b.csum_root_addr);
+        o->num("csum_root_gen", b.csum_root_generation);
+        o->num("total_bytes", b.total_bytes);
+        o->num("bytes_used", b.bytes_used);
+        o->num("num_devices", b.num_devices);
+        o->num("tree_root_level", b.root_level);
+        o->num("chunk_root_level", b.chunk_root_level);
+        o->num("extent_root_level", b.extent_root_level);
+        o->num("fs_root_level", b.fs_root_level);
+        o->num("dev_root_level", b.dev_root_level);
+        o->num("csum_root_level", b.csum_root_level);
+
+        if (opts.json)
+            o->end_obj();
+
+        finish_line(*o);
+        emit(move(o->s));
+    }
+
+    if (!opts.json)
+        emit("\n");
+}
+
+void dumper::run() {
+    const auto& sb = img.sb;
+    map<uint64_t, pair<uint64_t, uint8_t>> roots, log_roots;
+
+    // read the whole chunk tree first, so we can find everything else
+
+    scan_tree(sb.chunk_tree_addr, sb.chunk_root_level, [&](const KEY& key, const uint8_t* data, uint32_t size) {
+        if (key.obj_type == TYPE_CHUNK_ITEM && size >= sizeof(CHUNK_ITEM))
+            img.add_chunk(key.offset, (const CHUNK_ITEM*)data, size);
+    });
+
+    scan_tree(sb.root_tree_addr, sb.root_level, [&](const KEY& key, const uint8_t* data, uint32_t size) {
+        if (key.obj_type == TYPE_ROOT_ITEM && size >= offsetof(ROOT_ITEM, root_level) + 1) {
+            auto ri = (const ROOT_ITEM*)data;
+
+            roots[key.obj_id] = make_pair(ri->block_number, ri->root_level);
+        }
+    });
+
+    if (sb.log_tree_addr != 0) {
+        scan_tree(sb.log_tree_addr, sb.log_root_level, [&](const KEY& key, const uint8_t* data, uint32_t size) {
+            if (key.obj_id == TREE_LOG_ID && key.obj_type == TYPE_ROOT_ITEM && size >= offsetof(ROOT_ITEM, root_level) + 1) {
+                auto ri = (const ROOT_ITEM*)data;
+
+                log_roots[key.offset] = make_pair(ri->block_number, ri->root_level);
+            }
+        });
+    }
+
+    if (opts.trees.empty() && !opts.items_only)
+        dump_superblock();
+
+    if (want_tree(BTRFS_ROOT_CHUNK, false))
+        dump_tree(sb.chunk_tree_addr, sb.chunk_root_level, BTRFS_ROOT_CHUNK, false);
+
+    if (want_tree(BTRFS_ROOT_ROOT, false))
+        dump_tree(sb.root_tree_addr, sb.root_level, BTRFS_ROOT_ROOT, false);
+
+    if (sb.log_tree_addr != 0 && opts.log)
+        dump_tree(sb.log_tree_addr, sb.log_root_level, TREE_LOG_ID, false);
+
+    for (const auto& r : roots) {
+        if (want_tree(r.first, false))
+            dump_tree(r.second.first, r.second.second, r.first, false);
+    }
+
+    for (const auto& r : log_roots) {
+        if (opts.log)
+            dump_tree(r.second.first, r.second.second, r.first, true);
+    }
+
+    write_ready(0);
+}
+
+// command line
+
+static const pair<const char*, uint64_t> tree_names[] = {
+    { "root", BTRFS_ROOT_ROOT },
+    { "extent", BTRFS_ROOT_EXTENT },
+    { "chunk", BTRFS_ROOT_CHUNK },
+    { "dev", BTRFS_ROOT_DEVTREE },
+    { "fs", BTRFS_ROOT_FSTREE },
+    { "csum", BTRFS_ROOT_CHECKSUM },
+    { "uuid", BTRFS_ROOT_UUID },
+    { "free-space", BTRFS_ROOT_FREE_SPACE },
+    { "block-group", BTRFS_ROOT_BLOCK_GROUP },
+    { "data-reloc", BTRFS_ROOT_DATA_RELOC },
+    { nullptr, 0 }
+};
+
+static void parse_trees(const char* arg, dump_options& opts) {
+    string s = arg;
+    size_t pos = 0;
+
+    while (pos <= s.size()) {
+        auto comma = s.find(',', pos);
+        auto t = s.substr(pos, comma == string::npos ? string::npos : comma - pos);
+        bool found = false;
+
+        if (t == "log") {
+            opts.log = true;
+            found = true;
+        } else {
+            for (auto n = tree_names; n->first; n++) {
+                if (t == n->first) {
+                    opts.trees.insert(n->second);
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (!found) {
+            char* end;
+
+            auto id = strtoull(t.c_str(), &end, 16);
+
+            if (t.empty() || *end != 0)
+                throw runtime_error("Unrecognized tree " + t + ".");
+
+            opts.trees.insert(id);
+        }
+
+        if (comma == string::npos)
+            break;
+
+        pos = comma + 1;
+    }
+}
+
+static KEY parse_key(const string& s, bool upper) {
+    KEY k;
+    uint64_t vals[3];
+    const char* p = s.c_str();
+    unsigned int n = 0;
+
+    while (n < 3) {
+        char* end;
+
+        vals[n] = strtoull(p, &end, 16);
+
+        if (end == p)
+            throw runtime_error("Invalid key " + s + ".");
+
+        n++;
+
+        if (*end == 0)
+            break;
+
+        if (*end != ',')
+            throw runtime_error("Invalid key " + s + ".");
+
+        p = end + 1;
+    }
+
+    k.obj_id = vals[0];
+    k.obj_type = n > 1 ? (uint8_t)vals[1] : (upper ? 0xff : 0);
+    k.offset = n > 2 ? vals[2] : (upper ? 0xffffffffffffffff : 0);
+
+    return k;
+}
+
+static void parse_key_range(const char* arg, dump_options& opts) {
+    string s = arg;
+    auto dash = s.find('-');
+
+    if (dash == string::npos) {
+        opts.min_key = parse_key(s, false);
+        opts.max_key = parse_key(s, true);
+    } else {
+        if (dash != 0)
+            opts.min_key = parse_key(s.substr(0, dash), false);
+
+        if (dash != s.size() - 1)
+            opts.max_key = parse_key(s.substr(dash + 1), true);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: btrfsdump [-J] [-i] [-t trees] [-k range] [-j threads] device [device...]\n\n");
+    fprintf(stderr, "Dumps the trees of a btrfs filesystem. Give every device of a multi-device\n");
+    fprintf(stderr, "filesystem; the superblock of the first one is used.\n\n");
+    fprintf(stderr, "  -J              write JSON, one object per line\n");
+    fprintf(stderr, "  -i              items only: leave out the superblock, node headers and internal nodes\n");
+    fprintf(stderr, "  -t <trees>      comma-separated list of trees to dump, by ID in hex or by name:\n");
+    fprintf(stderr, "                  root, extent, chunk, dev, fs, csum, uuid, free-space, block-group,\n");
+    fprintf(stderr, "                  data-reloc or log\n");
+    fprintf(stderr, "  -k <from-to>    only dump items with keys in this range, written as obj,type,offset\n");
+    fprintf(stderr, "                  in hex; either end can be left off, as can trailing parts of a key\n");
+    fprintf(stderr, "  -j <threads>    number of threads (default: number of CPUs)\n");
+}
+
+int main(int argc, char* argv[]) {
+    dump_options opts;
+    int opt;
+
+    opts.threads = thread::hardware_concurrency();
+
+    while ((opt = getopt(argc, argv, "Jit:k:j:")) != -1) {
+        try {
+            switch (opt) {
+                case 'J':
+                    opts.json = true;
+                break;
+
+                case 'i':
+                    opts.items_only = true;
+                break;
+
+                case 't':
+                    if (opts.trees.empty() && opts.log)
+                        opts.log = false; // only if asked for
+
+                    parse_trees(optarg, opts);
+                break;
+
+                case 'k':
+                    parse_key_range(optarg, opts);
+                break;
+
+                case 'j':
+                    opts.threads = (unsigned int)strtoul(optarg, nullptr, 10);
+                break;
+
+                default:
+                    usage();
+                    return 1;
+            }
+        } catch (const exception& e) {
+            fprintf(stderr, "ERROR: %s\n", e.what());
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    if (opts.threads == 0)
+        opts.threads = 1;
+
+    try {
+#ifdef __x86_64__
+        if (__builtin_cpu_supports("sse4.2"))
+            calc_crc32c = calc_crc32c_hw;
+#endif
+
+        vector<string> files(argv + optind, argv + argc);
+        btrfs_image img(files);
+        uint64_t errors;
+
+        static char outbuf[1048576];
+        setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+        {
+            dumper d(img, opts);
+
+            d.run();
+            errors = d.errors;
+        }
+
+        fflush(stdout);
+
+        if (errors != 0) {
+            fprintf(stderr, "%llu unreadable or invalid nodes.\n", (unsigned long long)errors);
+            return 1;
+        }
+    } catch (const exception& e) {
+        fflush(stdout);
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
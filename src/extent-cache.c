@@ -0,0 +1,183 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef _KERNEL_MODE
+#include "btrfs_drv.h"
+#else
+#include "compress-shim.h"
+#endif
+
+// Small reads from compressed extents otherwise mean decompressing the whole
+// extent each time, so read_file keeps the last few it decompressed here,
+// keyed by disk address and generation. Compressed extents are never written
+// in place, so entries only go stale when their extent is freed, which is when
+// extent_cache_invalidate gets called; the generation is belt and braces, in
+// case the address gets reused.
+
+static __inline LIST_ENTRY* hash_bucket(extent_cache* ec, uint64_t address) {
+    return &ec->hash[(uint32_t)(((address >> 12) * 0x9e3779b97f4a7c15ULL) >> 32) % EXTENT_CACHE_HASH_SIZE];
+}
+
+static extent_cache_entry* find_entry(extent_cache* ec, uint64_t address, uint64_t generation) {
+    LIST_ENTRY* bucket = hash_bucket(ec, address);
+    LIST_ENTRY* le = bucket->Flink;
+
+    while (le != bucket) {
+        extent_cache_entry* ece = CONTAINING_RECORD(le, extent_cache_entry, list_entry_hash);
+
+        if (ece->address == address && ece->generation == generation)
+            return ece;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static void remove_entry(extent_cache* ec, extent_cache_entry* ece) {
+    RemoveEntryList(&ece->list_entry);
+    RemoveEntryList(&ece->list_entry_hash);
+
+    ec->size -= ece->length;
+
+    ExFreePool(ece->data);
+    ExFreePool(ece);
+}
+
+void extent_cache_init(extent_cache* ec, uint64_t max_size) {
+    ExInitializeResourceLite(&ec->lock);
+
+    InitializeListHead(&ec->lru);
+
+    for (unsigned int i = 0; i < EXTENT_CACHE_HASH_SIZE; i++) {
+        InitializeListHead(&ec->hash[i]);
+    }
+
+    ec->size = 0;
+    ec->max_size = max_size;
+    ec->hits = ec->misses = ec->evictions = ec->invalidations = 0;
+}
+
+void extent_cache_free(extent_cache* ec) {
+    while (!IsListEmpty(&ec->lru)) {
+        remove_entry(ec, CONTAINING_RECORD(ec->lru.Flink, extent_cache_entry, list_entry));
+    }
+
+    ExDeleteResourceLite(&ec->lock);
+}
+
+// Copies length bytes at offset within the decompressed extent to data, and
+// returns true if it was in the cache.
+bool extent_cache_read(extent_cache* ec, uint64_t address, uint64_t generation, uint32_t offset, void* data, uint32_t length) {
+    extent_cache_entry* ece;
+
+    if (ec->max_size == 0)
+        return false;
+
+    ExAcquireResourceExclusiveLite(&ec->lock, true);
+
+    ece = find_entry(ec, address, generation);
+
+    if (!ece || offset + length > ece->length) {
+        ec->misses++;
+        ExReleaseResourceLite(&ec->lock);
+        return false;
+    }
+
+    RtlCopyMemory(data, ece->data + offset, length);
+
+    RemoveEntryList(&ece->list_entry);
+    InsertHeadList(&ec->lru, &ece->list_entry);
+
+    ec->hits++;
+
+    ExReleaseResourceLite(&ec->lock);
+
+    return true;
+}
+
+// Takes ownership of data, which must have been allocated from paged pool - it
+// gets freed here if we decide not to keep it.
+void extent_cache_insert(extent_cache* ec, uint64_t address, uint64_t generation, uint8_t* data, uint32_t length) {
+    extent_cache_entry* ece;
+
+    if (length > ec->max_size) {
+        ExFreePool(data);
+        return;
+    }
+
+    ece = ExAllocatePoolWithTag(PagedPool, sizeof(extent_cache_entry), ALLOC_TAG);
+    if (!ece) {
+        ERR("out of memory\n");
+        ExFreePool(data);
+        return;
+    }
+
+    ece->address = address;
+    ece->generation = generation;
+    ece->length = length;
+    ece->data = data;
+
+    ExAcquireResourceExclusiveLite(&ec->lock, true);
+
+    // someone else might have got there first
+    if (find_entry(ec, address, generation)) {
+        ExReleaseResourceLite(&ec->lock);
+        ExFreePool(ece->data);
+        ExFreePool(ece);
+        return;
+    }
+
+    while (ec->size + length > ec->max_size) {
+        remove_entry(ec, CONTAINING_RECORD(ec->lru.Blink, extent_cache_entry, list_entry));
+        ec->evictions++;
+    }
+
+    InsertHeadList(&ec->lru, &ece->list_entry);
+    InsertTailList(hash_bucket(ec, address), &ece->list_entry_hash);
+    ec->size += length;
+
+    ExReleaseResourceLite(&ec->lock);
+}
+
+// Called when the data extent at address is freed.
+void extent_cache_invalidate(extent_cache* ec, uint64_t address) {
+    LIST_ENTRY* bucket;
+    LIST_ENTRY* le;
+
+    if (ec->max_size == 0)
+        return;
+
+    ExAcquireResourceExclusiveLite(&ec->lock, true);
+
+    bucket = hash_bucket(ec, address);
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        LIST_ENTRY* le2 = le->Flink;
+        extent_cache_entry* ece = CONTAINING_RECORD(le, extent_cache_entry, list_entry_hash);
+
+        if (ece->address == address) {
+            remove_entry(ec, ece);
+            ec->invalidations++;
+        }
+
+        le = le2;
+    }
+
+    ExReleaseResourceLite(&ec->lock);
+}
@@ -0,0 +1,50 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+// The per-volume cache of decompressed extents, included by btrfs_drv.h and
+// by compress-shim.h, so that it can also be built in user mode.
+
+#define EXTENT_CACHE_HASH_SIZE 256
+
+typedef struct {
+    LIST_ENTRY list_entry; // in lru
+    LIST_ENTRY list_entry_hash;
+    uint64_t address;
+    uint64_t generation;
+    uint32_t length;
+    uint8_t* data;
+} extent_cache_entry;
+
+typedef struct {
+    ERESOURCE lock;
+    LIST_ENTRY lru; // most recently used first
+    LIST_ENTRY hash[EXTENT_CACHE_HASH_SIZE];
+    uint64_t size; // bytes of decompressed data held
+    uint64_t max_size; // 0 if disabled
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} extent_cache;
+
+void extent_cache_init(extent_cache* ec, uint64_t max_size);
+void extent_cache_free(extent_cache* ec);
+bool extent_cache_read(extent_cache* ec, uint64_t address, uint64_t generation, uint32_t offset, void* data, uint32_t length);
+void extent_cache_insert(extent_cache* ec, uint64_t address, uint64_t generation, uint8_t* data, uint32_t length);
+void extent_cache_invalidate(extent_cache* ec, uint64_t address);
@@ -2591,6 +2591,7 @@ end:
     if (ce->count == 0 && !ce->superseded) {
         c->used -= ce->size;
         space_list_add(c, ce->address, ce->size, rollback);
+        extent_cache_invalidate(&Vcb->extent_cache, ce->address);
     }
 
     RemoveEntryList(&ce->list_entry);
@@ -1823,8 +1823,8 @@ static NTSTATUS zero_data(device_extension* Vcb, fcb* fcb, uint64_t start, uint6
         end_data = fcb->inode_item.st_size;
         buf_head = (ULONG)offsetof(EXTENT_DATA, data[0]);
     } else if (compress) {
-        start_data = start & ~(uint64_t)(COMPRESSED_EXTENT_SIZE - 1);
-        end_data = min(sector_align(start + length, COMPRESSED_EXTENT_SIZE),
+        start_data = start & ~(uint64_t)(Vcb->options.compress_part_size - 1);
+        end_data = min(sector_align(start + length, Vcb->options.compress_part_size),
                        sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size));
         buf_head = 0;
     } else {
@@ -2084,6 +2084,161 @@ end:
     return Status;
 }
 
+static NTSTATUS encoded_write(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
+    btrfs_encoded_write* bew = data;
+    NTSTATUS Status;
+    fcb* fcb;
+    ccb* ccb;
+    file_ref* fileref;
+    LIST_ENTRY rollback, *le;
+    LARGE_INTEGER time, offset;
+    BTRFS_TIME now;
+    IO_STATUS_BLOCK iosb;
+    uint8_t compression;
+
+    if (!data || datalen < offsetof(btrfs_encoded_write, data[0]))
+        return STATUS_INVALID_PARAMETER;
+
+    if (bew->length > datalen - offsetof(btrfs_encoded_write, data[0]))
+        return STATUS_INVALID_PARAMETER;
+
+    if (!FileObject || !FileObject->FsContext || !FileObject->FsContext2 || FileObject->FsContext == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bew->encryption != BTRFS_ENCODED_IO_ENCRYPTION_NONE)
+        return STATUS_NOT_SUPPORTED;
+
+    switch (bew->compression) {
+        case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
+            compression = BTRFS_COMPRESSION_ZLIB;
+        break;
+
+        case BTRFS_ENCODED_IO_COMPRESSION_ZSTD:
+            compression = BTRFS_COMPRESSION_ZSTD;
+        break;
+
+        default:
+            if (bew->compression != BTRFS_ENCODED_IO_COMPRESSION_LZO_4K + Vcb->sector_shift - 12)
+                return STATUS_NOT_SUPPORTED;
+
+            compression = BTRFS_COMPRESSION_LZO;
+        break;
+    }
+
+    // checked separately, so that nothing can wrap round
+    if (bew->length == 0 || bew->length > COMPRESSED_EXTENT_SIZE || bew->unencoded_len > COMPRESSED_EXTENT_SIZE ||
+        bew->unencoded_offset >= bew->unencoded_len || bew->unencoded_file_len == 0 ||
+        bew->unencoded_file_len > bew->unencoded_len - bew->unencoded_offset)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bew->offset & (Vcb->superblock.sector_size - 1) || bew->unencoded_file_len & (Vcb->superblock.sector_size - 1))
+        return STATUS_INVALID_PARAMETER;
+
+    if (bew->offset + bew->unencoded_file_len < bew->offset)
+        return STATUS_INVALID_PARAMETER;
+
+    // The data goes on disk as it is, and gets decompressed every time the file
+    // is read, so this is as dangerous as writing to the volume directly.
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), Irp->RequestorMode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    fcb = FileObject->FsContext;
+    ccb = FileObject->FsContext2;
+    fileref = ccb->fileref;
+
+    if (!fileref) {
+        ERR("fileref was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    if (Irp->RequestorMode == UserMode && !(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, true);
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, true);
+
+    if (fcb->type != BTRFS_TYPE_FILE || fcb->ads) {
+        WARN("FileObject did not point to a file\n");
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
+
+    if (fcb->inode_item.flags & BTRFS_INODE_NODATACOW) {
+        Status = STATUS_NOT_SUPPORTED;
+        goto end;
+    }
+
+    // caller has to extend the file first
+    if (bew->offset + bew->unencoded_file_len > sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size)) {
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore && ext->extent_data.type == EXTENT_TYPE_INLINE) {
+            Status = STATUS_NOT_SUPPORTED;
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    CcFlushCache(FileObject->SectionObjectPointer, NULL, 0, &iosb);
+
+    Status = write_encoded(fcb, bew->offset, bew->unencoded_file_len, bew->unencoded_len, bew->unencoded_offset,
+                           compression, bew->data, bew->length, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_encoded returned %08lx\n", Status);
+        goto end;
+    }
+
+    offset.QuadPart = bew->offset;
+    CcPurgeCacheSection(FileObject->SectionObjectPointer, &offset, (ULONG)bew->unencoded_file_len, false);
+
+    KeQuerySystemTime(&time);
+    win_time_to_unix(time, &now);
+
+    fcb->inode_item.transid = Vcb->superblock.generation;
+    fcb->inode_item.sequence++;
+
+    if (!ccb->user_set_change_time)
+        fcb->inode_item.st_ctime = now;
+
+    if (!ccb->user_set_write_time)
+        fcb->inode_item.st_mtime = now;
+
+    queue_notification_fcb(fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
+
+    fcb->subvol->root_item.ctransid = Vcb->superblock.generation;
+    fcb->subvol->root_item.ctime = now;
+
+    Status = STATUS_SUCCESS;
+
+end:
+    if (!NT_SUCCESS(Status))
+        do_rollback(Vcb, &rollback);
+    else
+        clear_rollback(&rollback);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
+}
+
 static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFER* inbuf, ULONG inbuflen, void* outbuf, ULONG outbuflen, ULONG_PTR* retlen) {
     NTSTATUS Status;
     fcb* fcb;
@@ -3257,6 +3412,43 @@ bool fcb_is_inline(fcb* fcb) {
     return false;
 }
 
+// Returns the extent if the file's data is all in one uncompressed inline
+// extent, which is the case for most small files, so that callers can work on
+// the item directly.
+extent* get_inline_extent(fcb* fcb) {
+    LIST_ENTRY* le;
+    extent* ext = NULL;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext2 = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext2->ignore) {
+            if (ext)
+                return NULL;
+
+            ext = ext2;
+
+            if (ext->offset != 0 || ext->extent_data.type != EXTENT_TYPE_INLINE)
+                return NULL;
+        }
+
+        le = le->Flink;
+    }
+
+    if (!ext)
+        return NULL;
+
+    if (ext->extent_data.compression != BTRFS_COMPRESSION_NONE || ext->extent_data.encryption != BTRFS_ENCRYPTION_NONE ||
+        ext->extent_data.encoding != BTRFS_ENCODING_NONE)
+        return NULL;
+
+    if (ext->datalen != offsetof(EXTENT_DATA, data[0]) + ext->extent_data.decoded_size)
+        return NULL;
+
+    return ext;
+}
+
 static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
     DUPLICATE_EXTENTS_DATA* ded = (DUPLICATE_EXTENTS_DATA*)data;
     fcb *fcb = FileObject ? FileObject->FsContext : NULL, *sourcefcb;
@@ -4531,25 +4723,13 @@ static NTSTATUS reserve_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, P
 }
 
 static NTSTATUS get_subvol_path(device_extension* Vcb, uint64_t id, WCHAR* out, ULONG outlen, PIRP Irp) {
-    LIST_ENTRY* le;
-    root* r = NULL;
+    root* r;
     NTSTATUS Status;
     file_ref* fr;
     UNICODE_STRING us;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == id) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
-
-    if (!r) {
+    Status = find_root(Vcb, id, &r, Irp);
+    if (!NT_SUCCESS(Status)) {
         ERR("couldn't find subvol %I64x\n", id);
         return STATUS_INTERNAL_ERROR;
     }
@@ -5183,6 +5363,47 @@ static NTSTATUS add_csum_sparse_extents(device_extension* Vcb, uint64_t sparse_e
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS get_mount_times(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    if (length < sizeof(btrfs_mount_times) || !data)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlCopyMemory(data, &Vcb->mount_times, sizeof(btrfs_mount_times));
+    *retlen = sizeof(btrfs_mount_times);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_compression_stats(device_extension* Vcb, void* data, ULONG length, ULONG_PTR* retlen) {
+    btrfs_compression_stats* bcs = data;
+
+    if (length < sizeof(btrfs_compression_stats) || !data)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    RtlCopyMemory(bcs, &Vcb->comp_stats, sizeof(btrfs_compression_stats));
+
+    ExAcquireResourceSharedLite(&Vcb->extent_cache.lock, true);
+
+    bcs->extent_cache_hits = Vcb->extent_cache.hits;
+    bcs->extent_cache_misses = Vcb->extent_cache.misses;
+    bcs->extent_cache_evictions = Vcb->extent_cache.evictions;
+    bcs->extent_cache_invalidations = Vcb->extent_cache.invalidations;
+    bcs->extent_cache_size = Vcb->extent_cache.size;
+
+    ExReleaseResourceLite(&Vcb->extent_cache.lock);
+
+    if (Vcb->options.adaptive_level) {
+        bcs->zlib_level = Vcb->calcthreads.zlib_level.level;
+        bcs->zstd_level = Vcb->calcthreads.zstd_level.level;
+    } else {
+        bcs->zlib_level = Vcb->options.zlib_level;
+        bcs->zstd_level = Vcb->options.zstd_level;
+    }
+
+    *retlen = sizeof(btrfs_compression_stats);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS get_csum_info(device_extension* Vcb, PFILE_OBJECT FileObject, btrfs_csum_info* buf, ULONG buflen,
                               ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     NTSTATUS Status;
@@ -5919,6 +6140,32 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type) {
                                    Irp->RequestorMode);
             break;
 
+        case FSCTL_BTRFS_ESTIMATE_BALANCE:
+            Status = estimate_balance(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength,
+                                      Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.OutputBufferLength,
+                                      &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_MOUNT_TIMES:
+            Status = get_mount_times(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                     IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_ENCODED_WRITE:
+            Status = encoded_write(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                   IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
+            break;
+
+        case FSCTL_BTRFS_GET_SEND_STATS:
+            Status = get_send_stats(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                    IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
+        case FSCTL_BTRFS_GET_COMPRESSION_STATS:
+            Status = get_compression_stats(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer,
+                                           IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information);
+            break;
+
         default:
             WARN("unknown control code %lx (DeviceType = %lx, Access = %lx, Function = %lx, Method = %lx)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
@@ -57,6 +57,26 @@ typedef struct {
     uint8_t* va;
 } read_data_context;
 
+// A read_data that's been sent to the disks, but not yet waited for or checked.
+typedef struct {
+    read_data_context context;
+    CHUNK_ITEM* ci;
+    chunk* c;
+    device** devices;
+    uint64_t type;
+    uint64_t offset;
+    uint64_t generation;
+    uint8_t* buf;
+    bool file_read;
+    bool need_to_wait;
+    uint16_t missing_devices;
+    uint64_t total_reading;
+    uint64_t lockaddr;
+    uint64_t locklen;
+    uint8_t* dummypage;
+    PMDL dummy_mdl;
+} read_data_op;
+
 extern bool diskacc;
 extern tPsUpdateDiskCounters fPsUpdateDiskCounters;
 extern tCcCopyReadEx fCcCopyReadEx;
@@ -1475,20 +1495,47 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
     return STATUS_SUCCESS;
 }
 
-NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
-                   _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
-                   _In_ ULONG priority) {
+static void read_data_free(device_extension* Vcb, read_data_op* op) {
+    read_data_context* context = &op->context;
+    uint16_t i;
+
+    if (op->c && (op->type == BLOCK_FLAG_RAID5 || op->type == BLOCK_FLAG_RAID6))
+        chunk_unlock_range(Vcb, op->c, op->lockaddr, op->locklen);
+
+    if (op->dummy_mdl)
+        IoFreeMdl(op->dummy_mdl);
+
+    if (op->dummypage)
+        ExFreePool(op->dummypage);
+
+    for (i = 0; i < op->ci->num_stripes; i++) {
+        if (context->stripes[i].mdl) {
+            if (context->stripes[i].mdl->MdlFlags & MDL_PAGES_LOCKED)
+                MmUnlockPages(context->stripes[i].mdl);
+
+            IoFreeMdl(context->stripes[i].mdl);
+        }
+
+        if (context->stripes[i].Irp)
+            IoFreeIrp(context->stripes[i].Irp);
+    }
+
+    ExFreePool(context->stripes);
+
+    if (!Vcb->log_to_phys_loaded)
+        ExFreePool(op->devices);
+}
+
+static NTSTATUS read_data_start(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
+                                _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation,
+                                _In_ bool file_read, _In_ ULONG priority, _Out_ read_data_op* op) {
     CHUNK_ITEM* ci;
     CHUNK_ITEM_STRIPE* cis;
-    read_data_context context;
-    uint64_t type, offset, total_reading = 0;
+    read_data_context* context = &op->context;
+    uint64_t type, offset;
     NTSTATUS Status;
     device** devices = NULL;
-    uint16_t i, startoffstripe, allowed_missing, missing_devices = 0;
-    uint8_t* dummypage = NULL;
-    PMDL dummy_mdl = NULL;
-    bool need_to_wait;
-    uint64_t lockaddr, locklen;
+    uint16_t i, startoffstripe, allowed_missing;
 
     if (Vcb->log_to_phys_loaded) {
         if (!c) {
@@ -1580,29 +1627,38 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
     cis = (CHUNK_ITEM_STRIPE*)&ci[1];
 
-    RtlZeroMemory(&context, sizeof(read_data_context));
-    KeInitializeEvent(&context.Event, NotificationEvent, false);
+    RtlZeroMemory(op, sizeof(read_data_op));
+    KeInitializeEvent(&context->Event, NotificationEvent, false);
 
-    context.stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_stripe) * ci->num_stripes, ALLOC_TAG);
-    if (!context.stripes) {
+    op->ci = ci;
+    op->c = c;
+    op->devices = devices;
+    op->type = type;
+    op->offset = offset;
+    op->buf = buf;
+    op->generation = generation;
+    op->file_read = file_read;
+
+    context->stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_stripe) * ci->num_stripes, ALLOC_TAG);
+    if (!context->stripes) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     if (c && (type == BLOCK_FLAG_RAID5 || type == BLOCK_FLAG_RAID6)) {
-        get_raid56_lock_range(c, addr, length, &lockaddr, &locklen);
-        chunk_lock_range(Vcb, c, lockaddr, locklen);
+        get_raid56_lock_range(c, addr, length, &op->lockaddr, &op->locklen);
+        chunk_lock_range(Vcb, c, op->lockaddr, op->locklen);
     }
 
-    RtlZeroMemory(context.stripes, sizeof(read_data_stripe) * ci->num_stripes);
+    RtlZeroMemory(context->stripes, sizeof(read_data_stripe) * ci->num_stripes);
 
-    context.buflen = length;
-    context.num_stripes = ci->num_stripes;
-    context.stripes_left = context.num_stripes;
-    context.sector_size = Vcb->superblock.sector_size;
-    context.csum = csum;
-    context.tree = is_tree;
-    context.type = type;
+    context->buflen = length;
+    context->num_stripes = ci->num_stripes;
+    context->stripes_left = context->num_stripes;
+    context->sector_size = Vcb->superblock.sector_size;
+    context->csum = csum;
+    context->tree = is_tree;
+    context->type = type;
 
     if (type == BLOCK_FLAG_RAID0) {
         uint64_t startoff, endoff;
@@ -1626,17 +1682,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
             // with duplicated dummy PFNs, which confuse check_csum. Ah well.
             // See https://msdn.microsoft.com/en-us/library/windows/hardware/Dn614012.aspx if you're interested.
 
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1661,23 +1717,23 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
         for (i = 0; i < ci->num_stripes; i++) {
             if (startoffstripe > i)
-                context.stripes[i].stripestart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[i].stripestart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
             else if (startoffstripe == i)
-                context.stripes[i].stripestart = startoff;
+                context->stripes[i].stripestart = startoff;
             else
-                context.stripes[i].stripestart = startoff - (startoff % ci->stripe_length);
+                context->stripes[i].stripestart = startoff - (startoff % ci->stripe_length);
 
             if (endoffstripe > i)
-                context.stripes[i].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[i].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
             else if (endoffstripe == i)
-                context.stripes[i].stripeend = endoff + 1;
+                context->stripes[i].stripeend = endoff + 1;
             else
-                context.stripes[i].stripeend = endoff - (endoff % ci->stripe_length);
+                context->stripes[i].stripeend = endoff - (endoff % ci->stripe_length);
 
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), false, false, NULL);
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -1701,10 +1757,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         pos = 0;
         stripe = startoffstripe;
         while (pos < length) {
-            PFN_NUMBER* stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+            PFN_NUMBER* stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
             if (pos == 0) {
-                uint32_t readlen = (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length));
+                uint32_t readlen = (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length));
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -1752,19 +1808,19 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        context.firstoff = (uint16_t)((startoff % ci->stripe_length) >> Vcb->sector_shift);
-        context.startoffstripe = startoffstripe;
-        context.sectors_per_stripe = (uint16_t)(ci->stripe_length >> Vcb->sector_shift);
+        context->firstoff = (uint16_t)((startoff % ci->stripe_length) >> Vcb->sector_shift);
+        context->startoffstripe = startoffstripe;
+        context->sectors_per_stripe = (uint16_t)(ci->stripe_length >> Vcb->sector_shift);
 
         startoffstripe *= ci->sub_stripes;
         endoffstripe *= ci->sub_stripes;
@@ -1772,7 +1828,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         if (c)
             c->last_stripe = (orig_ls + 1) % ci->sub_stripes;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1826,14 +1882,14 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
             for (j = 0; j < ci->sub_stripes; j++) {
                 if (j == orig_ls && devices[i+j] && devices[i+j]->devobj) {
-                    context.stripes[i+j].stripestart = sstart;
-                    context.stripes[i+j].stripeend = send;
-                    stripes[i / ci->sub_stripes] = &context.stripes[i+j];
+                    context->stripes[i+j].stripestart = sstart;
+                    context->stripes[i+j].stripeend = send;
+                    stripes[i / ci->sub_stripes] = &context->stripes[i+j];
 
                     if (sstart != send) {
-                        context.stripes[i+j].mdl = IoAllocateMdl(context.va, (ULONG)(send - sstart), false, false, NULL);
+                        context->stripes[i+j].mdl = IoAllocateMdl(context->va, (ULONG)(send - sstart), false, false, NULL);
 
-                        if (!context.stripes[i+j].mdl) {
+                        if (!context->stripes[i+j].mdl) {
                             ERR("IoAllocateMdl failed\n");
                             MmUnlockPages(master_mdl);
                             IoFreeMdl(master_mdl);
@@ -1844,21 +1900,21 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
                     stripeset = true;
                 } else
-                    context.stripes[i+j].status = ReadDataStatus_Skip;
+                    context->stripes[i+j].status = ReadDataStatus_Skip;
             }
 
             if (!stripeset) {
                 for (j = 0; j < ci->sub_stripes; j++) {
                     if (devices[i+j] && devices[i+j]->devobj) {
-                        context.stripes[i+j].stripestart = sstart;
-                        context.stripes[i+j].stripeend = send;
-                        context.stripes[i+j].status = ReadDataStatus_Pending;
-                        stripes[i / ci->sub_stripes] = &context.stripes[i+j];
+                        context->stripes[i+j].stripestart = sstart;
+                        context->stripes[i+j].stripeend = send;
+                        context->stripes[i+j].status = ReadDataStatus_Pending;
+                        stripes[i / ci->sub_stripes] = &context->stripes[i+j];
 
                         if (sstart != send) {
-                            context.stripes[i+j].mdl = IoAllocateMdl(context.va, (ULONG)(send - sstart), false, false, NULL);
+                            context->stripes[i+j].mdl = IoAllocateMdl(context->va, (ULONG)(send - sstart), false, false, NULL);
 
-                            if (!context.stripes[i+j].mdl) {
+                            if (!context->stripes[i+j].mdl) {
                                 ERR("IoAllocateMdl failed\n");
                                 MmUnlockPages(master_mdl);
                                 IoFreeMdl(master_mdl);
@@ -1944,30 +2000,30 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         if (c)
             c->last_stripe = (i + 1) % ci->num_stripes;
 
-        context.stripes[i].stripestart = addr - offset;
-        context.stripes[i].stripeend = context.stripes[i].stripestart + length;
+        context->stripes[i].stripestart = addr - offset;
+        context->stripes[i].stripeend = context->stripes[i].stripestart + length;
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
 
-            context.stripes[i].mdl = IoAllocateMdl(context.va, length, false, false, NULL);
-            if (!context.stripes[i].mdl) {
+            context->stripes[i].mdl = IoAllocateMdl(context->va, length, false, false, NULL);
+            if (!context->stripes[i].mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(context.stripes[i].mdl);
+            MmBuildMdlForNonPagedPool(context->stripes[i].mdl);
         } else {
-            context.stripes[i].mdl = IoAllocateMdl(buf, length, false, false, NULL);
+            context->stripes[i].mdl = IoAllocateMdl(buf, length, false, false, NULL);
 
-            if (!context.stripes[i].mdl) {
+            if (!context->stripes[i].mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
@@ -1976,7 +2032,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
             Status = STATUS_SUCCESS;
 
             try {
-                MmProbeAndLockPages(context.stripes[i].mdl, KernelMode, IoWriteAccess);
+                MmProbeAndLockPages(context->stripes[i].mdl, KernelMode, IoWriteAccess);
             } except (EXCEPTION_EXECUTE_HANDLER) {
                 Status = GetExceptionCode();
             }
@@ -1998,17 +2054,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         get_raid0_offset(addr + length - offset - 1, ci->stripe_length, ci->num_stripes - 1, &endoff, &endoffstripe);
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2044,8 +2100,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     if (i == startoffstripe) {
                         readlen = min(length, (ULONG)(ci->stripe_length - (startoff % ci->stripe_length)));
 
-                        context.stripes[stripe].stripestart = startoff;
-                        context.stripes[stripe].stripeend = startoff + readlen;
+                        context->stripes[stripe].stripestart = startoff;
+                        context->stripes[stripe].stripeend = startoff + readlen;
 
                         pos += readlen;
 
@@ -2054,8 +2110,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     } else {
                         readlen = min(length - pos, (ULONG)ci->stripe_length);
 
-                        context.stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
-                        context.stripes[stripe].stripeend = context.stripes[stripe].stripestart + readlen;
+                        context->stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
+                        context->stripes[stripe].stripeend = context->stripes[stripe].stripestart + readlen;
 
                         pos += readlen;
 
@@ -2073,16 +2129,16 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 for (i = 0; i < startoffstripe; i++) {
                     uint16_t stripe2 = (parity + i + 1) % ci->num_stripes;
 
-                    context.stripes[stripe2].stripestart = context.stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                    context->stripes[stripe2].stripestart = context->stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
                 }
 
-                context.stripes[parity].stripestart = context.stripes[parity].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity].stripestart = context->stripes[parity].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 if (length - pos > ci->num_stripes * (ci->num_stripes - 1) * ci->stripe_length) {
                     skip = (ULONG)(((length - pos) / (ci->num_stripes * (ci->num_stripes - 1) * ci->stripe_length)) - 1);
 
                     for (i = 0; i < ci->num_stripes; i++) {
-                        context.stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
+                        context->stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
                     }
 
                     pos += (uint32_t)(skip * (ci->num_stripes - 1) * ci->num_stripes * ci->stripe_length);
@@ -2090,7 +2146,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 }
             } else if (length - pos >= ci->stripe_length * (ci->num_stripes - 1)) {
                 for (i = 0; i < ci->num_stripes; i++) {
-                    context.stripes[i].stripeend += ci->stripe_length;
+                    context->stripes[i].stripeend += ci->stripe_length;
                 }
 
                 pos += (uint32_t)(ci->stripe_length * (ci->num_stripes - 1));
@@ -2101,10 +2157,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 i = 0;
                 while (stripe != parity) {
                     if (endoffstripe == i) {
-                        context.stripes[stripe].stripeend = endoff + 1;
+                        context->stripes[stripe].stripeend = endoff + 1;
                         break;
                     } else if (endoffstripe > i)
-                        context.stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                        context->stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
 
                     i++;
                     stripe = (stripe + 1) % ci->num_stripes;
@@ -2115,11 +2171,11 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         for (i = 0; i < ci->num_stripes; i++) {
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart),
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart),
                                                        false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -2130,8 +2186,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            op->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!op->dummypage) {
                 ERR("out of memory\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2139,8 +2195,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, false, false, NULL);
-            if (!dummy_mdl) {
+            op->dummy_mdl = IoAllocateMdl(op->dummypage, PAGE_SIZE, false, false, NULL);
+            if (!op->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2148,9 +2204,9 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(op->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(op->dummy_mdl + 1);
         }
 
         stripeoff = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint32_t) * ci->num_stripes, ALLOC_TAG);
@@ -2173,10 +2229,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
             if (pos == 0) {
                 uint16_t stripe = (parity + startoffstripe + 1) % ci->num_stripes;
-                uint32_t readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart,
-                                                       ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length)));
+                uint32_t readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart,
+                                                       ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length)));
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -2186,8 +2242,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 stripe = (stripe + 1) % ci->num_stripes;
 
                 while (stripe != parity) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2204,7 +2260,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 ULONG k;
 
                 while (stripe != parity) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                     RtlCopyMemory(&stripe_pfns[stripeoff[stripe] >> PAGE_SHIFT], &pfns[pos >> PAGE_SHIFT], (ULONG)(ci->stripe_length * sizeof(PFN_NUMBER) >> PAGE_SHIFT));
 
@@ -2214,7 +2270,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     stripe = (stripe + 1) % ci->num_stripes;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity] >> PAGE_SHIFT] = dummy;
@@ -2225,8 +2281,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 uint32_t readlen;
 
                 while (pos < length) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = min(length - pos, (ULONG)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = min(length - pos, (ULONG)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2257,17 +2313,17 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         get_raid0_offset(addr + length - offset - 1, ci->stripe_length, ci->num_stripes - 2, &endoff, &endoffstripe);
 
         if (file_read) {
-            context.va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            context->va = ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
 
-            if (!context.va) {
+            if (!context->va) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto exit;
             }
         } else
-            context.va = buf;
+            context->va = buf;
 
-        master_mdl = IoAllocateMdl(context.va, length, false, false, NULL);
+        master_mdl = IoAllocateMdl(context->va, length, false, false, NULL);
         if (!master_mdl) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2303,8 +2359,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     if (i == startoffstripe) {
                         readlen = (ULONG)min(length, ci->stripe_length - (startoff % ci->stripe_length));
 
-                        context.stripes[stripe].stripestart = startoff;
-                        context.stripes[stripe].stripeend = startoff + readlen;
+                        context->stripes[stripe].stripestart = startoff;
+                        context->stripes[stripe].stripeend = startoff + readlen;
 
                         pos += readlen;
 
@@ -2313,8 +2369,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     } else {
                         readlen = min(length - pos, (ULONG)ci->stripe_length);
 
-                        context.stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
-                        context.stripes[stripe].stripeend = context.stripes[stripe].stripestart + readlen;
+                        context->stripes[stripe].stripestart = startoff - (startoff % ci->stripe_length);
+                        context->stripes[stripe].stripeend = context->stripes[stripe].stripestart + readlen;
 
                         pos += readlen;
 
@@ -2332,19 +2388,19 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 for (i = 0; i < startoffstripe; i++) {
                     uint16_t stripe2 = (parity1 + i + 2) % ci->num_stripes;
 
-                    context.stripes[stripe2].stripestart = context.stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                    context->stripes[stripe2].stripestart = context->stripes[stripe2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
                 }
 
-                context.stripes[parity1].stripestart = context.stripes[parity1].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity1].stripestart = context->stripes[parity1].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 parity2 = (parity1 + 1) % ci->num_stripes;
-                context.stripes[parity2].stripestart = context.stripes[parity2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
+                context->stripes[parity2].stripestart = context->stripes[parity2].stripeend = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
 
                 if (length - pos > ci->num_stripes * (ci->num_stripes - 2) * ci->stripe_length) {
                     skip = (ULONG)(((length - pos) / (ci->num_stripes * (ci->num_stripes - 2) * ci->stripe_length)) - 1);
 
                     for (i = 0; i < ci->num_stripes; i++) {
-                        context.stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
+                        context->stripes[i].stripeend += skip * ci->num_stripes * ci->stripe_length;
                     }
 
                     pos += (uint32_t)(skip * (ci->num_stripes - 2) * ci->num_stripes * ci->stripe_length);
@@ -2352,7 +2408,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 }
             } else if (length - pos >= ci->stripe_length * (ci->num_stripes - 2)) {
                 for (i = 0; i < ci->num_stripes; i++) {
-                    context.stripes[i].stripeend += ci->stripe_length;
+                    context->stripes[i].stripeend += ci->stripe_length;
                 }
 
                 pos += (uint32_t)(ci->stripe_length * (ci->num_stripes - 2));
@@ -2363,10 +2419,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 i = 0;
                 while (stripe != parity1) {
                     if (endoffstripe == i) {
-                        context.stripes[stripe].stripeend = endoff + 1;
+                        context->stripes[stripe].stripeend = endoff + 1;
                         break;
                     } else if (endoffstripe > i)
-                        context.stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
+                        context->stripes[stripe].stripeend = endoff - (endoff % ci->stripe_length) + ci->stripe_length;
 
                     i++;
                     stripe = (stripe + 1) % ci->num_stripes;
@@ -2377,10 +2433,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         for (i = 0; i < ci->num_stripes; i++) {
-            if (context.stripes[i].stripestart != context.stripes[i].stripeend) {
-                context.stripes[i].mdl = IoAllocateMdl(context.va, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), false, false, NULL);
+            if (context->stripes[i].stripestart != context->stripes[i].stripeend) {
+                context->stripes[i].mdl = IoAllocateMdl(context->va, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), false, false, NULL);
 
-                if (!context.stripes[i].mdl) {
+                if (!context->stripes[i].mdl) {
                     ERR("IoAllocateMdl failed\n");
                     MmUnlockPages(master_mdl);
                     IoFreeMdl(master_mdl);
@@ -2391,8 +2447,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         }
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            op->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!op->dummypage) {
                 ERR("out of memory\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2400,8 +2456,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, false, false, NULL);
-            if (!dummy_mdl) {
+            op->dummy_mdl = IoAllocateMdl(op->dummypage, PAGE_SIZE, false, false, NULL);
+            if (!op->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 MmUnlockPages(master_mdl);
                 IoFreeMdl(master_mdl);
@@ -2409,9 +2465,9 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 goto exit;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(op->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(op->dummy_mdl + 1);
         }
 
         stripeoff = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint32_t) * ci->num_stripes, ALLOC_TAG);
@@ -2434,10 +2490,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
 
             if (pos == 0) {
                 uint16_t stripe = (parity1 + startoffstripe + 2) % ci->num_stripes;
-                uint32_t readlen = min(length - pos, (uint32_t)min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart,
-                                                       ci->stripe_length - (context.stripes[stripe].stripestart % ci->stripe_length)));
+                uint32_t readlen = min(length - pos, (uint32_t)min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart,
+                                                       ci->stripe_length - (context->stripes[stripe].stripestart % ci->stripe_length)));
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                 RtlCopyMemory(stripe_pfns, pfns, readlen * sizeof(PFN_NUMBER) >> PAGE_SHIFT);
 
@@ -2447,8 +2503,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 stripe = (stripe + 1) % ci->num_stripes;
 
                 while (stripe != parity1) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = (uint32_t)min(length - pos, min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = (uint32_t)min(length - pos, min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2466,7 +2522,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 ULONG k;
 
                 while (stripe != parity1) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
 
                     RtlCopyMemory(&stripe_pfns[stripeoff[stripe] >> PAGE_SHIFT], &pfns[pos >> PAGE_SHIFT], (ULONG)(ci->stripe_length * sizeof(PFN_NUMBER) >> PAGE_SHIFT));
 
@@ -2476,14 +2532,14 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                     stripe = (stripe + 1) % ci->num_stripes;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity1].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity1].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity1] >> PAGE_SHIFT] = dummy;
                     stripeoff[parity1] += PAGE_SIZE;
                 }
 
-                stripe_pfns = (PFN_NUMBER*)(context.stripes[parity2].mdl + 1);
+                stripe_pfns = (PFN_NUMBER*)(context->stripes[parity2].mdl + 1);
 
                 for (k = 0; k < ci->stripe_length >> PAGE_SHIFT; k++) {
                     stripe_pfns[stripeoff[parity2] >> PAGE_SHIFT] = dummy;
@@ -2494,8 +2550,8 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
                 uint32_t readlen;
 
                 while (pos < length) {
-                    stripe_pfns = (PFN_NUMBER*)(context.stripes[stripe].mdl + 1);
-                    readlen = (uint32_t)min(length - pos, min(context.stripes[stripe].stripeend - context.stripes[stripe].stripestart, ci->stripe_length));
+                    stripe_pfns = (PFN_NUMBER*)(context->stripes[stripe].mdl + 1);
+                    readlen = (uint32_t)min(length - pos, min(context->stripes[stripe].stripeend - context->stripes[stripe].stripestart, ci->stripe_length));
 
                     if (readlen == 0)
                         break;
@@ -2516,20 +2572,20 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
         ExFreePool(stripeoff);
     }
 
-    context.address = addr;
+    context->address = addr;
 
     for (i = 0; i < ci->num_stripes; i++) {
-        if (!devices[i] || !devices[i]->devobj || context.stripes[i].stripestart == context.stripes[i].stripeend) {
-            context.stripes[i].status = ReadDataStatus_MissingDevice;
-            context.stripes_left--;
+        if (!devices[i] || !devices[i]->devobj || context->stripes[i].stripestart == context->stripes[i].stripeend) {
+            context->stripes[i].status = ReadDataStatus_MissingDevice;
+            context->stripes_left--;
 
             if (!devices[i] || !devices[i]->devobj)
-                missing_devices++;
+                op->missing_devices++;
         }
     }
 
-    if (missing_devices > allowed_missing) {
-        ERR("not enough devices to service request (%u missing)\n", missing_devices);
+    if (op->missing_devices > allowed_missing) {
+        ERR("not enough devices to service request (%u missing)\n", op->missing_devices);
         Status = STATUS_UNEXPECTED_IO_ERROR;
         goto exit;
     }
@@ -2537,194 +2593,203 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t
     for (i = 0; i < ci->num_stripes; i++) {
         PIO_STACK_LOCATION IrpSp;
 
-        if (devices[i] && devices[i]->devobj && context.stripes[i].stripestart != context.stripes[i].stripeend && context.stripes[i].status != ReadDataStatus_Skip) {
-            context.stripes[i].context = (struct read_data_context*)&context;
+        if (devices[i] && devices[i]->devobj && context->stripes[i].stripestart != context->stripes[i].stripeend && context->stripes[i].status != ReadDataStatus_Skip) {
+            context->stripes[i].context = (struct read_data_context*)context;
 
             if (type == BLOCK_FLAG_RAID10) {
-                context.stripes[i].stripenum = i / ci->sub_stripes;
+                context->stripes[i].stripenum = i / ci->sub_stripes;
             }
 
             if (!Irp) {
-                context.stripes[i].Irp = IoAllocateIrp(devices[i]->devobj->StackSize, false);
+                context->stripes[i].Irp = IoAllocateIrp(devices[i]->devobj->StackSize, false);
 
-                if (!context.stripes[i].Irp) {
+                if (!context->stripes[i].Irp) {
                     ERR("IoAllocateIrp failed\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
             } else {
-                context.stripes[i].Irp = IoMakeAssociatedIrp(Irp, devices[i]->devobj->StackSize);
+                context->stripes[i].Irp = IoMakeAssociatedIrp(Irp, devices[i]->devobj->StackSize);
 
-                if (!context.stripes[i].Irp) {
+                if (!context->stripes[i].Irp) {
                     ERR("IoMakeAssociatedIrp failed\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
             }
 
-            IrpSp = IoGetNextIrpStackLocation(context.stripes[i].Irp);
+            IrpSp = IoGetNextIrpStackLocation(context->stripes[i].Irp);
             IrpSp->MajorFunction = IRP_MJ_READ;
             IrpSp->MinorFunction = IRP_MN_NORMAL;
             IrpSp->FileObject = devices[i]->fileobj;
 
             if (devices[i]->devobj->Flags & DO_BUFFERED_IO) {
-                context.stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart), ALLOC_TAG);
-                if (!context.stripes[i].Irp->AssociatedIrp.SystemBuffer) {
+                context->stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart), ALLOC_TAG);
+                if (!context->stripes[i].Irp->AssociatedIrp.SystemBuffer) {
                     ERR("out of memory\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
                 }
 
-                context.stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
+                context->stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
 
-                context.stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context.stripes[i].mdl, priority);
+                context->stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context->stripes[i].mdl, priority);
             } else if (devices[i]->devobj->Flags & DO_DIRECT_IO)
-                context.stripes[i].Irp->MdlAddress = context.stripes[i].mdl;
+                context->stripes[i].Irp->MdlAddress = context->stripes[i].mdl;
             else
-                context.stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context.stripes[i].mdl, priority);
+                context->stripes[i].Irp->UserBuffer = MmGetSystemAddressForMdlSafe(context->stripes[i].mdl, priority);
 
-            IrpSp->Parameters.Read.Length = (ULONG)(context.stripes[i].stripeend - context.stripes[i].stripestart);
-            IrpSp->Parameters.Read.ByteOffset.QuadPart = context.stripes[i].stripestart + cis[i].offset;
+            IrpSp->Parameters.Read.Length = (ULONG)(context->stripes[i].stripeend - context->stripes[i].stripestart);
+            IrpSp->Parameters.Read.ByteOffset.QuadPart = context->stripes[i].stripestart + cis[i].offset;
 
-            total_reading += IrpSp->Parameters.Read.Length;
+            op->total_reading += IrpSp->Parameters.Read.Length;
 
-            context.stripes[i].Irp->UserIosb = &context.stripes[i].iosb;
+            context->stripes[i].Irp->UserIosb = &context->stripes[i].iosb;
 
-            IoSetCompletionRoutine(context.stripes[i].Irp, read_data_completion, &context.stripes[i], true, true, true);
+            IoSetCompletionRoutine(context->stripes[i].Irp, read_data_completion, &context->stripes[i], true, true, true);
 
-            context.stripes[i].status = ReadDataStatus_Pending;
+            context->stripes[i].status = ReadDataStatus_Pending;
         }
     }
 
-    need_to_wait = false;
+    op->need_to_wait = false;
     for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].status != ReadDataStatus_MissingDevice && context.stripes[i].status != ReadDataStatus_Skip) {
-            IoCallDriver(devices[i]->devobj, context.stripes[i].Irp);
-            need_to_wait = true;
+        if (context->stripes[i].status != ReadDataStatus_MissingDevice && context->stripes[i].status != ReadDataStatus_Skip) {
+            IoCallDriver(devices[i]->devobj, context->stripes[i].Irp);
+            op->need_to_wait = true;
         }
     }
 
-    if (need_to_wait)
-        KeWaitForSingleObject(&context.Event, Executive, KernelMode, false, NULL);
+    return STATUS_SUCCESS;
+
+exit:
+    read_data_free(Vcb, op);
+
+    return Status;
+}
+
+static NTSTATUS read_data_finish(device_extension* Vcb, read_data_op* op) {
+    read_data_context* context = &op->context;
+    CHUNK_ITEM* ci = op->ci;
+    device** devices = op->devices;
+    chunk* c = op->c;
+    uint8_t* buf = op->buf;
+    uint64_t type = op->type, offset = op->offset, generation = op->generation, addr = context->address;
+    uint32_t length = context->buflen;
+    bool file_read = op->file_read;
+    NTSTATUS Status = STATUS_SUCCESS;
+    uint16_t i;
+
+    if (op->need_to_wait)
+        KeWaitForSingleObject(&context->Event, Executive, KernelMode, false, NULL);
 
     if (diskacc)
-        fFsRtlUpdateDiskCounters(total_reading, 0);
+        fFsRtlUpdateDiskCounters(op->total_reading, 0);
 
     // check if any of the devices return a "user-induced" error
 
     for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].status == ReadDataStatus_Error && IoIsErrorUserInduced(context.stripes[i].iosb.Status)) {
-            Status = context.stripes[i].iosb.Status;
+        if (context->stripes[i].status == ReadDataStatus_Error && IoIsErrorUserInduced(context->stripes[i].iosb.Status)) {
+            Status = context->stripes[i].iosb.Status;
             goto exit;
         }
     }
 
     if (type == BLOCK_FLAG_RAID0) {
-        Status = read_data_raid0(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, generation, offset);
+        Status = read_data_raid0(Vcb, file_read ? context->va : buf, addr, length, context, ci, devices, generation, offset);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid0 returned %08lx\n", Status);
 
             if (file_read)
-                ExFreePool(context.va);
+                ExFreePool(context->va);
 
             goto exit;
         }
 
         if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
+            RtlCopyMemory(buf, context->va, length);
+            ExFreePool(context->va);
         }
     } else if (type == BLOCK_FLAG_RAID10) {
-        Status = read_data_raid10(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, generation, offset);
+        Status = read_data_raid10(Vcb, file_read ? context->va : buf, addr, length, context, ci, devices, generation, offset);
 
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid10 returned %08lx\n", Status);
 
             if (file_read)
-                ExFreePool(context.va);
+                ExFreePool(context->va);
 
             goto exit;
         }
 
         if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
+            RtlCopyMemory(buf, context->va, length);
+            ExFreePool(context->va);
         }
     } else if (type == BLOCK_FLAG_DUPLICATE) {
-        Status = read_data_dup(Vcb, file_read ? context.va : buf, addr, &context, ci, devices, generation);
+        Status = read_data_dup(Vcb, file_read ? context->va : buf, addr, context, ci, devices, generation);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_dup returned %08lx\n", Status);
 
             if (file_read)
-                ExFreePool(context.va);
+                ExFreePool(context->va);
 
             goto exit;
         }
 
         if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
+            RtlCopyMemory(buf, context->va, length);
+            ExFreePool(context->va);
         }
     } else if (type == BLOCK_FLAG_RAID5) {
-        Status = read_data_raid5(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, offset, generation, c, missing_devices > 0 ? true : false);
+        Status = read_data_raid5(Vcb, file_read ? context->va : buf, addr, length, context, ci, devices, offset, generation, c, op->missing_devices > 0 ? true : false);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid5 returned %08lx\n", Status);
 
             if (file_read)
-                ExFreePool(context.va);
+                ExFreePool(context->va);
 
             goto exit;
         }
 
         if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
+            RtlCopyMemory(buf, context->va, length);
+            ExFreePool(context->va);
         }
     } else if (type == BLOCK_FLAG_RAID6) {
-        Status = read_data_raid6(Vcb, file_read ? context.va : buf, addr, length, &context, ci, devices, offset, generation, c, missing_devices > 0 ? true : false);
+        Status = read_data_raid6(Vcb, file_read ? context->va : buf, addr, length, context, ci, devices, offset, generation, c, op->missing_devices > 0 ? true : false);
         if (!NT_SUCCESS(Status)) {
             ERR("read_data_raid6 returned %08lx\n", Status);
 
             if (file_read)
-                ExFreePool(context.va);
+                ExFreePool(context->va);
 
             goto exit;
         }
 
         if (file_read) {
-            RtlCopyMemory(buf, context.va, length);
-            ExFreePool(context.va);
+            RtlCopyMemory(buf, context->va, length);
+            ExFreePool(context->va);
         }
     }
 
 exit:
-    if (c && (type == BLOCK_FLAG_RAID5 || type == BLOCK_FLAG_RAID6))
-        chunk_unlock_range(Vcb, c, lockaddr, locklen);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
+    read_data_free(Vcb, op);
 
-    if (dummypage)
-        ExFreePool(dummypage);
-
-    for (i = 0; i < ci->num_stripes; i++) {
-        if (context.stripes[i].mdl) {
-            if (context.stripes[i].mdl->MdlFlags & MDL_PAGES_LOCKED)
-                MmUnlockPages(context.stripes[i].mdl);
-
-            IoFreeMdl(context.stripes[i].mdl);
-        }
-
-        if (context.stripes[i].Irp)
-            IoFreeIrp(context.stripes[i].Irp);
-    }
+    return Status;
+}
 
-    ExFreePool(context.stripes);
+NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) void* csum,
+                   _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
+                   _In_ ULONG priority) {
+    NTSTATUS Status;
+    read_data_op op;
 
-    if (!Vcb->log_to_phys_loaded)
-        ExFreePool(devices);
+    Status = read_data_start(Vcb, addr, length, csum, is_tree, buf, c, pc, Irp, generation, file_read, priority, &op);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-    return Status;
+    return read_data_finish(Vcb, &op);
 }
 
 __attribute__((nonnull(1, 2)))
@@ -2763,6 +2828,10 @@ typedef struct {
     uint64_t ed_size;
     uint64_t ed_offset;
     uint64_t ed_num_bytes;
+    uint64_t ed_decoded_size;
+    uint64_t address;
+    uint64_t generation;
+    bool cache; // decompress all of it, and add it to the extent cache
 } read_part_extent;
 
 typedef struct {
@@ -2779,6 +2848,7 @@ typedef struct {
     bool mdl;
     void* data;
     uint8_t compression;
+    read_data_op* op; // if the read's been sent but not finished
     unsigned int num_extents;
     read_part_extent extents[1];
 } read_part;
@@ -2790,6 +2860,10 @@ typedef struct {
     void* data;
     unsigned int offset;
     size_t length;
+    bool cache;
+    uint64_t address;
+    uint64_t generation;
+    unsigned int decomp_len;
 } comp_calc_job;
 
 __attribute__((nonnull(1, 2)))
@@ -2800,6 +2874,8 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
     LIST_ENTRY* le;
     POOL_TYPE pool_type;
     LIST_ENTRY read_parts, calc_jobs;
+    bool direct;
+    extent* inline_ext;
 
     TRACE("(%p, %p, %I64x, %I64x, %p)\n", fcb, data, start, length, pbr);
 
@@ -2811,11 +2887,26 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
         return STATUS_END_OF_FILE;
     }
 
+    // small files are usually one inline extent, which we already have in memory
+    inline_ext = get_inline_extent(fcb);
+
+    if (inline_ext && start + length <= inline_ext->extent_data.decoded_size) {
+        RtlCopyMemory(data, &inline_ext->extent_data.data[start], (size_t)length);
+
+        if (pbr)
+            *pbr = (ULONG)length;
+
+        return STATUS_SUCCESS;
+    }
+
     InitializeListHead(&read_parts);
     InitializeListHead(&calc_jobs);
 
     pool_type = fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? NonPagedPool : PagedPool;
 
+    // see below
+    direct = !Irp || !(Irp->Flags & IRP_PAGING_IO);
+
     le = fcb->extents.Flink;
 
     last_end = start;
@@ -2920,7 +3011,7 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                                 goto exit;
                             }
                         } else if (ed->compression == BTRFS_COMPRESSION_ZSTD) {
-                            Status = zstd_decompress(ed->data, inlen, decomp, (uint32_t)(read + off));
+                            Status = zstd_decompress(ed->data, inlen, decomp, (uint32_t)(read + off), NULL);
                             if (!NT_SUCCESS(Status)) {
                                 ERR("zstd_decompress returned %08lx\n", Status);
                                 if (decomp_alloc) ExFreePool(decomp);
@@ -2948,6 +3039,25 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                 {
                     EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
                     read_part* rp;
+                    bool cache = false;
+
+                    if (ed->compression != BTRFS_COMPRESSION_NONE && !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE) &&
+                        fcb->Vcb->extent_cache.max_size > 0 && ed->decoded_size <= COMPRESSED_EXTENT_SIZE &&
+                        ed2->offset + ed2->num_bytes <= ed->decoded_size) {
+                        uint64_t off = start + bytes_read - ext->offset;
+                        uint32_t read = (uint32_t)min(len - off, length);
+
+                        if (extent_cache_read(&fcb->Vcb->extent_cache, ed2->address, ed->generation, (uint32_t)(ed2->offset + off),
+                                              data + bytes_read, read)) {
+                            bytes_read += read;
+                            length -= read;
+                            break;
+                        }
+
+                        // Only worth keeping if we're not reading all of it - large sequential
+                        // reads would just push out everything else.
+                        cache = off != 0 || read < len;
+                    }
 
                     rp = ExAllocatePoolWithTag(pool_type, sizeof(read_part), ALLOC_TAG);
                     if (!rp) {
@@ -2957,6 +3067,7 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                     }
 
                     rp->mdl = (Irp && Irp->MdlAddress) ? true : false;
+                    rp->op = NULL;
                     rp->extents[0].off = start + bytes_read - ext->offset;
                     rp->bumpoff = 0;
                     rp->num_extents = 1;
@@ -3024,6 +3135,10 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                     rp->extents[0].ed_offset = ed2->offset;
                     rp->extents[0].ed_size = ed2->size;
                     rp->extents[0].ed_num_bytes = ed2->num_bytes;
+                    rp->extents[0].ed_decoded_size = ed->decoded_size;
+                    rp->extents[0].address = ed2->address;
+                    rp->extents[0].generation = ed->generation;
+                    rp->extents[0].cache = cache;
 
                     InsertTailList(&read_parts, &rp->list_entry);
 
@@ -3121,6 +3236,7 @@ nextitem:
                 rp2->mdl = false;
                 rp2->data = last_rp->data;
                 rp2->compression = last_rp->compression;
+                rp2->op = NULL;
                 rp2->num_extents = last_rp->num_extents + 1;
 
                 RtlCopyMemory(rp2->extents, last_rp->extents, last_rp->num_extents * sizeof(read_part_extent));
@@ -3156,12 +3272,55 @@ nextitem:
         }
     }
 
+    // Send the reads of compressed extents off at once, then finish them in
+    // order, queueing each extent's decompression as soon as its data is in -
+    // so the calc threads can be working on one extent while we're still
+    // waiting for the next. Their buffers have all been allocated above
+    // anyway. Uncompressed parts are still read one at a time below, as
+    // reading into an MDL means a bounce buffer in non-paged pool the size of
+    // the part, and we don't want all of those at once.
+
+    le = read_parts.Flink;
+    while (le != &read_parts) {
+        read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
+
+        // RAID5 and RAID6 reads hold the stripe range lock until they're
+        // finished, so these have to be done one at a time below too
+        if (rp->compression != BTRFS_COMPRESSION_NONE && !(rp->c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))) {
+            rp->op = ExAllocatePoolWithTag(NonPagedPool, sizeof(read_data_op), ALLOC_TAG);
+            if (!rp->op) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
+            }
+
+            Status = read_data_start(fcb->Vcb, rp->addr, rp->to_read, rp->csum, false, rp->buf, rp->c, NULL, Irp, 0, rp->mdl,
+                                     fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority, rp->op);
+            if (!NT_SUCCESS(Status)) {
+                ERR("read_data_start returned %08lx\n", Status);
+                ExFreePool(rp->op);
+                rp->op = NULL;
+                goto exit;
+            }
+        }
+
+        le = le->Flink;
+    }
+
     le = read_parts.Flink;
     while (le != &read_parts) {
         read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
 
-        Status = read_data(fcb->Vcb, rp->addr, rp->to_read, rp->csum, false, rp->buf, rp->c, NULL, Irp, 0, rp->mdl,
-                           fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+        if (rp->op) {
+            Status = read_data_finish(fcb->Vcb, rp->op);
+
+            ExFreePool(rp->op);
+            rp->op = NULL;
+        } else {
+            Status = read_data(fcb->Vcb, rp->addr, rp->to_read, rp->csum, false, rp->buf, rp->c, NULL, Irp, 0, rp->mdl,
+                               fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+        }
+
         if (!NT_SUCCESS(Status)) {
             ERR("read_data returned %08lx\n", Status);
             goto exit;
@@ -3189,7 +3348,7 @@ nextitem:
                     inlen -= sizeof(uint32_t);
 
                     // If reading a few sectors in, skip to the interesting bit
-                    while (off2 > LZO_PAGE_SIZE) {
+                    while (off2 > LZO_PAGE_SIZE && !rp->extents[i].cache) {
                         uint32_t partlen;
 
                         if (inlen < sizeof(uint32_t))
@@ -3212,27 +3371,33 @@ nextitem:
                     inpageoff = inoff % LZO_PAGE_SIZE;
                 }
 
-                /* Previous versions of this code decompressed directly into the destination buffer,
+                /* Previous versions of this code always decompressed directly into the destination buffer,
                  * but unfortunately that can't be relied on - Windows likes to use dummy pages sometimes
-                 * when mmap-ing, which breaks the backtracking used by e.g. zstd. */
+                 * when mmap-ing, which breaks the backtracking used by e.g. zstd. That only happens with
+                 * paging I/O, so otherwise, if we want the extent from the beginning, we still do. */
 
-                if (off2 != 0)
+                if (rp->extents[i].cache)
+                    outlen = (ULONG)rp->extents[i].ed_decoded_size;
+                else if (off2 != 0)
                     outlen = off2 + min(rp->read, (uint32_t)(rp->extents[i].ed_num_bytes - rp->extents[i].off));
                 else
                     outlen = min(rp->read, (uint32_t)(rp->extents[i].ed_num_bytes - rp->extents[i].off));
 
-                decomp = ExAllocatePoolWithTag(pool_type, outlen, ALLOC_TAG);
-                if (!decomp) {
-                    ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto exit;
+                if (!direct || off2 != 0 || rp->extents[i].cache) {
+                    decomp = ExAllocatePoolWithTag(pool_type, outlen, ALLOC_TAG);
+                    if (!decomp) {
+                        ERR("out of memory\n");
+                        Status = STATUS_INSUFFICIENT_RESOURCES;
+                        goto exit;
+                    }
                 }
 
                 ccj = (comp_calc_job*)ExAllocatePoolWithTag(pool_type, sizeof(comp_calc_job), ALLOC_TAG);
                 if (!ccj) {
                     ERR("out of memory\n");
 
-                    ExFreePool(decomp);
+                    if (decomp)
+                        ExFreePool(decomp);
 
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     goto exit;
@@ -3243,13 +3408,18 @@ nextitem:
 
                 ccj->offset = off2;
                 ccj->length = (size_t)min(rp->read, rp->extents[i].ed_num_bytes - rp->extents[i].off);
+                ccj->cache = rp->extents[i].cache;
+                ccj->address = rp->extents[i].address;
+                ccj->generation = rp->extents[i].generation;
+                ccj->decomp_len = outlen;
 
-                Status = add_calc_job_decomp(fcb->Vcb, rp->compression, buf2, inlen, decomp, outlen,
+                Status = add_calc_job_decomp(fcb->Vcb, rp->compression, buf2, inlen, decomp ? decomp : rp->data, outlen,
                                              inpageoff, &ccj->cj);
                 if (!NT_SUCCESS(Status)) {
                     ERR("add_calc_job_decomp returned %08lx\n", Status);
 
-                    ExFreePool(decomp);
+                    if (decomp)
+                        ExFreePool(decomp);
                     ExFreePool(ccj);
 
                     goto exit;
@@ -3280,15 +3450,21 @@ nextitem:
     while (!IsListEmpty(&calc_jobs)) {
         comp_calc_job* ccj = CONTAINING_RECORD(RemoveTailList(&calc_jobs), comp_calc_job, list_entry);
 
-        calc_thread_main(fcb->Vcb, ccj->cj);
+        calc_thread_main(fcb->Vcb, ccj->cj, NULL);
 
         KeWaitForSingleObject(&ccj->cj->event, Executive, KernelMode, false, NULL);
 
         if (!NT_SUCCESS(ccj->cj->Status))
             Status = ccj->cj->Status;
 
-        RtlCopyMemory(ccj->data, (uint8_t*)ccj->decomp + ccj->offset, ccj->length);
-        ExFreePool(ccj->decomp);
+        if (ccj->decomp) {
+            RtlCopyMemory(ccj->data, (uint8_t*)ccj->decomp + ccj->offset, ccj->length);
+
+            if (ccj->cache && NT_SUCCESS(ccj->cj->Status))
+                extent_cache_insert(&fcb->Vcb->extent_cache, ccj->address, ccj->generation, ccj->decomp, ccj->decomp_len);
+            else
+                ExFreePool(ccj->decomp);
+        }
 
         ExFreePool(ccj);
     }
@@ -3297,18 +3473,7 @@ nextitem:
         *pbr = bytes_read;
 
 exit:
-    while (!IsListEmpty(&read_parts)) {
-        read_part* rp = CONTAINING_RECORD(RemoveHeadList(&read_parts), read_part, list_entry);
-
-        if (rp->buf_free)
-            ExFreePool(rp->buf);
-
-        if (rp->csum_free)
-            ExFreePool(rp->csum);
-
-        ExFreePool(rp);
-    }
-
+    // the calc jobs are reading from the read_parts' buffers, so have to go first
     while (!IsListEmpty(&calc_jobs)) {
         comp_calc_job* ccj = CONTAINING_RECORD(RemoveHeadList(&calc_jobs), comp_calc_job, list_entry);
 
@@ -3322,6 +3487,24 @@ exit:
         ExFreePool(ccj);
     }
 
+    while (!IsListEmpty(&read_parts)) {
+        read_part* rp = CONTAINING_RECORD(RemoveHeadList(&read_parts), read_part, list_entry);
+
+        // still in flight if we failed partway through
+        if (rp->op) {
+            read_data_finish(fcb->Vcb, rp->op);
+            ExFreePool(rp->op);
+        }
+
+        if (rp->buf_free)
+            ExFreePool(rp->buf);
+
+        if (rp->csum_free)
+            ExFreePool(rp->csum);
+
+        ExFreePool(rp);
+    }
+
     return Status;
 }
 
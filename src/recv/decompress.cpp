@@ -0,0 +1,336 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "decompress.h"
+#include "../btrfs.h"
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#define Z_SOLO
+#include "../zlib/zlib.h"
+
+#define ZSTD_STATIC_LINKING_ONLY
+#include "../zstd/lib/zstd.h"
+
+using namespace std;
+
+#define M2_MAX_OFFSET 0x0800
+#define M3_MAX_OFFSET 0x4000
+
+#define M2_MARKER 64
+#define M3_MARKER 32
+
+static void* zlib_alloc(void*, unsigned int items, unsigned int size) {
+    return calloc(items, size);
+}
+
+static void zlib_free(void*, void* ptr) {
+    free(ptr);
+}
+
+static void* zstd_alloc(void*, size_t size) {
+    return malloc(size);
+}
+
+static void zstd_free(void*, void* ptr) {
+    free(ptr);
+}
+
+static const ZSTD_customMem zstd_mem = { zstd_alloc, zstd_free, nullptr };
+
+static void zlib_decompress(const uint8_t* inbuf, size_t inlen, uint8_t* outbuf, size_t outlen) {
+    z_stream c_stream;
+    int ret;
+
+    memset(&c_stream, 0, sizeof(c_stream));
+    c_stream.zalloc = zlib_alloc;
+    c_stream.zfree = zlib_free;
+
+    ret = inflateInit(&c_stream);
+    if (ret != Z_OK)
+        throw runtime_error("inflateInit returned " + to_string(ret));
+
+    c_stream.next_in = (Bytef*)inbuf;
+    c_stream.avail_in = (uInt)inlen;
+    c_stream.next_out = outbuf;
+    c_stream.avail_out = (uInt)outlen;
+
+    do {
+        ret = inflate(&c_stream, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&c_stream);
+            throw runtime_error("inflate returned " + to_string(ret));
+        }
+    } while (c_stream.avail_out > 0 && ret != Z_STREAM_END);
+
+    inflateEnd(&c_stream);
+}
+
+static void zstd_decompress(ZSTD_DCtx* ctx, const uint8_t* inbuf, size_t inlen, uint8_t* outbuf, size_t outlen) {
+    ZSTD_inBuffer input = { inbuf, inlen, 0 };
+    ZSTD_outBuffer output = { outbuf, outlen, 0 };
+    size_t ret;
+
+    ZSTD_DCtx_reset(ctx, ZSTD_reset_session_only);
+
+    do {
+        ret = ZSTD_decompressStream(ctx, &output, &input);
+
+        if (ZSTD_isError(ret))
+            throw runtime_error(string("ZSTD_decompressStream failed: ") + ZSTD_getErrorName(ret));
+    } while (ret != 0 && output.pos < output.size && input.pos < input.size);
+}
+
+// Long lengths are a run of zero bytes, each worth 255, followed by the rest.
+static uint32_t lzo_ext_len(const uint8_t*& ip, const uint8_t* ip_end, uint32_t len) {
+    while (ip < ip_end && *ip == 0) {
+        len += 255;
+        ip++;
+    }
+
+    if (ip == ip_end)
+        throw runtime_error("LZO data truncated");
+
+    return len + *ip++;
+}
+
+// The same as do_lzo_decompress in compress.c: decodes one segment, stopping
+// if it would go beyond outlen. Returns how much it wrote.
+static size_t lzo_decompress_segment(const uint8_t* ip, size_t inlen, uint8_t* out, size_t outlen) {
+    const uint8_t* ip_end = ip + inlen;
+    uint8_t* op = out;
+    uint8_t* op_end = out + outlen;
+    uint32_t t, len, back, state;
+    size_t n;
+
+    if (ip == ip_end)
+        throw runtime_error("LZO data truncated");
+
+    t = *ip++;
+
+    if (t > 17) { // starts with a short literal run
+        len = t - 17;
+        state = min(len, (uint32_t)4);
+        goto literals;
+    }
+
+    state = 0;
+
+    while (true) {
+        if (t < 16) {
+            if (state == 0) { // literal run
+                len = t;
+
+                if (len == 0)
+                    len = lzo_ext_len(ip, ip_end, 15);
+
+                len += 3;
+                state = 4;
+                goto literals;
+            }
+
+            // M1, short matches which only make sense after literals
+            if (ip == ip_end)
+                throw runtime_error("LZO data truncated");
+
+            if (state == 4) {
+                back = (t >> 2) + (*ip++ << 2) + M2_MAX_OFFSET + 1;
+                len = 3;
+            } else {
+                back = (t >> 2) + (*ip++ << 2) + 1;
+                len = 2;
+            }
+        } else if (t >= M2_MARKER) {
+            if (ip == ip_end)
+                throw runtime_error("LZO data truncated");
+
+            back = ((t >> 2) & 7) + (*ip++ << 3) + 1;
+            len = (t >> 5) + 1;
+        } else if (t >= M3_MARKER) {
+            len = t & 31;
+
+            if (len == 0)
+                len = lzo_ext_len(ip, ip_end, 31);
+
+            len += 2;
+
+            if (ip_end - ip < 2)
+                throw runtime_error("LZO data truncated");
+
+            back = (ip[0] >> 2) + (ip[1] << 6) + 1;
+            ip += 2;
+        } else { // M4
+            len = t & 7;
+
+            if (len == 0)
+                len = lzo_ext_len(ip, ip_end, 7);
+
+            len += 2;
+
+            if (ip_end - ip < 2)
+                throw runtime_error("LZO data truncated");
+
+            back = ((t & 8) << 11) + (ip[0] >> 2) + (ip[1] << 6);
+            ip += 2;
+
+            if (back == 0) { // end of stream
+                if (len != 3)
+                    throw runtime_error("LZO data corrupt");
+
+                break;
+            }
+
+            back += M3_MAX_OFFSET;
+        }
+
+        // the low two bits of the last byte but one are how many literals follow
+        state = ip[-2] & 3;
+
+        if (back > (size_t)(op - out))
+            throw runtime_error("LZO data corrupt");
+
+        n = min((size_t)len, (size_t)(op_end - op));
+
+        // matches can overlap what they're producing, so this has to be a byte at a time
+        for (size_t i = 0; i < n; i++) {
+            op[i] = op[i - back];
+        }
+
+        op += n;
+
+        if (op == op_end)
+            break;
+
+        len = state;
+
+literals:
+        if (len > 0) {
+            n = min((size_t)len, (size_t)(op_end - op));
+
+            if (n > (size_t)(ip_end - ip))
+                throw runtime_error("LZO data truncated");
+
+            memcpy(op, ip, n);
+            op += n;
+            ip += n;
+
+            if (op == op_end)
+                break;
+        }
+
+        if (ip == ip_end)
+            throw runtime_error("LZO data truncated");
+
+        t = *ip++;
+    }
+
+    return op - out;
+}
+
+// btrfs' LZO format: the total length, then each sector compressed separately
+// with its length in front. A length never straddles a sector boundary - if
+// there's not enough room for it, it goes at the start of the next sector.
+static void lzo_decompress(const uint8_t* inbuf, size_t inlen, uint8_t* outbuf, size_t outlen, uint32_t sector_size) {
+    size_t inoff, outoff = 0;
+    uint32_t total;
+
+    if (inlen < sizeof(uint32_t))
+        throw runtime_error("LZO data truncated");
+
+    memcpy(&total, inbuf, sizeof(uint32_t));
+
+    if (total < sizeof(uint32_t) || total > inlen)
+        throw runtime_error("LZO data corrupt");
+
+    inlen = total;
+    inoff = sizeof(uint32_t);
+
+    while (inoff < inlen && outoff < outlen) {
+        uint32_t seglen;
+        size_t outseg, written;
+
+        if (sector_size - (inoff % sector_size) < sizeof(uint32_t))
+            inoff += sector_size - (inoff % sector_size);
+
+        if (inlen - inoff < sizeof(uint32_t))
+            break;
+
+        memcpy(&seglen, inbuf + inoff, sizeof(uint32_t));
+        inoff += sizeof(uint32_t);
+
+        if (seglen > inlen - inoff)
+            throw runtime_error("LZO data corrupt");
+
+        outseg = min((size_t)sector_size, outlen - outoff);
+
+        written = lzo_decompress_segment(inbuf + inoff, seglen, outbuf + outoff, outseg);
+
+        if (written < outseg)
+            memset(outbuf + outoff + written, 0, outseg - written);
+
+        inoff += seglen;
+        outoff += outseg;
+    }
+}
+
+encoded_decompressor::~encoded_decompressor() {
+    if (zctx)
+        ZSTD_freeDCtx((ZSTD_DCtx*)zctx);
+}
+
+const uint8_t* encoded_decompressor::decompress(uint32_t compression, const uint8_t* data, size_t datalen, uint64_t unencoded_len,
+                                                uint64_t unencoded_offset, uint64_t file_len) {
+    // checked separately, so that nothing can wrap round
+    if (unencoded_len > ENCODED_WRITE_MAX_LEN || unencoded_offset >= unencoded_len || file_len > unencoded_len - unencoded_offset)
+        throw runtime_error("invalid encoded write");
+
+    buf.resize((size_t)unencoded_len);
+    memset(buf.data(), 0, buf.size());
+
+    switch (compression) {
+        case BTRFS_ENCODED_IO_COMPRESSION_NONE:
+            memcpy(buf.data(), data, min(datalen, buf.size()));
+        break;
+
+        case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
+            zlib_decompress(data, datalen, buf.data(), buf.size());
+        break;
+
+        case BTRFS_ENCODED_IO_COMPRESSION_ZSTD:
+            if (!zctx) {
+                zctx = ZSTD_createDCtx_advanced(zstd_mem);
+
+                if (!zctx)
+                    throw runtime_error("ZSTD_createDCtx_advanced failed");
+            }
+
+            zstd_decompress((ZSTD_DCtx*)zctx, data, datalen, buf.data(), buf.size());
+        break;
+
+        default:
+            if (compression < BTRFS_ENCODED_IO_COMPRESSION_LZO_4K || compression > BTRFS_ENCODED_IO_COMPRESSION_LZO_64K)
+                throw runtime_error("unsupported compression type " + to_string(compression));
+
+            lzo_decompress(data, datalen, buf.data(), buf.size(), 0x1000 << (compression - BTRFS_ENCODED_IO_COMPRESSION_LZO_4K));
+        break;
+    }
+
+    return buf.data() + unencoded_offset;
+}
@@ -0,0 +1,44 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Decompression of the data in encoded writes, for when the receiving end
+// can't take it as it is - because it isn't btrfs, or because the file is
+// one that the driver won't do encoded writes to. Shared by the shell
+// extension and the Linux receiver. Throws std::runtime_error if the
+// parameters are invalid or the data is corrupt.
+
+#define ENCODED_WRITE_MAX_LEN 0x1000000 // sanity check on unencoded_len
+
+class encoded_decompressor {
+public:
+    ~encoded_decompressor();
+
+    // Returns a pointer to the file_len bytes at unencoded_offset, which stays
+    // valid until the next call.
+    const uint8_t* decompress(uint32_t compression, const uint8_t* data, size_t datalen, uint64_t unencoded_len,
+                              uint64_t unencoded_offset, uint64_t file_len);
+
+private:
+    void* zctx = nullptr; // ZSTD_DCtx, created when first needed
+    std::vector<uint8_t> buf;
+};
@@ -0,0 +1,1595 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Linux receiver for send streams, applying them to a directory. Namespace
+// operations run in stream order on the main thread, while data and inode
+// metadata are queued to worker threads sharded by path, so that writes to
+// different files proceed in parallel.
+
+#include "sendstream.h"
+#include "decompress.h"
+#include "../crc32c.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <linux/btrfs.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <exception>
+
+using namespace std;
+
+#define MAX_QUEUED_BYTES    0x10000000 // 256 MB
+#define MAX_QUEUED_OPS      4096
+#define MAX_WORKERS         64
+#define COPY_BUFFER_SIZE    0x100000
+
+// uuid and ctransid of the subvolume a directory was received from, so that
+// later incremental streams can find their parent on non-btrfs filesystems
+#define XATTR_RECEIVED "user.recvbtrfs.received"
+
+class errno_error : public runtime_error {
+public:
+    errno_error(const char* func, string_view path, int err = errno) :
+        runtime_error(string(func) + "(" + string(path) + "): " + strerror(err)) {
+    }
+};
+
+class dir_closer {
+public:
+    void operator()(DIR* dir) const {
+        closedir(dir);
+    }
+};
+
+typedef unique_ptr<DIR, dir_closer> dir_handle;
+
+class fd_handle {
+public:
+    explicit fd_handle(int fd = -1) : fd(fd) {
+    }
+
+    fd_handle(fd_handle&& other) : fd(other.fd) {
+        other.fd = -1;
+    }
+
+    fd_handle& operator=(fd_handle&& other) {
+        swap(fd, other.fd);
+        return *this;
+    }
+
+    fd_handle(const fd_handle&) = delete;
+    fd_handle& operator=(const fd_handle&) = delete;
+
+    ~fd_handle() {
+        if (fd != -1)
+            close(fd);
+    }
+
+    int get() const {
+        return fd;
+    }
+
+private:
+    int fd;
+};
+
+class linux_recv;
+class recv_worker;
+
+typedef function<void(recv_worker&)> recv_op_fn;
+
+struct recv_op {
+    string path;
+    size_t bytes;
+    uint64_t gen;
+    bool perm;
+    recv_op_fn fn;
+};
+
+class recv_worker {
+public:
+    recv_worker(linux_recv& rv);
+    ~recv_worker();
+    void push(recv_op&& op);
+    int file(const string& path);
+
+    encoded_decompressor decomp;
+
+private:
+    void run();
+
+    linux_recv& rv;
+    mutex lock;
+    condition_variable cv;
+    deque<recv_op> queue;
+    bool quit = false;
+    int fd = -1;
+    string fd_path;
+    uint64_t fd_gen = 0, cur_gen = 0;
+    thread t;
+};
+
+class linux_recv : public send_handler {
+public:
+    linux_recv(const string& dest, unsigned int num_threads, bool verbose);
+    ~linux_recv();
+    void begin(uint32_t version, bool zero_copy);
+    void end();
+    void cancel();
+    bool flush();
+    void reopen(const send_command& cmd);
+    void close_subvol();
+
+    atomic<uint64_t> bytes_written{0}, bytes_cloned{0};
+
+protected:
+    void cmd_subvol(const send_command& cmd) override;
+    void cmd_snapshot(const send_command& cmd) override;
+    void cmd_mkfile(const send_command& cmd) override;
+    void cmd_rename(const send_command& cmd) override;
+    void cmd_link(const send_command& cmd) override;
+    void cmd_unlink(const send_command& cmd) override;
+    void cmd_rmdir(const send_command& cmd) override;
+    void cmd_setxattr(const send_command& cmd) override;
+    void cmd_removexattr(const send_command& cmd) override;
+    void cmd_write(const send_command& cmd) override;
+    void cmd_clone(const send_command& cmd) override;
+    void cmd_truncate(const send_command& cmd) override;
+    void cmd_chmod(const send_command& cmd) override;
+    void cmd_chown(const send_command& cmd) override;
+    void cmd_utimes(const send_command& cmd) override;
+    void cmd_encoded_write(const send_command& cmd) override;
+    void cmd_fallocate(const send_command& cmd) override;
+
+private:
+    friend class recv_worker;
+
+    void enqueue(const string& path, size_t bytes, bool perm, recv_op_fn&& fn);
+    void finish_op(const recv_op& op);
+    void set_error(exception_ptr e);
+    void wait_for(string_view path, bool self, bool descendants, bool perm_only = false);
+    void wait_for_parent(string_view path);
+    void drain();
+    void open_subvol(const string& name);
+    string find_subvol(const BTRFS_UUID& uuid);
+    void copy_tree(const string& src, const string& dst, map<pair<dev_t, ino_t>, string>& links);
+    void encoded_write(recv_worker& w, const string& path, uint64_t offset, uint64_t file_len, uint64_t unencoded_len,
+                       uint64_t unencoded_offset, uint32_t compression, const uint8_t* data, uint32_t datalen);
+    void warn_once(atomic<bool>& flag, const char* msg);
+
+    string dest, subvol_name, subvol_path;
+    int destfd = -1, sfd = -1;
+    bool is_subvol = false, zero_copy = false, verbose;
+    BTRFS_UUID subvol_uuid;
+    uint64_t stransid = 0;
+    map<string, string> subvols; // received uuid to directory name
+
+    vector<unique_ptr<recv_worker>> workers;
+    mutex pending_lock;
+    condition_variable pending_cv;
+    unordered_map<string, unsigned int> pending, pending_perm, pending_under;
+    size_t queued_bytes = 0, queued_ops = 0;
+    exception_ptr error;
+    atomic<bool> failed{false}, cancelled{false};
+    atomic<uint64_t> gen{1};
+    atomic<bool> use_encoded_ioctl{true};
+    atomic<bool> warned_chown{false}, warned_xattr{false}, warned_received{false};
+};
+
+static void check_path(string_view path) {
+    size_t pos = 0;
+
+    if (!path.empty() && path[0] == '/')
+        throw runtime_error("absolute path " + string(path) + " in stream");
+
+    while (pos <= path.length()) {
+        auto next = path.find('/', pos);
+
+        if (next == string_view::npos)
+            next = path.length();
+
+        if (path.substr(pos, next - pos) == "..")
+            throw runtime_error("path " + string(path) + " escapes the subvolume");
+
+        pos = next + 1;
+    }
+}
+
+static string_view parent_of(string_view path) {
+    auto pos = path.rfind('/');
+
+    return pos == string_view::npos ? string_view() : path.substr(0, pos);
+}
+
+static const char* rel(const string& path) {
+    return path.empty() ? "." : path.c_str();
+}
+
+// Opens path within dirfd without following any symlinks, even in the middle
+// - the stream can create symlinks, and otherwise could use one to point a
+// later command outside the destination. openat2 needs Linux 5.6; before
+// that, we go through the path a component at a time with O_NOFOLLOW.
+static int open_beneath(int dirfd, const string& path, int flags, mode_t mode = 0) {
+    static atomic<bool> have_openat2{true};
+
+    if (have_openat2) {
+        struct open_how how;
+        int ret;
+
+        memset(&how, 0, sizeof(how));
+        how.flags = (uint64_t)(flags | O_CLOEXEC);
+        how.mode = flags & O_CREAT ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+
+        // EAGAIN means a rename raced with us
+        do {
+            ret = (int)syscall(SYS_openat2, dirfd, rel(path), &how, sizeof(how));
+        } while (ret == -1 && errno == EAGAIN);
+
+        if (ret != -1 || errno != ENOSYS)
+            return ret;
+
+        have_openat2 = false;
+    }
+
+    fd_handle dir;
+    size_t pos = 0;
+    int cur = dirfd;
+
+    // check_path has already thrown out "..", and absolute paths
+    while (true) {
+        auto next = path.find('/', pos);
+
+        if (next == string::npos)
+            break;
+
+        if (next > pos) {
+            fd_handle sub(openat(cur, path.substr(pos, next - pos).c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+
+            if (sub.get() == -1)
+                return -1;
+
+            dir = move(sub);
+            cur = dir.get();
+        }
+
+        pos = next + 1;
+    }
+
+    auto name = path.substr(pos);
+
+    return openat(cur, name.empty() ? "." : name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+// Returns the directory that path is in, opened beneath dirfd, and sets name
+// to its last component, for the *at functions.
+static fd_handle open_parent(int dirfd, const string& path, string& name) {
+    auto pos = path.rfind('/');
+    string parent;
+
+    if (path.empty()) {
+        parent = "";
+        name = ".";
+    } else if (pos == string::npos) {
+        parent = "";
+        name = path;
+    } else {
+        parent = path.substr(0, pos);
+        name = path.substr(pos + 1);
+    }
+
+    fd_handle fd(open_beneath(dirfd, parent, O_PATH | O_DIRECTORY));
+
+    if (fd.get() == -1)
+        throw errno_error("open", parent.empty() ? "." : parent);
+
+    return fd;
+}
+
+// There's no lsetxattrat, so get to the file through /proc, which means that
+// nothing before the last component is looked up again.
+static string fd_path(const fd_handle& dir, const string& name) {
+    return "/proc/self/fd/" + to_string(dir.get()) + "/" + name;
+}
+
+static void write_all(int fd, const string& path, const uint8_t* data, size_t len, uint64_t off) {
+    while (len > 0) {
+        auto ret = pwrite(fd, data, len, (off_t)off);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw errno_error("pwrite", path);
+        }
+
+        data += ret;
+        len -= (size_t)ret;
+        off += (uint64_t)ret;
+    }
+}
+
+// reflink if we can, otherwise let the kernel copy, otherwise do it ourselves
+static void copy_range(int src, int dst, const string& path, uint64_t src_off, uint64_t dst_off, uint64_t len) {
+    struct file_clone_range fcr;
+
+    fcr.src_fd = src;
+    fcr.src_offset = src_off;
+    fcr.src_length = len;
+    fcr.dest_offset = dst_off;
+
+    if (ioctl(dst, FICLONERANGE, &fcr) == 0)
+        return;
+
+    while (len > 0) {
+        loff_t so = (loff_t)src_off, dof = (loff_t)dst_off;
+        auto ret = copy_file_range(src, &so, dst, &dof, len, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)
+                break;
+
+            throw errno_error("copy_file_range", path);
+        }
+
+        if (ret == 0) // source is short - treat as a hole
+            return;
+
+        src_off += (uint64_t)ret;
+        dst_off += (uint64_t)ret;
+        len -= (uint64_t)ret;
+    }
+
+    if (len == 0)
+        return;
+
+    vector<uint8_t> buf((size_t)min(len, (uint64_t)COPY_BUFFER_SIZE));
+
+    while (len > 0) {
+        auto ret = pread(src, buf.data(), (size_t)min(len, (uint64_t)buf.size()), (off_t)src_off);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw errno_error("pread", path);
+        }
+
+        if (ret == 0)
+            return;
+
+        write_all(dst, path, buf.data(), (size_t)ret, dst_off);
+
+        src_off += (uint64_t)ret;
+        dst_off += (uint64_t)ret;
+        len -= (uint64_t)ret;
+    }
+}
+
+recv_worker::recv_worker(linux_recv& rv) : rv(rv), t(&recv_worker::run, this) {
+}
+
+recv_worker::~recv_worker() {
+    {
+        lock_guard<mutex> l(lock);
+        quit = true;
+    }
+
+    cv.notify_one();
+    t.join();
+
+    if (fd != -1)
+        close(fd);
+}
+
+void recv_worker::push(recv_op&& op) {
+    {
+        lock_guard<mutex> l(lock);
+        queue.emplace_back(move(op));
+    }
+
+    cv.notify_one();
+}
+
+void recv_worker::run() {
+    while (true) {
+        recv_op op;
+
+        {
+            unique_lock<mutex> l(lock);
+
+            cv.wait(l, [&]() { return quit || !queue.empty(); });
+
+            if (queue.empty())
+                break;
+
+            op = move(queue.front());
+            queue.pop_front();
+        }
+
+        if (!rv.failed && !rv.cancelled) {
+            try {
+                cur_gen = op.gen;
+                op.fn(*this);
+            } catch (...) {
+                rv.set_error(current_exception());
+            }
+        }
+
+        rv.finish_op(op);
+    }
+}
+
+// Paths can only change meaning through namespace operations, which bump the
+// generation, so a cached fd is good for as long as the generation matches.
+int recv_worker::file(const string& path) {
+    if (fd != -1 && fd_gen == cur_gen && fd_path == path)
+        return fd;
+
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    fd = open_beneath(rv.sfd, path, O_WRONLY);
+    if (fd == -1)
+        throw errno_error("open", path);
+
+    fd_path = path;
+    fd_gen = cur_gen;
+
+    return fd;
+}
+
+linux_recv::linux_recv(const string& dest, unsigned int num_threads, bool verbose) : dest(dest), verbose(verbose) {
+    destfd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (destfd == -1)
+        throw errno_error("open", dest);
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers.emplace_back(make_unique<recv_worker>(*this));
+    }
+}
+
+linux_recv::~linux_recv() {
+    workers.clear();
+
+    if (sfd != -1)
+        close(sfd);
+
+    close(destfd);
+}
+
+void linux_recv::set_error(exception_ptr e) {
+    {
+        lock_guard<mutex> l(pending_lock);
+
+        if (!error)
+            error = e;
+    }
+
+    failed = true;
+    pending_cv.notify_all();
+}
+
+void linux_recv::enqueue(const string& path, size_t bytes, bool perm, recv_op_fn&& fn) {
+    {
+        unique_lock<mutex> l(pending_lock);
+
+        pending_cv.wait(l, [&]() {
+            return failed || (queued_bytes < MAX_QUEUED_BYTES && queued_ops < MAX_QUEUED_OPS);
+        });
+
+        if (failed)
+            rethrow_exception(error);
+
+        pending[path]++;
+
+        if (perm)
+            pending_perm[path]++;
+
+        for (auto p = string_view(path); !p.empty(); ) {
+            p = parent_of(p);
+            pending_under[string(p)]++;
+        }
+
+        queued_bytes += bytes;
+        queued_ops++;
+    }
+
+    auto& w = workers[hash<string>()(path) % workers.size()];
+
+    w->push({ path, bytes, gen, perm, move(fn) });
+}
+
+void linux_recv::finish_op(const recv_op& op) {
+    {
+        lock_guard<mutex> l(pending_lock);
+
+        auto dec = [](unordered_map<string, unsigned int>& m, const string& key) {
+            auto it = m.find(key);
+
+            if (--it->second == 0)
+                m.erase(it);
+        };
+
+        dec(pending, op.path);
+
+        if (op.perm)
+            dec(pending_perm, op.path);
+
+        for (auto p = string_view(op.path); !p.empty(); ) {
+            p = parent_of(p);
+            dec(pending_under, string(p));
+        }
+
+        queued_bytes -= op.bytes;
+        queued_ops--;
+    }
+
+    pending_cv.notify_all();
+}
+
+void linux_recv::wait_for(string_view path, bool self, bool descendants, bool perm_only) {
+    unique_lock<mutex> l(pending_lock);
+    string key(path);
+
+    pending_cv.wait(l, [&]() {
+        if (self && (perm_only ? pending_perm : pending).count(key) != 0)
+            return false;
+
+        if (descendants && pending_under.count(key) != 0)
+            return false;
+
+        return true;
+    });
+
+    if (failed)
+        rethrow_exception(error);
+}
+
+// Creating or removing an entry mustn't overtake a chmod of the directory
+// it's in, in case we're not root and the directory is read-only.
+void linux_recv::wait_for_parent(string_view path) {
+    wait_for(parent_of(path), true, false, true);
+}
+
+void linux_recv::drain() {
+    unique_lock<mutex> l(pending_lock);
+
+    pending_cv.wait(l, [&]() { return queued_ops == 0; });
+
+    if (failed)
+        rethrow_exception(error);
+}
+
+// Throw away anything still queued, e.g. because the stream turned out to be
+// corrupt. The workers mustn't outlive the data they point to.
+void linux_recv::cancel() {
+    unique_lock<mutex> l(pending_lock);
+
+    cancelled = true;
+    pending_cv.wait(l, [&]() { return queued_ops == 0; });
+}
+
+// Wait for everything queued so far, returning false if any of it failed.
+bool linux_recv::flush() {
+    unique_lock<mutex> l(pending_lock);
+
+    pending_cv.wait(l, [&]() { return queued_ops == 0; });
+
+    return !failed;
+}
+
+void linux_recv::warn_once(atomic<bool>& flag, const char* msg) {
+    if (!flag.exchange(true))
+        fprintf(stderr, "WARNING: %s\n", msg);
+}
+
+void linux_recv::begin(uint32_t, bool zero_copy) {
+    this->zero_copy = zero_copy;
+}
+
+void linux_recv::open_subvol(const string& name) {
+    if (sfd != -1)
+        close(sfd);
+
+    sfd = openat(destfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sfd == -1)
+        throw errno_error("open", name);
+
+    subvol_name = name;
+    subvol_path = dest + "/" + name;
+    gen++;
+
+    if (verbose)
+        fprintf(stderr, "At subvol %s\n", name.c_str());
+}
+
+string linux_recv::find_subvol(const BTRFS_UUID& uuid) {
+    string key((const char*)uuid.uuid, sizeof(BTRFS_UUID));
+
+    if (auto it = subvols.find(key); it != subvols.end())
+        return it->second;
+
+    // look for a directory in dest which was received from this subvolume
+
+    dir_handle dir(fdopendir(dup(destfd)));
+
+    if (!dir)
+        throw errno_error("opendir", dest);
+
+    rewinddir(dir.get());
+
+    while (auto de = readdir(dir.get())) {
+        string name = de->d_name;
+        uint8_t val[sizeof(BTRFS_UUID) + sizeof(uint64_t)];
+
+        if (name == "." || name == ".." || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+            continue;
+
+        if (lgetxattr((dest + "/" + name).c_str(), XATTR_RECEIVED, val, sizeof(val)) == sizeof(val) &&
+            !memcmp(val, uuid.uuid, sizeof(BTRFS_UUID))) {
+            subvols[key] = name;
+            return name;
+        }
+
+        int fd = openat(destfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd != -1) {
+            struct btrfs_ioctl_get_subvol_info_args info;
+
+            if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) == 0 &&
+                (!memcmp(info.received_uuid, uuid.uuid, sizeof(BTRFS_UUID)) || !memcmp(info.uuid, uuid.uuid, sizeof(BTRFS_UUID)))) {
+                close(fd);
+                subvols[key] = name;
+                return name;
+            }
+
+            close(fd);
+        }
+    }
+
+    char s[(sizeof(BTRFS_UUID) * 2) + 1];
+
+    for (unsigned int i = 0; i < sizeof(BTRFS_UUID); i++) {
+        snprintf(s + (i * 2), 3, "%02x", uuid.uuid[i]);
+    }
+
+    throw runtime_error("could not find subvolume with UUID " + string(s) + " in " + dest);
+}
+
+static void copy_xattrs(const string& src, const string& dst) {
+    auto len = llistxattr(src.c_str(), nullptr, 0);
+
+    if (len <= 0)
+        return;
+
+    vector<char> names((size_t)len);
+    vector<uint8_t> val;
+
+    len = llistxattr(src.c_str(), names.data(), names.size());
+    if (len < 0)
+        throw errno_error("llistxattr", src);
+
+    for (size_t off = 0; off < (size_t)len; off += strlen(&names[off]) + 1) {
+        const char* name = &names[off];
+
+        if (!strcmp(name, XATTR_RECEIVED))
+            continue;
+
+        auto vallen = lgetxattr(src.c_str(), name, nullptr, 0);
+        if (vallen < 0)
+            continue;
+
+        val.resize((size_t)vallen);
+
+        vallen = lgetxattr(src.c_str(), name, val.data(), val.size());
+        if (vallen < 0)
+            continue;
+
+        if (lsetxattr(dst.c_str(), name, val.data(), (size_t)vallen, 0) != 0 && errno != ENOTSUP && errno != EPERM)
+            throw errno_error("lsetxattr", dst);
+    }
+}
+
+static void copy_metadata(const string& src, const string& dst, const struct stat& st) {
+    struct timespec ts[2];
+
+    if (lchown(dst.c_str(), st.st_uid, st.st_gid) != 0 && errno != EPERM)
+        throw errno_error("lchown", dst);
+
+    copy_xattrs(src, dst);
+
+    if (!S_ISLNK(st.st_mode) && chmod(dst.c_str(), st.st_mode & 07777) != 0)
+        throw errno_error("chmod", dst);
+
+    ts[0] = st.st_atim;
+    ts[1] = st.st_mtim;
+
+    if (utimensat(AT_FDCWD, dst.c_str(), ts, AT_SYMLINK_NOFOLLOW) != 0)
+        throw errno_error("utimensat", dst);
+}
+
+// Fallback for snapshots when the destination isn't btrfs: reflink or copy
+// the parent, preserving hard links.
+void linux_recv::copy_tree(const string& src, const string& dst, map<pair<dev_t, ino_t>, string>& links) {
+    dir_handle dir(opendir(src.c_str()));
+
+    if (!dir)
+        throw errno_error("opendir", src);
+
+    while (auto de = readdir(dir.get())) {
+        string name = de->d_name;
+        struct stat st;
+
+        if (name == "." || name == "..")
+            continue;
+
+        auto s = src + "/" + name;
+        auto d = dst + "/" + name;
+
+        if (lstat(s.c_str(), &st) != 0)
+            throw errno_error("lstat", s);
+
+        if (S_ISDIR(st.st_mode)) {
+            if (mkdir(d.c_str(), 0700) != 0)
+                throw errno_error("mkdir", d);
+
+            copy_tree(s, d, links);
+        } else if (S_ISREG(st.st_mode)) {
+            if (st.st_nlink > 1) {
+                auto it = links.find(make_pair(st.st_dev, st.st_ino));
+
+                if (it != links.end()) {
+                    if (link(it->second.c_str(), d.c_str()) != 0)
+                        throw errno_error("link", d);
+
+                    continue;
+                }
+
+                links[make_pair(st.st_dev, st.st_ino)] = d;
+            }
+
+            int in = open(s.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in == -1)
+                throw errno_error("open", s);
+
+            int out = open(d.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (out == -1) {
+                close(in);
+                throw errno_error("open", d);
+            }
+
+            try {
+                if (ioctl(out, FICLONE, in) != 0)
+                    copy_range(in, out, d, 0, 0, (uint64_t)st.st_size);
+
+                if (ftruncate(out, st.st_size) != 0)
+                    throw errno_error("ftruncate", d);
+            } catch (...) {
+                close(in);
+                close(out);
+                throw;
+            }
+
+            close(in);
+            close(out);
+        } else if (S_ISLNK(st.st_mode)) {
+            vector<char> target((size_t)st.st_size + 1);
+
+            auto len = readlink(s.c_str(), target.data(), target.size());
+            if (len < 0)
+                throw errno_error("readlink", s);
+
+            target[(size_t)len] = 0;
+
+            if (symlink(target.data(), d.c_str()) != 0)
+                throw errno_error("symlink", d);
+        } else {
+            if (mknod(d.c_str(), st.st_mode, st.st_rdev) != 0)
+                throw errno_error("mknod", d);
+        }
+
+        copy_metadata(s, d, st);
+    }
+}
+
+void linux_recv::cmd_subvol(const send_command& cmd) {
+    struct btrfs_ioctl_vol_args args;
+
+    drain();
+
+    auto name = string(cmd.string(BTRFS_SEND_TLV_PATH));
+
+    if (name.empty() || name.find('/') != string::npos || name == "." || name == "..")
+        throw runtime_error("invalid subvolume name " + name);
+
+    memcpy(&subvol_uuid, cmd.fixed(BTRFS_SEND_TLV_UUID, sizeof(BTRFS_UUID)), sizeof(BTRFS_UUID));
+    stransid = cmd.u64(BTRFS_SEND_TLV_TRANSID);
+
+    memset(&args, 0, sizeof(args));
+    strncpy(args.name, name.c_str(), sizeof(args.name) - 1);
+
+    if (ioctl(destfd, BTRFS_IOC_SUBVOL_CREATE, &args) == 0)
+        is_subvol = true;
+    else if (errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL) {
+        is_subvol = false;
+
+        if (mkdirat(destfd, name.c_str(), 0755) != 0)
+            throw errno_error("mkdir", name);
+    } else
+        throw errno_error("BTRFS_IOC_SUBVOL_CREATE", name);
+
+    open_subvol(name);
+}
+
+void linux_recv::cmd_snapshot(const send_command& cmd) {
+    BTRFS_UUID parent_uuid;
+    struct btrfs_ioctl_vol_args_v2 args;
+
+    drain();
+
+    auto name = string(cmd.string(BTRFS_SEND_TLV_PATH));
+
+    if (name.empty() || name.find('/') != string::npos || name == "." || name == "..")
+        throw runtime_error("invalid subvolume name " + name);
+
+    memcpy(&subvol_uuid, cmd.fixed(BTRFS_SEND_TLV_UUID, sizeof(BTRFS_UUID)), sizeof(BTRFS_UUID));
+    stransid = cmd.u64(BTRFS_SEND_TLV_TRANSID);
+    memcpy(&parent_uuid, cmd.fixed(BTRFS_SEND_TLV_CLONE_UUID, sizeof(BTRFS_UUID)), sizeof(BTRFS_UUID));
+
+    auto parent = find_subvol(parent_uuid);
+
+    int pfd = openat(destfd, parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pfd == -1)
+        throw errno_error("open", parent);
+
+    memset(&args, 0, sizeof(args));
+    args.fd = pfd;
+    strncpy(args.name, name.c_str(), sizeof(args.name) - 1);
+
+    is_subvol = ioctl(destfd, BTRFS_IOC_SNAP_CREATE_V2, &args) == 0;
+
+    close(pfd);
+
+    if (is_subvol) {
+        if (lremovexattr((dest + "/" + name).c_str(), XATTR_RECEIVED) != 0 && errno != ENODATA && errno != ENOTSUP)
+            throw errno_error("lremovexattr", name);
+    } else {
+        map<pair<dev_t, ino_t>, string> links;
+        struct stat st;
+        auto src = dest + "/" + parent;
+        auto dst = dest + "/" + name;
+
+        if (verbose)
+            fprintf(stderr, "Copying %s to %s\n", parent.c_str(), name.c_str());
+
+        if (stat(src.c_str(), &st) != 0)
+            throw errno_error("stat", src);
+
+        if (mkdirat(destfd, name.c_str(), 0700) != 0)
+            throw errno_error("mkdir", name);
+
+        copy_tree(src, dst, links);
+        copy_metadata(src, dst, st);
+    }
+
+    open_subvol(name);
+}
+
+void linux_recv::cmd_mkfile(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    string name;
+    int ret;
+
+    check_path(path);
+    wait_for_parent(path);
+
+    auto dir = open_parent(sfd, path, name);
+
+    switch (cmd.cmd) {
+        case BTRFS_SEND_CMD_MKFILE:
+            ret = openat(dir.get(), name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+            if (ret != -1) {
+                close(ret);
+                ret = 0;
+            }
+        break;
+
+        case BTRFS_SEND_CMD_MKDIR:
+            ret = mkdirat(dir.get(), name.c_str(), 0700);
+        break;
+
+        case BTRFS_SEND_CMD_MKNOD:
+            ret = mknodat(dir.get(), name.c_str(), (mode_t)cmd.u64(BTRFS_SEND_TLV_MODE), (dev_t)cmd.u64(BTRFS_SEND_TLV_RDEV));
+        break;
+
+        case BTRFS_SEND_CMD_MKFIFO:
+            ret = mkfifoat(dir.get(), name.c_str(), 0600);
+        break;
+
+        case BTRFS_SEND_CMD_MKSOCK:
+            ret = mknodat(dir.get(), name.c_str(), S_IFSOCK | 0600, 0);
+        break;
+
+        case BTRFS_SEND_CMD_SYMLINK:
+            ret = symlinkat(string(cmd.string(BTRFS_SEND_TLV_PATH_LINK)).c_str(), dir.get(), name.c_str());
+        break;
+
+        default:
+            ret = -1;
+            errno = EINVAL;
+    }
+
+    if (ret != 0)
+        throw errno_error("create", path);
+
+    gen++;
+}
+
+void linux_recv::cmd_rename(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto path_to = string(cmd.string(BTRFS_SEND_TLV_PATH_TO));
+
+    check_path(path);
+    check_path(path_to);
+
+    wait_for(path, true, true);
+    wait_for(path_to, true, true);
+    wait_for_parent(path);
+    wait_for_parent(path_to);
+
+    string name, name_to;
+    auto dir = open_parent(sfd, path, name);
+    auto dir_to = open_parent(sfd, path_to, name_to);
+
+    if (renameat(dir.get(), name.c_str(), dir_to.get(), name_to.c_str()) != 0)
+        throw errno_error("rename", path);
+
+    gen++;
+}
+
+void linux_recv::cmd_link(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto path_link = string(cmd.string(BTRFS_SEND_TLV_PATH_LINK));
+
+    check_path(path);
+    check_path(path_link);
+
+    wait_for_parent(path);
+
+    string name, name_link;
+    auto dir = open_parent(sfd, path, name);
+    auto dir_link = open_parent(sfd, path_link, name_link);
+
+    if (linkat(dir_link.get(), name_link.c_str(), dir.get(), name.c_str(), 0) != 0)
+        throw errno_error("link", path);
+
+    gen++;
+}
+
+void linux_recv::cmd_unlink(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+
+    check_path(path);
+
+    wait_for(path, true, false);
+    wait_for_parent(path);
+
+    string name;
+    auto dir = open_parent(sfd, path, name);
+
+    if (unlinkat(dir.get(), name.c_str(), 0) != 0)
+        throw errno_error("unlink", path);
+
+    gen++;
+}
+
+void linux_recv::cmd_rmdir(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+
+    check_path(path);
+
+    wait_for(path, true, true);
+    wait_for_parent(path);
+
+    string name;
+    auto dir = open_parent(sfd, path, name);
+
+    if (unlinkat(dir.get(), name.c_str(), AT_REMOVEDIR) != 0)
+        throw errno_error("rmdir", path);
+
+    gen++;
+}
+
+void linux_recv::cmd_setxattr(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto name = string(cmd.string(BTRFS_SEND_TLV_XATTR_NAME));
+    auto val = string(cmd.string(BTRFS_SEND_TLV_XATTR_DATA));
+
+    check_path(path);
+
+    enqueue(path, val.length(), false, [this, path, name, val](recv_worker&) {
+        string file;
+        auto dir = open_parent(sfd, path, file);
+
+        if (lsetxattr(fd_path(dir, file).c_str(), name.c_str(), val.data(), val.length(), 0) != 0) {
+            if (errno != ENOTSUP && errno != EPERM)
+                throw errno_error("lsetxattr", path);
+
+            warn_once(warned_xattr, "destination doesn't allow all xattrs to be set, skipping");
+        }
+    });
+}
+
+void linux_recv::cmd_removexattr(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto name = string(cmd.string(BTRFS_SEND_TLV_XATTR_NAME));
+
+    check_path(path);
+
+    enqueue(path, 0, false, [this, path, name](recv_worker&) {
+        string file;
+        auto dir = open_parent(sfd, path, file);
+
+        if (lremovexattr(fd_path(dir, file).c_str(), name.c_str()) != 0 && errno != ENODATA && errno != ENOTSUP)
+            throw errno_error("lremovexattr", path);
+    });
+}
+
+void linux_recv::cmd_write(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto offset = cmd.u64(BTRFS_SEND_TLV_OFFSET);
+    const void* data;
+    uint32_t len;
+
+    check_path(path);
+
+    if (!cmd.find(BTRFS_SEND_TLV_DATA, &data, &len))
+        throw send_stream_error(send_error::bad_tlv, cmd.offset, BTRFS_SEND_TLV_DATA);
+
+    if (zero_copy) {
+        enqueue(path, len, false, [this, path, offset, data, len](recv_worker& w) {
+            write_all(w.file(path), path, (const uint8_t*)data, len, offset);
+            bytes_written += len;
+        });
+    } else {
+        // the stream buffer is about to be reused, so take a copy
+        auto buf = make_shared<vector<uint8_t>>((const uint8_t*)data, (const uint8_t*)data + len);
+
+        enqueue(path, len, false, [this, path, offset, buf](recv_worker& w) {
+            write_all(w.file(path), path, buf->data(), buf->size(), offset);
+            bytes_written += buf->size();
+        });
+    }
+}
+
+void linux_recv::cmd_clone(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto offset = cmd.u64(BTRFS_SEND_TLV_OFFSET);
+    auto len = cmd.u64(BTRFS_SEND_TLV_CLONE_LENGTH);
+    auto clone_path = string(cmd.string(BTRFS_SEND_TLV_CLONE_PATH));
+    auto clone_offset = cmd.u64(BTRFS_SEND_TLV_CLONE_OFFSET);
+    BTRFS_UUID uuid;
+    string src_subvol;
+
+    check_path(path);
+    check_path(clone_path);
+
+    memcpy(&uuid, cmd.fixed(BTRFS_SEND_TLV_CLONE_UUID, sizeof(BTRFS_UUID)), sizeof(BTRFS_UUID));
+
+    if (!memcmp(&uuid, &subvol_uuid, sizeof(BTRFS_UUID))) {
+        // the source has to have been written before we can clone from it
+        if (clone_path != path)
+            wait_for(clone_path, true, false);
+    } else
+        src_subvol = find_subvol(uuid);
+
+    enqueue(path, 0, false, [this, path, offset, len, src_subvol, clone_path, clone_offset](recv_worker& w) {
+        int dst = w.file(path);
+        int in;
+
+        if (src_subvol.empty())
+            in = open_beneath(sfd, clone_path, O_RDONLY);
+        else {
+            fd_handle dir(open_beneath(destfd, src_subvol, O_PATH | O_DIRECTORY));
+
+            if (dir.get() == -1)
+                throw errno_error("open", src_subvol);
+
+            in = open_beneath(dir.get(), clone_path, O_RDONLY);
+        }
+
+        if (in == -1)
+            throw errno_error("open", clone_path);
+
+        try {
+            copy_range(in, dst, path, clone_offset, offset, len);
+        } catch (...) {
+            close(in);
+            throw;
+        }
+
+        close(in);
+
+        bytes_cloned += len;
+    });
+}
+
+void linux_recv::cmd_truncate(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto size = cmd.u64(BTRFS_SEND_TLV_SIZE);
+
+    check_path(path);
+
+    enqueue(path, 0, false, [path, size](recv_worker& w) {
+        if (ftruncate(w.file(path), (off_t)size) != 0)
+            throw errno_error("ftruncate", path);
+    });
+}
+
+void linux_recv::cmd_chmod(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto mode = (mode_t)(cmd.u64(BTRFS_SEND_TLV_MODE) & 07777);
+
+    check_path(path);
+
+    // anything queued inside a directory has to finish before we make it read-only
+    wait_for(path, false, true);
+
+    enqueue(path, 0, true, [this, path, mode](recv_worker&) {
+        string name;
+        struct stat st;
+        auto dir = open_parent(sfd, path, name);
+
+        if (fstatat(dir.get(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            throw errno_error("stat", path);
+
+        // symlinks don't have modes of their own, and chmod would follow it
+        if (S_ISLNK(st.st_mode))
+            return;
+
+        if (fchmodat(dir.get(), name.c_str(), mode, 0) != 0)
+            throw errno_error("chmod", path);
+    });
+}
+
+void linux_recv::cmd_chown(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto uid = (uid_t)cmd.u64(BTRFS_SEND_TLV_UID);
+    auto gid = (gid_t)cmd.u64(BTRFS_SEND_TLV_GID);
+
+    check_path(path);
+
+    wait_for(path, false, true);
+
+    enqueue(path, 0, true, [this, path, uid, gid](recv_worker&) {
+        string name;
+        auto dir = open_parent(sfd, path, name);
+
+        if (fchownat(dir.get(), name.c_str(), uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno != EPERM || geteuid() == 0)
+                throw errno_error("chown", path);
+
+            warn_once(warned_chown, "not running as root, file ownership will not be preserved");
+        }
+    });
+}
+
+void linux_recv::cmd_utimes(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    BTRFS_TIME atime, mtime;
+    struct timespec ts[2];
+
+    check_path(path);
+
+    memcpy(&atime, cmd.fixed(BTRFS_SEND_TLV_ATIME, sizeof(BTRFS_TIME)), sizeof(BTRFS_TIME));
+    memcpy(&mtime, cmd.fixed(BTRFS_SEND_TLV_MTIME, sizeof(BTRFS_TIME)), sizeof(BTRFS_TIME));
+
+    ts[0].tv_sec = (time_t)atime.seconds;
+    ts[0].tv_nsec = atime.nanoseconds;
+    ts[1].tv_sec = (time_t)mtime.seconds;
+    ts[1].tv_nsec = mtime.nanoseconds;
+
+    enqueue(path, 0, false, [this, path, ts](recv_worker&) {
+        string name;
+        auto dir = open_parent(sfd, path, name);
+
+        if (utimensat(dir.get(), name.c_str(), ts, AT_SYMLINK_NOFOLLOW) != 0)
+            throw errno_error("utimensat", path);
+    });
+}
+
+void linux_recv::encoded_write(recv_worker& w, const string& path, uint64_t offset, uint64_t file_len, uint64_t unencoded_len,
+                               uint64_t unencoded_offset, uint32_t compression, const uint8_t* data, uint32_t datalen) {
+    int fd = w.file(path);
+
+#ifdef BTRFS_IOC_ENCODED_WRITE
+    if (use_encoded_ioctl) {
+        struct btrfs_ioctl_encoded_io_args args;
+        struct iovec iov;
+
+        iov.iov_base = (void*)data;
+        iov.iov_len = datalen;
+
+        memset(&args, 0, sizeof(args));
+        args.iov = &iov;
+        args.iovcnt = 1;
+        args.offset = (__s64)offset;
+        args.len = file_len;
+        args.unencoded_len = unencoded_len;
+        args.unencoded_offset = unencoded_offset;
+        args.compression = compression;
+        args.encryption = BTRFS_ENCODED_IO_ENCRYPTION_NONE;
+
+        if (ioctl(fd, BTRFS_IOC_ENCODED_WRITE, &args) >= 0) {
+            bytes_written += file_len;
+            return;
+        }
+
+        // not btrfs, or not allowed - decompress everything from now on
+        if (errno == ENOTTY || errno == EPERM || errno == EOPNOTSUPP)
+            use_encoded_ioctl = false;
+    }
+#endif
+
+    const uint8_t* unencoded;
+
+    try {
+        unencoded = w.decomp.decompress(compression, data, datalen, unencoded_len, unencoded_offset, file_len);
+    } catch (const exception& e) {
+        throw runtime_error(string(e.what()) + " (" + path + ")");
+    }
+
+    write_all(fd, path, unencoded, (size_t)file_len, offset);
+
+    bytes_written += file_len;
+}
+
+void linux_recv::cmd_encoded_write(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto offset = cmd.u64(BTRFS_SEND_TLV_OFFSET);
+    auto file_len = cmd.u64(BTRFS_SEND_TLV_UNENCODED_FILE_LEN);
+    auto unencoded_len = cmd.u64(BTRFS_SEND_TLV_UNENCODED_LEN);
+    auto unencoded_offset = cmd.u64(BTRFS_SEND_TLV_UNENCODED_OFFSET);
+    auto compression = cmd.u32(BTRFS_SEND_TLV_COMPRESSION);
+    const void* data;
+    uint32_t len;
+
+    check_path(path);
+
+    if (cmd.has(BTRFS_SEND_TLV_ENCRYPTION) && cmd.u32(BTRFS_SEND_TLV_ENCRYPTION) != BTRFS_ENCODED_IO_ENCRYPTION_NONE)
+        throw runtime_error("encrypted writes are not supported (" + path + ")");
+
+    if (!cmd.find(BTRFS_SEND_TLV_DATA, &data, &len))
+        throw send_stream_error(send_error::bad_tlv, cmd.offset, BTRFS_SEND_TLV_DATA);
+
+    if (zero_copy) {
+        enqueue(path, len, false, [this, path, offset, file_len, unencoded_len, unencoded_offset, compression, data, len](recv_worker& w) {
+            encoded_write(w, path, offset, file_len, unencoded_len, unencoded_offset, compression, (const uint8_t*)data, len);
+        });
+    } else {
+        auto buf = make_shared<vector<uint8_t>>((const uint8_t*)data, (const uint8_t*)data + len);
+
+        enqueue(path, len, false, [this, path, offset, file_len, unencoded_len, unencoded_offset, compression, buf](recv_worker& w) {
+            encoded_write(w, path, offset, file_len, unencoded_len, unencoded_offset, compression, buf->data(), (uint32_t)buf->size());
+        });
+    }
+}
+
+void linux_recv::cmd_fallocate(const send_command& cmd) {
+    auto path = string(cmd.string(BTRFS_SEND_TLV_PATH));
+    auto mode = cmd.u32(BTRFS_SEND_TLV_FALLOCATE_MODE);
+    auto offset = cmd.u64(BTRFS_SEND_TLV_OFFSET);
+    auto size = cmd.u64(BTRFS_SEND_TLV_SIZE);
+
+    check_path(path);
+
+    enqueue(path, 0, false, [path, mode, offset, size](recv_worker& w) {
+        if (fallocate(w.file(path), (int)mode, (off_t)offset, (off_t)size) != 0)
+            throw errno_error("fallocate", path);
+    });
+}
+
+void linux_recv::end() {
+    uint8_t val[sizeof(BTRFS_UUID) + sizeof(uint64_t)];
+
+    drain();
+
+    if (sfd == -1)
+        return;
+
+    memcpy(val, &subvol_uuid, sizeof(BTRFS_UUID));
+    memcpy(val + sizeof(BTRFS_UUID), &stransid, sizeof(uint64_t));
+
+    if (lsetxattr(subvol_path.c_str(), XATTR_RECEIVED, val, sizeof(val), 0) != 0)
+        warn_once(warned_received, "could not record received UUID, incremental streams will not find this subvolume");
+
+    if (is_subvol) {
+        struct btrfs_ioctl_received_subvol_args rs;
+        uint64_t flags = BTRFS_SUBVOL_RDONLY;
+
+        memset(&rs, 0, sizeof(rs));
+        memcpy(rs.uuid, &subvol_uuid, sizeof(BTRFS_UUID));
+        rs.stransid = stransid;
+
+        // needs CAP_SYS_ADMIN, but the xattr will do if we don't have it
+        ioctl(sfd, BTRFS_IOC_SET_RECEIVED_SUBVOL, &rs);
+
+        if (ioctl(sfd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) != 0)
+            throw errno_error("BTRFS_IOC_SUBVOL_SETFLAGS", subvol_name);
+    }
+
+    subvols[string((const char*)subvol_uuid.uuid, sizeof(BTRFS_UUID))] = subvol_name;
+
+    close(sfd);
+    sfd = -1;
+    gen++;
+}
+
+// When resuming, the subvolume was created by an earlier run, so all we do
+// with SUBVOL or SNAPSHOT is open it again.
+void linux_recv::reopen(const send_command& cmd) {
+    uint64_t flags;
+
+    drain();
+
+    auto name = string(cmd.string(BTRFS_SEND_TLV_PATH));
+
+    if (name.empty() || name.find('/') != string::npos || name == "." || name == "..")
+        throw runtime_error("invalid subvolume name " + name);
+
+    memcpy(&subvol_uuid, cmd.fixed(BTRFS_SEND_TLV_UUID, sizeof(BTRFS_UUID)), sizeof(BTRFS_UUID));
+    stransid = cmd.u64(BTRFS_SEND_TLV_TRANSID);
+
+    open_subvol(name);
+
+    // only succeeds on the root of a subvolume
+    is_subvol = ioctl(sfd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) == 0;
+}
+
+// Leave the subvolume without marking it as received, for a stream which an
+// earlier run finished.
+void linux_recv::close_subvol() {
+    drain();
+
+    if (sfd != -1) {
+        close(sfd);
+        sfd = -1;
+    }
+
+    gen++;
+}
+
+class fd_source : public send_source {
+public:
+    fd_source(int fd) : fd(fd) {
+    }
+
+    size_t read(void* buf, size_t len) override {
+        while (true) {
+            auto ret = ::read(fd, buf, len);
+
+            if (ret >= 0)
+                return (size_t)ret;
+
+            if (errno != EINTR)
+                throw errno_error("read", "stream");
+        }
+    }
+
+private:
+    int fd;
+};
+
+static void recv_stream(send_stream& s, linux_recv& r, bool stop_at_end, uint64_t resume_at) {
+    uint64_t applied = resume_at; // everything before this is done once the queue is empty
+
+    try {
+        while (s.read_header()) {
+            r.begin(s.version(), s.zero_copy());
+
+            while (true) {
+                applied = max(s.offset(), resume_at);
+
+                auto& batch = s.next_batch();
+
+                if (batch.empty())
+                    break;
+
+                for (const auto& c : batch) {
+                    if (c.offset >= resume_at)
+                        r.dispatch(c);
+                    else if (c.cmd == BTRFS_SEND_CMD_SUBVOL || c.cmd == BTRFS_SEND_CMD_SNAPSHOT)
+                        r.reopen(c);
+                    else if (c.cmd == BTRFS_SEND_CMD_END)
+                        r.close_subvol();
+                }
+
+                // once we know which subvolume we're in, jump to where we left off
+                if (s.offset() < resume_at && !s.ended() && !s.skip_to(resume_at))
+                    r.close_subvol();
+            }
+
+            if (!s.ended())
+                throw send_stream_error(send_error::truncated, s.offset());
+
+            r.end();
+
+            if (stop_at_end)
+                break;
+        }
+    } catch (const send_stream_error&) {
+        // The input is bad, but what came before it is fine - let that finish,
+        // so the receive can be resumed once the rest of the stream is available.
+        if (r.flush())
+            fprintf(stderr, "Received up to offset %llu, use -r %llu to resume.\n", (unsigned long long)applied, (unsigned long long)applied);
+
+        throw;
+    } catch (...) {
+        r.cancel();
+        throw;
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: recvbtrfs [-v] [-e] [-j threads] [-r offset] [-f file] <dir>\n\n");
+    fprintf(stderr, "Applies btrfs send streams to a directory.\n\n");
+    fprintf(stderr, "  -f <file>     read the stream from file rather than stdin\n");
+    fprintf(stderr, "  -j <threads>  number of threads to write with (default: number of CPUs)\n");
+    fprintf(stderr, "  -r <offset>   resume an interrupted receive from the command at offset, as listed by senddump -l\n");
+    fprintf(stderr, "  -e            stop after the first END command\n");
+    fprintf(stderr, "  -v            print progress and statistics\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* file = nullptr;
+    unsigned int threads = thread::hardware_concurrency();
+    bool verbose = false, stop_at_end = false;
+    uint64_t resume_at = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:j:r:ev")) != -1) {
+        switch (opt) {
+            case 'f':
+                file = optarg;
+            break;
+
+            case 'j':
+                threads = (unsigned int)strtoul(optarg, nullptr, 10);
+            break;
+
+            case 'r':
+                resume_at = strtoull(optarg, nullptr, 10);
+            break;
+
+            case 'e':
+                stop_at_end = true;
+            break;
+
+            case 'v':
+                verbose = true;
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    threads = max(1u, min(threads, (unsigned int)MAX_WORKERS));
+
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.2"))
+        calc_crc32c = calc_crc32c_hw;
+#endif
+
+    try {
+        auto start_time = chrono::steady_clock::now();
+        linux_recv r(argv[optind], threads, verbose);
+        struct stat st;
+        int fd = STDIN_FILENO;
+        uint64_t total;
+
+        if (file) {
+            fd = open(file, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                throw errno_error("open", file);
+        }
+
+        if (fstat(fd, &st) != 0)
+            throw errno_error("fstat", file ? file : "stdin");
+
+        // map regular files, so write data can go straight from the page cache to the workers
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED)
+                throw errno_error("mmap", file ? file : "stdin");
+
+            madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+            send_stream s((const uint8_t*)addr, (size_t)st.st_size);
+
+            try {
+                recv_stream(s, r, stop_at_end, resume_at);
+            } catch (...) {
+                munmap(addr, (size_t)st.st_size);
+                throw;
+            }
+
+            total = s.offset();
+
+            munmap(addr, (size_t)st.st_size);
+        } else {
+            fd_source src(fd);
+            send_stream s(src);
+
+            recv_stream(s, r, stop_at_end, resume_at);
+
+            total = s.offset();
+        }
+
+        if (fd != STDIN_FILENO)
+            close(fd);
+
+        if (verbose) {
+            auto secs = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+            fprintf(stderr, "Received %llu bytes in %.2f seconds (%.1f MB/s), %llu bytes written, %llu bytes cloned, %u threads\n",
+                    (unsigned long long)total, secs, secs > 0 ? (double)total / secs / 1048576.0 : 0.0,
+                    (unsigned long long)r.bytes_written, (unsigned long long)r.bytes_cloned, threads);
+        }
+    } catch (const exception& e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,858 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Inspector for send streams, replacing send-dump.pl. Checks every command's
+// checksum, and can print the commands, summarize where the bytes go, and
+// write an index of the stream which recvbtrfs -r can resume from.
+
+#include "sendstream.h"
+#include "sendindex.h"
+#include "../crc32c.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+#define NUM_COMMANDS    (BTRFS_SEND_CMD_ENCODED_WRITE + 1)
+
+static runtime_error errno_error(const char* func, const string& path) {
+    return runtime_error(string(func) + " failed on " + path + ": " + strerror(errno));
+}
+
+class fd_source : public send_source {
+public:
+    fd_source(int fd) : fd(fd) {
+    }
+
+    size_t read(void* buf, size_t len) override {
+        while (true) {
+            auto ret = ::read(fd, buf, len);
+
+            if (ret >= 0)
+                return (size_t)ret;
+
+            if (errno != EINTR)
+                throw errno_error("read", "stream");
+        }
+    }
+
+private:
+    int fd;
+};
+
+class index_writer {
+public:
+    index_writer(const char* fn);
+    ~index_writer();
+    void add(const send_command& c, uint16_t stream, string_view path, uint64_t inode);
+    void finish();
+
+private:
+    void flush();
+
+    string fn;
+    FILE* f;
+    vector<send_index_entry> entries;
+    string strings;
+    unordered_map<string, uint64_t> string_offsets;
+    uint64_t num_entries = 0;
+};
+
+class send_dumper {
+public:
+    send_dumper(bool dump, index_writer* index) : dump(dump), index(index) {
+    }
+
+    void begin(uint32_t version);
+    void command(const send_command& c);
+    void print_stats(unsigned int top_paths, uint64_t total, double secs);
+
+private:
+    void print_command(const send_command& c);
+    uint64_t inode_of(const string& path);
+    void rename(const string& from, const string& to);
+
+    template<typename T>
+    static void move_subtree(map<string, T>& m, const string& from, const string& to);
+
+    bool dump;
+    index_writer* index;
+    uint32_t version = 0;
+    uint16_t stream = 0;
+    unsigned int num_streams = 0;
+
+    map<string, uint64_t> inodes; // path to inode, for those the stream has told us about
+    map<string, uint64_t> volume; // bytes written or cloned per path
+
+    uint64_t counts[NUM_COMMANDS + 1] = {}; // last is unknown commands
+    uint64_t bytes[NUM_COMMANDS + 1] = {};
+    uint64_t write_bytes = 0, clone_bytes = 0, encoded_bytes = 0, unencoded_bytes = 0;
+};
+
+index_writer::index_writer(const char* fn) : fn(fn) {
+    send_index_header h;
+
+    f = fopen(fn, "wb");
+    if (!f)
+        throw errno_error("fopen", fn);
+
+    // written properly by finish()
+    memset(&h, 0, sizeof(h));
+
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        throw errno_error("fwrite", fn);
+
+    entries.reserve(4096);
+}
+
+index_writer::~index_writer() {
+    if (f)
+        fclose(f);
+}
+
+void index_writer::flush() {
+    if (entries.empty())
+        return;
+
+    if (fwrite(entries.data(), sizeof(send_index_entry), entries.size(), f) != entries.size())
+        throw errno_error("fwrite", fn);
+
+    entries.clear();
+}
+
+void index_writer::add(const send_command& c, uint16_t stream, string_view path, uint64_t inode) {
+    auto& e = entries.emplace_back();
+
+    e.offset = c.offset;
+    e.inode = inode;
+    e.cmd = c.cmd;
+    e.stream = stream;
+    e.path_length = (uint32_t)path.length();
+    e.path = 0;
+
+    // each path is only stored once, as most commands are writes to the same few files
+
+    if (!path.empty()) {
+        auto [it, added] = string_offsets.try_emplace(string(path), strings.length());
+
+        if (added)
+            strings.append(path);
+
+        e.path = it->second;
+    }
+
+    num_entries++;
+
+    if (entries.size() == entries.capacity())
+        flush();
+}
+
+void index_writer::finish() {
+    send_index_header h;
+
+    flush();
+
+    memcpy(h.magic, SEND_INDEX_MAGIC, sizeof(h.magic));
+    h.version = SEND_INDEX_VERSION;
+    h.num_entries = num_entries;
+    h.strings_offset = sizeof(send_index_header) + (num_entries * sizeof(send_index_entry));
+    h.strings_length = strings.length();
+
+    if (!strings.empty() && fwrite(strings.data(), strings.length(), 1, f) != 1)
+        throw errno_error("fwrite", fn);
+
+    if (fseek(f, 0, SEEK_SET) != 0)
+        throw errno_error("fseek", fn);
+
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        throw errno_error("fwrite", fn);
+
+    if (fclose(f) != 0) {
+        f = nullptr;
+        throw errno_error("fclose", fn);
+    }
+
+    f = nullptr;
+}
+
+template<typename T>
+void send_dumper::move_subtree(map<string, T>& m, const string& from, const string& to) {
+    if (auto it = m.find(from); it != m.end()) {
+        auto v = it->second;
+
+        m.erase(it);
+        m[to] = v;
+    }
+
+    // children sort straight after "from/", and before "from0"
+    auto prefix = from + "/";
+    auto it = m.lower_bound(prefix);
+    vector<pair<string, T>> moved;
+
+    while (it != m.end() && it->first.compare(0, prefix.length(), prefix) == 0) {
+        moved.emplace_back(to + "/" + it->first.substr(prefix.length()), it->second);
+        it = m.erase(it);
+    }
+
+    for (auto& p : moved) {
+        m[p.first] = p.second;
+    }
+}
+
+// New inodes are created with names like o257-12-0, which tell us the inode
+// number even when the stream doesn't.
+static uint64_t orphan_inode(const string& path) {
+    auto slash = path.rfind('/');
+    auto name = slash == string::npos ? path.c_str() : path.c_str() + slash + 1;
+    unsigned long long ino, gen;
+    unsigned int n;
+    int len;
+
+    if (name[0] != 'o')
+        return 0;
+
+    if (sscanf(name, "o%llu-%llu-%u%n", &ino, &gen, &n, &len) != 3 || name[len] != 0)
+        return 0;
+
+    return ino;
+}
+
+uint64_t send_dumper::inode_of(const string& path) {
+    if (auto it = inodes.find(path); it != inodes.end())
+        return it->second;
+
+    return orphan_inode(path);
+}
+
+void send_dumper::rename(const string& from, const string& to) {
+    auto ino = inode_of(from);
+
+    move_subtree(inodes, from, to);
+    move_subtree(volume, from, to);
+
+    if (ino != 0)
+        inodes[to] = ino;
+}
+
+void send_dumper::begin(uint32_t version) {
+    if (dump && num_streams > 0)
+        printf("---\n");
+
+    this->version = version;
+    stream = (uint16_t)num_streams;
+    num_streams++;
+
+    // paths are relative to each stream's subvolume
+    inodes.clear();
+}
+
+static string tlv_string(const uint8_t* data, uint16_t len) {
+    return string((const char*)data, len);
+}
+
+static uint64_t tlv_u64(const uint8_t* data, uint16_t len) {
+    uint64_t v = 0;
+
+    memcpy(&v, data, min((size_t)len, sizeof(uint64_t)));
+
+    return v;
+}
+
+static uint32_t tlv_u32(const uint8_t* data, uint16_t len) {
+    uint32_t v = 0;
+
+    memcpy(&v, data, min((size_t)len, sizeof(uint32_t)));
+
+    return v;
+}
+
+static void print_uuid(const char* name, const uint8_t* u, uint16_t len) {
+    if (len < 16) {
+        printf("  %s: (%x bytes)\n", name, len);
+        return;
+    }
+
+    printf("  %s: %02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x\n", name,
+           u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+static void print_time(const char* name, const uint8_t* data, uint16_t len) {
+    time_t t = (time_t)tlv_u64(data, len);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+
+    printf("  %s: %04u-%02u-%02u %02u:%02u:%02u\n", name, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// Same output as send-dump.pl, TLVs in stream order.
+void send_dumper::print_command(const send_command& c) {
+    btrfs_send_command h;
+    auto name = send_command_name(c.cmd);
+    uint32_t off = 0;
+
+    memcpy(&h, c.data - sizeof(btrfs_send_command), sizeof(btrfs_send_command));
+
+    if (name)
+        printf("%s, %x, %08x\n", name, c.length, h.csum);
+    else
+        printf("unknown(%x), %x, %08x\n", c.cmd, c.length, h.csum);
+
+    while (off + sizeof(uint16_t) <= c.length) {
+        uint16_t type, len;
+        const uint8_t* v;
+
+        memcpy(&type, c.data + off, sizeof(uint16_t));
+
+        if (version >= 2 && type == BTRFS_SEND_TLV_DATA) {
+            printf("  data: (%x bytes)\n", (unsigned int)(c.length - off - sizeof(uint16_t)));
+            break;
+        }
+
+        if (off + sizeof(btrfs_send_tlv) > c.length)
+            break;
+
+        memcpy(&len, c.data + off + offsetof(btrfs_send_tlv, length), sizeof(uint16_t));
+
+        if (off + sizeof(btrfs_send_tlv) + len > c.length)
+            break;
+
+        v = c.data + off + sizeof(btrfs_send_tlv);
+
+        switch (type) {
+            case BTRFS_SEND_TLV_UUID:
+                print_uuid("uuid", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_TRANSID:
+                printf("  transid: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_INODE:
+                printf("  inode: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_SIZE:
+                printf("  size: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_MODE:
+                printf("  mode: %llo\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_UID:
+                printf("  uid: %llu\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_GID:
+                printf("  gid: %llu\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_RDEV:
+                printf("  rdev: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_CTIME:
+                print_time("ctime", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_MTIME:
+                print_time("mtime", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_ATIME:
+                print_time("atime", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_OTIME:
+                print_time("otime", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_XATTR_NAME:
+                printf("  xattr_name: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_XATTR_DATA:
+                printf("  xattr_data: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_PATH:
+                printf("  path: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_PATH_TO:
+                printf("  path_to: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_PATH_LINK:
+                printf("  path_link: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_OFFSET:
+                printf("  offset: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_DATA:
+                printf("  data: (%x bytes)\n", len);
+            break;
+
+            case BTRFS_SEND_TLV_CLONE_UUID:
+                print_uuid("clone_uuid", v, len);
+            break;
+
+            case BTRFS_SEND_TLV_CLONE_CTRANSID:
+                printf("  clone_transid: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_CLONE_PATH:
+                printf("  clone_path: \"%s\"\n", tlv_string(v, len).c_str());
+            break;
+
+            case BTRFS_SEND_TLV_CLONE_OFFSET:
+                printf("  clone_offset: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_CLONE_LENGTH:
+                printf("  clone_len: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_FALLOCATE_MODE:
+                printf("  fallocate_mode: %x\n", tlv_u32(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_FILEATTR:
+                printf("  fileattr: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_UNENCODED_FILE_LEN:
+                printf("  unencoded_file_len: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_UNENCODED_LEN:
+                printf("  unencoded_len: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_UNENCODED_OFFSET:
+                printf("  unencoded_offset: %llx\n", (unsigned long long)tlv_u64(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_COMPRESSION:
+                printf("  compression: %x\n", tlv_u32(v, len));
+            break;
+
+            case BTRFS_SEND_TLV_ENCRYPTION:
+                printf("  encryption: %x\n", tlv_u32(v, len));
+            break;
+
+            default:
+                printf("  unknown(%u),%x\n", type, len);
+        }
+
+        off += (uint32_t)sizeof(btrfs_send_tlv) + len;
+    }
+}
+
+void send_dumper::command(const send_command& c) {
+    unsigned int slot = c.cmd < NUM_COMMANDS ? c.cmd : NUM_COMMANDS;
+    string path;
+    uint64_t ino = 0;
+
+    counts[slot]++;
+    bytes[slot] += sizeof(btrfs_send_command) + c.length;
+
+    if (dump)
+        print_command(c);
+
+    if (c.has(BTRFS_SEND_TLV_PATH))
+        path = c.string(BTRFS_SEND_TLV_PATH);
+
+    switch (c.cmd) {
+        case BTRFS_SEND_CMD_MKFILE:
+        case BTRFS_SEND_CMD_MKDIR:
+        case BTRFS_SEND_CMD_MKNOD:
+        case BTRFS_SEND_CMD_MKFIFO:
+        case BTRFS_SEND_CMD_MKSOCK:
+        case BTRFS_SEND_CMD_SYMLINK:
+            if (c.has(BTRFS_SEND_TLV_INODE))
+                ino = c.u64(BTRFS_SEND_TLV_INODE);
+            else
+                ino = orphan_inode(path);
+
+            if (ino != 0)
+                inodes[path] = ino;
+        break;
+
+        case BTRFS_SEND_CMD_RENAME:
+            ino = inode_of(path);
+            rename(path, string(c.string(BTRFS_SEND_TLV_PATH_TO)));
+        break;
+
+        case BTRFS_SEND_CMD_LINK:
+            ino = inode_of(string(c.string(BTRFS_SEND_TLV_PATH_LINK)));
+
+            if (ino != 0)
+                inodes[path] = ino;
+        break;
+
+        case BTRFS_SEND_CMD_UNLINK:
+        case BTRFS_SEND_CMD_RMDIR:
+            ino = inode_of(path);
+            inodes.erase(path);
+        break;
+
+        case BTRFS_SEND_CMD_WRITE:
+        {
+            const void* data;
+            uint32_t len;
+
+            ino = inode_of(path);
+
+            if (c.find(BTRFS_SEND_TLV_DATA, &data, &len)) {
+                write_bytes += len;
+                volume[path] += len;
+            }
+
+            break;
+        }
+
+        case BTRFS_SEND_CMD_CLONE:
+        {
+            auto len = c.u64(BTRFS_SEND_TLV_CLONE_LENGTH);
+
+            ino = inode_of(path);
+            clone_bytes += len;
+            volume[path] += len;
+
+            break;
+        }
+
+        case BTRFS_SEND_CMD_ENCODED_WRITE:
+        {
+            const void* data;
+            uint32_t len;
+
+            ino = inode_of(path);
+
+            if (c.find(BTRFS_SEND_TLV_DATA, &data, &len))
+                encoded_bytes += len;
+
+            unencoded_bytes += c.u64(BTRFS_SEND_TLV_UNENCODED_FILE_LEN);
+            volume[path] += c.u64(BTRFS_SEND_TLV_UNENCODED_FILE_LEN);
+
+            break;
+        }
+
+        case BTRFS_SEND_CMD_SUBVOL:
+        case BTRFS_SEND_CMD_SNAPSHOT:
+        case BTRFS_SEND_CMD_END:
+        break;
+
+        default:
+            ino = inode_of(path);
+    }
+
+    if (index)
+        index->add(c, stream, path, ino);
+}
+
+static string human_size(uint64_t v) {
+    static const char* units[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+    double d = (double)v;
+    unsigned int u = 0;
+    char s[32];
+
+    while (d >= 1024.0 && u < (sizeof(units) / sizeof(units[0])) - 1) {
+        d /= 1024.0;
+        u++;
+    }
+
+    if (u == 0)
+        snprintf(s, sizeof(s), "%llu B", (unsigned long long)v);
+    else
+        snprintf(s, sizeof(s), "%.1f %s", d, units[u]);
+
+    return s;
+}
+
+void send_dumper::print_stats(unsigned int top_paths, uint64_t total, double secs) {
+    auto out = dump ? stderr : stdout;
+    uint64_t data_bytes = write_bytes + clone_bytes + unencoded_bytes;
+
+    fprintf(out, "%u stream%s, %s in %.2f seconds (%.1f MB/s)\n\n", num_streams, num_streams == 1 ? "" : "s",
+            human_size(total).c_str(), secs, secs > 0 ? (double)total / secs / 1048576.0 : 0.0);
+
+    fprintf(out, "%-16s %12s %12s\n", "command", "count", "bytes");
+
+    for (unsigned int i = 0; i <= NUM_COMMANDS; i++) {
+        if (counts[i] == 0)
+            continue;
+
+        auto name = i < NUM_COMMANDS ? send_command_name((uint16_t)i) : "unknown";
+
+        fprintf(out, "%-16s %12llu %12s\n", name ? name : "unknown", (unsigned long long)counts[i], human_size(bytes[i]).c_str());
+    }
+
+    fprintf(out, "\nwritten: %s, cloned: %s, encoded: %s (%s unencoded)\n", human_size(write_bytes).c_str(),
+            human_size(clone_bytes).c_str(), human_size(encoded_bytes).c_str(), human_size(unencoded_bytes).c_str());
+
+    if (data_bytes > 0)
+        fprintf(out, "cloned data: %.1f%% of file data\n", (double)clone_bytes * 100.0 / (double)data_bytes);
+
+    if (top_paths == 0 || volume.empty())
+        return;
+
+    vector<pair<uint64_t, const string*>> v;
+
+    v.reserve(volume.size());
+
+    for (const auto& p : volume) {
+        v.emplace_back(p.second, &p.first);
+    }
+
+    auto n = min((size_t)top_paths, v.size());
+
+    partial_sort(v.begin(), v.begin() + n, v.end(), [](const auto& a, const auto& b) {
+        return a.first > b.first;
+    });
+
+    fprintf(out, "\nlargest %zu of %zu paths:\n", n, v.size());
+
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "%12s  %s\n", human_size(v[i].first).c_str(), v[i].second->c_str());
+    }
+}
+
+static void dump_stream(send_stream& s, send_dumper& d) {
+    while (s.read_header()) {
+        d.begin(s.version());
+
+        while (true) {
+            auto& batch = s.next_batch();
+
+            if (batch.empty())
+                break;
+
+            for (const auto& c : batch) {
+                d.command(c);
+            }
+        }
+
+        if (!s.ended())
+            throw send_stream_error(send_error::truncated, s.offset());
+    }
+}
+
+// Print the entries of an index, optionally only those for one path, so that
+// an interrupted receive can be resumed with recvbtrfs -r.
+static void list_index(const char* fn, const char* path) {
+    send_index_header h;
+    send_index_entry e;
+    string strings;
+    FILE* f;
+
+    f = fopen(fn, "rb");
+    if (!f)
+        throw errno_error("fopen", fn);
+
+    try {
+        if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, SEND_INDEX_MAGIC, sizeof(h.magic)))
+            throw runtime_error(string(fn) + " is not a send stream index");
+
+        if (h.version != SEND_INDEX_VERSION)
+            throw runtime_error(string(fn) + ": unsupported index version " + to_string(h.version));
+
+        strings.resize(h.strings_length);
+
+        if (fseeko(f, (off_t)h.strings_offset, SEEK_SET) != 0 ||
+            (h.strings_length > 0 && fread(strings.data(), h.strings_length, 1, f) != 1)) {
+            throw runtime_error(string(fn) + " is truncated");
+        }
+
+        if (fseeko(f, sizeof(h), SEEK_SET) != 0)
+            throw errno_error("fseeko", fn);
+
+        for (uint64_t i = 0; i < h.num_entries; i++) {
+            string_view p;
+
+            if (fread(&e, sizeof(e), 1, f) != 1)
+                throw runtime_error(string(fn) + " is truncated");
+
+            if (e.path + e.path_length > strings.length())
+                throw runtime_error(string(fn) + " is corrupt");
+
+            p = string_view(strings).substr(e.path, e.path_length);
+
+            if (path && p != path)
+                continue;
+
+            auto name = send_command_name(e.cmd);
+
+            printf("%llu\t%u\t%s\t%llu\t%.*s\n", (unsigned long long)e.offset, e.stream, name ? name : "unknown",
+                   (unsigned long long)e.inode, (int)p.length(), p.data());
+        }
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+
+    fclose(f);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: senddump [-d] [-s] [-n paths] [-i index] [file]\n");
+    fprintf(stderr, "       senddump -l index [path]\n\n");
+    fprintf(stderr, "Checks a btrfs send stream, reading from stdin if no file is given.\n\n");
+    fprintf(stderr, "  -d            print every command, as send-dump.pl did\n");
+    fprintf(stderr, "  -s            print statistics (the default without -d or -i)\n");
+    fprintf(stderr, "  -n <paths>    number of paths to list in the statistics (default: 20)\n");
+    fprintf(stderr, "  -i <index>    write an index of the stream's commands\n");
+    fprintf(stderr, "  -l <index>    list the offset, stream, command, inode and path of each command in an index\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* index_fn = nullptr;
+    const char* list_fn = nullptr;
+    bool dump = false, stats = false;
+    unsigned int top_paths = 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dsn:i:l:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dump = true;
+            break;
+
+            case 's':
+                stats = true;
+            break;
+
+            case 'n':
+                top_paths = (unsigned int)strtoul(optarg, nullptr, 10);
+            break;
+
+            case 'i':
+                index_fn = optarg;
+            break;
+
+            case 'l':
+                list_fn = optarg;
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind < argc - 1) {
+        usage();
+        return 1;
+    }
+
+    try {
+        if (list_fn) {
+            list_index(list_fn, optind < argc ? argv[optind] : nullptr);
+            return 0;
+        }
+
+        if (!dump && !index_fn)
+            stats = true;
+
+#ifdef __x86_64__
+        if (__builtin_cpu_supports("sse4.2"))
+            calc_crc32c = calc_crc32c_hw;
+#endif
+
+        const char* file = optind < argc ? argv[optind] : nullptr;
+        auto start_time = chrono::steady_clock::now();
+        unique_ptr<index_writer> index;
+        struct stat st;
+        int fd = STDIN_FILENO;
+        uint64_t total;
+
+        if (index_fn)
+            index.reset(new index_writer(index_fn));
+
+        send_dumper d(dump, index.get());
+
+        if (file) {
+            fd = open(file, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                throw errno_error("open", file);
+        }
+
+        if (fstat(fd, &st) != 0)
+            throw errno_error("fstat", file ? file : "stdin");
+
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED)
+                throw errno_error("mmap", file ? file : "stdin");
+
+            madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+            send_stream s((const uint8_t*)addr, (size_t)st.st_size);
+
+            try {
+                dump_stream(s, d);
+            } catch (...) {
+                munmap(addr, (size_t)st.st_size);
+                throw;
+            }
+
+            total = s.offset();
+
+            munmap(addr, (size_t)st.st_size);
+        } else {
+            fd_source src(fd);
+            send_stream s(src);
+
+            dump_stream(s, d);
+
+            total = s.offset();
+        }
+
+        if (fd != STDIN_FILENO)
+            close(fd);
+
+        if (index)
+            index->finish();
+
+        if (stats)
+            d.print_stats(top_paths, total, chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+    } catch (const exception& e) {
+        fflush(stdout);
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+
+// On-disk format of the index written by senddump -i. There's one entry per
+// command, in stream order, so a reader can binary search on offset. Paths
+// are stored once each in a string table following the entries.
+
+#define SEND_INDEX_MAGIC    "btrfs-sendidx"
+#define SEND_INDEX_VERSION  1
+
+#pragma pack(push, 1)
+
+typedef struct {
+    char magic[14];
+    uint16_t version;
+    uint64_t num_entries;
+    uint64_t strings_offset;
+    uint64_t strings_length;
+} send_index_header;
+
+typedef struct {
+    uint64_t offset; // of the command header, within the input
+    uint64_t inode; // 0 if the stream doesn't tell us
+    uint64_t path; // offset into the string table
+    uint32_t path_length;
+    uint16_t cmd;
+    uint16_t stream; // number of the stream within the input, for concatenated streams
+} send_index_entry;
+
+#pragma pack(pop)
+
+static_assert(sizeof(send_index_header) == 40, "send_index_header has wrong size");
+static_assert(sizeof(send_index_entry) == 32, "send_index_entry has wrong size");
@@ -0,0 +1,447 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "sendstream.h"
+#include "../crc32c.h"
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+
+using namespace std;
+
+static string error_message(send_error code, uint64_t offset, uint32_t value) {
+    char s[255];
+
+    switch (code) {
+        case send_error::read_failed:
+            snprintf(s, sizeof(s), "read failed at offset %" PRIu64, offset);
+        break;
+
+        case send_error::truncated:
+            snprintf(s, sizeof(s), "stream truncated at offset %" PRIu64, offset);
+        break;
+
+        case send_error::not_a_send_stream:
+            snprintf(s, sizeof(s), "not a send stream (offset %" PRIu64 ")", offset);
+        break;
+
+        case send_error::unsupported_version:
+            snprintf(s, sizeof(s), "unsupported stream version %u", value);
+        break;
+
+        case send_error::csum_error:
+            snprintf(s, sizeof(s), "checksum mismatch in command at offset %" PRIu64, offset);
+        break;
+
+        case send_error::command_too_long:
+            snprintf(s, sizeof(s), "command at offset %" PRIu64 " is too long (%u bytes)", offset, value);
+        break;
+
+        case send_error::bad_tlv:
+            snprintf(s, sizeof(s), "missing or malformed TLV %u in command at offset %" PRIu64, value, offset);
+        break;
+
+        case send_error::unknown_command:
+            snprintf(s, sizeof(s), "unknown command %u at offset %" PRIu64, value, offset);
+        break;
+
+        case send_error::bad_offset:
+            snprintf(s, sizeof(s), "offset %" PRIu64 " is not the start of a command", offset);
+        break;
+
+        default:
+            snprintf(s, sizeof(s), "error at offset %" PRIu64, offset);
+    }
+
+    return s;
+}
+
+send_stream_error::send_stream_error(send_error code, uint64_t offset, uint32_t value) :
+        runtime_error(error_message(code, offset, value)), code(code), offset(offset), value(value) {
+}
+
+void send_command::parse_tlvs(uint32_t version) {
+    uint32_t off = 0;
+
+    present = 0;
+
+    while (off < length) {
+        uint16_t type, len;
+
+        if (length - off < sizeof(uint16_t))
+            throw send_stream_error(send_error::bad_tlv, offset);
+
+        memcpy(&type, data + off, sizeof(uint16_t));
+
+        // in v2 streams, data has no length and runs to the end of the command
+        if (version >= 2 && type == BTRFS_SEND_TLV_DATA) {
+            tlvs[type].data = data + off + sizeof(uint16_t);
+            tlvs[type].length = length - off - (uint32_t)sizeof(uint16_t);
+            present |= 1u << type;
+            break;
+        }
+
+        if (length - off < sizeof(btrfs_send_tlv))
+            throw send_stream_error(send_error::bad_tlv, offset, type);
+
+        memcpy(&len, data + off + offsetof(btrfs_send_tlv, length), sizeof(uint16_t));
+
+        if (length - off - sizeof(btrfs_send_tlv) < len)
+            throw send_stream_error(send_error::bad_tlv, offset, type);
+
+        if (type < SEND_TLV_SLOTS) {
+            tlvs[type].data = data + off + sizeof(btrfs_send_tlv);
+            tlvs[type].length = len;
+            present |= 1u << type;
+        }
+
+        off += (uint32_t)sizeof(btrfs_send_tlv) + len;
+    }
+}
+
+string_view send_command::string(uint16_t type) const {
+    if (!has(type))
+        throw send_stream_error(send_error::bad_tlv, offset, type);
+
+    return string_view((const char*)tlvs[type].data, tlvs[type].length);
+}
+
+uint64_t send_command::u64(uint16_t type) const {
+    uint64_t v;
+
+    memcpy(&v, fixed(type, sizeof(uint64_t)), sizeof(uint64_t));
+
+    return v;
+}
+
+uint32_t send_command::u32(uint16_t type) const {
+    uint32_t v;
+
+    memcpy(&v, fixed(type, sizeof(uint32_t)), sizeof(uint32_t));
+
+    return v;
+}
+
+const void* send_command::fixed(uint16_t type, uint32_t len) const {
+    if (!has(type) || tlvs[type].length < len)
+        throw send_stream_error(send_error::bad_tlv, offset, type);
+
+    return tlvs[type].data;
+}
+
+send_stream::send_stream(const uint8_t* data, size_t len) : src(nullptr), mem(data), memlen(len), start(0), end(len), base(0),
+                                                            eof(true), end_seen(false), stream_version(0) {
+}
+
+send_stream::send_stream(send_source& src, size_t bufsize) : src(&src), mem(nullptr), memlen(0), start(0), end(0), base(0),
+                                                             eof(false), end_seen(false), stream_version(0) {
+    buf.resize(bufsize);
+    mem = buf.data();
+}
+
+bool send_stream::fill(size_t len) {
+    if (end - start >= len)
+        return true;
+
+    if (!src || eof)
+        return false;
+
+    // move the partial command to the front, invalidating the previous batch
+
+    if (start > 0) {
+        memmove(buf.data(), buf.data() + start, end - start);
+        base += start;
+        end -= start;
+        start = 0;
+    }
+
+    if (len > buf.size()) {
+        buf.resize(len);
+        mem = buf.data();
+    }
+
+    // fill the whole buffer, so that batches are as large as possible
+
+    while (end < buf.size()) {
+        size_t ret = src->read(buf.data() + end, buf.size() - end);
+
+        if (ret == 0) {
+            eof = true;
+            break;
+        }
+
+        end += ret;
+    }
+
+    return end - start >= len;
+}
+
+bool send_stream::read_header() {
+    btrfs_send_header header;
+
+    batch.clear();
+    end_seen = false;
+
+    if (!fill(sizeof(btrfs_send_header))) {
+        if (end == start)
+            return false;
+
+        throw send_stream_error(send_error::truncated, offset());
+    }
+
+    memcpy(&header, mem + start, sizeof(btrfs_send_header));
+
+    if (memcmp(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic)))
+        throw send_stream_error(send_error::not_a_send_stream, offset());
+
+    if (header.version == 0 || header.version > BTRFS_SEND_STREAM_VERSION_MAX)
+        throw send_stream_error(send_error::unsupported_version, offset(), header.version);
+
+    stream_version = header.version;
+    start += sizeof(btrfs_send_header);
+
+    return true;
+}
+
+void send_stream::verify_batch() {
+    for (auto& c : batch) {
+        btrfs_send_command h;
+        uint32_t crc32;
+
+        memcpy(&h, c.data - sizeof(btrfs_send_command), sizeof(btrfs_send_command));
+
+        crc32 = h.csum;
+        h.csum = 0;
+
+        uint32_t calc = calc_crc32c(0, (uint8_t*)&h, sizeof(btrfs_send_command));
+
+        if (c.length > 0)
+            calc = calc_crc32c(calc, (uint8_t*)c.data, c.length);
+
+        if (calc != crc32)
+            throw send_stream_error(send_error::csum_error, c.offset);
+    }
+
+    // only look inside the commands once we know they're intact
+
+    for (auto& c : batch) {
+        c.parse_tlvs(stream_version);
+    }
+}
+
+const vector<send_command>& send_stream::next_batch() {
+    size_t batch_bytes = 0;
+
+    batch.clear();
+
+    if (end_seen)
+        return batch;
+
+    while (batch.size() < SEND_STREAM_BATCH_CMDS && batch_bytes < SEND_STREAM_BATCH) {
+        btrfs_send_command h;
+
+        if (end - start < sizeof(btrfs_send_command)) {
+            if (!batch.empty()) // refilling would move the buffer under the views
+                break;
+
+            if (!fill(sizeof(btrfs_send_command))) {
+                if (end == start)
+                    break;
+
+                throw send_stream_error(send_error::truncated, offset());
+            }
+        }
+
+        memcpy(&h, mem + start, sizeof(btrfs_send_command));
+
+        if (h.length > SEND_STREAM_MAX_COMMAND)
+            throw send_stream_error(send_error::command_too_long, offset(), h.length);
+
+        if (end - start - sizeof(btrfs_send_command) < h.length) {
+            if (!batch.empty())
+                break;
+
+            if (!fill(sizeof(btrfs_send_command) + h.length))
+                throw send_stream_error(send_error::truncated, offset());
+        }
+
+        auto& c = batch.emplace_back();
+
+        c.cmd = h.cmd;
+        c.length = h.length;
+        c.data = mem + start + sizeof(btrfs_send_command);
+        c.offset = offset();
+
+        start += sizeof(btrfs_send_command) + h.length;
+        batch_bytes += sizeof(btrfs_send_command) + h.length;
+
+        if (h.cmd == BTRFS_SEND_CMD_END) {
+            end_seen = true;
+            break;
+        }
+    }
+
+    verify_batch();
+
+    return batch;
+}
+
+bool send_stream::skip_to(uint64_t off) {
+    batch.clear();
+
+    while (offset() < off) {
+        btrfs_send_command h;
+        size_t len;
+
+        if (!fill(sizeof(btrfs_send_command)))
+            throw send_stream_error(send_error::truncated, offset());
+
+        memcpy(&h, mem + start, sizeof(btrfs_send_command));
+
+        if (h.length > SEND_STREAM_MAX_COMMAND)
+            throw send_stream_error(send_error::command_too_long, offset(), h.length);
+
+        len = sizeof(btrfs_send_command) + h.length;
+
+        // consume the command a buffer at a time, rather than making fill() hold all of it
+        while (len > 0) {
+            size_t n;
+
+            if (start == end && !fill(1))
+                throw send_stream_error(send_error::truncated, offset());
+
+            n = min(len, end - start);
+            start += n;
+            len -= n;
+        }
+
+        if (h.cmd == BTRFS_SEND_CMD_END) {
+            end_seen = true;
+            return false;
+        }
+    }
+
+    if (offset() != off)
+        throw send_stream_error(send_error::bad_offset, off);
+
+    return true;
+}
+
+const char* send_command_name(uint16_t cmd) {
+    static const char* names[] = {
+        nullptr, "subvol", "snapshot", "mkfile", "mkdir", "mknod", "mkfifo", "mksock", "symlink", "rename", "link", "unlink",
+        "rmdir", "set_xattr", "remove_xattr", "write", "clone", "truncate", "chmod", "chown", "utimes", "end", "update-extent",
+        "fallocate", "fileattr", "encoded-write"
+    };
+
+    if (cmd >= sizeof(names) / sizeof(names[0]))
+        return nullptr;
+
+    return names[cmd];
+}
+
+void send_handler::dispatch(const send_command& cmd) {
+    switch (cmd.cmd) {
+        case BTRFS_SEND_CMD_SUBVOL:
+            cmd_subvol(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_SNAPSHOT:
+            cmd_snapshot(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_MKFILE:
+        case BTRFS_SEND_CMD_MKDIR:
+        case BTRFS_SEND_CMD_MKNOD:
+        case BTRFS_SEND_CMD_MKFIFO:
+        case BTRFS_SEND_CMD_MKSOCK:
+        case BTRFS_SEND_CMD_SYMLINK:
+            cmd_mkfile(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_RENAME:
+            cmd_rename(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_LINK:
+            cmd_link(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_UNLINK:
+            cmd_unlink(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_RMDIR:
+            cmd_rmdir(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_SET_XATTR:
+            cmd_setxattr(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_REMOVE_XATTR:
+            cmd_removexattr(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_WRITE:
+            cmd_write(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_CLONE:
+            cmd_clone(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_TRUNCATE:
+            cmd_truncate(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_CHMOD:
+            cmd_chmod(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_CHOWN:
+            cmd_chown(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_UTIMES:
+            cmd_utimes(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_ENCODED_WRITE:
+            cmd_encoded_write(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_UPDATE_EXTENT:
+            cmd_update_extent(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_FALLOCATE:
+            cmd_fallocate(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_FILEATTR:
+            cmd_fileattr(cmd);
+        break;
+
+        case BTRFS_SEND_CMD_END:
+        break;
+
+        default:
+            throw send_stream_error(send_error::unknown_command, cmd.offset, cmd.cmd);
+    }
+}
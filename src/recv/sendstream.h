@@ -0,0 +1,200 @@
+/* Copyright (c) Mark Harmstone 2026
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../btrfs.h"
+
+// Portable parser for btrfs send streams, shared by the shell extension and
+// the Linux receiver. Commands are handed out in batches of views into the
+// stream, whose checksums have all been verified before any of them is
+// returned.
+
+#define SEND_STREAM_BUFFER      0x800000 // 8 MB
+#define SEND_STREAM_BATCH       0x800000 // bytes per batch when parsing from memory
+#define SEND_STREAM_BATCH_CMDS  4096
+#define SEND_STREAM_MAX_COMMAND 0x1000000 // sanity check, so a corrupt length doesn't make us allocate gigabytes
+
+#define SEND_TLV_SLOTS          32 // TLV types we index directly, i.e. up to BTRFS_SEND_TLV_ENCRYPTION
+
+enum class send_error {
+    read_failed,
+    truncated,
+    not_a_send_stream,
+    unsupported_version,
+    csum_error,
+    command_too_long,
+    bad_tlv,
+    unknown_command,
+    bad_offset
+};
+
+class send_stream_error : public std::runtime_error {
+public:
+    send_stream_error(send_error code, uint64_t offset, uint32_t value = 0);
+
+    send_error code;
+    uint64_t offset;
+    uint32_t value;
+};
+
+class send_source {
+public:
+    virtual ~send_source() = default;
+
+    // Returns the number of bytes read, or 0 at the end of the input. Should
+    // throw on error.
+    virtual size_t read(void* buf, size_t len) = 0;
+};
+
+class send_command {
+public:
+    bool has(uint16_t type) const {
+        return type < SEND_TLV_SLOTS && present & (1u << type);
+    }
+
+    bool find(uint16_t type, const void** value, uint32_t* len) const {
+        if (!has(type))
+            return false;
+
+        *value = tlvs[type].data;
+        *len = tlvs[type].length;
+
+        return true;
+    }
+
+    // The following throw send_error::bad_tlv if the TLV is missing or too short.
+    std::string_view string(uint16_t type) const;
+    uint64_t u64(uint16_t type) const;
+    uint32_t u32(uint16_t type) const;
+    const void* fixed(uint16_t type, uint32_t len) const;
+
+    uint16_t cmd;
+    uint32_t length;
+    const uint8_t* data;
+    uint64_t offset; // of the command header, within the input
+
+private:
+    friend class send_stream;
+
+    void parse_tlvs(uint32_t version);
+
+    struct {
+        const uint8_t* data;
+        uint32_t length;
+    } tlvs[SEND_TLV_SLOTS];
+
+    uint32_t present;
+};
+
+class send_stream {
+public:
+    // Parse a stream held entirely in memory, e.g. an mmap'd file. Command
+    // data points straight into the mapping.
+    send_stream(const uint8_t* data, size_t len);
+
+    // Parse a stream from a reader, through a buffer which is reused between
+    // batches.
+    send_stream(send_source& src, size_t bufsize = SEND_STREAM_BUFFER);
+
+    // Reads the header of the next stream in the input, returning false at the
+    // end of the input. Several streams may be concatenated.
+    bool read_header();
+
+    // Returns the next batch of commands, stopping after BTRFS_SEND_CMD_END.
+    // The views are only valid until the next call. An empty batch means the
+    // input has run out; check ended() to see if the stream was complete.
+    const std::vector<send_command>& next_batch();
+
+    // Skips commands without checking them, until reaching the one at offset,
+    // e.g. to resume an interrupted receive. Returns false if the stream ended
+    // first, in which case BTRFS_SEND_CMD_END has been skipped too. Throws
+    // send_error::bad_offset if offset isn't at the start of a command.
+    bool skip_to(uint64_t off);
+
+    uint32_t version() const {
+        return stream_version;
+    }
+
+    bool ended() const {
+        return end_seen;
+    }
+
+    // Whether command data outlives the batch it was returned in.
+    bool zero_copy() const {
+        return !src;
+    }
+
+    // Bytes of the input consumed so far.
+    uint64_t offset() const {
+        return base + start;
+    }
+
+private:
+    bool fill(size_t len);
+    void verify_batch();
+
+    send_source* src;
+    std::vector<uint8_t> buf;
+    const uint8_t* mem;
+    size_t memlen, start, end;
+    uint64_t base;
+    bool eof, end_seen;
+    uint32_t stream_version;
+    std::vector<send_command> batch;
+};
+
+// Returns the name of a command as printed by send-dump.pl, or nullptr if it
+// isn't one we know.
+const char* send_command_name(uint16_t cmd);
+
+class send_handler {
+public:
+    virtual ~send_handler() = default;
+
+    // Calls the handler for the command; throws send_error::unknown_command
+    // for anything it doesn't recognize. BTRFS_SEND_CMD_END is left to the
+    // caller.
+    void dispatch(const send_command& cmd);
+
+protected:
+    virtual void cmd_subvol(const send_command& cmd) = 0;
+    virtual void cmd_snapshot(const send_command& cmd) = 0;
+    virtual void cmd_mkfile(const send_command& cmd) = 0; // also MKDIR, MKNOD, MKFIFO, MKSOCK and SYMLINK
+    virtual void cmd_rename(const send_command& cmd) = 0;
+    virtual void cmd_link(const send_command& cmd) = 0;
+    virtual void cmd_unlink(const send_command& cmd) = 0;
+    virtual void cmd_rmdir(const send_command& cmd) = 0;
+    virtual void cmd_setxattr(const send_command& cmd) = 0;
+    virtual void cmd_removexattr(const send_command& cmd) = 0;
+    virtual void cmd_write(const send_command& cmd) = 0;
+    virtual void cmd_clone(const send_command& cmd) = 0;
+    virtual void cmd_truncate(const send_command& cmd) = 0;
+    virtual void cmd_chmod(const send_command& cmd) = 0;
+    virtual void cmd_chown(const send_command& cmd) = 0;
+    virtual void cmd_utimes(const send_command& cmd) = 0;
+    virtual void cmd_encoded_write(const send_command& cmd) = 0;
+    virtual void cmd_update_extent(const send_command&) { }
+    virtual void cmd_fallocate(const send_command&) { }
+    virtual void cmd_fileattr(const send_command&) { }
+};
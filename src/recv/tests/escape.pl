@@ -0,0 +1,212 @@
+#!/usr/bin/perl
+
+# Regression test for recvbtrfs: feeds it streams which try to use symlinks
+# they've created to get at something outside the destination directory,
+# and checks that it didn't.
+#
+# Usage: escape.pl <path to recvbtrfs>
+
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+
+my $recvbtrfs = $ARGV[0] or die "Usage: escape.pl <path to recvbtrfs>\n";
+
+my @crctable;
+
+for my $i (0..255) {
+    my $c = $i;
+
+    for (1..8) {
+        $c = $c & 1 ? ($c >> 1) ^ 0x82f63b78 : $c >> 1;
+    }
+
+    $crctable[$i] = $c;
+}
+
+sub crc32c {
+    my ($data) = @_;
+    my $rem = 0;
+
+    for my $b (unpack("C*", $data)) {
+        $rem = $crctable[($rem ^ $b) & 0xff] ^ ($rem >> 8);
+    }
+
+    return $rem;
+}
+
+sub tlv {
+    my ($type, $data) = @_;
+
+    return pack("vv", $type, length($data)).$data;
+}
+
+sub path { return tlv(15, $_[0]); }
+sub path_to { return tlv(16, $_[0]); }
+sub path_link { return tlv(17, $_[0]); }
+sub u64 { return tlv($_[0], pack("Q<", $_[1])); }
+
+sub cmd {
+    my ($type, @tlvs) = @_;
+    my $data = join("", @tlvs);
+    my $crc = crc32c(pack("VvV", length($data), $type, 0).$data);
+
+    return pack("VvV", length($data), $type, $crc).$data;
+}
+
+my $uuid = tlv(1, "\x01" x 16);
+
+sub stream {
+    return "btrfs-stream\0".pack("V", 1).cmd(1, path("sv"), $uuid, u64(2, 1)).join("", @_).cmd(21);
+}
+
+sub symlink_cmd { return cmd(8, path($_[0]), path_link($_[1])); }
+sub mkfile { return cmd(3, path($_[0])); }
+
+# Each one gets $out, the directory it's trying to escape to, and returns the
+# stream. If fails is set, recvbtrfs should have given up rather than quietly
+# skipping the command.
+my @tests = (
+    {
+        name => "create through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), mkfile("esc/pwned")); },
+    },
+    {
+        name => "mkdir through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(4, path("esc/pwned"))); },
+    },
+    {
+        name => "write through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(15, path("esc/victim"), u64(18, 0), tlv(19, "pwned"))); },
+    },
+    {
+        name => "write through a symlink",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("t", "$_[0]/victim"), cmd(15, path("t"), u64(18, 0), tlv(19, "pwned"))); },
+    },
+    {
+        name => "truncate through a symlink",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("t", "$_[0]/victim"), cmd(17, path("t"), u64(4, 0))); },
+    },
+    {
+        name => "chmod through a symlink",
+        fails => 0,
+        stream => sub { stream(symlink_cmd("t", "$_[0]/victim"), cmd(18, path("t"), u64(5, 0777))); },
+    },
+    {
+        name => "chmod through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(18, path("esc/victim"), u64(5, 0777))); },
+    },
+    {
+        name => "utimes through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(20, path("esc/victim"), tlv(11, "\0" x 12), tlv(10, "\0" x 12))); },
+    },
+    {
+        name => "setxattr through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(13, path("esc/victim"), tlv(13, "user.pwned"), tlv(14, "1"))); },
+    },
+    {
+        name => "rename out through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(mkfile("f"), symlink_cmd("esc", $_[0]), cmd(9, path("f"), path_to("esc/pwned"))); },
+    },
+    {
+        name => "rename over a file through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(mkfile("f"), symlink_cmd("esc", $_[0]), cmd(9, path("f"), path_to("esc/victim"))); },
+    },
+    {
+        name => "unlink through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(11, path("esc/victim"))); },
+    },
+    {
+        name => "hard link out through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(mkfile("f"), symlink_cmd("esc", $_[0]), cmd(10, path("esc/pwned"), path_link("f"))); },
+    },
+    {
+        name => "hard link in through a symlinked directory",
+        fails => 1,
+        stream => sub { stream(symlink_cmd("esc", $_[0]), cmd(10, path("stolen"), path_link("esc/victim")),
+                               cmd(15, path("stolen"), u64(18, 0), tlv(19, "pwned"))); },
+    },
+    {
+        name => "clone from a symlinked directory",
+        fails => 1,
+        stream => sub { stream(mkfile("f"), symlink_cmd("esc", $_[0]),
+                               cmd(16, path("f"), u64(18, 0), u64(24, 9), tlv(20, "\x01" x 16), u64(21, 1), tlv(22, "esc/victim"), u64(23, 0))); },
+    },
+);
+
+my $failed = 0;
+
+for my $t (@tests) {
+    my $tmp = tempdir(CLEANUP => 1);
+    my $out = "$tmp/outside";
+    my $dest = "$tmp/dest";
+    my @problems;
+
+    mkdir($out) or die "mkdir $out: $!";
+    mkdir($dest) or die "mkdir $dest: $!";
+
+    open(my $f, ">", "$out/victim") or die "$out/victim: $!";
+    print $f "original\n";
+    close($f);
+
+    chmod(0644, "$out/victim");
+    utime(1000000000, 1000000000, "$out/victim");
+
+    open($f, ">", "$tmp/stream") or die "$tmp/stream: $!";
+    binmode($f);
+    print $f $t->{stream}->($out);
+    close($f);
+
+    my $ret = system("\"$recvbtrfs\" -f \"$tmp/stream\" \"$dest\" 2>/dev/null");
+
+    if ($ret == -1) {
+        die "Could not run $recvbtrfs: $!\n";
+    } elsif ($ret & 127) {
+        push(@problems, "recvbtrfs died with signal ".($ret & 127));
+    } elsif ($t->{fails} && $ret == 0) {
+        push(@problems, "recvbtrfs succeeded");
+    }
+
+    opendir(my $d, $out) or die "opendir $out: $!";
+    my @entries = sort(grep { $_ ne "." && $_ ne ".." } readdir($d));
+    closedir($d);
+
+    push(@problems, "$out contains ".join(", ", @entries)) if join(",", @entries) ne "victim";
+
+    my @st = lstat("$out/victim");
+
+    if (!@st) {
+        push(@problems, "victim has gone");
+    } else {
+        push(@problems, sprintf("victim has mode %o", $st[2] & 07777)) if ($st[2] & 07777) != 0644;
+        push(@problems, "victim has nlink $st[3]") if $st[3] != 1;
+        push(@problems, "victim has mtime $st[9]") if $st[9] != 1000000000;
+
+        open($f, "<", "$out/victim") or die "$out/victim: $!";
+        my $contents = do { local $/; <$f> };
+        close($f);
+
+        push(@problems, "victim has changed") if $contents ne "original\n";
+    }
+
+    if (@problems) {
+        print "FAIL: $t->{name}: ".join("; ", @problems)."\n";
+        $failed++;
+    } else {
+        print "ok: $t->{name}\n";
+    }
+}
+
+exit($failed ? 1 : 0);
@@ -33,12 +33,21 @@ WORK_QUEUE_ITEM wqi;
 
 static const WCHAR option_mounted[] = L"Mounted";
 
+static uint32_t round_down_power_of_two(uint32_t v) {
+    while (v & (v - 1)) {
+        v &= v - 1;
+    }
+
+    return v;
+}
+
 NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
                    maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus,
-                   norootdirus, nodatacowus;
+                   norootdirus, nodatacowus, extentcachesizeus, adaptivelevelus, adaptivelevelminus,
+                   adaptivelevelmaxus, compresspartsizeus, readaheadgranularityus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -51,6 +60,9 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->readonly = mount_readonly;
     options->zlib_level = mount_zlib_level;
     options->zstd_level = mount_zstd_level;
+    options->adaptive_level = mount_adaptive_level;
+    options->adaptive_level_min = mount_adaptive_level_min;
+    options->adaptive_level_max = mount_adaptive_level_max;
     options->flush_interval = mount_flush_interval;
     options->max_inline = min(mount_max_inline, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - sizeof(EXTENT_DATA) + 1);
     options->skip_balance = mount_skip_balance;
@@ -61,6 +73,9 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->subvol_id = 0;
     options->no_root_dir = mount_no_root_dir;
     options->nodatacow = mount_nodatacow;
+    options->extent_cache_size = mount_extent_cache_size;
+    options->compress_part_size = mount_compress_part_size;
+    options->read_ahead_granularity = mount_read_ahead_granularity;
 
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
     path.Buffer = ExAllocatePoolWithTag(PagedPool, path.Length, ALLOC_TAG);
@@ -126,6 +141,12 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
     RtlInitUnicodeString(&norootdirus, L"NoRootDir");
     RtlInitUnicodeString(&nodatacowus, L"NoDataCOW");
+    RtlInitUnicodeString(&extentcachesizeus, L"ExtentCacheSize");
+    RtlInitUnicodeString(&adaptivelevelus, L"AdaptiveLevel");
+    RtlInitUnicodeString(&adaptivelevelminus, L"AdaptiveLevelMin");
+    RtlInitUnicodeString(&adaptivelevelmaxus, L"AdaptiveLevelMax");
+    RtlInitUnicodeString(&compresspartsizeus, L"CompressPartSize");
+    RtlInitUnicodeString(&readaheadgranularityus, L"ReadAheadGranularity");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -206,6 +227,30 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
                 options->nodatacow = *val;
+            } else if (FsRtlAreNamesEqual(&extentcachesizeus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->extent_cache_size = *val;
+            } else if (FsRtlAreNamesEqual(&adaptivelevelus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->adaptive_level = *val != 0 ? true : false;
+            } else if (FsRtlAreNamesEqual(&adaptivelevelminus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->adaptive_level_min = *val;
+            } else if (FsRtlAreNamesEqual(&adaptivelevelmaxus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->adaptive_level_max = *val;
+            } else if (FsRtlAreNamesEqual(&compresspartsizeus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->compress_part_size = *val;
+            } else if (FsRtlAreNamesEqual(&readaheadgranularityus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->read_ahead_granularity = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08lx\n", Status);
@@ -222,9 +267,32 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     if (options->zstd_level > (uint32_t)ZSTD_maxCLevel())
         options->zstd_level = ZSTD_maxCLevel();
 
+    if (options->adaptive_level_min == 0)
+        options->adaptive_level_min = 1;
+
+    if (options->adaptive_level_max < options->adaptive_level_min)
+        options->adaptive_level_max = options->adaptive_level_min;
+
     if (options->flush_interval == 0)
         options->flush_interval = mount_flush_interval;
 
+    // Both have to be powers of two. Compressed extents can't be bigger than
+    // 128 KB, or Linux won't read them.
+
+    options->compress_part_size = round_down_power_of_two(options->compress_part_size);
+
+    if (options->compress_part_size < Vcb->superblock.sector_size)
+        options->compress_part_size = Vcb->superblock.sector_size;
+    else if (options->compress_part_size > COMPRESSED_EXTENT_SIZE)
+        options->compress_part_size = COMPRESSED_EXTENT_SIZE;
+
+    options->read_ahead_granularity = round_down_power_of_two(options->read_ahead_granularity);
+
+    if (options->read_ahead_granularity < PAGE_SIZE)
+        options->read_ahead_granularity = PAGE_SIZE;
+    else if (options->read_ahead_granularity > MAX_READ_AHEAD_GRANULARITY)
+        options->read_ahead_granularity = MAX_READ_AHEAD_GRANULARITY;
+
     Status = STATUS_SUCCESS;
 
 end2:
@@ -821,6 +889,13 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
     get_registry_value(h, L"NoRootDir", REG_DWORD, &mount_no_root_dir, sizeof(mount_no_root_dir));
     get_registry_value(h, L"NoDataCOW", REG_DWORD, &mount_nodatacow, sizeof(mount_nodatacow));
+    get_registry_value(h, L"ExtentCacheSize", REG_DWORD, &mount_extent_cache_size, sizeof(mount_extent_cache_size));
+    get_registry_value(h, L"AdaptiveLevel", REG_DWORD, &mount_adaptive_level, sizeof(mount_adaptive_level));
+    get_registry_value(h, L"AdaptiveLevelMin", REG_DWORD, &mount_adaptive_level_min, sizeof(mount_adaptive_level_min));
+    get_registry_value(h, L"AdaptiveLevelMax", REG_DWORD, &mount_adaptive_level_max, sizeof(mount_adaptive_level_max));
+    get_registry_value(h, L"CompressPartSize", REG_DWORD, &mount_compress_part_size, sizeof(mount_compress_part_size));
+    get_registry_value(h, L"ReadAheadGranularity", REG_DWORD, &mount_read_ahead_granularity, sizeof(mount_read_ahead_granularity));
+    get_registry_value(h, L"SendBufferSize", REG_DWORD, &send_buffer_size, sizeof(send_buffer_size));
 
     if (!refresh)
         get_registry_value(h, L"NoPNP", REG_DWORD, &no_pnp, sizeof(no_pnp));
@@ -56,19 +56,8 @@ static void log_file_checksum_error(device_extension* Vcb, uint64_t addr, uint64
     NTSTATUS Status;
     ULONG utf16len;
 
-    le = Vcb->roots.Flink;
-    while (le != &Vcb->roots) {
-        root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-        if (r2->id == subvol) {
-            r = r2;
-            break;
-        }
-
-        le = le->Flink;
-    }
-
-    if (!r) {
+    Status = find_root(Vcb, subvol, &r, NULL);
+    if (!NT_SUCCESS(Status)) {
         ERR("could not find subvol %I64x\n", subvol);
         return;
     }
@@ -119,21 +108,8 @@ static void log_file_checksum_error(device_extension* Vcb, uint64_t addr, uint64
 
                 InsertTailList(&parts, &pp->list_entry);
 
-                r = NULL;
-
-                le = Vcb->roots.Flink;
-                while (le != &Vcb->roots) {
-                    root* r2 = CONTAINING_RECORD(le, root, list_entry);
-
-                    if (r2->id == tp.item->key.offset) {
-                        r = r2;
-                        break;
-                    }
-
-                    le = le->Flink;
-                }
-
-                if (!r) {
+                Status = find_root(Vcb, tp.item->key.offset, &r, NULL);
+                if (!NT_SUCCESS(Status)) {
                     ERR("could not find subvol %I64x\n", tp.item->key.offset);
                     goto end;
                 }
@@ -65,20 +65,79 @@ typedef struct {
     EXTENT_DATA data;
 } send_ext;
 
+typedef struct {
+    uint8_t* data;
+    ULONG datalen;
+} send_segment;
+
+typedef struct {
+    uint64_t address;
+    uint32_t length;
+    uint8_t* buf;
+    void* csum;
+    NTSTATUS Status;
+    KEVENT event;
+    LIST_ENTRY list_entry;
+    LIST_ENTRY pending_list_entry;
+} send_read;
+
+typedef struct {
+    KEY start;
+    KEY end; // exclusive
+} send_diff_range;
+
+typedef struct {
+    uint64_t address;
+    uint64_t size; // 0 if slot is empty
+    root* r; // NULL if we know there's no clone source
+    uint64_t inode;
+    uint64_t file_offset;
+    uint64_t offset; // range of the extent covered by the source, or by the seed we failed to find one for
+    uint64_t num_bytes;
+} send_clone_cache_entry;
+
 typedef struct {
     device_extension* Vcb;
     root* root;
     root* parent;
     uint8_t* data;
     ULONG datalen;
+    uint8_t* buffer;
+    send_segment* segs;
+    ULONG num_segs;
+    ULONG fill_seg;
+    ULONG drain_seg;
+    ULONG drain_off;
+    ULONG full_segs;
+    KSPIN_LOCK ring_lock;
     ULONG num_clones;
     root** clones;
+    ULONG version;
+    ULONG max_write;
+    ULONG read_len;
+    bool read_ahead;
+    LIST_ENTRY reads;
+    ULONG reads_size;
+    LIST_ENTRY* ra_le;
+    uint64_t ra_off;
+    HANDLE ra_thread;
+    KSPIN_LOCK ra_lock;
+    LIST_ENTRY ra_pending;
+    KEVENT ra_event;
+    KEVENT ra_finished;
+    bool ra_exit;
     LIST_ENTRY orphans;
     LIST_ENTRY dirs;
     LIST_ENTRY pending_rmdirs;
     KEVENT buffer_event;
     send_dir* root_dir;
     send_info* send;
+    send_diff_range* diff_ranges;
+    ULONG num_diff_ranges;
+    ULONG diff_pos;
+    bool diff_done;
+    send_clone_cache_entry* clone_cache;
+    btrfs_send_stats stats;
 
     struct {
         uint64_t inode;
@@ -108,7 +167,13 @@ typedef struct {
 } send_context;
 
 #define MAX_SEND_WRITE 0xc000 // 48 KB
+#define MAX_SEND_WRITE_V2 0x20000 // 128 KB
 #define SEND_BUFFER_LENGTH 0x100000 // 1 MB
+#define MAX_SEND_SEGMENTS 64
+#define SEND_CLONE_CACHE_SIZE 1024 // must be a power of two
+#define SEND_MAX_CLONE_CANDIDATES 64
+#define SEND_READ_LENGTH 0x100000 // 1 MB
+#define SEND_READ_AHEAD 0x400000 // 4 MB
 
 static NTSTATUS find_send_dir(send_context* context, uint64_t dir, uint64_t generation, send_dir** psd, bool* added_dummy);
 static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2);
@@ -141,6 +206,25 @@ static void send_add_tlv(send_context* context, uint16_t type, void* data, uint1
     context->datalen += sizeof(btrfs_send_tlv) + length;
 }
 
+// In v2 streams the data TLV has no length, and runs to the end of the command
+static void send_add_tlv_data(send_context* context, void* data, ULONG length) {
+    if (context->version >= 2) {
+        *(uint16_t*)&context->data[context->datalen] = BTRFS_SEND_TLV_DATA;
+        context->datalen += sizeof(uint16_t);
+    } else {
+        btrfs_send_tlv* tlv = (btrfs_send_tlv*)&context->data[context->datalen];
+
+        tlv->type = BTRFS_SEND_TLV_DATA;
+        tlv->length = (uint16_t)length;
+        context->datalen += sizeof(btrfs_send_tlv);
+    }
+
+    if (length > 0 && data)
+        RtlCopyMemory(&context->data[context->datalen], data, length);
+
+    context->datalen += length;
+}
+
 static char* uint64_to_char(uint64_t num, char* buf) {
     char *tmp, tmp2[20];
 
@@ -1599,9 +1683,66 @@ static NTSTATUS flush_refs(send_context* context, traverse_ptr* tp1, traverse_pt
     return STATUS_SUCCESS;
 }
 
+static void next_segment(send_context* context) {
+    context->data = context->segs[context->fill_seg].data;
+    context->datalen = 0;
+}
+
+// Hands the segment we've been filling over to read_send_buffer. Returns true if the ring
+// is now full, in which case the caller has to wait on cleared_event and call next_segment.
+static bool queue_segment(send_context* context) {
+    KIRQL irql;
+    bool full;
+
+    KeAcquireSpinLock(&context->ring_lock, &irql);
+
+    context->segs[context->fill_seg].datalen = context->datalen;
+    context->fill_seg = (context->fill_seg + 1) % context->num_segs;
+    context->full_segs++;
+
+    full = context->full_segs == context->num_segs;
+
+    if (full && !context->send->cancelling)
+        KeClearEvent(&context->send->cleared_event);
+
+    KeSetEvent(&context->buffer_event, 0, false);
+
+    KeReleaseSpinLock(&context->ring_lock, irql);
+
+    if (!full)
+        next_segment(context);
+
+    return full;
+}
+
+static void wait_for_drain(send_context* context) {
+    if (context->datalen > 0 && queue_segment(context))
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+
+    while (!context->send->cancelling) {
+        KIRQL irql;
+
+        KeAcquireSpinLock(&context->ring_lock, &irql);
+
+        if (context->full_segs == 0) {
+            KeReleaseSpinLock(&context->ring_lock, irql);
+            break;
+        }
+
+        KeClearEvent(&context->send->cleared_event);
+
+        KeReleaseSpinLock(&context->ring_lock, irql);
+
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+    }
+}
+
 static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
     NTSTATUS Status;
     KEY key1, key2;
+    bool full;
+
+    full = queue_segment(context);
 
     if (tp1)
         key1 = tp1->item->key;
@@ -1609,11 +1750,16 @@ static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, travers
     if (tp2)
         key2 = tp2->item->key;
 
+    // Give up the tree lock at every handoff, not just when we have to wait,
+    // so that a flush waiting for it exclusively gets its turn - otherwise
+    // everyone else on the volume would be stuck behind it until the send
+    // finished.
     ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, true);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+    if (full) {
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+        next_segment(context);
+    }
 
     ExAcquireResourceSharedLite(&context->Vcb->tree_lock, true);
 
@@ -1934,12 +2080,46 @@ static bool send_add_tlv_clone_path(send_context* context, root* r, uint64_t ino
     return true;
 }
 
-static bool try_clone_edr(send_context* context, send_ext* se, EXTENT_DATA_REF* edr) {
+static bool send_clone_command(send_context* context, send_ext* se, root* r, uint64_t inode, uint64_t file_offset, uint64_t offset) {
+    EXTENT_DATA2* seed2 = (EXTENT_DATA2*)se->data.data;
+    uint64_t clone_offset = file_offset + seed2->offset - offset;
+    uint64_t clone_len = min(context->lastinode.size - se->offset, seed2->num_bytes);
+    ULONG pos;
+
+    if ((clone_offset & (context->Vcb->superblock.sector_size - 1)) != 0 || (clone_len & (context->Vcb->superblock.sector_size - 1)) != 0)
+        return false;
+
+    pos = context->datalen;
+
+    send_command(context, BTRFS_SEND_CMD_CLONE);
+
+    send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_CLONE_LENGTH, &clone_len, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+    send_add_tlv(context, BTRFS_SEND_TLV_CLONE_UUID, r->root_item.rtransid == 0 ? &r->root_item.uuid : &r->root_item.received_uuid, sizeof(BTRFS_UUID));
+    send_add_tlv(context, BTRFS_SEND_TLV_CLONE_CTRANSID, &r->root_item.ctransid, sizeof(uint64_t));
+
+    if (!send_add_tlv_clone_path(context, r, inode)) {
+        context->datalen = pos;
+        return false;
+    }
+
+    send_add_tlv(context, BTRFS_SEND_TLV_CLONE_OFFSET, &clone_offset, sizeof(uint64_t));
+
+    send_command_finish(context, pos);
+
+    context->stats.bytes_cloned += clone_len;
+
+    return true;
+}
+
+static bool try_clone_edr(send_context* context, send_ext* se, EXTENT_DATA_REF* edr, ULONG* candidates, bool* covered, send_clone_cache_entry* cce) {
     NTSTATUS Status;
     root* r = NULL;
     KEY searchkey;
     traverse_ptr tp;
     EXTENT_DATA2* seed2 = (EXTENT_DATA2*)se->data.data;
+    uint64_t end;
 
     if (context->parent && edr->root == context->parent->id)
         r = context->parent;
@@ -1958,9 +2138,20 @@ static bool try_clone_edr(send_context* context, send_ext* se, EXTENT_DATA_REF*
     if (!r)
         return false;
 
+    (*candidates)++;
+    context->stats.clone_candidates++;
+
+    // The backref's offset is the file offset of the extent's start, so any items
+    // using it lie within the extent's decoded length of there.
+
     searchkey.obj_id = edr->objid;
     searchkey.obj_type = TYPE_EXTENT_DATA;
-    searchkey.offset = 0;
+    searchkey.offset = edr->offset;
+
+    end = edr->offset + se->data.decoded_size;
+
+    if (end < edr->offset) // wrapped around
+        searchkey.offset = 0;
 
     Status = find_item(context->Vcb, r, &tp, &searchkey, false, NULL);
     if (!NT_SUCCESS(Status)) {
@@ -1972,6 +2163,9 @@ static bool try_clone_edr(send_context* context, send_ext* se, EXTENT_DATA_REF*
         traverse_ptr next_tp;
 
         if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+            if (tp.item->key.offset >= end)
+                break;
+
             if (tp.item->size < sizeof(EXTENT_DATA))
                 ERR("(%I64x,%x,%I64x) has size %u, not at least %Iu as expected\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_DATA));
             else {
@@ -1984,30 +2178,21 @@ static bool try_clone_edr(send_context* context, send_ext* se, EXTENT_DATA_REF*
                     else {
                         EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
 
-                        if (ed2->address == seed2->address && ed2->size == seed2->size && seed2->offset <= ed2->offset && seed2->offset + seed2->num_bytes >= ed2->offset + ed2->num_bytes) {
-                            uint64_t clone_offset = tp.item->key.offset + ed2->offset - seed2->offset;
-                            uint64_t clone_len = min(context->lastinode.size - se->offset, ed2->num_bytes);
-
-                            if ((clone_offset & (context->Vcb->superblock.sector_size - 1)) == 0 && (clone_len & (context->Vcb->superblock.sector_size - 1)) == 0) {
-                                ULONG pos = context->datalen;
-
-                                send_command(context, BTRFS_SEND_CMD_CLONE);
-
-                                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(uint64_t));
-                                send_add_tlv(context, BTRFS_SEND_TLV_CLONE_LENGTH, &clone_len, sizeof(uint64_t));
-                                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-                                send_add_tlv(context, BTRFS_SEND_TLV_CLONE_UUID, r->root_item.rtransid == 0 ? &r->root_item.uuid : &r->root_item.received_uuid, sizeof(BTRFS_UUID));
-                                send_add_tlv(context, BTRFS_SEND_TLV_CLONE_CTRANSID, &r->root_item.ctransid, sizeof(uint64_t));
-
-                                if (!send_add_tlv_clone_path(context, r, tp.item->key.obj_id))
-                                    context->datalen = pos;
-                                else {
-                                    send_add_tlv(context, BTRFS_SEND_TLV_CLONE_OFFSET, &clone_offset, sizeof(uint64_t));
-
-                                    send_command_finish(context, pos);
-
-                                    return true;
+                        if (ed2->address == seed2->address && ed2->size == seed2->size && ed2->offset <= seed2->offset && ed2->offset + ed2->num_bytes >= seed2->offset + seed2->num_bytes) {
+                            *covered = true;
+
+                            if (send_clone_command(context, se, r, tp.item->key.obj_id, tp.item->key.offset, ed2->offset)) {
+                                if (cce) {
+                                    cce->address = seed2->address;
+                                    cce->size = seed2->size;
+                                    cce->r = r;
+                                    cce->inode = tp.item->key.obj_id;
+                                    cce->file_offset = tp.item->key.offset;
+                                    cce->offset = ed2->offset;
+                                    cce->num_bytes = ed2->num_bytes;
                                 }
+
+                                return true;
                             }
                         }
                     }
@@ -2032,6 +2217,29 @@ static bool try_clone(send_context* context, send_ext* se) {
     EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
     EXTENT_ITEM* ei;
     uint64_t rc = 0;
+    ULONG candidates = 0;
+    bool covered = false;
+    send_clone_cache_entry* cce = NULL;
+
+    context->stats.clone_lookups++;
+
+    if (context->clone_cache) {
+        cce = &context->clone_cache[(ed2->address >> context->Vcb->sector_shift) & (SEND_CLONE_CACHE_SIZE - 1)];
+
+        if (cce->address == ed2->address && cce->size == ed2->size) {
+            if (cce->r) {
+                if (cce->offset <= ed2->offset && cce->offset + cce->num_bytes >= ed2->offset + ed2->num_bytes &&
+                    send_clone_command(context, se, cce->r, cce->inode, cce->file_offset, cce->offset)) {
+                    context->stats.clone_cache_hits++;
+                    return true;
+                }
+            } else if (ed2->offset <= cce->offset && ed2->offset + ed2->num_bytes >= cce->offset + cce->num_bytes) {
+                // we've already failed to find anything covering a subset of this
+                context->stats.clone_cache_hits++;
+                return false;
+            }
+        }
+    }
 
     searchkey.obj_id = ed2->address;
     searchkey.obj_type = TYPE_EXTENT_ITEM;
@@ -2081,8 +2289,11 @@ static bool try_clone(send_context* context, send_ext* se) {
             if (secttype == TYPE_EXTENT_DATA_REF) {
                 EXTENT_DATA_REF* sectedr = (EXTENT_DATA_REF*)(ptr + sizeof(uint8_t));
 
-                if (try_clone_edr(context, se, sectedr))
+                if (try_clone_edr(context, se, sectedr, &candidates, &covered, cce))
                     return true;
+
+                if (candidates >= SEND_MAX_CLONE_CANDIDATES)
+                    return false;
             }
 
             len -= sectlen;
@@ -2090,181 +2301,489 @@ static bool try_clone(send_context* context, send_ext* se) {
         }
     }
 
-    if (rc >= ei->refcount)
-        return false;
+    if (rc < ei->refcount) {
+        searchkey.obj_type = TYPE_EXTENT_DATA_REF;
+        searchkey.offset = 0;
 
-    searchkey.obj_type = TYPE_EXTENT_DATA_REF;
-    searchkey.offset = 0;
+        Status = find_item(context->Vcb, context->Vcb->extent_root, &tp, &searchkey, false, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("find_item returned %08lx\n", Status);
+            return false;
+        }
 
-    Status = find_item(context->Vcb, context->Vcb->extent_root, &tp, &searchkey, false, NULL);
-    if (!NT_SUCCESS(Status)) {
-        ERR("find_item returned %08lx\n", Status);
-        return false;
-    }
+        while (true) {
+            traverse_ptr next_tp;
 
-    while (true) {
-        traverse_ptr next_tp;
+            if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+                if (tp.item->size < sizeof(EXTENT_DATA_REF))
+                    ERR("(%I64x,%x,%I64x) has size %u, not %Iu as expected\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_DATA_REF));
+                else {
+                    if (try_clone_edr(context, se, (EXTENT_DATA_REF*)tp.item->data, &candidates, &covered, cce))
+                        return true;
 
-        if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
-            if (tp.item->size < sizeof(EXTENT_DATA_REF))
-                ERR("(%I64x,%x,%I64x) has size %u, not %Iu as expected\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_DATA_REF));
-            else {
-                if (try_clone_edr(context, se, (EXTENT_DATA_REF*)tp.item->data))
-                    return true;
-            }
-        } else if (tp.item->key.obj_id > searchkey.obj_id || (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type > searchkey.obj_type))
-            break;
+                    if (candidates >= SEND_MAX_CLONE_CANDIDATES)
+                        return false;
+                }
+            } else if (tp.item->key.obj_id > searchkey.obj_id || (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type > searchkey.obj_type))
+                break;
 
-        if (find_next_item(context->Vcb, &tp, &next_tp, false, NULL))
-            tp = next_tp;
-        else
-            break;
+            if (find_next_item(context->Vcb, &tp, &next_tp, false, NULL))
+                tp = next_tp;
+            else
+                break;
+        }
+    }
+
+    // Only remember a miss if we looked at everything, and nothing covered the
+    // seed - if a source was rejected because of alignment, a different seed
+    // might still be able to use it.
+
+    if (cce && !covered) {
+        cce->address = ed2->address;
+        cce->size = ed2->size;
+        cce->r = NULL;
+        cce->offset = ed2->offset;
+        cce->num_bytes = ed2->num_bytes;
     }
 
     return false;
 }
 
-static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+static void free_send_read(send_read* sr) {
+    if (sr->csum)
+        ExFreePool(sr->csum);
+
+    ExFreePool(sr->buf);
+    ExFreePool(sr);
+}
+
+static NTSTATUS alloc_send_read(send_context* context, uint64_t address, uint32_t length, send_read** psr) {
     NTSTATUS Status;
+    send_read* sr;
 
-    if ((IsListEmpty(&context->lastinode.exts) && IsListEmpty(&context->lastinode.oldexts)) || context->lastinode.size == 0)
-        return STATUS_SUCCESS;
+    sr = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_read), ALLOC_TAG);
+    if (!sr) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    if (context->parent) {
-        Status = add_ext_holes(context->Vcb, &context->lastinode.exts, context->lastinode.size);
-        if (!NT_SUCCESS(Status)) {
-            ERR("add_ext_holes returned %08lx\n", Status);
-            return Status;
-        }
+    sr->address = address;
+    sr->length = length;
+    sr->csum = NULL;
+    sr->Status = STATUS_SUCCESS;
+    KeInitializeEvent(&sr->event, NotificationEvent, false);
 
-        Status = add_ext_holes(context->Vcb, &context->lastinode.oldexts, context->lastinode.size);
-        if (!NT_SUCCESS(Status)) {
-            ERR("add_ext_holes returned %08lx\n", Status);
-            return Status;
+    sr->buf = ExAllocatePoolWithTag(PagedPool, length, ALLOC_TAG);
+    if (!sr->buf) {
+        ERR("out of memory\n");
+        ExFreePool(sr);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!(context->lastinode.flags & BTRFS_INODE_NODATASUM)) {
+        ULONG sectors = length >> context->Vcb->sector_shift;
+
+        sr->csum = ExAllocatePoolWithTag(PagedPool, sectors * context->Vcb->csum_size, ALLOC_TAG);
+        if (!sr->csum) {
+            ERR("out of memory\n");
+            ExFreePool(sr->buf);
+            ExFreePool(sr);
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        Status = sync_ext_cutoff_points(context);
+        Status = load_csum(context->Vcb, sr->csum, address, sectors, NULL);
         if (!NT_SUCCESS(Status)) {
-            ERR("sync_ext_cutoff_points returned %08lx\n", Status);
+            ERR("load_csum returned %08lx\n", Status);
+            free_send_read(sr);
             return Status;
         }
     }
 
-    while (!IsListEmpty(&context->lastinode.exts)) {
-        send_ext* se = CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry);
-        send_ext* se2 = context->parent ? CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry) : NULL;
-        ULONG pos;
-        EXTENT_DATA2* ed2;
+    *psr = sr;
 
-        if (se2) {
-            if (se->data.type == EXTENT_TYPE_INLINE && se2->data.type == EXTENT_TYPE_INLINE &&
-                RtlCompareMemory(se->data.data, se2->data.data, (ULONG)se->data.decoded_size) == (ULONG)se->data.decoded_size) {
-                ExFreePool(se);
-                ExFreePool(se2);
-                continue;
-            }
+    return STATUS_SUCCESS;
+}
 
-            if (se->data.type == EXTENT_TYPE_REGULAR && se2->data.type == EXTENT_TYPE_REGULAR) {
-                EXTENT_DATA2 *ed2a, *ed2b;
+_Function_class_(KSTART_ROUTINE)
+static void __stdcall send_read_thread(void* ctx) {
+    send_context* context = (send_context*)ctx;
+    bool exit;
 
-                ed2a = (EXTENT_DATA2*)se->data.data;
-                ed2b = (EXTENT_DATA2*)se2->data.data;
+    do {
+        KeWaitForSingleObject(&context->ra_event, Executive, KernelMode, false, NULL);
 
-                if (RtlCompareMemory(ed2a, ed2b, sizeof(EXTENT_DATA2)) == sizeof(EXTENT_DATA2)) {
-                    ExFreePool(se);
-                    ExFreePool(se2);
-                    continue;
-                }
-            }
-        }
+        // The send thread gives up tree_lock in wait_for_flush, and on its way
+        // out, so read_data needs our own hold on it. If the send thread is
+        // holding it while it waits for us, a flush waiting for it exclusively
+        // mustn't get in the way, hence starving exclusive waiters.
+        ExAcquireSharedStarveExclusive(&context->Vcb->tree_lock, true);
 
-        if (se->data.type == EXTENT_TYPE_INLINE) {
-            pos = context->datalen;
+        do {
+            send_read* sr = NULL;
+            KIRQL irql;
 
-            send_command(context, BTRFS_SEND_CMD_WRITE);
+            KeAcquireSpinLock(&context->ra_lock, &irql);
 
-            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-            send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(uint64_t));
+            if (!IsListEmpty(&context->ra_pending))
+                sr = CONTAINING_RECORD(RemoveHeadList(&context->ra_pending), send_read, pending_list_entry);
 
-            if (se->data.compression == BTRFS_COMPRESSION_NONE)
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, se->data.data, (uint16_t)se->data.decoded_size);
-            else if (se->data.compression == BTRFS_COMPRESSION_ZLIB || se->data.compression == BTRFS_COMPRESSION_LZO || se->data.compression == BTRFS_COMPRESSION_ZSTD) {
-                ULONG inlen = se->datalen - (ULONG)offsetof(EXTENT_DATA, data[0]);
+            exit = context->ra_exit;
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, (uint16_t)se->data.decoded_size);
-                RtlZeroMemory(&context->data[context->datalen - se->data.decoded_size], (ULONG)se->data.decoded_size);
+            KeReleaseSpinLock(&context->ra_lock, irql);
 
-                if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
-                    Status = zlib_decompress(se->data.data, inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("zlib_decompress returned %08lx\n", Status);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
-                } else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
-                    if (inlen < sizeof(uint32_t)) {
-                        ERR("extent data was truncated\n");
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_INTERNAL_ERROR;
-                    } else
-                        inlen -= sizeof(uint32_t);
+            if (!sr)
+                break;
 
-                    Status = lzo_decompress(se->data.data + sizeof(uint32_t), inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size, sizeof(uint32_t));
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("lzo_decompress returned %08lx\n", Status);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
-                } else if (se->data.compression == BTRFS_COMPRESSION_ZSTD) {
-                    Status = zstd_decompress(se->data.data, inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("zlib_decompress returned %08lx\n", Status);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
-                }
-            } else {
-                ERR("unhandled compression type %x\n", se->data.compression);
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                return STATUS_NOT_IMPLEMENTED;
-            }
+            sr->Status = read_data(context->Vcb, sr->address, sr->length, sr->csum, false, sr->buf, NULL, NULL, NULL, 0, false, NormalPagePriority);
 
-            send_command_finish(context, pos);
+            KeSetEvent(&sr->event, 0, false);
+        } while (true);
 
-            ExFreePool(se);
-            if (se2) ExFreePool(se2);
-            continue;
-        }
+        ExReleaseResourceLite(&context->Vcb->tree_lock);
+    } while (!exit);
 
-        ed2 = (EXTENT_DATA2*)se->data.data;
+    KeSetEvent(&context->ra_finished, 0, false);
 
-        if (ed2->size != 0 && (context->parent || context->num_clones > 0)) {
-            if (try_clone(context, se)) {
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                continue;
-            }
-        }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
 
-        if (ed2->size == 0) { // write sparse
-            uint64_t off, offset;
+static void cancel_read_ahead(send_context* context) {
+    while (!IsListEmpty(&context->reads)) {
+        send_read* sr = CONTAINING_RECORD(RemoveHeadList(&context->reads), send_read, list_entry);
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                uint16_t length = (uint16_t)min(min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE), context->lastinode.size - se->offset - off);
+        KeWaitForSingleObject(&sr->event, Executive, KernelMode, false, NULL);
+        free_send_read(sr);
+    }
 
-                if (context->datalen > SEND_BUFFER_LENGTH) {
-                    Status = wait_for_flush(context, tp1, tp2);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("wait_for_flush returned %08lx\n", Status);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
+    context->reads_size = 0;
+}
+
+// Queues reads for the extents coming up, so the I/O overlaps with building
+// commands. Only used for full sends, where every regular extent gets read in order.
+static NTSTATUS send_read_ahead(send_context* context) {
+    NTSTATUS Status;
+
+    while (context->reads_size < SEND_READ_AHEAD && context->ra_le != &context->lastinode.exts) {
+        send_ext* se = CONTAINING_RECORD(context->ra_le, send_ext, list_entry);
+        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+        uint64_t address;
+        uint32_t length;
+        send_read* sr;
+        KIRQL irql;
+
+        if (se->data.type == EXTENT_TYPE_INLINE || ed2->size == 0) {
+            context->ra_le = context->ra_le->Flink;
+            continue;
+        }
+
+        if (se->data.compression == BTRFS_COMPRESSION_NONE) {
+            ULONG spanlen = (ULONG)min(ed2->num_bytes - context->ra_off, context->read_len);
+            ULONG skip_start;
+
+            address = ed2->address + ed2->offset + context->ra_off;
+            skip_start = address & (context->Vcb->superblock.sector_size - 1);
+            address -= skip_start;
+            length = (uint32_t)sector_align(spanlen + skip_start, context->Vcb->superblock.sector_size);
+
+            context->ra_off += spanlen;
+        } else {
+            address = ed2->address;
+            length = (uint32_t)ed2->size;
+
+            context->ra_off = ed2->num_bytes;
+        }
+
+        if (context->ra_off >= ed2->num_bytes) {
+            context->ra_le = context->ra_le->Flink;
+            context->ra_off = 0;
+        }
+
+        Status = alloc_send_read(context, address, length, &sr);
+        if (!NT_SUCCESS(Status)) {
+            ERR("alloc_send_read returned %08lx\n", Status);
+            return Status;
+        }
+
+        InsertTailList(&context->reads, &sr->list_entry);
+        context->reads_size += length;
+
+        KeAcquireSpinLock(&context->ra_lock, &irql);
+        InsertTailList(&context->ra_pending, &sr->pending_list_entry);
+        KeReleaseSpinLock(&context->ra_lock, irql);
+
+        KeSetEvent(&context->ra_event, 0, false);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_send_read(send_context* context, uint64_t address, uint32_t length, send_read** psr) {
+    NTSTATUS Status;
+    send_read* sr;
+
+    if (context->read_ahead) {
+        if (IsListEmpty(&context->reads)) {
+            Status = send_read_ahead(context);
+            if (!NT_SUCCESS(Status)) {
+                ERR("send_read_ahead returned %08lx\n", Status);
+                return Status;
+            }
+        }
+
+        if (!IsListEmpty(&context->reads)) {
+            sr = CONTAINING_RECORD(context->reads.Flink, send_read, list_entry);
+
+            if (sr->address == address && sr->length == length) {
+                RemoveEntryList(&sr->list_entry);
+                context->reads_size -= sr->length;
+
+                Status = send_read_ahead(context);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("send_read_ahead returned %08lx\n", Status);
+                    KeWaitForSingleObject(&sr->event, Executive, KernelMode, false, NULL);
+                    free_send_read(sr);
+                    return Status;
+                }
+
+                KeWaitForSingleObject(&sr->event, Executive, KernelMode, false, NULL);
+
+                if (!NT_SUCCESS(sr->Status)) {
+                    ERR("read_data returned %08lx\n", sr->Status);
+                    Status = sr->Status;
+                    free_send_read(sr);
+                    return Status;
+                }
+
+                *psr = sr;
+
+                return STATUS_SUCCESS;
+            }
+        }
+
+        WARN("read-ahead out of step, disabling\n");
+        cancel_read_ahead(context);
+        context->read_ahead = false;
+    }
+
+    Status = alloc_send_read(context, address, length, &sr);
+    if (!NT_SUCCESS(Status)) {
+        ERR("alloc_send_read returned %08lx\n", Status);
+        return Status;
+    }
+
+    Status = read_data(context->Vcb, address, length, sr->csum, false, sr->buf, NULL, NULL, NULL, 0, false, NormalPagePriority);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08lx\n", Status);
+        free_send_read(sr);
+        return Status;
+    }
+
+    *psr = sr;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS send_encoded_write(send_context* context, send_ext* se, uint8_t* compbuf, traverse_ptr* tp1, traverse_ptr* tp2) {
+    NTSTATUS Status;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+    ULONG pos;
+    uint32_t compression, encryption = BTRFS_ENCODED_IO_ENCRYPTION_NONE;
+
+    switch (se->data.compression) {
+        case BTRFS_COMPRESSION_ZLIB:
+            compression = BTRFS_ENCODED_IO_COMPRESSION_ZLIB;
+        break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            compression = BTRFS_ENCODED_IO_COMPRESSION_ZSTD;
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            compression = BTRFS_ENCODED_IO_COMPRESSION_LZO_4K + context->Vcb->sector_shift - 12;
+        break;
+
+        default:
+            ERR("unhandled compression type %x\n", se->data.compression);
+            return STATUS_NOT_IMPLEMENTED;
+    }
+
+    if (context->datalen > SEND_BUFFER_LENGTH) {
+        Status = wait_for_flush(context, tp1, tp2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("wait_for_flush returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (context->send->cancelling)
+            return STATUS_SUCCESS;
+    }
+
+    pos = context->datalen;
+
+    send_command(context, BTRFS_SEND_CMD_ENCODED_WRITE);
+
+    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+    send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, &ed2->num_bytes, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_LEN, &se->data.decoded_size, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_OFFSET, &ed2->offset, sizeof(uint64_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_COMPRESSION, &compression, sizeof(uint32_t));
+    send_add_tlv(context, BTRFS_SEND_TLV_ENCRYPTION, &encryption, sizeof(uint32_t));
+    send_add_tlv_data(context, compbuf, (ULONG)ed2->size);
+
+    send_command_finish(context, pos);
+
+    context->stats.bytes_written += ed2->num_bytes;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+    NTSTATUS Status;
+
+    if ((IsListEmpty(&context->lastinode.exts) && IsListEmpty(&context->lastinode.oldexts)) || context->lastinode.size == 0)
+        return STATUS_SUCCESS;
+
+    if (context->parent) {
+        Status = add_ext_holes(context->Vcb, &context->lastinode.exts, context->lastinode.size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_ext_holes returned %08lx\n", Status);
+            return Status;
+        }
+
+        Status = add_ext_holes(context->Vcb, &context->lastinode.oldexts, context->lastinode.size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_ext_holes returned %08lx\n", Status);
+            return Status;
+        }
+
+        Status = sync_ext_cutoff_points(context);
+        if (!NT_SUCCESS(Status)) {
+            ERR("sync_ext_cutoff_points returned %08lx\n", Status);
+            return Status;
+        }
+    }
+
+    context->ra_le = context->lastinode.exts.Flink;
+    context->ra_off = 0;
+
+    while (!IsListEmpty(&context->lastinode.exts)) {
+        send_ext* se = CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry);
+        send_ext* se2 = context->parent ? CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry) : NULL;
+        ULONG pos;
+        EXTENT_DATA2* ed2;
+
+        if (se2) {
+            if (se->data.type == EXTENT_TYPE_INLINE && se2->data.type == EXTENT_TYPE_INLINE &&
+                RtlCompareMemory(se->data.data, se2->data.data, (ULONG)se->data.decoded_size) == (ULONG)se->data.decoded_size) {
+                ExFreePool(se);
+                ExFreePool(se2);
+                continue;
+            }
+
+            if (se->data.type == EXTENT_TYPE_REGULAR && se2->data.type == EXTENT_TYPE_REGULAR) {
+                EXTENT_DATA2 *ed2a, *ed2b;
+
+                ed2a = (EXTENT_DATA2*)se->data.data;
+                ed2b = (EXTENT_DATA2*)se2->data.data;
+
+                if (RtlCompareMemory(ed2a, ed2b, sizeof(EXTENT_DATA2)) == sizeof(EXTENT_DATA2)) {
+                    ExFreePool(se);
+                    ExFreePool(se2);
+                    continue;
+                }
+            }
+        }
+
+        if (se->data.type == EXTENT_TYPE_INLINE) {
+            pos = context->datalen;
+
+            send_command(context, BTRFS_SEND_CMD_WRITE);
+
+            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+            send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(uint64_t));
+
+            if (se->data.compression == BTRFS_COMPRESSION_NONE)
+                send_add_tlv_data(context, se->data.data, (ULONG)se->data.decoded_size);
+            else if (se->data.compression == BTRFS_COMPRESSION_ZLIB || se->data.compression == BTRFS_COMPRESSION_LZO || se->data.compression == BTRFS_COMPRESSION_ZSTD) {
+                ULONG inlen = se->datalen - (ULONG)offsetof(EXTENT_DATA, data[0]);
+
+                send_add_tlv_data(context, NULL, (ULONG)se->data.decoded_size);
+                RtlZeroMemory(&context->data[context->datalen - se->data.decoded_size], (ULONG)se->data.decoded_size);
+
+                if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
+                    Status = zlib_decompress(se->data.data, inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("zlib_decompress returned %08lx\n", Status);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return Status;
+                    }
+                } else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
+                    if (inlen < sizeof(uint32_t)) {
+                        ERR("extent data was truncated\n");
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return STATUS_INTERNAL_ERROR;
+                    } else
+                        inlen -= sizeof(uint32_t);
+
+                    Status = lzo_decompress(se->data.data + sizeof(uint32_t), inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size, sizeof(uint32_t));
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("lzo_decompress returned %08lx\n", Status);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return Status;
+                    }
+                } else if (se->data.compression == BTRFS_COMPRESSION_ZSTD) {
+                    Status = zstd_decompress(se->data.data, inlen, &context->data[context->datalen - se->data.decoded_size], (uint32_t)se->data.decoded_size, NULL);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("zlib_decompress returned %08lx\n", Status);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return Status;
+                    }
+                }
+            } else {
+                ERR("unhandled compression type %x\n", se->data.compression);
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+                return STATUS_NOT_IMPLEMENTED;
+            }
+
+            send_command_finish(context, pos);
+
+            context->stats.bytes_written += se->data.decoded_size;
+
+            ExFreePool(se);
+            if (se2) ExFreePool(se2);
+            continue;
+        }
+
+        ed2 = (EXTENT_DATA2*)se->data.data;
+
+        if (ed2->size != 0 && (context->parent || context->num_clones > 0)) {
+            if (try_clone(context, se)) {
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+                continue;
+            }
+        }
+
+        if (ed2->size == 0) { // write sparse
+            uint64_t off, offset;
+
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->max_write) {
+                ULONG length = (ULONG)min(min(ed2->offset + ed2->num_bytes - off, context->max_write), context->lastinode.size - se->offset - (off - ed2->offset));
+
+                if (context->datalen > SEND_BUFFER_LENGTH) {
+                    Status = wait_for_flush(context, tp1, tp2);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("wait_for_flush returned %08lx\n", Status);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return Status;
+                    }
 
                     if (context->send->cancelling) {
                         ExFreePool(se);
@@ -2277,693 +2796,1290 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
 
                 send_command(context, BTRFS_SEND_CMD_WRITE);
 
-                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+
+                offset = se->offset + off - ed2->offset;
+                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+
+                send_add_tlv_data(context, NULL, length);
+                RtlZeroMemory(&context->data[context->datalen - length], length);
+
+                send_command_finish(context, pos);
+
+                context->stats.bytes_written += length;
+            }
+        } else if (se->data.compression == BTRFS_COMPRESSION_NONE) {
+            uint64_t off;
+
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->read_len) {
+                ULONG spanlen = (ULONG)min(ed2->offset + ed2->num_bytes - off, context->read_len);
+                uint64_t addr = ed2->address + off;
+                ULONG skip_start = addr & (context->Vcb->superblock.sector_size - 1);
+                send_read* sr;
+                ULONG spanoff;
+
+                Status = get_send_read(context, addr - skip_start, (uint32_t)sector_align(spanlen + skip_start, context->Vcb->superblock.sector_size), &sr);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("get_send_read returned %08lx\n", Status);
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return Status;
+                }
+
+                for (spanoff = 0; spanoff < spanlen; spanoff += context->max_write) {
+                    ULONG length = min(spanlen - spanoff, context->max_write);
+                    uint64_t offset = se->offset + off + spanoff - ed2->offset;
+
+                    if (offset >= context->lastinode.size)
+                        break;
+
+                    if (context->datalen > SEND_BUFFER_LENGTH) {
+                        Status = wait_for_flush(context, tp1, tp2);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("wait_for_flush returned %08lx\n", Status);
+                            free_send_read(sr);
+                            ExFreePool(se);
+                            if (se2) ExFreePool(se2);
+                            return Status;
+                        }
+
+                        if (context->send->cancelling) {
+                            free_send_read(sr);
+                            ExFreePool(se);
+                            if (se2) ExFreePool(se2);
+                            return STATUS_SUCCESS;
+                        }
+                    }
+
+                    pos = context->datalen;
+
+                    send_command(context, BTRFS_SEND_CMD_WRITE);
+
+                    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+                    send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+
+                    length = (ULONG)min(context->lastinode.size - offset, length);
+                    send_add_tlv_data(context, sr->buf + skip_start + spanoff, length);
+
+                    send_command_finish(context, pos);
+
+                    context->stats.bytes_written += length;
+                }
+
+                free_send_read(sr);
+            }
+        } else {
+            uint8_t *buf, *compbuf;
+            uint64_t off;
+            send_read* sr;
+
+            Status = get_send_read(context, ed2->address, (uint32_t)ed2->size, &sr);
+            if (!NT_SUCCESS(Status)) {
+                ERR("get_send_read returned %08lx\n", Status);
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+                return Status;
+            }
+
+            compbuf = sr->buf;
+
+            // pass extent through as-is, unless it runs past EOF
+            if (context->version >= 2 && ed2->size <= context->max_write && se->offset + ed2->num_bytes <= context->lastinode.size) {
+                Status = send_encoded_write(context, se, compbuf, tp1, tp2);
+
+                free_send_read(sr);
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("send_encoded_write returned %08lx\n", Status);
+                    return Status;
+                }
+
+                continue;
+            }
+
+            buf = ExAllocatePoolWithTag(PagedPool, (ULONG)se->data.decoded_size, ALLOC_TAG);
+            if (!buf) {
+                ERR("out of memory\n");
+                free_send_read(sr);
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
+                Status = zlib_decompress(compbuf, (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("zlib_decompress returned %08lx\n", Status);
+                    free_send_read(sr);
+                    ExFreePool(buf);
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return Status;
+                }
+            } else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
+                Status = lzo_decompress(&compbuf[sizeof(uint32_t)], (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size, sizeof(uint32_t));
+                if (!NT_SUCCESS(Status)) {
+                    ERR("lzo_decompress returned %08lx\n", Status);
+                    free_send_read(sr);
+                    ExFreePool(buf);
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return Status;
+                }
+            } else if (se->data.compression == BTRFS_COMPRESSION_ZSTD) {
+                Status = zstd_decompress(compbuf, (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size, NULL);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("zstd_decompress returned %08lx\n", Status);
+                    free_send_read(sr);
+                    ExFreePool(buf);
+                    ExFreePool(se);
+                    if (se2) ExFreePool(se2);
+                    return Status;
+                }
+            }
+
+            free_send_read(sr);
+
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->max_write) {
+                ULONG length = (ULONG)min(ed2->offset + ed2->num_bytes - off, context->max_write);
+                uint64_t offset;
+
+                if (context->datalen > SEND_BUFFER_LENGTH) {
+                    Status = wait_for_flush(context, tp1, tp2);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("wait_for_flush returned %08lx\n", Status);
+                        ExFreePool(buf);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return Status;
+                    }
+
+                    if (context->send->cancelling) {
+                        ExFreePool(buf);
+                        ExFreePool(se);
+                        if (se2) ExFreePool(se2);
+                        return STATUS_SUCCESS;
+                    }
+                }
+
+                pos = context->datalen;
+
+                send_command(context, BTRFS_SEND_CMD_WRITE);
+
+                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+
+                offset = se->offset + off - ed2->offset;
+                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+
+                length = (ULONG)min(context->lastinode.size - offset, length);
+                send_add_tlv_data(context, &buf[off], length);
+
+                send_command_finish(context, pos);
+
+                context->stats.bytes_written += length;
+            }
+
+            ExFreePool(buf);
+        }
+
+        ExFreePool(se);
+        if (se2) ExFreePool(se2);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS finish_inode(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
+    LIST_ENTRY* le;
+
+    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
+        NTSTATUS Status = flush_refs(context, tp1, tp2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_refs returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (context->send->cancelling)
+            return STATUS_SUCCESS;
+    }
+
+    if (!context->lastinode.deleting) {
+        if (context->lastinode.file) {
+            NTSTATUS Status = flush_extents(context, tp1, tp2);
+            if (!NT_SUCCESS(Status)) {
+                ERR("flush_extents returned %08lx\n", Status);
+                return Status;
+            }
+
+            if (context->send->cancelling)
+                return STATUS_SUCCESS;
+
+            send_truncate_command(context, context->lastinode.path, context->lastinode.size);
+        }
+
+        if (context->lastinode.new || context->lastinode.uid != context->lastinode.olduid || context->lastinode.gid != context->lastinode.oldgid)
+            send_chown_command(context, context->lastinode.path, context->lastinode.uid, context->lastinode.gid);
+
+        if (((context->lastinode.mode & __S_IFLNK) != __S_IFLNK || ((context->lastinode.mode & 07777) != 0777)) &&
+            (context->lastinode.new || context->lastinode.mode != context->lastinode.oldmode))
+            send_chmod_command(context, context->lastinode.path, context->lastinode.mode);
+
+        send_utimes_command(context, context->lastinode.path, &context->lastinode.atime, &context->lastinode.mtime, &context->lastinode.ctime);
+    }
+
+    while (!IsListEmpty(&context->lastinode.exts)) {
+        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry));
+    }
+
+    while (!IsListEmpty(&context->lastinode.oldexts)) {
+        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry));
+    }
+
+    if (context->parent) {
+        le = context->pending_rmdirs.Flink;
+
+        while (le != &context->pending_rmdirs) {
+            pending_rmdir* pr = CONTAINING_RECORD(le, pending_rmdir, list_entry);
+
+            if (pr->last_child_inode <= context->lastinode.inode) {
+                le = le->Flink;
+
+                send_rmdir_command(context, pr->sd->namelen, pr->sd->name);
+
+                RemoveEntryList(&pr->sd->list_entry);
+
+                if (pr->sd->name)
+                    ExFreePool(pr->sd->name);
+
+                while (!IsListEmpty(&pr->sd->deleted_children)) {
+                    deleted_child* dc = CONTAINING_RECORD(RemoveHeadList(&pr->sd->deleted_children), deleted_child, list_entry);
+                    ExFreePool(dc);
+                }
+
+                ExFreePool(pr->sd);
+
+                RemoveEntryList(&pr->list_entry);
+                ExFreePool(pr);
+            } else
+                break;
+        }
+    }
+
+    context->lastinode.inode = 0;
+    context->lastinode.o = NULL;
+
+    if (context->lastinode.path) {
+        ExFreePool(context->lastinode.path);
+        context->lastinode.path = NULL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS send_extent_data(send_context* context, traverse_ptr* tp, traverse_ptr* tp2) {
+    NTSTATUS Status;
+
+    if (tp && tp2 && tp->item->size == tp2->item->size && RtlCompareMemory(tp->item->data, tp2->item->data, tp->item->size) == tp->item->size)
+        return STATUS_SUCCESS;
+
+    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
+        Status = flush_refs(context, tp, tp2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_refs returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (context->send->cancelling)
+            return STATUS_SUCCESS;
+    }
+
+    if ((context->lastinode.mode & __S_IFLNK) == __S_IFLNK)
+        return STATUS_SUCCESS;
+
+    if (tp) {
+        EXTENT_DATA* ed;
+        EXTENT_DATA2* ed2 = NULL;
+
+        if (tp->item->size < sizeof(EXTENT_DATA)) {
+            ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+                tp->item->size, sizeof(EXTENT_DATA));
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        ed = (EXTENT_DATA*)tp->item->data;
+
+        if (ed->encryption != BTRFS_ENCRYPTION_NONE) {
+            ERR("unknown encryption type %u\n", ed->encryption);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->encoding != BTRFS_ENCODING_NONE) {
+            ERR("unknown encoding type %u\n", ed->encoding);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->compression != BTRFS_COMPRESSION_NONE && ed->compression != BTRFS_COMPRESSION_ZLIB &&
+            ed->compression != BTRFS_COMPRESSION_LZO && ed->compression != BTRFS_COMPRESSION_ZSTD) {
+            ERR("unknown compression type %u\n", ed->compression);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->type == EXTENT_TYPE_REGULAR) {
+            if (tp->item->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)) {
+                ERR("(%I64x,%x,%I64x) was %u bytes, expected %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+                    tp->item->size, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
+                return STATUS_INTERNAL_ERROR;
+            }
+
+            ed2 = (EXTENT_DATA2*)ed->data;
+        } else if (ed->type == EXTENT_TYPE_INLINE) {
+            if (tp->item->size < offsetof(EXTENT_DATA, data[0]) + ed->decoded_size && ed->compression == BTRFS_COMPRESSION_NONE) {
+                ERR("(%I64x,%x,%I64x) was %u bytes, expected %I64u\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+                    tp->item->size, offsetof(EXTENT_DATA, data[0]) + ed->decoded_size);
+                return STATUS_INTERNAL_ERROR;
+            }
+        }
+
+        if ((ed->type == EXTENT_TYPE_INLINE || (ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0)) && ed->decoded_size != 0) {
+            send_ext* se = ExAllocatePoolWithTag(PagedPool, offsetof(send_ext, data) + tp->item->size, ALLOC_TAG);
+
+            if (!se) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            se->offset = tp->item->key.offset;
+            se->datalen = tp->item->size;
+            RtlCopyMemory(&se->data, tp->item->data, tp->item->size);
+            InsertTailList(&context->lastinode.exts, &se->list_entry);
+        }
+    }
+
+    if (tp2) {
+        EXTENT_DATA* ed;
+        EXTENT_DATA2* ed2 = NULL;
+
+        if (tp2->item->size < sizeof(EXTENT_DATA)) {
+            ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
+                tp2->item->size, sizeof(EXTENT_DATA));
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        ed = (EXTENT_DATA*)tp2->item->data;
+
+        if (ed->encryption != BTRFS_ENCRYPTION_NONE) {
+            ERR("unknown encryption type %u\n", ed->encryption);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->encoding != BTRFS_ENCODING_NONE) {
+            ERR("unknown encoding type %u\n", ed->encoding);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->compression != BTRFS_COMPRESSION_NONE && ed->compression != BTRFS_COMPRESSION_ZLIB &&
+            ed->compression != BTRFS_COMPRESSION_LZO && ed->compression != BTRFS_COMPRESSION_ZSTD) {
+            ERR("unknown compression type %u\n", ed->compression);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (ed->type == EXTENT_TYPE_REGULAR) {
+            if (tp2->item->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)) {
+                ERR("(%I64x,%x,%I64x) was %u bytes, expected %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
+                    tp2->item->size, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
+                return STATUS_INTERNAL_ERROR;
+            }
+
+            ed2 = (EXTENT_DATA2*)ed->data;
+        } else if (ed->type == EXTENT_TYPE_INLINE) {
+            if (tp2->item->size < offsetof(EXTENT_DATA, data[0]) + ed->decoded_size) {
+                ERR("(%I64x,%x,%I64x) was %u bytes, expected %I64u\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
+                    tp2->item->size, offsetof(EXTENT_DATA, data[0]) + ed->decoded_size);
+                return STATUS_INTERNAL_ERROR;
+            }
+        }
+
+        if ((ed->type == EXTENT_TYPE_INLINE || (ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0)) && ed->decoded_size != 0) {
+            send_ext* se = ExAllocatePoolWithTag(PagedPool, offsetof(send_ext, data) + tp2->item->size, ALLOC_TAG);
+
+            if (!se) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            se->offset = tp2->item->key.offset;
+            se->datalen = tp2->item->size;
+            RtlCopyMemory(&se->data, tp2->item->data, tp2->item->size);
+            InsertTailList(&context->lastinode.oldexts, &se->list_entry);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+typedef struct {
+    uint16_t namelen;
+    char* name;
+    uint16_t value1len;
+    char* value1;
+    uint16_t value2len;
+    char* value2;
+    LIST_ENTRY list_entry;
+} xattr_cmp;
+
+static NTSTATUS send_xattr(send_context* context, traverse_ptr* tp, traverse_ptr* tp2) {
+    if (tp && tp2 && tp->item->size == tp2->item->size && RtlCompareMemory(tp->item->data, tp2->item->data, tp->item->size) == tp->item->size)
+        return STATUS_SUCCESS;
+
+    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
+        NTSTATUS Status = flush_refs(context, tp, tp2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_refs returned %08lx\n", Status);
+            return Status;
+        }
+
+        if (context->send->cancelling)
+            return STATUS_SUCCESS;
+    }
+
+    if (tp && tp->item->size < sizeof(DIR_ITEM)) {
+        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
+            tp->item->size, sizeof(DIR_ITEM));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (tp2 && tp2->item->size < sizeof(DIR_ITEM)) {
+        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
+            tp2->item->size, sizeof(DIR_ITEM));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (tp && !tp2) {
+        ULONG len;
+        DIR_ITEM* di;
+
+        len = tp->item->size;
+        di = (DIR_ITEM*)tp->item->data;
+
+        do {
+            ULONG pos;
+
+            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
+                ERR("(%I64x,%x,%I64x) was truncated\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset);
+                return STATUS_INTERNAL_ERROR;
+            }
+
+            pos = context->datalen;
+            send_command(context, BTRFS_SEND_CMD_SET_XATTR);
+            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, di->name, di->n);
+            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_DATA, &di->name[di->n], di->m);
+            send_command_finish(context, pos);
+
+            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
+            di = (DIR_ITEM*)&di->name[di->m + di->n];
+        } while (len > 0);
+    } else if (!tp && tp2) {
+        ULONG len;
+        DIR_ITEM* di;
+
+        len = tp2->item->size;
+        di = (DIR_ITEM*)tp2->item->data;
+
+        do {
+            ULONG pos;
+
+            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
+                ERR("(%I64x,%x,%I64x) was truncated\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset);
+                return STATUS_INTERNAL_ERROR;
+            }
+
+            pos = context->datalen;
+            send_command(context, BTRFS_SEND_CMD_REMOVE_XATTR);
+            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, di->name, di->n);
+            send_command_finish(context, pos);
+
+            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
+            di = (DIR_ITEM*)&di->name[di->m + di->n];
+        } while (len > 0);
+    } else {
+        ULONG len;
+        DIR_ITEM* di;
+        LIST_ENTRY xattrs;
+
+        InitializeListHead(&xattrs);
 
-                offset = se->offset + off;
-                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+        len = tp->item->size;
+        di = (DIR_ITEM*)tp->item->data;
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, length);
-                RtlZeroMemory(&context->data[context->datalen - length], length);
+        do {
+            xattr_cmp* xa;
 
-                send_command_finish(context, pos);
+            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
+                ERR("(%I64x,%x,%I64x) was truncated\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset);
+                return STATUS_INTERNAL_ERROR;
             }
-        } else if (se->data.compression == BTRFS_COMPRESSION_NONE) {
-            uint64_t off, offset;
-            uint8_t* buf;
 
-            buf = ExAllocatePoolWithTag(NonPagedPool, MAX_SEND_WRITE + (2 * context->Vcb->superblock.sector_size), ALLOC_TAG);
-            if (!buf) {
+            xa = ExAllocatePoolWithTag(PagedPool, sizeof(xattr_cmp), ALLOC_TAG);
+            if (!xa) {
                 ERR("out of memory\n");
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
+
+                while (!IsListEmpty(&xattrs)) {
+                    ExFreePool(CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry));
+                }
+
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                uint16_t length = (uint16_t)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
-                ULONG skip_start;
-                uint64_t addr = ed2->address + off;
-                void* csum;
+            xa->namelen = di->n;
+            xa->name = di->name;
+            xa->value1len = di->m;
+            xa->value1 = di->name + di->n;
+            xa->value2len = 0;
+            xa->value2 = NULL;
 
-                if (context->datalen > SEND_BUFFER_LENGTH) {
-                    Status = wait_for_flush(context, tp1, tp2);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("wait_for_flush returned %08lx\n", Status);
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
+            InsertTailList(&xattrs, &xa->list_entry);
 
-                    if (context->send->cancelling) {
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_SUCCESS;
-                    }
-                }
+            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
+            di = (DIR_ITEM*)&di->name[di->m + di->n];
+        } while (len > 0);
 
-                skip_start = addr & (context->Vcb->superblock.sector_size - 1);
-                addr -= skip_start;
+        len = tp2->item->size;
+        di = (DIR_ITEM*)tp2->item->data;
 
-                if (context->lastinode.flags & BTRFS_INODE_NODATASUM)
-                    csum = NULL;
-                else {
-                    uint32_t len;
+        do {
+            xattr_cmp* xa;
+            LIST_ENTRY* le;
+            bool found = false;
 
-                    len = (uint32_t)sector_align(length + skip_start, context->Vcb->superblock.sector_size) >> context->Vcb->sector_shift;
+            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
+                ERR("(%I64x,%x,%I64x) was truncated\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset);
+                return STATUS_INTERNAL_ERROR;
+            }
 
-                    csum = ExAllocatePoolWithTag(PagedPool, len * context->Vcb->csum_size, ALLOC_TAG);
-                    if (!csum) {
-                        ERR("out of memory\n");
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_INSUFFICIENT_RESOURCES;
-                    }
+            le = xattrs.Flink;
+            while (le != &xattrs) {
+                xa = CONTAINING_RECORD(le, xattr_cmp, list_entry);
 
-                    Status = load_csum(context->Vcb, csum, addr, len, NULL);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("load_csum returned %08lx\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_INSUFFICIENT_RESOURCES;
-                    }
+                if (xa->namelen == di->n && RtlCompareMemory(xa->name, di->name, di->n) == di->n) {
+                    xa->value2len = di->m;
+                    xa->value2 = di->name + di->n;
+                    found = true;
+                    break;
                 }
 
-                Status = read_data(context->Vcb, addr, (uint32_t)sector_align(length + skip_start, context->Vcb->superblock.sector_size),
-                                   csum, false, buf, NULL, NULL, NULL, 0, false, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08lx\n", Status);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    if (csum) ExFreePool(csum);
-                    return Status;
-                }
+                le = le->Flink;
+            }
 
-                if (csum)
-                    ExFreePool(csum);
+            if (!found) {
+                xa = ExAllocatePoolWithTag(PagedPool, sizeof(xattr_cmp), ALLOC_TAG);
+                if (!xa) {
+                    ERR("out of memory\n");
 
-                pos = context->datalen;
+                    while (!IsListEmpty(&xattrs)) {
+                        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry));
+                    }
 
-                send_command(context, BTRFS_SEND_CMD_WRITE);
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
 
-                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+                xa->namelen = di->n;
+                xa->name = di->name;
+                xa->value1len = 0;
+                xa->value1 = NULL;
+                xa->value2len = di->m;
+                xa->value2 = di->name + di->n;
 
-                offset = se->offset + off;
-                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+                InsertTailList(&xattrs, &xa->list_entry);
+            }
 
-                length = (uint16_t)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, buf + skip_start, length);
+            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
+            di = (DIR_ITEM*)&di->name[di->m + di->n];
+        } while (len > 0);
 
-                send_command_finish(context, pos);
-            }
+        while (!IsListEmpty(&xattrs)) {
+            xattr_cmp* xa = CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry);
 
-            ExFreePool(buf);
-        } else {
-            uint8_t *buf, *compbuf;
-            uint64_t off;
-            void* csum;
+            if (xa->value1len != xa->value2len || !xa->value1 || !xa->value2 || RtlCompareMemory(xa->value1, xa->value2, xa->value1len) != xa->value1len) {
+                ULONG pos;
 
-            buf = ExAllocatePoolWithTag(PagedPool, (ULONG)se->data.decoded_size, ALLOC_TAG);
-            if (!buf) {
-                ERR("out of memory\n");
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                return STATUS_INSUFFICIENT_RESOURCES;
+                if (!xa->value1) {
+                    pos = context->datalen;
+                    send_command(context, BTRFS_SEND_CMD_REMOVE_XATTR);
+                    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, xa->name, xa->namelen);
+                    send_command_finish(context, pos);
+                } else {
+                    pos = context->datalen;
+                    send_command(context, BTRFS_SEND_CMD_SET_XATTR);
+                    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, xa->name, xa->namelen);
+                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_DATA, xa->value1, xa->value1len);
+                    send_command_finish(context, pos);
+                }
             }
 
-            compbuf = ExAllocatePoolWithTag(PagedPool, (ULONG)ed2->size, ALLOC_TAG);
-            if (!compbuf) {
-                ERR("out of memory\n");
-                ExFreePool(buf);
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            ExFreePool(xa);
+        }
+    }
 
-            if (context->lastinode.flags & BTRFS_INODE_NODATASUM)
-                csum = NULL;
-            else {
-                uint32_t len;
+    return STATUS_SUCCESS;
+}
 
-                len = (uint32_t)(ed2->size >> context->Vcb->sector_shift);
+static void start_read_ahead(send_context* context) {
+    NTSTATUS Status;
+    OBJECT_ATTRIBUTES oa;
 
-                csum = ExAllocatePoolWithTag(PagedPool, len * context->Vcb->csum_size, ALLOC_TAG);
-                if (!csum) {
-                    ERR("out of memory\n");
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
+    KeInitializeSpinLock(&context->ra_lock);
+    KeInitializeEvent(&context->ra_event, SynchronizationEvent, false);
+    KeInitializeEvent(&context->ra_finished, NotificationEvent, false);
+    context->ra_exit = false;
 
-                Status = load_csum(context->Vcb, csum, ed2->address, len, NULL);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("load_csum returned %08lx\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            }
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
 
-            Status = read_data(context->Vcb, ed2->address, (uint32_t)ed2->size, csum, false, compbuf, NULL, NULL, NULL, 0, false, NormalPagePriority);
-            if (!NT_SUCCESS(Status)) {
-                ERR("read_data returned %08lx\n", Status);
-                ExFreePool(compbuf);
-                ExFreePool(buf);
-                ExFreePool(se);
-                if (se2) ExFreePool(se2);
-                if (csum) ExFreePool(csum);
-                return Status;
-            }
+    Status = PsCreateSystemThread(&context->ra_thread, 0, &oa, NULL, NULL, send_read_thread, context);
+    if (!NT_SUCCESS(Status)) {
+        WARN("PsCreateSystemThread returned %08lx\n", Status);
+        context->ra_thread = NULL;
+        context->read_ahead = false;
+    }
+}
 
-            if (csum)
-                ExFreePool(csum);
+static void stop_read_ahead(send_context* context) {
+    KIRQL irql;
 
-            if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
-                Status = zlib_decompress(compbuf, (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("zlib_decompress returned %08lx\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            } else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
-                Status = lzo_decompress(&compbuf[sizeof(uint32_t)], (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size, sizeof(uint32_t));
-                if (!NT_SUCCESS(Status)) {
-                    ERR("lzo_decompress returned %08lx\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            } else if (se->data.compression == BTRFS_COMPRESSION_ZSTD) {
-                Status = zstd_decompress(compbuf, (uint32_t)ed2->size, buf, (uint32_t)se->data.decoded_size);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("zstd_decompress returned %08lx\n", Status);
-                    ExFreePool(compbuf);
-                    ExFreePool(buf);
-                    ExFreePool(se);
-                    if (se2) ExFreePool(se2);
-                    return Status;
-                }
-            }
+    cancel_read_ahead(context);
 
-            ExFreePool(compbuf);
+    if (!context->ra_thread)
+        return;
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                uint16_t length = (uint16_t)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
-                uint64_t offset;
+    KeAcquireSpinLock(&context->ra_lock, &irql);
+    context->ra_exit = true;
+    KeReleaseSpinLock(&context->ra_lock, irql);
 
-                if (context->datalen > SEND_BUFFER_LENGTH) {
-                    Status = wait_for_flush(context, tp1, tp2);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("wait_for_flush returned %08lx\n", Status);
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return Status;
-                    }
+    KeSetEvent(&context->ra_event, 0, false);
+    KeWaitForSingleObject(&context->ra_finished, Executive, KernelMode, false, NULL);
 
-                    if (context->send->cancelling) {
-                        ExFreePool(buf);
-                        ExFreePool(se);
-                        if (se2) ExFreePool(se2);
-                        return STATUS_SUCCESS;
-                    }
-                }
+    ZwClose(context->ra_thread);
+    context->ra_thread = NULL;
+}
 
-                pos = context->datalen;
+// Parallel tree comparison for incremental sends. Before the main loop, the
+// key space is split up between threads by the top-level nodes of the subvol,
+// and each thread walks both trees down to the leaves, dropping any subtree
+// which the two trees share. What's left is a list of key ranges, in order,
+// outside of which the trees are identical - the main loop then jumps from
+// one range to the next, rather than stepping through the trees a leaf at a
+// time with skip_to_difference.
 
-                send_command(context, BTRFS_SEND_CMD_WRITE);
+#define SEND_DIFF_MAX_RANGES 0x100000 // give up and use skip_to_difference if the trees are this different
 
-                send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
+typedef struct {
+    KEY start;
+    KEY end;
+    root* r;
+    tree_holder* th;
+    tree* parent;
+    tree_data* td;
+    uint64_t address;
+    uint8_t level;
+    bool matched;
+} send_diff_node;
 
-                offset = se->offset + off;
-                send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(uint64_t));
+typedef struct {
+    send_diff_node* nodes;
+    ULONG num;
+    ULONG alloc;
+} send_diff_nodes;
+
+typedef struct {
+    send_context* context;
+    KEY start;
+    KEY end;
+    send_diff_range* ranges;
+    ULONG num_ranges;
+    ULONG ranges_alloc;
+    NTSTATUS Status;
+    HANDLE thread;
+    KEVENT finished;
+} send_diff_job;
 
-                length = (uint16_t)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, &buf[off], length);
+static const KEY max_key = { 0xffffffffffffffff, 0xff, 0xffffffffffffffff };
 
-                send_command_finish(context, pos);
-            }
+static NTSTATUS add_diff_node(send_diff_nodes* list, send_diff_node* n) {
+    if (list->num == list->alloc) {
+        ULONG alloc = list->alloc == 0 ? 64 : list->alloc * 2;
+        send_diff_node* nodes = ExAllocatePoolWithTag(PagedPool, sizeof(send_diff_node) * alloc, ALLOC_TAG);
 
-            ExFreePool(buf);
+        if (!nodes) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        ExFreePool(se);
-        if (se2) ExFreePool(se2);
+        if (list->nodes) {
+            RtlCopyMemory(nodes, list->nodes, sizeof(send_diff_node) * list->num);
+            ExFreePool(list->nodes);
+        }
+
+        list->nodes = nodes;
+        list->alloc = alloc;
     }
 
+    list->nodes[list->num] = *n;
+    list->num++;
+
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS finish_inode(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
-    LIST_ENTRY* le;
+static NTSTATUS add_diff_range(send_diff_job* job, KEY* start, KEY* end) {
+    if (job->num_ranges == job->ranges_alloc) {
+        ULONG alloc = job->ranges_alloc == 0 ? 64 : job->ranges_alloc * 2;
+        send_diff_range* ranges;
 
-    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
-        NTSTATUS Status = flush_refs(context, tp1, tp2);
-        if (!NT_SUCCESS(Status)) {
-            ERR("flush_refs returned %08lx\n", Status);
-            return Status;
+        if (alloc > SEND_DIFF_MAX_RANGES)
+            return STATUS_BUFFER_OVERFLOW;
+
+        ranges = ExAllocatePoolWithTag(PagedPool, sizeof(send_diff_range) * alloc, ALLOC_TAG);
+        if (!ranges) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (context->send->cancelling)
-            return STATUS_SUCCESS;
+        if (job->ranges) {
+            RtlCopyMemory(ranges, job->ranges, sizeof(send_diff_range) * job->num_ranges);
+            ExFreePool(job->ranges);
+        }
+
+        job->ranges = ranges;
+        job->ranges_alloc = alloc;
     }
 
-    if (!context->lastinode.deleting) {
-        if (context->lastinode.file) {
-            NTSTATUS Status = flush_extents(context, tp1, tp2);
-            if (!NT_SUCCESS(Status)) {
-                ERR("flush_extents returned %08lx\n", Status);
-                return Status;
-            }
+    job->ranges[job->num_ranges].start = *start;
+    job->ranges[job->num_ranges].end = *end;
+    job->num_ranges++;
 
-            if (context->send->cancelling)
-                return STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
 
-            send_truncate_command(context, context->lastinode.path, context->lastinode.size);
-        }
+static void sort_diff_nodes(send_diff_node** nodes, send_diff_node** scratch, ULONG num) {
+    ULONG half, i, j, k;
 
-        if (context->lastinode.new || context->lastinode.uid != context->lastinode.olduid || context->lastinode.gid != context->lastinode.oldgid)
-            send_chown_command(context, context->lastinode.path, context->lastinode.uid, context->lastinode.gid);
+    if (num < 2)
+        return;
 
-        if (((context->lastinode.mode & __S_IFLNK) != __S_IFLNK || ((context->lastinode.mode & 07777) != 0777)) &&
-            (context->lastinode.new || context->lastinode.mode != context->lastinode.oldmode))
-            send_chmod_command(context, context->lastinode.path, context->lastinode.mode);
+    half = num / 2;
 
-        send_utimes_command(context, context->lastinode.path, &context->lastinode.atime, &context->lastinode.mtime, &context->lastinode.ctime);
-    }
+    sort_diff_nodes(nodes, scratch, half);
+    sort_diff_nodes(&nodes[half], scratch, num - half);
 
-    while (!IsListEmpty(&context->lastinode.exts)) {
-        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&context->lastinode.exts), send_ext, list_entry));
+    RtlCopyMemory(scratch, nodes, sizeof(send_diff_node*) * half);
+
+    i = 0;
+    j = half;
+    k = 0;
+
+    while (i < half && j < num) {
+        if (nodes[j]->address < scratch[i]->address) {
+            nodes[k] = nodes[j];
+            j++;
+        } else {
+            nodes[k] = scratch[i];
+            i++;
+        }
+
+        k++;
     }
 
-    while (!IsListEmpty(&context->lastinode.oldexts)) {
-        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&context->lastinode.oldexts), send_ext, list_entry));
+    while (i < half) {
+        nodes[k] = scratch[i];
+        i++;
+        k++;
     }
+}
 
-    if (context->parent) {
-        le = context->pending_rmdirs.Flink;
+static void sort_diff_ranges(send_diff_range* ranges, send_diff_range* scratch, ULONG num) {
+    ULONG half, i, j, k;
 
-        while (le != &context->pending_rmdirs) {
-            pending_rmdir* pr = CONTAINING_RECORD(le, pending_rmdir, list_entry);
+    if (num < 2)
+        return;
 
-            if (pr->last_child_inode <= context->lastinode.inode) {
-                le = le->Flink;
+    half = num / 2;
 
-                send_rmdir_command(context, pr->sd->namelen, pr->sd->name);
+    sort_diff_ranges(ranges, scratch, half);
+    sort_diff_ranges(&ranges[half], scratch, num - half);
 
-                RemoveEntryList(&pr->sd->list_entry);
+    RtlCopyMemory(scratch, ranges, sizeof(send_diff_range) * half);
 
-                if (pr->sd->name)
-                    ExFreePool(pr->sd->name);
+    i = 0;
+    j = half;
+    k = 0;
 
-                while (!IsListEmpty(&pr->sd->deleted_children)) {
-                    deleted_child* dc = CONTAINING_RECORD(RemoveHeadList(&pr->sd->deleted_children), deleted_child, list_entry);
-                    ExFreePool(dc);
-                }
+    while (i < half && j < num) {
+        if (keycmp(ranges[j].start, scratch[i].start) == -1) {
+            ranges[k] = ranges[j];
+            j++;
+        } else {
+            ranges[k] = scratch[i];
+            i++;
+        }
 
-                ExFreePool(pr->sd);
+        k++;
+    }
 
-                RemoveEntryList(&pr->list_entry);
-                ExFreePool(pr);
-            } else
-                break;
+    while (i < half) {
+        ranges[k] = scratch[i];
+        i++;
+        k++;
+    }
+}
+
+// Nodes with the same address are the same on both sides, as are all their
+// children, so they can be dropped. Only nodes at the same level can match.
+static NTSTATUS match_diff_nodes(send_diff_nodes* list, uint8_t level) {
+    send_diff_node** ptrs;
+    ULONG num = 0, i;
+
+    for (i = 0; i < list->num; i++) {
+        if (list->nodes[i].level == level)
+            num++;
+    }
+
+    if (num < 2)
+        return STATUS_SUCCESS;
+
+    ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(send_diff_node*) * num * 2, ALLOC_TAG);
+    if (!ptrs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    num = 0;
+    for (i = 0; i < list->num; i++) {
+        if (list->nodes[i].level == level) {
+            ptrs[num] = &list->nodes[i];
+            num++;
         }
     }
 
-    context->lastinode.inode = 0;
-    context->lastinode.o = NULL;
+    sort_diff_nodes(ptrs, &ptrs[num], num);
 
-    if (context->lastinode.path) {
-        ExFreePool(context->lastinode.path);
-        context->lastinode.path = NULL;
+    for (i = 1; i < num; i++) {
+        if (ptrs[i]->address == ptrs[i - 1]->address && ptrs[i]->r != ptrs[i - 1]->r) {
+            ptrs[i]->matched = true;
+            ptrs[i - 1]->matched = true;
+        }
     }
 
+    ExFreePool(ptrs);
+
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS send_extent_data(send_context* context, traverse_ptr* tp, traverse_ptr* tp2) {
+// Replaces a node by its children, clipped to the node's range.
+static NTSTATUS expand_diff_node(device_extension* Vcb, send_diff_node* n, send_diff_nodes* out) {
     NTSTATUS Status;
+    LIST_ENTRY* le;
+    tree* t;
 
-    if (tp && tp2 && tp->item->size == tp2->item->size && RtlCompareMemory(tp->item->data, tp2->item->data, tp->item->size) == tp->item->size)
-        return STATUS_SUCCESS;
-
-    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
-        Status = flush_refs(context, tp, tp2);
+    if (!n->th->tree) {
+        Status = do_load_tree(Vcb, n->th, n->r, n->parent, n->td, NULL);
         if (!NT_SUCCESS(Status)) {
-            ERR("flush_refs returned %08lx\n", Status);
+            ERR("do_load_tree returned %08lx\n", Status);
             return Status;
         }
-
-        if (context->send->cancelling)
-            return STATUS_SUCCESS;
     }
 
-    if ((context->lastinode.mode & __S_IFLNK) == __S_IFLNK)
-        return STATUS_SUCCESS;
-
-    if (tp) {
-        EXTENT_DATA* ed;
-        EXTENT_DATA2* ed2 = NULL;
-
-        if (tp->item->size < sizeof(EXTENT_DATA)) {
-            ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
-                tp->item->size, sizeof(EXTENT_DATA));
-            return STATUS_INTERNAL_ERROR;
-        }
+    t = n->th->tree;
 
-        ed = (EXTENT_DATA*)tp->item->data;
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+        send_diff_node c;
 
-        if (ed->encryption != BTRFS_ENCRYPTION_NONE) {
-            ERR("unknown encryption type %u\n", ed->encryption);
-            return STATUS_INTERNAL_ERROR;
+        if (td->ignore) {
+            le = le2;
+            continue;
         }
 
-        if (ed->encoding != BTRFS_ENCODING_NONE) {
-            ERR("unknown encoding type %u\n", ed->encoding);
-            return STATUS_INTERNAL_ERROR;
+        while (le2 != &t->itemlist && CONTAINING_RECORD(le2, tree_data, list_entry)->ignore) {
+            le2 = le2->Flink;
         }
 
-        if (ed->compression != BTRFS_COMPRESSION_NONE && ed->compression != BTRFS_COMPRESSION_ZLIB &&
-            ed->compression != BTRFS_COMPRESSION_LZO && ed->compression != BTRFS_COMPRESSION_ZSTD) {
-            ERR("unknown compression type %u\n", ed->compression);
-            return STATUS_INTERNAL_ERROR;
-        }
+        c.start = keycmp(td->key, n->start) == 1 ? td->key : n->start;
 
-        if (ed->type == EXTENT_TYPE_REGULAR) {
-            if (tp->item->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)) {
-                ERR("(%I64x,%x,%I64x) was %u bytes, expected %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
-                    tp->item->size, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
-                return STATUS_INTERNAL_ERROR;
-            }
+        if (le2 != &t->itemlist) {
+            tree_data* td2 = CONTAINING_RECORD(le2, tree_data, list_entry);
 
-            ed2 = (EXTENT_DATA2*)ed->data;
-        } else if (ed->type == EXTENT_TYPE_INLINE) {
-            if (tp->item->size < offsetof(EXTENT_DATA, data[0]) + ed->decoded_size && ed->compression == BTRFS_COMPRESSION_NONE) {
-                ERR("(%I64x,%x,%I64x) was %u bytes, expected %I64u\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
-                    tp->item->size, offsetof(EXTENT_DATA, data[0]) + ed->decoded_size);
-                return STATUS_INTERNAL_ERROR;
-            }
+            c.end = keycmp(td2->key, n->end) == -1 ? td2->key : n->end;
+        } else
+            c.end = n->end;
+
+        if (keycmp(c.start, c.end) == -1) {
+            c.r = n->r;
+            c.th = &td->treeholder;
+            c.parent = t;
+            c.td = td;
+            c.address = td->treeholder.address;
+            c.level = t->header.level - 1;
+            c.matched = false;
+
+            Status = add_diff_node(out, &c);
+            if (!NT_SUCCESS(Status))
+                return Status;
         }
 
-        if ((ed->type == EXTENT_TYPE_INLINE || (ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0)) && ed->decoded_size != 0) {
-            send_ext* se = ExAllocatePoolWithTag(PagedPool, offsetof(send_ext, data) + tp->item->size, ALLOC_TAG);
+        le = le2;
+    }
 
-            if (!se) {
-                ERR("out of memory\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+    return STATUS_SUCCESS;
+}
 
-            se->offset = tp->item->key.offset;
-            se->datalen = tp->item->size;
-            RtlCopyMemory(&se->data, tp->item->data, tp->item->size);
-            InsertTailList(&context->lastinode.exts, &se->list_entry);
-        }
-    }
+static NTSTATUS do_send_diff_job(send_diff_job* job) {
+    NTSTATUS Status;
+    send_context* context = job->context;
+    send_diff_nodes list, list2;
+    send_diff_node n;
+    ULONG i;
+
+    list.nodes = list2.nodes = NULL;
+    list.num = list2.num = 0;
+    list.alloc = list2.alloc = 0;
+
+    n.start = job->start;
+    n.end = job->end;
+    n.parent = NULL;
+    n.td = NULL;
+    n.matched = false;
+
+    n.r = context->root;
+    n.th = &context->root->treeholder;
+    n.address = n.th->address;
+    n.level = n.th->tree->header.level;
+
+    Status = add_diff_node(&list, &n);
+    if (!NT_SUCCESS(Status))
+        goto end;
 
-    if (tp2) {
-        EXTENT_DATA* ed;
-        EXTENT_DATA2* ed2 = NULL;
+    n.r = context->parent;
+    n.th = &context->parent->treeholder;
+    n.address = n.th->address;
+    n.level = n.th->tree->header.level;
 
-        if (tp2->item->size < sizeof(EXTENT_DATA)) {
-            ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
-                tp2->item->size, sizeof(EXTENT_DATA));
-            return STATUS_INTERNAL_ERROR;
-        }
+    Status = add_diff_node(&list, &n);
+    if (!NT_SUCCESS(Status))
+        goto end;
 
-        ed = (EXTENT_DATA*)tp2->item->data;
+    while (true) {
+        uint8_t level = 0;
+        send_diff_nodes tmp;
 
-        if (ed->encryption != BTRFS_ENCRYPTION_NONE) {
-            ERR("unknown encryption type %u\n", ed->encryption);
-            return STATUS_INTERNAL_ERROR;
+        if (context->send->cancelling) {
+            Status = STATUS_CANCELLED;
+            goto end;
         }
 
-        if (ed->encoding != BTRFS_ENCODING_NONE) {
-            ERR("unknown encoding type %u\n", ed->encoding);
-            return STATUS_INTERNAL_ERROR;
+        for (i = 0; i < list.num; i++) {
+            if (list.nodes[i].level > level)
+                level = list.nodes[i].level;
         }
 
-        if (ed->compression != BTRFS_COMPRESSION_NONE && ed->compression != BTRFS_COMPRESSION_ZLIB &&
-            ed->compression != BTRFS_COMPRESSION_LZO && ed->compression != BTRFS_COMPRESSION_ZSTD) {
-            ERR("unknown compression type %u\n", ed->compression);
-            return STATUS_INTERNAL_ERROR;
-        }
+        Status = match_diff_nodes(&list, level);
+        if (!NT_SUCCESS(Status))
+            goto end;
 
-        if (ed->type == EXTENT_TYPE_REGULAR) {
-            if (tp2->item->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)) {
-                ERR("(%I64x,%x,%I64x) was %u bytes, expected %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
-                    tp2->item->size, offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
-                return STATUS_INTERNAL_ERROR;
-            }
+        if (level == 0)
+            break;
 
-            ed2 = (EXTENT_DATA2*)ed->data;
-        } else if (ed->type == EXTENT_TYPE_INLINE) {
-            if (tp2->item->size < offsetof(EXTENT_DATA, data[0]) + ed->decoded_size) {
-                ERR("(%I64x,%x,%I64x) was %u bytes, expected %I64u\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
-                    tp2->item->size, offsetof(EXTENT_DATA, data[0]) + ed->decoded_size);
-                return STATUS_INTERNAL_ERROR;
-            }
-        }
+        list2.num = 0;
 
-        if ((ed->type == EXTENT_TYPE_INLINE || (ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0)) && ed->decoded_size != 0) {
-            send_ext* se = ExAllocatePoolWithTag(PagedPool, offsetof(send_ext, data) + tp2->item->size, ALLOC_TAG);
+        for (i = 0; i < list.num; i++) {
+            if (list.nodes[i].matched)
+                continue;
 
-            if (!se) {
-                ERR("out of memory\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            if (list.nodes[i].level == level)
+                Status = expand_diff_node(context->Vcb, &list.nodes[i], &list2);
+            else
+                Status = add_diff_node(&list2, &list.nodes[i]);
 
-            se->offset = tp2->item->key.offset;
-            se->datalen = tp2->item->size;
-            RtlCopyMemory(&se->data, tp2->item->data, tp2->item->size);
-            InsertTailList(&context->lastinode.oldexts, &se->list_entry);
+            if (!NT_SUCCESS(Status))
+                goto end;
+        }
+
+        tmp = list;
+        list = list2;
+        list2 = tmp;
+    }
+
+    for (i = 0; i < list.num; i++) {
+        if (!list.nodes[i].matched) {
+            Status = add_diff_range(job, &list.nodes[i].start, &list.nodes[i].end);
+            if (!NT_SUCCESS(Status))
+                goto end;
         }
     }
 
-    return STATUS_SUCCESS;
+    Status = STATUS_SUCCESS;
+
+end:
+    if (list.nodes)
+        ExFreePool(list.nodes);
+
+    if (list2.nodes)
+        ExFreePool(list2.nodes);
+
+    return Status;
 }
 
-typedef struct {
-    uint16_t namelen;
-    char* name;
-    uint16_t value1len;
-    char* value1;
-    uint16_t value2len;
-    char* value2;
-    LIST_ENTRY list_entry;
-} xattr_cmp;
+_Function_class_(KSTART_ROUTINE)
+static void __stdcall send_diff_thread(void* ctx) {
+    send_diff_job* job = ctx;
 
-static NTSTATUS send_xattr(send_context* context, traverse_ptr* tp, traverse_ptr* tp2) {
-    if (tp && tp2 && tp->item->size == tp2->item->size && RtlCompareMemory(tp->item->data, tp2->item->data, tp->item->size) == tp->item->size)
-        return STATUS_SUCCESS;
+    job->Status = do_send_diff_job(job);
 
-    if (!IsListEmpty(&context->lastinode.refs) || !IsListEmpty(&context->lastinode.oldrefs)) {
-        NTSTATUS Status = flush_refs(context, tp, tp2);
+    KeSetEvent(&job->finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Called with tree_lock held shared, which covers the worker threads too, as
+// we don't release it until they've all finished.
+static NTSTATUS find_diff_ranges(send_context* context) {
+    NTSTATUS Status;
+    send_diff_job* jobs;
+    ULONG num_children = 0, num_jobs, num_ranges = 0, per_job, i;
+    LIST_ENTRY* le;
+    tree* t;
+    OBJECT_ATTRIBUTES oa;
+    send_diff_range* ranges;
+
+    if (!context->root->treeholder.tree) {
+        Status = do_load_tree(context->Vcb, &context->root->treeholder, context->root, NULL, NULL, NULL);
         if (!NT_SUCCESS(Status)) {
-            ERR("flush_refs returned %08lx\n", Status);
+            ERR("do_load_tree returned %08lx\n", Status);
             return Status;
         }
+    }
 
-        if (context->send->cancelling)
-            return STATUS_SUCCESS;
+    if (!context->parent->treeholder.tree) {
+        Status = do_load_tree(context->Vcb, &context->parent->treeholder, context->parent, NULL, NULL, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_load_tree returned %08lx\n", Status);
+            return Status;
+        }
     }
 
-    if (tp && tp->item->size < sizeof(DIR_ITEM)) {
-        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset,
-            tp->item->size, sizeof(DIR_ITEM));
-        return STATUS_INTERNAL_ERROR;
+    t = context->root->treeholder.tree;
+
+    // nothing to gain on small trees
+    if (t->header.level == 0 || context->parent->treeholder.tree->header.level == 0)
+        return STATUS_NOT_SUPPORTED;
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        num_children++;
+        le = le->Flink;
     }
 
-    if (tp2 && tp2->item->size < sizeof(DIR_ITEM)) {
-        ERR("(%I64x,%x,%I64x) was %u bytes, expected at least %Iu\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset,
-            tp2->item->size, sizeof(DIR_ITEM));
-        return STATUS_INTERNAL_ERROR;
+    num_jobs = min(get_num_of_processors(), num_children);
+
+    if (num_jobs == 0)
+        return STATUS_NOT_SUPPORTED;
+
+    jobs = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_diff_job) * num_jobs, ALLOC_TAG);
+    if (!jobs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    if (tp && !tp2) {
-        ULONG len;
-        DIR_ITEM* di;
+    RtlZeroMemory(jobs, sizeof(send_diff_job) * num_jobs);
 
-        len = tp->item->size;
-        di = (DIR_ITEM*)tp->item->data;
+    // split the top-level nodes of the subvol evenly between the jobs
+
+    per_job = (num_children + num_jobs - 1) / num_jobs;
+    le = t->itemlist.Flink;
 
-        do {
-            ULONG pos;
+    for (i = 0; i < num_jobs; i++) {
+        ULONG j;
 
-            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
-                ERR("(%I64x,%x,%I64x) was truncated\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset);
-                return STATUS_INTERNAL_ERROR;
-            }
+        jobs[i].context = context;
+        KeInitializeEvent(&jobs[i].finished, NotificationEvent, false);
 
-            pos = context->datalen;
-            send_command(context, BTRFS_SEND_CMD_SET_XATTR);
-            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, di->name, di->n);
-            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_DATA, &di->name[di->n], di->m);
-            send_command_finish(context, pos);
+        if (i == 0)
+            RtlZeroMemory(&jobs[i].start, sizeof(KEY));
+        else
+            jobs[i].start = jobs[i - 1].end;
 
-            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
-            di = (DIR_ITEM*)&di->name[di->m + di->n];
-        } while (len > 0);
-    } else if (!tp && tp2) {
-        ULONG len;
-        DIR_ITEM* di;
+        for (j = 0; j < per_job && le != &t->itemlist; j++) {
+            le = le->Flink;
+        }
 
-        len = tp2->item->size;
-        di = (DIR_ITEM*)tp2->item->data;
+        if (le == &t->itemlist || i == num_jobs - 1)
+            jobs[i].end = max_key;
+        else
+            jobs[i].end = CONTAINING_RECORD(le, tree_data, list_entry)->key;
+    }
 
-        do {
-            ULONG pos;
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
 
-            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
-                ERR("(%I64x,%x,%I64x) was truncated\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset);
-                return STATUS_INTERNAL_ERROR;
-            }
+    // the first job runs on this thread
+    for (i = 1; i < num_jobs; i++) {
+        Status = PsCreateSystemThread(&jobs[i].thread, 0, &oa, NULL, NULL, send_diff_thread, &jobs[i]);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08lx\n", Status);
+            jobs[i].thread = NULL;
+        }
+    }
 
-            pos = context->datalen;
-            send_command(context, BTRFS_SEND_CMD_REMOVE_XATTR);
-            send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-            send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, di->name, di->n);
-            send_command_finish(context, pos);
+    jobs[0].Status = do_send_diff_job(&jobs[0]);
 
-            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
-            di = (DIR_ITEM*)&di->name[di->m + di->n];
-        } while (len > 0);
-    } else {
-        ULONG len;
-        DIR_ITEM* di;
-        LIST_ENTRY xattrs;
+    for (i = 1; i < num_jobs; i++) {
+        if (jobs[i].thread) {
+            KeWaitForSingleObject(&jobs[i].finished, Executive, KernelMode, false, NULL);
+            ZwClose(jobs[i].thread);
+        } else
+            jobs[i].Status = do_send_diff_job(&jobs[i]);
+    }
 
-        InitializeListHead(&xattrs);
+    Status = STATUS_SUCCESS;
 
-        len = tp->item->size;
-        di = (DIR_ITEM*)tp->item->data;
+    for (i = 0; i < num_jobs; i++) {
+        if (!NT_SUCCESS(jobs[i].Status)) {
+            if (jobs[i].Status != STATUS_BUFFER_OVERFLOW && jobs[i].Status != STATUS_CANCELLED)
+                ERR("do_send_diff_job returned %08lx\n", jobs[i].Status);
 
-        do {
-            xattr_cmp* xa;
+            if (NT_SUCCESS(Status))
+                Status = jobs[i].Status;
+        }
 
-            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
-                ERR("(%I64x,%x,%I64x) was truncated\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset);
-                return STATUS_INTERNAL_ERROR;
-            }
+        num_ranges += jobs[i].num_ranges;
+    }
 
-            xa = ExAllocatePoolWithTag(PagedPool, sizeof(xattr_cmp), ALLOC_TAG);
-            if (!xa) {
-                ERR("out of memory\n");
+    if (!NT_SUCCESS(Status))
+        goto end;
 
-                while (!IsListEmpty(&xattrs)) {
-                    ExFreePool(CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry));
-                }
+    if (num_ranges == 0) {
+        context->diff_ranges = NULL;
+        context->num_diff_ranges = 0;
+        context->diff_done = true;
+        goto end;
+    }
 
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+    ranges = ExAllocatePoolWithTag(PagedPool, sizeof(send_diff_range) * num_ranges * 2, ALLOC_TAG);
+    if (!ranges) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
 
-            xa->namelen = di->n;
-            xa->name = di->name;
-            xa->value1len = di->m;
-            xa->value1 = di->name + di->n;
-            xa->value2len = 0;
-            xa->value2 = NULL;
+    num_ranges = 0;
 
-            InsertTailList(&xattrs, &xa->list_entry);
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].num_ranges > 0) {
+            RtlCopyMemory(&ranges[num_ranges], jobs[i].ranges, sizeof(send_diff_range) * jobs[i].num_ranges);
+            num_ranges += jobs[i].num_ranges;
+        }
+    }
 
-            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
-            di = (DIR_ITEM*)&di->name[di->m + di->n];
-        } while (len > 0);
+    sort_diff_ranges(ranges, &ranges[num_ranges], num_ranges);
 
-        len = tp2->item->size;
-        di = (DIR_ITEM*)tp2->item->data;
+    // Merge overlapping ranges, and start each at the beginning of its inode:
+    // the main loop skips the rest of an inode if its INODE_ITEM hasn't changed,
+    // so we mustn't land in the middle of one.
 
-        do {
-            xattr_cmp* xa;
-            LIST_ENTRY* le;
-            bool found = false;
+    {
+        ULONG j = 0;
 
-            if (len < sizeof(DIR_ITEM) || len < offsetof(DIR_ITEM, name[0]) + di->m + di->n) {
-                ERR("(%I64x,%x,%I64x) was truncated\n", tp2->item->key.obj_id, tp2->item->key.obj_type, tp2->item->key.offset);
-                return STATUS_INTERNAL_ERROR;
+        for (i = 0; i < num_ranges; i++) {
+            ranges[i].start.obj_type = 0;
+            ranges[i].start.offset = 0;
+
+            if (j > 0 && keycmp(ranges[i].start, ranges[j - 1].end) != 1) {
+                if (keycmp(ranges[i].end, ranges[j - 1].end) == 1)
+                    ranges[j - 1].end = ranges[i].end;
+            } else {
+                ranges[j] = ranges[i];
+                j++;
             }
+        }
 
-            le = xattrs.Flink;
-            while (le != &xattrs) {
-                xa = CONTAINING_RECORD(le, xattr_cmp, list_entry);
+        num_ranges = j;
+    }
 
-                if (xa->namelen == di->n && RtlCompareMemory(xa->name, di->name, di->n) == di->n) {
-                    xa->value2len = di->m;
-                    xa->value2 = di->name + di->n;
-                    found = true;
-                    break;
-                }
+    TRACE("%lu jobs found %lu ranges\n", num_jobs, num_ranges);
 
-                le = le->Flink;
-            }
+    context->diff_ranges = ranges;
+    context->num_diff_ranges = num_ranges;
+    context->diff_done = true;
 
-            if (!found) {
-                xa = ExAllocatePoolWithTag(PagedPool, sizeof(xattr_cmp), ALLOC_TAG);
-                if (!xa) {
-                    ERR("out of memory\n");
+end:
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].ranges)
+            ExFreePool(jobs[i].ranges);
+    }
 
-                    while (!IsListEmpty(&xattrs)) {
-                        ExFreePool(CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry));
-                    }
+    ExFreePool(jobs);
 
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
+    return Status;
+}
 
-                xa->namelen = di->n;
-                xa->name = di->name;
-                xa->value1len = 0;
-                xa->value1 = NULL;
-                xa->value2len = di->m;
-                xa->value2 = di->name + di->n;
+// Moves tp to the first item at or after key.
+static NTSTATUS find_diff_item(send_context* context, root* r, traverse_ptr* tp, KEY key, bool* ended) {
+    NTSTATUS Status;
+    traverse_ptr next_tp;
 
-                InsertTailList(&xattrs, &xa->list_entry);
-            }
+    Status = find_item(context->Vcb, r, tp, &key, false, NULL);
+    if (Status == STATUS_NOT_FOUND) {
+        *ended = true;
+        return STATUS_SUCCESS;
+    } else if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08lx\n", Status);
+        return Status;
+    }
 
-            len -= (ULONG)offsetof(DIR_ITEM, name[0]) + di->m + di->n;
-            di = (DIR_ITEM*)&di->name[di->m + di->n];
-        } while (len > 0);
+    if (keycmp(tp->item->key, key) == -1) {
+        if (find_next_item(context->Vcb, tp, &next_tp, false, NULL))
+            *tp = next_tp;
+        else
+            *ended = true;
+    }
 
-        while (!IsListEmpty(&xattrs)) {
-            xattr_cmp* xa = CONTAINING_RECORD(RemoveHeadList(&xattrs), xattr_cmp, list_entry);
+    return STATUS_SUCCESS;
+}
 
-            if (xa->value1len != xa->value2len || !xa->value1 || !xa->value2 || RtlCompareMemory(xa->value1, xa->value2, xa->value1len) != xa->value1len) {
-                ULONG pos;
+// The equivalent of skip_to_difference when we have the diff ranges. Only
+// called when tp and tp2 are at the same key, so that anything before the next
+// range is known to be the same on both sides.
+static NTSTATUS skip_to_diff_range(send_context* context, traverse_ptr* tp, traverse_ptr* tp2, bool* ended1, bool* ended2) {
+    NTSTATUS Status;
+    KEY key = tp->item->key;
+    send_diff_range* dr;
 
-                if (!xa->value1) {
-                    pos = context->datalen;
-                    send_command(context, BTRFS_SEND_CMD_REMOVE_XATTR);
-                    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, xa->name, xa->namelen);
-                    send_command_finish(context, pos);
-                } else {
-                    pos = context->datalen;
-                    send_command(context, BTRFS_SEND_CMD_SET_XATTR);
-                    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (uint16_t)strlen(context->lastinode.path) : 0);
-                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_NAME, xa->name, xa->namelen);
-                    send_add_tlv(context, BTRFS_SEND_TLV_XATTR_DATA, xa->value1, xa->value1len);
-                    send_command_finish(context, pos);
-                }
-            }
+    while (context->diff_pos < context->num_diff_ranges && keycmp(context->diff_ranges[context->diff_pos].end, key) != 1) {
+        context->diff_pos++;
+    }
 
-            ExFreePool(xa);
-        }
+    if (context->diff_pos == context->num_diff_ranges) {
+        *ended1 = *ended2 = true;
+        return STATUS_SUCCESS;
     }
 
+    dr = &context->diff_ranges[context->diff_pos];
+
+    if (keycmp(key, dr->start) != -1)
+        return STATUS_SUCCESS;
+
+    Status = find_diff_item(context, context->root, tp, dr->start, ended1);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = find_diff_item(context, context->parent, tp2, dr->start, ended2);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     return STATUS_SUCCESS;
 }
 
@@ -2974,6 +4090,9 @@ static void __stdcall send_thread(void* ctx) {
     KEY searchkey;
     traverse_ptr tp, tp2;
 
+    if (context->read_ahead)
+        start_read_ahead(context);
+
     InterlockedIncrement(&context->root->send_ops);
 
     if (context->parent)
@@ -2987,6 +4106,16 @@ static void __stdcall send_thread(void* ctx) {
         }
     }
 
+    // not fatal if this fails, we'll just have to resolve every backref
+    if (context->parent || context->num_clones > 0) {
+        context->clone_cache = ExAllocatePoolWithTag(PagedPool, sizeof(send_clone_cache_entry) * SEND_CLONE_CACHE_SIZE, ALLOC_TAG);
+
+        if (context->clone_cache)
+            RtlZeroMemory(context->clone_cache, sizeof(send_clone_cache_entry) * SEND_CLONE_CACHE_SIZE);
+        else
+            WARN("out of memory\n");
+    }
+
     ExAcquireResourceExclusiveLite(&context->Vcb->tree_lock, true);
 
     flush_subvol_fcbs(context->root);
@@ -3028,17 +4157,27 @@ static void __stdcall send_thread(void* ctx) {
             goto end;
         }
 
+        Status = find_diff_ranges(context);
+        if (Status == STATUS_CANCELLED) {
+            ExReleaseResourceLite(&context->Vcb->tree_lock);
+            goto end;
+        } else if (!NT_SUCCESS(Status) && Status != STATUS_NOT_SUPPORTED)
+            WARN("find_diff_ranges returned %08lx, falling back to skip_to_difference\n", Status);
+
         do {
             traverse_ptr next_tp;
 
             if (context->datalen > SEND_BUFFER_LENGTH) {
                 KEY key1 = tp.item->key, key2 = tp2.item->key;
+                bool full = queue_segment(context);
 
+                // as in wait_for_flush, let anyone waiting for the lock have it
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, true);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+                if (full) {
+                    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+                    next_segment(context);
+                }
 
                 if (context->send->cancelling)
                     goto end;
@@ -3078,12 +4217,26 @@ static void __stdcall send_thread(void* ctx) {
                 }
             }
 
-            while (!ended1 && !ended2 && tp.tree->header.address == tp2.tree->header.address) {
-                Status = skip_to_difference(context->Vcb, &tp, &tp2, &ended1, &ended2);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("skip_to_difference returned %08lx\n", Status);
-                    ExReleaseResourceLite(&context->Vcb->tree_lock);
-                    goto end;
+            if (context->diff_done) {
+                if (!ended1 && !ended2 && !keycmp(tp.item->key, tp2.item->key)) {
+                    Status = skip_to_diff_range(context, &tp, &tp2, &ended1, &ended2);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("skip_to_diff_range returned %08lx\n", Status);
+                        ExReleaseResourceLite(&context->Vcb->tree_lock);
+                        goto end;
+                    }
+
+                    if (ended1 && ended2)
+                        break;
+                }
+            } else {
+                while (!ended1 && !ended2 && tp.tree->header.address == tp2.tree->header.address) {
+                    Status = skip_to_difference(context->Vcb, &tp, &tp2, &ended1, &ended2);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("skip_to_difference returned %08lx\n", Status);
+                        ExReleaseResourceLite(&context->Vcb->tree_lock);
+                        goto end;
+                    }
                 }
             }
 
@@ -3412,12 +4565,15 @@ static void __stdcall send_thread(void* ctx) {
 
             if (context->datalen > SEND_BUFFER_LENGTH) {
                 KEY key = tp.item->key;
+                bool full = queue_segment(context);
 
+                // as in wait_for_flush, let anyone waiting for the lock have it
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, true);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+                if (full) {
+                    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+                    next_segment(context);
+                }
 
                 if (context->send->cancelling)
                     goto end;
@@ -3522,19 +4678,21 @@ static void __stdcall send_thread(void* ctx) {
     } else
         ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, true);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, false, NULL);
+    wait_for_drain(context);
 
     Status = STATUS_SUCCESS;
 
 end:
-    if (!NT_SUCCESS(Status)) {
-        KeSetEvent(&context->buffer_event, 0, false);
+    stop_read_ahead(context);
 
-        if (context->send->ccb)
-            context->send->ccb->send_status = Status;
-    }
+    if (!NT_SUCCESS(Status) && context->send->ccb)
+        context->send->ccb->send_status = Status;
+
+    TRACE("written %I64x, cloned %I64x, %I64x clone lookups, %I64x cache hits, %I64x candidates\n", context->stats.bytes_written,
+          context->stats.bytes_cloned, context->stats.clone_lookups, context->stats.clone_cache_hits, context->stats.clone_candidates);
+
+    // wake up any reader, so it can see that we've finished
+    KeSetEvent(&context->buffer_event, 0, false);
 
     ExAcquireResourceExclusiveLite(&context->Vcb->send_load_lock, true);
 
@@ -3557,15 +4715,24 @@ end:
         ExFreePool(sd);
     }
 
+    if (context->diff_ranges)
+        ExFreePool(context->diff_ranges);
+
+    if (context->clone_cache)
+        ExFreePool(context->clone_cache);
+
     ZwClose(context->send->thread);
     context->send->thread = NULL;
 
-    if (context->send->ccb)
+    if (context->send->ccb) {
+        context->send->ccb->send_stats = context->stats;
         context->send->ccb->send = NULL;
+    }
 
     RemoveEntryList(&context->send->list_entry);
     ExFreePool(context->send);
-    ExFreePool(context->data);
+    ExFreePool(context->buffer);
+    ExFreePool(context->segs);
 
     InterlockedDecrement(&context->Vcb->running_sends);
     InterlockedDecrement(&context->root->send_ops);
@@ -3597,7 +4764,7 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     root* parsubvol = NULL;
     send_context* context;
     send_info* send;
-    ULONG num_clones = 0;
+    ULONG num_clones = 0, version = BTRFS_SEND_STREAM_VERSION;
     root** clones = NULL;
     OBJECT_ATTRIBUTES oa;
 
@@ -3634,6 +4801,13 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 
             if (datalen < offsetof(btrfs_send_subvol32, clones[0]) + (num_clones * sizeof(uint32_t)))
                 return STATUS_INVALID_PARAMETER;
+
+            if (datalen >= offsetof(btrfs_send_subvol32, clones[0]) + (num_clones * sizeof(uint32_t)) + sizeof(ULONG)) {
+                ULONG v = *(ULONG*)&bss32->clones[num_clones];
+
+                if (v != 0)
+                    version = v;
+            }
         } else {
 #endif
             if (datalen < offsetof(btrfs_send_subvol, num_clones))
@@ -3646,10 +4820,23 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 
             if (datalen < offsetof(btrfs_send_subvol, clones[0]) + (num_clones * sizeof(HANDLE)))
                 return STATUS_INVALID_PARAMETER;
+
+            // older callers don't send the version
+            if (datalen >= offsetof(btrfs_send_subvol, clones[0]) + (num_clones * sizeof(HANDLE)) + sizeof(ULONG)) {
+                ULONG v = *(ULONG*)&bss->clones[num_clones];
+
+                if (v != 0)
+                    version = v;
+            }
 #if defined(_WIN64)
         }
 #endif
 
+        if (version > BTRFS_SEND_STREAM_VERSION_MAX) {
+            WARN("unsupported send stream version %lu\n", version);
+            return STATUS_INVALID_PARAMETER;
+        }
+
         if (parent) {
             PFILE_OBJECT fileobj;
             struct _fcb* parfcb;
@@ -3766,21 +4953,58 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     context->lastinode.path = NULL;
     context->lastinode.sd = NULL;
     context->root_dir = NULL;
+    context->diff_ranges = NULL;
+    context->num_diff_ranges = 0;
+    context->diff_pos = 0;
+    context->diff_done = false;
+    context->clone_cache = NULL;
+    RtlZeroMemory(&context->stats, sizeof(btrfs_send_stats));
     context->num_clones = num_clones;
     context->clones = clones;
+    context->version = version;
+    context->max_write = version >= 2 ? MAX_SEND_WRITE_V2 : MAX_SEND_WRITE;
+    context->read_len = (SEND_READ_LENGTH / context->max_write) * context->max_write;
+    context->read_ahead = !parsubvol && num_clones == 0;
+    context->reads_size = 0;
+    context->ra_thread = NULL;
+    InitializeListHead(&context->reads);
+    InitializeListHead(&context->ra_pending);
     InitializeListHead(&context->lastinode.refs);
     InitializeListHead(&context->lastinode.oldrefs);
     InitializeListHead(&context->lastinode.exts);
     InitializeListHead(&context->lastinode.oldexts);
 
-    context->data = ExAllocatePoolWithTag(PagedPool, SEND_BUFFER_LENGTH + (2 * MAX_SEND_WRITE), ALLOC_TAG); // give ourselves some wiggle room
-    if (!context->data) {
+    context->num_segs = min(max(send_buffer_size, 2), MAX_SEND_SEGMENTS);
+
+    context->segs = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_segment) * context->num_segs, ALLOC_TAG);
+    if (!context->segs) {
+        ERR("out of memory\n");
         ExFreePool(context);
         ExReleaseResourceLite(&Vcb->send_load_lock);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    context->datalen = 0;
+    {
+        ULONG seglen = SEND_BUFFER_LENGTH + (2 * context->max_write); // give ourselves some wiggle room
+
+        context->buffer = ExAllocatePoolWithTag(PagedPool, seglen * context->num_segs, ALLOC_TAG);
+        if (!context->buffer) {
+            ERR("out of memory\n");
+            ExFreePool(context->segs);
+            ExFreePool(context);
+            ExReleaseResourceLite(&Vcb->send_load_lock);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG i = 0; i < context->num_segs; i++) {
+            context->segs[i].data = context->buffer + (i * seglen);
+            context->segs[i].datalen = 0;
+        }
+    }
+
+    KeInitializeSpinLock(&context->ring_lock);
+    context->fill_seg = context->drain_seg = context->drain_off = context->full_segs = 0;
+    next_segment(context);
 
     send_subvol_header(context, fcb->subvol, ccb->fileref); // FIXME - fileref needs some sort of lock here
 
@@ -3789,7 +5013,8 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     send = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_info), ALLOC_TAG);
     if (!send) {
         ERR("out of memory\n");
-        ExFreePool(context->data);
+        ExFreePool(context->buffer);
+        ExFreePool(context->segs);
         ExFreePool(context);
 
         if (clones)
@@ -3807,6 +5032,7 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     ccb->send = send;
     send->ccb = ccb;
     ccb->send_status = STATUS_SUCCESS;
+    RtlZeroMemory(&ccb->send_stats, sizeof(btrfs_send_stats));
 
     send->cancelling = false;
 
@@ -3820,7 +5046,8 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
         ccb->send = NULL;
         InterlockedDecrement(&Vcb->running_sends);
         ExFreePool(send);
-        ExFreePool(context->data);
+        ExFreePool(context->buffer);
+        ExFreePool(context->segs);
         ExFreePool(context);
 
         if (clones)
@@ -3839,6 +5066,9 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
 NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     ccb* ccb;
     send_context* context;
+    send_segment* seg;
+    ULONG left;
+    KIRQL irql;
 
     ccb = FileObject ? FileObject->FsContext2 : NULL;
     if (!ccb)
@@ -3863,21 +5093,69 @@ NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void*
         return STATUS_SUCCESS;
     }
 
-    RtlCopyMemory(data, context->data, min(datalen, context->datalen));
+    // The send thread only touches segments that aren't full, so we can copy
+    // without holding the ring lock.
 
-    if (datalen < context->datalen) { // not empty yet
-        *retlen = datalen;
-        RtlMoveMemory(context->data, &context->data[datalen], context->datalen - datalen);
-        context->datalen -= datalen;
-        ExReleaseResourceLite(&Vcb->send_load_lock);
-    } else {
-        *retlen = context->datalen;
-        context->datalen = 0;
+    KeAcquireSpinLock(&context->ring_lock, &irql);
+
+    if (context->full_segs == 0) {
+        KeReleaseSpinLock(&context->ring_lock, irql);
         ExReleaseResourceLite(&Vcb->send_load_lock);
+        *retlen = 0;
+        return STATUS_SUCCESS;
+    }
+
+    seg = &context->segs[context->drain_seg];
+    left = seg->datalen - context->drain_off;
+
+    KeReleaseSpinLock(&context->ring_lock, irql);
+
+    *retlen = min(datalen, left);
+    RtlCopyMemory(data, seg->data + context->drain_off, *retlen);
+
+    KeAcquireSpinLock(&context->ring_lock, &irql);
+
+    if (*retlen < left) // not empty yet
+        context->drain_off += (ULONG)*retlen;
+    else {
+        context->drain_off = 0;
+        context->drain_seg = (context->drain_seg + 1) % context->num_segs;
+        context->full_segs--;
+
+        if (context->full_segs == 0)
+            KeClearEvent(&context->buffer_event);
 
-        KeClearEvent(&context->buffer_event);
         KeSetEvent(&ccb->send->cleared_event, 0, false);
     }
 
+    KeReleaseSpinLock(&context->ring_lock, irql);
+
+    ExReleaseResourceLite(&Vcb->send_load_lock);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS get_send_stats(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen) {
+    ccb* ccb;
+
+    ccb = FileObject ? FileObject->FsContext2 : NULL;
+    if (!ccb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (datalen < sizeof(btrfs_send_stats) || !data)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    // if the send is still running, the counters are a snapshot
+    ExAcquireResourceSharedLite(&Vcb->send_load_lock, true);
+
+    if (ccb->send)
+        RtlCopyMemory(data, &((send_context*)ccb->send->context)->stats, sizeof(btrfs_send_stats));
+    else
+        RtlCopyMemory(data, &ccb->send_stats, sizeof(btrfs_send_stats));
+
+    ExReleaseResourceLite(&Vcb->send_load_lock);
+
+    *retlen = sizeof(btrfs_send_stats);
+
     return STATUS_SUCCESS;
 }
@@ -59,6 +59,28 @@ static void serialize(void* data, ULONG len, WCHAR* s) {
     }
 }
 
+void BtrfsBalance::GetStartBalance(HWND hwndDlg, btrfs_start_balance* bsb) {
+    RtlCopyMemory(&bsb->opts[0], &data_opts, sizeof(btrfs_balance_opts));
+    RtlCopyMemory(&bsb->opts[1], &metadata_opts, sizeof(btrfs_balance_opts));
+    RtlCopyMemory(&bsb->opts[2], &system_opts, sizeof(btrfs_balance_opts));
+    RtlCopyMemory(bsb->target, target, sizeof(target));
+
+    if (IsDlgButtonChecked(hwndDlg, IDC_DATA) == BST_CHECKED)
+        bsb->opts[0].flags |= BTRFS_BALANCE_OPTS_ENABLED;
+    else
+        bsb->opts[0].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
+
+    if (IsDlgButtonChecked(hwndDlg, IDC_METADATA) == BST_CHECKED)
+        bsb->opts[1].flags |= BTRFS_BALANCE_OPTS_ENABLED;
+    else
+        bsb->opts[1].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
+
+    if (IsDlgButtonChecked(hwndDlg, IDC_SYSTEM) == BST_CHECKED)
+        bsb->opts[2].flags |= BTRFS_BALANCE_OPTS_ENABLED;
+    else
+        bsb->opts[2].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
+}
+
 void BtrfsBalance::StartBalance(HWND hwndDlg) {
     wstring t;
     WCHAR modfn[MAX_PATH], u[600];
@@ -69,24 +91,7 @@ void BtrfsBalance::StartBalance(HWND hwndDlg) {
 
     t = L"\""s + modfn + L"\",StartBalance "s + fn + L" "s;
 
-    RtlCopyMemory(&bsb.opts[0], &data_opts, sizeof(btrfs_balance_opts));
-    RtlCopyMemory(&bsb.opts[1], &metadata_opts, sizeof(btrfs_balance_opts));
-    RtlCopyMemory(&bsb.opts[2], &system_opts, sizeof(btrfs_balance_opts));
-
-    if (IsDlgButtonChecked(hwndDlg, IDC_DATA) == BST_CHECKED)
-        bsb.opts[0].flags |= BTRFS_BALANCE_OPTS_ENABLED;
-    else
-        bsb.opts[0].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
-
-    if (IsDlgButtonChecked(hwndDlg, IDC_METADATA) == BST_CHECKED)
-        bsb.opts[1].flags |= BTRFS_BALANCE_OPTS_ENABLED;
-    else
-        bsb.opts[1].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
-
-    if (IsDlgButtonChecked(hwndDlg, IDC_SYSTEM) == BST_CHECKED)
-        bsb.opts[2].flags |= BTRFS_BALANCE_OPTS_ENABLED;
-    else
-        bsb.opts[2].flags &= ~BTRFS_BALANCE_OPTS_ENABLED;
+    GetStartBalance(hwndDlg, &bsb);
 
     serialize(&bsb, sizeof(btrfs_start_balance), u);
 
@@ -126,6 +131,45 @@ void BtrfsBalance::StartBalance(HWND hwndDlg) {
     CloseHandle(sei.hProcess);
 }
 
+void BtrfsBalance::EstimateBalance(HWND hwndDlg) {
+    btrfs_start_balance bsb;
+    btrfs_balance_estimate bbe;
+    wstring s, t, title, moved, before, after;
+
+    GetStartBalance(hwndDlg, &bsb);
+
+    {
+        win_handle h = CreateFileW(fn.c_str(), FILE_TRAVERSE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                   OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+
+        if (h != INVALID_HANDLE_VALUE) {
+            NTSTATUS Status;
+            IO_STATUS_BLOCK iosb;
+
+            Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_ESTIMATE_BALANCE, &bsb, sizeof(btrfs_start_balance),
+                                     &bbe, sizeof(btrfs_balance_estimate));
+
+            if (!NT_SUCCESS(Status))
+                throw ntstatus_error(Status);
+        } else
+            throw last_error(GetLastError());
+    }
+
+    format_size(bbe.bytes_to_move, moved, false);
+    format_size(bbe.unallocated_before, before, false);
+    format_size(bbe.unallocated_after, after, false);
+
+    if (!load_string(module, IDS_BALANCE_ESTIMATE, s))
+        throw last_error(GetLastError());
+
+    wstring_sprintf(t, s, bbe.chunks, moved.c_str(), bbe.chunks_freed, before.c_str(), after.c_str());
+
+    if (!load_string(module, IDS_BALANCE_ESTIMATE_TITLE, title))
+        throw last_error(GetLastError());
+
+    MessageBoxW(hwndDlg, t.c_str(), title.c_str(), MB_ICONINFORMATION);
+}
+
 void BtrfsBalance::PauseBalance(HWND hwndDlg) {
     WCHAR modfn[MAX_PATH];
     wstring t;
@@ -192,6 +236,8 @@ void BtrfsBalance::RefreshBalanceDlg(HWND hwndDlg, bool first) {
             NTSTATUS Status;
             IO_STATUS_BLOCK iosb;
 
+            RtlZeroMemory(bqb.target, sizeof(bqb.target)); // older drivers leave these alone
+
             Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_QUERY_BALANCE, nullptr, 0, &bqb, sizeof(btrfs_query_balance));
 
             if (!NT_SUCCESS(Status))
@@ -349,6 +395,7 @@ void BtrfsBalance::SaveBalanceOpts(HWND hwndDlg) {
     }
 
     RtlZeroMemory(opts, sizeof(btrfs_balance_opts));
+    target[opts_type - 1] = 0;
 
     if (IsDlgButtonChecked(hwndDlg, IDC_PROFILES) == BST_CHECKED) {
         opts->flags |= BTRFS_BALANCE_OPTS_PROFILES;
@@ -483,6 +530,18 @@ void BtrfsBalance::SaveBalanceOpts(HWND hwndDlg) {
         }
     }
 
+    if (IsDlgButtonChecked(hwndDlg, IDC_ORDER_USAGE) == BST_CHECKED)
+        opts->flags |= BTRFS_BALANCE_OPTS_ORDER_USAGE;
+
+    if (IsDlgButtonChecked(hwndDlg, IDC_TARGET) == BST_CHECKED) {
+        WCHAR s[255];
+
+        opts->flags |= BTRFS_BALANCE_OPTS_TARGET;
+
+        GetWindowTextW(GetDlgItem(hwndDlg, IDC_TARGET_SIZE), s, sizeof(s) / sizeof(WCHAR));
+        target[opts_type - 1] = _wtoi64(s);
+    }
+
     EndDialog(hwndDlg, 0);
 }
 
@@ -707,6 +766,21 @@ INT_PTR CALLBACK BtrfsBalance::BalanceOptsDlgProc(HWND hwndDlg, UINT uMsg, WPARA
                 EnableWindow(convcb, !balance_started && opts->flags & BTRFS_BALANCE_OPTS_CONVERT ? true : false);
                 EnableWindow(GetDlgItem(hwndDlg, IDC_CONVERT), balance_started ? false : true);
 
+                // order
+
+                CheckDlgButton(hwndDlg, IDC_ORDER_USAGE, opts->flags & BTRFS_BALANCE_OPTS_ORDER_USAGE ? BST_CHECKED : BST_UNCHECKED);
+                EnableWindow(GetDlgItem(hwndDlg, IDC_ORDER_USAGE), balance_started ? false : true);
+
+                // target
+
+                CheckDlgButton(hwndDlg, IDC_TARGET, opts->flags & BTRFS_BALANCE_OPTS_TARGET ? BST_CHECKED : BST_UNCHECKED);
+
+                s = to_wstring(balance_started ? bqb.target[opts_type - 1] : target[opts_type - 1]);
+                SetDlgItemTextW(hwndDlg, IDC_TARGET_SIZE, s.c_str());
+
+                EnableWindow(GetDlgItem(hwndDlg, IDC_TARGET_SIZE), !balance_started && opts->flags & BTRFS_BALANCE_OPTS_TARGET ? true : false);
+                EnableWindow(GetDlgItem(hwndDlg, IDC_TARGET), balance_started ? false : true);
+
                 break;
             }
 
@@ -800,6 +874,13 @@ INT_PTR CALLBACK BtrfsBalance::BalanceOptsDlgProc(HWND hwndDlg, UINT uMsg, WPARA
                                 EnableWindow(GetDlgItem(hwndDlg, IDC_SOFT), enabled);
                                 break;
                             }
+
+                            case IDC_TARGET: {
+                                bool enabled = IsDlgButtonChecked(hwndDlg, IDC_TARGET) == BST_CHECKED ? true : false;
+
+                                EnableWindow(GetDlgItem(hwndDlg, IDC_TARGET_SIZE), enabled);
+                                break;
+                            }
                         }
                     break;
                 }
@@ -843,6 +924,7 @@ INT_PTR CALLBACK BtrfsBalance::BalanceDlgProc(HWND hwndDlg, UINT uMsg, WPARAM wP
                 RtlZeroMemory(&data_opts, sizeof(btrfs_balance_opts));
                 RtlZeroMemory(&metadata_opts, sizeof(btrfs_balance_opts));
                 RtlZeroMemory(&system_opts, sizeof(btrfs_balance_opts));
+                RtlZeroMemory(target, sizeof(target));
 
                 removing = called_from_RemoveDevice;
                 shrinking = called_from_ShrinkDevice;
@@ -912,6 +994,10 @@ INT_PTR CALLBACK BtrfsBalance::BalanceDlgProc(HWND hwndDlg, UINT uMsg, WPARAM wP
                                 StartBalance(hwndDlg);
                             return true;
 
+                            case IDC_ESTIMATE_BALANCE:
+                                EstimateBalance(hwndDlg);
+                            return true;
+
                             case IDC_PAUSE_BALANCE:
                                 PauseBalance(hwndDlg);
                                 RefreshBalanceDlg(hwndDlg, false);
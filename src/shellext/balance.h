@@ -37,13 +37,16 @@ public:
 private:
     void ShowBalanceOptions(HWND hwndDlg, uint8_t type);
     void SaveBalanceOpts(HWND hwndDlg);
+    void GetStartBalance(HWND hwndDlg, btrfs_start_balance* bsb);
     void StartBalance(HWND hwndDlg);
+    void EstimateBalance(HWND hwndDlg);
     void RefreshBalanceDlg(HWND hwndDlg, bool first);
     void PauseBalance(HWND hwndDlg);
     void StopBalance(HWND hwndDlg);
 
     uint32_t balance_status;
     btrfs_balance_opts data_opts, metadata_opts, system_opts;
+    uint64_t target[3];
     uint8_t opts_type;
     btrfs_query_balance bqb;
     bool cancelling;
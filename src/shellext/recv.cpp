@@ -37,29 +37,20 @@ static const string_view EA_REPARSE = "user.reparse";
 static const string_view EA_EA = "user.EA";
 static const string_view XATTR_USER = "user.";
 
-bool BtrfsRecv::find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** value, ULONG* len) {
-    size_t off = 0;
+bool BtrfsRecv::find_tlv(const send_command& cmd, uint16_t type, void** value, ULONG* len) {
+    const void* v;
+    uint32_t l;
 
-    while (off < datalen) {
-        btrfs_send_tlv* tlv = (btrfs_send_tlv*)(data + off);
-        uint8_t* payload = data + off + sizeof(btrfs_send_tlv);
-
-        if (off + sizeof(btrfs_send_tlv) + tlv->length > datalen) // file is truncated
-            return false;
-
-        if (tlv->type == type) {
-            *value = payload;
-            *len = tlv->length;
-            return true;
-        }
+    if (!cmd.find(type, &v, &l))
+        return false;
 
-        off += sizeof(btrfs_send_tlv) + tlv->length;
-    }
+    *value = (void*)v;
+    *len = l;
 
-    return false;
+    return true;
 }
 
-void BtrfsRecv::cmd_subvol(btrfs_send_command* cmd, uint8_t* data, const win_handle& parent) {
+void BtrfsRecv::cmd_subvol(const send_command& cmd) {
     string name;
     BTRFS_UUID* uuid;
     uint64_t* gen;
@@ -72,19 +63,19 @@ void BtrfsRecv::cmd_subvol(btrfs_send_command* cmd, uint8_t* data, const win_han
         char* namebuf;
         ULONG namelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&namebuf, &namelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&namebuf, &namelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         name = string(namebuf, namelen);
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UUID, (void**)&uuid, &uuidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_UUID, (void**)&uuid, &uuidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"uuid");
 
     if (uuidlen < sizeof(BTRFS_UUID))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"uuid", uuidlen, sizeof(BTRFS_UUID));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_TRANSID, (void**)&gen, &genlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_TRANSID, (void**)&gen, &genlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"transid");
 
     if (genlen < sizeof(uint64_t))
@@ -149,7 +140,7 @@ void BtrfsRecv::add_cache_entry(BTRFS_UUID* uuid, uint64_t transid, const wstrin
     cache.push_back(sc);
 }
 
-void BtrfsRecv::cmd_snapshot(btrfs_send_command* cmd, uint8_t* data, const win_handle& parent) {
+void BtrfsRecv::cmd_snapshot(const send_command& cmd) {
     string name;
     BTRFS_UUID *uuid, *parent_uuid;
     uint64_t *gen, *parent_transid;
@@ -166,31 +157,31 @@ void BtrfsRecv::cmd_snapshot(btrfs_send_command* cmd, uint8_t* data, const win_h
         char* namebuf;
         ULONG namelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&namebuf, &namelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&namebuf, &namelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         name = string(namebuf, namelen);
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UUID, (void**)&uuid, &uuidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_UUID, (void**)&uuid, &uuidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"uuid");
 
     if (uuidlen < sizeof(BTRFS_UUID))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"uuid", uuidlen, sizeof(BTRFS_UUID));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_TRANSID, (void**)&gen, &genlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_TRANSID, (void**)&gen, &genlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"transid");
 
     if (genlen < sizeof(uint64_t))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"transid", genlen, sizeof(uint64_t));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_UUID, (void**)&parent_uuid, &paruuidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_UUID, (void**)&parent_uuid, &paruuidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_uuid");
 
     if (paruuidlen < sizeof(BTRFS_UUID))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"clone_uuid", paruuidlen, sizeof(BTRFS_UUID));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_CTRANSID, (void**)&parent_transid, &partransidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_CTRANSID, (void**)&parent_transid, &partransidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_ctransid");
 
     if (partransidlen < sizeof(uint64_t))
@@ -272,7 +263,7 @@ void BtrfsRecv::cmd_snapshot(btrfs_send_command* cmd, uint8_t* data, const win_h
     num_received++;
 }
 
-void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_mkfile(const send_command& cmd) {
     uint64_t *inode, *rdev = nullptr, *mode = nullptr;
     ULONG inodelen;
     NTSTATUS Status;
@@ -284,37 +275,37 @@ void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
         char* name;
         ULONG namelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&name, &namelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&name, &namelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         nameu = utf8_to_utf16(string(name, namelen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_INODE, (void**)&inode, &inodelen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_INODE, (void**)&inode, &inodelen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"inode");
 
     if (inodelen < sizeof(uint64_t))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"inode", inodelen, sizeof(uint64_t));
 
-    if (cmd->cmd == BTRFS_SEND_CMD_MKNOD || cmd->cmd == BTRFS_SEND_CMD_MKFIFO || cmd->cmd == BTRFS_SEND_CMD_MKSOCK) {
+    if (cmd.cmd == BTRFS_SEND_CMD_MKNOD || cmd.cmd == BTRFS_SEND_CMD_MKFIFO || cmd.cmd == BTRFS_SEND_CMD_MKSOCK) {
         ULONG rdevlen, modelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_RDEV, (void**)&rdev, &rdevlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_RDEV, (void**)&rdev, &rdevlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"rdev");
 
         if (rdevlen < sizeof(uint64_t))
             throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"rdev", rdev, sizeof(uint64_t));
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"mode");
 
         if (modelen < sizeof(uint64_t))
             throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"mode", modelen, sizeof(uint64_t));
-    } else if (cmd->cmd == BTRFS_SEND_CMD_SYMLINK) {
+    } else if (cmd.cmd == BTRFS_SEND_CMD_SYMLINK) {
         char* pathlink;
         ULONG pathlinklen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH_LINK, (void**)&pathlink, &pathlinklen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH_LINK, (void**)&pathlink, &pathlinklen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path_link");
 
         pathlinku = utf8_to_utf16(string(pathlink, pathlinklen));
@@ -325,13 +316,13 @@ void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
 
     bmn->inode = *inode;
 
-    if (cmd->cmd == BTRFS_SEND_CMD_MKDIR)
+    if (cmd.cmd == BTRFS_SEND_CMD_MKDIR)
         bmn->type = BTRFS_TYPE_DIRECTORY;
-    else if (cmd->cmd == BTRFS_SEND_CMD_MKNOD)
+    else if (cmd.cmd == BTRFS_SEND_CMD_MKNOD)
         bmn->type = *mode & S_IFCHR ? BTRFS_TYPE_CHARDEV : BTRFS_TYPE_BLOCKDEV;
-    else if (cmd->cmd == BTRFS_SEND_CMD_MKFIFO)
+    else if (cmd.cmd == BTRFS_SEND_CMD_MKFIFO)
         bmn->type = BTRFS_TYPE_FIFO;
-    else if (cmd->cmd == BTRFS_SEND_CMD_MKSOCK)
+    else if (cmd.cmd == BTRFS_SEND_CMD_MKSOCK)
         bmn->type = BTRFS_TYPE_SOCKET;
     else
         bmn->type = BTRFS_TYPE_FILE;
@@ -348,7 +339,7 @@ void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
 
     free(bmn);
 
-    if (cmd->cmd == BTRFS_SEND_CMD_SYMLINK) {
+    if (cmd.cmd == BTRFS_SEND_CMD_SYMLINK) {
         REPARSE_DATA_BUFFER* rdb;
         btrfs_set_inode_info bsii;
 
@@ -395,11 +386,11 @@ void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
         Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_SET_INODE_INFO, &bsii, sizeof(btrfs_set_inode_info), nullptr, 0);
         if (!NT_SUCCESS(Status))
             throw string_error(IDS_RECV_SETINODEINFO_FAILED, Status, format_ntstatus(Status).c_str());
-    } else if (cmd->cmd == BTRFS_SEND_CMD_MKNOD || cmd->cmd == BTRFS_SEND_CMD_MKFIFO || cmd->cmd == BTRFS_SEND_CMD_MKSOCK) {
+    } else if (cmd.cmd == BTRFS_SEND_CMD_MKNOD || cmd.cmd == BTRFS_SEND_CMD_MKFIFO || cmd.cmd == BTRFS_SEND_CMD_MKSOCK) {
         uint64_t* mode;
         ULONG modelen;
 
-        if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen)) {
+        if (find_tlv(cmd, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen)) {
             btrfs_set_inode_info bsii;
 
             if (modelen < sizeof(uint64_t))
@@ -422,14 +413,14 @@ void BtrfsRecv::cmd_mkfile(btrfs_send_command* cmd, uint8_t* data) {
     }
 }
 
-void BtrfsRecv::cmd_rename(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_rename(const send_command& cmd) {
     wstring pathu, path_tou;
 
     {
         char* path;
         ULONG path_len;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &path_len))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &path_len))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, path_len));
@@ -439,7 +430,7 @@ void BtrfsRecv::cmd_rename(btrfs_send_command* cmd, uint8_t* data) {
         char* path_to;
         ULONG path_to_len;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH_TO, (void**)&path_to, &path_to_len))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH_TO, (void**)&path_to, &path_to_len))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path_to");
 
         path_tou = utf8_to_utf16(string(path_to, path_to_len));
@@ -449,14 +440,14 @@ void BtrfsRecv::cmd_rename(btrfs_send_command* cmd, uint8_t* data) {
         throw string_error(IDS_RECV_MOVEFILE_FAILED, pathu.c_str(), path_tou.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 }
 
-void BtrfsRecv::cmd_link(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_link(const send_command& cmd) {
     wstring pathu, path_linku;
 
     {
         char* path;
         ULONG path_len;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &path_len))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &path_len))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, path_len));
@@ -466,7 +457,7 @@ void BtrfsRecv::cmd_link(btrfs_send_command* cmd, uint8_t* data) {
         char* path_link;
         ULONG path_link_len;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH_LINK, (void**)&path_link, &path_link_len))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH_LINK, (void**)&path_link, &path_link_len))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path_link");
 
         path_linku = utf8_to_utf16(string(path_link, path_link_len));
@@ -476,7 +467,7 @@ void BtrfsRecv::cmd_link(btrfs_send_command* cmd, uint8_t* data) {
         throw string_error(IDS_RECV_CREATEHARDLINK_FAILED, pathu.c_str(), path_linku.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 }
 
-void BtrfsRecv::cmd_unlink(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_unlink(const send_command& cmd) {
     wstring pathu;
     ULONG att;
 
@@ -484,7 +475,7 @@ void BtrfsRecv::cmd_unlink(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -503,7 +494,7 @@ void BtrfsRecv::cmd_unlink(btrfs_send_command* cmd, uint8_t* data) {
         throw string_error(IDS_RECV_DELETEFILE_FAILED, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 }
 
-void BtrfsRecv::cmd_rmdir(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_rmdir(const send_command& cmd) {
     wstring pathu;
     ULONG att;
 
@@ -511,7 +502,7 @@ void BtrfsRecv::cmd_rmdir(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -530,7 +521,7 @@ void BtrfsRecv::cmd_rmdir(btrfs_send_command* cmd, uint8_t* data) {
         throw string_error(IDS_RECV_REMOVEDIRECTORY_FAILED, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 }
 
-void BtrfsRecv::cmd_setxattr(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_setxattr(const send_command& cmd) {
     string xattrname;
     uint8_t* xattrdata;
     ULONG xattrdatalen;
@@ -540,7 +531,7 @@ void BtrfsRecv::cmd_setxattr(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -550,13 +541,13 @@ void BtrfsRecv::cmd_setxattr(btrfs_send_command* cmd, uint8_t* data) {
         char* xattrnamebuf;
         ULONG xattrnamelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_XATTR_NAME, (void**)&xattrnamebuf, &xattrnamelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_XATTR_NAME, (void**)&xattrnamebuf, &xattrnamelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"xattr_name");
 
         xattrname = string(xattrnamebuf, xattrnamelen);
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_XATTR_DATA, (void**)&xattrdata, &xattrdatalen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_XATTR_DATA, (void**)&xattrdata, &xattrdatalen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"xattr_data");
 
     if (xattrname.length() > XATTR_USER.length() && xattrname.substr(0, XATTR_USER.length()) == XATTR_USER &&
@@ -626,7 +617,7 @@ void BtrfsRecv::cmd_setxattr(btrfs_send_command* cmd, uint8_t* data) {
     }
 }
 
-void BtrfsRecv::cmd_removexattr(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_removexattr(const send_command& cmd) {
     wstring pathu;
     string xattrname;
 
@@ -634,7 +625,7 @@ void BtrfsRecv::cmd_removexattr(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -644,7 +635,7 @@ void BtrfsRecv::cmd_removexattr(btrfs_send_command* cmd, uint8_t* data) {
         char* xattrnamebuf;
         ULONG xattrnamelen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_XATTR_NAME, (void**)&xattrnamebuf, &xattrnamelen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_XATTR_NAME, (void**)&xattrnamebuf, &xattrnamelen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"xattr_name");
 
         xattrname = string(xattrnamebuf, xattrnamelen);
@@ -708,13 +699,98 @@ void BtrfsRecv::cmd_removexattr(btrfs_send_command* cmd, uint8_t* data) {
     }
 }
 
-void BtrfsRecv::cmd_write(btrfs_send_command* cmd, uint8_t* data) {
+HANDLE BtrfsRecv::open_write_file(const wstring& pathu) {
+    HANDLE h;
+    FILE_BASIC_INFO fbi;
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+
+    if (lastwritepath == pathu)
+        return lastwritefile;
+
+    if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+        if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
+            throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    CloseHandle(lastwritefile);
+
+    lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
+    if (lastwriteatt == INVALID_FILE_ATTRIBUTES)
+        throw string_error(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+
+    if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+        if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY))
+            throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
+                    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        throw string_error(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+
+    lastwritepath = pathu;
+    lastwritefile = h;
+
+    memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+
+    fbi.LastWriteTime.QuadPart = -1;
+
+    Status = NtSetInformationFile(h, &iosb, &fbi, sizeof(FILE_BASIC_INFO), FileBasicInformation);
+    if (!NT_SUCCESS(Status))
+        throw ntstatus_error(Status);
+
+    return h;
+}
+
+void BtrfsRecv::cmd_write(const send_command& cmd) {
     uint64_t* offset;
     uint8_t* writedata;
     ULONG offsetlen, datalen;
     wstring pathu;
     HANDLE h;
     LARGE_INTEGER offli;
+
+    {
+        char* path;
+        ULONG pathlen;
+
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+            throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
+
+        pathu = utf8_to_utf16(string(path, pathlen));
+    }
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"offset");
+
+    if (offsetlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"offset", offsetlen, sizeof(uint64_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"data");
+
+    h = open_write_file(pathu);
+
+    offli.QuadPart = *offset;
+
+    if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+        throw string_error(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+
+    if (!WriteFile(h, writedata, datalen, nullptr, nullptr))
+        throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+}
+
+void BtrfsRecv::cmd_encoded_write(const send_command& cmd) {
+    uint64_t *offset, *unencoded_file_len, *unencoded_len, *unencoded_offset;
+    uint32_t *compression, *encryption;
+    uint8_t* writedata;
+    ULONG offsetlen, filelenlen, unenclenlen, unencofflen, compressionlen, encryptionlen, datalen;
+    wstring pathu;
+    HANDLE h;
+    LARGE_INTEGER filesize;
+    btrfs_encoded_write* bew;
+    size_t bewlen;
     NTSTATUS Status;
     IO_STATUS_BLOCK iosb;
 
@@ -722,68 +798,106 @@ void BtrfsRecv::cmd_write(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"offset");
 
     if (offsetlen < sizeof(uint64_t))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"offset", offsetlen, sizeof(uint64_t));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, (void**)&unencoded_file_len, &filelenlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_file_len");
+
+    if (filelenlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_file_len", filelenlen, sizeof(uint64_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_UNENCODED_LEN, (void**)&unencoded_len, &unenclenlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_len");
+
+    if (unenclenlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_len", unenclenlen, sizeof(uint64_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_UNENCODED_OFFSET, (void**)&unencoded_offset, &unencofflen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_offset");
+
+    if (unencofflen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_offset", unencofflen, sizeof(uint64_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_COMPRESSION, (void**)&compression, &compressionlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"compression");
+
+    if (compressionlen < sizeof(uint32_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"compression", compressionlen, sizeof(uint32_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_ENCRYPTION, (void**)&encryption, &encryptionlen))
+        encryption = nullptr;
+    else if (encryptionlen < sizeof(uint32_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"encryption", encryptionlen, sizeof(uint32_t));
+
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"data");
 
-    if (lastwritepath != pathu) {
-        FILE_BASIC_INFO fbi;
+    h = open_write_file(pathu);
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
-                throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-        }
+    // the driver won't write past EOF, so extend the file first
 
-        CloseHandle(lastwritefile);
+    if (!GetFileSizeEx(h, &filesize))
+        throw string_error(IDS_RECV_GETFILESIZEEX_FAILED, GetLastError(), format_message(GetLastError()).c_str());
 
-        lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
-        if (lastwriteatt == INVALID_FILE_ATTRIBUTES)
-            throw string_error(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if ((uint64_t)filesize.QuadPart < *offset + *unencoded_file_len) {
+        filesize.QuadPart = *offset + *unencoded_file_len;
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY))
-                throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-        }
+        if (SetFilePointer(h, filesize.LowPart, &filesize.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+            throw string_error(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
 
-        h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
-                        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
-        if (h == INVALID_HANDLE_VALUE)
-            throw string_error(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+        if (!SetEndOfFile(h))
+            throw string_error(IDS_RECV_SETENDOFFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
 
-        lastwritepath = pathu;
-        lastwritefile = h;
+    bewlen = offsetof(btrfs_encoded_write, data[0]) + datalen;
 
-        memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+    bew = (btrfs_encoded_write*)malloc(bewlen);
+    if (!bew)
+        throw string_error(IDS_OUT_OF_MEMORY);
 
-        fbi.LastWriteTime.QuadPart = -1;
+    bew->offset = *offset;
+    bew->unencoded_file_len = *unencoded_file_len;
+    bew->unencoded_len = *unencoded_len;
+    bew->unencoded_offset = *unencoded_offset;
+    bew->compression = *compression;
+    bew->encryption = encryption ? *encryption : 0;
+    bew->length = datalen;
+    memcpy(bew->data, writedata, datalen);
 
-        Status = NtSetInformationFile(h, &iosb, &fbi, sizeof(FILE_BASIC_INFO), FileBasicInformation);
-        if (!NT_SUCCESS(Status))
-            throw ntstatus_error(Status);
-    } else
-        h = lastwritefile;
+    Status = NtFsControlFile(h, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_ENCODED_WRITE, bew, (ULONG)bewlen, nullptr, 0);
 
-    offli.QuadPart = *offset;
+    free(bew);
 
-    if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
-        throw string_error(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    // The driver won't do encoded writes to nodatacow or inline files, or if we
+    // don't have SeManageVolumePrivilege - decompress it ourselves instead.
+    if ((Status == STATUS_NOT_SUPPORTED || Status == STATUS_PRIVILEGE_NOT_HELD) && (!encryption || *encryption == 0)) {
+        const uint8_t* unencoded;
+        LARGE_INTEGER offli;
 
-    if (!WriteFile(h, writedata, datalen, nullptr, nullptr))
-        throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        unencoded = decomp.decompress(*compression, writedata, datalen, *unencoded_len, *unencoded_offset, *unencoded_file_len);
+
+        offli.QuadPart = *offset;
+
+        if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+            throw string_error(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+
+        if (!WriteFile(h, unencoded, (DWORD)*unencoded_file_len, nullptr, nullptr))
+            throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    } else if (!NT_SUCCESS(Status))
+        throw ntstatus_error(Status);
 }
 
-void BtrfsRecv::cmd_clone(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_clone(const send_command& cmd) {
     uint64_t *offset, *cloneoffset, *clonetransid, *clonelen;
     BTRFS_UUID* cloneuuid;
     ULONG i, offsetlen, cloneoffsetlen, cloneuuidlen, clonetransidlen, clonelenlen;
@@ -796,13 +910,13 @@ void BtrfsRecv::cmd_clone(btrfs_send_command* cmd, uint8_t* data) {
     LARGE_INTEGER filesize;
     bool found = false;
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"offset");
 
     if (offsetlen < sizeof(uint64_t))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"offset", offsetlen, sizeof(uint64_t));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_LENGTH, (void**)&clonelen, &clonelenlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_LENGTH, (void**)&clonelen, &clonelenlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_len");
 
     if (clonelenlen < sizeof(uint64_t))
@@ -812,19 +926,19 @@ void BtrfsRecv::cmd_clone(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_UUID, (void**)&cloneuuid, &cloneuuidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_UUID, (void**)&cloneuuid, &cloneuuidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_uuid");
 
     if (cloneuuidlen < sizeof(BTRFS_UUID))
         throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"clone_uuid", cloneuuidlen, sizeof(BTRFS_UUID));
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_CTRANSID, (void**)&clonetransid, &clonetransidlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_CTRANSID, (void**)&clonetransid, &clonetransidlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_ctransid");
 
     if (clonetransidlen < sizeof(uint64_t))
@@ -834,13 +948,13 @@ void BtrfsRecv::cmd_clone(btrfs_send_command* cmd, uint8_t* data) {
         char* clonepath;
         ULONG clonepathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_PATH, (void**)&clonepath, &clonepathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_PATH, (void**)&clonepath, &clonepathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_path");
 
         clonepathu = utf8_to_utf16(string(clonepath, clonepathlen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_CLONE_OFFSET, (void**)&cloneoffset, &cloneoffsetlen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_CLONE_OFFSET, (void**)&cloneoffset, &cloneoffsetlen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"clone_offset");
 
     if (cloneoffsetlen < sizeof(uint64_t))
@@ -918,7 +1032,7 @@ void BtrfsRecv::cmd_clone(btrfs_send_command* cmd, uint8_t* data) {
     }
 }
 
-void BtrfsRecv::cmd_truncate(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_truncate(const send_command& cmd) {
     uint64_t* size;
     ULONG sizelen;
     wstring pathu;
@@ -929,13 +1043,13 @@ void BtrfsRecv::cmd_truncate(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_SIZE, (void**)&size, &sizelen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_SIZE, (void**)&size, &sizelen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"size");
 
     if (sizelen < sizeof(uint64_t))
@@ -972,7 +1086,7 @@ void BtrfsRecv::cmd_truncate(btrfs_send_command* cmd, uint8_t* data) {
     }
 }
 
-void BtrfsRecv::cmd_chmod(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_chmod(const send_command& cmd) {
     win_handle h;
     uint32_t* mode;
     ULONG modelen;
@@ -985,13 +1099,13 @@ void BtrfsRecv::cmd_chmod(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
     }
 
-    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen))
+    if (!find_tlv(cmd, BTRFS_SEND_TLV_MODE, (void**)&mode, &modelen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"mode");
 
     if (modelen < sizeof(uint32_t))
@@ -1012,7 +1126,7 @@ void BtrfsRecv::cmd_chmod(btrfs_send_command* cmd, uint8_t* data) {
         throw string_error(IDS_RECV_SETINODEINFO_FAILED, Status, format_ntstatus(Status).c_str());
 }
 
-void BtrfsRecv::cmd_chown(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_chown(const send_command& cmd) {
     win_handle h;
     uint32_t *uid, *gid;
     ULONG uidlen, gidlen;
@@ -1023,7 +1137,7 @@ void BtrfsRecv::cmd_chown(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -1036,7 +1150,7 @@ void BtrfsRecv::cmd_chown(btrfs_send_command* cmd, uint8_t* data) {
 
     memset(&bsii, 0, sizeof(btrfs_set_inode_info));
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_UID, (void**)&uid, &uidlen)) {
+    if (find_tlv(cmd, BTRFS_SEND_TLV_UID, (void**)&uid, &uidlen)) {
         if (uidlen < sizeof(uint32_t))
             throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"uid", uidlen, sizeof(uint32_t));
 
@@ -1044,7 +1158,7 @@ void BtrfsRecv::cmd_chown(btrfs_send_command* cmd, uint8_t* data) {
         bsii.st_uid = *uid;
     }
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_GID, (void**)&gid, &gidlen)) {
+    if (find_tlv(cmd, BTRFS_SEND_TLV_GID, (void**)&gid, &gidlen)) {
         if (gidlen < sizeof(uint32_t))
             throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"gid", gidlen, sizeof(uint32_t));
 
@@ -1066,7 +1180,7 @@ static __inline uint64_t unix_time_to_win(BTRFS_TIME* t) {
     return (t->seconds * 10000000) + (t->nanoseconds / 100) + 116444736000000000;
 }
 
-void BtrfsRecv::cmd_utimes(btrfs_send_command* cmd, uint8_t* data) {
+void BtrfsRecv::cmd_utimes(const send_command& cmd) {
     wstring pathu;
     win_handle h;
     FILE_BASIC_INFO fbi;
@@ -1079,7 +1193,7 @@ void BtrfsRecv::cmd_utimes(btrfs_send_command* cmd, uint8_t* data) {
         char* path;
         ULONG pathlen;
 
-        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+        if (!find_tlv(cmd, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
             throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
         pathu = utf8_to_utf16(string(path, pathlen));
@@ -1092,16 +1206,16 @@ void BtrfsRecv::cmd_utimes(btrfs_send_command* cmd, uint8_t* data) {
 
     memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_OTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
+    if (find_tlv(cmd, BTRFS_SEND_TLV_OTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
         fbi.CreationTime.QuadPart = unix_time_to_win(time);
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_ATIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
+    if (find_tlv(cmd, BTRFS_SEND_TLV_ATIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
         fbi.LastAccessTime.QuadPart = unix_time_to_win(time);
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_MTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
+    if (find_tlv(cmd, BTRFS_SEND_TLV_MTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
         fbi.LastWriteTime.QuadPart = unix_time_to_win(time);
 
-    if (find_tlv(data, cmd->length, BTRFS_SEND_TLV_CTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
+    if (find_tlv(cmd, BTRFS_SEND_TLV_CTIME, (void**)&time, &timelen) && timelen >= sizeof(BTRFS_TIME))
         fbi.ChangeTime.QuadPart = unix_time_to_win(time);
 
     Status = NtSetInformationFile(h, &iosb, &fbi, sizeof(FILE_BASIC_INFO), FileBasicInformation);
@@ -1139,87 +1253,68 @@ static void delete_directory(const wstring& dir) {
     RemoveDirectoryW(dir.c_str());
 }
 
-static bool check_csum(btrfs_send_command* cmd, uint8_t* data) {
-    uint32_t crc32 = cmd->csum, calc;
+class win_send_source : public send_source {
+public:
+    win_send_source(HANDLE h) : h(h) {
+    }
 
-    cmd->csum = 0;
+    size_t read(void* buf, size_t len) override {
+        DWORD bytes_read;
 
-    calc = calc_crc32c(0, (uint8_t*)cmd, sizeof(btrfs_send_command));
+        if (!ReadFile(h, buf, (DWORD)min(len, (size_t)0x40000000), &bytes_read, nullptr))
+            throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
 
-    if (cmd->length > 0)
-        calc = calc_crc32c(calc, data, cmd->length);
+        return bytes_read;
+    }
 
-    return calc == crc32 ? true : false;
-}
+private:
+    HANDLE h;
+};
 
-void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const win_handle& parent) {
-    try {
-        btrfs_send_header header;
-        bool ended = false;
+static string_error stream_error(const send_stream_error& e) {
+    switch (e.code) {
+        case send_error::not_a_send_stream:
+            return string_error(IDS_RECV_NOT_A_SEND_STREAM);
 
-        if (!ReadFile(f, &header, sizeof(btrfs_send_header), nullptr, nullptr))
-            throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        case send_error::unsupported_version:
+            return string_error(IDS_RECV_UNSUPPORTED_VERSION, e.value);
 
-        *pos += sizeof(btrfs_send_header);
+        case send_error::csum_error:
+        case send_error::command_too_long:
+            return string_error(IDS_RECV_CSUM_ERROR);
 
-        if (memcmp(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic)))
-            throw string_error(IDS_RECV_NOT_A_SEND_STREAM);
+        case send_error::unknown_command:
+            return string_error(IDS_RECV_UNKNOWN_COMMAND, e.value);
 
-        if (header.version > 1)
-            throw string_error(IDS_RECV_UNSUPPORTED_VERSION, header.version);
+        default:
+            return string_error(IDS_RECV_FILE_TRUNCATED);
+    }
+}
 
+void BtrfsRecv::do_recv(send_stream& s, uint64_t size) {
+    try {
         SendMessageW(GetDlgItem(hwnd, IDC_RECV_PROGRESS), PBM_SETRANGE32, 0, (LPARAM)65536);
 
         lastwritefile = INVALID_HANDLE_VALUE;
         lastwritepath = L"";
         lastwriteatt = 0;
 
-        while (true) {
-            btrfs_send_command cmd;
-            uint8_t* data = nullptr;
+        while (!cancelling) {
             ULONG progress;
 
-            if (cancelling)
-                break;
-
-            progress = (ULONG)((float)*pos * 65536.0f / (float)size);
+            progress = (ULONG)((float)s.offset() * 65536.0f / (float)size);
             SendMessageW(GetDlgItem(hwnd, IDC_RECV_PROGRESS), PBM_SETPOS, progress, 0);
 
-            if (!ReadFile(f, &cmd, sizeof(btrfs_send_command), nullptr, nullptr)) {
-                if (GetLastError() != ERROR_HANDLE_EOF)
-                    throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+            auto& batch = s.next_batch();
 
+            if (batch.empty())
                 break;
-            }
 
-            *pos += sizeof(btrfs_send_command);
-
-            if (cmd.length > 0) {
-                if (*pos + cmd.length > size)
-                    throw string_error(IDS_RECV_FILE_TRUNCATED);
-
-                data = (uint8_t*)malloc(cmd.length);
-                if (!data)
-                    throw string_error(IDS_OUT_OF_MEMORY);
-            }
-
-            try {
-                if (data) {
-                    if (!ReadFile(f, data, cmd.length, nullptr, nullptr))
-                        throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-
-                    *pos += cmd.length;
-                }
-
-                if (!check_csum(&cmd, data))
-                    throw string_error(IDS_RECV_CSUM_ERROR);
-
-                if (cmd.cmd == BTRFS_SEND_CMD_END) {
-                    ended = true;
+            for (const auto& cmd : batch) {
+                if (cancelling)
                     break;
-                }
 
-                if (lastwritefile != INVALID_HANDLE_VALUE && cmd.cmd != BTRFS_SEND_CMD_WRITE) {
+                if (lastwritefile != INVALID_HANDLE_VALUE && cmd.cmd != BTRFS_SEND_CMD_WRITE && cmd.cmd != BTRFS_SEND_CMD_ENCODED_WRITE) {
                     if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
                         if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
                             throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
@@ -1232,85 +1327,8 @@ void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
                     lastwriteatt = 0;
                 }
 
-                switch (cmd.cmd) {
-                    case BTRFS_SEND_CMD_SUBVOL:
-                        cmd_subvol(&cmd, data, parent);
-                    break;
-
-                    case BTRFS_SEND_CMD_SNAPSHOT:
-                        cmd_snapshot(&cmd, data, parent);
-                    break;
-
-                    case BTRFS_SEND_CMD_MKFILE:
-                    case BTRFS_SEND_CMD_MKDIR:
-                    case BTRFS_SEND_CMD_MKNOD:
-                    case BTRFS_SEND_CMD_MKFIFO:
-                    case BTRFS_SEND_CMD_MKSOCK:
-                    case BTRFS_SEND_CMD_SYMLINK:
-                        cmd_mkfile(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_RENAME:
-                        cmd_rename(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_LINK:
-                        cmd_link(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UNLINK:
-                        cmd_unlink(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_RMDIR:
-                        cmd_rmdir(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_SET_XATTR:
-                        cmd_setxattr(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_REMOVE_XATTR:
-                        cmd_removexattr(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_WRITE:
-                        cmd_write(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CLONE:
-                        cmd_clone(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_TRUNCATE:
-                        cmd_truncate(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CHMOD:
-                        cmd_chmod(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CHOWN:
-                        cmd_chown(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UTIMES:
-                        cmd_utimes(&cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UPDATE_EXTENT:
-                        // does nothing
-                    break;
-
-                    default:
-                        throw string_error(IDS_RECV_UNKNOWN_COMMAND, cmd.cmd);
-                }
-            } catch (...) {
-                if (data) free(data);
-                throw;
+                dispatch(cmd);
             }
-
-            if (data) free(data);
         }
 
         if (lastwritefile != INVALID_HANDLE_VALUE) {
@@ -1322,7 +1340,7 @@ void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
             CloseHandle(lastwritefile);
         }
 
-        if (!ended && !cancelling)
+        if (!s.ended() && !cancelling)
             throw string_error(IDS_RECV_FILE_TRUNCATED);
 
         if (!cancelling) {
@@ -1387,7 +1405,6 @@ static void check_cpu() {
 
 DWORD BtrfsRecv::recv_thread() {
     LARGE_INTEGER size;
-    uint64_t pos = 0;
     bool b = true;
 
     running = true;
@@ -1406,9 +1423,18 @@ DWORD BtrfsRecv::recv_thread() {
             if (parent == INVALID_HANDLE_VALUE)
                 throw string_error(IDS_RECV_CANT_OPEN_PATH, dirpath.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 
-            do {
-                do_recv(f, &pos, size.QuadPart, parent);
-            } while (pos < (uint64_t)size.QuadPart);
+            win_send_source src(f);
+            send_stream s(src);
+
+            this->parent = parent;
+
+            try {
+                while (!cancelling && s.read_header()) {
+                    do_recv(s, size.QuadPart);
+                }
+            } catch (const send_stream_error& e) {
+                throw stream_error(e);
+            }
         }
     } catch (const exception& e) {
         auto msg = utf8_to_utf16(e.what());
@@ -19,6 +19,8 @@
 
 #include <shlobj.h>
 #include "../btrfs.h"
+#include "../recv/sendstream.h"
+#include "../recv/decompress.h"
 
 extern LONG objs_loaded;
 
@@ -28,10 +30,11 @@ typedef struct {
     wstring path;
 } subvol_cache;
 
-class BtrfsRecv {
+class BtrfsRecv : public send_handler {
 public:
     BtrfsRecv() {
         thread = nullptr;
+        parent = INVALID_HANDLE_VALUE;
         master = INVALID_HANDLE_VALUE;
         dir = INVALID_HANDLE_VALUE;
         running = false;
@@ -50,27 +53,31 @@ public:
     DWORD recv_thread();
     INT_PTR CALLBACK RecvProgressDlgProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
+protected:
+    void cmd_subvol(const send_command& cmd) override;
+    void cmd_snapshot(const send_command& cmd) override;
+    void cmd_mkfile(const send_command& cmd) override;
+    void cmd_rename(const send_command& cmd) override;
+    void cmd_link(const send_command& cmd) override;
+    void cmd_unlink(const send_command& cmd) override;
+    void cmd_rmdir(const send_command& cmd) override;
+    void cmd_setxattr(const send_command& cmd) override;
+    void cmd_removexattr(const send_command& cmd) override;
+    void cmd_write(const send_command& cmd) override;
+    void cmd_encoded_write(const send_command& cmd) override;
+    void cmd_clone(const send_command& cmd) override;
+    void cmd_truncate(const send_command& cmd) override;
+    void cmd_chmod(const send_command& cmd) override;
+    void cmd_chown(const send_command& cmd) override;
+    void cmd_utimes(const send_command& cmd) override;
+
 private:
-    void cmd_subvol(btrfs_send_command* cmd, uint8_t* data, const win_handle& parent);
-    void cmd_snapshot(btrfs_send_command* cmd, uint8_t* data, const win_handle& parent);
-    void cmd_mkfile(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_rename(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_link(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_unlink(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_rmdir(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_setxattr(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_removexattr(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_write(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_clone(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_truncate(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_chmod(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_chown(btrfs_send_command* cmd, uint8_t* data);
-    void cmd_utimes(btrfs_send_command* cmd, uint8_t* data);
+    HANDLE open_write_file(const wstring& pathu);
     void add_cache_entry(BTRFS_UUID* uuid, uint64_t transid, const wstring& path);
-    bool find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** value, ULONG* len);
-    void do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const win_handle& parent);
+    bool find_tlv(const send_command& cmd, uint16_t type, void** value, ULONG* len);
+    void do_recv(send_stream& s, uint64_t size);
 
-    HANDLE dir, master, thread, lastwritefile;
+    HANDLE dir, master, thread, lastwritefile, parent;
     HWND hwnd;
     wstring streamfile, dirpath, subvolpath, lastwritepath;
     DWORD lastwriteatt;
@@ -79,4 +86,5 @@ private:
     BTRFS_UUID subvol_uuid;
     bool running, cancelling;
     vector<subvol_cache> cache;
+    encoded_decompressor decomp;
 };
@@ -206,6 +206,8 @@
 #define IDS_CANT_OPEN_MOUNTMGR          289
 #define IDS_TVM_INSERTITEM_FAILED       290
 #define IDS_RECV_PATH_TOO_LONG          291
+#define IDS_BALANCE_ESTIMATE            292
+#define IDS_BALANCE_ESTIMATE_TITLE      293
 #define IDC_UID                         1001
 #define IDC_GID                         1002
 #define IDC_USERR                       1003
@@ -336,6 +338,10 @@
 #define IDC_RESIZE_NEWSIZE              1073
 #define IDC_VOL_CHANGE_DRIVE_LETTER     1073
 #define IDC_DRIVE_LETTER_COMBO          1074
+#define IDC_ORDER_USAGE                 1075
+#define IDC_TARGET                      1076
+#define IDC_TARGET_SIZE                 1077
+#define IDC_ESTIMATE_BALANCE            1078
 
 // Next default values for new objects
 //
@@ -343,7 +349,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        179
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1075
+#define _APS_NEXT_CONTROL_VALUE         1079
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
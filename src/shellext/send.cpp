@@ -557,7 +557,7 @@ extern "C" void CALLBACK SendSubvolGUIW(HWND hwnd, HINSTANCE, LPWSTR lpszCmdLine
     }
 }
 
-static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones) {
+static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones, uint32_t version) {
     char* buf;
     win_handle dirh, stream;
     ULONG i;
@@ -579,7 +579,8 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
             throw last_error(GetLastError());
 
         try {
-            size_t bss_size = offsetof(btrfs_send_subvol, clones[0]) + (clones.size() * sizeof(HANDLE));
+            // the version goes after the clones
+            size_t bss_size = offsetof(btrfs_send_subvol, clones[0]) + (clones.size() * sizeof(HANDLE)) + sizeof(ULONG);
             bss = (btrfs_send_subvol*)malloc(bss_size);
             memset(bss, 0, bss_size);
 
@@ -595,6 +596,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
                 bss->parent = nullptr;
 
             bss->num_clones = (ULONG)clones.size();
+            *(ULONG*)&bss->clones[bss->num_clones] = version;
 
             for (i = 0; i < bss->num_clones; i++) {
                 HANDLE h;
@@ -628,7 +630,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
                 throw ntstatus_error(Status);
 
             memcpy(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic));
-            header.version = 1;
+            header.version = version;
 
             if (!WriteFile(stream, &header, sizeof(header), nullptr, nullptr))
                 throw last_error(GetLastError());
@@ -674,6 +676,7 @@ extern "C" void CALLBACK SendSubvolW(HWND, HINSTANCE, LPWSTR lpszCmdLine, int) {
     vector<wstring> args;
     wstring subvol, parent, file;
     vector<wstring> clones;
+    uint32_t version = BTRFS_SEND_STREAM_VERSION;
 
     command_line_to_args(lpszCmdLine, args);
 
@@ -700,7 +703,10 @@ extern "C" void CALLBACK SendSubvolW(HWND, HINSTANCE, LPWSTR lpszCmdLine, int) {
 
         for (unsigned int i = 0; i < args.size(); i++) {
             if (args[i][0] == '-') {
-                if (args[i][2] == 0 && i < args.size() - 1) {
+                if (args[i] == L"--proto" && i < args.size() - 1) {
+                    version = (uint32_t)wcstoul(args[i+1].c_str(), nullptr, 10);
+                    i++;
+                } else if (args[i][2] == 0 && i < args.size() - 1) {
                     if (args[i][1] == 'p') {
                         parent = args[i+1];
                         i++;
@@ -719,7 +725,7 @@ extern "C" void CALLBACK SendSubvolW(HWND, HINSTANCE, LPWSTR lpszCmdLine, int) {
 
         if (subvol != L"" && file != L"") {
             try {
-                send_subvol(subvol, file, parent, clones);
+                send_subvol(subvol, file, parent, clones, version);
             } catch (const exception& e) {
                 cerr << "Error: " << e.what() << endl;
             }
@@ -38,7 +38,9 @@ using namespace std;
 #define STATUS_END_OF_FILE              (NTSTATUS)0xc0000011
 #define STATUS_MORE_PROCESSING_REQUIRED (NTSTATUS)0xc0000016
 #define STATUS_BUFFER_TOO_SMALL         (NTSTATUS)0xc0000023
+#define STATUS_PRIVILEGE_NOT_HELD       (NTSTATUS)0xc0000061
 #define STATUS_DEVICE_NOT_READY         (NTSTATUS)0xc00000a3
+#define STATUS_NOT_SUPPORTED            (NTSTATUS)0xc00000bb
 #define STATUS_CANNOT_DELETE            (NTSTATUS)0xc0000121
 #define STATUS_NOT_FOUND                (NTSTATUS)0xc0000225
 
@@ -15,9 +15,14 @@
  * You should have received a copy of the GNU Lesser General Public Licence
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
+#ifndef _WIN32
+#define _GNU_SOURCE // for fallocate and SEEK_DATA
+#endif
+
 #include <stdlib.h>
 #include <stddef.h>
 #include <time.h>
+#ifdef _WIN32
 #include <ntstatus.h>
 #define WIN32_NO_STATUS
 #include <windef.h>
@@ -30,13 +35,39 @@
 #include <ata.h>
 #include <mountmgr.h>
 #include <stringapiset.h>
+#else
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <search.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+// sys/stat.h defines these as macros
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+#endif
 #include <stdbool.h>
 #include "../btrfs.h"
+#ifdef _WIN32
 #include "../btrfsioctl.h"
+#endif
 #include "../crc32c.h"
 #include "../zstd/lib/common/xxhash.h"
 
-#if defined(_X86_) || defined(_AMD64_)
+#if defined(_X86_) || defined(_AMD64_) || (!defined(_WIN32) && (defined(__i386__) || defined(__x86_64__)))
+#define HAVE_CPUID
 #ifndef _MSC_VER
 #include <cpuid.h>
 #else
@@ -50,6 +81,7 @@ void calc_sha256(uint8_t* hash, const void* input, size_t len);
 #define BLAKE2_HASH_SIZE 32
 void blake2b(void *out, size_t outlen, const void* in, size_t inlen);
 
+#ifdef _WIN32
 #define FSCTL_LOCK_VOLUME               CTL_CODE(FILE_DEVICE_FILE_SYSTEM,  6, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_UNLOCK_VOLUME             CTL_CODE(FILE_DEVICE_FILE_SYSTEM,  7, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_DISMOUNT_VOLUME           CTL_CODE(FILE_DEVICE_FILE_SYSTEM,  8, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -69,7 +101,39 @@ NTSTATUS NTAPI NtReadFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRo
 #ifdef __cplusplus
 }
 #endif
+#else
+// On Linux, we build as the mkbtrfs executable rather than as a DLL. The
+// device is a file descriptor, and the NT definitions below are just enough
+// for the code that both share.
+
+typedef int32_t NTSTATUS;
+typedef uint32_t ULONG;
+typedef int HANDLE;
+typedef void VOID;
+
+#define NT_SUCCESS(Status) ((NTSTATUS)(Status) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xc000000d)
+#define STATUS_INVALID_VOLUME_LABEL     ((NTSTATUS)0xc0000086)
+#define STATUS_DISK_FULL                ((NTSTATUS)0xc000007f)
+#define STATUS_INTERNAL_ERROR           ((NTSTATUS)0xc00000e5)
+#define STATUS_UNEXPECTED_IO_ERROR      ((NTSTATUS)0xc00000e9)
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) ((type*)((uint8_t*)(address) - offsetof(type, field)))
+#define RtlZeroMemory(dest, length) memset(dest, 0, length)
+#define FORCEINLINE static inline
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
+#ifdef _WIN32
 // These are undocumented, and what comes from format.exe
 typedef struct {
     void* table;
@@ -94,6 +158,7 @@ typedef struct {
     uint32_t flags;
     DSTRING* label;
 } options;
+#endif
 
 FORCEINLINE VOID InitializeListHead(PLIST_ENTRY ListHead) {
     ListHead->Flink = ListHead->Blink = ListHead;
@@ -128,22 +193,64 @@ typedef struct {
     uint64_t lastoff;
     uint64_t used;
     LIST_ENTRY used_space;
+    uint8_t* row; // RAID5 and RAID6: the full stripe being written, and space for its parity
+    uint64_t row_num;
     LIST_ENTRY list_entry;
 } btrfs_chunk;
 
+typedef struct {
+    uint64_t address;
+    KEY firstkey;
+    uint8_t level;
+    uint32_t num_items; // for internal nodes, the number of children
+    LIST_ENTRY* first_item; // leaves only
+    uint32_t first_child; // internal nodes only, index into btrfs_root.nodes
+} btrfs_node;
+
 typedef struct {
     uint64_t id;
     tree_header header;
     btrfs_chunk* c;
     LIST_ENTRY items;
+    LIST_ENTRY* last_added;
+    btrfs_node* nodes; // leaves, then each level of internal nodes in turn
+    uint32_t num_nodes;
     LIST_ENTRY list_entry;
 } btrfs_root;
 
 typedef struct {
     DEV_ITEM dev_item;
     uint64_t last_alloc;
+    HANDLE h;
 } btrfs_dev;
 
+#define BLOCK_FLAG_PROFILES (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID1 | BLOCK_FLAG_DUPLICATE | BLOCK_FLAG_RAID10 | BLOCK_FLAG_RAID5 | \
+                             BLOCK_FLAG_RAID6 | BLOCK_FLAG_RAID1C3 | BLOCK_FLAG_RAID1C4)
+
+#define PROFILE_DEFAULT 0xffffffffffffffff
+
+typedef struct {
+    uint64_t flag;
+    const char* name;
+    uint16_t devs_min;
+    uint16_t devs_max; // 0 for as many as there are
+    uint16_t dev_stripes;
+    uint16_t sub_stripes;
+} raid_profile;
+
+// the same minimums as the driver uses in alloc_chunk
+static const raid_profile raid_profiles[] = {
+    { 0,                    "single",   1, 1, 1, 0 },
+    { BLOCK_FLAG_DUPLICATE, "dup",      1, 1, 2, 0 },
+    { BLOCK_FLAG_RAID0,     "raid0",    2, 0, 1, 0 },
+    { BLOCK_FLAG_RAID1,     "raid1",    2, 2, 1, 1 },
+    { BLOCK_FLAG_RAID1C3,   "raid1c3",  3, 3, 1, 1 },
+    { BLOCK_FLAG_RAID1C4,   "raid1c4",  4, 4, 1, 1 },
+    { BLOCK_FLAG_RAID10,    "raid10",   4, 0, 1, 2 },
+    { BLOCK_FLAG_RAID5,     "raid5",    3, 0, 1, 1 },
+    { BLOCK_FLAG_RAID6,     "raid6",    4, 0, 1, 1 },
+};
+
 #define keycmp(key1, key2)\
     ((key1.obj_id < key2.obj_id) ? -1 :\
     ((key1.obj_id > key2.obj_id) ? 1 :\
@@ -153,12 +260,15 @@ typedef struct {
     ((key1.offset > key2.offset) ? 1 :\
     0))))))
 
+#ifdef _WIN32
 HMODULE module;
+#endif
 ULONG def_sector_size = 0, def_node_size = 0;
 uint64_t def_incompat_flags = BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF | BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA;
 uint64_t def_compat_ro_flags = 0;
 uint16_t def_csum_type = CSUM_TYPE_CRC32C;
 
+#ifdef _WIN32
 // the following definitions come from fmifs.h in ReactOS
 
 typedef struct {
@@ -214,6 +324,7 @@ typedef enum {
 } CALLBACKCOMMAND;
 
 typedef BOOLEAN (NTAPI* PFMIFSCALLBACK)(CALLBACKCOMMAND Command, ULONG SubAction, PVOID ActionInfo);
+#endif
 
 static bool IsListEmpty(LIST_ENTRY* head) {
     return head->Flink == head;
@@ -230,6 +341,12 @@ static LIST_ENTRY* RemoveHeadList(LIST_ENTRY* head) {
     return entry;
 }
 
+static void RemoveEntryList(LIST_ENTRY* entry) {
+    entry->Blink->Flink = entry->Flink;
+    entry->Flink->Blink = entry->Blink;
+}
+
+#ifdef _WIN32
 NTSTATUS WINAPI ChkdskEx(PUNICODE_STRING DriveRoot, BOOLEAN FixErrors, BOOLEAN Verbose, BOOLEAN CheckOnlyIfDirty,
                          BOOLEAN ScanDrive, PFMIFSCALLBACK Callback) {
     // STUB
@@ -245,6 +362,7 @@ NTSTATUS WINAPI ChkdskEx(PUNICODE_STRING DriveRoot, BOOLEAN FixErrors, BOOLEAN V
 
     return STATUS_SUCCESS;
 }
+#endif
 
 static btrfs_root* add_root(LIST_ENTRY* roots, uint64_t id) {
     btrfs_root* root;
@@ -254,6 +372,9 @@ static btrfs_root* add_root(LIST_ENTRY* roots, uint64_t id) {
     root->id = id;
     RtlZeroMemory(&root->header, sizeof(tree_header));
     InitializeListHead(&root->items);
+    root->last_added = NULL;
+    root->nodes = NULL;
+    root->num_nodes = 0;
     InsertTailList(roots, &root->list_entry);
 
     return root;
@@ -280,6 +401,9 @@ static void free_roots(LIST_ENTRY* roots) {
             le3 = le4;
         }
 
+        if (r->nodes)
+            free(r->nodes);
+
         free(r);
 
         le = le2;
@@ -300,6 +424,9 @@ static void free_chunks(LIST_ENTRY* chunks) {
             free(use);
         }
 
+        if (c->row)
+            free(c->row);
+
         free(c->chunk_item);
         free(c);
 
@@ -326,6 +453,18 @@ static void add_item(btrfs_root* r, uint64_t obj_id, uint8_t obj_type, uint64_t
     }
 
     le = r->items.Flink;
+
+    // Items are mostly added in order, so rather than always searching from
+    // the start, carry on from the last item added if we can.
+    if (r->last_added) {
+        btrfs_item* last = CONTAINING_RECORD(r->last_added, btrfs_item, list_entry);
+
+        if (keycmp(item->key, last->key) == 1)
+            le = r->last_added->Flink;
+    }
+
+    r->last_added = &item->list_entry;
+
     while (le != &r->items) {
         btrfs_item* i2 = CONTAINING_RECORD(le, btrfs_item, list_entry);
 
@@ -340,6 +479,29 @@ static void add_item(btrfs_root* r, uint64_t obj_id, uint8_t obj_type, uint64_t
     InsertTailList(&r->items, &item->list_entry);
 }
 
+static void remove_items(btrfs_root* r, bool (*match)(btrfs_item* item)) {
+    LIST_ENTRY* le;
+
+    le = r->items.Flink;
+    while (le != &r->items) {
+        LIST_ENTRY* le2 = le->Flink;
+        btrfs_item* item = CONTAINING_RECORD(le, btrfs_item, list_entry);
+
+        if (!match || match(item)) {
+            RemoveEntryList(le);
+
+            if (item->data)
+                free(item->data);
+
+            free(item);
+        }
+
+        le = le2;
+    }
+
+    r->last_added = NULL;
+}
+
 static uint64_t find_chunk_offset(uint64_t size, uint64_t offset, btrfs_dev* dev, btrfs_root* dev_root, BTRFS_UUID* chunkuuid) {
     uint64_t off;
     DEV_EXTENT de;
@@ -360,14 +522,45 @@ static uint64_t find_chunk_offset(uint64_t size, uint64_t offset, btrfs_dev* dev
     return off;
 }
 
-static btrfs_chunk* add_chunk(LIST_ENTRY* chunks, uint64_t flags, btrfs_root* chunk_root, btrfs_dev* dev, btrfs_root* dev_root, BTRFS_UUID* chunkuuid, uint32_t sector_size) {
-    uint64_t off, size;
-    uint16_t stripes, i;
+static const raid_profile* get_raid_profile(uint64_t flags) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof(raid_profiles) / sizeof(raid_profiles[0]); i++) {
+        if ((flags & BLOCK_FLAG_PROFILES) == raid_profiles[i].flag)
+            return &raid_profiles[i];
+    }
+
+    return NULL;
+}
+
+// how many stripes' worth of data each row of the chunk holds
+static uint16_t get_data_stripes(CHUNK_ITEM* ci) {
+    if (ci->type & BLOCK_FLAG_RAID0)
+        return ci->num_stripes;
+    else if (ci->type & BLOCK_FLAG_RAID10)
+        return ci->num_stripes / ci->sub_stripes;
+    else if (ci->type & BLOCK_FLAG_RAID5)
+        return ci->num_stripes - 1;
+    else if (ci->type & BLOCK_FLAG_RAID6)
+        return ci->num_stripes - 2;
+    else
+        return 1;
+}
+
+static btrfs_chunk* add_chunk(LIST_ENTRY* chunks, uint64_t flags, uint64_t min_size, btrfs_root* chunk_root, btrfs_dev* devs, uint16_t num_devices,
+                              btrfs_root* dev_root, BTRFS_UUID* chunkuuid, uint32_t sector_size) {
+    uint64_t off, stripe_size, min_stripe_size, max_chunk_size, total_size = 0;
+    uint16_t num_devs = 0, stripes, factor, i, j;
     btrfs_chunk* c;
     LIST_ENTRY* le;
     CHUNK_ITEM_STRIPE* cis;
+    btrfs_dev** sorted;
+    const raid_profile* prof = get_raid_profile(flags);
     uint64_t stripe_length = max(sector_size, 0x10000);
 
+    if (!prof)
+        return NULL;
+
     off = 0xc00000;
     le = chunks->Flink;
     while (le != chunks) {
@@ -379,31 +572,108 @@ static btrfs_chunk* add_chunk(LIST_ENTRY* chunks, uint64_t flags, btrfs_root* ch
         le = le->Flink;
     }
 
+    for (i = 0; i < num_devices; i++) {
+        total_size += devs[i].dev_item.num_bytes;
+    }
+
     if (flags & BLOCK_FLAG_METADATA) {
-        if (dev->dev_item.num_bytes > 0xC80000000) // 50 GB
-            size = 0x40000000; // 1 GB
+        if (total_size > 0xC80000000) // 50 GB
+            stripe_size = 0x40000000; // 1 GB
         else
-            size = 0x10000000; // 256 MB
-    } else // BLOCK_FLAG_SYSTEM
-        size = 0x800000;
+            stripe_size = 0x10000000; // 256 MB
+
+        max_chunk_size = stripe_size;
+    } else if (flags & BLOCK_FLAG_DATA) {
+        stripe_size = 0x40000000; // 1 GB
+        max_chunk_size = 10 * stripe_size;
+    } else { // BLOCK_FLAG_SYSTEM
+        stripe_size = 0x800000;
+        max_chunk_size = 2 * stripe_size;
+    }
+
+    max_chunk_size = min(max_chunk_size, total_size / 10); // cap at 10%
+
+    // use the devices with the most space left first
+
+    sorted = malloc(num_devices * sizeof(btrfs_dev*));
+
+    for (i = 0; i < num_devices; i++) {
+        btrfs_dev* dev = &devs[i];
+
+        if ((dev->dev_item.num_bytes - dev->last_alloc) / prof->dev_stripes < stripe_length)
+            continue;
+
+        for (j = num_devs; j > 0 && sorted[j - 1]->dev_item.num_bytes - sorted[j - 1]->last_alloc <
+                                    dev->dev_item.num_bytes - dev->last_alloc; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+
+        sorted[j] = dev;
+        num_devs++;
+    }
+
+    if (prof->devs_max != 0)
+        num_devs = min(num_devs, prof->devs_max);
+
+    if (prof->flag == BLOCK_FLAG_RAID10)
+        num_devs &= ~1;
+
+    if (num_devs < prof->devs_min) {
+        free(sorted);
+        return NULL;
+    }
+
+    stripes = num_devs * prof->dev_stripes;
+
+    switch (prof->flag) {
+        case BLOCK_FLAG_RAID0:
+            factor = stripes;
+        break;
+
+        case BLOCK_FLAG_RAID10:
+            factor = stripes / prof->sub_stripes;
+        break;
+
+        case BLOCK_FLAG_RAID5:
+            factor = stripes - 1;
+        break;
+
+        case BLOCK_FLAG_RAID6:
+            factor = stripes - 2;
+        break;
+
+        default:
+            factor = 1;
+    }
 
-    size = min(size, dev->dev_item.num_bytes / 10); // cap at 10%
-    size &= ~(stripe_length - 1);
+    min_stripe_size = (min_size + factor - 1) / factor;
+    min_stripe_size = (min_stripe_size + stripe_length - 1) & ~(stripe_length - 1);
 
-    stripes = flags & BLOCK_FLAG_DUPLICATE ? 2 : 1;
+    stripe_size = min(stripe_size, max_chunk_size / factor);
+    stripe_size = max(stripe_size, min_stripe_size);
 
-    if (dev->dev_item.num_bytes - dev->dev_item.bytes_used < stripes * size) // not enough space
+    for (i = 0; i < num_devs; i++) { // shrink to what's left
+        stripe_size = min(stripe_size, (sorted[i]->dev_item.num_bytes - sorted[i]->last_alloc) / prof->dev_stripes);
+    }
+
+    stripe_size &= ~(stripe_length - 1);
+
+    if (stripe_size == 0 || stripe_size < min_stripe_size) { // not enough space
+        free(sorted);
         return NULL;
+    }
 
     c = malloc(sizeof(btrfs_chunk));
     c->offset = off;
     c->lastoff = off;
     c->used = 0;
+    c->row = NULL;
+    c->row_num = 0xffffffffffffffff;
     InitializeListHead(&c->used_space);
 
     c->chunk_item = malloc(sizeof(CHUNK_ITEM) + (stripes * sizeof(CHUNK_ITEM_STRIPE)));
 
-    c->chunk_item->size = size;
+    c->chunk_item->size = stripe_size * factor;
     c->chunk_item->root_id = BTRFS_ROOT_EXTENT;
     c->chunk_item->stripe_length = stripe_length;
     c->chunk_item->type = flags;
@@ -411,16 +681,20 @@ static btrfs_chunk* add_chunk(LIST_ENTRY* chunks, uint64_t flags, btrfs_root* ch
     c->chunk_item->opt_io_width = stripe_length;
     c->chunk_item->sector_size = sector_size;
     c->chunk_item->num_stripes = stripes;
-    c->chunk_item->sub_stripes = 0;
+    c->chunk_item->sub_stripes = prof->sub_stripes;
 
     cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
 
     for (i = 0; i < stripes; i++) {
+        btrfs_dev* dev = sorted[i / prof->dev_stripes];
+
         cis[i].dev_id = dev->dev_item.dev_id;
-        cis[i].offset = find_chunk_offset(size, c->offset, dev, dev_root, chunkuuid);
+        cis[i].offset = find_chunk_offset(stripe_size, c->offset, dev, dev_root, chunkuuid);
         cis[i].dev_uuid = dev->dev_item.device_uuid;
     }
 
+    free(sorted);
+
     add_item(chunk_root, 0x100, TYPE_CHUNK_ITEM, c->offset, c->chunk_item, sizeof(CHUNK_ITEM) + (stripes * sizeof(CHUNK_ITEM_STRIPE)));
 
     InsertTailList(chunks, &c->list_entry);
@@ -428,32 +702,75 @@ static btrfs_chunk* add_chunk(LIST_ENTRY* chunks, uint64_t flags, btrfs_root* ch
     return c;
 }
 
+static void get_raid0_offset(uint64_t off, uint64_t stripe_length, uint16_t num_stripes, uint64_t* stripeoff, uint16_t* stripe) {
+    uint64_t initoff, startoff;
+
+    startoff = off % (num_stripes * stripe_length);
+    initoff = (off / (num_stripes * stripe_length)) * stripe_length;
+
+    *stripe = (uint16_t)(startoff / stripe_length);
+    *stripeoff = initoff + startoff - (*stripe * stripe_length);
+}
+
+static bool stripe_has_superblock(uint64_t offset, uint64_t length) {
+    unsigned int i = 0;
+
+    while (superblock_addrs[i] != 0) {
+        if (superblock_addrs[i] >= offset && superblock_addrs[i] < offset + length)
+            return true;
+
+        i++;
+    }
+
+    return false;
+}
+
+// Returns true if the stripe_length-sized piece of the chunk at address would
+// be written anywhere near a superblock. For RAID5 and RAID6 this includes the
+// rest of the row, as that's where its parity goes.
 static bool superblock_collision(btrfs_chunk* c, uint64_t address) {
-    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
-    uint64_t stripe = (address - c->offset) / c->chunk_item->stripe_length;
-    uint16_t i, j;
-
-    for (i = 0; i < c->chunk_item->num_stripes; i++) {
-        j = 0;
-        while (superblock_addrs[j] != 0) {
-            if (superblock_addrs[j] >= cis[i].offset) {
-                uint64_t stripe2 = (superblock_addrs[j] - cis[i].offset) / c->chunk_item->stripe_length;
-
-                if (stripe2 == stripe)
-                    return true;
-            }
-            j++;
+    CHUNK_ITEM* ci = c->chunk_item;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+    uint64_t off = address - c->offset;
+    uint16_t i;
+
+    if (ci->type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10)) {
+        uint16_t sub_stripes = ci->type & BLOCK_FLAG_RAID10 ? ci->sub_stripes : 1;
+        uint64_t stripeoff;
+        uint16_t stripe;
+
+        get_raid0_offset(off, ci->stripe_length, ci->num_stripes / sub_stripes, &stripeoff, &stripe);
+
+        stripeoff -= stripeoff % ci->stripe_length;
+
+        for (i = 0; i < sub_stripes; i++) {
+            if (stripe_has_superblock(cis[(stripe * sub_stripes) + i].offset + stripeoff, ci->stripe_length))
+                return true;
         }
+
+        return false;
+    } else if (ci->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        off = (off / (get_data_stripes(ci) * ci->stripe_length)) * ci->stripe_length;
+    else
+        off -= off % ci->stripe_length;
+
+    for (i = 0; i < ci->num_stripes; i++) {
+        if (stripe_has_superblock(cis[i].offset + off, ci->stripe_length))
+            return true;
     }
 
     return false;
 }
 
-static uint64_t get_next_address(btrfs_chunk* c) {
+static uint64_t get_next_address(btrfs_chunk* c, uint32_t node_size) {
     uint64_t addr;
 
     addr = c->lastoff;
 
+    // tree blocks can't cross a stripe boundary
+    if ((addr - c->offset) / c->chunk_item->stripe_length != (addr + node_size - 1 - c->offset) / c->chunk_item->stripe_length)
+        addr = addr - ((addr - c->offset) % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
+
     while (superblock_collision(c, addr)) {
         addr = addr - ((addr - c->offset) % c->chunk_item->stripe_length) + c->chunk_item->stripe_length;
 
@@ -461,9 +778,144 @@ static uint64_t get_next_address(btrfs_chunk* c) {
             return 0;
     }
 
+    if (addr + node_size > c->offset + c->chunk_item->size)
+        return 0;
+
     return addr;
 }
 
+static void add_used_space(btrfs_chunk* c, uint64_t address, uint64_t size) {
+    used_space_extent* use;
+
+    if (!IsListEmpty(&c->used_space)) {
+        use = CONTAINING_RECORD(c->used_space.Blink, used_space_extent, list_entry);
+
+        if (use->address + use->size == address) {
+            use->size += size;
+            goto end;
+        }
+    }
+
+    use = malloc(sizeof(used_space_extent));
+    use->address = address;
+    use->size = size;
+    InsertTailList(&c->used_space, &use->list_entry);
+
+end:
+    c->lastoff = address + size;
+    c->used += size;
+}
+
+static void reset_chunk(btrfs_chunk* c) {
+    while (!IsListEmpty(&c->used_space)) {
+        used_space_extent* use = CONTAINING_RECORD(RemoveHeadList(&c->used_space), used_space_extent, list_entry);
+
+        free(use);
+    }
+
+    c->lastoff = c->offset;
+    c->used = 0;
+}
+
+static btrfs_node* new_node(btrfs_node** nodes, uint32_t* num_nodes, uint32_t* alloc) {
+    btrfs_node* n;
+
+    if (*num_nodes == *alloc) {
+        *alloc *= 2;
+        *nodes = realloc(*nodes, *alloc * sizeof(btrfs_node));
+    }
+
+    n = &(*nodes)[*num_nodes];
+    (*num_nodes)++;
+
+    RtlZeroMemory(n, sizeof(btrfs_node));
+
+    return n;
+}
+
+// Splits the items of a tree into full leaves, and puts levels of internal
+// nodes above them until there's only one node at the top. Returns true if
+// the shape of the tree has changed since last time.
+static bool layout_tree(btrfs_root* r, uint32_t node_size) {
+    btrfs_node* nodes;
+    uint32_t num_nodes = 0, alloc = 16, space = 0, level_start, level_end, i;
+    uint32_t ptrs_per_node = (node_size - sizeof(tree_header)) / sizeof(internal_node);
+    LIST_ENTRY* le;
+    bool changed;
+
+    nodes = malloc(alloc * sizeof(btrfs_node));
+
+    le = r->items.Flink;
+    while (le != &r->items) {
+        btrfs_item* item = CONTAINING_RECORD(le, btrfs_item, list_entry);
+        uint32_t item_size = sizeof(leaf_node) + item->size;
+
+        if (num_nodes == 0 || space < item_size) {
+            btrfs_node* n = new_node(&nodes, &num_nodes, &alloc);
+
+            n->first_item = le;
+            n->firstkey = item->key;
+            space = node_size - sizeof(tree_header);
+        }
+
+        nodes[num_nodes - 1].num_items++;
+        space -= item_size;
+
+        le = le->Flink;
+    }
+
+    if (num_nodes == 0) {
+        btrfs_node* n = new_node(&nodes, &num_nodes, &alloc);
+
+        n->first_item = &r->items;
+    }
+
+    level_start = 0;
+    level_end = num_nodes;
+
+    while (level_end - level_start > 1) {
+        for (i = level_start; i < level_end; i += ptrs_per_node) {
+            btrfs_node* n = new_node(&nodes, &num_nodes, &alloc);
+
+            n->level = nodes[i].level + 1;
+            n->firstkey = nodes[i].firstkey;
+            n->first_child = i;
+            n->num_items = min(ptrs_per_node, level_end - i);
+        }
+
+        level_start = level_end;
+        level_end = num_nodes;
+    }
+
+    changed = !r->nodes || r->num_nodes != num_nodes;
+
+    for (i = 0; i < num_nodes && !changed; i++) {
+        if (nodes[i].level != r->nodes[i].level || nodes[i].num_items != r->nodes[i].num_items ||
+            keycmp(nodes[i].firstkey, r->nodes[i].firstkey) != 0) {
+            changed = true;
+        }
+    }
+
+    // If nothing's changed, keep the addresses we gave the nodes last time -
+    // but the items themselves may have been replaced since.
+    if (!changed) {
+        for (i = 0; i < num_nodes; i++) {
+            r->nodes[i].first_item = nodes[i].first_item;
+        }
+
+        free(nodes);
+        return false;
+    }
+
+    if (r->nodes)
+        free(r->nodes);
+
+    r->nodes = nodes;
+    r->num_nodes = num_nodes;
+
+    return true;
+}
+
 typedef struct {
     EXTENT_ITEM ei;
     uint8_t type;
@@ -477,72 +929,75 @@ typedef struct {
     TREE_BLOCK_REF tbr;
 } EXTENT_ITEM_METADATA2;
 
-static void assign_addresses(LIST_ENTRY* roots, btrfs_chunk* sys_chunk, btrfs_chunk* metadata_chunk, uint32_t node_size,
-                             btrfs_root* root_root, btrfs_root* extent_root, bool skinny) {
+static bool is_tree_block_item(btrfs_item* item) {
+    if (item->key.obj_type == TYPE_METADATA_ITEM)
+        return true;
+
+    return item->key.obj_type == TYPE_EXTENT_ITEM && ((EXTENT_ITEM*)item->data)->flags & EXTENT_ITEM_TREE_BLOCK;
+}
+
+static bool is_root_item(btrfs_item* item) {
+    return item->key.obj_type == TYPE_ROOT_ITEM;
+}
+
+// Called again whenever the layout of the trees changes, so it replaces the
+// extent and root items it added last time.
+static NTSTATUS assign_addresses(LIST_ENTRY* roots, btrfs_chunk* sys_chunk, btrfs_chunk* metadata_chunk, uint32_t node_size,
+                                 btrfs_root* root_root, btrfs_root* extent_root, bool skinny) {
     LIST_ENTRY* le;
 
+    reset_chunk(sys_chunk);
+    reset_chunk(metadata_chunk);
+
+    remove_items(extent_root, is_tree_block_item);
+    remove_items(root_root, is_root_item);
+
     le = roots->Flink;
     while (le != roots) {
         btrfs_root* r = CONTAINING_RECORD(le, btrfs_root, list_entry);
         btrfs_chunk* c = r->id == BTRFS_ROOT_CHUNK ? sys_chunk : metadata_chunk;
-        bool done_use = false;
+        btrfs_node* top;
+        uint32_t i;
 
-        r->header.address = get_next_address(c);
+        for (i = 0; i < r->num_nodes; i++) {
+            btrfs_node* n = &r->nodes[i];
 
-        if (!IsListEmpty(&c->used_space)) {
-            used_space_extent* use = CONTAINING_RECORD(c->used_space.Blink, used_space_extent, list_entry);
+            n->address = get_next_address(c, node_size);
+            if (n->address == 0) // chunk full
+                return STATUS_DISK_FULL;
 
-            if (use->address + use->size == r->header.address) {
-                use->size += node_size;
-                done_use = true;
-            }
-        }
-
-        if (!done_use) {
-            used_space_extent* use = malloc(sizeof(used_space_extent));
-            use->address = r->header.address;
-            use->size = node_size;
-            InsertTailList(&c->used_space, &use->list_entry);
-        }
+            add_used_space(c, n->address, node_size);
 
-        r->c = c;
-        c->lastoff = r->header.address + node_size;
-        c->used += node_size;
-
-        if (skinny) {
-            EXTENT_ITEM_METADATA eim;
+            if (skinny) {
+                EXTENT_ITEM_METADATA eim;
 
-            eim.ei.refcount = 1;
-            eim.ei.generation = 1;
-            eim.ei.flags = EXTENT_ITEM_TREE_BLOCK;
-            eim.type = TYPE_TREE_BLOCK_REF;
-            eim.tbr.offset = r->id;
-
-            add_item(extent_root, r->header.address, TYPE_METADATA_ITEM, 0, &eim, sizeof(EXTENT_ITEM_METADATA));
-        } else {
-            EXTENT_ITEM_METADATA2 eim2;
-            KEY firstitem;
+                eim.ei.refcount = 1;
+                eim.ei.generation = 1;
+                eim.ei.flags = EXTENT_ITEM_TREE_BLOCK;
+                eim.type = TYPE_TREE_BLOCK_REF;
+                eim.tbr.offset = r->id;
 
-            if (r->items.Flink == &r->items) {
-                firstitem.obj_id = 0;
-                firstitem.obj_type = 0;
-                firstitem.offset = 0;
+                add_item(extent_root, n->address, TYPE_METADATA_ITEM, n->level, &eim, sizeof(EXTENT_ITEM_METADATA));
             } else {
-                btrfs_item* bi = CONTAINING_RECORD(r->items.Flink, btrfs_item, list_entry);
+                EXTENT_ITEM_METADATA2 eim2;
 
-                firstitem = bi->key;
+                eim2.ei.refcount = 1;
+                eim2.ei.generation = 1;
+                eim2.ei.flags = EXTENT_ITEM_TREE_BLOCK;
+                eim2.ei2.firstitem = n->firstkey;
+                eim2.ei2.level = n->level;
+                eim2.type = TYPE_TREE_BLOCK_REF;
+                eim2.tbr.offset = r->id;
+
+                add_item(extent_root, n->address, TYPE_EXTENT_ITEM, node_size, &eim2, sizeof(EXTENT_ITEM_METADATA2));
             }
+        }
 
-            eim2.ei.refcount = 1;
-            eim2.ei.generation = 1;
-            eim2.ei.flags = EXTENT_ITEM_TREE_BLOCK;
-            eim2.ei2.firstitem = firstitem;
-            eim2.ei2.level = 0;
-            eim2.type = TYPE_TREE_BLOCK_REF;
-            eim2.tbr.offset = r->id;
+        top = &r->nodes[r->num_nodes - 1];
 
-            add_item(extent_root, r->header.address, TYPE_EXTENT_ITEM, node_size, &eim2, sizeof(EXTENT_ITEM_METADATA2));
-        }
+        r->c = c;
+        r->header.address = top->address;
+        r->header.level = top->level;
 
         if (r->id != BTRFS_ROOT_ROOT && r->id != BTRFS_ROOT_CHUNK) {
             ROOT_ITEM ri;
@@ -557,8 +1012,9 @@ static void assign_addresses(LIST_ENTRY* roots, btrfs_chunk* sys_chunk, btrfs_ch
             ri.generation = 1;
             ri.objid = r->id == 5 || r->id >= 0x100 ? SUBVOL_ROOT_INODE : 0;
             ri.block_number = r->header.address;
-            ri.bytes_used = node_size;
+            ri.bytes_used = r->num_nodes * node_size;
             ri.num_references = 1;
+            ri.root_level = r->header.level;
             ri.generation2 = ri.generation;
 
             add_item(root_root, r->id, TYPE_ROOT_ITEM, 0, &ri, sizeof(ROOT_ITEM));
@@ -566,125 +1022,405 @@ static void assign_addresses(LIST_ENTRY* roots, btrfs_chunk* sys_chunk, btrfs_ch
 
         le = le->Flink;
     }
+
+    return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_data(HANDLE h, uint64_t address, btrfs_chunk* c, void* data, ULONG size) {
-    NTSTATUS Status;
-    uint16_t i;
+#ifdef _WIN32
+static NTSTATUS write_device(HANDLE h, uint64_t offset, void* data, ULONG size) {
     IO_STATUS_BLOCK iosb;
     LARGE_INTEGER off;
-    CHUNK_ITEM_STRIPE* cis;
-
-    cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
-
-    for (i = 0; i < c->chunk_item->num_stripes; i++) {
-        off.QuadPart = cis[i].offset + address - c->offset;
 
-        Status = NtWriteFile(h, NULL, NULL, NULL, &iosb, data, size, &off, NULL);
-        if (!NT_SUCCESS(Status))
-            return Status;
-    }
+    off.QuadPart = offset;
 
-    return STATUS_SUCCESS;
+    return NtWriteFile(h, NULL, NULL, NULL, &iosb, data, size, &off, NULL);
 }
 
-static void calc_tree_checksum(tree_header* th, uint32_t node_size) {
-    switch (def_csum_type) {
-        case CSUM_TYPE_CRC32C:
-            *(uint32_t*)th = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, node_size - sizeof(th->csum));
-        break;
-
-        case CSUM_TYPE_XXHASH:
-            *(uint64_t*)th = XXH64((uint8_t*)&th->fs_uuid, node_size - sizeof(th->csum), 0);
-        break;
+static NTSTATUS read_device(HANDLE h, uint64_t offset, void* data, ULONG size) {
+    IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER off;
 
-        case CSUM_TYPE_SHA256:
-            calc_sha256((uint8_t*)th, &th->fs_uuid, node_size - sizeof(th->csum));
-        break;
+    off.QuadPart = offset;
 
-        case CSUM_TYPE_BLAKE2:
-            blake2b((uint8_t*)th, BLAKE2_HASH_SIZE, &th->fs_uuid, node_size - sizeof(th->csum));
-        break;
-    }
+    return NtReadFile(h, NULL, NULL, NULL, &iosb, data, size, &off, NULL);
 }
+#else
+static NTSTATUS write_device(HANDLE h, uint64_t offset, void* data, ULONG size) {
+    uint8_t* buf = data;
 
-static NTSTATUS write_roots(HANDLE h, LIST_ENTRY* roots, uint32_t node_size, BTRFS_UUID* fsuuid, BTRFS_UUID* chunkuuid) {
-    LIST_ENTRY *le, *le2;
-    NTSTATUS Status;
-    uint8_t* tree;
-
-    tree = malloc(node_size);
-
-    le = roots->Flink;
-    while (le != roots) {
-        btrfs_root* r = CONTAINING_RECORD(le, btrfs_root, list_entry);
-        uint8_t* dp;
-        leaf_node* ln;
-
-        memset(tree, 0, node_size);
+    while (size > 0) {
+        ssize_t ret = pwrite(h, buf, size, (off_t)offset);
 
-        r->header.num_items = 0;
-        r->header.fs_uuid = *fsuuid;
-        r->header.flags = HEADER_FLAG_MIXED_BACKREF | HEADER_FLAG_WRITTEN;
-        r->header.chunk_tree_uuid = *chunkuuid;
-        r->header.generation = 1;
-        r->header.tree_id = r->id;
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
 
-        ln = (leaf_node*)(tree + sizeof(tree_header));
+            fprintf(stderr, "pwrite failed at %llx: %s\n", (unsigned long long)offset, strerror(errno));
 
-        dp = tree + node_size;
+            return errno == ENOSPC ? STATUS_DISK_FULL : STATUS_UNEXPECTED_IO_ERROR;
+        }
 
-        le2 = r->items.Flink;
-        while (le2 != &r->items) {
-            btrfs_item* item = CONTAINING_RECORD(le2, btrfs_item, list_entry);
+        buf += ret;
+        offset += ret;
+        size -= (ULONG)ret;
+    }
 
-            ln->key = item->key;
-            ln->size = item->size;
+    return STATUS_SUCCESS;
+}
 
-            if (item->size > 0) {
-                dp -= item->size;
-                memcpy(dp, item->data, item->size);
-            }
+static NTSTATUS read_device(HANDLE h, uint64_t offset, void* data, ULONG size) {
+    uint8_t* buf = data;
 
-            ln->offset = (uint32_t)(dp - tree - sizeof(tree_header));
+    while (size > 0) {
+        ssize_t ret = pread(h, buf, size, (off_t)offset);
 
-            ln = &ln[1];
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
 
-            r->header.num_items++;
+            fprintf(stderr, "pread failed at %llx: %s\n", (unsigned long long)offset, strerror(errno));
 
-            le2 = le2->Flink;
+            return STATUS_UNEXPECTED_IO_ERROR;
         }
 
-        memcpy(tree, &r->header, sizeof(tree_header));
-
-        calc_tree_checksum((tree_header*)tree, node_size);
-
-        Status = write_data(h, r->header.address, r->c, tree, node_size);
-        if (!NT_SUCCESS(Status)) {
-            free(tree);
-            return Status;
+        if (ret == 0) { // past the end of an image file, which reads as zeroes
+            memset(buf, 0, size);
+            break;
         }
 
-        le = le->Flink;
+        buf += ret;
+        offset += ret;
+        size -= (ULONG)ret;
     }
 
-    free(tree);
-
     return STATUS_SUCCESS;
 }
+#endif
 
-static void get_uuid(BTRFS_UUID* uuid) {
-    uint8_t i;
-
-    for (i = 0; i < 16; i+=2) {
-        ULONG r = rand();
+static void galois_double(uint8_t* data, uint32_t len) {
+    uint32_t i;
 
-        uuid->uuid[i] = (r & 0xff00) >> 8;
-        uuid->uuid[i+1] = r & 0xff;
+    for (i = 0; i < len; i++) {
+        data[i] = (uint8_t)((data[i] << 1) ^ (data[i] & 0x80 ? 0x1d : 0));
     }
 }
 
-static void init_device(btrfs_dev* dev, uint64_t id, uint64_t size, BTRFS_UUID* fsuuid, uint32_t sector_size) {
+static void do_xor(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        buf1[i] ^= buf2[i];
+    }
+}
+
+// Data stripe i of a RAID5 or RAID6 row comes after the parity, which moves
+// along by one device each row - the same layout as the driver and Linux use.
+static uint16_t get_raid56_stripe(CHUNK_ITEM* ci, uint64_t row, uint16_t i) {
+    uint16_t data_stripes = get_data_stripes(ci);
+    uint16_t parity = (uint16_t)((row + data_stripes) % ci->num_stripes);
+
+    return (parity + (ci->num_stripes - data_stripes) + i) % ci->num_stripes;
+}
+
+static NTSTATUS flush_row(btrfs_dev* devs, btrfs_chunk* c) {
+    NTSTATUS Status;
+    CHUNK_ITEM* ci = c->chunk_item;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+    uint16_t data_stripes = get_data_stripes(ci);
+    uint32_t stripe_length = (uint32_t)ci->stripe_length;
+    uint16_t parity = (uint16_t)((c->row_num + data_stripes) % ci->num_stripes);
+    uint8_t* p = c->row + (data_stripes * stripe_length);
+    uint8_t* q = p + stripe_length;
+    uint16_t i;
+
+    if (c->row_num == 0xffffffffffffffff)
+        return STATUS_SUCCESS;
+
+    memcpy(p, c->row + ((data_stripes - 1) * stripe_length), stripe_length);
+
+    if (ci->type & BLOCK_FLAG_RAID6)
+        memcpy(q, p, stripe_length);
+
+    for (i = data_stripes - 1; i > 0; i--) {
+        uint8_t* data = c->row + ((i - 1) * stripe_length);
+
+        do_xor(p, data, stripe_length);
+
+        if (ci->type & BLOCK_FLAG_RAID6) {
+            galois_double(q, stripe_length);
+            do_xor(q, data, stripe_length);
+        }
+    }
+
+    for (i = 0; i < data_stripes; i++) {
+        CHUNK_ITEM_STRIPE* stripe = &cis[get_raid56_stripe(ci, c->row_num, i)];
+
+        Status = write_device(devs[stripe->dev_id - 1].h, stripe->offset + (c->row_num * stripe_length), c->row + (i * stripe_length),
+                              stripe_length);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    Status = write_device(devs[cis[parity].dev_id - 1].h, cis[parity].offset + (c->row_num * stripe_length), p, stripe_length);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (ci->type & BLOCK_FLAG_RAID6) {
+        CHUNK_ITEM_STRIPE* stripe = &cis[(parity + 1) % ci->num_stripes];
+
+        Status = write_device(devs[stripe->dev_id - 1].h, stripe->offset + (c->row_num * stripe_length), q, stripe_length);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    c->row_num = 0xffffffffffffffff;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS flush_rows(btrfs_dev* devs, LIST_ENTRY* chunks) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    le = chunks->Flink;
+    while (le != chunks) {
+        btrfs_chunk* c = CONTAINING_RECORD(le, btrfs_chunk, list_entry);
+
+        if (c->row) {
+            Status = flush_row(devs, c);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// We write sequentially, so rather than reading and writing each row every
+// time part of it changes, we keep the current one in memory and write it out
+// with its parity once we've moved on.
+static NTSTATUS write_data_raid56(btrfs_dev* devs, uint64_t address, btrfs_chunk* c, uint8_t* data, ULONG size) {
+    NTSTATUS Status;
+    CHUNK_ITEM* ci = c->chunk_item;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+    uint16_t data_stripes = get_data_stripes(ci);
+    uint32_t stripe_length = (uint32_t)ci->stripe_length;
+    uint64_t row_length = data_stripes * ci->stripe_length;
+    uint16_t i;
+
+    if (!c->row)
+        c->row = malloc((data_stripes + 2) * stripe_length);
+
+    while (size > 0) {
+        uint64_t row = (address - c->offset) / row_length;
+        uint32_t rowoff = (uint32_t)((address - c->offset) % row_length);
+        ULONG len = (ULONG)min(size, row_length - rowoff);
+
+        if (row != c->row_num) {
+            Status = flush_row(devs, c);
+            if (!NT_SUCCESS(Status))
+                return Status;
+
+            // if we're not overwriting the whole row, start with what's there already
+            if (len < row_length) {
+                for (i = 0; i < data_stripes; i++) {
+                    CHUNK_ITEM_STRIPE* stripe = &cis[get_raid56_stripe(ci, row, i)];
+
+                    Status = read_device(devs[stripe->dev_id - 1].h, stripe->offset + (row * stripe_length), c->row + (i * stripe_length),
+                                         stripe_length);
+                    if (!NT_SUCCESS(Status))
+                        return Status;
+                }
+            }
+
+            c->row_num = row;
+        }
+
+        memcpy(c->row + rowoff, data, len);
+
+        address += len;
+        data += len;
+        size -= len;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS write_data(btrfs_dev* devs, uint64_t address, btrfs_chunk* c, void* data, ULONG size) {
+    NTSTATUS Status;
+    uint16_t i;
+    CHUNK_ITEM* ci = c->chunk_item;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+    uint8_t* buf = data;
+
+    if (ci->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        return write_data_raid56(devs, address, c, data, size);
+
+    if (!(ci->type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10))) { // every stripe is a copy
+        for (i = 0; i < ci->num_stripes; i++) {
+            Status = write_device(devs[cis[i].dev_id - 1].h, cis[i].offset + address - c->offset, data, size);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    while (size > 0) {
+        uint16_t sub_stripes = ci->type & BLOCK_FLAG_RAID10 ? ci->sub_stripes : 1;
+        uint64_t stripeoff;
+        uint16_t stripe;
+        ULONG len;
+
+        get_raid0_offset(address - c->offset, ci->stripe_length, ci->num_stripes / sub_stripes, &stripeoff, &stripe);
+
+        len = (ULONG)min(size, ci->stripe_length - (stripeoff % ci->stripe_length));
+
+        for (i = 0; i < sub_stripes; i++) {
+            CHUNK_ITEM_STRIPE* cis2 = &cis[(stripe * sub_stripes) + i];
+
+            Status = write_device(devs[cis2->dev_id - 1].h, cis2->offset + stripeoff, buf, len);
+            if (!NT_SUCCESS(Status))
+                return Status;
+        }
+
+        address += len;
+        buf += len;
+        size -= len;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static void calc_csum(uint8_t* csum, const void* data, uint32_t len) {
+    switch (def_csum_type) {
+        case CSUM_TYPE_CRC32C:
+            *(uint32_t*)csum = ~calc_crc32c(0xffffffff, (uint8_t*)data, len);
+        break;
+
+        case CSUM_TYPE_XXHASH:
+            *(uint64_t*)csum = XXH64(data, len, 0);
+        break;
+
+        case CSUM_TYPE_SHA256:
+            calc_sha256(csum, data, len);
+        break;
+
+        case CSUM_TYPE_BLAKE2:
+            blake2b(csum, BLAKE2_HASH_SIZE, data, len);
+        break;
+    }
+}
+
+static void calc_tree_checksum(tree_header* th, uint32_t node_size) {
+    calc_csum(th->csum, &th->fs_uuid, node_size - sizeof(th->csum));
+}
+
+static NTSTATUS write_roots(btrfs_dev* devs, LIST_ENTRY* roots, uint32_t node_size, BTRFS_UUID* fsuuid, BTRFS_UUID* chunkuuid) {
+    LIST_ENTRY *le, *le2;
+    NTSTATUS Status;
+    uint8_t* tree;
+
+    tree = malloc(node_size);
+
+    le = roots->Flink;
+    while (le != roots) {
+        btrfs_root* r = CONTAINING_RECORD(le, btrfs_root, list_entry);
+        uint32_t i, j;
+
+        for (i = 0; i < r->num_nodes; i++) {
+            btrfs_node* n = &r->nodes[i];
+            tree_header* th = (tree_header*)tree;
+
+            memset(tree, 0, node_size);
+
+            th->fs_uuid = *fsuuid;
+            th->address = n->address;
+            th->flags = HEADER_FLAG_MIXED_BACKREF | HEADER_FLAG_WRITTEN;
+            th->chunk_tree_uuid = *chunkuuid;
+            th->generation = 1;
+            th->tree_id = r->id;
+            th->num_items = n->num_items;
+            th->level = n->level;
+
+            if (n->level == 0) {
+                leaf_node* ln = (leaf_node*)(tree + sizeof(tree_header));
+                uint8_t* dp = tree + node_size;
+
+                le2 = n->first_item;
+                for (j = 0; j < n->num_items; j++) {
+                    btrfs_item* item = CONTAINING_RECORD(le2, btrfs_item, list_entry);
+
+                    ln->key = item->key;
+                    ln->size = item->size;
+
+                    if (item->size > 0) {
+                        dp -= item->size;
+                        memcpy(dp, item->data, item->size);
+                    }
+
+                    ln->offset = (uint32_t)(dp - tree - sizeof(tree_header));
+
+                    ln = &ln[1];
+
+                    le2 = le2->Flink;
+                }
+            } else {
+                internal_node* in = (internal_node*)(tree + sizeof(tree_header));
+
+                for (j = 0; j < n->num_items; j++) {
+                    btrfs_node* child = &r->nodes[n->first_child + j];
+
+                    in[j].key = child->firstkey;
+                    in[j].address = child->address;
+                    in[j].generation = 1;
+                }
+            }
+
+            calc_tree_checksum(th, node_size);
+
+            Status = write_data(devs, n->address, r->c, tree, node_size);
+            if (!NT_SUCCESS(Status)) {
+                free(tree);
+                return Status;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    free(tree);
+
+    return STATUS_SUCCESS;
+}
+
+#ifdef _WIN32
+static void get_uuid(BTRFS_UUID* uuid) {
+    uint8_t i;
+
+    for (i = 0; i < 16; i+=2) {
+        ULONG r = rand();
+
+        uuid->uuid[i] = (r & 0xff00) >> 8;
+        uuid->uuid[i+1] = r & 0xff;
+    }
+}
+#else
+static void get_uuid(BTRFS_UUID* uuid) {
+    // rand() seeded with the time would give the same UUIDs to every image
+    // made in the same second
+    if (getrandom(uuid, sizeof(BTRFS_UUID), 0) == sizeof(BTRFS_UUID))
+        return;
+
+    for (unsigned int i = 0; i < sizeof(BTRFS_UUID); i++) {
+        uuid->uuid[i] = rand() & 0xff;
+    }
+}
+#endif
+
+static void init_device(btrfs_dev* dev, uint64_t id, uint64_t size, BTRFS_UUID* fsuuid, uint32_t sector_size) {
     dev->dev_item.dev_id = id;
     dev->dev_item.num_bytes = size;
     dev->dev_item.bytes_used = 0;
@@ -704,42 +1440,78 @@ static void init_device(btrfs_dev* dev, uint64_t id, uint64_t size, BTRFS_UUID*
 }
 
 static void calc_superblock_checksum(superblock* sb) {
-    switch (def_csum_type) {
-        case CSUM_TYPE_CRC32C:
-            *(uint32_t*)sb = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-        break;
+    calc_csum(sb->checksum, &sb->uuid, sizeof(superblock) - sizeof(sb->checksum));
+}
 
-        case CSUM_TYPE_XXHASH:
-            *(uint64_t*)sb = XXH64(&sb->uuid, sizeof(superblock) - sizeof(sb->checksum), 0);
-        break;
+typedef struct {
+    btrfs_dev* dev;
+    superblock* sb;
+    ULONG sblen;
+    NTSTATUS Status;
+} superblock_write;
 
-        case CSUM_TYPE_SHA256:
-            calc_sha256((uint8_t*)sb, &sb->uuid, sizeof(superblock) - sizeof(sb->checksum));
-        break;
+static NTSTATUS write_device_superblocks(btrfs_dev* dev, superblock* base, ULONG sblen) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    superblock* sb;
+    int i;
 
-        case CSUM_TYPE_BLAKE2:
-            blake2b((uint8_t*)sb, BLAKE2_HASH_SIZE, &sb->uuid, sizeof(superblock) - sizeof(sb->checksum));
-        break;
+    sb = malloc(sblen);
+    memcpy(sb, base, sblen);
+    memcpy(&sb->dev_item, &dev->dev_item, sizeof(DEV_ITEM));
+
+    i = 0;
+    while (superblock_addrs[i] != 0) {
+        if (superblock_addrs[i] > dev->dev_item.num_bytes)
+            break;
+
+        sb->sb_phys_addr = superblock_addrs[i];
+
+        calc_superblock_checksum(sb);
+
+        Status = write_device(dev->h, superblock_addrs[i], sb, sblen);
+        if (!NT_SUCCESS(Status))
+            break;
+
+        i++;
     }
+
+    free(sb);
+
+    return Status;
+}
+
+#ifndef _WIN32
+static void* superblock_thread(void* context) {
+    superblock_write* sw = context;
+
+    sw->Status = write_device_superblocks(sw->dev, sw->sb, sw->sblen);
+
+    return NULL;
 }
+#endif
 
-static NTSTATUS write_superblocks(HANDLE h, btrfs_dev* dev, btrfs_root* chunk_root, btrfs_root* root_root, btrfs_root* extent_root,
-                                  btrfs_chunk* sys_chunk, uint32_t node_size, BTRFS_UUID* fsuuid, uint32_t sector_size, PUNICODE_STRING label,
-                                  uint64_t incompat_flags, uint64_t compat_ro_flags) {
+static NTSTATUS write_superblocks(btrfs_dev* devs, uint16_t num_devices, btrfs_root* chunk_root, btrfs_root* root_root,
+                                  btrfs_root* extent_root, btrfs_chunk* sys_chunk, uint32_t node_size, BTRFS_UUID* fsuuid,
+                                  uint32_t sector_size, const char* label, uint64_t incompat_flags, uint64_t compat_ro_flags) {
     NTSTATUS Status;
-    IO_STATUS_BLOCK iosb;
     ULONG sblen;
-    int i;
+    uint16_t i;
     superblock* sb;
     KEY* key;
-    uint64_t bytes_used;
+    uint64_t bytes_used, total_bytes;
     LIST_ENTRY* le;
+    superblock_write* sw;
 
     sblen = sizeof(*sb);
     if (sblen & (sector_size - 1))
         sblen = (sblen & sector_size) + sector_size;
 
     bytes_used = 0;
+    total_bytes = 0;
+
+    for (i = 0; i < num_devices; i++) {
+        total_bytes += devs[i].dev_item.num_bytes;
+    }
 
     le = extent_root->items.Flink;
     while (le != &extent_root->items) {
@@ -762,10 +1534,12 @@ static NTSTATUS write_superblocks(HANDLE h, btrfs_dev* dev, btrfs_root* chunk_ro
     sb->generation = 1;
     sb->root_tree_addr = root_root->header.address;
     sb->chunk_tree_addr = chunk_root->header.address;
-    sb->total_bytes = dev->dev_item.num_bytes;
+    sb->root_level = root_root->header.level;
+    sb->chunk_root_level = chunk_root->header.level;
+    sb->total_bytes = total_bytes;
     sb->bytes_used = bytes_used;
     sb->root_dir_objectid = BTRFS_ROOT_TREEDIR;
-    sb->num_devices = 1;
+    sb->num_devices = num_devices;
     sb->sector_size = sector_size;
     sb->node_size = node_size;
     sb->leaf_size = node_size;
@@ -775,29 +1549,16 @@ static NTSTATUS write_superblocks(HANDLE h, btrfs_dev* dev, btrfs_root* chunk_ro
     sb->compat_ro_flags = compat_ro_flags;
     sb->incompat_flags = incompat_flags;
     sb->csum_type = def_csum_type;
-    memcpy(&sb->dev_item, &dev->dev_item, sizeof(DEV_ITEM));
 
-    if (label->Length > 0) {
-        ULONG utf8len;
+    if (label) { // UTF-8
+        size_t utf8len = strlen(label);
 
-        for (unsigned int i = 0; i < label->Length / sizeof(WCHAR); i++) {
-            if (label->Buffer[i] == '/' || label->Buffer[i] == '\\') {
-                free(sb);
-                return STATUS_INVALID_VOLUME_LABEL;
-            }
-        }
-
-        utf8len = WideCharToMultiByte(CP_UTF8, 0, label->Buffer, label->Length / sizeof(WCHAR), NULL, 0, NULL, NULL);
-
-        if (utf8len == 0 || utf8len > MAX_LABEL_SIZE) {
+        if (utf8len > MAX_LABEL_SIZE || strchr(label, '/') || strchr(label, '\\')) {
             free(sb);
             return STATUS_INVALID_VOLUME_LABEL;
         }
 
-        if (WideCharToMultiByte(CP_UTF8, 0, label->Buffer, label->Length / sizeof(WCHAR), sb->label, utf8len, NULL, NULL) == 0) {
-            free(sb);
-            return STATUS_INVALID_VOLUME_LABEL;
-        }
+        memcpy(sb->label, label, utf8len);
     }
     sb->cache_generation = 0xffffffffffffffff;
 
@@ -807,33 +1568,59 @@ static NTSTATUS write_superblocks(HANDLE h, btrfs_dev* dev, btrfs_root* chunk_ro
     key->offset = sys_chunk->offset;
     memcpy(&key[1], sys_chunk->chunk_item, sizeof(CHUNK_ITEM) + (sys_chunk->chunk_item->num_stripes * sizeof(CHUNK_ITEM_STRIPE)));
 
-    i = 0;
-    while (superblock_addrs[i] != 0) {
-        LARGE_INTEGER off;
+    // each device gets its own copy, with its own DEV_ITEM
 
-        if (superblock_addrs[i] > dev->dev_item.num_bytes)
-            break;
+    sw = malloc(num_devices * sizeof(superblock_write));
 
-        sb->sb_phys_addr = superblock_addrs[i];
+    for (i = 0; i < num_devices; i++) {
+        sw[i].dev = &devs[i];
+        sw[i].sb = sb;
+        sw[i].sblen = sblen;
+    }
 
-        calc_superblock_checksum(sb);
+#ifndef _WIN32
+    if (num_devices > 1) {
+        pthread_t* threads = malloc(num_devices * sizeof(pthread_t));
+        bool* started = malloc(num_devices * sizeof(bool));
 
-        off.QuadPart = superblock_addrs[i];
+        for (i = 0; i < num_devices; i++) {
+            started[i] = pthread_create(&threads[i], NULL, superblock_thread, &sw[i]) == 0;
 
-        Status = NtWriteFile(h, NULL, NULL, NULL, &iosb, sb, sblen, &off, NULL);
-        if (!NT_SUCCESS(Status)) {
-            free(sb);
-            return Status;
+            if (!started[i])
+                superblock_thread(&sw[i]);
         }
 
-        i++;
+        for (i = 0; i < num_devices; i++) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+        }
+
+        free(started);
+        free(threads);
+    } else
+#endif
+    {
+        for (i = 0; i < num_devices; i++) {
+            sw[i].Status = write_device_superblocks(&devs[i], sb, sblen);
+        }
+    }
+
+    Status = STATUS_SUCCESS;
+
+    for (i = 0; i < num_devices; i++) {
+        if (!NT_SUCCESS(sw[i].Status)) {
+            Status = sw[i].Status;
+            break;
+        }
     }
 
+    free(sw);
     free(sb);
 
-    return STATUS_SUCCESS;
+    return Status;
 }
 
+#ifdef _WIN32
 static __inline void win_time_to_unix(LARGE_INTEGER t, BTRFS_TIME* out) {
     ULONGLONG l = t.QuadPart - 116444736000000000;
 
@@ -841,11 +1628,32 @@ static __inline void win_time_to_unix(LARGE_INTEGER t, BTRFS_TIME* out) {
     out->nanoseconds = (l % 10000000) * 100;
 }
 
+static void get_current_time(BTRFS_TIME* out) {
+    FILETIME filetime;
+    LARGE_INTEGER time;
+
+    GetSystemTimeAsFileTime(&filetime);
+    time.LowPart = filetime.dwLowDateTime;
+    time.HighPart = filetime.dwHighDateTime;
+
+    win_time_to_unix(time, out);
+}
+#else
+static void get_current_time(BTRFS_TIME* out) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    out->seconds = ts.tv_sec;
+    out->nanoseconds = (uint32_t)ts.tv_nsec;
+}
+#endif
+
 static void add_inode_ref(btrfs_root* r, uint64_t inode, uint64_t parent, uint64_t index, const char* name) {
     uint16_t name_len = (uint16_t)strlen(name);
     INODE_REF* ir = malloc(offsetof(INODE_REF, name[0]) + name_len);
 
-    ir->index = 0;
+    ir->index = index;
     ir->n = name_len;
     memcpy(ir->name, name, name_len);
 
@@ -856,8 +1664,6 @@ static void add_inode_ref(btrfs_root* r, uint64_t inode, uint64_t parent, uint64
 
 static void init_fs_tree(btrfs_root* r, uint32_t node_size) {
     INODE_ITEM ii;
-    FILETIME filetime;
-    LARGE_INTEGER time;
 
     memset(&ii, 0, sizeof(INODE_ITEM));
 
@@ -866,11 +1672,7 @@ static void init_fs_tree(btrfs_root* r, uint32_t node_size) {
     ii.st_nlink = 1;
     ii.st_mode = 040755;
 
-    GetSystemTimeAsFileTime(&filetime);
-    time.LowPart = filetime.dwLowDateTime;
-    time.HighPart = filetime.dwHighDateTime;
-
-    win_time_to_unix(time, &ii.st_atime);
+    get_current_time(&ii.st_atime);
     ii.st_ctime = ii.st_mtime = ii.st_atime;
 
     add_item(r, SUBVOL_ROOT_INODE, TYPE_INODE_ITEM, 0, &ii, sizeof(INODE_ITEM));
@@ -878,9 +1680,15 @@ static void init_fs_tree(btrfs_root* r, uint32_t node_size) {
     add_inode_ref(r, SUBVOL_ROOT_INODE, SUBVOL_ROOT_INODE, 0, "..");
 }
 
+static bool is_block_group_item(btrfs_item* item) {
+    return item->key.obj_type == TYPE_BLOCK_GROUP_ITEM;
+}
+
 static void add_block_group_items(LIST_ENTRY* chunks, btrfs_root* root) {
     LIST_ENTRY* le;
 
+    remove_items(root, is_block_group_item);
+
     le = chunks->Flink;
     while (le != chunks) {
         btrfs_chunk* c = CONTAINING_RECORD(le, btrfs_chunk, list_entry);
@@ -895,6 +1703,7 @@ static void add_block_group_items(LIST_ENTRY* chunks, btrfs_root* root) {
     }
 }
 
+#ifdef _WIN32
 static NTSTATUS clear_first_megabyte(HANDLE h) {
     NTSTATUS Status;
     IO_STATUS_BLOCK iosb;
@@ -947,8 +1756,67 @@ static bool is_ssd(HANDLE h) {
 
     return false;
 }
+#else
+static NTSTATUS clear_first_megabyte(HANDLE h) {
+    NTSTATUS Status;
+    struct stat st;
+    uint8_t* mb;
 
-static void add_dir_item(btrfs_root* root, uint64_t inode, uint32_t hash, uint64_t key_objid, uint8_t key_type,
+    if (fstat(h, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t data = lseek(h, 0, SEEK_DATA);
+
+        // skip if it's a hole already, as with a new image
+        if ((data == -1 && errno == ENXIO) || data >= 0x100000)
+            return STATUS_SUCCESS;
+
+        if (fallocate(h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, 0x100000) == 0)
+            return STATUS_SUCCESS;
+    } else if (S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = { 0, 0x100000 };
+
+        if (ioctl(h, BLKZEROOUT, range) == 0)
+            return STATUS_SUCCESS;
+    }
+
+    mb = calloc(1, 0x100000);
+
+    Status = write_device(h, 0, mb, 0x100000);
+
+    free(mb);
+
+    return Status;
+}
+
+static bool is_ssd(HANDLE h) {
+    struct stat st;
+    char path[80];
+    FILE* f;
+    int c;
+
+    if (fstat(h, &st) != 0 || !S_ISBLK(st.st_mode))
+        return false;
+
+    // partitions don't have a queue directory of their own
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(st.st_rdev), minor(st.st_rdev));
+
+    f = fopen(path, "r");
+
+    if (!f) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(st.st_rdev), minor(st.st_rdev));
+
+        f = fopen(path, "r");
+        if (!f)
+            return false;
+    }
+
+    c = fgetc(f);
+    fclose(f);
+
+    return c == '0';
+}
+#endif
+
+static void add_dir_item(btrfs_root* root, uint64_t inode, uint32_t hash, uint64_t key_objid, uint8_t key_type,
                          uint64_t key_offset, uint64_t transid, uint8_t type, const char* name) {
     uint16_t name_len = (uint16_t)strlen(name);
     DIR_ITEM* di = malloc(offsetof(DIR_ITEM, name[0]) + name_len);
@@ -969,8 +1837,6 @@ static void add_dir_item(btrfs_root* root, uint64_t inode, uint32_t hash, uint64
 
 static void set_default_subvol(btrfs_root* root_root, uint32_t node_size) {
     INODE_ITEM ii;
-    FILETIME filetime;
-    LARGE_INTEGER time;
 
     static const char default_subvol[] = "default";
     static const uint32_t default_hash = 0x8dbfc2d2;
@@ -984,11 +1850,7 @@ static void set_default_subvol(btrfs_root* root_root, uint32_t node_size) {
     ii.st_nlink = 1;
     ii.st_mode = 040755;
 
-    GetSystemTimeAsFileTime(&filetime);
-    time.LowPart = filetime.dwLowDateTime;
-    time.HighPart = filetime.dwHighDateTime;
-
-    win_time_to_unix(time, &ii.st_atime);
+    get_current_time(&ii.st_atime);
     ii.st_ctime = ii.st_mtime = ii.otime = ii.st_atime;
 
     add_item(root_root, BTRFS_ROOT_TREEDIR, TYPE_INODE_ITEM, 0, &ii, sizeof(INODE_ITEM));
@@ -1002,6 +1864,8 @@ static void set_default_subvol(btrfs_root* root_root, uint32_t node_size) {
 static void populate_free_space_root(LIST_ENTRY* chunks, btrfs_root* free_space_root) {
     LIST_ENTRY* le;
 
+    remove_items(free_space_root, NULL);
+
     le = chunks->Flink;
     while (le != chunks) {
         btrfs_chunk* c = CONTAINING_RECORD(le, btrfs_chunk, list_entry);
@@ -1016,40 +1880,1342 @@ static void populate_free_space_root(LIST_ENTRY* chunks, btrfs_root* free_space_
         while (le2 != &c->used_space) {
             used_space_extent* use = CONTAINING_RECORD(le2, used_space_extent, list_entry);
 
-            if (use->address > last_end) {
-                add_item(free_space_root, last_end, TYPE_FREE_SPACE_EXTENT, use->address - last_end,
-                         NULL, 0);
-                fsi.count++;
-            }
+            if (use->address > last_end) {
+                add_item(free_space_root, last_end, TYPE_FREE_SPACE_EXTENT, use->address - last_end,
+                         NULL, 0);
+                fsi.count++;
+            }
+
+            last_end = use->address + use->size;
+
+            le2 = le2->Flink;
+        }
+
+        if (c->offset + c->chunk_item->size > last_end) {
+            add_item(free_space_root, last_end, TYPE_FREE_SPACE_EXTENT, c->offset + c->chunk_item->size - last_end,
+                     NULL, 0);
+            fsi.count++;
+        }
+
+        add_item(free_space_root, c->offset, TYPE_FREE_SPACE_INFO, c->chunk_item->size, &fsi, sizeof(fsi));
+
+        le = le->Flink;
+    }
+}
+
+typedef struct _rootdir rootdir;
+
+#ifndef _WIN32
+typedef struct _comp_ctx comp_ctx;
+
+NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, unsigned int* space_left,
+                       comp_ctx* ctx);
+NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int* space_left, comp_ctx* ctx);
+NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, unsigned int* space_left,
+                       comp_ctx* ctx);
+comp_ctx* comp_ctx_alloc();
+void comp_ctx_free(comp_ctx* ctx);
+
+// Populating the filesystem from a directory (mkbtrfs -r). We walk the
+// directory first, so we know how much metadata to expect, then write the
+// file data sequentially into data chunks, compressing and checksumming it in
+// batches across threads. Last of all, the FS tree is built in key order from
+// what we've recorded.
+
+#define ROOTDIR_MAX_INLINE      2048 // the same as the default max_inline on Linux
+#define ROOTDIR_UNIT_SIZE       0x20000 // 128 KB, the largest a compressed extent can be
+#define ROOTDIR_MAX_EXTENT_SIZE 0x8000000 // 128 MB
+#define ROOTDIR_BATCH_UNITS     256
+#define ROOTDIR_MAX_THREADS     64
+
+typedef struct {
+    EXTENT_ITEM ei;
+    uint8_t type;
+    EXTENT_DATA_REF edr;
+} EXTENT_ITEM_FILE;
+
+typedef struct {
+    char* name;
+    uint16_t name_len;
+    uint8_t type;
+    uint32_t hash;
+    uint64_t inode;
+    uint64_t index;
+} rootdir_entry;
+
+typedef struct {
+    uint64_t parent;
+    uint64_t index;
+    const char* name; // belongs to the parent's rootdir_entry
+    uint16_t name_len;
+} rootdir_link;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t address; // 0 for a hole
+    uint64_t size;
+    uint64_t num_bytes;
+    uint8_t compression;
+} rootdir_extent;
+
+typedef struct {
+    char* path;
+    struct stat st;
+    rootdir_entry* entries;
+    size_t num_entries;
+    rootdir_link* links;
+    size_t num_links;
+    rootdir_extent* extents;
+    size_t num_extents;
+    uint64_t nbytes;
+} rootdir_inode;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    uint64_t inode;
+} rootdir_hardlink;
+
+struct _rootdir {
+    rootdir_inode* inodes; // inodes[0] is SUBVOL_ROOT_INODE
+    size_t num_inodes;
+    size_t alloc_inodes;
+    void* hardlinks;
+    struct stat* images; // the devices being formatted, which can't be copied into themselves
+    unsigned int num_images;
+    uint8_t compression;
+    unsigned int level;
+    unsigned int threads;
+    comp_ctx* comp_ctxs[ROOTDIR_MAX_THREADS]; // one per worker, kept from batch to batch
+};
+
+typedef struct {
+    uint64_t inode;
+    uint64_t offset;
+    uint64_t length; // sector-aligned
+    bool hole;
+    uint8_t* data;
+    uint8_t* comp;
+    uint32_t comp_length; // sector-aligned, or 0 if not compressed
+    uint8_t* csums;
+} rootdir_job;
+
+typedef struct {
+    rootdir* rd;
+    rootdir_job* jobs;
+    unsigned int num_jobs;
+    unsigned int next_job;
+    unsigned int next_worker;
+    uint32_t sector_size;
+} rootdir_batch;
+
+typedef struct {
+    btrfs_dev* devs;
+    uint16_t num_devices;
+    LIST_ENTRY* chunks;
+    btrfs_root* chunk_root;
+    btrfs_root* dev_root;
+    btrfs_root* extent_root;
+    btrfs_root* csum_root;
+    BTRFS_UUID* chunkuuid;
+    uint64_t chunk_flags;
+    uint32_t sector_size;
+    btrfs_chunk* c;
+
+    // the extent we're currently writing, which may get extended by the next job
+    bool have_ext;
+    uint64_t ext_inode;
+    rootdir_extent ext;
+    btrfs_chunk* ext_chunk;
+
+    // checksums waiting to go into the csum tree
+    uint64_t csum_address;
+    uint8_t* csums;
+    uint32_t num_csums;
+    uint32_t max_csums;
+} rootdir_writer;
+
+static uint16_t get_csum_size() {
+    switch (def_csum_type) {
+        case CSUM_TYPE_XXHASH:
+            return sizeof(uint64_t);
+
+        case CSUM_TYPE_SHA256:
+            return SHA256_HASH_SIZE;
+
+        case CSUM_TYPE_BLAKE2:
+            return BLAKE2_HASH_SIZE;
+
+        default:
+            return sizeof(uint32_t);
+    }
+}
+
+static inline rootdir_inode* get_rootdir_inode(rootdir* rd, uint64_t inode) {
+    return &rd->inodes[inode - SUBVOL_ROOT_INODE];
+}
+
+static uint32_t calc_name_hash(const char* name, uint16_t len) {
+    return calc_crc32c(0xfffffffe, (uint8_t*)name, len);
+}
+
+static bool is_inline(rootdir_inode* ri, uint32_t sector_size) {
+    if (S_ISLNK(ri->st.st_mode))
+        return true;
+
+    return S_ISREG(ri->st.st_mode) && ri->st.st_size > 0 && ri->st.st_size <= ROOTDIR_MAX_INLINE &&
+           (uint64_t)ri->st.st_size < sector_size;
+}
+
+static uint8_t mode_to_btrfs_type(mode_t mode) {
+    if (S_ISDIR(mode))
+        return BTRFS_TYPE_DIRECTORY;
+    else if (S_ISCHR(mode))
+        return BTRFS_TYPE_CHARDEV;
+    else if (S_ISBLK(mode))
+        return BTRFS_TYPE_BLOCKDEV;
+    else if (S_ISFIFO(mode))
+        return BTRFS_TYPE_FIFO;
+    else if (S_ISSOCK(mode))
+        return BTRFS_TYPE_SOCKET;
+    else if (S_ISLNK(mode))
+        return BTRFS_TYPE_SYMLINK;
+    else
+        return BTRFS_TYPE_FILE;
+}
+
+static uint64_t rootdir_add_inode(rootdir* rd, char* path, struct stat* st) {
+    rootdir_inode* ri;
+
+    if (rd->num_inodes == rd->alloc_inodes) {
+        rd->alloc_inodes = rd->alloc_inodes == 0 ? 64 : (rd->alloc_inodes * 2);
+        rd->inodes = realloc(rd->inodes, rd->alloc_inodes * sizeof(rootdir_inode));
+    }
+
+    ri = &rd->inodes[rd->num_inodes];
+    memset(ri, 0, sizeof(rootdir_inode));
+    ri->path = path;
+    ri->st = *st;
+
+    rd->num_inodes++;
+
+    return SUBVOL_ROOT_INODE + rd->num_inodes - 1;
+}
+
+static int hardlink_cmp(const void* a, const void* b) {
+    const rootdir_hardlink* hl1 = a;
+    const rootdir_hardlink* hl2 = b;
+
+    if (hl1->dev != hl2->dev)
+        return hl1->dev < hl2->dev ? -1 : 1;
+
+    if (hl1->ino != hl2->ino)
+        return hl1->ino < hl2->ino ? -1 : 1;
+
+    return 0;
+}
+
+static int dirent_cmp(const struct dirent** a, const struct dirent** b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static bool is_image(rootdir* rd, struct stat* st) {
+    unsigned int i;
+
+    for (i = 0; i < rd->num_images; i++) {
+        if (st->st_dev == rd->images[i].st_dev && st->st_ino == rd->images[i].st_ino)
+            return true;
+    }
+
+    return false;
+}
+
+static bool rootdir_scan_dir(rootdir* rd, uint64_t dir) {
+    const char* path = get_rootdir_inode(rd, dir)->path;
+    struct dirent** names;
+    rootdir_entry* entries;
+    size_t num_entries = 0;
+    int num_names, i;
+    uint64_t index = 2;
+    bool ret = true;
+
+    num_names = scandir(path, &names, NULL, dirent_cmp);
+    if (num_names < 0) {
+        fprintf(stderr, "Could not read directory %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    entries = malloc(sizeof(rootdir_entry) * (num_names > 0 ? num_names : 1));
+
+    for (i = 0; i < num_names; i++) {
+        const char* name = names[i]->d_name;
+        rootdir_entry* e;
+        rootdir_inode* ri;
+        struct stat st;
+        char* child_path;
+        uint64_t inode;
+
+        if (!ret || !strcmp(name, ".") || !strcmp(name, ".."))
+            goto next;
+
+        child_path = malloc(strlen(path) + strlen(name) + 2);
+        sprintf(child_path, "%s/%s", path, name);
+
+        if (lstat(child_path, &st) != 0) {
+            fprintf(stderr, "Could not stat %s: %s\n", child_path, strerror(errno));
+            free(child_path);
+            ret = false;
+            goto next;
+        }
+
+        if (is_image(rd, &st)) {
+            fprintf(stderr, "%s is the image being created, and can't be inside the directory.\n", child_path);
+            free(child_path);
+            ret = false;
+            goto next;
+        }
+
+        if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+            rootdir_hardlink key, **found;
+
+            key.dev = st.st_dev;
+            key.ino = st.st_ino;
+
+            found = tfind(&key, &rd->hardlinks, hardlink_cmp);
+
+            if (found) {
+                inode = (*found)->inode;
+                free(child_path);
+            } else {
+                rootdir_hardlink* hl = malloc(sizeof(rootdir_hardlink));
+
+                hl->dev = st.st_dev;
+                hl->ino = st.st_ino;
+                hl->inode = inode = rootdir_add_inode(rd, child_path, &st);
+
+                tsearch(hl, &rd->hardlinks, hardlink_cmp);
+            }
+        } else
+            inode = rootdir_add_inode(rd, child_path, &st);
+
+        e = &entries[num_entries];
+        num_entries++;
+
+        e->name_len = (uint16_t)strlen(name);
+        e->name = malloc(e->name_len + 1);
+        memcpy(e->name, name, e->name_len + 1);
+        e->type = mode_to_btrfs_type(st.st_mode);
+        e->hash = calc_name_hash(e->name, e->name_len);
+        e->inode = inode;
+        e->index = index;
+        index++;
+
+        ri = get_rootdir_inode(rd, inode);
+        ri->links = realloc(ri->links, (ri->num_links + 1) * sizeof(rootdir_link));
+        ri->links[ri->num_links].parent = dir;
+        ri->links[ri->num_links].index = e->index;
+        ri->links[ri->num_links].name = e->name;
+        ri->links[ri->num_links].name_len = e->name_len;
+        ri->num_links++;
+
+next:
+        free(names[i]);
+    }
+
+    free(names);
+
+    get_rootdir_inode(rd, dir)->entries = entries;
+    get_rootdir_inode(rd, dir)->num_entries = num_entries;
+
+    if (!ret)
+        return false;
+
+    for (i = 0; i < (int)num_entries; i++) {
+        if (entries[i].type == BTRFS_TYPE_DIRECTORY && !rootdir_scan_dir(rd, entries[i].inode))
+            return false;
+    }
+
+    return true;
+}
+
+static bool rootdir_scan(rootdir* rd, const char* path) {
+    struct stat st;
+    char* root_path;
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s is not a directory.\n", path);
+        return false;
+    }
+
+    root_path = malloc(strlen(path) + 1);
+    strcpy(root_path, path);
+
+    rootdir_add_inode(rd, root_path, &st);
+
+    return rootdir_scan_dir(rd, SUBVOL_ROOT_INODE);
+}
+
+static void rootdir_free(rootdir* rd) {
+    size_t i, j;
+
+    for (i = 0; i < rd->num_inodes; i++) {
+        rootdir_inode* ri = &rd->inodes[i];
+
+        for (j = 0; j < ri->num_entries; j++) {
+            free(ri->entries[j].name);
+        }
+
+        free(ri->path);
+
+        if (ri->entries)
+            free(ri->entries);
+
+        if (ri->links)
+            free(ri->links);
+
+        if (ri->extents)
+            free(ri->extents);
+    }
+
+    if (rd->inodes)
+        free(rd->inodes);
+
+    tdestroy(rd->hardlinks, free);
+
+    for (i = 0; i < ROOTDIR_MAX_THREADS; i++) {
+        if (rd->comp_ctxs[i])
+            comp_ctx_free(rd->comp_ctxs[i]);
+    }
+}
+
+// A rough guess at how much metadata the directory will need, so we can make
+// the metadata chunk big enough.
+static uint64_t rootdir_metadata_size(rootdir* rd, uint32_t sector_size) {
+    uint64_t size = 0;
+    size_t i, j;
+
+    for (i = 0; i < rd->num_inodes; i++) {
+        rootdir_inode* ri = &rd->inodes[i];
+
+        size += sizeof(leaf_node) + sizeof(INODE_ITEM);
+
+        for (j = 0; j < ri->num_links; j++) {
+            size += (3 * sizeof(leaf_node)) + sizeof(INODE_REF) + (2 * sizeof(DIR_ITEM)) + (3 * ri->links[j].name_len);
+        }
+
+        if (is_inline(ri, sector_size))
+            size += sizeof(leaf_node) + sizeof(EXTENT_DATA) + ri->st.st_size;
+        else if (S_ISREG(ri->st.st_mode)) {
+            uint64_t sectors = ((uint64_t)ri->st.st_size + sector_size - 1) / sector_size;
+            uint64_t extents = (ri->st.st_size / (rd->compression != BTRFS_COMPRESSION_NONE ? ROOTDIR_UNIT_SIZE : ROOTDIR_MAX_EXTENT_SIZE)) + 1;
+
+            size += extents * ((2 * sizeof(leaf_node)) + offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2) + sizeof(EXTENT_ITEM_FILE));
+            size += sectors * get_csum_size();
+        }
+    }
+
+    // leave room for xattrs, internal nodes, and the space left at the end of leaves
+    return size * 2;
+}
+
+static void rootdir_flush_csums(rootdir_writer* w) {
+    if (w->num_csums == 0)
+        return;
+
+    add_item(w->csum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, w->csum_address, w->csums, (uint16_t)(w->num_csums * get_csum_size()));
+
+    w->num_csums = 0;
+}
+
+static void rootdir_add_csums(rootdir_writer* w, uint64_t address, uint8_t* csums, uint32_t num) {
+    uint16_t csum_size = get_csum_size();
+
+    while (num > 0) {
+        uint32_t n;
+
+        if (w->num_csums > 0 && (w->num_csums == w->max_csums || w->csum_address + ((uint64_t)w->num_csums * w->sector_size) != address))
+            rootdir_flush_csums(w);
+
+        if (w->num_csums == 0)
+            w->csum_address = address;
+
+        n = min(num, w->max_csums - w->num_csums);
+
+        memcpy(w->csums + (w->num_csums * csum_size), csums, n * csum_size);
+        w->num_csums += n;
+
+        address += (uint64_t)n * w->sector_size;
+        csums += n * csum_size;
+        num -= n;
+    }
+}
+
+// Like get_next_address, but for data: finds where an extent of len bytes can
+// go without overlapping the stripe of a superblock. Returns 0 if the chunk is
+// full.
+static uint64_t find_data_address(btrfs_chunk* c, uint64_t len) {
+    uint64_t stripe_length = c->chunk_item->stripe_length;
+    uint64_t addr = c->lastoff;
+    bool moved;
+
+    do {
+        uint64_t piece;
+
+        moved = false;
+
+        if (addr + len > c->offset + c->chunk_item->size)
+            return 0;
+
+        for (piece = addr - ((addr - c->offset) % stripe_length); piece < addr + len; piece += stripe_length) {
+            if (superblock_collision(c, piece)) {
+                addr = piece + stripe_length;
+                moved = true;
+                break;
+            }
+        }
+    } while (moved);
+
+    return addr;
+}
+
+static void rootdir_finish_extent(rootdir* rd, rootdir_writer* w) {
+    rootdir_inode* ri;
+
+    if (!w->have_ext)
+        return;
+
+    ri = get_rootdir_inode(rd, w->ext_inode);
+
+    ri->extents = realloc(ri->extents, (ri->num_extents + 1) * sizeof(rootdir_extent));
+    ri->extents[ri->num_extents] = w->ext;
+    ri->num_extents++;
+
+    if (w->ext.address != 0) {
+        EXTENT_ITEM_FILE eif;
+
+        eif.ei.refcount = 1;
+        eif.ei.generation = 1;
+        eif.ei.flags = EXTENT_ITEM_DATA;
+        eif.type = TYPE_EXTENT_DATA_REF;
+        eif.edr.root = BTRFS_ROOT_FSTREE;
+        eif.edr.objid = w->ext_inode;
+        eif.edr.offset = w->ext.offset;
+        eif.edr.count = 1;
+
+        add_item(w->extent_root, w->ext.address, TYPE_EXTENT_ITEM, w->ext.size, &eif, sizeof(EXTENT_ITEM_FILE));
+
+        ri->nbytes += w->ext.num_bytes;
+    }
+
+    w->have_ext = false;
+}
+
+static NTSTATUS rootdir_write_job(rootdir* rd, rootdir_writer* w, rootdir_job* job) {
+    NTSTATUS Status;
+    uint8_t* buf = job->comp_length != 0 ? job->comp : job->data;
+    uint32_t len = job->comp_length != 0 ? job->comp_length : (uint32_t)job->length;
+    uint64_t address = 0;
+
+    if (job->hole) {
+        rootdir_finish_extent(rd, w);
+
+        w->have_ext = true;
+        w->ext_inode = job->inode;
+        w->ext.offset = job->offset;
+        w->ext.address = 0;
+        w->ext.size = 0;
+        w->ext.num_bytes = job->length;
+        w->ext.compression = BTRFS_COMPRESSION_NONE;
+
+        return STATUS_SUCCESS;
+    }
+
+    // uncompressed data carries on the previous extent if it can
+    if (w->have_ext && w->ext_inode == job->inode && job->comp_length == 0 && w->ext.address != 0 &&
+        w->ext.compression == BTRFS_COMPRESSION_NONE && w->ext.offset + w->ext.num_bytes == job->offset &&
+        w->ext.size + len <= ROOTDIR_MAX_EXTENT_SIZE && w->ext_chunk == w->c) {
+        address = find_data_address(w->c, len);
+
+        if (address != w->ext.address + w->ext.size)
+            address = 0;
+    }
+
+    if (address == 0) {
+        rootdir_finish_extent(rd, w);
+
+        if (w->c)
+            address = find_data_address(w->c, len);
+
+        if (address == 0) {
+            w->c = add_chunk(w->chunks, w->chunk_flags, len, w->chunk_root, w->devs, w->num_devices, w->dev_root, w->chunkuuid,
+                             w->sector_size);
+            if (!w->c) {
+                fprintf(stderr, "Not enough space for the contents of the directory.\n");
+                return STATUS_DISK_FULL;
+            }
+
+            address = find_data_address(w->c, len);
+            if (address == 0)
+                return STATUS_DISK_FULL;
+        }
+
+        w->have_ext = true;
+        w->ext_inode = job->inode;
+        w->ext_chunk = w->c;
+        w->ext.offset = job->offset;
+        w->ext.address = address;
+        w->ext.size = len;
+        w->ext.num_bytes = job->length;
+        w->ext.compression = job->comp_length != 0 ? rd->compression : BTRFS_COMPRESSION_NONE;
+    } else {
+        w->ext.size += len;
+        w->ext.num_bytes += len;
+    }
+
+    Status = write_data(w->devs, address, w->c, buf, len);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    add_used_space(w->c, address, len);
+
+    rootdir_add_csums(w, address, job->csums, len / w->sector_size);
+
+    return STATUS_SUCCESS;
+}
+
+static void rootdir_process_job(rootdir* rd, rootdir_job* job, uint32_t sector_size, comp_ctx* ctx) {
+    NTSTATUS Status;
+    unsigned int space_left = 0;
+    uint16_t csum_size = get_csum_size();
+    uint8_t* buf;
+    uint32_t len, off;
+
+    job->comp_length = 0;
+
+    if (job->hole)
+        return;
+
+    switch (rd->compression) {
+        case BTRFS_COMPRESSION_ZLIB:
+            Status = zlib_compress(job->data, (uint32_t)job->length, job->comp, (uint32_t)job->length, rd->level, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            Status = lzo_compress(job->data, (uint32_t)job->length, job->comp, (uint32_t)job->length, &space_left, ctx);
+        break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            Status = zstd_compress(job->data, (uint32_t)job->length, job->comp, (uint32_t)job->length, rd->level, &space_left, ctx);
+        break;
+
+        default:
+            Status = STATUS_SUCCESS;
+        break;
+    }
+
+    // only worth it if we save at least a sector
+    if (NT_SUCCESS(Status) && space_left >= sector_size) {
+        uint32_t comp_len = (uint32_t)job->length - space_left;
+
+        job->comp_length = (comp_len + sector_size - 1) & ~(sector_size - 1);
+        memset(job->comp + comp_len, 0, job->comp_length - comp_len);
+    }
+
+    buf = job->comp_length != 0 ? job->comp : job->data;
+    len = job->comp_length != 0 ? job->comp_length : (uint32_t)job->length;
+
+    for (off = 0; off < len; off += sector_size) {
+        calc_csum(job->csums + ((off / sector_size) * csum_size), buf + off, sector_size);
+    }
+}
+
+static comp_ctx* rootdir_comp_ctx(rootdir* rd, unsigned int worker) {
+    if (rd->compression == BTRFS_COMPRESSION_NONE)
+        return NULL;
+
+    // if this fails, the compression functions set up a context each time
+    if (!rd->comp_ctxs[worker])
+        rd->comp_ctxs[worker] = comp_ctx_alloc();
+
+    return rd->comp_ctxs[worker];
+}
+
+static void* rootdir_worker(void* context) {
+    rootdir_batch* b = context;
+    unsigned int i;
+    comp_ctx* ctx = rootdir_comp_ctx(b->rd, __atomic_fetch_add(&b->next_worker, 1, __ATOMIC_RELAXED));
+
+    while ((i = __atomic_fetch_add(&b->next_job, 1, __ATOMIC_RELAXED)) < b->num_jobs) {
+        rootdir_process_job(b->rd, &b->jobs[i], b->sector_size, ctx);
+    }
+
+    return NULL;
+}
+
+static NTSTATUS rootdir_run_batch(rootdir* rd, rootdir_writer* w, rootdir_batch* b) {
+    NTSTATUS Status;
+    pthread_t threads[ROOTDIR_MAX_THREADS - 1];
+    unsigned int num_threads = 0, i;
+
+    b->next_job = 0;
+    b->next_worker = 0;
+
+    while (num_threads + 1 < min(rd->threads, b->num_jobs) && num_threads < sizeof(threads) / sizeof(threads[0])) {
+        if (pthread_create(&threads[num_threads], NULL, rootdir_worker, b) != 0)
+            break;
+
+        num_threads++;
+    }
+
+    rootdir_worker(b);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // written in order, so the layout doesn't depend on the number of threads
+    for (i = 0; i < b->num_jobs; i++) {
+        Status = rootdir_write_job(rd, w, &b->jobs[i]);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    b->num_jobs = 0;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS rootdir_get_job(rootdir* rd, rootdir_writer* w, rootdir_batch* b, rootdir_job** job) {
+    if (b->num_jobs == ROOTDIR_BATCH_UNITS) {
+        NTSTATUS Status = rootdir_run_batch(rd, w, b);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    *job = &b->jobs[b->num_jobs];
+    b->num_jobs++;
+
+    return STATUS_SUCCESS;
+}
+
+static bool read_file(int fd, const char* path, uint8_t* buf, uint64_t offset, uint32_t len, uint64_t file_size) {
+    uint32_t done = 0;
+
+    if (offset < file_size)
+        len = (uint32_t)min(len, file_size - offset);
+    else
+        len = 0;
+
+    while (done < len) {
+        ssize_t ret = pread(fd, buf + done, len - done, (off_t)(offset + done));
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        if (ret == 0) // file has shrunk since we looked at it
+            break;
+
+        done += (uint32_t)ret;
+    }
+
+    return true;
+}
+
+static NTSTATUS rootdir_queue_file(rootdir* rd, rootdir_writer* w, rootdir_batch* b, uint64_t inode, bool no_holes) {
+    NTSTATUS Status;
+    rootdir_inode* ri = get_rootdir_inode(rd, inode);
+    uint64_t size = ri->st.st_size;
+    uint64_t end = (size + w->sector_size - 1) & ~((uint64_t)w->sector_size - 1);
+    uint64_t pos = 0;
+    int fd;
+
+    fd = open(ri->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", ri->path, strerror(errno));
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+
+    while (pos < end) {
+        uint64_t start = pos, stop = end, off;
+        off_t data;
+        rootdir_job* job;
+
+        // skip over holes in sparse files
+        data = lseek(fd, (off_t)pos, SEEK_DATA);
+
+        if (data == -1 && errno == ENXIO)
+            start = end;
+        else if (data != -1) {
+            off_t hole;
+
+            start = min(end, (uint64_t)data & ~((uint64_t)w->sector_size - 1));
+
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole != -1)
+                stop = min(end, ((uint64_t)hole + w->sector_size - 1) & ~((uint64_t)w->sector_size - 1));
+        }
+
+        if (start > pos && !no_holes) {
+            Status = rootdir_get_job(rd, w, b, &job);
+            if (!NT_SUCCESS(Status))
+                goto end;
+
+            job->inode = inode;
+            job->offset = pos;
+            job->length = start - pos;
+            job->hole = true;
+        }
+
+        for (off = start; off < stop; off += ROOTDIR_UNIT_SIZE) {
+            Status = rootdir_get_job(rd, w, b, &job);
+            if (!NT_SUCCESS(Status))
+                goto end;
+
+            job->inode = inode;
+            job->offset = off;
+            job->length = min(ROOTDIR_UNIT_SIZE, stop - off);
+            job->hole = false;
+
+            memset(job->data, 0, job->length);
+
+            if (!read_file(fd, ri->path, job->data, off, (uint32_t)job->length, size)) {
+                Status = STATUS_UNEXPECTED_IO_ERROR;
+                goto end;
+            }
+        }
+
+        pos = stop;
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    close(fd);
+
+    return Status;
+}
+
+static NTSTATUS rootdir_write_data(rootdir* rd, rootdir_writer* w, bool no_holes) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    rootdir_batch b;
+    size_t i;
+
+    b.rd = rd;
+    b.sector_size = w->sector_size;
+    b.num_jobs = 0;
+    b.jobs = malloc(ROOTDIR_BATCH_UNITS * sizeof(rootdir_job));
+
+    for (i = 0; i < ROOTDIR_BATCH_UNITS; i++) {
+        b.jobs[i].data = malloc(ROOTDIR_UNIT_SIZE);
+        b.jobs[i].comp = malloc(ROOTDIR_UNIT_SIZE);
+        b.jobs[i].csums = malloc((ROOTDIR_UNIT_SIZE / w->sector_size) * get_csum_size());
+    }
+
+    for (i = 0; i < rd->num_inodes; i++) {
+        rootdir_inode* ri = &rd->inodes[i];
+
+        if (!S_ISREG(ri->st.st_mode) || ri->st.st_size == 0 || is_inline(ri, w->sector_size))
+            continue;
+
+        Status = rootdir_queue_file(rd, w, &b, SUBVOL_ROOT_INODE + i, no_holes);
+        if (!NT_SUCCESS(Status))
+            goto end;
+    }
+
+    if (b.num_jobs > 0) {
+        Status = rootdir_run_batch(rd, w, &b);
+        if (!NT_SUCCESS(Status))
+            goto end;
+    }
+
+    rootdir_finish_extent(rd, w);
+    rootdir_flush_csums(w);
+
+end:
+    for (i = 0; i < ROOTDIR_BATCH_UNITS; i++) {
+        free(b.jobs[i].data);
+        free(b.jobs[i].comp);
+        free(b.jobs[i].csums);
+    }
+
+    free(b.jobs);
+
+    return Status;
+}
+
+static int link_cmp(const void* a, const void* b) {
+    const rootdir_link* l1 = a;
+    const rootdir_link* l2 = b;
+
+    if (l1->parent != l2->parent)
+        return l1->parent < l2->parent ? -1 : 1;
+
+    if (l1->index != l2->index)
+        return l1->index < l2->index ? -1 : 1;
+
+    return 0;
+}
+
+static int entry_hash_cmp(const void* a, const void* b) {
+    const rootdir_entry* e1 = *(const rootdir_entry**)a;
+    const rootdir_entry* e2 = *(const rootdir_entry**)b;
+
+    if (e1->hash != e2->hash)
+        return e1->hash < e2->hash ? -1 : 1;
+
+    if (e1->index != e2->index)
+        return e1->index < e2->index ? -1 : 1;
+
+    return 0;
+}
+
+static uint16_t put_dir_item(uint8_t* buf, uint64_t inode, uint8_t key_type, uint8_t type, const char* name, uint16_t name_len,
+                             const void* value, uint16_t value_len) {
+    DIR_ITEM* di = (DIR_ITEM*)buf;
+
+    di->key.obj_id = inode;
+    di->key.obj_type = key_type;
+    di->key.offset = 0;
+    di->transid = 1;
+    di->m = value_len;
+    di->n = name_len;
+    di->type = type;
+    memcpy(di->name, name, name_len);
+
+    if (value_len > 0)
+        memcpy(di->name + name_len, value, value_len);
+
+    return (uint16_t)(offsetof(DIR_ITEM, name[0]) + name_len + value_len);
+}
+
+typedef struct {
+    char* name;
+    uint16_t name_len;
+    uint8_t* value;
+    uint16_t value_len;
+    uint32_t hash;
+} rootdir_xattr;
+
+static int xattr_hash_cmp(const void* a, const void* b) {
+    const rootdir_xattr* x1 = a;
+    const rootdir_xattr* x2 = b;
+
+    if (x1->hash != x2->hash)
+        return x1->hash < x2->hash ? -1 : 1;
+
+    return strcmp(x1->name, x2->name);
+}
+
+static NTSTATUS rootdir_add_xattrs(btrfs_root* r, uint64_t inode, const char* path, uint32_t max_item_size) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    ssize_t len;
+    char* names;
+    char* name;
+    rootdir_xattr* xattrs;
+    size_t num_xattrs = 0, i, j;
+
+    len = llistxattr(path, NULL, 0);
+
+    if (len == 0 || (len < 0 && errno == ENOTSUP))
+        return STATUS_SUCCESS;
+
+    names = len > 0 ? malloc(len) : NULL;
+
+    if (len < 0 || (len = llistxattr(path, names, len)) < 0) {
+        fprintf(stderr, "Could not list xattrs of %s: %s\n", path, strerror(errno));
+
+        if (names)
+            free(names);
+
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+
+    xattrs = malloc(len * sizeof(rootdir_xattr)); // more than enough
+
+    for (name = names; name < names + len; name += strlen(name) + 1) {
+        rootdir_xattr* x = &xattrs[num_xattrs];
+        ssize_t vlen;
+
+        vlen = lgetxattr(path, name, NULL, 0);
+
+        if (vlen >= 0) {
+            x->value = malloc(vlen > 0 ? vlen : 1);
+            vlen = lgetxattr(path, name, x->value, vlen);
+
+            if (vlen < 0)
+                free(x->value);
+        }
+
+        if (vlen < 0) {
+            fprintf(stderr, "Could not get xattr %s of %s: %s\n", name, path, strerror(errno));
+            Status = STATUS_UNEXPECTED_IO_ERROR;
+            goto end;
+        }
+
+        x->name = name;
+        x->name_len = (uint16_t)strlen(name);
+        x->value_len = (uint16_t)vlen;
+        x->hash = calc_name_hash(name, x->name_len);
+
+        num_xattrs++;
+
+        if (offsetof(DIR_ITEM, name[0]) + x->name_len + vlen > max_item_size) {
+            fprintf(stderr, "xattr %s of %s is too large.\n", name, path);
+            Status = STATUS_INVALID_PARAMETER;
+            goto end;
+        }
+    }
+
+    qsort(xattrs, num_xattrs, sizeof(rootdir_xattr), xattr_hash_cmp);
+
+    // xattrs whose names hash the same share an item
+    for (i = 0; i < num_xattrs; i = j) {
+        size_t size = 0;
+        uint8_t* buf;
+        uint8_t* p;
+
+        for (j = i; j < num_xattrs && xattrs[j].hash == xattrs[i].hash; j++) {
+            size += offsetof(DIR_ITEM, name[0]) + xattrs[j].name_len + xattrs[j].value_len;
+        }
+
+        if (size > max_item_size) {
+            fprintf(stderr, "Too many xattrs on %s.\n", path);
+            Status = STATUS_INVALID_PARAMETER;
+            goto end;
+        }
+
+        buf = p = malloc(size);
+
+        for (j = i; j < num_xattrs && xattrs[j].hash == xattrs[i].hash; j++) {
+            p += put_dir_item(p, 0, 0, BTRFS_TYPE_EA, xattrs[j].name, xattrs[j].name_len, xattrs[j].value, xattrs[j].value_len);
+        }
+
+        add_item(r, inode, TYPE_XATTR_ITEM, xattrs[i].hash, buf, (uint16_t)size);
+
+        free(buf);
+    }
+
+end:
+    for (i = 0; i < num_xattrs; i++) {
+        free(xattrs[i].value);
+    }
+
+    free(xattrs);
+    free(names);
+
+    return Status;
+}
+
+static NTSTATUS rootdir_read_inline(rootdir* rd, rootdir_inode* ri, uint8_t* buf, uint16_t* len, uint8_t* compression) {
+    uint8_t data[ROOTDIR_MAX_INLINE];
+    unsigned int space_left = 0;
+    NTSTATUS Status;
+    int fd;
+
+    *compression = BTRFS_COMPRESSION_NONE;
+
+    if (S_ISLNK(ri->st.st_mode)) {
+        ssize_t ret = readlink(ri->path, (char*)buf, ri->st.st_size + 1);
+
+        if (ret < 0 || ret != ri->st.st_size) {
+            fprintf(stderr, "Could not read symlink %s: %s\n", ri->path, ret < 0 ? strerror(errno) : "size changed");
+            return STATUS_UNEXPECTED_IO_ERROR;
+        }
+
+        *len = (uint16_t)ret;
+
+        return STATUS_SUCCESS;
+    }
+
+    fd = open(ri->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", ri->path, strerror(errno));
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+
+    memset(data, 0, ri->st.st_size);
+
+    if (!read_file(fd, ri->path, data, 0, (uint32_t)ri->st.st_size, ri->st.st_size)) {
+        close(fd);
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+
+    close(fd);
+
+    *len = (uint16_t)ri->st.st_size;
+
+    switch (rd->compression) {
+        case BTRFS_COMPRESSION_ZLIB:
+            Status = zlib_compress(data, *len, buf, *len, rd->level, &space_left, rootdir_comp_ctx(rd, 0));
+        break;
+
+        case BTRFS_COMPRESSION_LZO:
+            Status = lzo_compress(data, *len, buf, *len, &space_left, rootdir_comp_ctx(rd, 0));
+        break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            Status = zstd_compress(data, *len, buf, *len, rd->level, &space_left, rootdir_comp_ctx(rd, 0));
+        break;
+
+        default:
+            Status = STATUS_SUCCESS;
+        break;
+    }
+
+    if (NT_SUCCESS(Status) && space_left > 0) {
+        *len -= space_left;
+        *compression = rd->compression;
+    } else
+        memcpy(buf, data, *len);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS rootdir_add_inode_items(rootdir* rd, btrfs_root* r, uint64_t inode, uint32_t sector_size, uint32_t node_size) {
+    NTSTATUS Status;
+    rootdir_inode* ri = get_rootdir_inode(rd, inode);
+    uint32_t max_item_size = node_size - sizeof(tree_header) - sizeof(leaf_node);
+    uint8_t inline_data[ROOTDIR_MAX_INLINE > 4096 ? ROOTDIR_MAX_INLINE : 4096];
+    uint16_t inline_len = 0;
+    uint8_t inline_compression = BTRFS_COMPRESSION_NONE;
+    INODE_ITEM ii;
+    size_t i, j;
+
+    if (is_inline(ri, sector_size)) {
+        Status = rootdir_read_inline(rd, ri, inline_data, &inline_len, &inline_compression);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        if (offsetof(EXTENT_DATA, data[0]) + inline_len > max_item_size) {
+            fprintf(stderr, "Symlink %s is too long.\n", ri->path);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    memset(&ii, 0, sizeof(INODE_ITEM));
+
+    ii.generation = 1;
+    ii.transid = 1;
+    ii.st_uid = ri->st.st_uid;
+    ii.st_gid = ri->st.st_gid;
+    ii.st_mode = ri->st.st_mode;
+
+    if (S_ISDIR(ri->st.st_mode)) {
+        ii.st_nlink = 1;
+
+        for (i = 0; i < ri->num_entries; i++) {
+            ii.st_size += 2 * ri->entries[i].name_len;
+        }
+    } else {
+        ii.st_nlink = (uint32_t)ri->num_links;
+        ii.st_size = ri->st.st_size;
+        ii.st_blocks = is_inline(ri, sector_size) ? (uint64_t)ri->st.st_size : ri->nbytes;
+    }
+
+    if (S_ISCHR(ri->st.st_mode) || S_ISBLK(ri->st.st_mode))
+        ii.st_rdev = (minor(ri->st.st_rdev) & 0xFFFFF) | ((uint64_t)major(ri->st.st_rdev) << 20);
+
+    ii.st_atime.seconds = ri->st.st_atim.tv_sec;
+    ii.st_atime.nanoseconds = (uint32_t)ri->st.st_atim.tv_nsec;
+    ii.st_ctime.seconds = ri->st.st_ctim.tv_sec;
+    ii.st_ctime.nanoseconds = (uint32_t)ri->st.st_ctim.tv_nsec;
+    ii.st_mtime.seconds = ri->st.st_mtim.tv_sec;
+    ii.st_mtime.nanoseconds = (uint32_t)ri->st.st_mtim.tv_nsec;
+    get_current_time(&ii.otime);
+
+    add_item(r, inode, TYPE_INODE_ITEM, 0, &ii, sizeof(INODE_ITEM));
+
+    // INODE_REFs, one item for each parent
+
+    if (inode == SUBVOL_ROOT_INODE)
+        add_inode_ref(r, SUBVOL_ROOT_INODE, SUBVOL_ROOT_INODE, 0, "..");
+    else {
+        qsort(ri->links, ri->num_links, sizeof(rootdir_link), link_cmp);
+
+        for (i = 0; i < ri->num_links; i = j) {
+            size_t size = 0;
+            uint8_t* buf;
+            uint8_t* p;
+
+            for (j = i; j < ri->num_links && ri->links[j].parent == ri->links[i].parent; j++) {
+                size += offsetof(INODE_REF, name[0]) + ri->links[j].name_len;
+            }
+
+            if (size > max_item_size) {
+                fprintf(stderr, "%s has too many hard links.\n", ri->path);
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            buf = p = malloc(size);
+
+            for (j = i; j < ri->num_links && ri->links[j].parent == ri->links[i].parent; j++) {
+                INODE_REF* ir = (INODE_REF*)p;
+
+                ir->index = ri->links[j].index;
+                ir->n = ri->links[j].name_len;
+                memcpy(ir->name, ri->links[j].name, ir->n);
+
+                p += offsetof(INODE_REF, name[0]) + ir->n;
+            }
+
+            add_item(r, inode, TYPE_INODE_REF, ri->links[i].parent, buf, (uint16_t)size);
+
+            free(buf);
+        }
+    }
+
+    Status = rootdir_add_xattrs(r, inode, ri->path, max_item_size);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    // DIR_ITEMs, sorted by hash, and DIR_INDEXes
+
+    if (ri->num_entries > 0) {
+        rootdir_entry** sorted = malloc(ri->num_entries * sizeof(rootdir_entry*));
+        uint8_t buf[offsetof(DIR_ITEM, name[0]) + 255];
+
+        for (i = 0; i < ri->num_entries; i++) {
+            sorted[i] = &ri->entries[i];
+        }
+
+        qsort(sorted, ri->num_entries, sizeof(rootdir_entry*), entry_hash_cmp);
+
+        for (i = 0; i < ri->num_entries; i = j) {
+            size_t size = 0;
+            uint8_t* item;
+            uint8_t* p;
+
+            for (j = i; j < ri->num_entries && sorted[j]->hash == sorted[i]->hash; j++) {
+                size += offsetof(DIR_ITEM, name[0]) + sorted[j]->name_len;
+            }
+
+            item = p = malloc(size);
+
+            for (j = i; j < ri->num_entries && sorted[j]->hash == sorted[i]->hash; j++) {
+                p += put_dir_item(p, sorted[j]->inode, TYPE_INODE_ITEM, sorted[j]->type, sorted[j]->name, sorted[j]->name_len, NULL, 0);
+            }
+
+            add_item(r, inode, TYPE_DIR_ITEM, sorted[i]->hash, item, (uint16_t)size);
+
+            free(item);
+        }
+
+        free(sorted);
+
+        for (i = 0; i < ri->num_entries; i++) {
+            rootdir_entry* e = &ri->entries[i];
+            uint16_t size = put_dir_item(buf, e->inode, TYPE_INODE_ITEM, e->type, e->name, e->name_len, NULL, 0);
+
+            add_item(r, inode, TYPE_DIR_INDEX, e->index, buf, size);
+        }
+    }
+
+    // EXTENT_DATA
+
+    if (is_inline(ri, sector_size)) {
+        uint8_t buf[offsetof(EXTENT_DATA, data[0]) + sizeof(inline_data)];
+        EXTENT_DATA* ed = (EXTENT_DATA*)buf;
+
+        ed->generation = 1;
+        ed->decoded_size = ri->st.st_size;
+        ed->compression = inline_compression;
+        ed->encryption = 0;
+        ed->encoding = 0;
+        ed->type = EXTENT_TYPE_INLINE;
+        memcpy(ed->data, inline_data, inline_len);
+
+        add_item(r, inode, TYPE_EXTENT_DATA, 0, buf, (uint16_t)(offsetof(EXTENT_DATA, data[0]) + inline_len));
+    } else {
+        for (i = 0; i < ri->num_extents; i++) {
+            rootdir_extent* ext = &ri->extents[i];
+            uint8_t buf[offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)];
+            EXTENT_DATA* ed = (EXTENT_DATA*)buf;
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+            ed->generation = 1;
+            ed->decoded_size = ext->num_bytes;
+            ed->compression = ext->compression;
+            ed->encryption = 0;
+            ed->encoding = 0;
+            ed->type = EXTENT_TYPE_REGULAR;
+
+            ed2->address = ext->address;
+            ed2->size = ext->size;
+            ed2->offset = 0;
+            ed2->num_bytes = ext->num_bytes;
+
+            add_item(r, inode, TYPE_EXTENT_DATA, ext->offset, buf, sizeof(buf));
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS rootdir_populate(rootdir* rd, btrfs_dev* devs, uint16_t num_devices, LIST_ENTRY* chunks, btrfs_root* chunk_root,
+                                 btrfs_root* dev_root, BTRFS_UUID* chunkuuid, btrfs_root* fs_root, btrfs_root* extent_root,
+                                 btrfs_root* csum_root, uint32_t sector_size, uint32_t node_size, uint64_t data_flags, uint64_t incompat_flags) {
+    NTSTATUS Status;
+    rootdir_writer w;
+    size_t i;
+
+    memset(&w, 0, sizeof(rootdir_writer));
+
+    w.devs = devs;
+    w.num_devices = num_devices;
+    w.chunks = chunks;
+    w.chunk_root = chunk_root;
+    w.dev_root = dev_root;
+    w.extent_root = extent_root;
+    w.csum_root = csum_root;
+    w.chunkuuid = chunkuuid;
+    w.sector_size = sector_size;
+    w.chunk_flags = data_flags;
 
-            last_end = use->address + use->size;
+    // the same limit as MAX_CSUM_ITEMS in Linux
+    w.max_csums = ((node_size - sizeof(tree_header) - (2 * sizeof(leaf_node))) / get_csum_size()) - 1;
+    w.csums = malloc(w.max_csums * get_csum_size());
 
-            le2 = le2->Flink;
-        }
+    Status = rootdir_write_data(rd, &w, incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES);
 
-        if (c->offset + c->chunk_item->size > last_end) {
-            add_item(free_space_root, last_end, TYPE_FREE_SPACE_EXTENT, c->offset + c->chunk_item->size - last_end,
-                     NULL, 0);
-            fsi.count++;
-        }
+    free(w.csums);
 
-        add_item(free_space_root, c->offset, TYPE_FREE_SPACE_INFO, c->chunk_item->size, &fsi, sizeof(fsi));
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-        le = le->Flink;
+    for (i = 0; i < rd->num_inodes; i++) {
+        Status = rootdir_add_inode_items(rd, fs_root, SUBVOL_ROOT_INODE + i, sector_size, node_size);
+        if (!NT_SUCCESS(Status))
+            return Status;
     }
+
+    return STATUS_SUCCESS;
 }
+#endif
 
-static NTSTATUS write_btrfs(HANDLE h, uint64_t size, PUNICODE_STRING label, uint32_t sector_size, uint32_t node_size, uint64_t incompat_flags,
-                            uint64_t compat_ro_flags) {
+static NTSTATUS write_btrfs(HANDLE* handles, uint64_t* sizes, uint16_t num_devices, const char* label, uint32_t sector_size,
+                            uint32_t node_size, uint64_t incompat_flags, uint64_t compat_ro_flags, uint64_t data_profile,
+                            uint64_t metadata_profile, rootdir* rd) {
     NTSTATUS Status;
     LIST_ENTRY roots, chunks;
-    btrfs_root *root_root, *chunk_root, *extent_root, *dev_root, *fs_root, *reloc_root,
+    btrfs_root *root_root, *chunk_root, *extent_root, *dev_root, *csum_root, *fs_root, *reloc_root,
                *block_group_root, *free_space_root;
     btrfs_chunk *sys_chunk, *metadata_chunk;
-    btrfs_dev dev;
+    btrfs_dev* devs;
     BTRFS_UUID fsuuid, chunkuuid;
-    bool ssd;
-    uint64_t metadata_flags;
+    bool ssd, have_data_chunk;
+    uint64_t system_profile, metadata_flags, data_flags, metadata_size = 0;
+    unsigned int i;
+    LIST_ENTRY* le;
 
     srand((unsigned int)time(0));
     get_uuid(&fsuuid);
@@ -1062,7 +3228,7 @@ static NTSTATUS write_btrfs(HANDLE h, uint64_t size, PUNICODE_STRING label, uint
     chunk_root = add_root(&roots, BTRFS_ROOT_CHUNK);
     extent_root = add_root(&roots, BTRFS_ROOT_EXTENT);
     dev_root = add_root(&roots, BTRFS_ROOT_DEVTREE);
-    add_root(&roots, BTRFS_ROOT_CHECKSUM);
+    csum_root = add_root(&roots, BTRFS_ROOT_CHECKSUM);
     fs_root = add_root(&roots, BTRFS_ROOT_FSTREE);
     reloc_root = add_root(&roots, BTRFS_ROOT_DATA_RELOC);
 
@@ -1076,59 +3242,172 @@ static NTSTATUS write_btrfs(HANDLE h, uint64_t size, PUNICODE_STRING label, uint
     else
         block_group_root = NULL;
 
-    init_device(&dev, 1, size, &fsuuid, sector_size);
+    devs = malloc(num_devices * sizeof(btrfs_dev));
+
+    for (i = 0; i < num_devices; i++) {
+        init_device(&devs[i], i + 1, sizes[i], &fsuuid, sector_size);
+        devs[i].h = handles[i];
+    }
+
+    ssd = is_ssd(handles[0]);
+
+    // As mkfs.btrfs does: RAID1 metadata if there's more than one device,
+    // otherwise DUP unless it's an SSD; and single data. System chunks follow
+    // the metadata, other than on mixed filesystems, where they stay as they
+    // would have been.
+
+    if (metadata_profile == PROFILE_DEFAULT) {
+        if (incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS && data_profile != PROFILE_DEFAULT)
+            metadata_profile = data_profile;
+        else if (num_devices > 1)
+            metadata_profile = BLOCK_FLAG_RAID1;
+        else if (!ssd && !(incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS))
+            metadata_profile = BLOCK_FLAG_DUPLICATE;
+        else
+            metadata_profile = 0;
+
+        if (num_devices > 1)
+            system_profile = BLOCK_FLAG_RAID1;
+        else
+            system_profile = ssd ? 0 : BLOCK_FLAG_DUPLICATE;
+    } else
+        system_profile = metadata_profile;
+
+    if (data_profile == PROFILE_DEFAULT)
+        data_profile = incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS ? metadata_profile : 0;
 
-    ssd = is_ssd(h);
+    if (incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS && data_profile != metadata_profile)
+        return STATUS_INVALID_PARAMETER;
+
+    if ((data_profile | metadata_profile) & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        incompat_flags |= BTRFS_INCOMPAT_FLAGS_RAID56;
 
-    sys_chunk = add_chunk(&chunks, BLOCK_FLAG_SYSTEM | (ssd ? 0 : BLOCK_FLAG_DUPLICATE), chunk_root, &dev, dev_root, &chunkuuid, sector_size);
+    if ((data_profile | metadata_profile) & (BLOCK_FLAG_RAID1C3 | BLOCK_FLAG_RAID1C4))
+        incompat_flags |= BTRFS_INCOMPAT_FLAGS_RAID1C34;
+
+    sys_chunk = add_chunk(&chunks, BLOCK_FLAG_SYSTEM | system_profile, 0, chunk_root, devs, num_devices, dev_root, &chunkuuid, sector_size);
     if (!sys_chunk)
         return STATUS_INTERNAL_ERROR;
 
-    metadata_flags = BLOCK_FLAG_METADATA;
-
-    if (!ssd && !(incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS))
-        metadata_flags |= BLOCK_FLAG_DUPLICATE;
+    metadata_flags = BLOCK_FLAG_METADATA | metadata_profile;
+    data_flags = BLOCK_FLAG_DATA | data_profile;
 
-    if (incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS)
+    if (incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS) {
         metadata_flags |= BLOCK_FLAG_DATA;
+        data_flags |= BLOCK_FLAG_METADATA;
+    }
 
-    metadata_chunk = add_chunk(&chunks, metadata_flags, chunk_root, &dev, dev_root, &chunkuuid, sector_size);
-    if (!metadata_chunk)
-        return STATUS_INTERNAL_ERROR;
+#ifndef _WIN32
+    if (rd)
+        metadata_size = rootdir_metadata_size(rd, sector_size);
+#endif
+
+    metadata_chunk = add_chunk(&chunks, metadata_flags, metadata_size, chunk_root, devs, num_devices, dev_root, &chunkuuid, sector_size);
+    if (!metadata_chunk) {
+        if (metadata_size != 0)
+            return STATUS_DISK_FULL;
 
-    add_item(chunk_root, 1, TYPE_DEV_ITEM, dev.dev_item.dev_id, &dev.dev_item, sizeof(DEV_ITEM));
+        return STATUS_INTERNAL_ERROR;
+    }
 
     set_default_subvol(root_root, node_size);
 
-    init_fs_tree(fs_root, node_size);
+#ifndef _WIN32
+    if (rd) {
+        Status = rootdir_populate(rd, devs, num_devices, &chunks, chunk_root, dev_root, &chunkuuid, fs_root, extent_root, csum_root,
+                                  sector_size, node_size, data_flags, incompat_flags);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    } else
+#endif
+        init_fs_tree(fs_root, node_size);
+
     init_fs_tree(reloc_root, node_size);
 
-    assign_addresses(&roots, sys_chunk, metadata_chunk, node_size, root_root, extent_root, incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA);
+    // Linux would give new data chunks the profile of the existing ones, so
+    // if we don't want single we need to start it off.
+
+    have_data_chunk = false;
+
+    le = chunks.Flink;
+    while (le != &chunks) {
+        btrfs_chunk* c = CONTAINING_RECORD(le, btrfs_chunk, list_entry);
+
+        if (c->chunk_item->type & BLOCK_FLAG_DATA)
+            have_data_chunk = true;
+
+        le = le->Flink;
+    }
+
+    if (!have_data_chunk && data_profile != 0) {
+        if (!add_chunk(&chunks, data_flags, 0, chunk_root, devs, num_devices, dev_root, &chunkuuid, sector_size))
+            return STATUS_INTERNAL_ERROR;
+    }
+
+    // after any data chunks have been added, as they change bytes_used
+    for (i = 0; i < num_devices; i++) {
+        add_item(chunk_root, 1, TYPE_DEV_ITEM, devs[i].dev_item.dev_id, &devs[i].dev_item, sizeof(DEV_ITEM));
+    }
+
+    // Giving the tree blocks addresses adds extent items, which can change how
+    // many blocks the trees need, so go round until nothing moves.
+    for (i = 0; ; i++) {
+        bool changed = false;
+
+        le = roots.Flink;
+        while (le != &roots) {
+            btrfs_root* r = CONTAINING_RECORD(le, btrfs_root, list_entry);
+
+            if (layout_tree(r, node_size))
+                changed = true;
+
+            le = le->Flink;
+        }
+
+        if (i > 0 && !changed)
+            break;
+
+        if (i == 16)
+            return STATUS_INTERNAL_ERROR;
+
+        Status = assign_addresses(&roots, sys_chunk, metadata_chunk, node_size, root_root, extent_root,
+                                  incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA);
+        if (!NT_SUCCESS(Status))
+            return Status;
 
-    add_block_group_items(&chunks, block_group_root ? block_group_root : extent_root);
+        add_block_group_items(&chunks, block_group_root ? block_group_root : extent_root);
 
-    if (free_space_root)
-        populate_free_space_root(&chunks, free_space_root);
+        if (free_space_root)
+            populate_free_space_root(&chunks, free_space_root);
+    }
 
-    Status = write_roots(h, &roots, node_size, &fsuuid, &chunkuuid);
+    Status = write_roots(devs, &roots, node_size, &fsuuid, &chunkuuid);
     if (!NT_SUCCESS(Status))
         return Status;
 
-    Status = clear_first_megabyte(h);
+    Status = flush_rows(devs, &chunks);
     if (!NT_SUCCESS(Status))
         return Status;
 
-    Status = write_superblocks(h, &dev, chunk_root, root_root, extent_root, sys_chunk, node_size, &fsuuid, sector_size, label,
+    for (i = 0; i < num_devices; i++) {
+        Status = clear_first_megabyte(devs[i].h);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    Status = write_superblocks(devs, num_devices, chunk_root, root_root, extent_root, sys_chunk, node_size, &fsuuid, sector_size, label,
                                incompat_flags, compat_ro_flags);
     if (!NT_SUCCESS(Status))
         return Status;
 
     free_roots(&roots);
     free_chunks(&chunks);
+    free(devs);
 
     return STATUS_SUCCESS;
 }
 
+#ifdef _WIN32
 static bool look_for_device(btrfs_filesystem* bfs, BTRFS_UUID* devuuid) {
     uint32_t i;
     btrfs_filesystem_device* dev;
@@ -1294,19 +3573,39 @@ static void do_full_trim(HANDLE h) {
 
     NtDeviceIoControlFile(h, NULL, NULL, NULL, &iosb, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &dmdsa, sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), NULL, 0);
 }
+#else
+static void do_full_trim(HANDLE h) {
+    struct stat st;
+
+    if (fstat(h, &st) != 0)
+        return;
+
+    if (S_ISREG(st.st_mode)) {
+        // punching out the whole of an image leaves it sparse
+        if (lseek(h, 0, SEEK_DATA) == -1 && errno == ENXIO)
+            return;
+
+        fallocate(h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+    } else if (S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = { 0, 0 };
+
+        if (ioctl(h, BLKGETSIZE64, &range[1]) == 0)
+            ioctl(h, BLKDISCARD, range);
+    }
+}
+#endif
 
 static bool is_power_of_two(ULONG i) {
     return ((i != 0) && !(i & (i - 1)));
 }
 
-#if defined(_X86_) || defined(_AMD64_)
+#ifdef HAVE_CPUID
 static void check_cpu() {
     unsigned int cpuInfo[4];
     bool have_sse42;
 
 #ifndef _MSC_VER
-    __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]);
-    have_sse42 = cpuInfo[2] & bit_SSE4_2;
+    have_sse42 = __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]) && (cpuInfo[2] & bit_SSE4_2);
 #else
     __cpuid(cpuInfo, 1);
     have_sse42 = cpuInfo[2] & (1 << 20);
@@ -1317,6 +3616,7 @@ static void check_cpu() {
 }
 #endif
 
+#ifdef _WIN32
 static NTSTATUS NTAPI FormatEx2(PUNICODE_STRING DriveRoot, FMIFS_MEDIA_FLAG MediaFlag, PUNICODE_STRING Label,
                                 BOOLEAN QuickFormat, ULONG ClusterSize, PFMIFSCALLBACK Callback)
 {
@@ -1331,8 +3631,8 @@ static NTSTATUS NTAPI FormatEx2(PUNICODE_STRING DriveRoot, FMIFS_MEDIA_FLAG Medi
     HANDLE token;
     TOKEN_PRIVILEGES tp;
     LUID luid;
-    uint64_t incompat_flags, compat_ro_flags;
-    UNICODE_STRING empty_label;
+    uint64_t incompat_flags, compat_ro_flags, size;
+    char label[MAX_LABEL_SIZE + 1];
 
     static WCHAR btrfs[] = L"\\Btrfs";
 
@@ -1355,7 +3655,7 @@ static NTSTATUS NTAPI FormatEx2(PUNICODE_STRING DriveRoot, FMIFS_MEDIA_FLAG Medi
 
     CloseHandle(token);
 
-#if defined(_X86_) || defined(_AMD64_)
+#ifdef HAVE_CPUID
     check_cpu();
 #endif
 
@@ -1363,6 +3663,20 @@ static NTSTATUS NTAPI FormatEx2(PUNICODE_STRING DriveRoot, FMIFS_MEDIA_FLAG Medi
         def_csum_type != CSUM_TYPE_BLAKE2)
         return STATUS_INVALID_PARAMETER;
 
+    label[0] = 0;
+
+    if (Label && Label->Length > 0) {
+        int utf8len = WideCharToMultiByte(CP_UTF8, 0, Label->Buffer, Label->Length / sizeof(WCHAR), NULL, 0, NULL, NULL);
+
+        if (utf8len == 0 || utf8len > MAX_LABEL_SIZE)
+            return STATUS_INVALID_VOLUME_LABEL;
+
+        if (WideCharToMultiByte(CP_UTF8, 0, Label->Buffer, Label->Length / sizeof(WCHAR), label, utf8len, NULL, NULL) == 0)
+            return STATUS_INVALID_VOLUME_LABEL;
+
+        label[utf8len] = 0;
+    }
+
     InitializeObjectAttributes(&attr, DriveRoot, OBJ_CASE_INSENSITIVE, NULL, NULL);
 
     Status = NtOpenFile(&h, FILE_GENERIC_READ | FILE_GENERIC_WRITE, &attr, &iosb,
@@ -1430,14 +3744,10 @@ static NTSTATUS NTAPI FormatEx2(PUNICODE_STRING DriveRoot, FMIFS_MEDIA_FLAG Medi
 
     compat_ro_flags = def_compat_ro_flags;
 
-    if (!Label) {
-        empty_label.Buffer = NULL;
-        empty_label.Length = empty_label.MaximumLength = 0;
-        Label = &empty_label;
-    }
+    size = gli.Length.QuadPart;
 
-    Status = write_btrfs(h, gli.Length.QuadPart, Label, sector_size, node_size, incompat_flags,
-                         compat_ro_flags);
+    Status = write_btrfs(&h, &size, 1, label[0] != 0 ? label : NULL, sector_size, node_size, incompat_flags, compat_ro_flags,
+                         PROFILE_DEFAULT, PROFILE_DEFAULT, NULL);
 
     NtFsControlFile(h, NULL, NULL, NULL, &iosb, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0);
 
@@ -1538,3 +3848,458 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, void* lpReserved) {
 
     return true;
 }
+#else
+static const struct {
+    const char* name;
+    uint64_t incompat_flag;
+    uint64_t compat_ro_flag;
+} features[] = {
+    { "mixed", BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS, 0 },
+    { "extiref", BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF, 0 },
+    { "skinnymetadata", BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA, 0 },
+    { "noholes", BTRFS_INCOMPAT_FLAGS_NO_HOLES, 0 },
+    { "freespacetree", 0, BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE },
+    { "blockgrouptree", 0, BTRFS_COMPAT_RO_FLAGS_BLOCK_GROUP_TREE },
+    { NULL, 0, 0 }
+};
+
+static bool parse_features(char* s, uint64_t* incompat_flags, uint64_t* compat_ro_flags) {
+    char* tok;
+    char* saveptr;
+
+    for (tok = strtok_r(s, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        bool disable = tok[0] == '^';
+        unsigned int i;
+
+        if (disable)
+            tok++;
+
+        for (i = 0; features[i].name; i++) {
+            if (!strcmp(tok, features[i].name))
+                break;
+        }
+
+        if (!features[i].name) {
+            fprintf(stderr, "Unknown feature %s.\n", tok);
+            return false;
+        }
+
+        if (disable) {
+            *incompat_flags &= ~features[i].incompat_flag;
+            *compat_ro_flags &= ~features[i].compat_ro_flag;
+        } else {
+            *incompat_flags |= features[i].incompat_flag;
+            *compat_ro_flags |= features[i].compat_ro_flag;
+        }
+    }
+
+    return true;
+}
+
+static bool parse_size(const char* s, uint64_t* size) {
+    char* end;
+    unsigned int shift = 0;
+
+    *size = strtoull(s, &end, 10);
+
+    if (end == s)
+        return false;
+
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        case 't': case 'T': shift = 40; end++; break;
+    }
+
+    if (*end != 0 || *size > (UINT64_MAX >> shift))
+        return false;
+
+    *size <<= shift;
+
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: mkbtrfs [-s size] [-L label] [-S sectorsize] [-n nodesize] [-c csum] [-O features] [-K]\n");
+    fprintf(stderr, "               [-d profile] [-m profile] [-r rootdir [-C compression[:level]] [-j threads]]\n");
+    fprintf(stderr, "               <device> [device...]\n\n");
+    fprintf(stderr, "The devices can be block devices or image files. If -s is given, the images are\n");
+    fprintf(stderr, "created or resized as sparse files; the size can end in K, M, G or T.\n\n");
+    fprintf(stderr, "  -L <label>       filesystem label\n");
+    fprintf(stderr, "  -S <sectorsize>  sector size, by default 4096\n");
+    fprintf(stderr, "  -n <nodesize>    node size, by default 16384\n");
+    fprintf(stderr, "  -c <csum>        checksum algorithm: crc32c (the default), xxhash, sha256 or blake2\n");
+    fprintf(stderr, "  -O <features>    comma-separated list of features to enable, or to disable if\n");
+    fprintf(stderr, "                   prefixed by ^: mixed, extiref, skinnymetadata, noholes,\n");
+    fprintf(stderr, "                   freespacetree, blockgrouptree\n");
+    fprintf(stderr, "  -K               don't discard the devices first\n");
+    fprintf(stderr, "  -d <profile>     data profile: single, dup, raid0, raid1, raid1c3, raid1c4,\n");
+    fprintf(stderr, "                   raid10, raid5 or raid6; by default single\n");
+    fprintf(stderr, "  -m <profile>     metadata profile, by default raid1 for more than one device,\n");
+    fprintf(stderr, "                   otherwise dup, or single on SSDs\n");
+    fprintf(stderr, "  -r <rootdir>     copy the contents of a directory into the new filesystem\n");
+    fprintf(stderr, "  -C <compression> compress the files copied by -r: zlib (level 1-9), lzo, or\n");
+    fprintf(stderr, "                   zstd (level 1-15), e.g. zstd:5\n");
+    fprintf(stderr, "  -j <threads>     number of threads compressing and checksumming, by default\n");
+    fprintf(stderr, "                   one per CPU\n");
+}
+
+static bool parse_profile(const char* s, uint64_t* profile, uint16_t* devs_min) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof(raid_profiles) / sizeof(raid_profiles[0]); i++) {
+        if (!strcmp(s, raid_profiles[i].name)) {
+            *profile = raid_profiles[i].flag;
+            *devs_min = raid_profiles[i].devs_min;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool open_device(const char* fn, bool have_size, uint64_t* size, int* fd, int* dev_sector_size, struct stat* st) {
+    if (stat(fn, st) == 0 && S_ISBLK(st->st_mode)) {
+        // O_EXCL on a block device fails if it's mounted
+        *fd = open(fn, O_RDWR | O_EXCL | O_CLOEXEC);
+        if (*fd == -1) {
+            fprintf(stderr, "Could not open %s: %s\n", fn, strerror(errno));
+            return false;
+        }
+
+        if (ioctl(*fd, BLKGETSIZE64, size) != 0 || ioctl(*fd, BLKSSZGET, dev_sector_size) != 0) {
+            fprintf(stderr, "Could not get size of %s: %s\n", fn, strerror(errno));
+            close(*fd);
+            return false;
+        }
+    } else {
+        *fd = open(fn, O_RDWR | O_CLOEXEC | (have_size ? O_CREAT : 0), 0644);
+        if (*fd == -1) {
+            fprintf(stderr, "Could not open %s: %s\n", fn, strerror(errno));
+            return false;
+        }
+
+        if (fstat(*fd, st) != 0) {
+            fprintf(stderr, "Could not stat %s: %s\n", fn, strerror(errno));
+            close(*fd);
+            return false;
+        }
+
+        *dev_sector_size = 0;
+
+        if (!have_size)
+            *size = st->st_size;
+        else if ((uint64_t)st->st_size != *size && ftruncate(*fd, (off_t)*size) != 0) { // leaves the new part as a hole
+            fprintf(stderr, "Could not resize %s: %s\n", fn, strerror(errno));
+            close(*fd);
+            return false;
+        }
+    }
+
+    if (*size < 0x1000000) {
+        fprintf(stderr, "%s is too small, it needs to be at least 16 MB.\n", fn);
+        close(*fd);
+        return false;
+    }
+
+    // the stat of the device itself, so that -r can skip it
+    if (fstat(*fd, st) != 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", fn, strerror(errno));
+        close(*fd);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_compression(const char* s, uint8_t* compression, unsigned int* level) {
+    const char* colon = strchr(s, ':');
+    size_t len = colon ? (size_t)(colon - s) : strlen(s);
+    unsigned int max_level;
+
+    if (len == 4 && !strncmp(s, "zlib", len)) {
+        *compression = BTRFS_COMPRESSION_ZLIB;
+        *level = 3;
+        max_level = 9;
+    } else if (len == 3 && !strncmp(s, "lzo", len)) {
+        *compression = BTRFS_COMPRESSION_LZO;
+        *level = 0;
+        max_level = 0;
+    } else if (len == 4 && !strncmp(s, "zstd", len)) {
+        *compression = BTRFS_COMPRESSION_ZSTD;
+        *level = 3;
+        max_level = 15;
+    } else
+        return false;
+
+    if (colon) {
+        char* end;
+        unsigned long l = strtoul(colon + 1, &end, 10);
+
+        if (colon[1] == 0 || *end != 0 || l < 1 || l > max_level)
+            return false;
+
+        *level = (unsigned int)l;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    NTSTATUS Status;
+    int opt, ret = 1;
+    uint64_t size = 0;
+    const char* label = NULL;
+    uint32_t sector_size = 0, node_size = 0x4000;
+    bool nodiscard = false, have_size = false, have_sector_size = false;
+    uint64_t incompat_flags = BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF | BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA |
+                              BTRFS_INCOMPAT_FLAGS_NO_HOLES;
+    uint64_t compat_ro_flags = BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE;
+    uint64_t data_profile = PROFILE_DEFAULT, metadata_profile = PROFILE_DEFAULT;
+    uint16_t data_devs_min = 1, metadata_devs_min = 1, num_devices = 0;
+    int* fds = NULL;
+    uint64_t* sizes = NULL;
+    struct stat* sts = NULL;
+    int dev_sector_size = 0;
+    const char* root_dir = NULL;
+    bool have_compression = false;
+    rootdir rd;
+    unsigned int i;
+
+    memset(&rd, 0, sizeof(rootdir));
+    rd.threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "s:L:S:n:c:O:Kd:m:r:C:j:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (!parse_size(optarg, &size)) {
+                    fprintf(stderr, "Invalid size %s.\n", optarg);
+                    return 1;
+                }
+
+                have_size = true;
+            break;
+
+            case 'L':
+                label = optarg;
+            break;
+
+            case 'S':
+                sector_size = (uint32_t)strtoul(optarg, NULL, 0);
+                have_sector_size = true;
+            break;
+
+            case 'n':
+                node_size = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+
+            case 'c':
+                if (!strcmp(optarg, "crc32c"))
+                    def_csum_type = CSUM_TYPE_CRC32C;
+                else if (!strcmp(optarg, "xxhash"))
+                    def_csum_type = CSUM_TYPE_XXHASH;
+                else if (!strcmp(optarg, "sha256"))
+                    def_csum_type = CSUM_TYPE_SHA256;
+                else if (!strcmp(optarg, "blake2"))
+                    def_csum_type = CSUM_TYPE_BLAKE2;
+                else {
+                    fprintf(stderr, "Invalid csum value. Valid values are crc32c, xxhash, sha256, and blake2.\n");
+                    return 1;
+                }
+            break;
+
+            case 'O':
+                if (!parse_features(optarg, &incompat_flags, &compat_ro_flags))
+                    return 1;
+            break;
+
+            case 'K':
+                nodiscard = true;
+            break;
+
+            case 'd':
+                if (!parse_profile(optarg, &data_profile, &data_devs_min)) {
+                    fprintf(stderr, "Invalid data profile %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'm':
+                if (!parse_profile(optarg, &metadata_profile, &metadata_devs_min)) {
+                    fprintf(stderr, "Invalid metadata profile %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            case 'r':
+                root_dir = optarg;
+            break;
+
+            case 'C':
+                if (!parse_compression(optarg, &rd.compression, &rd.level)) {
+                    fprintf(stderr, "Invalid compression %s. Valid values are zlib, lzo, and zstd, optionally followed by :level.\n", optarg);
+                    return 1;
+                }
+
+                have_compression = true;
+            break;
+
+            case 'j':
+                rd.threads = (unsigned int)strtoul(optarg, NULL, 0);
+
+                if (rd.threads == 0) {
+                    fprintf(stderr, "Invalid number of threads %s.\n", optarg);
+                    return 1;
+                }
+            break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    if (argc - optind > 0xffff) {
+        fprintf(stderr, "Too many devices.\n");
+        return 1;
+    }
+
+    num_devices = (uint16_t)(argc - optind);
+
+    if (have_compression && !root_dir) {
+        fprintf(stderr, "-C only makes sense with -r.\n");
+        return 1;
+    }
+
+    // checked again by write_superblocks, but by then we've written to the device
+    if (label && (strlen(label) > MAX_LABEL_SIZE || strchr(label, '/') || strchr(label, '\\'))) {
+        fprintf(stderr, "Invalid label. Labels can be up to 256 bytes, and can't contain slashes or backslashes.\n");
+        return 1;
+    }
+
+    if (num_devices < data_devs_min || num_devices < metadata_devs_min) {
+        fprintf(stderr, "The %s profile needs at least %u devices.\n",
+                data_devs_min > metadata_devs_min ? get_raid_profile(data_profile)->name : get_raid_profile(metadata_profile)->name,
+                data_devs_min > metadata_devs_min ? data_devs_min : metadata_devs_min);
+        return 1;
+    }
+
+    if (incompat_flags & BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS && data_profile != PROFILE_DEFAULT &&
+        metadata_profile != PROFILE_DEFAULT && data_profile != metadata_profile) {
+        fprintf(stderr, "With mixed block groups, the data and metadata profiles need to be the same.\n");
+        return 1;
+    }
+
+#ifdef HAVE_CPUID
+    check_cpu();
+#endif
+
+    fds = malloc(num_devices * sizeof(int));
+    sizes = malloc(num_devices * sizeof(uint64_t));
+    sts = malloc(num_devices * sizeof(struct stat));
+
+    for (i = 0; i < num_devices; i++) {
+        int dss;
+
+        sizes[i] = size;
+
+        if (!open_device(argv[optind + i], have_size, &sizes[i], &fds[i], &dss, &sts[i]))
+            goto end;
+
+        if (dss > dev_sector_size)
+            dev_sector_size = dss;
+    }
+
+    if (!have_sector_size) {
+        sector_size = dev_sector_size;
+
+        if (sector_size == 0x200 || sector_size == 0)
+            sector_size = 0x1000;
+    } else if (dev_sector_size != 0 && (sector_size < (uint32_t)dev_sector_size || sector_size % dev_sector_size != 0 ||
+               !is_power_of_two(sector_size / dev_sector_size))) {
+        fprintf(stderr, "Sector size %u is not valid for %s.\n", sector_size, num_devices == 1 ? argv[optind] : "these devices");
+        goto end;
+    } else if (!is_power_of_two(sector_size)) {
+        fprintf(stderr, "Sector size %u is not a power of two.\n", sector_size);
+        goto end;
+    }
+
+    if (node_size < sector_size || node_size % sector_size != 0 || !is_power_of_two(node_size / sector_size)) {
+        fprintf(stderr, "Node size %u is not valid.\n", node_size);
+        goto end;
+    }
+
+    // From Linux btrfs/disk-io.c: "Artificial requirement for block-group-tree to force
+    // newer features (free-space-tree, no-holes) so the test matrix is smaller."
+    if (compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_BLOCK_GROUP_TREE) {
+        compat_ro_flags |= BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE;
+        incompat_flags |= BTRFS_INCOMPAT_FLAGS_NO_HOLES;
+    }
+
+    if (compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE)
+        compat_ro_flags |= BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE_VALID;
+
+    if (rd.compression == BTRFS_COMPRESSION_LZO) {
+        // Linux can only read LZO extents split into pages of its own size
+        if (sector_size != 0x1000) {
+            fprintf(stderr, "LZO compression needs a sector size of 4096.\n");
+            goto end;
+        }
+
+        incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+    } else if (rd.compression == BTRFS_COMPRESSION_ZSTD)
+        incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+
+    if (root_dir) {
+        rd.images = sts;
+        rd.num_images = num_devices;
+
+        if (!rootdir_scan(&rd, root_dir))
+            goto end;
+    }
+
+    incompat_flags |= BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF | BTRFS_INCOMPAT_FLAGS_BIG_METADATA;
+
+    if (!nodiscard) {
+        for (i = 0; i < num_devices; i++) {
+            do_full_trim(fds[i]);
+        }
+    }
+
+    Status = write_btrfs(fds, sizes, num_devices, label, sector_size, node_size, incompat_flags, compat_ro_flags, data_profile,
+                         metadata_profile, root_dir ? &rd : NULL);
+
+    for (i = 0; i < num_devices; i++) {
+        if (NT_SUCCESS(Status) && fsync(fds[i]) != 0) {
+            fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+            Status = STATUS_UNEXPECTED_IO_ERROR;
+        }
+    }
+
+    if (!NT_SUCCESS(Status))
+        fprintf(stderr, "Formatting failed (error %08x).\n", (uint32_t)Status);
+    else
+        ret = 0;
+
+end:
+    if (root_dir)
+        rootdir_free(&rd);
+
+    while (i > 0) {
+        i--;
+        close(fds[i]);
+    }
+
+    free(fds);
+    free(sizes);
+    free(sts);
+
+    return ret;
+}
+#endif
@@ -4095,12 +4095,93 @@ nextitem:
     return STATUS_SUCCESS;
 }
 
+static bool extent_inserted_by(LIST_ENTRY* rollback, extent* ext) {
+    LIST_ENTRY* le = rollback->Flink;
+
+    while (le != rollback) {
+        rollback_item* ri = CONTAINING_RECORD(le, rollback_item, list_entry);
+
+        if (ri->type == ROLLBACK_INSERT_EXTENT && ((rollback_extent*)ri->ptr)->ext == ext)
+            return true;
+
+        le = le->Flink;
+    }
+
+    return false;
+}
+
+// Writes to a file which is all one uncompressed inline extent, and which is
+// going to stay that way. Rather than reading the file back through read_file
+// into a sector-aligned buffer, we build the new item straight from the old
+// one. If the old item was added by this same write - which is what happens on
+// an append, as extend_file will just have grown it - nothing else can have
+// seen it, and a rollback would throw it away, so we can write into it in place.
+__attribute__((nonnull(1,2,4,7)))
+static NTSTATUS write_inline(fcb* fcb, extent* ext, uint64_t offset, const void* buf, ULONG length, uint64_t newlength, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    EXTENT_DATA* ed;
+    uint16_t edsize;
+    uint64_t oldlength = ext->extent_data.decoded_size;
+
+    if (oldlength == newlength && extent_inserted_by(rollback, ext)) {
+        RtlCopyMemory(&ext->extent_data.data[offset], buf, length);
+        ext->extent_data.generation = fcb->Vcb->superblock.generation;
+
+        fcb->extents_changed = true;
+        mark_fcb_dirty(fcb);
+
+        return STATUS_SUCCESS;
+    }
+
+    edsize = (uint16_t)(offsetof(EXTENT_DATA, data[0]) + newlength);
+
+    ed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
+    if (!ed) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ed->generation = fcb->Vcb->superblock.generation;
+    ed->decoded_size = newlength;
+    ed->compression = BTRFS_COMPRESSION_NONE;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_INLINE;
+
+    RtlCopyMemory(ed->data, ext->extent_data.data, (size_t)oldlength);
+
+    if (offset > oldlength)
+        RtlZeroMemory(&ed->data[oldlength], (ULONG)(offset - oldlength));
+
+    RtlCopyMemory(&ed->data[offset], buf, length);
+
+    remove_fcb_extent(fcb, ext, rollback);
+
+    Status = add_extent_to_fcb(fcb, 0, ed, edsize, false, NULL, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_extent_to_fcb returned %08lx\n", Status);
+        ExFreePool(ed);
+        return Status;
+    }
+
+    ExFreePool(ed);
+
+    fcb->inode_item.st_blocks += newlength - oldlength;
+    fcb->inode_item_changed = true;
+
+    fcb->extents_changed = true;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
 __attribute__((nonnull(1,2,4,5,11)))
 NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void* buf, ULONG* length, bool paging_io, bool no_cache,
                      bool wait, bool deferred_write, bool write_irp, LIST_ENTRY* rollback) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     EXTENT_DATA* ed2;
+    extent* inline_ext;
     uint64_t off64, newlength, start_data, end_data;
     uint32_t bufhead;
     bool make_inline;
@@ -4359,8 +4440,16 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
 
         if (fileref)
             mark_fileref_dirty(fileref);
+    } else if (make_inline && (inline_ext = get_inline_extent(fcb)) && inline_ext->extent_data.decoded_size <= newlength) {
+        Status = write_inline(fcb, inline_ext, off64, buf, *length, newlength, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_inline returned %08lx\n", Status);
+            goto end;
+        }
+
+        fcb->Header.ValidDataLength.QuadPart = newlength;
     } else {
-        bool compress = write_fcb_compressed(fcb), no_buf = false;
+        bool compress = !make_inline && write_fcb_compressed(fcb) && !compression_skip(fcb, *length), no_buf = false;
         uint8_t* data;
 
         if (make_inline) {
@@ -4368,8 +4457,8 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             end_data = sector_align(newlength, fcb->Vcb->superblock.sector_size);
             bufhead = sizeof(EXTENT_DATA) - 1;
         } else if (compress) {
-            start_data = off64 & ~(uint64_t)(COMPRESSED_EXTENT_SIZE - 1);
-            end_data = min(sector_align(off64 + *length, COMPRESSED_EXTENT_SIZE),
+            start_data = off64 & ~(uint64_t)(fcb->Vcb->options.compress_part_size - 1);
+            end_data = min(sector_align(off64 + *length, fcb->Vcb->options.compress_part_size),
                            sector_align(newlength, fcb->Vcb->superblock.sector_size));
             bufhead = 0;
         } else {